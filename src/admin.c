@@ -26,63 +26,49 @@
 #include "admin.h"
 #include "block.h"
 #include "clients.h"
+#include "mapdata.h"
 #include "ship.h"
 #include "ship_packets.h"
 #include "utils.h"
+#include "legit.h"
+#include "ptdata.h"
+#include "rtdata.h"
+#include "handoff.h"
 
 int kill_guildcard(ship_client_t *c, uint32_t gc, const char *reason) {
     block_t *b;
     ship_client_t *i;
-    int j;
 
     /* Make sure we don't have anyone trying to escalate their privileges. */
     if(!LOCAL_GM(c)) {
         return -1;
     }
 
-    /* Look through all the blocks for the requested user, and kick the first
-       instance we happen to find (there shouldn't be more than one). */
-    for(j = 0; j < ship->cfg->blocks; ++j) {
-        b = ship->blocks[j];
-
-        if(b && b->run) {
-            pthread_rwlock_rdlock(&b->lock);
-
-            /* Look for the requested user */
-            TAILQ_FOREACH(i, b->clients, qentry) {
-                pthread_mutex_lock(&i->mutex);
-
-                /* Disconnect them if we find them */
-                if(i->guildcard == gc) {
-                    if(c->privilege <= i->privilege) {
-                        pthread_mutex_unlock(&i->mutex);
-                        pthread_rwlock_unlock(&b->lock);
-                        return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
-                    }
-
-                    if(reason) {
-                        send_message_box(i, "%s\n\n%s\n%s",
-                                         __(i, "\tEYou have been kicked by a "
-                                            "GM."),
-                                         __(i, "Reason:"), reason);
-                    }
-                    else {
-                        send_message_box(i, "%s",
-                                         __(i, "\tEYou have been kicked by a "
-                                            "GM."));
-                    }
-
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
-                    pthread_mutex_unlock(&i->mutex);
-                    pthread_rwlock_unlock(&b->lock);
-                    return 0;
-                }
-
-                pthread_mutex_unlock(&i->mutex);
-            }
+    /* Look for the requested user, and kick them if they're here (there
+       shouldn't be more than one instance of them). */
+    if((i = ship_find_client(ship, gc, &b))) {
+        pthread_mutex_lock(&i->mutex);
 
+        if(c->privilege <= i->privilege) {
+            pthread_mutex_unlock(&i->mutex);
             pthread_rwlock_unlock(&b->lock);
+            return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
         }
+
+        if(reason) {
+            send_message_box(i, "%s\n\n%s\n%s",
+                             __(i, "\tEYou have been kicked by a GM."),
+                             __(i, "Reason:"), reason);
+        }
+        else {
+            send_message_box(i, "%s",
+                             __(i, "\tEYou have been kicked by a GM."));
+        }
+
+        client_disconnect(i);
+        pthread_mutex_unlock(&i->mutex);
+        pthread_rwlock_unlock(&b->lock);
+        return 0;
     }
 
     /* If the requester is a global GM, forward the request to the shipgate,
@@ -97,10 +83,14 @@ int kill_guildcard(ship_client_t *c, uint32_t gc, const char *reason) {
 int load_quests(ship_t *s, sylverant_ship_t *cfg, int initial) {
     sylverant_quest_list_t qlist[CLIENT_VERSION_COUNT][CLIENT_LANG_COUNT];
     quest_map_t qmap;
+    quest_file_cache_t *qfiles, *oldfiles;
+    qmap_cache_t *qcs[CLIENT_VERSION_COUNT] = { 0 };
+    qmap_cache_t *oldqcs[CLIENT_VERSION_COUNT] = { 0 };
     int i, j;
     char fn[512];
 
-    TAILQ_INIT(&qmap);
+    quest_map_init(&qmap);
+    memset(qlist, 0, sizeof(qlist));
 
     /* Read the quest files in... */
     if(cfg->quests_dir && cfg->quests_dir[0]) {
@@ -117,11 +107,25 @@ int load_quests(ship_t *s, sylverant_ship_t *cfg, int initial) {
                         debug(DBG_LOG, "Unable to map quests for %s-%s\n",
                               version_codes[i], language_codes[j]);
                         sylverant_quests_destroy(&qlist[i][j]);
+                        memset(&qlist[i][j], 0, sizeof(qlist[i][j]));
                     }
                 }
             }
         }
 
+        /* Work out what's going to be in each of the quest menus. */
+        if(quest_build_menus(&qmap, qlist))
+            debug(DBG_WARN, "Unable to build quest menus!\n");
+
+        /* Read all the quest files in now, so that nobody has to hit the disk
+           when they load a quest. */
+        qfiles = quest_cache_files(&qmap, cfg->quests_dir);
+
+        /* Build the map caches now too, so that the only thing left to do with
+           the lock held is to swap everything in. */
+        if(quest_cache_maps(&qmap, qlist, cfg->quests_dir, qcs))
+            debug(DBG_WARN, "Unable to build quest map cache!\n");
+
         /* Lock the mutex to prevent anyone from trying anything funny. */
         pthread_rwlock_wrlock(&s->qlock);
 
@@ -146,14 +150,30 @@ int load_quests(ship_t *s, sylverant_ship_t *cfg, int initial) {
             quest_cleanup(&s->qmap);
 
         s->qmap = qmap;
+        oldfiles = s->qfiles;
+        s->qfiles = qfiles;
 
-        /* XXXX: Hopefully this doesn't fail... >_> */
-        if(quest_cache_maps(s, &s->qmap, cfg->quests_dir))
-            debug(DBG_WARN, "Unable to build quest map cache!\n");
+        /* Swap in any map caches that got built, keeping the old ones for any
+           versions that didn't. */
+        for(i = 0; i < CLIENT_VERSION_COUNT; ++i) {
+            if(qcs[i]) {
+                oldqcs[i] = s->qmap_cache[i];
+                s->qmap_cache[i] = qcs[i];
+            }
+        }
 
         /* Unlock the lock, we're done. */
         pthread_rwlock_unlock(&s->qlock);
 
+        /* Anyone still sending one of the old files (or using one of the old
+           map caches) holds their own reference to them. */
+        quest_files_unref(oldfiles);
+
+        for(i = 0; i < CLIENT_VERSION_COUNT; ++i) {
+            if(oldqcs[i])
+                qmap_cache_unref(oldqcs[i]);
+        }
+
         return 0;
     }
 
@@ -172,6 +192,15 @@ void clean_quests(ship_t *s) {
     }
 
     quest_cleanup(&s->qmap);
+    quest_files_unref(s->qfiles);
+    s->qfiles = NULL;
+
+    for(i = 0; i < CLIENT_VERSION_COUNT; ++i) {
+        if(s->qmap_cache[i]) {
+            qmap_cache_unref(s->qmap_cache[i]);
+            s->qmap_cache[i] = NULL;
+        }
+    }
 }
 
 int refresh_quests(ship_client_t *c, msgfunc f) {
@@ -205,6 +234,28 @@ int refresh_gms(ship_client_t *c, msgfunc f) {
     }
 }
 
+int refresh_drops(ship_client_t *c, msgfunc f) {
+    sylverant_ship_t *s = ship->cfg;
+
+    /* Make sure we don't have anyone trying to escalate their privileges. */
+    if(!LOCAL_GM(c))
+        return -1;
+
+    /* Each of these reads everything in on the side and only swaps it in if it
+       all worked. Games already running keep the tables they started with. */
+    if(pt_refresh(s->v2_ptdata_file, s->gc_ptdata_file, s->bb_ptdata_file)) {
+        debug(DBG_WARN, "%s: Couldn't refresh ItemPT data\n", s->name);
+        return f(c, "%s", __(c, "\tE\tC7Error reading ItemPT data."));
+    }
+
+    if(rt_refresh(s->v2_rtdata_file, s->gc_rtdata_file)) {
+        debug(DBG_WARN, "%s: Couldn't refresh ItemRT data\n", s->name);
+        return f(c, "%s", __(c, "\tE\tC7Error reading ItemRT data."));
+    }
+
+    return f(c, "%s", __(c, "\tE\tC7Updated drop tables."));
+}
+
 int refresh_limits(ship_client_t *c, msgfunc f) {
     sylverant_limits_t *l, *def = NULL;
     int i;
@@ -268,6 +319,11 @@ int refresh_limits(ship_client_t *c, msgfunc f) {
     /* If we get here, then everything has at least been read in successfully,
        go ahead and replace the data in the ship's structure. */
     pthread_rwlock_wrlock(&ship->llock);
+
+    /* Anything cached about the old lists has to go before they're freed, or a
+       new list allocated at the same address could pick up a stale result. */
+    legit_invalidate();
+
     ship_free_limits_ex(&ship->all_limits);
     ship->all_limits = lq;
     ship->def_limits = def;
@@ -388,6 +444,7 @@ int schedule_shutdown(ship_client_t *c, uint32_t when, int restart, msgfunc f) {
     }
 
     restart_on_shutdown = restart;
+    handoff_keep(restart);
     ship_server_shutdown(ship, time(NULL) + (when * 60));
 
     return 0;
@@ -397,7 +454,6 @@ int global_ban(ship_client_t *c, uint32_t gc, uint32_t l, const char *reason) {
     const char *len = NULL;
     block_t *b;
     ship_client_t *i;
-    int j;
 
     /* Make sure we don't have anyone trying to escalate their privileges. */
     if(!GLOBAL_GM(c)) {
@@ -410,86 +466,71 @@ int global_ban(ship_client_t *c, uint32_t gc, uint32_t l, const char *reason) {
         return send_txt(c, "%s", __(c, "\tE\tC7Error setting ban."));
     }
 
-    /* Look through all the blocks for the requested user, and kick the first
-       instance we happen to find, if any (there shouldn't be more than one). */
-    for(j = 0; j < ship->cfg->blocks; ++j) {
-        b = ship->blocks[j];
-
-        if(b && b->run) {
-            pthread_rwlock_rdlock(&b->lock);
+    /* Look for the requested user, and kick them if they're here (there
+       shouldn't be more than one instance of them). */
+    if((i = ship_find_client(ship, gc, &b))) {
+        pthread_mutex_lock(&i->mutex);
 
-            TAILQ_FOREACH(i, b->clients, qentry) {
-                /* Disconnect them if we find them */
-                if(i->guildcard == gc) {
-                    pthread_mutex_lock(&i->mutex);
-
-                    /* Make sure we're not trying something dirty (the gate
-                       should also have blocked the ban if this happens, in
-                       most cases anyway) */
-                    if(c->privilege <= i->privilege) {
-                        pthread_mutex_unlock(&i->mutex);
-                        pthread_rwlock_unlock(&b->lock);
-                        return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
-                    }
-
-                    /* Handle the common cases... */
-                    switch(l) {
-                        case 0xFFFFFFFF:
-                            len = __(i, "Forever");
-                            break;
-
-                        case 2592000:
-                            len = __(i, "30 days");
-                            break;
+        /* Make sure we're not trying something dirty (the gate
+           should also have blocked the ban if this happens, in
+           most cases anyway) */
+        if(c->privilege <= i->privilege) {
+            pthread_mutex_unlock(&i->mutex);
+            pthread_rwlock_unlock(&b->lock);
+            return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
+        }
 
-                        case 604800:
-                            len = __(i, "1 week");
-                            break;
+        /* Handle the common cases... */
+        switch(l) {
+            case 0xFFFFFFFF:
+                len = __(i, "Forever");
+                break;
 
-                        case 86400:
-                            len = __(i, "1 day");
-                            break;
+            case 2592000:
+                len = __(i, "30 days");
+                break;
 
-                        /* Other cases just don't have a length on them... */
-                    }
+            case 604800:
+                len = __(i, "1 week");
+                break;
 
-                    /* Send the user a message telling them they're banned. */
-                    if(reason && len) {
-                        send_message_box(i, "%s\n%s %s\n%s\n%s",
-                                         __(i, "\tEYou have been banned by a "
-                                            "GM."), __(i, "Ban Length:"),
-                                         len, __(i, "Reason:"), reason);
-                    }
-                    else if(len) {
-                        send_message_box(i, "%s\n%s %s",
-                                         __(i, "\tEYou have been banned by a "
-                                            "GM."), __(i, "Ban Length:"),
-                                         len);
-                    }
-                    else if(reason) {
-                        send_message_box(i, "%s\n%s\n%s",
-                                         __(i, "\tEYou have been banned by a "
-                                            "GM."), __(i, "Reason:"), reason);
-                    }
-                    else {
-                        send_message_box(i, "%s", __(i, "\tEYou have been "
-                                                     "banned by a GM."));
-                    }
+            case 86400:
+                len = __(i, "1 day");
+                break;
 
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
+            /* Other cases just don't have a length on them... */
+        }
 
-                    /* The ban setter will get a message telling them the ban has been
-                       set (or an error happened). */
-                    pthread_mutex_unlock(&i->mutex);
-                    pthread_rwlock_unlock(&b->lock);
-                    return 0;
-                }
+        /* Send the user a message telling them they're banned. */
+        if(reason && len) {
+            send_message_box(i, "%s\n%s %s\n%s\n%s",
+                             __(i, "\tEYou have been banned by a "
+                                "GM."), __(i, "Ban Length:"),
+                             len, __(i, "Reason:"), reason);
+        }
+        else if(len) {
+            send_message_box(i, "%s\n%s %s",
+                             __(i, "\tEYou have been banned by a "
+                                "GM."), __(i, "Ban Length:"),
+                             len);
+        }
+        else if(reason) {
+            send_message_box(i, "%s\n%s\n%s",
+                             __(i, "\tEYou have been banned by a "
+                                "GM."), __(i, "Reason:"), reason);
+        }
+        else {
+            send_message_box(i, "%s", __(i, "\tEYou have been "
+                                         "banned by a GM."));
+        }
 
-                pthread_mutex_unlock(&i->mutex);
-            }
+        client_disconnect(i);
 
-            pthread_rwlock_unlock(&b->lock);
-        }
+        /* The ban setter will get a message telling them the ban has been
+           set (or an error happened). */
+        pthread_mutex_unlock(&i->mutex);
+        pthread_rwlock_unlock(&b->lock);
+        return 0;
     }
 
     /* Since the requester is a global GM, forward the kick request to the
@@ -52,6 +52,7 @@ void clean_quests(ship_t *s);
 int refresh_quests(ship_client_t *c, msgfunc f);
 int refresh_gms(ship_client_t *c, msgfunc f);
 int refresh_limits(ship_client_t *c, msgfunc f);
+int refresh_drops(ship_client_t *c, msgfunc f);
 
 int broadcast_message(ship_client_t *c, const char *message, int prefix);
 
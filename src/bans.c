@@ -15,8 +15,10 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <errno.h>
@@ -51,6 +53,368 @@ static inline int eq_ip6(const struct sockaddr_in6 *ip1, const uint32_t ip2[4],
     return 0;
 }
 
+/* The bans that are checked when people connect are kept in an index that is
+   rebuilt from the lists whenever they change. Once built, an index is never
+   modified, so anyone holding a reference to one can use it without taking
+   the ban lock. IP bans go into a path-compressed binary trie (one for IPv4
+   and one for IPv6) keyed on the masked address, so a lookup only has to look
+   at the bans along one path. Guildcard bans go into a hash table. */
+typedef struct ban_entry {
+    time_t end_time;
+    uint32_t guildcard;
+    int next;
+    const char *reason;
+} ban_entry_t;
+
+typedef struct ban_odd {
+    int ipv6;
+    int ent;
+    uint32_t ip_addr[4];
+    uint32_t netmask[4];
+} ban_odd_t;
+
+typedef struct ban_node {
+    uint8_t key[16];
+    int bits;
+    int child[2];
+    int bans;
+} ban_node_t;
+
+struct ban_index {
+    int refcnt;
+
+    ban_entry_t *entries;
+    int entry_count;
+
+    ban_node_t *nodes;
+    int node_count;
+    int node_alloc;
+    int root4;
+    int root6;
+
+    /* Bans with netmasks that aren't a simple prefix can't go in the trie, so
+       they get checked one by one. There really shouldn't be any of these. */
+    ban_odd_t *odd;
+    int odd_count;
+
+    int *gc_hash;
+    uint32_t gc_mask;
+
+    char *reasons;
+};
+
+static inline int key_bit(const uint8_t *key, int bit) {
+    return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+static int mask_to_prefix(const uint8_t *mask, int len) {
+    int i, bits = 0;
+
+    for(i = 0; i < len * 8 && key_bit(mask, i); ++i)
+        ++bits;
+
+    /* Anything after the prefix has to be zero. */
+    for(; i < len * 8; ++i) {
+        if(key_bit(mask, i))
+            return -1;
+    }
+
+    return bits;
+}
+
+/* How many of the first max bits of the two keys are the same? */
+static int common_bits(const uint8_t *a, const uint8_t *b, int max) {
+    int i = 0;
+
+    while(i < max && !((a[i >> 3] ^ b[i >> 3]) & (0x80 >> (i & 7))))
+        ++i;
+
+    return i;
+}
+
+static int new_node(struct ban_index *idx, const uint8_t *key, int bits) {
+    ban_node_t *tmp;
+    ban_node_t *n;
+    int i;
+
+    if(idx->node_count == idx->node_alloc) {
+        i = idx->node_alloc ? idx->node_alloc * 2 : 64;
+        tmp = (ban_node_t *)realloc(idx->nodes, sizeof(ban_node_t) * i);
+
+        if(!tmp)
+            return -1;
+
+        idx->nodes = tmp;
+        idx->node_alloc = i;
+    }
+
+    n = &idx->nodes[idx->node_count];
+    memset(n->key, 0, 16);
+
+    /* Only keep the bits that matter to this node. */
+    for(i = 0; i < bits; ++i) {
+        if(key_bit(key, i))
+            n->key[i >> 3] |= 0x80 >> (i & 7);
+    }
+
+    n->bits = bits;
+    n->child[0] = n->child[1] = -1;
+    n->bans = -1;
+
+    return idx->node_count++;
+}
+
+static int trie_insert(struct ban_index *idx, int root, const uint8_t *key,
+                       int bits, int ent) {
+    int n = root, c, mid, b, cl;
+
+    for(;;) {
+        if(idx->nodes[n].bits == bits)
+            break;
+
+        b = key_bit(key, idx->nodes[n].bits);
+        c = idx->nodes[n].child[b];
+
+        /* Nothing down this way yet, so just hang a new node off of it. */
+        if(c == -1) {
+            if((c = new_node(idx, key, bits)) < 0)
+                return -1;
+
+            idx->nodes[n].child[b] = c;
+            n = c;
+            break;
+        }
+
+        cl = common_bits(key, idx->nodes[c].key,
+                         bits < idx->nodes[c].bits ? bits :
+                         idx->nodes[c].bits);
+
+        if(cl == idx->nodes[c].bits) {
+            n = c;
+            continue;
+        }
+
+        /* The new prefix splits off partway through the child, so put a node
+           in between for the part they have in common. */
+        if((mid = new_node(idx, key, cl)) < 0)
+            return -1;
+
+        idx->nodes[mid].child[key_bit(idx->nodes[c].key, cl)] = c;
+        idx->nodes[n].child[b] = mid;
+        n = mid;
+
+        if(cl != bits) {
+            if((c = new_node(idx, key, bits)) < 0)
+                return -1;
+
+            idx->nodes[mid].child[key_bit(key, cl)] = c;
+            n = c;
+        }
+
+        break;
+    }
+
+    idx->entries[ent].next = idx->nodes[n].bans;
+    idx->nodes[n].bans = ent;
+    return 0;
+}
+
+/* Find the most specific ban that matches, if any are still going. */
+static const ban_entry_t *trie_lookup(const struct ban_index *idx, int root,
+                                      const uint8_t *key, int max,
+                                      time_t now) {
+    const ban_entry_t *rv = NULL;
+    const ban_node_t *n;
+    int i = root, e;
+
+    while(i != -1) {
+        n = &idx->nodes[i];
+
+        if(common_bits(key, n->key, n->bits) != n->bits)
+            break;
+
+        for(e = n->bans; e != -1; e = idx->entries[e].next) {
+            if(idx->entries[e].end_time >= now ||
+               idx->entries[e].end_time == (time_t)-1) {
+                rv = &idx->entries[e];
+                break;
+            }
+        }
+
+        if(n->bits >= max)
+            break;
+
+        i = n->child[key_bit(key, n->bits)];
+    }
+
+    return rv;
+}
+
+static void index_free(struct ban_index *idx) {
+    free(idx->entries);
+    free(idx->nodes);
+    free(idx->odd);
+    free(idx->gc_hash);
+    free(idx->reasons);
+    free(idx);
+}
+
+static void index_unref(ship_t *s, struct ban_index *idx) {
+    int rc;
+
+    if(!idx)
+        return;
+
+    pthread_mutex_lock(&s->ban_idx_lock);
+    rc = --idx->refcnt;
+    pthread_mutex_unlock(&s->ban_idx_lock);
+
+    if(!rc)
+        index_free(idx);
+}
+
+static struct ban_index *index_get(ship_t *s) {
+    struct ban_index *rv;
+
+    pthread_mutex_lock(&s->ban_idx_lock);
+
+    if((rv = s->ban_idx))
+        ++rv->refcnt;
+
+    pthread_mutex_unlock(&s->ban_idx_lock);
+
+    return rv;
+}
+
+static void index_swap(ship_t *s, struct ban_index *idx) {
+    struct ban_index *old;
+
+    pthread_mutex_lock(&s->ban_idx_lock);
+    old = s->ban_idx;
+    s->ban_idx = idx;
+    pthread_mutex_unlock(&s->ban_idx_lock);
+
+    index_unref(s, old);
+}
+
+/* Build a new index from the ban lists. This must be called with the ban lock
+   held. */
+static struct ban_index *index_build(ship_t *s) {
+    struct ban_index *idx;
+    guildcard_ban_t *i;
+    ip_ban_t *j;
+    int gc_count = 0, ip_count = 0, e = 0, bits;
+    size_t rlen = 0, roff = 0, l;
+    uint32_t h, sz = 16;
+    uint8_t zero[16] = { 0 };
+    ban_entry_t *ent;
+    ban_odd_t *odd;
+
+    TAILQ_FOREACH(i, &s->guildcard_bans, qentry) {
+        ++gc_count;
+        rlen += strlen(i->reason) + 1;
+    }
+
+    TAILQ_FOREACH(j, &s->ip_bans, qentry) {
+        ++ip_count;
+        rlen += strlen(j->reason) + 1;
+    }
+
+    if(!(idx = (struct ban_index *)malloc(sizeof(struct ban_index))))
+        return NULL;
+
+    memset(idx, 0, sizeof(struct ban_index));
+    idx->refcnt = 1;
+
+    while(sz < (uint32_t)gc_count * 2)
+        sz <<= 1;
+
+    idx->gc_mask = sz - 1;
+    idx->entries = (ban_entry_t *)malloc(sizeof(ban_entry_t) *
+                                         (gc_count + ip_count + 1));
+    idx->gc_hash = (int *)malloc(sizeof(int) * sz);
+    idx->reasons = (char *)malloc(rlen + 1);
+    idx->odd = (ban_odd_t *)malloc(sizeof(ban_odd_t) * (ip_count + 1));
+
+    if(!idx->entries || !idx->gc_hash || !idx->reasons || !idx->odd)
+        goto err;
+
+    memset(idx->gc_hash, 0xFF, sizeof(int) * sz);
+
+    if((idx->root4 = new_node(idx, zero, 0)) < 0 ||
+       (idx->root6 = new_node(idx, zero, 0)) < 0)
+        goto err;
+
+    /* Go through the guildcard bans backwards, so that the first one in the
+       list ends up first in its bucket, like it would have been found by
+       walking the list. */
+    TAILQ_FOREACH_REVERSE(i, &s->guildcard_bans, gcban_queue, qentry) {
+        ent = &idx->entries[e];
+        l = strlen(i->reason) + 1;
+        memcpy(idx->reasons + roff, i->reason, l);
+        ent->reason = idx->reasons + roff;
+        roff += l;
+
+        ent->end_time = i->end_time;
+        ent->guildcard = i->banned_gc;
+
+        h = (i->banned_gc * 2654435761U) & idx->gc_mask;
+        ent->next = idx->gc_hash[h];
+        idx->gc_hash[h] = e++;
+    }
+
+    TAILQ_FOREACH_REVERSE(j, &s->ip_bans, ipban_queue, qentry) {
+        ent = &idx->entries[e];
+        l = strlen(j->reason) + 1;
+        memcpy(idx->reasons + roff, j->reason, l);
+        ent->reason = idx->reasons + roff;
+        roff += l;
+
+        ent->end_time = j->end_time;
+        ent->guildcard = 0;
+        ent->next = -1;
+
+        bits = mask_to_prefix((const uint8_t *)j->netmask, j->ipv6 ? 16 : 4);
+
+        if(bits < 0) {
+            odd = &idx->odd[idx->odd_count++];
+            odd->ipv6 = j->ipv6;
+            odd->ent = e++;
+            memcpy(odd->ip_addr, j->ip_addr, 16);
+            memcpy(odd->netmask, j->netmask, 16);
+            continue;
+        }
+
+        if(trie_insert(idx, j->ipv6 ? idx->root6 : idx->root4,
+                       (const uint8_t *)j->ip_addr, bits, e++))
+            goto err;
+    }
+
+    idx->entry_count = e;
+    return idx;
+
+err:
+    debug(DBG_WARN, "Cannot allocate memory for ban index\n");
+    index_free(idx);
+    return NULL;
+}
+
+/* Rebuild the index after the lists have changed. This must be called with the
+   ban lock held for writing. If the new index can't be built, the old one is
+   left alone. */
+static void index_rebuild(ship_t *s) {
+    struct ban_index *idx;
+
+    if((idx = index_build(s)))
+        index_swap(s, idx);
+}
+
+static void update_index(ship_t *s) {
+    pthread_rwlock_wrlock(&s->banlock);
+    index_rebuild(s);
+    pthread_rwlock_unlock(&s->banlock);
+}
+
 static int write_bans_list(ship_t *s) {
     xmlDoc *doc;
     xmlNode *root;
@@ -64,6 +428,7 @@ static int write_bans_list(ship_t *s) {
     struct sockaddr_storage addr;
     struct sockaddr_in6 *ip6 = (struct sockaddr_in6 *)&addr;
     struct sockaddr_in *ip4 = (struct sockaddr_in *)&addr;
+    char fn[512];
 
     /* Make sure the file exists and can be read, otherwise quietly bail out */
     if(!s->cfg->bans_file[0]) {
@@ -107,7 +472,7 @@ static int write_bans_list(ship_t *s) {
         node = xmlNewChild(root, NULL, XC"ban", NULL);
         if(!node) {
             rv = -5;
-            goto err_doc;
+            goto err_lock;
         }
 
         sprintf(tmp_str, "%lu", (unsigned long)i->set_by);
@@ -135,7 +500,7 @@ static int write_bans_list(ship_t *s) {
         node = xmlNewChild(root, NULL, XC"ipban", NULL);
         if(!node) {
             rv = -5;
-            goto err_doc;
+            goto err_lock;
         }
 
         sprintf(tmp_str, "%lu", (unsigned long)j->set_by);
@@ -156,7 +521,7 @@ static int write_bans_list(ship_t *s) {
         }
 
         my_ntop(&addr, tmp_str);
-        xmlNewProp(node, XC"netmask", XC tmp_str);
+        xmlNewProp(node, XC"ip", XC tmp_str);
 
         if(j->ipv6) {
             ip6->sin6_family = AF_INET6;
@@ -169,7 +534,7 @@ static int write_bans_list(ship_t *s) {
         }
 
         my_ntop(&addr, tmp_str);
-        xmlNewProp(node, XC"ip", XC tmp_str);
+        xmlNewProp(node, XC"netmask", XC tmp_str);
 
         sprintf(tmp_str, "%lld", (long long)j->start_time);
         xmlNewProp(node, XC"start", XC tmp_str);
@@ -182,11 +547,24 @@ static int write_bans_list(ship_t *s) {
 
     pthread_rwlock_unlock(&s->banlock);
 
-    /* Save the file out */
-    xmlSaveFormatFileEnc(s->cfg->bans_file, doc, "UTF-8", 1);
+    /* Save the file out. Write it off to the side first, so that a crash
+       partway through doesn't take the old list with it. */
+    snprintf(fn, sizeof(fn), "%s.tmp", s->cfg->bans_file);
+
+    if(xmlSaveFormatFileEnc(fn, doc, "UTF-8", 1) < 0 ||
+       rename(fn, s->cfg->bans_file)) {
+        debug(DBG_WARN, "Couldn't write bans list %s\n", s->cfg->bans_file);
+        unlink(fn);
+        rv = -6;
+    }
 
+    xmlFreeDoc(doc);
+    return rv;
+
+err_lock:
+    pthread_rwlock_unlock(&s->banlock);
 err_doc:
-    free(doc);
+    xmlFreeDoc(doc);
 
     return rv;
 }
@@ -299,17 +677,78 @@ static int ban_ip_int(ship_t *s, time_t end_time, time_t start_time,
     return 0;
 }
 
+/* Journal records are written out by the journal thread, so nobody has to wait
+   on the disk to ban someone. */
+static void journal_add(ship_t *s, const char *fmt, ...) {
+    ban_journal_t *j = &s->ban_journal;
+    ban_record_t *rec;
+    va_list args;
+    char buf[512];
+    int len;
+    char *p;
+
+    va_start(args, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    if(len < 0)
+        return;
+
+    if(len >= (int)sizeof(buf))
+        len = sizeof(buf) - 1;
+
+    /* Each record is one line, so don't let anything split it. */
+    for(p = buf; *p; ++p) {
+        if(*p == '\n' || *p == '\r')
+            *p = ' ';
+    }
+
+    pthread_mutex_lock(&j->mutex);
+
+    if(!j->running) {
+        pthread_mutex_unlock(&j->mutex);
+        return;
+    }
+
+    if(!(rec = (ban_record_t *)malloc(sizeof(ban_record_t) + len + 2))) {
+        /* If we can't journal it, a full rewrite will still save it. */
+        debug(DBG_WARN, "Can't allocate space for ban journal record\n");
+        j->compact = 1;
+    }
+    else {
+        memcpy(rec->line, buf, len);
+        rec->line[len] = '\n';
+        rec->line[len + 1] = '\0';
+        TAILQ_INSERT_TAIL(&j->records, rec, qentry);
+    }
+
+    pthread_cond_signal(&j->cond);
+    pthread_mutex_unlock(&j->mutex);
+}
+
+static void journal_compact(ship_t *s) {
+    ban_journal_t *j = &s->ban_journal;
+
+    pthread_mutex_lock(&j->mutex);
+    j->compact = 1;
+    pthread_cond_signal(&j->cond);
+    pthread_mutex_unlock(&j->mutex);
+}
+
 int ban_guildcard(ship_t *s, time_t end_time, uint32_t set_by,
                   uint32_t guildcard, const char *reason) {
+    time_t now = time(NULL);
+
     /* Add the ban to the list... */
-    if(ban_gc_int(s, end_time, time(NULL), set_by, guildcard, reason))
+    if(ban_gc_int(s, end_time, now, set_by, guildcard, reason))
         return -1;
 
-    /* Save the file */
-    if(write_bans_list(s)) {
-        debug(DBG_WARN, "Couldn't save bans list\n");
-        return -2;
-    }
+    update_index(s);
+
+    /* ...and get it saved. */
+    journal_add(s, "gc %lld %lld %lu %lu %s", (long long)end_time,
+                (long long)now, (unsigned long)set_by,
+                (unsigned long)guildcard, reason ? reason : "");
 
     return 0;
 }
@@ -317,20 +756,28 @@ int ban_guildcard(ship_t *s, time_t end_time, uint32_t set_by,
 int ban_ip(ship_t *s, time_t end_time, uint32_t set_by,
            const struct sockaddr_storage *ip,
            const struct sockaddr_storage *netmask, const char *reason) {
+    time_t now = time(NULL);
+    char ip_str[INET6_ADDRSTRLEN], nm_str[INET6_ADDRSTRLEN];
+
     /* Add the ban to the list... */
-    if(ban_ip_int(s, end_time, time(NULL), set_by, ip, netmask, reason))
+    if(ban_ip_int(s, end_time, now, set_by, ip, netmask, reason))
         return -1;
 
-    /* Save the file */
-    if(write_bans_list(s)) {
-        debug(DBG_WARN, "Couldn't save bans list\n");
-        return -2;
-    }
+    update_index(s);
+
+    /* ...and get it saved. */
+    my_ntop((struct sockaddr_storage *)ip, ip_str);
+    my_ntop((struct sockaddr_storage *)netmask, nm_str);
+    journal_add(s, "ip %d %lld %lld %lu %s %s %s",
+                ip->ss_family == AF_INET6, (long long)end_time,
+                (long long)now, (unsigned long)set_by, ip_str, nm_str,
+                reason ? reason : "");
 
     return 0;
 }
 
-int ban_lift_guildcard_ban(ship_t *s, uint32_t guildcard) {
+/* Remove all bans on a guildcard, returning how many there were. */
+static int lift_gc_int(ship_t *s, uint32_t guildcard) {
     guildcard_ban_t *i, *tmp;
     int num_lifted = 0, num_matching = 0;
     time_t now = time(NULL);
@@ -352,9 +799,8 @@ int ban_lift_guildcard_ban(ship_t *s, uint32_t guildcard) {
             ++num_lifted;
             ++num_matching;
         }
-
         /* While we're at it, remove any stale bans */
-        if(i->end_time != (time_t)-1 && i->end_time < now) {
+        else if(i->end_time != (time_t)-1 && i->end_time < now) {
             TAILQ_REMOVE(&s->guildcard_bans, i, qentry);
             free(i->reason);
             free(i);
@@ -364,27 +810,30 @@ int ban_lift_guildcard_ban(ship_t *s, uint32_t guildcard) {
         i = tmp;
     }
 
+    if(num_lifted)
+        index_rebuild(s);
+
     /* We're done with writing to the list, unlock this now... */
     pthread_rwlock_unlock(&s->banlock);
 
-    if(num_lifted) {
-        /* Save the file */
-        if(write_bans_list(s)) {
-            debug(DBG_WARN, "Couldn't save bans list\n");
-            return -2;
-        }
+    return num_matching;
+}
 
-        return num_matching ? 0 : -1;
-    }
+int ban_lift_guildcard_ban(ship_t *s, uint32_t guildcard) {
+    /* Didn't find anything, return failure. */
+    if(!lift_gc_int(s, guildcard))
+        return -1;
 
-    /* Didn't find anything if we get here, return failure. */
-    return -1;
+    journal_add(s, "liftgc %lu", (unsigned long)guildcard);
+    return 0;
 }
 
-int ban_lift_ip_ban(ship_t *s, const struct sockaddr_storage *ip) {
+/* Remove all bans matching an IP address, returning how many there were. */
+static int lift_ip_int(ship_t *s, const struct sockaddr_storage *ip) {
     ip_ban_t *i, *tmp;
-    int num_lifted = 0, num_matching = 0;
+    int num_lifted = 0, num_matching = 0, match;
     time_t now = time(NULL);
+    const struct sockaddr_in *ip4 = (const struct sockaddr_in *)ip;
 
     /* This involves writing to the ban list, in general. So, we have to lock
        for writing, unfortunately... */
@@ -396,29 +845,23 @@ int ban_lift_ip_ban(ship_t *s, const struct sockaddr_storage *ip) {
         tmp = TAILQ_NEXT(i, qentry);
 
         /* Did we find a match? */
-        if(i->ipv6) {
-            if(eq_ip6((const struct sockaddr_in6 *)ip, i->ip_addr,
-                      i->netmask)) {
-                TAILQ_REMOVE(&s->ip_bans, i, qentry);
-                free(i->reason);
-                free(i);
-                ++num_lifted;
-                ++num_matching;
-            }
-        }
-        else {
-            const struct sockaddr_in *ip4 = (const struct sockaddr_in *)ip;
-            if(i->ip_addr[0] == ip4->sin_addr.s_addr) {
-                TAILQ_REMOVE(&s->ip_bans, i, qentry);
-                free(i->reason);
-                free(i);
-                ++num_lifted;
-                ++num_matching;
-            }
+        if(i->ipv6)
+            match = ip->ss_family == AF_INET6 &&
+                eq_ip6((const struct sockaddr_in6 *)ip, i->ip_addr,
+                       i->netmask);
+        else
+            match = ip->ss_family == AF_INET &&
+                i->ip_addr[0] == ip4->sin_addr.s_addr;
+
+        if(match) {
+            TAILQ_REMOVE(&s->ip_bans, i, qentry);
+            free(i->reason);
+            free(i);
+            ++num_lifted;
+            ++num_matching;
         }
-
         /* While we're at it, remove any stale bans */
-        if(i->end_time != (time_t)-1 && i->end_time < now) {
+        else if(i->end_time != (time_t)-1 && i->end_time < now) {
             TAILQ_REMOVE(&s->ip_bans, i, qentry);
             free(i->reason);
             free(i);
@@ -428,21 +871,25 @@ int ban_lift_ip_ban(ship_t *s, const struct sockaddr_storage *ip) {
         i = tmp;
     }
 
+    if(num_lifted)
+        index_rebuild(s);
+
     /* We're done with writing to the list, unlock this now... */
     pthread_rwlock_unlock(&s->banlock);
 
-    if(num_lifted) {
-        /* Save the file */
-        if(write_bans_list(s)) {
-            debug(DBG_WARN, "Couldn't save bans list\n");
-            return -2;
-        }
+    return num_matching;
+}
 
-        return num_matching ? 0 : -1;
-    }
+int ban_lift_ip_ban(ship_t *s, const struct sockaddr_storage *ip) {
+    char ip_str[INET6_ADDRSTRLEN];
+
+    /* Didn't find anything, return failure. */
+    if(!lift_ip_int(s, ip))
+        return -1;
 
-    /* Didn't find anything if we get here, return failure. */
-    return -1;
+    my_ntop((struct sockaddr_storage *)ip, ip_str);
+    journal_add(s, "liftip %d %s", ip->ss_family == AF_INET6, ip_str);
+    return 0;
 }
 
 int ban_sweep(ship_t *s) {
@@ -484,16 +931,16 @@ int ban_sweep(ship_t *s) {
         j = tmp2;
     }
 
+    if(num_lifted)
+        index_rebuild(s);
+
     /* We're done with writing to the list, unlock this now... */
     pthread_rwlock_unlock(&s->banlock);
 
-    if(num_lifted) {
-        /* Save the file */
-        if(write_bans_list(s)) {
-            debug(DBG_WARN, "Couldn't save bans list\n");
-            return -1;
-        }
-    }
+    /* Nothing needs to go in the journal for these, since they'd be expired
+       when it was read back anyway. Just get the file cleaned up. */
+    if(num_lifted)
+        journal_compact(s);
 
     return 0;
 }
@@ -501,92 +948,115 @@ int ban_sweep(ship_t *s) {
 int is_guildcard_banned(ship_t *s, uint32_t guildcard, char **reason,
                         time_t *until) {
     time_t now = time(NULL);
-    guildcard_ban_t *i;
-    int banned = 0;
+    struct ban_index *idx;
+    const ban_entry_t *ent;
+    int banned = 0, e;
 
-    /* Lock the ban lock so nothing changes under us */
-    pthread_rwlock_rdlock(&s->banlock);
+    /* Grab the current index, it won't change under us. */
+    if(!(idx = index_get(s)))
+        return 0;
 
     /* Look for the user with any bans that haven't expired */
-    TAILQ_FOREACH(i, &s->guildcard_bans, qentry) {
-        if(i->banned_gc == guildcard) {
-            if(i->end_time >= now || i->end_time == (time_t)-1) {
+    e = idx->gc_hash[(guildcard * 2654435761U) & idx->gc_mask];
+
+    for(; e != -1; e = ent->next) {
+        ent = &idx->entries[e];
+
+        if(ent->guildcard == guildcard) {
+            if(ent->end_time >= now || ent->end_time == (time_t)-1) {
                 banned = 1;
-                *reason = strdup(i->reason);
-                *until = i->end_time;
+                *reason = strdup(ent->reason);
+                *until = ent->end_time;
                 break;
             }
         }
     }
 
-    pthread_rwlock_unlock(&s->banlock);
+    index_unref(s, idx);
 
     return banned;
 }
 
-static int is_ip4_banned(ship_t *s, const struct sockaddr_in *ip, char **reason,
-                         time_t *until) {
-    time_t now = time(NULL);
-    ip_ban_t *i;
+static const ban_entry_t *is_ip4_banned(const struct ban_index *idx,
+                                        const struct sockaddr_in *ip,
+                                        time_t now) {
+    const ban_entry_t *rv;
+    const ban_odd_t *o;
+    int i;
 
-    /* Look for the user with any bans that haven't expired */
-    TAILQ_FOREACH(i, &s->ip_bans, qentry) {
-        if(i->ipv6)
+    if((rv = trie_lookup(idx, idx->root4,
+                         (const uint8_t *)&ip->sin_addr.s_addr, 32, now)))
+        return rv;
+
+    for(i = 0; i < idx->odd_count; ++i) {
+        o = &idx->odd[i];
+        rv = &idx->entries[o->ent];
+
+        if(o->ipv6)
             continue;
 
-        if((i->end_time >= now || i->end_time == (time_t) -1) &&
-           (ip->sin_addr.s_addr & i->netmask[0]) ==
-           (i->ip_addr[0] & i->netmask[0])) {
-            *reason = strdup(i->reason);
-            *until = i->end_time;
-            return 1;
-        }
+        if((rv->end_time >= now || rv->end_time == (time_t)-1) &&
+           (ip->sin_addr.s_addr & o->netmask[0]) ==
+           (o->ip_addr[0] & o->netmask[0]))
+            return rv;
     }
 
-    return 0;
+    return NULL;
 }
 
-static int is_ip6_banned(ship_t *s, const struct sockaddr_in6 *ip,
-                         char **reason, time_t *until) {
-    time_t now = time(NULL);
-    ip_ban_t *i;
+static const ban_entry_t *is_ip6_banned(const struct ban_index *idx,
+                                        const struct sockaddr_in6 *ip,
+                                        time_t now) {
+    const ban_entry_t *rv;
+    const ban_odd_t *o;
+    int i;
 
-    /* Look for the user with any bans that haven't expired */
-    TAILQ_FOREACH(i, &s->ip_bans, qentry) {
-        if(!i->ipv6)
+    if((rv = trie_lookup(idx, idx->root6, ip->sin6_addr.s6_addr, 128, now)))
+        return rv;
+
+    for(i = 0; i < idx->odd_count; ++i) {
+        o = &idx->odd[i];
+        rv = &idx->entries[o->ent];
+
+        if(!o->ipv6)
             continue;
 
-        if((i->end_time >= now || i->end_time == (time_t) -1) &&
-           eq_ip6(ip, i->ip_addr, i->netmask)) {
-            *reason = strdup(i->reason);
-            *until = i->end_time;
-            return 1;
-        }
+        if((rv->end_time >= now || rv->end_time == (time_t)-1) &&
+           eq_ip6(ip, o->ip_addr, o->netmask))
+            return rv;
     }
 
-    return 0;
+    return NULL;
 }
 
 int is_ip_banned(ship_t *s, const struct sockaddr_storage *ip, char **reason,
                  time_t *until) {
+    time_t now = time(NULL);
+    struct ban_index *idx;
+    const ban_entry_t *ent;
     int banned = 0;
 
-    /* Lock the ban lock so nothing changes under us */
-    pthread_rwlock_rdlock(&s->banlock);
+    /* Grab the current index, it won't change under us. */
+    if(!(idx = index_get(s)))
+        return 0;
 
     if(ip->ss_family == AF_INET)
-        banned = is_ip4_banned(s, (const struct sockaddr_in *)ip, reason,
-                               until);
+        ent = is_ip4_banned(idx, (const struct sockaddr_in *)ip, now);
     else
-        banned = is_ip6_banned(s, (const struct sockaddr_in6 *)ip, reason,
-                               until);
+        ent = is_ip6_banned(idx, (const struct sockaddr_in6 *)ip, now);
 
-    pthread_rwlock_unlock(&s->banlock);
+    if(ent) {
+        banned = 1;
+        *reason = strdup(ent->reason);
+        *until = ent->end_time;
+    }
+
+    index_unref(s, idx);
 
     return banned;
 }
 
-int ban_list_read(const char *fn, ship_t *s) {
+static int read_bans_file(const char *fn, ship_t *s) {
     xmlParserCtxtPtr cxt;
     xmlDoc *doc;
     xmlNode *n;
@@ -597,11 +1067,6 @@ int ban_list_read(const char *fn, ship_t *s) {
     int rv = 0, num_bans = 0, is_ipv6 = 0;
     struct sockaddr_storage ban_ip, ban_nm;
 
-    if(!TAILQ_EMPTY(&s->guildcard_bans)) {
-        debug(DBG_WARN, "Cannot read guildcard bans multiple times!\n");
-        return -1;
-    }
-
     /* Make sure the file exists and can be read, otherwise quietly bail out */
     if(access(fn, R_OK)) {
         return -1;
@@ -817,6 +1282,255 @@ err:
     return rv;
 }
 
+/* Has this ban already been read in? The full file might have been written
+   after a ban went in, but before its record got written to the journal. */
+static int have_gc_ban(ship_t *s, uint32_t gc, time_t start) {
+    guildcard_ban_t *i;
+
+    TAILQ_FOREACH(i, &s->guildcard_bans, qentry) {
+        if(i->banned_gc == gc && i->start_time == start)
+            return 1;
+    }
+
+    return 0;
+}
+
+static int have_ip_ban(ship_t *s, const struct sockaddr_storage *ip,
+                       time_t start) {
+    ip_ban_t *i;
+    const struct sockaddr_in *ip4 = (const struct sockaddr_in *)ip;
+    const struct sockaddr_in6 *ip6 = (const struct sockaddr_in6 *)ip;
+
+    TAILQ_FOREACH(i, &s->ip_bans, qentry) {
+        if(i->start_time != start)
+            continue;
+
+        if(i->ipv6 && ip->ss_family == AF_INET6 &&
+           !memcmp(i->ip_addr, ip6->sin6_addr.s6_addr, 16))
+            return 1;
+        else if(!i->ipv6 && ip->ss_family == AF_INET &&
+                i->ip_addr[0] == ip4->sin_addr.s_addr)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Apply everything in the journal that was written since the full file was. */
+static int replay_journal(const char *fn, ship_t *s) {
+    FILE *fp;
+    char jfn[512], line[1024], ip_str[INET6_ADDRSTRLEN];
+    char nm_str[INET6_ADDRSTRLEN];
+    long long s_time, e_time;
+    unsigned long set_by, gc;
+    int v6, n, count = 0, lineno = 0;
+    struct sockaddr_storage ip, nm;
+    time_t now = time(NULL);
+    char *reason;
+
+    snprintf(jfn, sizeof(jfn), "%s.journal", fn);
+
+    if(!(fp = fopen(jfn, "r")))
+        return 0;
+
+    while(fgets(line, sizeof(line), fp)) {
+        ++lineno;
+        line[strcspn(line, "\n")] = '\0';
+
+        if(sscanf(line, "gc %lld %lld %lu %lu %n", &e_time, &s_time, &set_by,
+                  &gc, &n) == 4) {
+            if((e_time == -1 || e_time > now) &&
+               !have_gc_ban(s, (uint32_t)gc, (time_t)s_time))
+                ban_gc_int(s, (time_t)e_time, (time_t)s_time,
+                           (uint32_t)set_by, (uint32_t)gc, line + n);
+        }
+        else if(sscanf(line, "ip %d %lld %lld %lu %45s %45s %n", &v6, &e_time,
+                       &s_time, &set_by, ip_str, nm_str, &n) == 6) {
+            reason = line + n;
+
+            if(my_pton(v6 ? AF_INET6 : AF_INET, ip_str, &ip) != 1 ||
+               my_pton(v6 ? AF_INET6 : AF_INET, nm_str, &nm) != 1) {
+                debug(DBG_WARN, "Invalid IP in ban journal line %d\n", lineno);
+                continue;
+            }
+
+            ip.ss_family = nm.ss_family = v6 ? AF_INET6 : AF_INET;
+
+            if((e_time == -1 || e_time > now) &&
+               !have_ip_ban(s, &ip, (time_t)s_time))
+                ban_ip_int(s, (time_t)e_time, (time_t)s_time,
+                           (uint32_t)set_by, &ip, &nm, reason);
+        }
+        else if(sscanf(line, "liftgc %lu", &gc) == 1) {
+            lift_gc_int(s, (uint32_t)gc);
+        }
+        else if(sscanf(line, "liftip %d %45s", &v6, ip_str) == 2) {
+            if(my_pton(v6 ? AF_INET6 : AF_INET, ip_str, &ip) != 1) {
+                debug(DBG_WARN, "Invalid IP in ban journal line %d\n", lineno);
+                continue;
+            }
+
+            ip.ss_family = v6 ? AF_INET6 : AF_INET;
+            lift_ip_int(s, &ip);
+        }
+        else {
+            debug(DBG_WARN, "Invalid ban journal line %d\n", lineno);
+            continue;
+        }
+
+        ++count;
+    }
+
+    fclose(fp);
+
+    if(count)
+        debug(DBG_LOG, "Replayed %d ban journal records\n", count);
+
+    return count;
+}
+
+int ban_list_read(const char *fn, ship_t *s) {
+    int rv;
+
+    if(!TAILQ_EMPTY(&s->guildcard_bans)) {
+        debug(DBG_WARN, "Cannot read guildcard bans multiple times!\n");
+        return -1;
+    }
+
+    rv = read_bans_file(fn, s);
+
+    /* The journal thread will fold these into the full file once it starts. */
+    s->ban_journal.count = replay_journal(fn, s);
+
+    if(s->ban_journal.count)
+        rv = 0;
+
+    update_index(s);
+    return rv;
+}
+
+static void *journal_thd(void *d) {
+    ship_t *s = (ship_t *)d;
+    ban_journal_t *j = &s->ban_journal;
+    struct ban_record_queue recs;
+    ban_record_t *r, *tmp;
+    int compact, stop;
+    char fn[512];
+    FILE *fp;
+
+    snprintf(fn, sizeof(fn), "%s.journal", s->cfg->bans_file);
+
+    /* If anything got replayed from the journal, write it all out now. */
+    compact = j->count > 0;
+
+    pthread_mutex_lock(&j->mutex);
+
+    for(;;) {
+        while(!compact && j->running && TAILQ_EMPTY(&j->records) &&
+              !j->compact)
+            pthread_cond_wait(&j->cond, &j->mutex);
+
+        /* Take everything that has piled up, and write it all out at once. */
+        TAILQ_INIT(&recs);
+        TAILQ_CONCAT(&recs, &j->records, qentry);
+        compact |= j->compact;
+        j->compact = 0;
+        stop = !j->running;
+        pthread_mutex_unlock(&j->mutex);
+
+        if(!TAILQ_EMPTY(&recs)) {
+            if((fp = fopen(fn, "a"))) {
+                TAILQ_FOREACH(r, &recs, qentry) {
+                    fputs(r->line, fp);
+                    ++j->count;
+                }
+
+                if(fflush(fp) || fsync(fileno(fp)))
+                    compact = 1;
+
+                fclose(fp);
+            }
+            else {
+                debug(DBG_WARN, "Cannot open ban journal %s: %s\n", fn,
+                      strerror(errno));
+                compact = 1;
+            }
+
+            r = TAILQ_FIRST(&recs);
+            while(r) {
+                tmp = TAILQ_NEXT(r, qentry);
+                free(r);
+                r = tmp;
+            }
+        }
+
+        /* Every so often (and when shutting down), rewrite the whole file and
+           start the journal over. */
+        if(j->count >= BAN_JOURNAL_COMPACT || (stop && j->count))
+            compact = 1;
+
+        if(compact) {
+            if(!write_bans_list(s)) {
+                if(!(fp = fopen(fn, "w")))
+                    debug(DBG_WARN, "Cannot truncate ban journal %s: %s\n", fn,
+                          strerror(errno));
+                else
+                    fclose(fp);
+
+                j->count = 0;
+            }
+            else {
+                debug(DBG_WARN, "Couldn't save bans list\n");
+            }
+
+            compact = 0;
+        }
+
+        pthread_mutex_lock(&j->mutex);
+
+        if(stop && TAILQ_EMPTY(&j->records))
+            break;
+    }
+
+    pthread_mutex_unlock(&j->mutex);
+    return NULL;
+}
+
+int ban_journal_start(ship_t *s) {
+    ban_journal_t *j = &s->ban_journal;
+
+    /* Without a file, there's nothing to save the bans to. */
+    if(!s->cfg->bans_file || !s->cfg->bans_file[0])
+        return 0;
+
+    j->running = 1;
+
+    if(pthread_create(&j->thd, NULL, &journal_thd, s)) {
+        debug(DBG_ERROR, "Cannot start ban journal thread\n");
+        j->running = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+void ban_journal_stop(ship_t *s) {
+    ban_journal_t *j = &s->ban_journal;
+
+    pthread_mutex_lock(&j->mutex);
+
+    if(!j->running) {
+        pthread_mutex_unlock(&j->mutex);
+        return;
+    }
+
+    j->running = 0;
+    pthread_cond_signal(&j->cond);
+    pthread_mutex_unlock(&j->mutex);
+
+    pthread_join(j->thd, NULL);
+}
+
 void ban_list_clear(ship_t *s) {
     guildcard_ban_t *i, *tmp;
     ip_ban_t *j, *tmp2;
@@ -848,5 +1562,7 @@ void ban_list_clear(ship_t *s) {
     TAILQ_INIT(&s->guildcard_bans);
     TAILQ_INIT(&s->ip_bans);
 
+    index_swap(s, NULL);
+
     pthread_rwlock_unlock(&s->banlock);
 }
@@ -19,11 +19,13 @@
 #define BANS_H
 
 #include <time.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include <sys/queue.h>
 
 /* Forward declaration */
 struct ship;
+struct ban_index;
 
 #ifndef SHIP_DEFINED
 #define SHIP_DEFINED
@@ -53,6 +55,28 @@ typedef struct guildcard_ban {
 TAILQ_HEAD(gcban_queue, guildcard_ban);
 TAILQ_HEAD(ipban_queue, ip_ban);
 
+/* Changes to the bans are appended to a journal next to the bans file by a
+   background thread, and the whole file is only rewritten once this many
+   records have built up (or on shutdown). */
+#define BAN_JOURNAL_COMPACT     256
+
+typedef struct ban_record {
+    TAILQ_ENTRY(ban_record) qentry;
+    char line[];
+} ban_record_t;
+
+TAILQ_HEAD(ban_record_queue, ban_record);
+
+typedef struct ban_journal {
+    pthread_t thd;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct ban_record_queue records;
+    int running;
+    int compact;
+    int count;
+} ban_journal_t;
+
 int ban_guildcard(ship_t *s, time_t end_time, uint32_t set_by,
                   uint32_t guildcard, const char *reason);
 int ban_lift_guildcard_ban(ship_t *s, uint32_t guildcard);
@@ -72,4 +96,9 @@ int is_ip_banned(ship_t *s, const struct sockaddr_storage *ip, char **reason,
 int ban_list_read(const char *fn, ship_t *s);
 void ban_list_clear(ship_t *s);
 
+/* Start/stop the thread that saves changes to the bans. Stopping it makes sure
+   everything has been written out. */
+int ban_journal_start(ship_t *s);
+void ban_journal_stop(ship_t *s);
+
 #endif /* !BANS_H */
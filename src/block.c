@@ -16,15 +16,19 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/* For accept4() */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <time.h>
+#include <inttypes.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <arpa/inet.h>
 
 #include <sylverant/debug.h>
@@ -37,6 +41,7 @@
 #include "lobby.h"
 #include "ship_packets.h"
 #include "utils.h"
+#include "handoff.h"
 #include "shipgate.h"
 #include "commands.h"
 #include "gm.h"
@@ -44,26 +49,916 @@
 #include "scripts.h"
 #include "admin.h"
 #include "smutdata.h"
+#include "quest_xfer.h"
+#include "metrics.h"
 
 extern int enable_ipv6;
 extern uint32_t ship_ip4;
 extern uint8_t ship_ip6[16];
 
-static void *block_thd(void *d) {
-    block_t *b = (block_t *)d;
+/* Number of worker threads to spread each block's clients out over. Anything
+   less than 2 means the block's own thread does all the work. */
+int block_workers = 0;
+
+/* Number of threads accepting new connections for each block. */
+int block_acceptors = 0;
+
+/* Every thread that handles a block's clients has one of these, so that code
+   running on it can find out which block it belongs to and which random number
+   generator it should use. */
+typedef struct block_thread {
+    block_t *b;
+    struct mt19937_state *rng;
+    int acceptor;
+} block_thread_t;
+
+/* The most connections to accept from one listening socket before going on to
+   the next one. */
+#define BLOCK_ACCEPT_BATCH      16
+
+/* Don't move lobbies between workers unless the busiest one is handling at
+   least this many more packets per second than the least busy one. */
+#define BLOCK_SCHED_MIN_DIFF    200
+
+/* How often (in seconds) to send queued monster kill counts to the shipgate. */
+#define BLOCK_MKILL_INTERVAL    5
+
+struct block_worker {
+    block_t *b;
+    pthread_t thd;
+    block_thread_t self;
+    struct mt19937_state rng;
+    uint32_t load;
+
+    evloop_event_t *evs[EVLOOP_MAX_EVENTS];
+    int count;
+    int reap;
+};
+
+/* Each acceptor has its own event loop with just the listening sockets in it.
+   Where the system supports SO_REUSEPORT every acceptor but the first gets its
+   own set of sockets, so the kernel spreads the connections between them,
+   otherwise they all share the block's sockets. */
+struct block_acceptor {
+    block_t *b;
+    pthread_t thd;
+    block_thread_t self;
+    struct mt19937_state rng;
+    evloop_t *evl;
+
+    int lsocks[12];
+    int nlsocks;
+    int own;
+};
+
+static pthread_key_t block_thread_key;
+static pthread_once_t block_thread_once = PTHREAD_ONCE_INIT;
+
+static void block_thread_key_init(void) {
+    if(pthread_key_create(&block_thread_key, NULL)) {
+        perror("pthread_key_create");
+    }
+}
+
+int block_is_own_thread(block_t *b) {
+    block_thread_t *t = (block_thread_t *)pthread_getspecific(block_thread_key);
+
+    /* The acceptors don't run the block's loop, so nothing would ever flush
+       anything that they deferred. */
+    return t && t->b == b && !t->acceptor;
+}
+
+struct mt19937_state *block_rng(block_t *b) {
+    block_thread_t *t = (block_thread_t *)pthread_getspecific(block_thread_key);
+
+    if(t && t->b == b) {
+        return t->rng;
+    }
+
+    return &b->rng;
+}
+
+/* Versions and names for each of the listening sockets on a block, in the
+   same order as they're opened in block_server_start(). */
+static const int listen_versions[6] = {
+    CLIENT_VERSION_DCV1, CLIENT_VERSION_PC, CLIENT_VERSION_GC,
+    CLIENT_VERSION_EP3, CLIENT_VERSION_BB, CLIENT_VERSION_XBOX
+};
+
+static const char *listen_names[6] = {
+    "DC", "PC", "GC", "Episode 3", "Blue Burst", "Xbox"
+};
+
+/* Timer callback for checking if a client has gone quiet. The deadline is only
+   ever pushed forward from in here (not every time a packet comes in), so it
+   costs nothing extra to receive data. This just figures out if the client has
+   timed out or needs a ping now, and when it needs to be looked at again.
+   Returns non-zero if the client needs to be cleaned up. */
+static int block_ping_timer(twheel_timer_t *t, time_t now) {
+    ship_client_t *c = (ship_client_t *)t->data;
+    time_t next;
+    char nm[64];
+    int rv = 0;
+
+    pthread_mutex_lock(&c->mutex);
+
+    /* Make sure we catch anyone that another thread has kicked off. */
+    if(c->flags & CLIENT_FLAG_DISCONNECTED) {
+        rv = 1;
+        goto out;
+    }
+
+    /* If we haven't heard from a client in a minute and a half, it is
+       probably dead. Disconnect it. */
+    if(now > c->last_message + 90) {
+        if(c->bb_pl) {
+            istrncpy16_raw(ic_utf16_to_utf8, nm,
+                           &c->pl->bb.character.name[2], 64, 14);
+            debug(DBG_LOG, "Ping Timeout: %s(%d)\n", nm, c->guildcard);
+        }
+        else if(c->pl) {
+            debug(DBG_LOG, "Ping Timeout: %s(%d)\n", c->pl->v1.name,
+                  c->guildcard);
+        }
+
+        c->flags |= CLIENT_FLAG_DISCONNECTED;
+        rv = 1;
+        goto out;
+    }
+    /* Otherwise, if we haven't heard from them in half of a minute, ping them
+       (but no more than once every ten seconds). */
+    else if(now > c->last_message + 30) {
+        if(now > c->last_sent + 10) {
+            if(send_simple(c, PING_TYPE, 0)) {
+                c->flags |= CLIENT_FLAG_DISCONNECTED;
+                rv = 1;
+                goto out;
+            }
+
+            c->last_sent = now;
+        }
+
+        next = c->last_sent + 11;
+
+        if(next > c->last_message + 91)
+            next = c->last_message + 91;
+    }
+    else {
+        next = c->last_message + 31;
+    }
+
+    twheel_add(&c->cur_block->timers, t, next);
+
+out:
+    pthread_mutex_unlock(&c->mutex);
+    return rv;
+}
+
+/* Timer callback for when a client with guildcard protection hasn't logged in
+   within a minute of being warned about it. */
+static int block_protect_timer(twheel_timer_t *t, time_t now) {
+    ship_client_t *c = (ship_client_t *)t->data;
+    int rv = 0;
+
+    pthread_mutex_lock(&c->mutex);
+
+    if(c->flags & CLIENT_FLAG_GC_PROTECT) {
+        c->flags |= CLIENT_FLAG_DISCONNECTED;
+        rv = 1;
+    }
+
+    pthread_mutex_unlock(&c->mutex);
+    return rv;
+}
+
+/* Timer callback for a character backup that was held back because the last
+   one was too recent. */
+static int block_bkup_timer(twheel_timer_t *t, time_t now) {
+    ship_client_t *c = (ship_client_t *)t->data;
+
+    (void)now;
+    pthread_mutex_lock(&c->mutex);
+
+    if(!(c->flags & CLIENT_FLAG_DISCONNECTED))
+        client_flush_backup(c);
+
+    pthread_mutex_unlock(&c->mutex);
+    return 0;
+}
+
+void block_client_timers(ship_client_t *c) {
+    block_t *b = c->cur_block;
+
+    /* Start watching for the client going quiet on us. */
+    twheel_timer_init(&c->ping_timer, &block_ping_timer, c);
+    twheel_timer_init(&c->protect_timer, &block_protect_timer, c);
+    twheel_timer_init(&c->bkup_timer, &block_bkup_timer, c);
+    twheel_timer_init(&c->qxfer_timer, &quest_xfer_timer, c);
+    twheel_add(&b->timers, &c->ping_timer, c->last_message + 31);
+}
+
+/* Accept up to max new connections from one of the block's listening sockets.
+   Returns how many were accepted. */
+static int block_accept(block_t *b, int lsock, int version, const char *name,
+                        int max) {
     ship_t *s = b->ship;
-    int nfds, i;
-    struct timeval timeout;
-    fd_set readfds, writefds;
-    ship_client_t *it, *tmp;
     socklen_t len;
     struct sockaddr_storage addr;
     struct sockaddr *addr_p = (struct sockaddr *)&addr;
     char ipstr[INET6_ADDRSTRLEN];
+    int sock, n;
+
+    for(n = 0; n < max; ++n) {
+        len = sizeof(struct sockaddr_storage);
+
+#ifdef HAVE_ACCEPT4
+        sock = accept4(lsock, addr_p, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        if((sock = accept(lsock, addr_p, &len)) >= 0)
+            set_cloexec(sock);
+#endif
+
+        if(sock < 0) {
+            /* Someone else might have beaten us to it, or the client might
+               have given up already. */
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+               errno != ECONNABORTED) {
+                perror("accept");
+            }
+
+            break;
+        }
+
+        my_ntop(&addr, ipstr);
+        debug(DBG_LOG, "%s(%d): Accepted %s block connection from %s\n",
+              s->cfg->name, b->b, name, ipstr);
+
+        /* This closes the socket itself if it fails. */
+        client_create_connection(sock, version, CLIENT_TYPE_BLOCK, b->clients,
+                                 s, b, addr_p, len);
+    }
+
+    return n;
+}
+
+/* Write out everything that was deferred for clients during this pass through
+   the loop, one writev() per client. Returns non-zero if anyone needs to be
+   cleaned up. This must be called with the client list's lock held. */
+static int block_flush_clients(block_t *b) {
+    ship_client_t *c;
+    int rv = 0;
+
+    pthread_mutex_lock(&b->flush_mutex);
+
+    while((c = TAILQ_FIRST(&b->flush_list))) {
+        TAILQ_REMOVE(&b->flush_list, c, flush_qentry);
+        c->flush_pending = 0;
+        pthread_mutex_unlock(&b->flush_mutex);
+
+        pthread_mutex_lock(&c->mutex);
+
+        if(client_send_queued(c)) {
+            c->flags |= CLIENT_FLAG_DISCONNECTED;
+            rv = 1;
+        }
+        /* If the socket wouldn't take it all, wait until it's writable. */
+        else if(!sendq_empty(&c->sendq)) {
+            evloop_mod(c->evl, c->sock, EVLOOP_READ | EVLOOP_WRITE);
+        }
+
+        pthread_mutex_unlock(&c->mutex);
+        pthread_mutex_lock(&b->flush_mutex);
+    }
+
+    pthread_mutex_unlock(&b->flush_mutex);
+    return rv;
+}
+
+/* Clean up any dead connections on the block. */
+static void block_reap_clients(block_t *b) {
+    ship_client_t *it, *tmp;
+    char ipstr[INET6_ADDRSTRLEN];
     char nm[64];
-    int sock;
-    ssize_t sent;
+
+    /* Its not safe to do a TAILQ_REMOVE in the middle of a TAILQ_FOREACH, and
+       client_destroy_connection does indeed use TAILQ_REMOVE. */
+    pthread_rwlock_wrlock(&b->lock);
+    it = TAILQ_FIRST(b->clients);
+    while(it) {
+        tmp = TAILQ_NEXT(it, qentry);
+
+        if(it->flags & CLIENT_FLAG_DISCONNECTED) {
+            if(it->bb_pl) {
+                istrncpy16_raw(ic_utf16_to_utf8, nm,
+                               &it->pl->bb.character.name[2], 64, 14);
+                debug(DBG_LOG, "Disconnecting %s(%d)\n", nm, it->guildcard);
+            }
+            else if(it->pl) {
+                debug(DBG_LOG, "Disconnecting %s(%d)\n", it->pl->v1.name,
+                      it->guildcard);
+            }
+            else {
+                my_ntop(&it->ip_addr, ipstr);
+                debug(DBG_LOG, "Disconnecting something (IP: %s).\n",
+                      ipstr);
+            }
+
+            /* Remove the player from the lobby before disconnecting
+               them, or else bad things might happen. */
+            lobby_remove_player(it);
+
+            pthread_mutex_lock(&b->flush_mutex);
+
+            if(it->flush_pending) {
+                TAILQ_REMOVE(&b->flush_list, it, flush_qentry);
+            }
+
+            pthread_mutex_unlock(&b->flush_mutex);
+
+            pthread_mutex_lock(&b->move_mutex);
+
+            if(it->move_pending) {
+                TAILQ_REMOVE(&b->move_list, it, move_qentry);
+            }
+
+            pthread_mutex_unlock(&b->move_mutex);
+
+            twheel_del(&b->timers, &it->ping_timer);
+            twheel_del(&b->timers, &it->protect_timer);
+            twheel_del(&b->timers, &it->bkup_timer);
+            twheel_del(&b->timers, &it->qxfer_timer);
+            client_destroy_connection(it, b->clients);
+            --b->num_clients;
+        }
+
+        it = tmp;
+    }
+
+    pthread_rwlock_unlock(&b->lock);
+}
+
+/* Handle whatever the event loop said happened on one client's socket.
+   Returns non-zero if the client needs to be cleaned up. This must be called
+   with the client list's lock held. */
+static int block_client_event(evloop_event_t *ev) {
+    ship_client_t *it = (ship_client_t *)ev->data;
+    int rv = 0;
+
+    pthread_mutex_lock(&it->mutex);
+
+    if(it->flags & CLIENT_FLAG_DISCONNECTED) {
+        rv = 1;
+        goto out;
+    }
+
+    /* Check if this connection was trying to send us something. */
+    if(ev->events & EVLOOP_READ) {
+        if(client_process_pkt(it)) {
+            it->flags |= CLIENT_FLAG_DISCONNECTED;
+            rv = 1;
+            goto out;
+        }
+
+        /* The client might have asked to be disconnected. */
+        if(it->flags & CLIENT_FLAG_DISCONNECTED) {
+            rv = 1;
+            goto out;
+        }
+    }
+
+    /* If we have anything to write, and we can, do so. */
+    if(ev->events & EVLOOP_WRITE) {
+        if(client_send_queued(it)) {
+            it->flags |= CLIENT_FLAG_DISCONNECTED;
+            rv = 1;
+        }
+    }
+
+out:
+    pthread_mutex_unlock(&it->mutex);
+    return rv;
+}
+
+/* Find the worker with the least load on it. */
+static int block_coolest_worker(block_t *b) {
+    int i, rv = 0;
+
+    for(i = 1; i < b->num_workers; ++i) {
+        if(b->workers[i].load < b->workers[rv].load) {
+            rv = i;
+        }
+    }
+
+    return rv;
+}
+
+/* Figure out which worker should handle a client. Everyone in the same lobby
+   goes to the same worker, so that the lobby's packets are all handled in
+   order and by one thread at a time. Lobbies that haven't been placed yet go
+   wherever there's the least going on. */
+static int block_client_worker(block_t *b, ship_client_t *c) {
+    lobby_t *l = c->cur_lobby;
+
+    if(!l) {
+        return (int)((uint32_t)c->sock % (uint32_t)b->num_workers);
+    }
+
+    if(l->worker < 0 || l->worker >= b->num_workers) {
+        l->worker = block_coolest_worker(b);
+        b->workers[l->worker].load += l->pkt_rate;
+    }
+
+    return l->worker;
+}
+
+/* Can the lobby be moved over to another worker right now? Anything in the
+   middle of a burst (or with packets held back waiting on one) has to stay put
+   so that nothing gets handled out of order. */
+static int lobby_can_migrate(lobby_t *l) {
+    return !(l->flags & LOBBY_FLAG_BURSTING) &&
+        STAILQ_EMPTY(&l->pkt_queue) && STAILQ_EMPTY(&l->burst_queue);
+}
+
+/* Timer callback for the worker scheduler. Once a second, this works out how
+   many packets each lobby has been handling and how that adds up on each of
+   the workers. If one worker is doing a lot more than another, a lobby gets
+   moved from the busiest worker to the one doing the least. This runs on the
+   block's thread while the workers are idle, so nothing here needs to worry
+   about them. */
+static int block_sched_timer(twheel_timer_t *t, time_t now) {
+    block_t *b = (block_t *)t->data;
+    lobby_t *l, *best = NULL;
+    int i, hot = 0, cold = 0;
+    uint32_t diff;
+
+    for(i = 0; i < b->num_workers; ++i) {
+        b->workers[i].load = 0;
+    }
+
+    pthread_rwlock_rdlock(&b->lobby_lock);
+
+    /* Average the last second's count in with what we had before, so that
+       one odd second doesn't throw everything around. */
+    TAILQ_FOREACH(l, &b->lobbies, qentry) {
+        l->pkt_rate = (l->pkt_rate +
+                       __atomic_exchange_n(&l->pkt_count, 0,
+                                           __ATOMIC_RELAXED)) / 2;
+
+        if(l->worker >= 0 && l->worker < b->num_workers) {
+            b->workers[l->worker].load += l->pkt_rate;
+        }
+    }
+
+    for(i = 1; i < b->num_workers; ++i) {
+        if(b->workers[i].load > b->workers[hot].load) {
+            hot = i;
+        }
+
+        if(b->workers[i].load < b->workers[cold].load) {
+            cold = i;
+        }
+    }
+
+    diff = b->workers[hot].load - b->workers[cold].load;
+
+    /* Only bother if the imbalance is both big and meaningful. */
+    if(diff >= BLOCK_SCHED_MIN_DIFF &&
+       b->workers[hot].load > b->workers[cold].load +
+       b->workers[cold].load / 4) {
+        /* Find the busiest lobby on the hot worker that we can move without
+           just making the cold worker the new hot one. */
+        TAILQ_FOREACH(l, &b->lobbies, qentry) {
+            if(l->worker != hot || !l->pkt_rate || l->pkt_rate >= diff)
+                continue;
+
+            if(!lobby_can_migrate(l))
+                continue;
+
+            if(!best || l->pkt_rate > best->pkt_rate)
+                best = l;
+        }
+
+        if(best) {
+            best->worker = cold;
+            b->workers[hot].load -= best->pkt_rate;
+            b->workers[cold].load += best->pkt_rate;
+        }
+    }
+
+    pthread_rwlock_unlock(&b->lobby_lock);
+
+    twheel_add(&b->timers, t, now + 1);
+    return 0;
+}
+
+/* Timer callback to send off the monster kill counts that have piled up on the
+   block since the last time. */
+static int block_mkill_timer(twheel_timer_t *t, time_t now) {
+    block_t *b = (block_t *)t->data;
+
+    shipgate_flush_mkills(&b->ship->sg, b);
+    twheel_add(&b->timers, t, now + BLOCK_MKILL_INTERVAL);
+    return 0;
+}
+
+static void *block_worker_thd(void *d) {
+    block_worker_t *w = (block_worker_t *)d;
+    block_t *b = w->b;
+    int gen = 0, i;
+
+    pthread_setspecific(block_thread_key, &w->self);
+    pthread_mutex_lock(&b->work_mutex);
+
+    for(;;) {
+        while(b->work_gen == gen && b->workers_run) {
+            pthread_cond_wait(&b->work_cond, &b->work_mutex);
+        }
+
+        if(!b->workers_run) {
+            break;
+        }
+
+        gen = b->work_gen;
+        pthread_mutex_unlock(&b->work_mutex);
+
+        /* The block's thread is holding the client list's lock for us while
+           we work. */
+        w->reap = 0;
+
+        for(i = 0; i < w->count; ++i) {
+            w->reap |= block_client_event(w->evs[i]);
+        }
+
+        pthread_mutex_lock(&b->work_mutex);
+
+        if(!--b->work_left) {
+            pthread_cond_signal(&b->done_cond);
+        }
+    }
+
+    pthread_mutex_unlock(&b->work_mutex);
+    return NULL;
+}
+
+static void *block_acceptor_thd(void *d) {
+    block_acceptor_t *a = (block_acceptor_t *)d;
+    block_t *b = a->b;
+    evloop_event_t evs[13];
+    int i, j, n, count;
+
+    pthread_setspecific(block_thread_key, &a->self);
+
+    for(;;) {
+        if((n = evloop_wait(a->evl, evs, 13, -1)) < 0) {
+            if(errno != EINTR) {
+                perror("evloop_wait");
+            }
+
+            continue;
+        }
+
+        count = 0;
+
+        for(i = 0; i < n; ++i) {
+            /* The block's shutting down. */
+            if(evs[i].fd == b->acc_pipes[0]) {
+                return NULL;
+            }
+
+            for(j = 0; j < a->nlsocks; ++j) {
+                if(evs[i].fd == a->lsocks[j]) {
+                    count += block_accept(b, a->lsocks[j],
+                                          listen_versions[j % 6],
+                                          listen_names[j % 6],
+                                          BLOCK_ACCEPT_BATCH);
+                    break;
+                }
+            }
+        }
+
+        /* The new clients are in the block's event loop, but make sure that
+           the block's thread notices them if it's asleep in a select(). */
+        if(count) {
+            block_wakeup(b);
+        }
+    }
+}
+
+/* Fill in the listening sockets for one acceptor. If it can't have sockets of
+   its own, it shares the block's. */
+static void block_acceptor_socks(block_t *b, block_acceptor_t *a,
+                                 int numsocks) {
+    uint16_t ports[6];
+    int i, j, val;
+
+    ports[0] = b->dc_port;
+    ports[1] = b->pc_port;
+    ports[2] = b->gc_port;
+    ports[3] = b->ep3_port;
+    ports[4] = b->bb_port;
+    ports[5] = b->xb_port;
+    a->nlsocks = 0;
+
+#ifdef SO_REUSEPORT
+    if(a != b->acceptors) {
+        for(i = 0; i < numsocks; ++i) {
+            for(j = 0; j < 6; ++j) {
+                val = open_sock_ex(i ? AF_INET6 : AF_INET, ports[j], 1);
+
+                if(val < 0) {
+                    goto share;
+                }
+
+                a->lsocks[a->nlsocks++] = val;
+
+                /* Same as in block_server_start(). */
+                if(!j) {
+                    val = 32767;
+                    if(setsockopt(a->lsocks[a->nlsocks - 1], SOL_SOCKET,
+                                  SO_RCVBUF, &val, sizeof(int)) < 0) {
+                        perror("setsockopt");
+                    }
+                }
+            }
+        }
+
+        a->own = 1;
+        return;
+
+share:
+        debug(DBG_WARN, "%s(%d): Cannot open listening sockets for acceptor, "
+              "sharing the block's\n", b->ship->cfg->name, b->b);
+
+        for(i = 0; i < a->nlsocks; ++i) {
+            handoff_close(a->lsocks[i]);
+        }
+
+        a->nlsocks = 0;
+    }
+#else
+    (void)ports;
+    (void)j;
+    (void)val;
+#endif
+
+    for(i = 0; i < numsocks; ++i) {
+        a->lsocks[a->nlsocks++] = b->dcsock[i];
+        a->lsocks[a->nlsocks++] = b->pcsock[i];
+        a->lsocks[a->nlsocks++] = b->gcsock[i];
+        a->lsocks[a->nlsocks++] = b->ep3sock[i];
+        a->lsocks[a->nlsocks++] = b->bbsock[i];
+        a->lsocks[a->nlsocks++] = b->xbsock[i];
+    }
+
+    a->own = 0;
+}
+
+/* Start up the threads to accept new connections on, if the block's configured
+   to use any. Returns the number that were started. If none could be, the
+   block's thread just does it itself. */
+static int block_start_acceptors(block_t *b, int numsocks) {
+    block_acceptor_t *a;
+    int i, j, fl;
+
+    if(block_acceptors < 1) {
+        return 0;
+    }
+
+    b->acceptors = (block_acceptor_t *)calloc(block_acceptors,
+                                              sizeof(block_acceptor_t));
+
+    if(!b->acceptors) {
+        goto err;
+    }
+
+    if(pipe(b->acc_pipes) == -1) {
+        goto err_free;
+    }
+
+    set_cloexec(b->acc_pipes[0]);
+    set_cloexec(b->acc_pipes[1]);
+
+    for(i = 0; i < block_acceptors; ++i) {
+        a = &b->acceptors[i];
+        a->b = b;
+        a->self.b = b;
+        a->self.rng = &a->rng;
+        a->self.acceptor = 1;
+        mt19937_init(&a->rng, mt19937_genrand_int32(&b->rng));
+
+        if(!(a->evl = evloop_create())) {
+            break;
+        }
+
+        block_acceptor_socks(b, a, numsocks);
+
+        /* The acceptors keep accepting until a socket runs dry, and more than
+           one of them might be watching the same one, so none of them can be
+           allowed to block. */
+        for(j = 0; j < a->nlsocks; ++j) {
+            if((fl = fcntl(a->lsocks[j], F_GETFL)) == -1 ||
+               fcntl(a->lsocks[j], F_SETFL, fl | O_NONBLOCK) == -1) {
+                perror("fcntl");
+            }
+
+            evloop_add(a->evl, a->lsocks[j], EVLOOP_READ, NULL);
+        }
+
+        evloop_add(a->evl, b->acc_pipes[0], EVLOOP_READ, NULL);
+
+        if(pthread_create(&a->thd, NULL, &block_acceptor_thd, a)) {
+            if(a->own) {
+                for(j = 0; j < a->nlsocks; ++j) {
+                    handoff_close(a->lsocks[j]);
+                }
+            }
+
+            evloop_destroy(a->evl);
+            break;
+        }
+    }
+
+    if(!(b->num_acceptors = i)) {
+        close(b->acc_pipes[0]);
+        close(b->acc_pipes[1]);
+        goto err_free;
+    }
+
+    debug(DBG_LOG, "%s(%d): Started %d acceptor threads\n",
+          b->ship->cfg->name, b->b, i);
+    return i;
+
+err_free:
+    free(b->acceptors);
+    b->acceptors = NULL;
+err:
+    debug(DBG_WARN, "%s(%d): Cannot start acceptors, accepting connections on "
+          "the block thread\n", b->ship->cfg->name, b->b);
+    return 0;
+}
+
+static void block_stop_acceptors(block_t *b) {
+    block_acceptor_t *a;
+    int i, j;
+
+    /* Nobody ever reads the pipe, so this wakes them all up. */
+    write(b->acc_pipes[1], "\xFF", 1);
+
+    for(i = 0; i < b->num_acceptors; ++i) {
+        a = &b->acceptors[i];
+        pthread_join(a->thd, NULL);
+
+        if(a->own) {
+            for(j = 0; j < a->nlsocks; ++j) {
+                handoff_close(a->lsocks[j]);
+            }
+        }
+
+        evloop_destroy(a->evl);
+    }
+
+    close(b->acc_pipes[0]);
+    close(b->acc_pipes[1]);
+    b->num_acceptors = 0;
+    free(b->acceptors);
+    b->acceptors = NULL;
+}
+
+/* Start up the block's worker threads, if it's configured to use any. If some
+   of them can't be started, just go with what we've got. */
+static void block_start_workers(block_t *b) {
+    int i;
+
+    if(block_workers < 2) {
+        return;
+    }
+
+    b->workers = (block_worker_t *)calloc(block_workers,
+                                          sizeof(block_worker_t));
+
+    if(!b->workers) {
+        debug(DBG_WARN, "%s(%d): Cannot allocate workers, running with just "
+              "the block thread\n", b->ship->cfg->name, b->b);
+        return;
+    }
+
+    b->workers_run = 1;
+
+    for(i = 0; i < block_workers; ++i) {
+        b->workers[i].b = b;
+        b->workers[i].self.b = b;
+        b->workers[i].self.rng = &b->workers[i].rng;
+        mt19937_init(&b->workers[i].rng, mt19937_genrand_int32(&b->rng));
+
+        if(pthread_create(&b->workers[i].thd, NULL, &block_worker_thd,
+                          &b->workers[i])) {
+            debug(DBG_WARN, "%s(%d): Cannot start worker %d\n",
+                  b->ship->cfg->name, b->b, i);
+            break;
+        }
+    }
+
+    b->num_workers = i;
+
+    if(i) {
+        debug(DBG_LOG, "%s(%d): Started %d worker threads\n",
+              b->ship->cfg->name, b->b, i);
+
+        /* Start up the scheduler to keep the load between them even. */
+        twheel_timer_init(&b->sched_timer, &block_sched_timer, b);
+        twheel_add(&b->timers, &b->sched_timer, time(NULL) + 1);
+    }
+}
+
+static void block_stop_workers(block_t *b) {
+    int i;
+
+    twheel_del(&b->timers, &b->sched_timer);
+
+    pthread_mutex_lock(&b->work_mutex);
+    b->workers_run = 0;
+    pthread_cond_broadcast(&b->work_cond);
+    pthread_mutex_unlock(&b->work_mutex);
+
+    for(i = 0; i < b->num_workers; ++i) {
+        pthread_join(b->workers[i].thd, NULL);
+    }
+
+    b->num_workers = 0;
+    free(b->workers);
+    b->workers = NULL;
+}
+
+/* Hand the client events from one pass through the loop out to the workers,
+   and wait for them all to finish. Returns non-zero if anyone needs to be
+   cleaned up. This must be called with the client list's lock held. */
+static int block_dispatch(block_t *b, evloop_event_t *evs, int n) {
+    block_worker_t *w;
+    int i, used = 0, last = 0, rv = 0;
+
+    for(i = 0; i < b->num_workers; ++i) {
+        b->workers[i].count = 0;
+    }
+
+    for(i = 0; i < n; ++i) {
+        if(!evs[i].data) {
+            continue;
+        }
+
+        last = block_client_worker(b, (ship_client_t *)evs[i].data);
+        w = &b->workers[last];
+
+        if(!w->count++) {
+            ++used;
+        }
+
+        w->evs[w->count - 1] = &evs[i];
+    }
+
+    if(!used) {
+        return 0;
+    }
+
+    /* If everything landed on one worker, it's cheaper to just do it here than
+       to wake everyone up. */
+    if(used == 1) {
+        w = &b->workers[last];
+
+        for(i = 0; i < w->count; ++i) {
+            rv |= block_client_event(w->evs[i]);
+        }
+
+        return rv;
+    }
+
+    pthread_mutex_lock(&b->work_mutex);
+    b->work_left = b->num_workers;
+    ++b->work_gen;
+    pthread_cond_broadcast(&b->work_cond);
+
+    while(b->work_left) {
+        pthread_cond_wait(&b->done_cond, &b->work_mutex);
+    }
+
+    pthread_mutex_unlock(&b->work_mutex);
+
+    for(i = 0; i < b->num_workers; ++i) {
+        rv |= b->workers[i].reap;
+    }
+
+    return rv;
+}
+
+static void *block_thd(void *d) {
+    block_t *b = (block_t *)d;
+    ship_t *s = b->ship;
+    evloop_event_t evs[EVLOOP_MAX_EVENTS];
+    block_thread_t self;
+    int lsocks[12], lvers[12];
+    const char *lnames[12];
+    int nlsocks = 0, i, j, n, reap, timeout;
     time_t now;
+    char tmp;
     int numsocks = 1;
 
 #ifdef SYLVERANT_ENABLE_IPV6
@@ -72,293 +967,316 @@ static void *block_thd(void *d) {
     }
 #endif
 
+    self.b = b;
+    self.rng = &b->rng;
+    self.acceptor = 0;
+    pthread_setspecific(block_thread_key, &self);
+
+    /* Register all of the listening sockets and the pipe with the event loop,
+       unless there are other threads to accept connections on. Clients
+       register themselves as they connect. */
+    if(!block_start_acceptors(b, numsocks)) {
+        for(i = 0; i < numsocks; ++i) {
+            lsocks[nlsocks++] = b->dcsock[i];
+            lsocks[nlsocks++] = b->pcsock[i];
+            lsocks[nlsocks++] = b->gcsock[i];
+            lsocks[nlsocks++] = b->ep3sock[i];
+            lsocks[nlsocks++] = b->bbsock[i];
+            lsocks[nlsocks++] = b->xbsock[i];
+        }
+
+        for(i = 0; i < nlsocks; ++i) {
+            lvers[i] = listen_versions[i % 6];
+            lnames[i] = listen_names[i % 6];
+            evloop_add(b->evl, lsocks[i], EVLOOP_READ, NULL);
+        }
+    }
+
+    evloop_add(b->evl, b->pipes[0], EVLOOP_READ, NULL);
+    block_start_workers(b);
+
     debug(DBG_LOG, "%s(%d): Up and running\n", s->cfg->name, b->b);
 
     /* While we're still supposed to run... do it. */
     while(b->run) {
-        /* Clear the fd_sets so we can use them again. */
-        nfds = 0;
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-        timeout.tv_sec = 15;
-        timeout.tv_usec = 0;
         now = time(NULL);
 
-        /* Fill the sockets into the fd_sets so we can use select below. */
+        /* Run any timers that have come due, and figure out how long we can
+           sleep before the next one does. */
         pthread_rwlock_rdlock(&b->lock);
+        reap = twheel_run(&b->timers, now);
 
-        TAILQ_FOREACH(it, b->clients, qentry) {
-            /* If we haven't heard from a client in a minute and a half, it is
-               probably dead. Disconnect it. */
-            if(now > it->last_message + 90) {
-                if(it->bb_pl) {
-                    istrncpy16_raw(ic_utf16_to_utf8, nm,
-                                   &it->pl->bb.character.name[2], 64, 14);
-                    debug(DBG_LOG, "Ping Timeout: %s(%d)\n", nm, it->guildcard);
-                }
-                else if(it->pl) {
-                    debug(DBG_LOG, "Ping Timeout: %s(%d)\n", it->pl->v1.name,
-                          it->guildcard);
-                }
+        /* Make sure anything the timers (or new connections) sent goes out
+           before we go to sleep. */
+        if(!TAILQ_EMPTY(&b->flush_list)) {
+            reap |= block_flush_clients(b);
+        }
 
-                it->flags |= CLIENT_FLAG_DISCONNECTED;
+        pthread_rwlock_unlock(&b->lock);
+
+        /* If someone needs disconnecting, do it ASAP! */
+        timeout = reap ? 0 : twheel_next(&b->timers, now);
 
-                /* Make sure that we disconnect the client ASAP! */
-                timeout.tv_sec = 0;
+        /* Wait for some activity... */
+        if((n = evloop_wait(b->evl, evs, EVLOOP_MAX_EVENTS, timeout)) < 0) {
+            perror("evloop_wait");
+            n = 0;
+        }
 
+        /* Deal with the pipe and listening sockets first, since accepting a
+           new client needs the client list's write lock. */
+        for(i = 0; i < n; ++i) {
+            if(evs[i].data) {
                 continue;
             }
-            /* Otherwise, if we haven't heard from them in half of a minute,
-               ping them. */
-            else if(now > it->last_message + 30 && now > it->last_sent + 10) {
-                if(send_simple(it, PING_TYPE, 0)) {
-                    it->flags |= CLIENT_FLAG_DISCONNECTED;
-                    timeout.tv_sec = 0;
-                    continue;
-                }
 
-                it->last_sent = now;
+            /* Other threads poke the pipe when they kick one of our clients,
+               so take a look for anyone that needs cleaning up. */
+            if(evs[i].fd == b->pipes[0]) {
+                read(b->pipes[0], &tmp, 1);
+                reap = 1;
+                continue;
             }
 
-            /* Check if their timeout expired to login after getting a
-               protection message. */
-            if((it->flags & CLIENT_FLAG_GC_PROTECT) &&
-               it->join_time + 60 < now) {
-                it->flags |= CLIENT_FLAG_DISCONNECTED;
-                timeout.tv_sec = 0;
-                continue;
+            for(j = 0; j < nlsocks; ++j) {
+                if(evs[i].fd == lsocks[j]) {
+                    block_accept(b, lsocks[j], lvers[j], lnames[j], 1);
+                    break;
+                }
             }
+        }
 
-            FD_SET(it->sock, &readfds);
+        pthread_rwlock_rdlock(&b->lock);
 
-            /* Only add to the write fd set if we have something to send out. */
-            if(it->sendbuf_cur) {
-                FD_SET(it->sock, &writefds);
+        /* Process client connections, either right here or out on the
+           workers. */
+        if(b->num_workers) {
+            reap |= block_dispatch(b, evs, n);
+        }
+        else {
+            for(i = 0; i < n; ++i) {
+                if(evs[i].data) {
+                    reap |= block_client_event(&evs[i]);
+                }
             }
+        }
+
+        /* Send off anything that was held back while we were working. */
+        if(!TAILQ_EMPTY(&b->move_list)) {
+            subcmd_flush_moves(b);
+        }
 
-            nfds = nfds > it->sock ? nfds : it->sock;
+        if(!TAILQ_EMPTY(&b->flush_list)) {
+            reap |= block_flush_clients(b);
         }
 
         pthread_rwlock_unlock(&b->lock);
 
-        /* Add the listening sockets to the read fd_set. */
-        for(i = 0; i < numsocks; ++i) {
-            FD_SET(b->dcsock[i], &readfds);
-            nfds = nfds > b->dcsock[i] ? nfds : b->dcsock[i];
-            FD_SET(b->pcsock[i], &readfds);
-            nfds = nfds > b->pcsock[i] ? nfds : b->pcsock[i];
-            FD_SET(b->gcsock[i], &readfds);
-            nfds = nfds > b->gcsock[i] ? nfds : b->gcsock[i];
-            FD_SET(b->ep3sock[i], &readfds);
-            nfds = nfds > b->ep3sock[i] ? nfds : b->ep3sock[i];
-            FD_SET(b->bbsock[i], &readfds);
-            nfds = nfds > b->bbsock[i] ? nfds : b->bbsock[i];
-            FD_SET(b->xbsock[i], &readfds);
-            nfds = nfds > b->xbsock[i] ? nfds : b->xbsock[i];
-        }
-
-        FD_SET(b->pipes[1], &readfds);
-        nfds = nfds > b->pipes[1] ? nfds : b->pipes[1];
+        if(reap) {
+            block_reap_clients(b);
+        }
+    }
 
-        /* Wait for some activity... */
-        if(select(nfds + 1, &readfds, &writefds, NULL, &timeout) > 0) {
-            if(FD_ISSET(b->pipes[1], &readfds)) {
-                read(b->pipes[1], &len, 1);
-            }
+    if(b->num_acceptors) {
+        block_stop_acceptors(b);
+    }
 
-            for(i = 0; i < numsocks; ++i) {
-                if(FD_ISSET(b->dcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(b->dcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
+    if(b->num_workers) {
+        block_stop_workers(b);
+    }
 
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s(%d): Accepted DC block connection from "
-                          "%s\n", s->cfg->name, b->b, ipstr);
+    pthread_exit(NULL);
+}
 
-                    if(!client_create_connection(sock, CLIENT_VERSION_DCV1,
-                                                 CLIENT_TYPE_BLOCK, b->clients,
-                                                 s, b, addr_p, len)) {
-                        close(sock);
-                    }
-                }
+/* Set up everything for a block other than its listening sockets and its
+   thread. */
+block_t *block_create(ship_t *s, int b, uint16_t port) {
+    block_t *rv;
+    lobby_t *l;
+    uint32_t rng_seed;
+    int i;
 
-                if(FD_ISSET(b->pcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(b->pcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
+    /* Make space for the block structure. */
+    rv = (block_t *)malloc(sizeof(block_t));
+
+    if(!rv) {
+        debug(DBG_ERROR, "%s(%d): Cannot allocate memory!\n", s->cfg->name, b);
+        return NULL;
+    }
+
+    memset(rv, 0, sizeof(block_t));
 
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s(%d): Accepted PC block connection from "
-                          "%s\n", s->cfg->name, b->b, ipstr);
+    /* Make our pipe */
+    if(pipe(rv->pipes) == -1) {
+        debug(DBG_ERROR, "%s(%d): Cannot create pipe!\n", s->cfg->name, b);
+        goto err_free;
+    }
+
+    set_cloexec(rv->pipes[0]);
+    set_cloexec(rv->pipes[1]);
+
+    /* Set up the event loop for the sockets on the block. */
+    if(!(rv->evl = evloop_create())) {
+        debug(DBG_ERROR, "%s(%d): Cannot create event loop!\n", s->cfg->name,
+              b);
+        goto err_pipes;
+    }
+
+    /* Set up the timers for pinging and timing out clients. */
+    if(twheel_init(&rv->timers, time(NULL))) {
+        debug(DBG_ERROR, "%s(%d): Cannot create timer wheel!\n", s->cfg->name,
+              b);
+        goto err_evl;
+    }
+
+    /* Make room for the client list. */
+    rv->clients = (struct client_queue *)malloc(sizeof(struct client_queue));
+
+    if(!rv->clients) {
+        debug(DBG_ERROR, "%s(%d): Cannot allocate memory for clients!\n",
+              s->cfg->name, b);
+        goto err_timers;
+    }
 
-                    if(!client_create_connection(sock, CLIENT_VERSION_PC,
-                                                 CLIENT_TYPE_BLOCK, b->clients,
-                                                 s, b, addr_p, len)) {
-                        close(sock);
-                    }
-                }
+    /* Fill in the structure. */
+    TAILQ_INIT(rv->clients);
+    TAILQ_INIT(&rv->flush_list);
+    TAILQ_INIT(&rv->move_list);
+    rv->ship = s;
+    rv->b = b;
+    rv->dc_port = port;
+    rv->pc_port = port + 1;
+    rv->gc_port = port + 2;
+    rv->ep3_port = port + 3;
+    rv->bb_port = port + 4;
+    rv->xb_port = port + 5;
 
-                if(FD_ISSET(b->gcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(b->gcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
+    for(i = 0; i < 2; ++i) {
+        rv->dcsock[i] = rv->pcsock[i] = rv->gcsock[i] = -1;
+        rv->ep3sock[i] = rv->bbsock[i] = rv->xbsock[i] = -1;
+    }
 
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s(%d): Accepted GC block connection from "
-                          "%s\n", s->cfg->name, b->b, ipstr);
+    rv->run = 1;
 
-                    if(!client_create_connection(sock, CLIENT_VERSION_GC,
-                                                 CLIENT_TYPE_BLOCK, b->clients,
-                                                 s, b, addr_p, len)) {
-                        close(sock);
-                    }
-                }
+    TAILQ_INIT(&rv->lobbies);
 
-                if(FD_ISSET(b->ep3sock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(b->ep3sock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
+    for(i = 0; i < BLOCK_LOBBY_ID_BUCKETS; ++i) {
+        LIST_INIT(&rv->lobby_ids[i]);
+    }
 
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s(%d): Accepted Episode 3 block "
-                          "connection from %s\n", s->cfg->name, b->b, ipstr);
+    /* Give the block its own Lua state, so that its scripts don't have to wait
+       on the other blocks' scripts. The lobbies need it for their tables. */
+    rv->scripts = script_state_create();
 
-                    if(!client_create_connection(sock, CLIENT_VERSION_EP3,
-                                                 CLIENT_TYPE_BLOCK, b->clients,
-                                                 s, b, addr_p, len)) {
-                        close(sock);
-                    }
-                }
+#ifdef ENABLE_LUA
+    if(!rv->scripts) {
+        debug(DBG_ERROR, "%s(%d): Cannot create script state!\n",
+              s->cfg->name, b);
+        goto err_clients;
+    }
+#endif
 
-                if(FD_ISSET(b->bbsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(b->bbsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
+    /* Create the first 20 lobbies (the default ones) */
+    for(i = 1; i <= 20; ++i) {
+        /* Grab a new lobby. XXXX: Check the return value. */
+        l = lobby_create_default(rv, i, s->lobby_event);
 
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s(%d): Accepted Blue Burst block "
-                          "connection from %s\n", s->cfg->name, b->b, ipstr);
+        /* Add it into our list of lobbies */
+        block_add_lobby(rv, l);
+    }
 
-                    if(!client_create_connection(sock, CLIENT_VERSION_BB,
-                                                 CLIENT_TYPE_BLOCK, b->clients,
-                                                 s, b, addr_p, len)) {
-                        close(sock);
-                    }
-                }
+    /* Create the reader-writer locks */
+    pthread_rwlock_init(&rv->lock, NULL);
+    pthread_rwlock_init(&rv->lobby_lock, NULL);
 
-                if(FD_ISSET(b->xbsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(b->xbsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
+    /* Set up everything needed to share the work with other threads. */
+    pthread_once(&block_thread_once, &block_thread_key_init);
+    pthread_mutex_init(&rv->flush_mutex, NULL);
+    pthread_mutex_init(&rv->move_mutex, NULL);
+    pthread_mutex_init(&rv->work_mutex, NULL);
+    pthread_cond_init(&rv->work_cond, NULL);
+    pthread_cond_init(&rv->done_cond, NULL);
+    pthread_mutex_init(&rv->mkill_mutex, NULL);
 
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s(%d): Accepted Xbox block "
-                          "connection from %s\n", s->cfg->name, b->b, ipstr);
+    twheel_timer_init(&rv->mkill_timer, &block_mkill_timer, rv);
+    twheel_add(&rv->timers, &rv->mkill_timer,
+               time(NULL) + BLOCK_MKILL_INTERVAL);
 
-                    if(!client_create_connection(sock, CLIENT_VERSION_XBOX,
-                                                 CLIENT_TYPE_BLOCK, b->clients,
-                                                 s, b, addr_p, len)) {
-                        close(sock);
-                    }
-                }
-            }
+    /* Initialize the random number generator. The seed value is the current
+       UNIX time, xored with the port (so that each block will use a different
+       seed even though they'll probably get the same timestamp). */
+    rng_seed = (uint32_t)(time(NULL) ^ port);
+    mt19937_init(&rv->rng, rng_seed);
 
-            pthread_rwlock_rdlock(&b->lock);
+    return rv;
 
-            /* Process client connections. */
-            TAILQ_FOREACH(it, b->clients, qentry) {
-                pthread_mutex_lock(&it->mutex);
+#ifdef ENABLE_LUA
+err_clients:
+    free(rv->clients);
+#endif
+err_timers:
+    twheel_destroy(&rv->timers);
+err_evl:
+    evloop_destroy(rv->evl);
+err_pipes:
+    close(rv->pipes[0]);
+    close(rv->pipes[1]);
+err_free:
+    free(rv);
+    return NULL;
+}
 
-                /* Check if this connection was trying to send us something. */
-                if(FD_ISSET(it->sock, &readfds)) {
-                    if(client_process_pkt(it)) {
-                        it->flags |= CLIENT_FLAG_DISCONNECTED;
-                        pthread_mutex_unlock(&it->mutex);
-                        continue;
-                    }
-                }
+/* Tear down a block that was set up with block_create(), disconnecting any
+   clients still on it. Its thread, if it had one, must have already stopped. */
+void block_destroy(block_t *b) {
+    lobby_t *it2, *tmp2;
+    ship_client_t *it, *tmp;
 
-                /* If we have anything to write, check if we can right now. */
-                if(FD_ISSET(it->sock, &writefds)) {
-                    if(it->sendbuf_cur) {
-                        sent = send(it->sock, it->sendbuf + it->sendbuf_start,
-                                    it->sendbuf_cur - it->sendbuf_start, 0);
-
-                        /* If we fail to send, and the error isn't EAGAIN,
-                           bail. */
-                        if(sent == -1) {
-                            if(errno != EAGAIN) {
-                                it->flags |= CLIENT_FLAG_DISCONNECTED;
-                                pthread_mutex_unlock(&it->mutex);
-                                continue;
-                            }
-                        }
-                        else {
-                            it->sendbuf_start += sent;
-
-                            /* If we've sent everything, free the buffer. */
-                            if(it->sendbuf_start == it->sendbuf_cur) {
-                                free(it->sendbuf);
-                                it->sendbuf = NULL;
-                                it->sendbuf_cur = 0;
-                                it->sendbuf_size = 0;
-                                it->sendbuf_start = 0;
-                            }
-                        }
-                    }
-                }
+    /* Disconnect any clients. */
+    pthread_rwlock_wrlock(&b->lock);
 
-                pthread_mutex_unlock(&it->mutex);
-            }
+    it = TAILQ_FIRST(b->clients);
+    while(it) {
+        tmp = TAILQ_NEXT(it, qentry);
+        client_destroy_connection(it, b->clients);
+        it = tmp;
+    }
 
-            pthread_rwlock_unlock(&b->lock);
-        }
+    pthread_rwlock_unlock(&b->lock);
 
-        /* Clean up any dead connections (its not safe to do a TAILQ_REMOVE
-           in the middle of a TAILQ_FOREACH, and client_destroy_connection
-           does indeed use TAILQ_REMOVE). */
-        pthread_rwlock_wrlock(&b->lock);
-        it = TAILQ_FIRST(b->clients);
-        while(it) {
-            tmp = TAILQ_NEXT(it, qentry);
+    /* Destroy the lobbies that exist. */
+    pthread_rwlock_wrlock(&b->lobby_lock);
 
-            if(it->flags & CLIENT_FLAG_DISCONNECTED) {
-                if(it->bb_pl) {
-                    istrncpy16_raw(ic_utf16_to_utf8, nm,
-                                   &it->pl->bb.character.name[2], 64, 14);
-                    debug(DBG_LOG, "Disconnecting %s(%d)\n", nm, it->guildcard);
-                }
-                else if(it->pl) {
-                    debug(DBG_LOG, "Disconnecting %s(%d)\n", it->pl->v1.name,
-                          it->guildcard);
-                }
-                else {
-                    my_ntop(&it->ip_addr, ipstr);
-                    debug(DBG_LOG, "Disconnecting something (IP: %s).\n",
-                          ipstr);
-                }
+    it2 = TAILQ_FIRST(&b->lobbies);
+    while(it2) {
+        tmp2 = TAILQ_NEXT(it2, qentry);
+        lobby_destroy(it2);
+        it2 = tmp2;
+    }
 
-                /* Remove the player from the lobby before disconnecting
-                   them, or else bad things might happen. */
-                lobby_remove_player(it);
-                client_destroy_connection(it, b->clients);
-                --b->num_clients;
-            }
+    pthread_rwlock_unlock(&b->lobby_lock);
 
-            it = tmp;
-        }
+    /* Send off anything left over from the clients that just left. */
+    shipgate_flush_mkills(&b->ship->sg, b);
 
-        pthread_rwlock_unlock(&b->lock);
-    }
+    /* Finish with our cleanup... */
+    script_state_destroy(b->scripts);
+    pthread_mutex_destroy(&b->mkill_mutex);
+    free(b->mkill_buf);
+    pthread_cond_destroy(&b->done_cond);
+    pthread_cond_destroy(&b->work_cond);
+    pthread_mutex_destroy(&b->work_mutex);
+    pthread_mutex_destroy(&b->flush_mutex);
+    pthread_mutex_destroy(&b->move_mutex);
+    pthread_rwlock_destroy(&b->lobby_lock);
+    pthread_rwlock_destroy(&b->lock);
 
-    pthread_exit(NULL);
+    twheel_destroy(&b->timers);
+    evloop_destroy(b->evl);
+    close(b->pipes[0]);
+    close(b->pipes[1]);
+    free(b->clients);
+    free(b);
 }
 
 block_t *block_server_start(ship_t *s, int b, uint16_t port) {
@@ -366,13 +1284,14 @@ block_t *block_server_start(ship_t *s, int b, uint16_t port) {
     int dcsock[2] = { -1, -1 }, pcsock[2] = { -1, -1 };
     int gcsock[2] = { -1, -1 }, ep3sock[2] = { -1, -1 };
     int bbsock[2] = { -1, -1 }, xbsock[2] = { -1, -1 }, i;
-    lobby_t *l, *l2;
-    uint32_t rng_seed;
+    int reuse = block_acceptors > 1;
 
     debug(DBG_LOG, "%s: Starting server for block %d...\n", s->cfg->name, b);
 
-    /* Create the sockets for listening for connections. */
-    dcsock[0] = open_sock(AF_INET, port);
+    /* Create the sockets for listening for connections. If there's going to be
+       more than one acceptor, they'll want to open their own sockets on the
+       same ports later. */
+    dcsock[0] = open_sock_ex(AF_INET, port, reuse);
     if(dcsock[0] < 0) {
         return NULL;
     }
@@ -384,34 +1303,34 @@ block_t *block_server_start(ship_t *s, int b, uint16_t port) {
         perror("setsockopt");
     }
 
-    pcsock[0] = open_sock(AF_INET, port + 1);
+    pcsock[0] = open_sock_ex(AF_INET, port + 1, reuse);
     if(pcsock[0] < 0) {
         goto err_close_dc;
     }
 
-    gcsock[0] = open_sock(AF_INET, port + 2);
+    gcsock[0] = open_sock_ex(AF_INET, port + 2, reuse);
     if(gcsock[0] < 0) {
         goto err_close_pc;
     }
 
-    ep3sock[0] = open_sock(AF_INET, port + 3);
+    ep3sock[0] = open_sock_ex(AF_INET, port + 3, reuse);
     if(ep3sock[0] < 0) {
         goto err_close_gc;
     }
 
-    bbsock[0] = open_sock(AF_INET, port + 4);
+    bbsock[0] = open_sock_ex(AF_INET, port + 4, reuse);
     if(bbsock[0] < 0) {
         goto err_close_ep3;
     }
 
-    xbsock[0] = open_sock(AF_INET, port + 5);
+    xbsock[0] = open_sock_ex(AF_INET, port + 5, reuse);
     if(xbsock[0] < 0) {
         goto err_close_bb;
     }
 
 #ifdef SYLVERANT_ENABLE_IPV6
     if(enable_ipv6) {
-        dcsock[1] = open_sock(AF_INET6, port);
+        dcsock[1] = open_sock_ex(AF_INET6, port, reuse);
         if(dcsock[1] < 0) {
             goto err_close_xb;
         }
@@ -423,68 +1342,37 @@ block_t *block_server_start(ship_t *s, int b, uint16_t port) {
             perror("setsockopt");
         }
 
-        pcsock[1] = open_sock(AF_INET6, port + 1);
+        pcsock[1] = open_sock_ex(AF_INET6, port + 1, reuse);
         if(pcsock[1] < 0) {
             goto err_close_dc_6;
         }
 
-        gcsock[1] = open_sock(AF_INET6, port + 2);
+        gcsock[1] = open_sock_ex(AF_INET6, port + 2, reuse);
         if(gcsock[1] < 0) {
             goto err_close_pc_6;
         }
 
-        ep3sock[1] = open_sock(AF_INET6, port + 3);
+        ep3sock[1] = open_sock_ex(AF_INET6, port + 3, reuse);
         if(ep3sock[1] < 0) {
             goto err_close_gc_6;
         }
 
-        bbsock[1] = open_sock(AF_INET6, port + 4);
+        bbsock[1] = open_sock_ex(AF_INET6, port + 4, reuse);
         if(bbsock[1] < 0) {
             goto err_close_ep3_6;
         }
 
-        xbsock[1] = open_sock(AF_INET6, port + 5);
+        xbsock[1] = open_sock_ex(AF_INET6, port + 5, reuse);
         if(xbsock[1] < 0) {
             goto err_close_bb_6;
         }
     }
 #endif
 
-    /* Make space for the block structure. */
-    rv = (block_t *)malloc(sizeof(block_t));
-
-    if(!rv) {
-        debug(DBG_ERROR, "%s(%d): Cannot allocate memory!\n", s->cfg->name, b);
+    /* Set up the rest of the block. */
+    if(!(rv = block_create(s, b, port)))
         goto err_close_all;
-    }
-
-    memset(rv, 0, sizeof(block_t));
-
-    /* Make our pipe */
-    if(pipe(rv->pipes) == -1) {
-        debug(DBG_ERROR, "%s(%d): Cannot create pipe!\n", s->cfg->name, b);
-        goto err_free;
-    }
-
-    /* Make room for the client list. */
-    rv->clients = (struct client_queue *)malloc(sizeof(struct client_queue));
 
-    if(!rv->clients) {
-        debug(DBG_ERROR, "%s(%d): Cannot allocate memory for clients!\n",
-              s->cfg->name, b);
-        goto err_pipes;
-    }
-
-    /* Fill in the structure. */
-    TAILQ_INIT(rv->clients);
-    rv->ship = s;
-    rv->b = b;
-    rv->dc_port = port;
-    rv->pc_port = port + 1;
-    rv->gc_port = port + 2;
-    rv->ep3_port = port + 3;
-    rv->bb_port = port + 4;
-    rv->xb_port = port + 5;
     rv->dcsock[0] = dcsock[0];
     rv->pcsock[0] = pcsock[0];
     rv->gcsock[0] = gcsock[0];
@@ -497,149 +1385,96 @@ block_t *block_server_start(ship_t *s, int b, uint16_t port) {
     rv->ep3sock[1] = ep3sock[1];
     rv->bbsock[1] = bbsock[1];
     rv->xbsock[1] = xbsock[1];
-    rv->run = 1;
-
-    TAILQ_INIT(&rv->lobbies);
-
-    /* Create the first 20 lobbies (the default ones) */
-    for(i = 1; i <= 20; ++i) {
-        /* Grab a new lobby. XXXX: Check the return value. */
-        l = lobby_create_default(rv, i, s->lobby_event);
-
-        /* Add it into our list of lobbies */
-        TAILQ_INSERT_TAIL(&rv->lobbies, l, qentry);
-    }
-
-    /* Create the reader-writer locks */
-    pthread_rwlock_init(&rv->lock, NULL);
-    pthread_rwlock_init(&rv->lobby_lock, NULL);
-
-    /* Initialize the random number generator. The seed value is the current
-       UNIX time, xored with the port (so that each block will use a different
-       seed even though they'll probably get the same timestamp). */
-    rng_seed = (uint32_t)(time(NULL) ^ port);
-    mt19937_init(&rv->rng, rng_seed);
 
     /* Start up the thread for this block. */
     if(pthread_create(&rv->thd, NULL, &block_thd, rv)) {
         debug(DBG_ERROR, "%s(%d): Cannot start block thread!\n",
               s->cfg->name, b);
-        goto err_lobbies;
+        goto err_thread;
     }
 
     return rv;
 
-err_lobbies:
-    l2 = TAILQ_FIRST(&rv->lobbies);
-    while(l2) {
-        l = TAILQ_NEXT(l2, qentry);
-        lobby_destroy(l2);
-        l2 = l;
-    }
-
-    pthread_rwlock_destroy(&rv->lock);
-    pthread_rwlock_destroy(&rv->lobby_lock);
-    free(rv->clients);
-err_pipes:
-    close(rv->pipes[0]);
-    close(rv->pipes[1]);
-err_free:
-    free(rv);
+err_thread:
+    block_destroy(rv);
 err_close_all:
 #ifdef SYLVERANT_ENABLE_IPV6
     if(enable_ipv6) {
-        close(xbsock[1]);
+        handoff_close(xbsock[1]);
 err_close_bb_6:
-        close(bbsock[1]);
+        handoff_close(bbsock[1]);
 err_close_ep3_6:
-        close(ep3sock[1]);
+        handoff_close(ep3sock[1]);
 err_close_gc_6:
-        close(gcsock[1]);
+        handoff_close(gcsock[1]);
 err_close_pc_6:
-        close(pcsock[1]);
+        handoff_close(pcsock[1]);
 err_close_dc_6:
-        close(dcsock[1]);
+        handoff_close(dcsock[1]);
     }
 err_close_xb:
 #endif
-    close(xbsock[0]);
+    handoff_close(xbsock[0]);
 err_close_bb:
-    close(bbsock[0]);
+    handoff_close(bbsock[0]);
 err_close_ep3:
-    close(ep3sock[0]);
+    handoff_close(ep3sock[0]);
 err_close_gc:
-    close(gcsock[0]);
+    handoff_close(gcsock[0]);
 err_close_pc:
-    close(pcsock[0]);
+    handoff_close(pcsock[0]);
 err_close_dc:
-    close(dcsock[0]);
+    handoff_close(dcsock[0]);
 
     return NULL;
 }
 
 void block_server_stop(block_t *b) {
-    lobby_t *it2, *tmp2;
-    ship_client_t *it, *tmp;
-
     /* Set the flag to kill the block. */
     b->run = 0;
+    clear_menu_images();
 
-    /* Send a byte to the pipe so that we actually break out of the select. */
-    write(b->pipes[0], "\xFF", 1);
+    /* Send a byte to the pipe so that we actually break out of the wait. */
+    block_wakeup(b);
 
     /* Wait for it to die. */
     pthread_join(b->thd, NULL);
 
     /* Close all the sockets so nobody can connect... */
-    close(b->pipes[0]);
-    close(b->pipes[1]);
-    close(b->dcsock[0]);
-    close(b->pcsock[0]);
-    close(b->gcsock[0]);
-    close(b->ep3sock[0]);
-    close(b->bbsock[0]);
-    close(b->xbsock[0]);
+    handoff_close(b->dcsock[0]);
+    handoff_close(b->pcsock[0]);
+    handoff_close(b->gcsock[0]);
+    handoff_close(b->ep3sock[0]);
+    handoff_close(b->bbsock[0]);
+    handoff_close(b->xbsock[0]);
 #ifdef SYLVERANT_ENABLE_IPV6
     if(enable_ipv6) {
-        close(b->dcsock[1]);
-        close(b->pcsock[1]);
-        close(b->gcsock[1]);
-        close(b->ep3sock[1]);
-        close(b->bbsock[1]);
-        close(b->xbsock[1]);
+        handoff_close(b->dcsock[1]);
+        handoff_close(b->pcsock[1]);
+        handoff_close(b->gcsock[1]);
+        handoff_close(b->ep3sock[1]);
+        handoff_close(b->bbsock[1]);
+        handoff_close(b->xbsock[1]);
     }
 #endif
 
-    /* Disconnect any clients. */
-    pthread_rwlock_wrlock(&b->lock);
-
-    it = TAILQ_FIRST(b->clients);
-    while(it) {
-        tmp = TAILQ_NEXT(it, qentry);
-        client_destroy_connection(it, b->clients);
-        it = tmp;
-    }
-
-    pthread_rwlock_unlock(&b->lock);
-
-    /* Destroy the lobbies that exist. */
-    pthread_rwlock_wrlock(&b->lobby_lock);
+    block_destroy(b);
+}
 
-    it2 = TAILQ_FIRST(&b->lobbies);
-    while(it2) {
-        tmp2 = TAILQ_NEXT(it2, qentry);
-        lobby_destroy(it2);
-        it2 = tmp2;
-    }
+void block_wakeup(block_t *b) {
+    write(b->pipes[1], "\xFF", 1);
+}
 
-    pthread_rwlock_unlock(&b->lobby_lock);
+void block_start_gc_protect(ship_client_t *c) {
+    block_t *b = c->cur_block;
 
-    /* Finish with our cleanup... */
-    pthread_rwlock_destroy(&b->lobby_lock);
-    pthread_rwlock_destroy(&b->lock);
+    c->flags |= CLIENT_FLAG_GC_PROTECT;
+    c->join_time = time(NULL);
 
-    free(b->clients);
-    free(b);
+    /* Give them a minute to log in, and make sure the block thread notices the
+       new deadline if it's currently asleep. */
+    twheel_add(&b->timers, &c->protect_timer, c->join_time + 61);
+    block_wakeup(b);
 }
 
 int block_info_reply(ship_client_t *c, uint32_t block) {
@@ -677,25 +1512,43 @@ int block_info_reply(ship_client_t *c, uint32_t block) {
     return send_info_reply(c, string);
 }
 
-lobby_t *block_get_lobby(block_t *b, uint32_t lobby_id) {
-    lobby_t *rv = NULL, *l;
-
-    /* Look through all the lobbies in this block. */
-    TAILQ_FOREACH(l, &b->lobbies, qentry) {
-        pthread_mutex_lock(&l->mutex);
+/* Look up a lobby by ID. The caller must hold the block's lobby_lock. The lobby
+   ID can't change after the lobby is created, so there's no need to lock each
+   lobby to look at it. */
+static lobby_t *block_get_lobby_locked(block_t *b, uint32_t lobby_id) {
+    lobby_t *l;
 
+    LIST_FOREACH(l, &b->lobby_ids[lobby_id & (BLOCK_LOBBY_ID_BUCKETS - 1)],
+                 id_qentry) {
         if(l->lobby_id == lobby_id) {
-            rv = l;
-        }
-
-        pthread_mutex_unlock(&l->mutex);
-
-        if(rv) {
             break;
         }
     }
 
-    return rv;
+    return l;
+}
+
+lobby_t *block_get_lobby(block_t *b, uint32_t lobby_id) {
+    lobby_t *l;
+
+    pthread_rwlock_rdlock(&b->lobby_lock);
+    l = block_get_lobby_locked(b, lobby_id);
+    pthread_rwlock_unlock(&b->lobby_lock);
+
+    return l;
+}
+
+void block_add_lobby(block_t *b, lobby_t *l) {
+    TAILQ_INSERT_TAIL(&b->lobbies, l, qentry);
+    LIST_INSERT_HEAD(&b->lobby_ids[l->lobby_id & (BLOCK_LOBBY_ID_BUCKETS - 1)],
+                     l, id_qentry);
+    clear_game_lists(b);
+}
+
+void block_remove_lobby(block_t *b, lobby_t *l) {
+    TAILQ_REMOVE(&b->lobbies, l, qentry);
+    LIST_REMOVE(l, id_qentry);
+    clear_game_lists(b);
 }
 
 static int join_game(ship_client_t *c, lobby_t *l) {
@@ -826,8 +1679,7 @@ static int join_game(ship_client_t *c, lobby_t *l) {
     /* Try to backup their character data */
     if(c->version != CLIENT_VERSION_BB &&
        (c->flags & CLIENT_FLAG_AUTO_BACKUP)) {
-        if(shipgate_send_cbkup(&ship->sg, c->guildcard, c->cur_block->b,
-                               c->pl->v1.name, &c->pl->v1, 1052)) {
+        if(client_backup_char(c)) {
             /* XXXX: Should probably notify them... */
             return rv;
         }
@@ -867,6 +1719,7 @@ static int dcnte_process_login(ship_client_t *c, dcnte_login_8b_pkt *pkt) {
 
     /* Save what we care about in here. */
     c->guildcard = LE32(pkt->guildcard);
+    ship_index_client(ship, c);
     c->language_code = CLIENT_LANG_JAPANESE;
     c->q_lang = CLIENT_LANG_JAPANESE;
     c->flags |= CLIENT_FLAG_IS_NTE;
@@ -929,6 +1782,7 @@ static int dc_process_login(ship_client_t *c, dc_login_93_pkt *pkt) {
 
     /* Save what we care about in here. */
     c->guildcard = LE32(pkt->guildcard);
+    ship_index_client(ship, c);
     c->language_code = pkt->language_code;
     c->q_lang = pkt->language_code;
 
@@ -944,11 +1798,9 @@ static int dc_process_login(ship_client_t *c, dc_login_93_pkt *pkt) {
         if(menu == MENU_ID_LOBBY) {
             menu = LE32(ext->lobby_id);
 
-            TAILQ_FOREACH(i, &c->cur_block->lobbies, qentry) {
-                if(i->lobby_id == menu && i->type == LOBBY_TYPE_LOBBY) {
-                    c->lobby_req = i;
-                    break;
-                }
+            if((i = block_get_lobby(c->cur_block, menu)) &&
+               i->type == LOBBY_TYPE_LOBBY) {
+                c->lobby_req = i;
             }
         }
     }
@@ -1043,6 +1895,7 @@ static int dcv2_process_login(ship_client_t *c, dcv2_login_9d_pkt *pkt) {
 
     /* Save what we care about in here. */
     c->guildcard = LE32(pkt->guildcard);
+    ship_index_client(ship, c);
     c->language_code = pkt->language_code;
     c->q_lang = pkt->language_code;
 
@@ -1061,11 +1914,9 @@ static int dcv2_process_login(ship_client_t *c, dcv2_login_9d_pkt *pkt) {
         if(menu == MENU_ID_LOBBY) {
             menu = LE32(extd->lobby_id);
 
-            TAILQ_FOREACH(i, &c->cur_block->lobbies, qentry) {
-                if(i->lobby_id == menu && i->type == LOBBY_TYPE_LOBBY) {
-                    c->lobby_req = i;
-                    break;
-                }
+            if((i = block_get_lobby(c->cur_block, menu)) &&
+               i->type == LOBBY_TYPE_LOBBY) {
+                c->lobby_req = i;
             }
         }
     }
@@ -1076,11 +1927,9 @@ static int dcv2_process_login(ship_client_t *c, dcv2_login_9d_pkt *pkt) {
         if(menu == MENU_ID_LOBBY) {
             menu = LE32(extp->lobby_id);
 
-            TAILQ_FOREACH(i, &c->cur_block->lobbies, qentry) {
-                if(i->lobby_id == menu && i->type == LOBBY_TYPE_LOBBY) {
-                    c->lobby_req = i;
-                    break;
-                }
+            if((i = block_get_lobby(c->cur_block, menu)) &&
+               i->type == LOBBY_TYPE_LOBBY) {
+                c->lobby_req = i;
             }
         }
     }
@@ -1159,6 +2008,7 @@ static int gc_process_login(ship_client_t *c, gc_login_9e_pkt *pkt) {
 
     /* Save what we care about in here. */
     c->guildcard = LE32(pkt->guildcard);
+    ship_index_client(ship, c);
     c->language_code = pkt->language_code;
     c->q_lang = pkt->language_code;
 
@@ -1186,11 +2036,9 @@ static int gc_process_login(ship_client_t *c, gc_login_9e_pkt *pkt) {
         if(menu == MENU_ID_LOBBY) {
             menu = LE32(ext->lobby_id);
 
-            TAILQ_FOREACH(i, &c->cur_block->lobbies, qentry) {
-                if(i->lobby_id == menu && i->type == LOBBY_TYPE_LOBBY) {
-                    c->lobby_req = i;
-                    break;
-                }
+            if((i = block_get_lobby(c->cur_block, menu)) &&
+               i->type == LOBBY_TYPE_LOBBY) {
+                c->lobby_req = i;
             }
         }
     }
@@ -1247,6 +2095,7 @@ static int xb_process_login(ship_client_t *c, xb_login_9e_pkt *pkt) {
 
     /* Save what we care about in here. */
     c->guildcard = LE32(pkt->guildcard);
+    ship_index_client(ship, c);
     c->language_code = pkt->language_code;
     c->q_lang = pkt->language_code;
     c->flags |= CLIENT_FLAG_GC_MSG_BOXES;
@@ -1306,6 +2155,7 @@ static int bb_process_login(ship_client_t *c, bb_login_93_pkt *pkt) {
     }
 
     c->guildcard = LE32(pkt->guildcard);
+    ship_index_client(ship, c);
     team_id = LE32(pkt->team_id);
 
     /* See if this person is a GM. */
@@ -1428,6 +2278,8 @@ static int dc_process_char(ship_client_t *c, dc_char_data_pkt *pkt) {
         memcpy(c->blacklist, c->pl->v3.blacklist, 30 * sizeof(uint32_t));
     }
 
+    clear_disp_data(c);
+
     /* Copy out the inventory data */
     memcpy(c->items, c->pl->v1.inv.items, sizeof(item_t) * 30);
     c->item_count = (int)c->pl->v1.inv.item_count;
@@ -1520,6 +2372,7 @@ static int bb_process_char(ship_client_t *c, bb_char_data_pkt *pkt) {
     c->infoboard = (char *)c->pl->bb.infoboard;
     c->c_rank = c->pl->bb.c_rank;
     memcpy(c->blacklist, c->pl->bb.blacklist, 30 * sizeof(uint32_t));
+    clear_disp_data(c);
 
     /* Copy out the inventory data */
     memcpy(c->items, c->pl->bb.inv.items, sizeof(item_t) * 30);
@@ -1586,7 +2439,7 @@ static int bb_process_char(ship_client_t *c, bb_char_data_pkt *pkt) {
 
 /* Process a change lobby packet. */
 static int process_change_lobby(ship_client_t *c, uint32_t item_id) {
-    lobby_t *i, *req = NULL;
+    lobby_t *req = NULL;
     int rv;
 
     /* Make sure they don't have the protection flag on */
@@ -1598,12 +2451,7 @@ static int process_change_lobby(ship_client_t *c, uint32_t item_id) {
 
     pthread_rwlock_rdlock(&c->cur_block->lobby_lock);
 
-    TAILQ_FOREACH(i, &c->cur_block->lobbies, qentry) {
-        if(i->lobby_id == item_id) {
-            req = i;
-            break;
-        }
-    }
+    req = block_get_lobby_locked(c->cur_block, item_id);
 
     /* The requested lobby is non-existant? What to do... */
     if(req == NULL) {
@@ -1693,8 +2541,11 @@ static int dc_process_chat(ship_client_t *c, dc_chat_pkt *pkt) {
                               "you can chat."));
     }
 
-    /* Create a censored version. */
-    cmsg = smutdata_censor_string(u8msg, SMUTDATA_BOTH);
+    /* Create a censored version, if there's anything to censor. */
+    cmsg = NULL;
+
+    if(smutdata_check_string(u8msg, SMUTDATA_BOTH))
+        cmsg = smutdata_censor_string(u8msg, SMUTDATA_BOTH);
 
     /* Send the message to the lobby. */
     i = send_lobby_chat(l, c, u8msg, cmsg);
@@ -1747,7 +2598,11 @@ static int pc_process_chat(ship_client_t *c, dc_chat_pkt *pkt) {
                               "you can chat."));
     }
 
-    cmsg = smutdata_censor_string(u8msg, SMUTDATA_BOTH);
+    /* Create a censored version, if there's anything to censor. */
+    cmsg = NULL;
+
+    if(smutdata_check_string(u8msg, SMUTDATA_BOTH))
+        cmsg = smutdata_censor_string(u8msg, SMUTDATA_BOTH);
 
     /* Send the message to the lobby. */
     i = send_lobby_chat(l, c, u8msg, cmsg);
@@ -2492,13 +3347,16 @@ static int dc_process_done_burst(ship_client_t *c) {
     }
 
     /* Lock the lobby, clear its bursting flag, send the resume game packet to
-       the rest of the lobby, and continue on. */
+       the rest of the lobby, and continue on. The quest lock comes first, since
+       we might have to send the quest (and it protects the quest files). */
+    pthread_rwlock_rdlock(&ship->qlock);
     pthread_mutex_lock(&l->mutex);
 
     /* Handle the end of burst stuff with the lobby */
     if(!(l->flags & LOBBY_FLAG_QUESTING)) {
         l->flags &= ~LOBBY_FLAG_BURSTING;
         c->flags &= ~CLIENT_FLAG_BURSTING;
+        metrics_observe(METRIC_BURST_TIME, metrics_now() - c->burst_start);
 
         if(l->version == CLIENT_VERSION_BB) {
             send_lobby_end_burst(l);
@@ -2513,6 +3371,7 @@ static int dc_process_done_burst(ship_client_t *c) {
     }
 
     pthread_mutex_unlock(&l->mutex);
+    pthread_rwlock_unlock(&ship->qlock);
 
     return rv;
 }
@@ -2747,7 +3606,7 @@ static int process_menu(ship_client_t *c, uint32_t menu_id, uint32_t item_id,
             pthread_rwlock_rdlock(&ship->qlock);
 
             /* Do we have quests configured? */
-            if(!TAILQ_EMPTY(&ship->qmap)) {
+            if(!TAILQ_EMPTY(&ship->qmap.list)) {
                 lang = (menu_id >> 24) & 0xFF;
                 rv = send_quest_list(c, (int)item_id, lang);
             }
@@ -2852,7 +3711,7 @@ static int process_menu(ship_client_t *c, uint32_t menu_id, uint32_t item_id,
 
                 /* Add the lobby to the list of lobbies on the block. */
                 pthread_rwlock_wrlock(&c->cur_block->lobby_lock);
-                TAILQ_INSERT_TAIL(&c->cur_block->lobbies, l, qentry);
+                block_add_lobby(c->cur_block, l);
                 ship_inc_games(ship);
                 ++c->cur_block->num_games;
                 pthread_rwlock_unlock(&c->cur_block->lobby_lock);
@@ -2927,7 +3786,7 @@ static int process_info_req(ship_client_t *c, uint32_t menu_id,
             pthread_rwlock_rdlock(&ship->qlock);
 
             /* Do we have quests configured? */
-            if(!TAILQ_EMPTY(&ship->qmap)) {
+            if(!TAILQ_EMPTY(&ship->qmap.list)) {
                 rv = send_quest_info(c->cur_lobby, item_id, lang);
             }
             else {
@@ -3184,6 +4043,7 @@ static int process_qload_done(ship_client_t *c) {
         return -1;
 
     c->flags |= CLIENT_FLAG_QLOAD_DONE;
+    metrics_observe(METRIC_QUEST_LOAD_TIME, metrics_now() - c->qload_start);
 
     /* See if everyone's done now. */
     for(i = 0; i < l->max_clients; ++i) {
@@ -3199,7 +4059,7 @@ static int process_qload_done(ship_client_t *c) {
     for(i = 0; i < l->max_clients; ++i) {
         if((c2 = l->clients[i]) && c2->version >= CLIENT_VERSION_GC) {
             if(send_simple(c2, QUEST_LOAD_DONE_TYPE, 0))
-                c2->flags |= CLIENT_FLAG_DISCONNECTED;
+                client_disconnect(c2);
         }
     }
 
@@ -3217,7 +4077,7 @@ static int process_qlist(ship_client_t *c) {
     pthread_mutex_lock(&l->mutex);
 
     /* Do we have quests configured? */
-    if(!TAILQ_EMPTY(&ship->qmap)) {
+    if(!TAILQ_EMPTY(&ship->qmap.list)) {
         l->flags |= LOBBY_FLAG_QUESTSEL;
         rv = send_quest_categories(c, c->q_lang);
     }
@@ -3319,16 +4179,18 @@ ship_client_t *block_find_client(block_t *b, uint32_t gc) {
     ship_client_t *it;
 
     pthread_rwlock_rdlock(&b->lock);
+    pthread_rwlock_rdlock(&ship->gc_lock);
 
-    TAILQ_FOREACH(it, b->clients, qentry) {
-        if(it->guildcard == gc) {
-            pthread_rwlock_unlock(&b->lock);
-            return it;
+    LIST_FOREACH(it, &ship->gc_index[gc & (SHIP_GC_INDEX_SIZE - 1)],
+                 gc_qentry) {
+        if(it->guildcard == gc && it->cur_block == b) {
+            break;
         }
     }
 
+    pthread_rwlock_unlock(&ship->gc_lock);
     pthread_rwlock_unlock(&b->lock);
-    return NULL;
+    return it;
 }
 
 /* Process block commands for a Dreamcast client. */
@@ -3356,6 +4218,8 @@ static int dc_process_pkt(ship_client_t *c, uint8_t *pkt) {
         dc->flags = flags;
     }
 
+    metrics_count_pkt(0, type);
+
     switch(type) {
         case LOGIN_8B_TYPE:
             return dcnte_process_login(c, (dcnte_login_8b_pkt *)pkt);
@@ -3425,6 +4289,8 @@ static int dc_process_pkt(ship_client_t *c, uint8_t *pkt) {
                 pthread_mutex_lock(&l->mutex);
                 l->flags &= ~LOBBY_FLAG_BURSTING;
                 c->flags &= ~(CLIENT_FLAG_BURSTING | CLIENT_FLAG_WAIT_QPING);
+                metrics_observe(METRIC_BURST_TIME,
+                                metrics_now() - c->burst_start);
 
                 rv = lobby_resend_burst(l, c);
                 rv = send_simple(c, PING_TYPE, 0) |
@@ -3438,7 +4304,7 @@ static int dc_process_pkt(ship_client_t *c, uint8_t *pkt) {
         case TYPE_05:
             /* If we've already gotten one of these, disconnect the client. */
             if(c->flags & CLIENT_FLAG_GOT_05) {
-                c->flags |= CLIENT_FLAG_DISCONNECTED;
+                client_disconnect(c);
             }
 
             c->flags |= CLIENT_FLAG_GOT_05;
@@ -3540,9 +4406,12 @@ static int dc_process_pkt(ship_client_t *c, uint8_t *pkt) {
                 return xb_process_login(c, (xb_login_9e_pkt *)pkt);
 
         case QUEST_CHUNK_TYPE:
+            /* The client got one of the chunks of the quest it's loading, so
+               send it some more. */
+            return quest_xfer_ack(c);
+
         case QUEST_FILE_TYPE:
-            /* Uhh... Ignore these for now, we've already sent it by the time we
-               get this packet from the client. */
+            /* Nothing to do with these, the chunks are what get counted. */
             return 0;
 
         case QUEST_LOAD_DONE_TYPE:
@@ -3620,12 +4489,14 @@ static int bb_process_pkt(ship_client_t *c, uint8_t *pkt) {
     uint16_t len = LE16(hdr->pkt_len);
     uint32_t flags = LE32(hdr->flags);
 
+    metrics_count_pkt(1, type);
+
     switch(type) {
         case PING_TYPE:
             return 0;
 
         case TYPE_05:
-            c->flags |= CLIENT_FLAG_DISCONNECTED;
+            client_disconnect(c);
             return 0;
 
         case LOGIN_93_TYPE:
@@ -3742,9 +4613,12 @@ static int bb_process_pkt(ship_client_t *c, uint8_t *pkt) {
             return process_qlist_end(c);
 
         case QUEST_CHUNK_TYPE:
+            /* The client got one of the chunks of the quest it's loading, so
+               send it some more. */
+            return quest_xfer_ack(c);
+
         case QUEST_FILE_TYPE:
-            /* Uhh... Ignore these for now, we've already sent it by the time we
-               get this packet from the client. */
+            /* Nothing to do with these, the chunks are what get counted. */
             return 0;
 
         case QUEST_LOAD_DONE_TYPE:
@@ -3765,8 +4639,58 @@ static int bb_process_pkt(ship_client_t *c, uint8_t *pkt) {
     }
 }
 
+/* Time how long it takes to handle a packet, and complain about it if it took
+   too long. This is only used when packet timing has been turned on. */
+static int timed_process_pkt(ship_client_t *c, uint8_t *pkt) {
+    int bb = c->version == CLIENT_VERSION_BB;
+    uint16_t type;
+    int subtype = -1, rv;
+    uint32_t lid = c->cur_lobby ? c->cur_lobby->lobby_id : 0;
+    uint64_t start, elapsed;
+    char sub[8] = "";
+
+    /* Figure out what the packet is before it gets handled, since the PC
+       header gets rewritten along the way. */
+    if(bb)
+        type = LE16(((bb_pkt_hdr_t *)pkt)->pkt_type);
+    else if(c->version == CLIENT_VERSION_PC)
+        type = ((pc_pkt_hdr_t *)pkt)->pkt_type;
+    else
+        type = ((dc_pkt_hdr_t *)pkt)->pkt_type;
+
+    if(type == GAME_COMMAND0_TYPE || type == GAME_COMMAND2_TYPE ||
+       type == GAME_COMMANDC_TYPE || type == GAME_COMMANDD_TYPE)
+        subtype = pkt[bb ? 8 : 4];
+
+    start = metrics_now();
+    rv = bb ? bb_process_pkt(c, pkt) : dc_process_pkt(c, pkt);
+    elapsed = metrics_now() - start;
+
+    metrics_time_pkt(bb, type, subtype, elapsed);
+
+    if(metrics_slow_pkt_ms && elapsed >= metrics_slow_pkt_ms * 1000ULL) {
+        if(subtype >= 0)
+            sprintf(sub, "/0x%02X", subtype);
+
+        debug(DBG_WARN, "Slow packet: 0x%04X%s took %" PRIu64 "ms (block %d, "
+              "lobby %" PRIu32 ", guildcard %" PRIu32 ")\n", type, sub,
+              elapsed / 1000, c->cur_block ? c->cur_block->b : -1, lid,
+              c->guildcard);
+    }
+
+    return rv;
+}
+
 /* Process any packet that comes into a block. */
 int block_process_pkt(ship_client_t *c, uint8_t *pkt) {
+    /* Keep track of how busy the lobby is, for the worker scheduler. */
+    if(c->cur_lobby) {
+        __atomic_add_fetch(&c->cur_lobby->pkt_count, 1, __ATOMIC_RELAXED);
+    }
+
+    if(__atomic_load_n(&metrics_pkt_timing, __ATOMIC_RELAXED))
+        return timed_process_pkt(c, pkt);
+
     switch(c->version) {
         case CLIENT_VERSION_DCV1:
         case CLIENT_VERSION_DCV2:
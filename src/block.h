@@ -20,11 +20,14 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <sys/queue.h>
 
 #include <sylverant/config.h>
 #include <sylverant/mtwist.h>
 
 #include "lobby.h"
+#include "evloop.h"
+#include "twheel.h"
 
 /* Forward declarations. */
 struct ship;
@@ -41,6 +44,14 @@ typedef struct ship_client ship_client_t;
 typedef struct ship ship_t;
 #endif
 
+typedef struct block_worker block_worker_t;
+typedef struct block_acceptor block_acceptor_t;
+
+/* Number of buckets in each block's lobby ID table. Game IDs are handed out
+   sequentially, so this just needs to be a power of two that's larger than the
+   number of games a block usually has at once. */
+#define BLOCK_LOBBY_ID_BUCKETS  256
+
 struct block {
     ship_t *ship;
 
@@ -61,6 +72,36 @@ struct block {
     int xbsock[2];
 
     int pipes[2];
+    evloop_t *evl;
+    twheel_t timers;
+
+    /* Clients with deferred data to write out at the end of this pass through
+       the block's loop. Only touched by the threads that handle the block's
+       clients. */
+    pthread_mutex_t flush_mutex;
+    TAILQ_HEAD(client_flush_queue, ship_client) flush_list;
+
+    /* Clients with movement waiting to go out at the end of this pass through
+       the block's loop (see subcmd_move_aoi). */
+    pthread_mutex_t move_mutex;
+    TAILQ_HEAD(client_move_queue, ship_client) move_list;
+
+    /* Worker threads that the block's clients are spread out over, if any. */
+    int num_workers;
+    int workers_run;
+    struct block_worker *workers;
+    pthread_mutex_t work_mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    int work_gen;
+    int work_left;
+    twheel_timer_t sched_timer;
+
+    /* Threads accepting new connections for the block, if any. The pipe is
+       used to tell them all to stop. */
+    int num_acceptors;
+    struct block_acceptor *acceptors;
+    int acc_pipes[2];
 
     uint16_t dc_port;
     uint16_t pc_port;
@@ -69,13 +110,25 @@ struct block {
     uint16_t bb_port;
     uint16_t xb_port;
 
-    /* Reader-writer lock for the lobby tailqueue */
+    /* Reader-writer lock for the lobby tailqueue (and the ID table) */
     pthread_rwlock_t lobby_lock;
     struct lobby_queue lobbies;
+    struct lobby_id_list lobby_ids[BLOCK_LOBBY_ID_BUCKETS];
     int num_games;
 
     /* Random number generator state */
     struct mt19937_state rng;
+
+    /* Lua state for scripts run on this block (NULL without Lua support). */
+    struct script_state *scripts;
+
+    /* Monster kill count updates waiting to go to the shipgate, see
+       shipgate_send_mkill(). */
+    pthread_mutex_t mkill_mutex;
+    uint8_t *mkill_buf;
+    int mkill_len;
+    int mkill_entries;
+    twheel_timer_t mkill_timer;
 };
 
 #ifndef BLOCK_DEFINED
@@ -85,9 +138,48 @@ typedef struct block block_t;
 
 block_t *block_server_start(ship_t *s, int b, uint16_t port);
 void block_server_stop(block_t *b);
+
+/* The parts of starting and stopping a block that don't involve its sockets or
+   its thread. block_server_start() and block_server_stop() use these, and they
+   can also be used to drive a block's packet handling directly. */
+block_t *block_create(ship_t *s, int b, uint16_t port);
+void block_destroy(block_t *b);
+
+/* Wake up the block's thread, for instance after kicking one of its clients
+   from another thread. */
+void block_wakeup(block_t *b);
+
+/* Number of worker threads each block should use (set on the command line). */
+extern int block_workers;
+
+/* Number of threads each block should accept new connections on (set on the
+   command line). Anything less than 1 means the block's own thread does it. */
+extern int block_acceptors;
+
+/* Is the calling thread one of the ones that handles the block's clients? */
+int block_is_own_thread(block_t *b);
+
+/* Grab the random number generator the calling thread should use for things
+   in the block. Each worker thread has its own, so they don't step on each
+   other. */
+struct mt19937_state *block_rng(block_t *b);
+
+/* Set up the timers that every client on a block needs. This has to be done
+   before the client goes in the block's list. */
+void block_client_timers(ship_client_t *c);
+
+/* Turn on guildcard protection for a client, giving them a minute to log in
+   before they get kicked. */
+void block_start_gc_protect(ship_client_t *c);
+
 int block_process_pkt(ship_client_t *c, uint8_t *pkt);
 
 lobby_t *block_get_lobby(block_t *b, uint32_t lobby_id);
+
+/* Add or remove a lobby to or from the block's list of lobbies. Both of these
+   must be called with the block's lobby_lock held for writing. */
+void block_add_lobby(block_t *b, lobby_t *l);
+void block_remove_lobby(block_t *b, lobby_t *l);
 int block_info_reply(ship_client_t *c, uint32_t block);
 
 ship_client_t *block_find_client(block_t *b, uint32_t gc);
@@ -21,6 +21,7 @@
 #include <string.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
 #include <errno.h>
 #include <math.h>
@@ -32,6 +33,7 @@
 #include <sylverant/mtwist.h>
 #include <sylverant/debug.h>
 #include <sylverant/memory.h>
+#include <sylverant/checksum.h>
 
 #include "ship.h"
 #include "utils.h"
@@ -41,6 +43,8 @@
 #include "subcmd.h"
 #include "mapdata.h"
 #include "items.h"
+#include "quest_xfer.h"
+#include "legit.h"
 
 #ifdef ENABLE_LUA
 #include <lua.h>
@@ -60,6 +64,61 @@ pthread_key_t recvbuf_key;
 /* The key for accessing our thread-specific send buffer. */
 pthread_key_t sendbuf_key;
 
+/* The key for accessing our thread-specific broadcast buffer. */
+pthread_key_t bcastbuf_key;
+
+/* Size of each client's receive buffer. There's always room for at least
+   CLIENT_RECVBUF_MIN_SPACE bytes (the biggest packet there can be) after the
+   start of any partial packet, and the leftover data only gets moved back to
+   the front once it drifts far enough along that there isn't. */
+#define CLIENT_RECVBUF_SIZE         (65536 + 16384)
+#define CLIENT_RECVBUF_MIN_SPACE    65536
+
+/* Don't hang on to more than this many free receive buffers. */
+#define CLIENT_RECVBUF_POOL_MAX     128
+
+/* Free receive buffers, ready to be handed back out to clients. Each buffer in
+   the list holds the pointer to the next one at the very start. */
+static unsigned char *recvbuf_pool = NULL;
+static int recvbuf_pool_count = 0;
+static pthread_mutex_t recvbuf_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Grab a receive buffer for a client, out of the pool if there's one there. */
+static unsigned char *recvbuf_get(void) {
+    unsigned char *rv;
+
+    pthread_mutex_lock(&recvbuf_pool_mutex);
+
+    if((rv = recvbuf_pool)) {
+        recvbuf_pool = *(unsigned char **)rv;
+        --recvbuf_pool_count;
+    }
+
+    pthread_mutex_unlock(&recvbuf_pool_mutex);
+
+    if(!rv && !(rv = (unsigned char *)malloc(CLIENT_RECVBUF_SIZE))) {
+        perror("malloc");
+    }
+
+    return rv;
+}
+
+/* Give a receive buffer back to the pool (or to the heap, if the pool's
+   full). */
+static void recvbuf_put(unsigned char *buf) {
+    pthread_mutex_lock(&recvbuf_pool_mutex);
+
+    if(recvbuf_pool_count < CLIENT_RECVBUF_POOL_MAX) {
+        *(unsigned char **)buf = recvbuf_pool;
+        recvbuf_pool = buf;
+        ++recvbuf_pool_count;
+        buf = NULL;
+    }
+
+    pthread_mutex_unlock(&recvbuf_pool_mutex);
+    free(buf);
+}
+
 /* Destructor for the thread-specific receive buffer */
 static void buf_dtor(void *rb) {
     free(rb);
@@ -77,13 +136,33 @@ int client_init(sylverant_ship_t *cfg) {
         return -1;
     }
 
+    if(pthread_key_create(&bcastbuf_key, &buf_dtor)) {
+        perror("pthread_key_create");
+        return -1;
+    }
+
     return 0;
 }
 
 /* Clean up the clients system. */
 void client_shutdown(void) {
+    unsigned char *tmp;
+
     pthread_key_delete(recvbuf_key);
     pthread_key_delete(sendbuf_key);
+    pthread_key_delete(bcastbuf_key);
+    sendq_pool_cleanup();
+
+    /* Free up everything sitting in the receive buffer pool. */
+    pthread_mutex_lock(&recvbuf_pool_mutex);
+
+    while((tmp = recvbuf_pool)) {
+        recvbuf_pool = *(unsigned char **)tmp;
+        free(tmp);
+    }
+
+    recvbuf_pool_count = 0;
+    pthread_mutex_unlock(&recvbuf_pool_mutex);
 }
 
 /* Create a new connection, storing it in the list of clients. */
@@ -104,6 +183,14 @@ ship_client_t *client_create_connection(int sock, int version, int type,
         perror("setsockopt");
     }
 
+    /* Don't let a slow client hold up the whole thread when sending. Anything
+       that the socket won't take right away goes in the client's send queue
+       instead. */
+    if((i = fcntl(sock, F_GETFL)) == -1 ||
+       fcntl(sock, F_SETFL, i | O_NONBLOCK) == -1) {
+        perror("fcntl");
+    }
+
     /* For the DC versions, set up friendly receive buffers that should ensure
        that we don't try to negotiate window scaling.
        XXXX: Should we do this on GC too? It definitely shouldn't be needed on
@@ -120,10 +207,12 @@ ship_client_t *client_create_connection(int sock, int version, int type,
 
     if(!rv) {
         perror("malloc");
+        close(sock);
         return NULL;
     }
 
     memset(rv, 0, sizeof(ship_client_t));
+    sendq_init(&rv->sendq);
 
     if(type == CLIENT_TYPE_BLOCK) {
         rv->pl = (player_t *)malloc(sizeof(player_t));
@@ -190,13 +279,15 @@ ship_client_t *client_create_connection(int sock, int version, int type,
     rv->cur_block = block;
     rv->arrow = 1;
     rv->last_message = rv->login_time = time(NULL);
-    rv->hdr_size = 4;
+    rv->hdr_size = version == CLIENT_VERSION_BB ? 8 : 4;
 
     /* Create the mutex */
     pthread_mutexattr_init(&attr);
     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
     pthread_mutex_init(&rv->mutex, &attr);
     pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&rv->qxfer_mutex, NULL);
+    pthread_mutex_init(&rv->send_mutex, NULL);
 
     memcpy(&rv->ip_addr, ip, size);
 
@@ -213,14 +304,36 @@ ship_client_t *client_create_connection(int sock, int version, int type,
         rng = &ship->rng;
     }
     else {
-        rng = &block->rng;
+        rng = block_rng(block);
     }
 
-#ifdef ENABLE_LUA
     /* Initialize the script table */
-    lua_newtable(ship->lstate);
-    rv->script_ref = luaL_ref(ship->lstate, LUA_REGISTRYINDEX);
-#endif
+    rv->script_ref = script_table_new(block);
+
+    /* Register the socket with the event loop before anything gets sent, just
+       in case the welcome packet has to be buffered. */
+    if(type == CLIENT_TYPE_BLOCK) {
+        rv->evl = block->evl;
+    }
+    else {
+        rv->evl = ship->evl;
+    }
+
+    /* Once it's in there, the thread running the event loop might go looking
+       at the client, so don't let it until the keys are all set up. */
+    pthread_mutex_lock(&rv->mutex);
+
+    if(evloop_add(rv->evl, sock, EVLOOP_READ, rv)) {
+        pthread_mutex_unlock(&rv->mutex);
+        rv->evl = NULL;
+        goto err;
+    }
+
+    /* Start the capture before anything gets sent, so it has the welcome
+       packet in it too. */
+    if(pkt_log_capture) {
+        pkt_log_start(rv);
+    }
 
     switch(version) {
         case CLIENT_VERSION_DCV1:
@@ -235,7 +348,7 @@ ship_client_t *client_create_connection(int sock, int version, int type,
 
             /* Send the client the welcome packet, or die trying. */
             if(send_dc_welcome(rv, server_seed_dc, client_seed_dc)) {
-                goto err;
+                goto err_welcome;
             }
 
             break;
@@ -252,7 +365,7 @@ ship_client_t *client_create_connection(int sock, int version, int type,
 
             /* Send the client the welcome packet, or die trying. */
             if(send_dc_welcome(rv, server_seed_dc, client_seed_dc)) {
-                goto err;
+                goto err_welcome;
             }
 
             break;
@@ -275,22 +388,29 @@ ship_client_t *client_create_connection(int sock, int version, int type,
 
             CRYPT_CreateKeys(&rv->skey, server_seed_bb, CRYPT_BLUEBURST);
             CRYPT_CreateKeys(&rv->ckey, client_seed_bb, CRYPT_BLUEBURST);
-            rv->hdr_size = 8;
 
             /* Send the client the welcome packet, or die trying. */
             if(send_bb_welcome(rv, server_seed_bb, client_seed_bb)) {
-                goto err;
+                goto err_welcome;
             }
 
             break;
     }
 
+    pthread_mutex_unlock(&rv->mutex);
+
+insert:
     /* Insert it at the end of our list, and we're done. */
     if(type == CLIENT_TYPE_BLOCK) {
+        block_client_timers(rv);
         pthread_rwlock_wrlock(&block->lock);
         TAILQ_INSERT_TAIL(clients, rv, qentry);
         ++block->num_clients;
         pthread_rwlock_unlock(&block->lock);
+
+        if(rv->flags & CLIENT_FLAG_DISCONNECTED) {
+            block_wakeup(block);
+        }
     }
     else {
         TAILQ_INSERT_TAIL(clients, rv, qentry);
@@ -300,11 +420,28 @@ ship_client_t *client_create_connection(int sock, int version, int type,
 
     return rv;
 
+err_welcome:
+    /* The block's thread might already have an event for the client in hand
+       (if it isn't the one setting it up), so leave the cleanup to it. */
+    if(type == CLIENT_TYPE_BLOCK) {
+        rv->flags |= CLIENT_FLAG_DISCONNECTED;
+        pthread_mutex_unlock(&rv->mutex);
+        goto insert;
+    }
+
+    if(rv->logfile) {
+        pkt_log_stop(rv);
+    }
+
+    pthread_mutex_unlock(&rv->mutex);
+
 err:
-#ifdef ENABLE_LUA
     /* Remove the table from the registry */
-    luaL_unref(ship->lstate, LUA_REGISTRYINDEX, rv->script_ref);
-#endif
+    script_table_free(block, rv->script_ref);
+
+    if(rv->evl) {
+        evloop_del(rv->evl, sock);
+    }
 
     close(sock);
 
@@ -317,6 +454,8 @@ err:
         free(rv->pl);
     }
 
+    pthread_mutex_destroy(&rv->qxfer_mutex);
+    pthread_mutex_destroy(&rv->send_mutex);
     pthread_mutex_destroy(&rv->mutex);
 
     free(rv);
@@ -328,30 +467,29 @@ err:
 void client_destroy_connection(ship_client_t *c,
                                struct client_queue *clients) {
     time_t now = time(NULL);
-    char tstr[26];
     script_action_t action = ScriptActionClientShipLogout;
 
     if(!(c->flags & CLIENT_FLAG_TYPE_SHIP))
         action = ScriptActionClientBlockLogout;
 
     TAILQ_REMOVE(clients, c, qentry);
+    ship_unindex_client(ship, c);
 
     /* If the client was on Blue Burst, update their db character */
     if(c->version == CLIENT_VERSION_BB &&
        !(c->flags & CLIENT_FLAG_TYPE_SHIP)) {
         c->bb_pl->character.play_time += now - c->login_time;
-        shipgate_send_cdata(&ship->sg, c->guildcard, c->sec_data.slot,
-                            c->bb_pl, sizeof(sylverant_bb_db_char_t),
-                            c->cur_block->b);
+        client_save_char(c);
         shipgate_send_bb_opts(&ship->sg, c);
     }
 
+    /* Don't lose a backup that was being held back. */
+    client_flush_backup(c);
+
     script_execute(action, c, SCRIPT_ARG_PTR, c, 0);
 
-#ifdef ENABLE_LUA
     /* Remove the table from the registry */
-    luaL_unref(ship->lstate, LUA_REGISTRYINDEX, c->script_ref);
-#endif
+    script_table_free(c->cur_block, c->script_ref);
 
     /* If the user was on a block, notify the shipgate */
     if(c->version != CLIENT_VERSION_BB && c->pl && c->pl->v1.name[0]) {
@@ -377,13 +515,15 @@ void client_destroy_connection(ship_client_t *c,
 
     /* If we were logging the user, close the file */
     if(c->logfile) {
-        ctime_r(&now, tstr);
-        tstr[strlen(tstr) - 1] = 0;
-        fprintf(c->logfile, "[%s] Connection closed\n", tstr);
-        fclose(c->logfile);
+        pktlog_note(c->logfile, "Connection closed\n");
+        pktlog_close(c->logfile);
     }
 
     if(c->sock >= 0) {
+        if(c->evl) {
+            evloop_del(c->evl, c->sock);
+        }
+
         close(c->sock);
     }
 
@@ -391,12 +531,11 @@ void client_destroy_connection(ship_client_t *c,
         release(c->limits);
 
     if(c->recvbuf) {
-        free(c->recvbuf);
+        recvbuf_put(c->recvbuf);
     }
 
-    if(c->sendbuf) {
-        free(c->sendbuf);
-    }
+    sendq_clear(&c->sendq);
+    quest_xfer_cancel(c);
 
     if(c->autoreply) {
         free(c->autoreply);
@@ -410,6 +549,8 @@ void client_destroy_connection(ship_client_t *c,
         free(c->pl);
     }
 
+    free(c->disp_cache);
+
     if(c->bb_pl) {
         free(c->bb_pl);
     }
@@ -426,35 +567,40 @@ void client_destroy_connection(ship_client_t *c,
         free(c->xbl_ip);
     }
 
+    pthread_mutex_destroy(&c->qxfer_mutex);
+    pthread_mutex_destroy(&c->send_mutex);
     pthread_mutex_destroy(&c->mutex);
 
     free(c);
 }
 
 /* Read data from a client that is connected to any port. */
+/* Read in whatever the client has sent us, decrypting and handling each
+   packet right where it landed in the client's receive buffer. */
 int client_process_pkt(ship_client_t *c) {
     ssize_t sz;
-    uint16_t pkt_sz;
+    int pkt_sz;
     int rv = 0;
     unsigned char *rbp;
-    void *tmp;
-    uint8_t *recvbuf = get_recvbuf();
     int hsz = c->hdr_size;
 
-    /* Make sure we got the recvbuf, otherwise, bail. */
-    if(!recvbuf) {
+    /* Make sure we've got somewhere to put the data. The buffer stays with the
+       client for as long as it has part of a packet in it. */
+    if(!c->recvbuf && !(c->recvbuf = recvbuf_get())) {
         return -1;
     }
 
-    /* If we've got anything buffered, copy it out to the main buffer to make
-       the rest of this a bit easier. */
-    if(c->recvbuf_cur) {
-        memcpy(recvbuf, c->recvbuf, c->recvbuf_cur);
-    }
-
     /* Attempt to read, and if we don't get anything, punt. */
-    if((sz = recv(c->sock, recvbuf + c->recvbuf_cur, 65536 - c->recvbuf_cur,
-                  0)) <= 0) {
+    if((sz = recv(c->sock, c->recvbuf + c->recvbuf_cur,
+                  CLIENT_RECVBUF_SIZE - c->recvbuf_cur, 0)) <= 0) {
+        /* The socket is non-blocking, so it may not actually have anything for
+           us, even if it said it did. */
+        if(sz == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                        errno == EINTR)) {
+            rv = 0;
+            goto out;
+        }
+
         if(sz == -1) {
             perror("recv");
         }
@@ -462,9 +608,9 @@ int client_process_pkt(ship_client_t *c) {
         return -1;
     }
 
-    sz += c->recvbuf_cur;
-    c->recvbuf_cur = 0;
-    rbp = recvbuf;
+    c->recvbuf_cur += sz;
+    rbp = c->recvbuf + c->recvbuf_start;
+    sz = c->recvbuf_cur - c->recvbuf_start;
 
     /* As long as what we have is long enough, decrypt it. */
     while(sz >= hsz && rv == 0) {
@@ -526,7 +672,7 @@ int client_process_pkt(ship_client_t *c) {
 
             /* If we're logging the client, write into the log */
             if(c->logfile) {
-                fprint_packet(c->logfile, rbp, pkt_sz, 1);
+                pktlog_packet(c->logfile, PKTLOG_RECV, rbp, pkt_sz);
             }
 
             /* Pass it onto the correct handler. */
@@ -539,44 +685,77 @@ int client_process_pkt(ship_client_t *c) {
 
             rbp += pkt_sz;
             sz -= pkt_sz;
+            c->recvbuf_start += pkt_sz;
 
             c->flags &= ~CLIENT_FLAG_HDR_READ;
         }
         else {
-            /* Nope, we're missing part, break out of the loop, and buffer
-               the remaining data. */
+            /* Nope, we're missing part, break out of the loop, and keep the
+               remaining data for the next pass. */
             break;
         }
     }
 
-    /* If we've still got something left here, buffer it for the next pass. */
-    if(sz && rv == 0) {
-        /* Reallocate the recvbuf for the client if its too small. */
-        if(c->recvbuf_size < sz) {
-            tmp = realloc(c->recvbuf, sz);
-
-            if(!tmp) {
-                perror("realloc");
-                return -1;
-            }
-
-            c->recvbuf = (unsigned char *)tmp;
-            c->recvbuf_size = sz;
-        }
+    if(rv) {
+        return rv;
+    }
 
-        memcpy(c->recvbuf, rbp, sz);
-        c->recvbuf_cur = sz;
+    /* If there's part of a packet left, make sure there's room for the rest of
+       it after what we've got. The data only has to be moved when it gets too
+       close to the end of the buffer. */
+    if(sz && c->recvbuf_start &&
+       CLIENT_RECVBUF_SIZE - c->recvbuf_start < CLIENT_RECVBUF_MIN_SPACE) {
+        memmove(c->recvbuf, rbp, sz);
+        c->recvbuf_start = 0;
+        c->recvbuf_cur = (int)sz;
     }
-    else if(c->recvbuf) {
-        /* Free the buffer, if we've got nothing in it. */
-        free(c->recvbuf);
+
+out:
+    /* If we're all caught up, give the buffer back. */
+    if(c->recvbuf_start == c->recvbuf_cur) {
+        recvbuf_put(c->recvbuf);
         c->recvbuf = NULL;
-        c->recvbuf_size = 0;
+        c->recvbuf_start = c->recvbuf_cur = 0;
     }
 
     return rv;
 }
 
+/* Write out any data that has been buffered for the client. */
+int client_send_queued(ship_client_t *c) {
+    ssize_t left;
+
+    pthread_mutex_lock(&c->send_mutex);
+    left = sendq_flush(&c->sendq, c->sock);
+
+    if(left < 0) {
+        pthread_mutex_unlock(&c->send_mutex);
+        return -1;
+    }
+
+    /* If we've sent everything, stop waiting for the socket to become
+       writable. */
+    if(!left && c->evl) {
+        evloop_mod(c->evl, c->sock, EVLOOP_READ);
+    }
+
+    pthread_mutex_unlock(&c->send_mutex);
+
+    /* Now that there's room, feed in more of the quest they're loading. */
+    if(!left && c->qxfer) {
+        return quest_xfer_pump(c);
+    }
+
+    return 0;
+}
+
+void client_disconnect(ship_client_t *c) {
+    c->flags |= CLIENT_FLAG_DISCONNECTED;
+
+    if(c->cur_block)
+        block_wakeup(c->cur_block);
+}
+
 /* Retrieve the thread-specific recvbuf for the current thread. */
 uint8_t *get_recvbuf(void) {
     uint8_t *recvbuf = (uint8_t *)pthread_getspecific(recvbuf_key);
@@ -781,6 +960,9 @@ int client_give_exp(ship_client_t *c, uint32_t exp) {
     /* If they got any level ups, send out the packet that says so. */
     if(need_lvlup) {
         c->bb_pl->character.level = LE32(level);
+        c->pl->bb.character.level = c->bb_pl->character.level;
+        lobby_members_update(c->cur_lobby);
+
         if(subcmd_send_bb_level(c))
             return -1;
     }
@@ -817,6 +999,9 @@ int client_give_level(ship_client_t *c, uint32_t level_req) {
 
     /* Send the level-up packet. */
     c->bb_pl->character.level = LE32(level_req);
+    c->pl->bb.character.level = c->bb_pl->character.level;
+    lobby_members_update(c->cur_lobby);
+
     if(subcmd_send_bb_level(c))
         return -1;
 
@@ -871,6 +1056,8 @@ int client_give_level_v2(ship_client_t *c, uint32_t level_req) {
     }
 
     c->pl->v1.level = LE32(level_req);
+    clear_disp_data(c);
+    lobby_members_update(c->cur_lobby);
 
     /* Reload them into the lobby. */
     send_lobby_join(c, c->cur_lobby);
@@ -878,6 +1065,106 @@ int client_give_level_v2(ship_client_t *c, uint32_t level_req) {
     return 0;
 }
 
+uint32_t client_char_crc(ship_client_t *c) {
+    sylverant_bb_db_char_t *pl = c->bb_pl;
+    uint32_t inv[30], bank[200], rv;
+    int i;
+
+    /* The item ids get handed out fresh on every login, so they aren't a
+       change worth saving. Leave them out of the CRC. */
+    for(i = 0; i < 30; ++i) {
+        inv[i] = pl->inv.items[i].item_id;
+        pl->inv.items[i].item_id = 0xFFFFFFFF;
+    }
+
+    for(i = 0; i < 200; ++i) {
+        bank[i] = pl->bank.items[i].item_id;
+        pl->bank.items[i].item_id = 0xFFFFFFFF;
+    }
+
+    rv = sylverant_crc32((const uint8_t *)pl, sizeof(sylverant_bb_db_char_t));
+
+    for(i = 0; i < 30; ++i) {
+        pl->inv.items[i].item_id = inv[i];
+    }
+
+    for(i = 0; i < 200; ++i) {
+        pl->bank.items[i].item_id = bank[i];
+    }
+
+    return rv;
+}
+
+int client_save_char(ship_client_t *c) {
+    uint32_t crc;
+
+    if(!c->bb_pl)
+        return -1;
+
+    crc = client_char_crc(c);
+
+    /* If the shipgate already has this, don't bother. */
+    if(c->save_crc_valid && crc == c->save_crc)
+        return 0;
+
+    if(shipgate_send_cdata(&ship->sg, c->guildcard, c->sec_data.slot,
+                           c->bb_pl, sizeof(sylverant_bb_db_char_t),
+                           c->cur_block->b))
+        return -1;
+
+    c->save_crc = crc;
+    c->save_crc_valid = 1;
+    return 0;
+}
+
+static int send_backup(ship_client_t *c, int wait) {
+    time_t now = time(NULL);
+    uint32_t crc;
+
+    if(!c->pl)
+        return -1;
+
+    crc = sylverant_crc32((const uint8_t *)&c->pl->v1, 1052);
+
+    if(c->bkup_crc_valid && crc == c->bkup_crc) {
+        c->bkup_pending = 0;
+        return 0;
+    }
+
+    /* Too soon after the last one, so hang onto it until the interval's up.
+       Whatever the data is by then is what gets sent. */
+    if(wait && c->bkup_crc_valid && now - c->last_bkup < CLIENT_BKUP_INTERVAL) {
+        if(!c->bkup_pending) {
+            c->bkup_pending = 1;
+            twheel_add(&c->cur_block->timers, &c->bkup_timer,
+                       c->last_bkup + CLIENT_BKUP_INTERVAL);
+        }
+
+        return 0;
+    }
+
+    if(shipgate_send_cbkup(&ship->sg, c->guildcard, c->cur_block->b,
+                           c->pl->v1.name, &c->pl->v1, 1052))
+        return -1;
+
+    c->bkup_crc = crc;
+    c->bkup_crc_valid = 1;
+    c->bkup_pending = 0;
+    c->last_bkup = now;
+    return 0;
+}
+
+int client_backup_char(ship_client_t *c) {
+    return send_backup(c, 1);
+}
+
+int client_flush_backup(ship_client_t *c) {
+    if(!c->bkup_pending)
+        return 0;
+
+    return send_backup(c, 0);
+}
+
 static int check_char_v1(ship_client_t *c, player_t *pl) {
     bitfloat_t f1, f2;
 
@@ -1062,7 +1349,7 @@ int client_legit_check(ship_client_t *c, sylverant_limits_t *limits) {
     /* Make sure the player qualifies for legit mode... */
     for(j = 0; j < c->pl->v1.inv.item_count; ++j) {
         item = (sylverant_iitem_t *)&c->pl->v1.inv.items[j];
-        irv = sylverant_limits_check_item(limits, item, v);
+        irv = legit_check_item(limits, item, v);
 
         if(!irv) {
             debug(DBG_LOG, "Potentially non-legit found in inventory (GC: %"
@@ -1111,7 +1398,7 @@ static int client_disconnect_lua(lua_State *l) {
 
     if(lua_islightuserdata(l, 1)) {
         c = (ship_client_t *)lua_touserdata(l, 1);
-        c->flags |= CLIENT_FLAG_DISCONNECTED;
+        client_disconnect(c);
     }
 
     return 0;
@@ -1303,7 +1590,12 @@ static int client_getTable_lua(lua_State *l) {
 
     if(lua_islightuserdata(l, 1)) {
         c = (ship_client_t *)lua_touserdata(l, 1);
-        lua_rawgeti(l, LUA_REGISTRYINDEX, c->script_ref);
+
+        /* The table lives in the state of the client's block. */
+        if(script_state_owns(c->cur_block, l))
+            lua_rawgeti(l, LUA_REGISTRYINDEX, c->script_ref);
+        else
+            lua_pushnil(l);
     }
     else {
         lua_pushnil(l);
@@ -1591,17 +1883,16 @@ static int client_item_lua(lua_State *l) {
 
 static int client_find_lua(lua_State *l) {
     ship_client_t *c;
+    block_t *b;
     uint32_t gc;
-    int i;
 
     if(lua_isinteger(l, 1)) {
         gc = (uint32_t)lua_tointeger(l, 1);
 
-        for(i = 0; i < ship->cfg->blocks; ++i) {
-            if((c = block_find_client(ship->blocks[i], gc))) {
-                lua_pushlightuserdata(l, c);
-                return 1;
-            }
+        if((c = ship_find_client(ship, gc, &b))) {
+            pthread_rwlock_unlock(&b->lock);
+            lua_pushlightuserdata(l, c);
+            return 1;
         }
 
         lua_pushnil(l);
@@ -1724,7 +2015,7 @@ static int client_legitCheckItem_lua(lua_State *l) {
                 return 1;
         }
 
-        rv = sylverant_limits_check_item(ship->def_limits, &item, v);
+        rv = legit_check_item(ship->def_limits, &item, v);
 
         if(!rv) {
             debug(DBG_LOG, "legitCheckItem failed for GC %" PRIu32 " with "
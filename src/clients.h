@@ -40,6 +40,10 @@
 #include "ship.h"
 #include "block.h"
 #include "player.h"
+#include "evloop.h"
+#include "twheel.h"
+#include "sendq.h"
+#include "pktlog.h"
 
 /* Pull in the packet header types. */
 #define PACKETS_H_HEADERS_ONLY
@@ -60,6 +64,10 @@ typedef struct lobby lobby_t;
 #define CLIENT_BLACKLIST_SIZE       30
 #define CLIENT_MAX_QSTACK           32
 
+/* Shortest time, in seconds, between automatic backups of a client's
+   character data (see client_backup_char()). */
+#define CLIENT_BKUP_INTERVAL        60
+
 #ifdef PACKED
 #undef PACKED
 #endif
@@ -83,27 +91,52 @@ typedef struct client_blocklist_entry {
 
 /* Ship server client structure. */
 struct ship_client {
+    /* The things the block looks at for every event, flush or timer on the
+       client come first, so dealing with one only pulls in the first few
+       cache lines of the client rather than striding across all of it. */
     TAILQ_ENTRY(ship_client) qentry;
+    TAILQ_ENTRY(ship_client) flush_qentry;
 
     pthread_mutex_t mutex;
+
+    int version;
+    int sock;
+    int hdr_size;
+    int recvbuf_cur;
+    int recvbuf_start;
+    int flush_pending;
+    uint32_t flags;
+
+    unsigned char *recvbuf;
+    block_t *cur_block;
+    lobby_t *cur_lobby;
+    evloop_t *evl;
+    pktlog_t *logfile;
+    sendq_t sendq;
+
+    /* Held while encrypting and queueing up a packet for the client (and while
+       writing out its queue), since the block's workers can all send to anyone
+       on the block at the same time. Nothing else is locked under it. */
+    pthread_mutex_t send_mutex;
+
+    time_t last_message;
+    time_t last_sent;
+    time_t join_time;
+    time_t login_time;
+
     pkt_header_t pkt;
 
+    /* These are huge, and only touched when actually encrypting or decrypting
+       something, so they go after the hot fields. */
     CRYPT_SETUP ckey;
     CRYPT_SETUP skey;
 
-    int version;
-    int sock;
-    int hdr_size;
-    int client_id;
+    TAILQ_ENTRY(ship_client) move_qentry;
+    LIST_ENTRY(ship_client) gc_qentry;
 
+    int client_id;
     int language_code;
     int cur_area;
-    int recvbuf_cur;
-    int recvbuf_size;
-
-    int sendbuf_cur;
-    int sendbuf_size;
-    int sendbuf_start;
     int item_count;
 
     int autoreply_len;
@@ -117,7 +150,6 @@ struct ship_client {
     struct sockaddr_storage ip_addr;
 
     uint32_t guildcard;
-    uint32_t flags;
     uint32_t arrow;
     uint32_t blocklist_size;
 
@@ -142,14 +174,20 @@ struct ship_client {
 
     item_t items[30];
 
-    block_t *cur_block;
-    lobby_t *cur_lobby;
     player_t *pl;
 
-    unsigned char *recvbuf;
-    unsigned char *sendbuf;
+    /* The last movement subcommand from the client (see subcmd_move_aoi). The
+       block's move_mutex covers all of these. */
+    int move_pending;                   /* On the block's move list */
+    int move_queued;                    /* Not sent out yet */
+    int move_len;
+    uint32_t move_lobby_id;
+    uint8_t move_pkt[0x20];
+
     void *autoreply;
-    FILE *logfile;
+
+    uint8_t *disp_cache;                /* See make_disp_data() in utils.c */
+    uint32_t disp_valid;
 
     char *infoboard;                    /* Points into the player struct. */
     uint8_t *c_rank;                    /* Points into the player struct. */
@@ -160,15 +198,30 @@ struct ship_client {
     sylverant_limits_t *limits;
     xbox_ip_t *xbl_ip;
 
-    time_t last_message;
-    time_t last_sent;
-    time_t join_time;
-    time_t login_time;
+    uint64_t burst_start;               /* For metrics, in microseconds. */
+    uint64_t qload_start;
+
+    twheel_timer_t ping_timer;
+    twheel_timer_t protect_timer;
+    twheel_timer_t bkup_timer;
+
+    struct quest_xfer *qxfer;
+    pthread_mutex_t qxfer_mutex;
+    twheel_timer_t qxfer_timer;
 
     bb_security_data_t sec_data;
     sylverant_bb_db_char_t *bb_pl;
     sylverant_bb_db_opts_t *bb_opts;
 
+    /* CRC32s of the character data the shipgate last got from us, so that the
+       same thing doesn't get sent over again. */
+    uint32_t save_crc;
+    uint32_t bkup_crc;
+    int save_crc_valid;
+    int bkup_crc_valid;
+    int bkup_pending;                   /* Held back by CLIENT_BKUP_INTERVAL */
+    time_t last_bkup;
+
     int script_ref;
     uint64_t aoe_timer;
 
@@ -232,6 +285,9 @@ extern pthread_key_t recvbuf_key;
 /* The key used for the thread-specific send buffer. */
 extern pthread_key_t sendbuf_key;
 
+/* The key used for the thread-specific broadcast buffer. */
+extern pthread_key_t bcastbuf_key;
+
 /* Possible values for the type field of ship_client_t */
 #define CLIENT_TYPE_SHIP        0
 #define CLIENT_TYPE_BLOCK       1
@@ -339,6 +395,15 @@ void client_destroy_connection(ship_client_t *c, struct client_queue *clients);
 /* Read data from a client that is connected to any port. */
 int client_process_pkt(ship_client_t *c);
 
+/* Write out any data that has been buffered for the client. This should only
+   be called when the event loop says the socket is writable. */
+int client_send_queued(ship_client_t *c);
+
+/* Flag a client to be disconnected and make sure the thread that owns it
+   notices. Use this rather than setting CLIENT_FLAG_DISCONNECTED directly when
+   the client may belong to another thread. */
+void client_disconnect(ship_client_t *c);
+
 /* Retrieve the thread-specific recvbuf for the current thread. */
 uint8_t *get_recvbuf(void);
 
@@ -367,6 +432,22 @@ int client_give_level(ship_client_t *c, uint32_t level_req);
 /* Give a PSOv2 client some free level ups. */
 int client_give_level_v2(ship_client_t *c, uint32_t level_req);
 
+/* CRC32 of a Blue Burst client's character data, leaving out the play time and
+   the item ids (which change without anything worth saving changing). */
+uint32_t client_char_crc(ship_client_t *c);
+
+/* Save a Blue Burst client's character data to the shipgate. Nothing is sent
+   if the CRC matches what the shipgate last had. */
+int client_save_char(ship_client_t *c);
+
+/* Back up a client's character data on the shipgate, if it has changed since
+   the last backup. If that was less than CLIENT_BKUP_INTERVAL seconds ago, the
+   backup is held until the interval is up (or the client disconnects). */
+int client_backup_char(ship_client_t *c);
+
+/* Send a backup that's being held back, without waiting for the interval. */
+int client_flush_backup(ship_client_t *c);
+
 /* Check if a client's newly sent character data looks corrupted. */
 int client_check_character(ship_client_t *c, player_t *pl, uint8_t ver);
 
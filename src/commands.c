@@ -43,6 +43,8 @@
 #include "mapdata.h"
 #include "rtdata.h"
 #include "scripts.h"
+#include "metrics.h"
+#include "legit.h"
 #include "version.h"
 
 int handle_dc_gcsend(ship_client_t *s, ship_client_t *d,
@@ -230,7 +232,7 @@ static int handle_max_level(ship_client_t *c, const char *params) {
     return send_txt(c, "%s", __(c, "\tE\tC7Maximum level set."));
 }
 
-/* Usage: /refresh [quests, gms, or limits] */
+/* Usage: /refresh [quests, gms, limits, or drops] */
 static int handle_refresh(ship_client_t *c, const char *params) {
     /* Make sure the requester is a GM. */
     if(!LOCAL_GM(c)) {
@@ -251,6 +253,9 @@ static int handle_refresh(ship_client_t *c, const char *params) {
     else if(!strcmp(params, "limits")) {
         return refresh_limits(c, send_txt);
     }
+    else if(!strcmp(params, "drops")) {
+        return refresh_drops(c, send_txt);
+    }
     else {
         return send_txt(c, "%s", __(c, "\tE\tC7Unknown item to refresh."));
     }
@@ -535,6 +540,7 @@ static int handle_passwd(ship_client_t *c, const char *params) {
 
     /* Copy the new password in. */
     strcpy(l->passwd, params);
+    clear_game_lists(l->block);
 
     pthread_mutex_unlock(&l->mutex);
 
@@ -565,6 +571,7 @@ static int handle_lname(ship_client_t *c, const char *params) {
 
     /* Copy the new name in. */
     strcpy(l->name, params);
+    clear_game_lists(l->block);
 
     pthread_mutex_unlock(&l->mutex);
 
@@ -627,9 +634,11 @@ static int handle_clinfo(ship_client_t *c, const char *params) {
 
     /* Fill in the client's info. */
     my_ntop(&cl->ip_addr, ip);
-    return send_txt(c, "\tE\tC7Name: %s\nIP: %s\nGC: %u\n%s Lv.%d",
+    return send_txt(c, "\tE\tC7Name: %s\nIP: %s\nGC: %u\n%s Lv.%d\n"
+                    "Queued: %zu (peak %zu)",
                     cl->pl->v1.name, ip, cl->guildcard,
-                    classes[cl->pl->v1.ch_class], cl->pl->v1.level + 1);
+                    classes[cl->pl->v1.ch_class], cl->pl->v1.level + 1,
+                    cl->sendq.bytes, cl->sendq.peak);
 }
 
 /* Usage: /gban:d guildcard reason */
@@ -817,7 +826,7 @@ static int handle_legit(ship_client_t *c, const char *params) {
     /* Make sure the player qualifies for legit mode... */
     for(j = 0; j < c->pl->v1.inv.item_count; ++j) {
         item = (sylverant_iitem_t *)&c->pl->v1.inv.items[j];
-        irv = sylverant_limits_check_item(limits, item, v);
+        irv = legit_check_item(limits, item, v);
 
         if(!irv) {
             debug(DBG_LOG, "Potentially non-legit item in legit mode:\n"
@@ -1083,6 +1092,7 @@ static int handle_dconly(ship_client_t *c, const char *params) {
     /* See if we're turning the flag off. */
     if(!strcmp(params, "off")) {
         l->flags &= ~LOBBY_FLAG_DCONLY;
+        clear_game_lists(l->block);
         pthread_mutex_unlock(&l->mutex);
         return send_txt(c, "%s", __(c, "\tE\tC7Dreamcast-only mode off."));
     }
@@ -1102,6 +1112,7 @@ static int handle_dconly(ship_client_t *c, const char *params) {
 
     /* We passed the check, set the flag and unlock the lobby. */
     l->flags |= LOBBY_FLAG_DCONLY;
+    clear_game_lists(l->block);
     pthread_mutex_unlock(&l->mutex);
 
     /* Tell the leader that the command has been activated. */
@@ -1132,6 +1143,7 @@ static int handle_v1only(ship_client_t *c, const char *params) {
     /* See if we're turning the flag off. */
     if(!strcmp(params, "off")) {
         l->flags &= ~LOBBY_FLAG_V1ONLY;
+        clear_game_lists(l->block);
         pthread_mutex_unlock(&l->mutex);
         return send_txt(c, "%s", __(c, "\tE\tC7V1-only mode off."));
     }
@@ -1150,6 +1162,7 @@ static int handle_v1only(ship_client_t *c, const char *params) {
 
     /* We passed the check, set the flag and unlock the lobby. */
     l->flags |= LOBBY_FLAG_V1ONLY;
+    clear_game_lists(l->block);
     pthread_mutex_unlock(&l->mutex);
 
     /* Tell the leader that the command has been activated. */
@@ -1618,6 +1631,7 @@ static int handle_allowgc(ship_client_t *c, const char *params) {
     /* See if we're turning the flag off. */
     if(!strcmp(params, "off")) {
         l->flags &= ~LOBBY_FLAG_GC_ALLOWED;
+        clear_game_lists(l->block);
         pthread_mutex_unlock(&l->mutex);
         return send_txt(c, "%s", __(c, "\tE\tC7Gamecube disallowed."));
     }
@@ -1631,6 +1645,7 @@ static int handle_allowgc(ship_client_t *c, const char *params) {
 
     /* We passed the check, set the flag and unlock the lobby. */
     l->flags |= LOBBY_FLAG_GC_ALLOWED;
+    clear_game_lists(l->block);
     pthread_mutex_unlock(&l->mutex);
 
     /* Tell the leader that the command has been activated. */
@@ -1839,6 +1854,7 @@ static int handle_npc(ship_client_t *c, const char *params) {
 
     /* This command, for now anyway, locks us down to one player mode. */
     l->flags |= LOBBY_FLAG_SINGLEPLAYER | LOBBY_FLAG_HAS_NPC;
+    clear_game_lists(l->block);
 
     /* We're done with the lobby data now... */
     pthread_mutex_unlock(&l->mutex);
@@ -1993,7 +2009,7 @@ static int handle_unignore(ship_client_t *c, const char *params) {
 
 /* Usage: /quit */
 static int handle_quit(ship_client_t *c, const char *params) {
-    c->flags |= CLIENT_FLAG_DISCONNECTED;
+    client_disconnect(c);
     return 0;
 }
 
@@ -2067,7 +2083,7 @@ static int handle_ban_d(ship_client_t *c, const char *params) {
                                          __(i, "1 day"));
                     }
 
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
+                    client_disconnect(i);
                 }
             }
 
@@ -2127,7 +2143,7 @@ static int handle_ban_w(ship_client_t *c, const char *params) {
                                          __(i, "1 week"));
                     }
 
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
+                    client_disconnect(i);
                 }
             }
 
@@ -2188,7 +2204,7 @@ static int handle_ban_m(ship_client_t *c, const char *params) {
                                          __(i, "30 days"));
                     }
 
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
+                    client_disconnect(i);
                 }
             }
 
@@ -2248,7 +2264,7 @@ static int handle_ban_p(ship_client_t *c, const char *params) {
                                          __(i, "Forever"));
                     }
 
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
+                    client_disconnect(i);
                 }
             }
 
@@ -3181,7 +3197,7 @@ static int handle_quest(ship_client_t *c, const char *params) {
     pthread_rwlock_rdlock(&ship->qlock);
 
     /* Do we have quests configured? */
-    if(!TAILQ_EMPTY(&ship->qmap)) {
+    if(!TAILQ_EMPTY(&ship->qmap.list)) {
         /* Find the quest first, since someone might be doing something
            stupid... */
            quest_map_elem_t *e = quest_lookup(&ship->qmap, quest_id);
@@ -3414,7 +3430,7 @@ static int handle_ib(ship_client_t *c, const char *params) {
                                             "this ship."));
                     }
 
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
+                    client_disconnect(i);
                 }
             }
 
@@ -3494,6 +3510,222 @@ static int handle_logme(ship_client_t *c, const char *params) {
 #endif /* DEBUG */
 }
 
+/* Usage: /lprof [reset | budget instructions] */
+static int handle_lprof(ship_client_t *c, const char *params) {
+#ifndef ENABLE_LUA
+    return send_txt(c, "%s", __(c, "\tE\tC7Scripting is not enabled."));
+#else
+    script_stats_t stats[SCRIPT_SLOT_COUNT][SCRIPT_SRC_COUNT];
+    script_stats_t *s;
+    int shown[SCRIPT_SLOT_COUNT][SCRIPT_SRC_COUNT] = { { 0 } };
+    int i, j, k, bi, bj;
+    char str[512];
+    size_t len;
+    unsigned long budget;
+    char *end;
+
+    /* Make sure the requester is a local root. */
+    if(!LOCAL_ROOT(c))
+        return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
+
+    if(!strcmp(params, "reset")) {
+        script_stats_reset();
+        return send_txt(c, "%s", __(c, "\tE\tC7Script stats reset."));
+    }
+    else if(!strncmp(params, "budget ", 7)) {
+        errno = 0;
+        budget = strtoul(params + 7, &end, 10);
+
+        if(errno || *end || budget > UINT32_MAX)
+            return send_txt(c, "%s", __(c, "\tE\tC7Invalid budget."));
+
+        script_set_budget((uint32_t)budget);
+        return send_txt(c, "%s", __(c, "\tE\tC7Script budget set."));
+    }
+    else if(*params) {
+        return send_txt(c, "%s", __(c, "\tE\tC7Unknown parameter."));
+    }
+
+    script_stats_read(stats);
+    len = snprintf(str, sizeof(str), "\tEBudget: %" PRIu32 "\n"
+                   "Event/source: calls, total ms, max ms, kinsns, aborts\n",
+                   script_get_budget());
+
+    /* Show the scripts that have taken the most time, up to 8 of them. */
+    for(k = 0; k < 8 && len < sizeof(str); ++k) {
+        bi = bj = -1;
+
+        for(i = 0; i < SCRIPT_SLOT_COUNT; ++i) {
+            for(j = 0; j < SCRIPT_SRC_COUNT; ++j) {
+                if(shown[i][j] || !stats[i][j].calls)
+                    continue;
+
+                if(bi == -1 ||
+                   stats[i][j].total_ns > stats[bi][bj].total_ns) {
+                    bi = i;
+                    bj = j;
+                }
+            }
+        }
+
+        if(bi == -1)
+            break;
+
+        shown[bi][bj] = 1;
+        s = &stats[bi][bj];
+        len += snprintf(str + len, sizeof(str) - len, "%s/%s: %" PRIu64
+                        ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64
+                        "\n", script_slot_name(bi), script_source_name(bj),
+                        s->calls, s->total_ns / 1000000, s->max_ns / 1000000,
+                        s->insns / 1000, s->aborts);
+    }
+
+    if(k == 0 && len < sizeof(str))
+        snprintf(str + len, sizeof(str) - len, "%s",
+                 __(c, "No scripts have run."));
+
+    return send_message_box(c, "%s", str);
+#endif
+}
+
+/* Usage: /pprof [on | off | reset | slow ms] */
+static int handle_pprof(ship_client_t *c, const char *params) {
+    static const char *names[4] = { "DC ", "BB ", "DC 60/", "BB 60/" };
+    metrics_timings_t *t;
+    metrics_timing_t *tabs[4], *best, *e;
+    int counts[4] = { 0x100, 0x1000, 0x100, 0x100 };
+    int i, j, k, bt = 0, bi = 0;
+    char str[512];
+    size_t len;
+    unsigned long ms;
+    char *end;
+
+    /* Make sure the requester is a local root. */
+    if(!LOCAL_ROOT(c))
+        return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
+
+    if(!strcmp(params, "on")) {
+        __atomic_store_n(&metrics_pkt_timing, 1, __ATOMIC_RELAXED);
+        return send_txt(c, "%s", __(c, "\tE\tC7Packet timing on."));
+    }
+    else if(!strcmp(params, "off")) {
+        __atomic_store_n(&metrics_pkt_timing, 0, __ATOMIC_RELAXED);
+        return send_txt(c, "%s", __(c, "\tE\tC7Packet timing off."));
+    }
+    else if(!strcmp(params, "reset")) {
+        metrics_timing_reset();
+        return send_txt(c, "%s", __(c, "\tE\tC7Packet times reset."));
+    }
+    else if(!strncmp(params, "slow ", 5)) {
+        errno = 0;
+        ms = strtoul(params + 5, &end, 10);
+
+        if(errno || *end || ms > UINT32_MAX)
+            return send_txt(c, "%s", __(c, "\tE\tC7Invalid time."));
+
+        __atomic_store_n(&metrics_slow_pkt_ms, (uint32_t)ms, __ATOMIC_RELAXED);
+        return send_txt(c, "%s", __(c, "\tE\tC7Slow packet time set."));
+    }
+    else if(*params) {
+        return send_txt(c, "%s", __(c, "\tE\tC7Unknown parameter."));
+    }
+
+    if(!(t = (metrics_timings_t *)malloc(sizeof(metrics_timings_t))))
+        return send_txt(c, "%s", __(c, "\tE\tC7Out of memory."));
+
+    metrics_timing_read(t);
+    tabs[0] = t->dc_pkts;
+    tabs[1] = t->bb_pkts;
+    tabs[2] = t->dc_subcmds;
+    tabs[3] = t->bb_subcmds;
+
+    len = snprintf(str, sizeof(str), "\tETiming: %s, slow: %" PRIu32 "ms\n"
+                   "Type: count, total ms, avg us, max ms\n",
+                   metrics_pkt_timing ? "on" : "off", metrics_slow_pkt_ms);
+
+    /* Show the packet types that have taken the most time, up to 8 of them.
+       This is our own copy of the times, so just clear each one out once it
+       has been shown. */
+    for(k = 0; k < 8 && len < sizeof(str); ++k) {
+        best = NULL;
+
+        for(i = 0; i < 4; ++i) {
+            for(j = 0; j < counts[i]; ++j) {
+                e = &tabs[i][j];
+
+                if(e->count && (!best || e->total > best->total)) {
+                    best = e;
+                    bt = i;
+                    bi = j;
+                }
+            }
+        }
+
+        if(!best)
+            break;
+
+        len += snprintf(str + len, sizeof(str) - len, "%s%02X: %" PRIu64
+                        ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 "\n",
+                        names[bt], bi, best->count, best->total / 1000,
+                        best->total / best->count, best->max / 1000);
+        best->count = 0;
+    }
+
+    free(t);
+
+    if(k == 0 && len < sizeof(str))
+        snprintf(str + len, sizeof(str) - len, "%s",
+                 __(c, "No packets have been timed."));
+
+    return send_message_box(c, "%s", str);
+}
+
+/* Usage: /sendq */
+static int handle_sendq(ship_client_t *c, const char *params) {
+    block_t *b = c->cur_block;
+    ship_client_t *i, *top[5];
+    int j, k, n = 0;
+    char str[512];
+    size_t len;
+
+    /* Make sure the requester is a local GM. */
+    if(!LOCAL_GM(c))
+        return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
+
+    /* Find whoever on the block has the most waiting to go out to them. */
+    TAILQ_FOREACH(i, b->clients, qentry) {
+        if(!i->sendq.peak)
+            continue;
+
+        for(j = 0; j < n && top[j]->sendq.bytes >= i->sendq.bytes; ++j) ;
+
+        if(j == 5)
+            continue;
+
+        if(n < 5)
+            ++n;
+
+        for(k = n - 1; k > j; --k)
+            top[k] = top[k - 1];
+
+        top[j] = i;
+    }
+
+    len = snprintf(str, sizeof(str), "\tESend queues: queued, peak, packets\n");
+
+    for(j = 0; j < n && len < sizeof(str); ++j) {
+        len += snprintf(str + len, sizeof(str) - len, "%" PRIu32 ": %zu, %zu, %"
+                        PRIu32 "\n", top[j]->guildcard, top[j]->sendq.bytes,
+                        top[j]->sendq.peak, top[j]->sendq.pkts);
+    }
+
+    if(!n && len < sizeof(str))
+        snprintf(str + len, sizeof(str) - len, "%s",
+                 __(c, "Nobody has had anything queued."));
+
+    return send_message_box(c, "%s", str);
+}
+
 static command_t cmds[] = {
     { "warp"     , handle_warp      },
     { "kill"     , handle_kill      },
@@ -3591,6 +3823,9 @@ static command_t cmds[] = {
     { "ib"       , handle_ib        },
     { "xblink"   , handle_xblink    },
     { "logme"    , handle_logme     },
+    { "lprof"    , handle_lprof     },
+    { "pprof"    , handle_pprof     },
+    { "sendq"    , handle_sendq     },
     { ""         , NULL             }     /* End marker -- DO NOT DELETE */
 };
 
@@ -0,0 +1,464 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(HAVE_SYS_EPOLL_H)
+#include <sys/epoll.h>
+#define EVLOOP_USE_EPOLL
+#elif defined(HAVE_SYS_EVENT_H)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#define EVLOOP_USE_KQUEUE
+#else
+#include <sys/time.h>
+#include <sys/select.h>
+#define EVLOOP_USE_SELECT
+#endif
+
+#include <sylverant/debug.h>
+
+#include "evloop.h"
+
+/* Everything we know about a registered descriptor. The table is indexed by
+   the descriptor itself, since they're small integers anyway. */
+typedef struct evloop_fd {
+    void *data;
+    int events;
+    int used;
+} evloop_fd_t;
+
+struct evloop {
+    pthread_mutex_t mutex;
+    evloop_fd_t *fds;
+    int fds_size;
+
+#if defined(EVLOOP_USE_EPOLL) || defined(EVLOOP_USE_KQUEUE)
+    int kfd;
+#else
+    int max_fd;
+#endif
+};
+
+/* This must be called with the mutex held. */
+static int grow_table(evloop_t *l, int fd) {
+    int sz = l->fds_size ? l->fds_size : 64;
+    evloop_fd_t *tmp;
+
+    while(sz <= fd) {
+        sz <<= 1;
+    }
+
+    if(sz == l->fds_size)
+        return 0;
+
+    if(!(tmp = (evloop_fd_t *)realloc(l->fds, sz * sizeof(evloop_fd_t)))) {
+        debug(DBG_ERROR, "Cannot grow event loop table: %s\n",
+              strerror(errno));
+        return -1;
+    }
+
+    memset(tmp + l->fds_size, 0, (sz - l->fds_size) * sizeof(evloop_fd_t));
+    l->fds = tmp;
+    l->fds_size = sz;
+
+    return 0;
+}
+
+#ifdef EVLOOP_USE_KQUEUE
+static int kq_change(evloop_t *l, int fd, int old, int events) {
+    struct kevent kev[2];
+    int n = 0;
+
+    if((events & EVLOOP_READ) && !(old & EVLOOP_READ))
+        EV_SET(&kev[n++], fd, EVFILT_READ, EV_ADD, 0, 0, 0);
+    else if(!(events & EVLOOP_READ) && (old & EVLOOP_READ))
+        EV_SET(&kev[n++], fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
+
+    if((events & EVLOOP_WRITE) && !(old & EVLOOP_WRITE))
+        EV_SET(&kev[n++], fd, EVFILT_WRITE, EV_ADD, 0, 0, 0);
+    else if(!(events & EVLOOP_WRITE) && (old & EVLOOP_WRITE))
+        EV_SET(&kev[n++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, 0);
+
+    if(n && kevent(l->kfd, kev, n, NULL, 0, NULL) < 0 && errno != ENOENT)
+        return -1;
+
+    return 0;
+}
+#endif
+
+#ifdef EVLOOP_USE_EPOLL
+static uint32_t epoll_flags(int events) {
+    uint32_t rv = 0;
+
+    if(events & EVLOOP_READ)
+        rv |= EPOLLIN;
+
+    if(events & EVLOOP_WRITE)
+        rv |= EPOLLOUT;
+
+    return rv;
+}
+#endif
+
+evloop_t *evloop_create(void) {
+    evloop_t *rv;
+
+    if(!(rv = (evloop_t *)malloc(sizeof(evloop_t)))) {
+        debug(DBG_ERROR, "Cannot allocate event loop: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    memset(rv, 0, sizeof(evloop_t));
+
+#if defined(EVLOOP_USE_EPOLL)
+    if((rv->kfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        debug(DBG_ERROR, "Cannot create epoll instance: %s\n",
+              strerror(errno));
+        free(rv);
+        return NULL;
+    }
+#elif defined(EVLOOP_USE_KQUEUE)
+    if((rv->kfd = kqueue()) < 0) {
+        debug(DBG_ERROR, "Cannot create kqueue: %s\n", strerror(errno));
+        free(rv);
+        return NULL;
+    }
+#else
+    rv->max_fd = -1;
+#endif
+
+    pthread_mutex_init(&rv->mutex, NULL);
+
+    return rv;
+}
+
+void evloop_destroy(evloop_t *l) {
+    if(!l)
+        return;
+
+#if defined(EVLOOP_USE_EPOLL) || defined(EVLOOP_USE_KQUEUE)
+    close(l->kfd);
+#endif
+
+    pthread_mutex_destroy(&l->mutex);
+    free(l->fds);
+    free(l);
+}
+
+int evloop_add(evloop_t *l, int fd, int events, void *data) {
+    int rv = 0;
+#ifdef EVLOOP_USE_EPOLL
+    struct epoll_event ev;
+#endif
+
+    if(fd < 0)
+        return -1;
+
+#ifdef EVLOOP_USE_SELECT
+    if(fd >= FD_SETSIZE) {
+        debug(DBG_WARN, "Descriptor %d too large for select()\n", fd);
+        return -1;
+    }
+#endif
+
+    pthread_mutex_lock(&l->mutex);
+
+    if(fd >= l->fds_size && grow_table(l, fd)) {
+        pthread_mutex_unlock(&l->mutex);
+        return -1;
+    }
+
+#if defined(EVLOOP_USE_EPOLL)
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.events = epoll_flags(events);
+    ev.data.fd = fd;
+
+    if(epoll_ctl(l->kfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        rv = -1;
+#elif defined(EVLOOP_USE_KQUEUE)
+    rv = kq_change(l, fd, 0, events);
+#else
+    if(fd > l->max_fd)
+        l->max_fd = fd;
+#endif
+
+    if(!rv) {
+        l->fds[fd].data = data;
+        l->fds[fd].events = events;
+        l->fds[fd].used = 1;
+    }
+    else {
+        debug(DBG_WARN, "Cannot add descriptor %d to event loop: %s\n", fd,
+              strerror(errno));
+    }
+
+    pthread_mutex_unlock(&l->mutex);
+
+    return rv;
+}
+
+int evloop_mod(evloop_t *l, int fd, int events) {
+    int rv = 0;
+#ifdef EVLOOP_USE_EPOLL
+    struct epoll_event ev;
+#endif
+
+    pthread_mutex_lock(&l->mutex);
+
+    if(fd < 0 || fd >= l->fds_size || !l->fds[fd].used) {
+        pthread_mutex_unlock(&l->mutex);
+        return -1;
+    }
+
+    /* Don't bother the kernel if nothing is changing. */
+    if(l->fds[fd].events == events) {
+        pthread_mutex_unlock(&l->mutex);
+        return 0;
+    }
+
+#if defined(EVLOOP_USE_EPOLL)
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.events = epoll_flags(events);
+    ev.data.fd = fd;
+
+    if(epoll_ctl(l->kfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+        rv = -1;
+#elif defined(EVLOOP_USE_KQUEUE)
+    rv = kq_change(l, fd, l->fds[fd].events, events);
+#endif
+
+    if(!rv)
+        l->fds[fd].events = events;
+
+    pthread_mutex_unlock(&l->mutex);
+
+    return rv;
+}
+
+int evloop_del(evloop_t *l, int fd) {
+    int rv = 0;
+#ifdef EVLOOP_USE_EPOLL
+    struct epoll_event ev;
+#endif
+
+    pthread_mutex_lock(&l->mutex);
+
+    if(fd < 0 || fd >= l->fds_size || !l->fds[fd].used) {
+        pthread_mutex_unlock(&l->mutex);
+        return -1;
+    }
+
+#if defined(EVLOOP_USE_EPOLL)
+    /* Older kernels require a non-NULL event here, even though its ignored. */
+    memset(&ev, 0, sizeof(struct epoll_event));
+
+    if(epoll_ctl(l->kfd, EPOLL_CTL_DEL, fd, &ev) < 0)
+        rv = -1;
+#elif defined(EVLOOP_USE_KQUEUE)
+    rv = kq_change(l, fd, l->fds[fd].events, 0);
+#else
+    if(fd == l->max_fd) {
+        while(l->max_fd >= 0 && (l->max_fd == fd || !l->fds[l->max_fd].used))
+            --l->max_fd;
+    }
+#endif
+
+    memset(&l->fds[fd], 0, sizeof(evloop_fd_t));
+    pthread_mutex_unlock(&l->mutex);
+
+    return rv;
+}
+
+#if defined(EVLOOP_USE_EPOLL)
+int evloop_wait(evloop_t *l, evloop_event_t *evs, int max, int timeout) {
+    struct epoll_event kevs[EVLOOP_MAX_EVENTS];
+    int i, n, fd, rv = 0;
+
+    if(max > EVLOOP_MAX_EVENTS)
+        max = EVLOOP_MAX_EVENTS;
+
+    if((n = epoll_wait(l->kfd, kevs, max, timeout)) < 0) {
+        if(errno == EINTR)
+            return 0;
+
+        return -1;
+    }
+
+    pthread_mutex_lock(&l->mutex);
+
+    for(i = 0; i < n; ++i) {
+        fd = kevs[i].data.fd;
+
+        /* Make sure it wasn't removed while we were waiting. */
+        if(fd >= l->fds_size || !l->fds[fd].used)
+            continue;
+
+        evs[rv].fd = fd;
+        evs[rv].data = l->fds[fd].data;
+        evs[rv].events = 0;
+
+        if(kevs[i].events & EPOLLIN)
+            evs[rv].events |= EVLOOP_READ;
+
+        if(kevs[i].events & EPOLLOUT)
+            evs[rv].events |= EVLOOP_WRITE;
+
+        /* Report hangups as readable too, so that the recv() fails and the
+           connection gets cleaned up the normal way. */
+        if(kevs[i].events & (EPOLLERR | EPOLLHUP))
+            evs[rv].events |= EVLOOP_ERROR | EVLOOP_READ;
+
+        ++rv;
+    }
+
+    pthread_mutex_unlock(&l->mutex);
+
+    return rv;
+}
+#elif defined(EVLOOP_USE_KQUEUE)
+int evloop_wait(evloop_t *l, evloop_event_t *evs, int max, int timeout) {
+    struct kevent kevs[EVLOOP_MAX_EVENTS];
+    struct timespec ts, *tsp = NULL;
+    int i, n, fd, rv = 0;
+
+    if(max > EVLOOP_MAX_EVENTS)
+        max = EVLOOP_MAX_EVENTS;
+
+    if(timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        tsp = &ts;
+    }
+
+    if((n = kevent(l->kfd, NULL, 0, kevs, max, tsp)) < 0) {
+        if(errno == EINTR)
+            return 0;
+
+        return -1;
+    }
+
+    pthread_mutex_lock(&l->mutex);
+
+    for(i = 0; i < n; ++i) {
+        fd = (int)kevs[i].ident;
+
+        if(fd >= l->fds_size || !l->fds[fd].used)
+            continue;
+
+        evs[rv].fd = fd;
+        evs[rv].data = l->fds[fd].data;
+
+        if(kevs[i].filter == EVFILT_WRITE)
+            evs[rv].events = EVLOOP_WRITE;
+        else
+            evs[rv].events = EVLOOP_READ;
+
+        if(kevs[i].flags & EV_ERROR)
+            evs[rv].events |= EVLOOP_ERROR | EVLOOP_READ;
+
+        ++rv;
+    }
+
+    pthread_mutex_unlock(&l->mutex);
+
+    return rv;
+}
+#else
+/* The select() fallback has to rebuild the sets on every call, exactly like
+   the old loops did. Changes made by other threads while we're waiting won't
+   be picked up until the next call. */
+int evloop_wait(evloop_t *l, evloop_event_t *evs, int max, int timeout) {
+    fd_set readfds, writefds;
+    struct timeval tv, *tvp = NULL;
+    int fd, n, nfds, rv = 0;
+
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+
+    pthread_mutex_lock(&l->mutex);
+
+    for(fd = 0; fd <= l->max_fd; ++fd) {
+        if(!l->fds[fd].used)
+            continue;
+
+        if(l->fds[fd].events & EVLOOP_READ)
+            FD_SET(fd, &readfds);
+
+        if(l->fds[fd].events & EVLOOP_WRITE)
+            FD_SET(fd, &writefds);
+    }
+
+    nfds = l->max_fd + 1;
+    pthread_mutex_unlock(&l->mutex);
+
+    if(timeout >= 0) {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        tvp = &tv;
+    }
+
+    if((n = select(nfds, &readfds, &writefds, NULL, tvp)) <= 0) {
+        if(n < 0 && errno != EINTR)
+            return -1;
+
+        return 0;
+    }
+
+    pthread_mutex_lock(&l->mutex);
+
+    for(fd = 0; fd < nfds && rv < max; ++fd) {
+        if(!l->fds[fd].used)
+            continue;
+
+        evs[rv].events = 0;
+
+        if(FD_ISSET(fd, &readfds))
+            evs[rv].events |= EVLOOP_READ;
+
+        if(FD_ISSET(fd, &writefds))
+            evs[rv].events |= EVLOOP_WRITE;
+
+        if(evs[rv].events) {
+            evs[rv].fd = fd;
+            evs[rv].data = l->fds[fd].data;
+            ++rv;
+        }
+    }
+
+    pthread_mutex_unlock(&l->mutex);
+
+    return rv;
+}
+#endif
+
+const char *evloop_backend(void) {
+#if defined(EVLOOP_USE_EPOLL)
+    return "epoll";
+#elif defined(EVLOOP_USE_KQUEUE)
+    return "kqueue";
+#else
+    return "select";
+#endif
+}
@@ -0,0 +1,70 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+/* Event flags. EVLOOP_READ and EVLOOP_WRITE may be requested when adding or
+   modifying a descriptor, EVLOOP_ERROR is only ever reported back. */
+#define EVLOOP_READ     0x00000001
+#define EVLOOP_WRITE    0x00000002
+#define EVLOOP_ERROR    0x00000004
+
+/* The maximum number of events that will be returned by one wait. */
+#define EVLOOP_MAX_EVENTS   64
+
+typedef struct evloop_event {
+    int fd;
+    int events;
+    void *data;
+} evloop_event_t;
+
+struct evloop;
+
+#ifndef EVLOOP_DEFINED
+#define EVLOOP_DEFINED
+typedef struct evloop evloop_t;
+#endif
+
+/* Create a new event loop using the best backend available on this system
+   (epoll on Linux, kqueue on the BSDs and macOS, select() elsewhere). */
+evloop_t *evloop_create(void);
+
+/* Destroy an event loop. Any descriptors still registered are not closed. */
+void evloop_destroy(evloop_t *l);
+
+/* Register a descriptor with the loop. The data pointer is handed back with
+   every event reported on the descriptor. */
+int evloop_add(evloop_t *l, int fd, int events, void *data);
+
+/* Change the set of events that a registered descriptor is waiting on. This
+   is safe to call from any thread, even while another thread is waiting. */
+int evloop_mod(evloop_t *l, int fd, int events);
+
+/* Remove a descriptor from the loop. This must be done before the descriptor
+   is closed. */
+int evloop_del(evloop_t *l, int fd);
+
+/* Wait for up to timeout milliseconds (or forever, if timeout is negative) for
+   something to happen. Returns the number of events filled in, 0 on timeout,
+   or -1 on error. */
+int evloop_wait(evloop_t *l, evloop_event_t *evs, int max, int timeout);
+
+/* Return the name of the backend in use, for logging. */
+const char *evloop_backend(void);
+
+#endif /* !EVLOOP_H */
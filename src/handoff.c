@@ -0,0 +1,353 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <sylverant/debug.h>
+
+#include "handoff.h"
+
+/* The sockets go across in batches of this many, which keeps well under the
+   limit on how many descriptors can go in one message. */
+#define HANDOFF_BATCH   32
+#define HANDOFF_MAGIC   0x48534C53          /* "SLSH" */
+
+typedef struct handoff_sock {
+    int sock;
+    int family;
+    uint16_t port;
+} handoff_sock_t;
+
+typedef struct handoff_list {
+    handoff_sock_t *socks;
+    int count;
+    int size;
+} handoff_list_t;
+
+/* What goes across the Unix socket, along with the descriptors themselves. */
+typedef struct handoff_msg {
+    uint32_t magic;
+    uint32_t count;
+    struct {
+        int32_t family;
+        uint32_t port;
+    } ent[HANDOFF_BATCH];
+} handoff_msg_t;
+
+int handoff_enabled = 0;
+
+static int keeping = 0;
+static handoff_list_t open_socks;           /* Ours */
+static handoff_list_t inherited;            /* From the last image */
+static pthread_mutex_t handoff_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int list_add(handoff_list_t *l, int sock, int family, uint16_t port) {
+    handoff_sock_t *tmp;
+
+    if(l->count == l->size) {
+        tmp = (handoff_sock_t *)realloc(l->socks, sizeof(handoff_sock_t) *
+                                        (l->size ? l->size * 2 : 16));
+        if(!tmp) {
+            debug(DBG_WARN, "Cannot track listening socket: %s\n",
+                  strerror(errno));
+            return -1;
+        }
+
+        l->socks = tmp;
+        l->size = l->size ? l->size * 2 : 16;
+    }
+
+    l->socks[l->count].sock = sock;
+    l->socks[l->count].family = family;
+    l->socks[l->count].port = port;
+    ++l->count;
+    return 0;
+}
+
+static void list_remove(handoff_list_t *l, int i) {
+    l->socks[i] = l->socks[--l->count];
+}
+
+void handoff_add(int sock, int family, uint16_t port) {
+    pthread_mutex_lock(&handoff_mutex);
+    list_add(&open_socks, sock, family, port);
+    pthread_mutex_unlock(&handoff_mutex);
+}
+
+int handoff_take(int family, uint16_t port) {
+    int i, rv = -1;
+
+    pthread_mutex_lock(&handoff_mutex);
+
+    for(i = 0; i < inherited.count; ++i) {
+        if(inherited.socks[i].family == family &&
+           inherited.socks[i].port == port) {
+            rv = inherited.socks[i].sock;
+            list_remove(&inherited, i);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&handoff_mutex);
+    return rv;
+}
+
+void handoff_close(int sock) {
+    int i;
+
+    if(sock < 0)
+        return;
+
+    pthread_mutex_lock(&handoff_mutex);
+
+    if(keeping) {
+        pthread_mutex_unlock(&handoff_mutex);
+        return;
+    }
+
+    for(i = 0; i < open_socks.count; ++i) {
+        if(open_socks.socks[i].sock == sock) {
+            list_remove(&open_socks, i);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&handoff_mutex);
+    close(sock);
+}
+
+void handoff_keep(int keep) {
+    pthread_mutex_lock(&handoff_mutex);
+    keeping = keep && handoff_enabled;
+    pthread_mutex_unlock(&handoff_mutex);
+}
+
+static void close_all(void) {
+    int i;
+
+    for(i = 0; i < open_socks.count; ++i) {
+        close(open_socks.socks[i].sock);
+    }
+
+    open_socks.count = 0;
+    keeping = 0;
+}
+
+static int send_batch(int fd, const handoff_sock_t *socks, int count) {
+    handoff_msg_t msg;
+    struct msghdr hdr;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    int i;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&hdr, 0, sizeof(hdr));
+    memset(cbuf, 0, sizeof(cbuf));
+
+    msg.magic = HANDOFF_MAGIC;
+    msg.count = (uint32_t)count;
+
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof(msg);
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = cbuf;
+    hdr.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+
+    for(i = 0; i < count; ++i) {
+        msg.ent[i].family = socks[i].family;
+        msg.ent[i].port = socks[i].port;
+        memcpy(CMSG_DATA(cmsg) + sizeof(int) * i, &socks[i].sock, sizeof(int));
+    }
+
+    if(sendmsg(fd, &hdr, 0) != (ssize_t)sizeof(msg)) {
+        debug(DBG_ERROR, "Cannot pass listening sockets: %s\n",
+              strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int handoff_exec(char *argv[]) {
+    int sv[2], i, j, argc;
+    char **nargv, fdstr[16];
+
+    pthread_mutex_lock(&handoff_mutex);
+
+    if(!open_socks.count) {
+        debug(DBG_WARN, "No listening sockets to hand off\n");
+        goto err;
+    }
+
+    /* The message just sits in the socket until the new image reads it, so
+       our end can be closed as soon as it's all been sent. */
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+        debug(DBG_ERROR, "Cannot create handoff socket: %s\n", strerror(errno));
+        goto err;
+    }
+
+    for(i = 0; i < open_socks.count; i += HANDOFF_BATCH) {
+        j = open_socks.count - i;
+
+        if(send_batch(sv[0], open_socks.socks + i,
+                      j > HANDOFF_BATCH ? HANDOFF_BATCH : j))
+            goto err_sock;
+    }
+
+    close(sv[0]);
+
+    /* The sockets are in the message now, so our copies can go. */
+    close_all();
+
+    /* Build the new argument list, dropping any --handoff from last time. */
+    for(argc = 0; argv[argc]; ++argc) {
+    }
+
+    if(!(nargv = (char **)malloc(sizeof(char *) * (argc + 3)))) {
+        debug(DBG_ERROR, "Cannot allocate arguments: %s\n", strerror(errno));
+        goto err_recv;
+    }
+
+    for(i = j = 0; i < argc; ++i) {
+        if(!strcmp(argv[i], "--handoff") && i + 1 < argc) {
+            ++i;
+            continue;
+        }
+
+        nargv[j++] = argv[i];
+    }
+
+    sprintf(fdstr, "%d", sv[1]);
+    nargv[j++] = "--handoff";
+    nargv[j++] = fdstr;
+    nargv[j] = NULL;
+
+    pthread_mutex_unlock(&handoff_mutex);
+
+    debug(DBG_LOG, "Handing off to a new ship server image...\n");
+
+    /* When started as just "ship_server", it was found in the PATH, so look
+       for it the same way now. */
+    execvp(nargv[0], nargv);
+
+    /* If we get here, the exec failed. Closing the other end throws away the
+       sockets that were in flight. */
+    debug(DBG_ERROR, "Cannot exec %s: %s\n", nargv[0], strerror(errno));
+    free(nargv);
+    close(sv[1]);
+    return -1;
+
+err_sock:
+    close(sv[0]);
+err_recv:
+    close(sv[1]);
+err:
+    close_all();
+    pthread_mutex_unlock(&handoff_mutex);
+    return -1;
+}
+
+int handoff_recv(int fd) {
+    handoff_msg_t msg;
+    struct msghdr hdr;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    int i, n, sock, rv = 0;
+    ssize_t sz;
+
+    pthread_mutex_lock(&handoff_mutex);
+
+    for(;;) {
+        memset(&hdr, 0, sizeof(hdr));
+        iov.iov_base = &msg;
+        iov.iov_len = sizeof(msg);
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = cbuf;
+        hdr.msg_controllen = sizeof(cbuf);
+
+        if((sz = recvmsg(fd, &hdr, MSG_WAITALL)) == 0)
+            break;
+
+        if(sz != (ssize_t)sizeof(msg) || msg.magic != HANDOFF_MAGIC ||
+           msg.count > HANDOFF_BATCH || (hdr.msg_flags & MSG_CTRUNC)) {
+            debug(DBG_ERROR, "Bad listening socket handoff\n");
+            rv = -1;
+        }
+
+        /* Take whatever descriptors came along, even if the message didn't
+           make sense, so they at least get closed. */
+        n = 0;
+
+        for(cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+            if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+
+            n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+            for(i = 0; i < n; ++i) {
+                memcpy(&sock, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(int));
+
+                if(rv || i >= (int)msg.count ||
+                   list_add(&inherited, sock, msg.ent[i].family,
+                            (uint16_t)msg.ent[i].port))
+                    close(sock);
+            }
+        }
+
+        if(rv || n != (int)msg.count)
+            break;
+    }
+
+    close(fd);
+
+    debug(DBG_LOG, "Inherited %d listening sockets\n", inherited.count);
+    pthread_mutex_unlock(&handoff_mutex);
+    return rv;
+}
+
+void handoff_release(void) {
+    int i;
+
+    pthread_mutex_lock(&handoff_mutex);
+
+    for(i = 0; i < inherited.count; ++i) {
+        debug(DBG_LOG, "Closing unused inherited socket (port %" PRIu16 ")\n",
+              inherited.socks[i].port);
+        close(inherited.socks[i].sock);
+    }
+
+    inherited.count = 0;
+    pthread_mutex_unlock(&handoff_mutex);
+}
@@ -0,0 +1,65 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+
+/* Live restarts. When these are turned on, a restart execs the ship server
+   binary again in place of the in-process restart. The listening sockets stay
+   open across the restart: they're passed to the new image over a Unix socket
+   (with SCM_RIGHTS), and open_sock() hands them back out when the new image
+   asks for the same ports, so nobody trying to connect ever gets refused
+   while the ship comes back up. Connected clients and the shipgate connection
+   are not carried over, they get dropped and reconnect like they would for
+   any other restart. */
+
+/* Set by --live-restart. */
+extern int handoff_enabled;
+
+/* Make a note of a listening socket, so it can be handed off later. */
+void handoff_add(int sock, int family, uint16_t port);
+
+/* Grab an inherited listening socket for the given family and port, if the
+   last image passed one along. Returns -1 if there wasn't one. */
+int handoff_take(int family, uint16_t port);
+
+/* Close a listening socket, unless it's being kept around for a live restart
+   (see handoff_keep()). */
+void handoff_close(int sock);
+
+/* Keep (or stop keeping) the listening sockets open when they're closed, so
+   they're still there to hand off once everything has shut down. This only
+   does anything if live restarts are turned on. */
+void handoff_keep(int keep);
+
+/* Pass all of the listening sockets along and exec the binary again, adding
+   "--handoff fd" to the arguments. argv[0] is looked up the same way the shell
+   would have. This only returns if something went wrong, in which case the
+   sockets have been closed. */
+int handoff_exec(char *argv[]);
+
+/* Read in the sockets passed from the last image over the given fd. */
+int handoff_recv(int fd);
+
+/* Close any inherited sockets that nobody asked for (because the ports in the
+   configuration changed, for instance). */
+void handoff_release(void);
+
+#endif /* !HANDOFF_H */
@@ -0,0 +1,112 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "legit.h"
+
+typedef struct legit_entry {
+    const sylverant_limits_t *limits;
+    uint32_t data[4];
+    uint32_t gen;
+    uint8_t version;
+    uint8_t result;
+} legit_entry_t;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+/* Bumped every time the cache is invalidated. Entries from an older generation
+   are never used. This starts at one so that a freshly allocated (zeroed)
+   cache doesn't have any valid entries in it. */
+static uint32_t cache_gen = 1;
+
+static void make_key(void) {
+    pthread_key_create(&cache_key, &free);
+}
+
+static legit_entry_t *get_cache(void) {
+    legit_entry_t *rv;
+
+    pthread_once(&key_once, &make_key);
+
+    if((rv = (legit_entry_t *)pthread_getspecific(cache_key)))
+        return rv;
+
+    if(!(rv = (legit_entry_t *)calloc(LEGIT_CACHE_SIZE,
+                                      sizeof(legit_entry_t))))
+        return NULL;
+
+    if(pthread_setspecific(cache_key, rv)) {
+        free(rv);
+        return NULL;
+    }
+
+    return rv;
+}
+
+static uint32_t hash_item(const sylverant_limits_t *l, const uint32_t d[4],
+                          uint32_t version) {
+    uint64_t h = (uint64_t)(uintptr_t)l ^ version;
+    int i;
+
+    for(i = 0; i < 4; ++i) {
+        h = (h ^ d[i]) * 0x9E3779B97F4A7C15ULL;
+    }
+
+    return (uint32_t)(h >> 40);
+}
+
+int legit_check_item(sylverant_limits_t *l, sylverant_iitem_t *item,
+                     uint32_t version) {
+    legit_entry_t *cache = get_cache(), *e;
+    uint32_t gen = __atomic_load_n(&cache_gen, __ATOMIC_ACQUIRE);
+    uint32_t d[4];
+    int rv;
+
+    /* The flags and item id in the inventory entry don't matter to the check,
+       only the item data itself does. */
+    d[0] = item->data_l[0];
+    d[1] = item->data_l[1];
+    d[2] = item->data_l[2];
+    d[3] = item->data2_l;
+
+    if(!cache)
+        return sylverant_limits_check_item(l, item, version);
+
+    e = &cache[hash_item(l, d, version) & (LEGIT_CACHE_SIZE - 1)];
+
+    if(e->gen == gen && e->limits == l && e->version == version &&
+       !memcmp(e->data, d, sizeof(d)))
+        return e->result;
+
+    rv = sylverant_limits_check_item(l, item, version);
+
+    e->limits = l;
+    memcpy(e->data, d, sizeof(d));
+    e->gen = gen;
+    e->version = (uint8_t)version;
+    e->result = !!rv;
+
+    return e->result;
+}
+
+void legit_invalidate(void) {
+    __atomic_add_fetch(&cache_gen, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,51 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LEGIT_H
+#define LEGIT_H
+
+#include <stdint.h>
+
+#include <sylverant/items.h>
+
+/* Checking an item against a limits list means walking through all of the
+   rules in the list, and the same items get checked over and over again (every
+   time someone joins a legit game, picks something up in one, and so on). The
+   outcome of a check only depends on the list, the item's data, and the
+   version, so each thread remembers the outcomes of the checks it has done
+   recently, and those get answered with a single lookup.
+
+   This is only a memo of what sylverant_limits_check_item() said. The rules
+   themselves could be read out of the list, but how they get matched is up to
+   libsylverant, and compiling them here would mean keeping a second copy of
+   that logic in step with it.
+
+   The cache is keyed on the address of the limits list, so it has to be thrown
+   out whenever the lists are reloaded (otherwise a new list could end up at
+   the address of an old one). That's what legit_invalidate() is for. */
+#define LEGIT_CACHE_SIZE    1024            /* Per thread, power of two */
+
+/* Check an item against a limits list. This returns the same thing as
+   sylverant_limits_check_item() does: non-zero if the item is allowed. */
+int legit_check_item(sylverant_limits_t *l, sylverant_iitem_t *item,
+                     uint32_t version);
+
+/* Forget everything every thread has cached. Call this after the limits lists
+   have been replaced. */
+void legit_invalidate(void);
+
+#endif /* !LEGIT_H */
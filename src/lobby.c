@@ -41,6 +41,8 @@
 #include "rtdata.h"
 #include "scripts.h"
 #include "quest_functions.h"
+#include "metrics.h"
+#include "legit.h"
 
 #ifdef ENABLE_LUA
 #include <lua.h>
@@ -51,15 +53,318 @@
 static pthread_key_t id_key;
 static pthread_once_t key_once = PTHREAD_ONCE_INIT;
 
+int lobby_stream_joins = 0;
+
 #ifdef DEBUG
 static FILE *logfp = NULL;
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
+/* Chunks of LOBBY_ARENA_CHUNK_SIZE that aren't in use by any lobby right now.
+   Only this many are kept around, anything beyond that is freed. */
+#define LOBBY_ARENA_POOL_MAX    64
+
+static SLIST_HEAD(, lobby_arena_chunk) arena_pool =
+    SLIST_HEAD_INITIALIZER(arena_pool);
+static int arena_pool_count = 0;
+static pthread_mutex_t arena_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Only held long enough to grab a reference to (or swap out) a lobby's list of
+   members, never while anything is being done with one. */
+static pthread_mutex_t members_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static int td(ship_client_t *c, lobby_t *l, void *req);
 
+/* The lobby's mutex is recursive, since things like replaying queued packets
+   at the end of a burst end up back in code that locks it again. */
+static void lobby_init_mutex(lobby_t *l) {
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&l->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* Grab a chunk with room for at least need bytes. Anything that won't fit in a
+   normal chunk gets one all to itself, as does anything asking for one that's
+   exactly the right size. */
+static lobby_arena_chunk_t *arena_chunk_get(size_t need, int exact) {
+    lobby_arena_chunk_t *rv = NULL;
+    size_t sz = LOBBY_ARENA_CHUNK_SIZE;
+
+    if(need > sz || exact) {
+        sz = need;
+    }
+    else {
+        pthread_mutex_lock(&arena_pool_mutex);
+
+        if((rv = SLIST_FIRST(&arena_pool))) {
+            SLIST_REMOVE_HEAD(&arena_pool, qentry);
+            --arena_pool_count;
+        }
+
+        pthread_mutex_unlock(&arena_pool_mutex);
+    }
+
+    if(!rv) {
+        if(!(rv = (lobby_arena_chunk_t *)malloc(sizeof(lobby_arena_chunk_t) +
+                                                sz))) {
+            return NULL;
+        }
+
+        rv->size = sz;
+        rv->data = (uint8_t *)(rv + 1);
+    }
+
+    rv->used = 0;
+    return rv;
+}
+
+static void arena_chunk_put(lobby_arena_chunk_t *c) {
+    if(c->size == LOBBY_ARENA_CHUNK_SIZE) {
+        pthread_mutex_lock(&arena_pool_mutex);
+
+        if(arena_pool_count < LOBBY_ARENA_POOL_MAX) {
+            SLIST_INSERT_HEAD(&arena_pool, c, qentry);
+            ++arena_pool_count;
+            c = NULL;
+        }
+
+        pthread_mutex_unlock(&arena_pool_mutex);
+    }
+
+    free(c);
+}
+
+/* Carve len bytes out of an arena, starting a new chunk if the current one
+   doesn't have room. If held isn't NULL, the size of any new chunk is added to
+   it. */
+static void *arena_take(struct lobby_arena *a, size_t len, size_t *held) {
+    lobby_arena_chunk_t *c = SLIST_FIRST(a);
+    void *rv;
+
+    /* Keep everything aligned for the lobby_pkt_t headers (and anything else
+       that ends up in there). */
+    len = (len + 7) & ~((size_t)7);
+
+    if(!c || c->size - c->used < len) {
+        if(!(c = arena_chunk_get(len, 0))) {
+            return NULL;
+        }
+
+        if(held) {
+            *held += c->size;
+        }
+
+        /* Something too big for a normal chunk uses all of its own, so keep
+           filling up the one we were already using after it. */
+        if(len > LOBBY_ARENA_CHUNK_SIZE && SLIST_FIRST(a)) {
+            SLIST_INSERT_AFTER(SLIST_FIRST(a), c, qentry);
+            c->used = len;
+            return c->data;
+        }
+
+        SLIST_INSERT_HEAD(a, c, qentry);
+    }
+
+    rv = c->data + c->used;
+    c->used += len;
+    return rv;
+}
+
+static void arena_release(struct lobby_arena *a) {
+    lobby_arena_chunk_t *c;
+
+    while((c = SLIST_FIRST(a))) {
+        SLIST_REMOVE_HEAD(a, qentry);
+        arena_chunk_put(c);
+    }
+}
+
+/* Grab space for a queued packet out of the lobby's packet arena. The lobby's
+   mutex must be held. */
+static void *arena_alloc(lobby_t *l, size_t len) {
+    return arena_take(&l->pkt_arena, len, NULL);
+}
+
+/* Throw out everything allocated from the lobby's packet arena. This must only
+   be done once both of the packet queues are empty. */
+static void arena_reset(lobby_t *l) {
+    arena_release(&l->pkt_arena);
+}
+
+/* Reset the arena if neither queue is using any of it anymore. */
+static inline void arena_check_reset(lobby_t *l) {
+    if(STAILQ_EMPTY(&l->pkt_queue) && STAILQ_EMPTY(&l->burst_queue)) {
+        arena_reset(l);
+    }
+}
+
+void lobby_pool_cleanup(void) {
+    lobby_arena_chunk_t *c;
+
+    pthread_mutex_lock(&arena_pool_mutex);
+
+    while((c = SLIST_FIRST(&arena_pool))) {
+        SLIST_REMOVE_HEAD(&arena_pool, qentry);
+        free(c);
+    }
+
+    arena_pool_count = 0;
+    pthread_mutex_unlock(&arena_pool_mutex);
+}
+
+void *lobby_alloc(lobby_t *l, size_t len) {
+    void *rv;
+
+    if((rv = arena_take(&l->arena, len, &l->arena_size))) {
+        memset(rv, 0, len);
+    }
+
+    return rv;
+}
+
+int lobby_reserve(lobby_t *l, size_t len) {
+    lobby_arena_chunk_t *c = SLIST_FIRST(&l->arena);
+
+    len = (len + 7) & ~((size_t)7);
+
+    if(c && c->size - c->used >= len) {
+        return 0;
+    }
+
+    if(!(c = arena_chunk_get(len, 0))) {
+        return -1;
+    }
+
+    SLIST_INSERT_HEAD(&l->arena, c, qentry);
+    l->arena_size += c->size;
+    return 0;
+}
+
+/* Make a new, cleared out, lobby at the start of its own arena, with room for
+   at least extra more bytes in the same chunk. Games come and go all the time,
+   so they get one of the pooled chunks. The default lobbies stick around, so
+   they get one that's exactly the size they need instead. */
+static lobby_t *lobby_new(size_t extra, int exact) {
+    lobby_arena_chunk_t *c;
+    size_t sz = (sizeof(lobby_t) + 7) & ~((size_t)7);
+    lobby_t *l;
+
+#ifdef ENABLE_LUA
+    extra += (sizeof(int) * ScriptActionCount + 7) & ~((size_t)7);
+#endif
+
+    if(!(c = arena_chunk_get(sz + extra, exact))) {
+        return NULL;
+    }
+
+    l = (lobby_t *)c->data;
+    memset(l, 0, sizeof(lobby_t));
+    c->used = sz;
+
+    SLIST_INSERT_HEAD(&l->arena, c, qentry);
+    l->arena_size = c->size;
+
+#ifdef ENABLE_LUA
+    /* Every lobby needs somewhere to keep track of its scripts. */
+    if(!(l->script_ids = (int *)lobby_alloc(l, sizeof(int) *
+                                               ScriptActionCount))) {
+        debug(DBG_WARN, "Couldn't allocate lobby script list!\n");
+    }
+#endif
+
+    return l;
+}
+
+lobby_members_t *lobby_members_get(lobby_t *l) {
+    lobby_members_t *m;
+
+    pthread_mutex_lock(&members_mutex);
+
+    if((m = l->members))
+        __atomic_add_fetch(&m->refcnt, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&members_mutex);
+
+    return m;
+}
+
+void lobby_members_put(lobby_members_t *m) {
+    if(m && !__atomic_sub_fetch(&m->refcnt, 1, __ATOMIC_ACQ_REL))
+        free(m);
+}
+
+/* Put out a new list of the lobby's members. This must be called with the
+   lobby's mutex held, after anyone has joined or left. If there's no memory
+   for a new list, the old one is thrown away so nobody sees a stale one. */
+static void lobby_publish_members(lobby_t *l) {
+    lobby_members_t *m, *old;
+    lobby_member_t *e;
+    ship_client_t *c;
+    int i;
+
+    if((m = (lobby_members_t *)malloc(sizeof(lobby_members_t)))) {
+        m->refcnt = 1;
+        m->count = 0;
+
+        for(i = 0; i < l->max_clients; ++i) {
+            if(!(c = l->clients[i]))
+                continue;
+
+            e = &m->members[m->count++];
+            e->guildcard = c->guildcard;
+            e->client_id = (uint8_t)i;
+            e->version = (uint8_t)c->version;
+
+            if(c->pl) {
+                e->level = c->pl->v1.level;
+                e->ch_class = c->pl->v1.ch_class;
+                e->language = c->pl->v1.inv.language;
+                memcpy(e->name, c->pl->v1.name, 16);
+            }
+            else {
+                e->level = 0;
+                e->ch_class = e->language = 0;
+                memset(e->name, 0, 16);
+            }
+        }
+    }
+    else {
+        debug(DBG_WARN, "Couldn't allocate lobby member list!\n");
+    }
+
+    pthread_mutex_lock(&members_mutex);
+    old = l->members;
+    l->members = m;
+    pthread_mutex_unlock(&members_mutex);
+
+    lobby_members_put(old);
+}
+
+void lobby_members_update(lobby_t *l) {
+    if(!l)
+        return;
+
+    pthread_mutex_lock(&l->mutex);
+    lobby_publish_members(l);
+    pthread_mutex_unlock(&l->mutex);
+}
+
+/* Free a lobby and everything else in its arena. */
+static void lobby_free(lobby_t *l) {
+    struct lobby_arena a = l->arena;
+
+    /* Anyone still looking at the member list keeps it around themselves. */
+    lobby_members_put(l->members);
+
+    /* The lobby is in one of the chunks, so don't look at it after this. */
+    arena_release(&a);
+}
+
 lobby_t *lobby_create_default(block_t *block, uint32_t lobby_id, uint8_t ev) {
-    lobby_t *l = (lobby_t *)malloc(sizeof(lobby_t));
+    lobby_t *l = lobby_new(0, 1);
 
     /* If we don't have a lobby, bail. */
     if(!l) {
@@ -68,9 +373,7 @@ lobby_t *lobby_create_default(block_t *block, uint32_t lobby_id, uint8_t ev) {
         return NULL;
     }
 
-    /* Clear it, and set up the specified parameters. */
-    memset(l, 0, sizeof(lobby_t));
-
+    /* Set up the specified parameters. */
     l->lobby_id = lobby_id;
     l->type = LOBBY_TYPE_LOBBY;
     l->max_clients = LOBBY_MAX_CLIENTS;
@@ -78,6 +381,7 @@ lobby_t *lobby_create_default(block_t *block, uint32_t lobby_id, uint8_t ev) {
     l->min_level = 0;
     l->max_level = 9001;                /* Its OVER 9000! */
     l->event = ev;
+    rng_seed(&l->rng, mt19937_genrand_int32(block_rng(block)));
 
     /* Fill in the name of the lobby. */
     if(lobby_id <= 15) {
@@ -91,23 +395,20 @@ lobby_t *lobby_create_default(block_t *block, uint32_t lobby_id, uint8_t ev) {
     /* Initialize the (unused) packet queue */
     STAILQ_INIT(&l->pkt_queue);
 
+    /* Not assigned to a worker thread until someone needs it to be. */
+    l->worker = -1;
+
 #ifdef ENABLE_LUA
     /* Initialize the script table */
-    lua_newtable(block->ship->lstate);
-    l->script_ref = luaL_ref(block->ship->lstate, LUA_REGISTRYINDEX);
-    lua_newtable(block->ship->lstate);
-    l->script_table = luaL_ref(block->ship->lstate, LUA_REGISTRYINDEX);
-
-    if(!(l->script_ids = (int *)malloc(sizeof(int) * ScriptActionCount)))
-        debug(DBG_WARN, "Couldn't allocate lobby script list!\n");
-    else
-        memset(l->script_ids, 0, sizeof(int) * ScriptActionCount);
+    l->script_ref = script_table_new(block);
+    l->script_table = script_table_new(block);
 
     SLIST_INIT(&l->qfunc_list);
+    SLIST_INIT(&l->qfunc_free);
 #endif
 
     /* Initialize the lobby mutex. */
-    pthread_mutex_init(&l->mutex, NULL);
+    lobby_init_mutex(l);
 
     return l;
 }
@@ -206,8 +507,10 @@ void lobby_print_info(lobby_t *l, FILE *fp) {
     fdebug(fp, DBG_LOG, "         Battle/Challenge: %d/%d\n",
            (int)l->battle, (int)l->challenge);
     fdebug(fp, DBG_LOG, "         Difficulty: %d\n", (int)l->difficulty);
+    fdebug(fp, DBG_LOG, "         Drop Seed: %08" PRIx32 "\n", l->rng.seed);
     fdebug(fp, DBG_LOG, "         Enemies Array: %p\n", l->map_enemies);
     fdebug(fp, DBG_LOG, "         Object Array: %p\n", l->map_objs);
+    fdebug(fp, DBG_LOG, "         Memory: %zu bytes\n", l->arena_size);
 
     if(l->qid)
         fdebug(fp, DBG_LOG, "         Quest ID: %" PRIu32 "\n", l->qid);
@@ -228,7 +531,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
                            uint8_t v2, int version, uint8_t section,
                            uint8_t event, uint8_t episode, ship_client_t *c,
                            uint8_t single_player) {
-    lobby_t *l = (lobby_t *)malloc(sizeof(lobby_t));
+    lobby_t *l = lobby_new(0, 0);
     uint32_t *pid, id;
     int i;
 
@@ -244,7 +547,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
     if(!(pid = (uint32_t *)pthread_getspecific(id_key))) {
         if(!(pid = (uint32_t *)malloc(sizeof(uint32_t)))) {
             debug(DBG_WARN, "Couldn't allocate key: %s\n", strerror(errno));
-            free(l);
+            lobby_free(l);
             return NULL;
         }
 
@@ -274,9 +577,6 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
         /* Let's be optimistic for now until we can prove otherwise. */
         version = CLIENT_VERSION_GC;
 
-    /* Clear it. */
-    memset(l, 0, sizeof(lobby_t));
-
     /* Set up the specified parameters. */
     l->lobby_id = id;
     l->type = LOBBY_TYPE_GAME;
@@ -334,8 +634,11 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
     TAILQ_INIT(&l->item_queue);
     STAILQ_INIT(&l->burst_queue);
 
+    /* Not assigned to a worker thread until someone needs it to be. */
+    l->worker = -1;
+
     /* Initialize the lobby mutex. */
-    pthread_mutex_init(&l->mutex, NULL);
+    lobby_init_mutex(l);
 
     /* We need episode to be either 1 or 2 for the below map selection code to
        work. On PSODC and PSOPC, it'll be 0 at this point, so make it 1 (as it
@@ -350,7 +653,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
            (c->flags & CLIENT_FLAG_IS_NTE)) {
             for(i = 0; i < 0x20; ++i) {
                 if(dcnte_maps[i] != 1) {
-                    l->maps[i] = mt19937_genrand_int32(&block->rng) %
+                    l->maps[i] = mt19937_genrand_int32(block_rng(block)) %
                         dcnte_maps[i];
                 }
             }
@@ -358,7 +661,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
         else if(!single_player) {
             for(i = 0; i < 0x20; ++i) {
                 if(maps[episode - 1][i] != 1) {
-                    l->maps[i] = mt19937_genrand_int32(&block->rng) %
+                    l->maps[i] = mt19937_genrand_int32(block_rng(block)) %
                         maps[episode - 1][i];
                 }
             }
@@ -366,7 +669,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
         else {
             for(i = 0; i < 0x20; ++i) {
                 if(sp_maps[episode - 1][i] != 1) {
-                    l->maps[i] = mt19937_genrand_int32(&block->rng) %
+                    l->maps[i] = mt19937_genrand_int32(block_rng(block)) %
                         sp_maps[episode - 1][i];
                 }
             }
@@ -380,7 +683,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
                     l->maps[i] = c->next_maps[i];
                 }
                 else {
-                    l->maps[i] = mt19937_genrand_int32(&block->rng) %
+                    l->maps[i] = mt19937_genrand_int32(block_rng(block)) %
                         dcnte_maps[i];
                 }
             }
@@ -391,7 +694,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
                     l->maps[i] = c->next_maps[i];
                 }
                 else {
-                    l->maps[i] = mt19937_genrand_int32(&block->rng) %
+                    l->maps[i] = mt19937_genrand_int32(block_rng(block)) %
                         maps[episode - 1][i];
                 }
             }
@@ -402,7 +705,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
                     l->maps[i] = c->next_maps[i];
                 }
                 else {
-                    l->maps[i] = mt19937_genrand_int32(&block->rng) %
+                    l->maps[i] = mt19937_genrand_int32(block_rng(block)) %
                         sp_maps[episode - 1][i];
                 }
             }
@@ -412,6 +715,10 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
         c->next_maps = NULL;
     }
 
+    /* Make sure all of the state for the enemies and objects fits together
+       with the rest of the game. */
+    lobby_reserve(l, map_game_footprint(l));
+
     /* If its a Blue Burst lobby, set up the enemy data. */
     if(version == CLIENT_VERSION_BB && bb_load_game_enemies(l)) {
         debug(DBG_WARN, "Error setting up blue burst enemies!\n");
@@ -420,7 +727,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
             release(l->limits_list);
 
         pthread_mutex_destroy(&l->mutex);
-        free(l);
+        lobby_free(l);
         return NULL;
     }
     else if(version <= CLIENT_VERSION_PC && map_have_v2_maps() && !battle &&
@@ -431,7 +738,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
             release(l->limits_list);
 
         pthread_mutex_destroy(&l->mutex);
-        free(l);
+        lobby_free(l);
         return NULL;
     }
     else if(version == CLIENT_VERSION_GC && map_have_gc_maps() && !battle &&
@@ -442,39 +749,43 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
             release(l->limits_list);
 
         pthread_mutex_destroy(&l->mutex);
-        free(l);
+        lobby_free(l);
         return NULL;
     }
 
+    /* Hang onto the drop tables as they are now, so that refreshing them
+       doesn't change them out from under the game. */
+    l->pt_gen = pt_gen_ref();
+    l->rt_gen = rt_gen_ref();
+
     /* Add it to the list of lobbies, and increment the game count. */
     if(version != CLIENT_VERSION_PC || battle || chal || difficulty == 3 ||
        (c->flags & CLIENT_FLAG_IS_NTE)) {
         pthread_rwlock_wrlock(&block->lobby_lock);
-        TAILQ_INSERT_TAIL(&block->lobbies, l, qentry);
+        block_add_lobby(block, l);
         ++block->num_games;
         pthread_rwlock_unlock(&block->lobby_lock);
 
         ship_inc_games(block->ship);
     }
 
-    l->rand_seed = mt19937_genrand_int32(&block->rng);
+    l->rand_seed = mt19937_genrand_int32(block_rng(block));
+
+    /* The drops get their own stream, so they don't depend on what any other
+       game on the block is doing. Its seed goes in the team log, so the drops
+       can be worked out again later. */
+    rng_seed(&l->rng, mt19937_genrand_int32(block_rng(block)));
 
     if(!chal && !battle)
         lobby_setup_drops(c, l, sylverant_crc32((uint8_t *)l->name, 16));
 
 #ifdef ENABLE_LUA
     /* Initialize the script table */
-    lua_newtable(block->ship->lstate);
-    l->script_ref = luaL_ref(block->ship->lstate, LUA_REGISTRYINDEX);
-    lua_newtable(block->ship->lstate);
-    l->script_table = luaL_ref(block->ship->lstate, LUA_REGISTRYINDEX);
-
-    if(!(l->script_ids = (int *)malloc(sizeof(int) * ScriptActionCount)))
-        debug(DBG_WARN, "Couldn't allocate team script list!\n");
-    else
-        memset(l->script_ids, 0, sizeof(int) * ScriptActionCount);
+    l->script_ref = script_table_new(block);
+    l->script_table = script_table_new(block);
 
     SLIST_INIT(&l->qfunc_list);
+    SLIST_INIT(&l->qfunc_free);
 #endif
 
     /* Run the team creation script, if one exists. */
@@ -516,7 +827,7 @@ out:
 lobby_t *lobby_create_ep3_game(block_t *block, char *name, char *passwd,
                                uint8_t view_battle, uint8_t section,
                                ship_client_t *c) {
-    lobby_t *l = (lobby_t *)malloc(sizeof(lobby_t));
+    lobby_t *l = lobby_new(0, 0);
     uint32_t id = 0x20;
 
     /* If we don't have a lobby, bail. */
@@ -526,9 +837,6 @@ lobby_t *lobby_create_ep3_game(block_t *block, char *name, char *passwd,
         return NULL;
     }
 
-    /* Clear it. */
-    memset(l, 0, sizeof(lobby_t));
-
     /* Select an unused ID. */
     do {
         ++id;
@@ -547,7 +855,8 @@ lobby_t *lobby_create_ep3_game(block_t *block, char *name, char *passwd,
     l->section = section;
     l->min_level = 1;
     l->max_level = 200;
-    l->rand_seed = mt19937_genrand_int32(&block->rng);
+    l->rand_seed = mt19937_genrand_int32(block_rng(block));
+    rng_seed(&l->rng, mt19937_genrand_int32(block_rng(block)));
     l->create_time = time(NULL);
     l->flags |= LOBBY_FLAG_EP3;
 
@@ -561,29 +870,26 @@ lobby_t *lobby_create_ep3_game(block_t *block, char *name, char *passwd,
     STAILQ_INIT(&l->pkt_queue);
     STAILQ_INIT(&l->burst_queue);
 
+    /* Not assigned to a worker thread until someone needs it to be. */
+    l->worker = -1;
+
     /* Initialize the lobby mutex. */
-    pthread_mutex_init(&l->mutex, NULL);
+    lobby_init_mutex(l);
 
     /* Add it to the list of lobbies, and increment the game count. */
     pthread_rwlock_wrlock(&block->lobby_lock);
-    TAILQ_INSERT_TAIL(&block->lobbies, l, qentry);
+    block_add_lobby(block, l);
     ++block->num_games;
     pthread_rwlock_unlock(&block->lobby_lock);
     ship_inc_games(block->ship);
 
 #ifdef ENABLE_LUA
     /* Initialize the script table */
-    lua_newtable(block->ship->lstate);
-    l->script_ref = luaL_ref(block->ship->lstate, LUA_REGISTRYINDEX);
-    lua_newtable(block->ship->lstate);
-    l->script_table = luaL_ref(block->ship->lstate, LUA_REGISTRYINDEX);
-
-    if(!(l->script_ids = (int *)malloc(sizeof(int) * ScriptActionCount)))
-        debug(DBG_WARN, "Couldn't allocate team script list!\n");
-    else
-        memset(l->script_ids, 0, sizeof(int) * ScriptActionCount);
+    l->script_ref = script_table_new(block);
+    l->script_table = script_table_new(block);
 
     SLIST_INIT(&l->qfunc_list);
+    SLIST_INIT(&l->qfunc_free);
 #endif
 
     /* Run the team creation script, if one exists. */
@@ -594,19 +900,10 @@ lobby_t *lobby_create_ep3_game(block_t *block, char *name, char *passwd,
 }
 
 static void lobby_empty_pkt_queue(lobby_t *l) {
-    lobby_pkt_t *i;
-
-    while((i = STAILQ_FIRST(&l->pkt_queue))) {
-        STAILQ_REMOVE_HEAD(&l->pkt_queue, qentry);
-        free(i->pkt);
-        free(i);
-    }
-
-    while((i = STAILQ_FIRST(&l->burst_queue))) {
-        STAILQ_REMOVE_HEAD(&l->burst_queue, qentry);
-        free(i->pkt);
-        free(i);
-    }
+    /* Everything in the queues lives in the arena, so just toss it all. */
+    STAILQ_INIT(&l->pkt_queue);
+    STAILQ_INIT(&l->burst_queue);
+    arena_reset(l);
 }
 
 static void lobby_destroy_locked(lobby_t *l, int remove) {
@@ -630,8 +927,8 @@ static void lobby_destroy_locked(lobby_t *l, int remove) {
         team_log_stop(l);
 
     /* Run the team deletion script, if one exists. */
-    script_execute(ScriptActionTeamDestroy, NULL, SCRIPT_ARG_PTR, l,
-                   SCRIPT_ARG_END);
+    script_execute_lobby(ScriptActionTeamDestroy, l, SCRIPT_ARG_PTR, l,
+                         SCRIPT_ARG_END);
 
 #ifdef ENABLE_LUA
     /* Clean up any scripts. */
@@ -641,14 +938,13 @@ static void lobby_destroy_locked(lobby_t *l, int remove) {
     }
 
     /* Remove the table from the registry */
-    luaL_unref(l->block->ship->lstate, LUA_REGISTRYINDEX, l->script_ref);
-    free(l->script_ids);
+    script_table_free(l->block, l->script_ref);
 #endif
 
     /* TAILQ_REMOVE may or may not be safe to use if the item was never actually
        inserted in a list, so don't remove it if it wasn't. */
     if(remove) {
-        TAILQ_REMOVE(&l->block->lobbies, l, qentry);
+        block_remove_lobby(l->block, l);
 
         /* Decrement the game count if it got incremented for this lobby */
         if(l->type != LOBBY_TYPE_LOBBY) {
@@ -663,6 +959,9 @@ static void lobby_destroy_locked(lobby_t *l, int remove) {
     if(l->limits_list)
         release(l->limits_list);
 
+    pt_gen_unref(l->pt_gen);
+    rt_gen_unref(l->rt_gen);
+
     /* Free up any items left in the lobby for Blue Burst. */
     i = TAILQ_FIRST(&l->item_queue);
     while(i) {
@@ -671,12 +970,19 @@ static void lobby_destroy_locked(lobby_t *l, int remove) {
         i = tmp;
     }
 
+    free(l->item_hash);
+
     /* Free up the enemy data */
     if(l->map_enemies) {
         free_game_enemies(l);
     }
 
-    free(l);
+    /* Everything else the lobby allocated goes with it. */
+    if(l->type != LOBBY_TYPE_LOBBY) {
+        metrics_observe(METRIC_GAME_MEMORY, l->arena_size);
+    }
+
+    lobby_free(l);
 
     pthread_mutex_unlock(&m);
     pthread_mutex_destroy(&m);
@@ -762,14 +1068,14 @@ static uint8_t lobby_find_max_challenge(lobby_t *l) {
 }
 
 static int td(ship_client_t *c, lobby_t *l, void *req) {
-    uint32_t r = mt19937_genrand_int32(&c->cur_block->rng);
+    uint32_t r = rng_int32(&l->rng);
     uint32_t i[4] = { 4, 0, 0, 0 };
 
     if((r & 15) != 2) {
         return 0;
     }
 
-    r = mt19937_genrand_int32(&c->cur_block->rng);
+    r = rng_int32(&l->rng);
 
     switch(l->difficulty) {
         case 0:
@@ -827,6 +1133,8 @@ static int lobby_add_client_locked(ship_client_t *c, lobby_t *l) {
         c->arrow = 0;
         c->join_time = time(NULL);
         nc = (uint32_t)++l->num_clients;
+        lobby_publish_members(l);
+        clear_game_lists(l->block);
 
         /* Update the challenge level as needed. */
         if(l->challenge)
@@ -859,6 +1167,10 @@ static int lobby_add_client_locked(ship_client_t *c, lobby_t *l) {
             c->arrow = 0;
             c->join_time = time(NULL);
             nc = (uint32_t)++l->num_clients;
+            lobby_publish_members(l);
+
+            if(l->type != LOBBY_TYPE_LOBBY)
+                clear_game_lists(l->block);
 
             /* Update the challenge level as needed. */
             if(l->challenge)
@@ -913,6 +1225,7 @@ static int lobby_elect_leader_cross_locked(lobby_t *l) {
         l->flags &= ~LOBBY_FLAG_GC_ALLOWED;
         l->version = CLIENT_VERSION_GC;
         l->episode = 1;
+        clear_game_lists(l->block);
 
         /* Same loop as above, but without the requirement of not on Gamecube.
            If we're here, everyone's obviously on Gamecube, if anyone's even
@@ -988,6 +1301,10 @@ static int lobby_remove_client_locked(ship_client_t *c, int client_id,
     /* Remove the client from our list, and we're done. */
     l->clients[client_id] = NULL;
     --l->num_clients;
+    lobby_publish_members(l);
+
+    if(l->type != LOBBY_TYPE_LOBBY)
+        clear_game_lists(l->block);
 
     /* Make sure the maximum challenge level available hasn't changed... */
     if(l->challenge)
@@ -1234,7 +1551,14 @@ int lobby_change_lobby(ship_client_t *c, lobby_t *req) {
         c->q_stack_top = 0;
         send_game_join(c, c->cur_lobby);
         c->cur_lobby->flags |= LOBBY_FLAG_BURSTING;
+        c->cur_lobby->burst_client = c;
         c->flags |= CLIENT_FLAG_BURSTING;
+        c->burst_start = metrics_now();
+
+        /* Quests still need everyone to wait, since the joining player has to
+           replay the burst packets queued up for the quest. */
+        if(lobby_stream_joins && !(c->cur_lobby->flags & LOBBY_FLAG_QUESTING))
+            c->cur_lobby->flags |= LOBBY_FLAG_STREAMING;
         c->flags &= ~CLIENT_FLAG_SHOPPING;
         memset(c->p2_drops, 0, sizeof(c->p2_drops));
         c->p2_drops_max = 0;
@@ -1326,8 +1650,14 @@ out:
 int lobby_send_pkt_dcnte(lobby_t *l, ship_client_t *c, void *h, void *h2,
                          int igcheck) {
     dc_pkt_hdr_t *hdr = (dc_pkt_hdr_t *)h, *hdr2 = (dc_pkt_hdr_t *)h2;
+    pkt_bcast_t b;
     int i;
 
+    if(c->version == CLIENT_VERSION_DCV1 && (c->flags & CLIENT_FLAG_IS_NTE))
+        pkt_bcast_init_dc(&b, hdr);
+    else
+        pkt_bcast_init_dc(&b, hdr2);
+
     /* Send the packet to every connected client. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c) {
@@ -1337,11 +1667,7 @@ int lobby_send_pkt_dcnte(lobby_t *l, ship_client_t *c, void *h, void *h2,
                 continue;
             }
 
-            if(c->version == CLIENT_VERSION_DCV1 &&
-               (c->flags & CLIENT_FLAG_IS_NTE))
-                send_pkt_dc(l->clients[i], hdr);
-            else
-                send_pkt_dc(l->clients[i], hdr2);
+            send_pkt_bcast(l->clients[i], &b);
         }
     }
 
@@ -1349,9 +1675,12 @@ int lobby_send_pkt_dcnte(lobby_t *l, ship_client_t *c, void *h, void *h2,
 }
 
 int lobby_send_pkt_dc(lobby_t *l, ship_client_t *c, void *h, int igcheck) {
-    dc_pkt_hdr_t *hdr = (dc_pkt_hdr_t *)h;
+    pkt_bcast_t b;
     int i;
 
+    pkt_bcast_init_dc(&b, (dc_pkt_hdr_t *)h);
+    pthread_mutex_lock(&l->mutex);
+
     /* Send the packet to every connected client. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c) {
@@ -1361,17 +1690,24 @@ int lobby_send_pkt_dc(lobby_t *l, ship_client_t *c, void *h, int igcheck) {
                 continue;
             }
 
-            send_pkt_dc(l->clients[i], hdr);
+            if(lobby_is_holding(l, l->clients[i]))
+                lobby_hold_pkt_dc(l, l->clients[i], (dc_pkt_hdr_t *)h);
+            else
+                send_pkt_bcast(l->clients[i], &b);
         }
     }
 
+    pthread_mutex_unlock(&l->mutex);
     return 0;
 }
 
 int lobby_send_pkt_bb(lobby_t *l, ship_client_t *c, void *h, int igcheck) {
-    bb_pkt_hdr_t *hdr = (bb_pkt_hdr_t *)h;
+    pkt_bcast_t b;
     int i;
 
+    pkt_bcast_init_bb(&b, (bb_pkt_hdr_t *)h);
+    pthread_mutex_lock(&l->mutex);
+
     /* Send the packet to every connected client. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c) {
@@ -1381,22 +1717,28 @@ int lobby_send_pkt_bb(lobby_t *l, ship_client_t *c, void *h, int igcheck) {
                 continue;
             }
 
-            send_pkt_bb(l->clients[i], hdr);
+            if(lobby_is_holding(l, l->clients[i]))
+                lobby_hold_pkt_bb(l, l->clients[i], (bb_pkt_hdr_t *)h);
+            else
+                send_pkt_bcast(l->clients[i], &b);
         }
     }
 
+    pthread_mutex_unlock(&l->mutex);
     return 0;
 }
 
 int lobby_send_pkt_ep3(lobby_t *l, ship_client_t *c, void *h) {
-    dc_pkt_hdr_t *hdr = (dc_pkt_hdr_t *)h;
+    pkt_bcast_t b;
     int i;
 
+    pkt_bcast_init_dc(&b, (dc_pkt_hdr_t *)h);
+
     /* Send the packet to every connected Episode 3 client. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c &&
            l->version == CLIENT_VERSION_EP3) {
-            send_pkt_dc(l->clients[i], hdr);
+            send_pkt_bcast(l->clients[i], &b);
         }
     }
 
@@ -1412,7 +1754,8 @@ int lobby_info_reply(ship_client_t *c, uint32_t lobby) {
     char msg[512] = { 0 };
     lobby_t *l = block_get_lobby(c->cur_block, lobby);
     int i, lang;
-    player_t *pl;
+    lobby_members_t *mem;
+    lobby_member_t *e;
     time_t t;
     int h, m, s;
     int legit, questing, drops;
@@ -1423,9 +1766,29 @@ int lobby_info_reply(ship_client_t *c, uint32_t lobby) {
     if(!l)
         return send_info_reply(c, __(c, "\tEThis team is no\nlonger active."));
 
+    msg[511] = 0;
+
+    /* The first page is just the list of who's there, which doesn't need the
+       lobby to be locked. */
+    if(c->last_info_req != lobby && c->last_info_req != (lobby | 0x80000000)) {
+        c->last_info_req = lobby;
+
+        if((mem = lobby_members_get(l))) {
+            for(i = 0; i < mem->count; ++i) {
+                e = &mem->members[i];
+                len += snprintf(msg + len, 511 - len, "%.16s L%d\n  %s    %s\n",
+                                e->name, e->level + 1, classes[e->ch_class],
+                                mini_language_codes[e->language]);
+            }
+
+            lobby_members_put(mem);
+        }
+
+        return send_info_reply(c, msg);
+    }
+
     /* Lock the lobby */
     pthread_mutex_lock(&l->mutex);
-    msg[511] = 0;
 
     /* Check if we should be on page 2 of the info or on the first page. */
     if(c->last_info_req == lobby) {
@@ -1557,29 +1920,11 @@ int lobby_info_reply(ship_client_t *c, uint32_t lobby) {
         else
             c->last_info_req = 0;
     }
-    else if(c->last_info_req == (lobby | 0x80000000)) {
+    else {
         snprintf(msg, 511, "%s:\n%s", __(c, "\tELegit Mode"),
                  l->limits_list->name ? l->limits_list->name : "Default");
         c->last_info_req = 0;
     }
-    else {
-        c->last_info_req = lobby;
-
-        /* Build up the information string */
-        for(i = 0; i < l->max_clients; ++i) {
-            /* Ignore blank clients */
-            if(!l->clients[i])
-                continue;
-
-            /* Grab the player data and fill in the string */
-            pl = l->clients[i]->pl;
-
-            len += snprintf(msg + len, 511 - len, "%s L%d\n  %s    %s\n",
-                            pl->v1.name, pl->v1.level + 1,
-                            classes[pl->v1.ch_class],
-                            mini_language_codes[pl->v1.inv.language]);
-        }
-    }
 
     /* Unlock the lobby */
     pthread_mutex_unlock(&l->mutex);
@@ -1601,7 +1946,7 @@ int lobby_check_player_legit(lobby_t *l, ship_t *s, player_t *pl, uint32_t v) {
     /* Look through each item */
     for(j = 0; j < pl->v1.inv.item_count; ++j) {
         item = (sylverant_iitem_t *)&pl->v1.inv.items[j];
-        irv = sylverant_limits_check_item(l->limits_list, item, v);
+        irv = legit_check_item(l->limits_list, item, v);
 
         if(!irv) {
             debug(DBG_LOG, "Potentially non-legit item in legit mode:\n"
@@ -1650,6 +1995,35 @@ int lobby_check_client_legit(lobby_t *l, ship_t *s, ship_client_t *c) {
     return rv;
 }
 
+static int is_game_cmd(uint16_t type) {
+    return type == GAME_COMMAND0_TYPE || type == GAME_COMMAND2_TYPE ||
+        type == GAME_COMMANDC_TYPE || type == GAME_COMMANDD_TYPE;
+}
+
+/* Send a held packet to the newcomer, running game commands through the same
+   filter they'd have gone through if they'd been sent right away. */
+static int lobby_send_held(ship_client_t *c, lobby_pkt_t *i) {
+    uint16_t type;
+    int nte = c->version == CLIENT_VERSION_DCV1 &&
+        (c->flags & CLIENT_FLAG_IS_NTE);
+
+    if(i->held == LOBBY_PKT_HELD_BB) {
+        type = LE16(((bb_pkt_hdr_t *)i->pkt)->pkt_type);
+
+        if(nte && is_game_cmd(type))
+            return subcmd_translate_bb_to_nte(c, (bb_subcmd_pkt_t *)i->pkt);
+
+        return send_pkt_bb(c, (bb_pkt_hdr_t *)i->pkt);
+    }
+
+    type = i->pkt->pkt_type;
+
+    if(nte && is_game_cmd(type))
+        return subcmd_translate_dc_to_nte(c, (subcmd_pkt_t *)i->pkt);
+
+    return send_pkt_dc(c, i->pkt);
+}
+
 /* Send out any queued packets when we get a done burst signal. You must hold
    the lobby's lock when calling this. */
 int lobby_handle_done_burst(lobby_t *l, ship_client_t *c) {
@@ -1657,10 +2031,23 @@ int lobby_handle_done_burst(lobby_t *l, ship_client_t *c) {
     int rv = 0;
     int j;
 
+    /* Nobody's getting anything held for them anymore. */
+    l->flags &= ~(LOBBY_FLAG_STREAMING | LOBBY_FLAG_BURST_SENT);
+    l->burst_client = NULL;
+
     /* Go through each packet and handle it */
     while((i = STAILQ_FIRST(&l->pkt_queue))) {
         STAILQ_REMOVE_HEAD(&l->pkt_queue, qentry);
 
+        /* Held packets have already been dealt with for everyone else, so they
+           just need to go to the newcomer (if it's still around). */
+        if(i->held) {
+            if(rv == 0 && c)
+                rv = lobby_send_held(c, i);
+
+            continue;
+        }
+
         /* As long as we haven't run into issues yet, continue sending the
            queued packets */
         if(rv == 0) {
@@ -1682,11 +2069,10 @@ int lobby_handle_done_burst(lobby_t *l, ship_client_t *c) {
                     rv = -1;
             }
         }
-
-        free(i->pkt);
-        free(i);
     }
 
+    arena_check_reset(l);
+
     /* Handle any synced regs. */
     if(c && (l->q_flags & LOBBY_QFLAG_SYNC_REGS)) {
         for(j = 0; j < l->num_syncregs; ++j) {
@@ -1723,11 +2109,9 @@ int lobby_resend_burst(lobby_t *l, ship_client_t *c) {
                     rv = -1;
             }
         }
-
-        free(i->pkt);
-        free(i);
     }
 
+    arena_check_reset(l);
     return rv;
 }
 
@@ -1752,22 +2136,17 @@ static int lobby_enqueue_pkt_ex(lobby_t *l, ship_client_t *c, dc_pkt_hdr_t *p,
         goto out;
     }
 
-    /* Allocate space */
-    pkt = (lobby_pkt_t *)malloc(sizeof(lobby_pkt_t));
+    /* Allocate space for the queue entry and the packet together. */
+    pkt = (lobby_pkt_t *)arena_alloc(l, sizeof(lobby_pkt_t) + len);
     if(!pkt) {
         rv = -3;
         goto out;
     }
 
-    pkt->pkt = (dc_pkt_hdr_t *)malloc(len);
-    if(!pkt->pkt) {
-        free(pkt);
-        rv = -3;
-        goto out;
-    }
-
     /* Fill in the struct */
     pkt->src = c;
+    pkt->pkt = (dc_pkt_hdr_t *)(pkt + 1);
+    pkt->held = 0;
     memcpy(pkt->pkt, p, len);
 
     /* Insert into the packet queue */
@@ -1789,6 +2168,147 @@ int lobby_enqueue_burst(lobby_t *l, ship_client_t *c, dc_pkt_hdr_t *p) {
     return lobby_enqueue_pkt_ex(l, c, p, 1);
 }
 
+static int lobby_hold_pkt(lobby_t *l, ship_client_t *c, void *p, uint16_t len,
+                          int type) {
+    lobby_pkt_t *pkt;
+
+    if(!(pkt = (lobby_pkt_t *)arena_alloc(l, sizeof(lobby_pkt_t) + len))) {
+        return -3;
+    }
+
+    pkt->src = c;
+    pkt->pkt = (dc_pkt_hdr_t *)(pkt + 1);
+    pkt->held = type;
+    memcpy(pkt->pkt, p, len);
+
+    STAILQ_INSERT_TAIL(&l->pkt_queue, pkt, qentry);
+    return 0;
+}
+
+void lobby_burst_started(lobby_t *l, ship_client_t *c) {
+    struct lobby_pkt_queue keep;
+    lobby_pkt_t *i;
+
+    if(!(l->flags & LOBBY_FLAG_STREAMING) ||
+       (l->flags & LOBBY_FLAG_BURST_SENT) || c != l->clients[l->leader_id])
+        return;
+
+    /* The leader had already been sent everything that was held, so its view
+       of the game includes all of it (other than anything still on its way to
+       the leader when it built the burst). Packets that were queued rather
+       than held haven't been handled at all yet, so those stay. */
+    l->flags |= LOBBY_FLAG_BURST_SENT;
+    STAILQ_INIT(&keep);
+
+    while((i = STAILQ_FIRST(&l->pkt_queue))) {
+        STAILQ_REMOVE_HEAD(&l->pkt_queue, qentry);
+
+        if(!i->held)
+            STAILQ_INSERT_TAIL(&keep, i, qentry);
+    }
+
+    while((i = STAILQ_FIRST(&keep))) {
+        STAILQ_REMOVE_HEAD(&keep, qentry);
+        STAILQ_INSERT_TAIL(&l->pkt_queue, i, qentry);
+    }
+}
+
+int lobby_hold_pkt_dc(lobby_t *l, ship_client_t *c, dc_pkt_hdr_t *p) {
+    return lobby_hold_pkt(l, c, p, LE16(p->pkt_len), LOBBY_PKT_HELD_DC);
+}
+
+int lobby_hold_pkt_bb(lobby_t *l, ship_client_t *c, bb_pkt_hdr_t *p) {
+    return lobby_hold_pkt(l, c, p, LE16(p->pkt_len), LOBBY_PKT_HELD_BB);
+}
+
+static inline uint32_t item_hash(lobby_t *l, uint32_t item_id) {
+    return (item_id * 0x9E3779B1) >> (32 - l->item_hash_bits);
+}
+
+/* Find the slot in the hash that has the item with the given ID, or the empty
+   slot where it would go. */
+static uint32_t item_hash_find(lobby_t *l, uint32_t item_id) {
+    uint32_t mask = (1 << l->item_hash_bits) - 1;
+    uint32_t i = item_hash(l, item_id);
+
+    while(l->item_hash[i] && l->item_hash[i]->d.item_id != item_id) {
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+/* Double the size of the hash (or make the first one). */
+static int item_hash_grow(lobby_t *l) {
+    lobby_item_t **old = l->item_hash;
+    uint32_t i, osize = old ? (1 << l->item_hash_bits) : 0;
+    uint32_t bits = old ? l->item_hash_bits + 1 : 6;
+
+    if(!(l->item_hash = (lobby_item_t **)calloc(1 << bits,
+                                                sizeof(lobby_item_t *)))) {
+        l->item_hash = old;
+        return -1;
+    }
+
+    l->item_hash_bits = bits;
+
+    for(i = 0; i < osize; ++i) {
+        if(old[i])
+            l->item_hash[item_hash_find(l, old[i]->d.item_id)] = old[i];
+    }
+
+    free(old);
+    return 0;
+}
+
+static int item_hash_insert(lobby_t *l, lobby_item_t *item) {
+    uint32_t i;
+
+    /* Keep it at most half full. */
+    if(!l->item_hash ||
+       l->item_hash_count >= (1U << (l->item_hash_bits - 1))) {
+        if(item_hash_grow(l))
+            return -1;
+    }
+
+    i = item_hash_find(l, item->d.item_id);
+
+    if(l->item_hash[i])
+        ++l->item_dups;
+    else
+        ++l->item_hash_count;
+
+    l->item_hash[i] = item;
+    return 0;
+}
+
+/* Empty out a slot of the hash, moving anything after it back to fill the hole
+   if it'd be found there. */
+static void item_hash_remove(lobby_t *l, uint32_t i) {
+    uint32_t mask = (1 << l->item_hash_bits) - 1;
+    uint32_t j = i, k;
+
+    l->item_hash[i] = NULL;
+    --l->item_hash_count;
+
+    for(;;) {
+        j = (j + 1) & mask;
+
+        if(!l->item_hash[j])
+            break;
+
+        /* Leave it alone if its home slot is after the hole. */
+        k = item_hash(l, l->item_hash[j]->d.item_id);
+
+        if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+
+        l->item_hash[i] = l->item_hash[j];
+        l->item_hash[j] = NULL;
+        i = j;
+    }
+}
+
 /* Add an item to the lobby's inventory. The caller must hold the lobby's mutex
    before calling this. Returns NULL if there is no space in the lobby's
    inventory for the new item. */
@@ -1811,6 +2331,11 @@ item_t *lobby_add_item_locked(lobby_t *l, uint32_t item_data[4]) {
     item->d.data_l[2] = LE32(item_data[2]);
     item->d.data2_l = LE32(item_data[3]);
 
+    if(item_hash_insert(l, item)) {
+        free(item);
+        return NULL;
+    }
+
     /* Increment the item ID, add it to the queue, and return the new item */
     ++l->item_id;
     TAILQ_INSERT_HEAD(&l->item_queue, item, qentry);
@@ -1832,6 +2357,11 @@ item_t *lobby_add_item2_locked(lobby_t *l, item_t *it) {
     /* Copy the item data in. */
     memcpy(&item->d, it, sizeof(item_t));
 
+    if(item_hash_insert(l, item)) {
+        free(item);
+        return NULL;
+    }
+
     /* Add it to the queue, and return the new item */
     TAILQ_INSERT_HEAD(&l->item_queue, item, qentry);
     return &item->d;
@@ -1839,6 +2369,7 @@ item_t *lobby_add_item2_locked(lobby_t *l, item_t *it) {
 
 int lobby_remove_item_locked(lobby_t *l, uint32_t item_id, item_t *rv) {
     lobby_item_t *i, *tmp;
+    uint32_t slot;
 
     if(l->version != CLIENT_VERSION_BB)
         return -1;
@@ -1846,21 +2377,31 @@ int lobby_remove_item_locked(lobby_t *l, uint32_t item_id, item_t *rv) {
     memset(rv, 0, sizeof(item_t));
     rv->data_l[0] = LE32(Item_NoSuchItem);
 
-    i = TAILQ_FIRST(&l->item_queue);
-    while(i) {
-        tmp = TAILQ_NEXT(i, qentry);
+    if(!l->item_hash)
+        return 1;
 
-        if(i->d.item_id == item_id) {
-            memcpy(rv, &i->d, sizeof(item_t));
-            TAILQ_REMOVE(&l->item_queue, i, qentry);
-            free(i);
-            return 0;
-        }
+    slot = item_hash_find(l, item_id);
 
-        i = tmp;
+    if(!(i = l->item_hash[slot]))
+        return 1;
+
+    memcpy(rv, &i->d, sizeof(item_t));
+    TAILQ_REMOVE(&l->item_queue, i, qentry);
+    free(i);
+
+    /* If something else was dropped with the same ID, it gets the slot now. */
+    if(l->item_dups) {
+        TAILQ_FOREACH(tmp, &l->item_queue, qentry) {
+            if(tmp->d.item_id == item_id) {
+                l->item_hash[slot] = tmp;
+                --l->item_dups;
+                return 0;
+            }
+        }
     }
 
-    return 1;
+    item_hash_remove(l, slot);
+    return 0;
 }
 
 void lobby_send_kill_counts(lobby_t *l) {
@@ -1874,7 +2415,6 @@ void lobby_send_kill_counts(lobby_t *l) {
            don't double count any kills. */
         if(c && (c->flags & CLIENT_FLAG_TRACK_KILLS)) {
             shipgate_send_mkill(&ship->sg, c->guildcard, c->cur_block->b, c, l);
-            memset(c->enemy_kills, 0, sizeof(uint32_t) * 0x60);
         }
     }
 }
@@ -1888,7 +2428,7 @@ int lobby_setup_quest(lobby_t *l, ship_client_t *c, uint32_t qid, int lang) {
     pthread_mutex_lock(&l->mutex);
 
     /* Do we have quests configured? */
-    if(!TAILQ_EMPTY(&ship->qmap)) {
+    if(!TAILQ_EMPTY(&ship->qmap.list)) {
         /* Run the before quest load script, if one exists. */
         rv = script_execute(ScriptActionBeforeQuestLoad, c, SCRIPT_ARG_PTR, c,
                             SCRIPT_ARG_PTR, l, SCRIPT_ARG_UINT32, qid,
@@ -1983,6 +2523,7 @@ int lobby_setup_quest(lobby_t *l, ship_client_t *c, uint32_t qid, int lang) {
             /* Update the lobby's episode, just in case it doesn't
                match up with what's already there. */
             l->episode = q->episode;
+            clear_game_lists(l->block);
         }
 
         l->flags |= LOBBY_FLAG_QUESTING;
@@ -2009,9 +2550,11 @@ int lobby_setup_quest(lobby_t *l, ship_client_t *c, uint32_t qid, int lang) {
 
         /* If the team log is running, note that the quest is loading... */
         if(l->logfp) {
-            fdebug(l->logfp, DBG_LOG, "Loading quest ID %" PRIu32 "\n", qid);
-            fdebug(l->logfp, DBG_LOG, "Enemies Array: %p\n", l->map_enemies);
-            fdebug(l->logfp, DBG_LOG, "Object Array: %p\n", l->map_objs);
+            team_log_write(l, TLOG_BASIC, "Loading quest ID %" PRIu32 "\n",
+                           qid);
+            team_log_write(l, TLOG_BASIC, "Enemies Array: %p\n",
+                           l->map_enemies);
+            team_log_write(l, TLOG_BASIC, "Object Array: %p\n", l->map_objs);
         }
 
         /* Figure out any information we need about the quest for dealing with
@@ -2040,24 +2583,23 @@ int lobby_setup_quest(lobby_t *l, ship_client_t *c, uint32_t qid, int lang) {
                     l->q_flags |= LOBBY_QFLAG_SYNC_REGS;
 
                     l->num_syncregs = q->num_sync;
-                    if(!(l->syncregs = (uint8_t *)malloc(q->num_sync))) {
+                    if(!(l->syncregs = (uint8_t *)lobby_alloc(l,
+                                                              q->num_sync))) {
                         debug(DBG_ERROR, "Error allocating syncregs!\n");
                         l->q_flags &= ~(LOBBY_QFLAG_JOIN |
                             LOBBY_QFLAG_SYNC_REGS);
                         l->num_syncregs = 0;
                     }
                     else if(!(l->regvals =
-                                (uint32_t *)malloc(q->num_sync << 2))) {
+                                (uint32_t *)lobby_alloc(l, q->num_sync << 2))) {
                         debug(DBG_ERROR, "Error allocating regvals!\n");
                         l->q_flags &= ~(LOBBY_QFLAG_JOIN |
                             LOBBY_QFLAG_SYNC_REGS);
-                        free(l->syncregs);
                         l->syncregs = NULL;
                         l->num_syncregs = 0;
                     }
                     else {
                         memcpy(l->syncregs, q->synced_regs, q->num_sync);
-                        memset(l->regvals, 0, q->num_sync << 2);
                     }
                 }
 
@@ -2376,7 +2918,12 @@ static int lobby_gettable_lua(lua_State *l) {
 
     if(lua_islightuserdata(l, 1)) {
         lb = (lobby_t *)lua_touserdata(l, 1);
-        lua_rawgeti(l, LUA_REGISTRYINDEX, lb->script_ref);
+
+        /* The table lives in the state of the lobby's block. */
+        if(script_state_owns(lb->block, l))
+            lua_rawgeti(l, LUA_REGISTRYINDEX, lb->script_ref);
+        else
+            lua_pushnil(l);
     }
     else {
         lua_pushnil(l);
@@ -2391,7 +2938,7 @@ static int lobby_randInt_lua(lua_State *l) {
 
     if(lua_islightuserdata(l, 1)) {
         lb = (lobby_t *)lua_touserdata(l, 1);
-        rn = mt19937_genrand_int32(&lb->block->rng);
+        rn = rng_int32(&lb->rng);
         lua_pushinteger(l, (lua_Integer)rn);
     }
     else {
@@ -2407,7 +2954,7 @@ static int lobby_randFloat_lua(lua_State *l) {
 
     if(lua_islightuserdata(l, 1)) {
         lb = (lobby_t *)lua_touserdata(l, 1);
-        rn = mt19937_genrand_real1(&lb->block->rng);
+        rn = rng_real1(&lb->rng);
         lua_pushnumber(l, (lua_Number)rn);
     }
     else {
@@ -2427,6 +2974,7 @@ static int lobby_setSinglePlayer_lua(lua_State *l) {
 
         if(lb->num_clients == 1) {
             lb->flags |= LOBBY_FLAG_SINGLEPLAYER;
+            clear_game_lists(lb->block);
             lua_pushboolean(l, 1);
         }
         else {
@@ -34,6 +34,8 @@
 
 #include "player.h"
 #include "mapdata.h"
+#include "pktlog.h"
+#include "rng.h"
 
 #define LOBBY_MAX_CLIENTS   12
 #define LOBBY_MAX_IN_TEAM   4
@@ -41,6 +43,8 @@
 /* Forward declaration. */
 struct ship_client;
 struct block;
+struct pt_gen;
+struct rt_gen;
 
 #ifndef SHIP_CLIENT_DEFINED
 #define SHIP_CLIENT_DEFINED
@@ -67,10 +71,34 @@ typedef struct lobby_pkt {
 
     ship_client_t *src;
     dc_pkt_hdr_t *pkt;
+    int held;
 } lobby_pkt_t;
 
+/* Values for the held member of lobby_pkt_t. Held packets have already been
+   handled by the server, and only need to be delivered to the client that is
+   joining the lobby once it has finished bursting. */
+#define LOBBY_PKT_HELD_DC       1
+#define LOBBY_PKT_HELD_BB       2
+
 STAILQ_HEAD(lobby_pkt_queue, lobby_pkt);
 
+/* Packets queued up while a lobby is bursting are carved out of chunks of this
+   size, so that the whole lot can be thrown out at once when the queues are
+   emptied, rather than freeing each packet separately. Everything else that
+   lives as long as the lobby does (see lobby_alloc()) comes out of chunks of
+   the same size. */
+#define LOBBY_ARENA_CHUNK_SIZE  16384
+
+typedef struct lobby_arena_chunk {
+    SLIST_ENTRY(lobby_arena_chunk) qentry;
+
+    size_t size;
+    size_t used;
+    uint8_t *data;
+} lobby_arena_chunk_t;
+
+SLIST_HEAD(lobby_arena, lobby_arena_chunk);
+
 typedef struct lobby_item {
     TAILQ_ENTRY(lobby_item) qentry;
 
@@ -79,6 +107,26 @@ typedef struct lobby_item {
 
 TAILQ_HEAD(lobby_item_queue, lobby_item);
 
+/* Who was in a lobby as of the last time someone joined, left or gained a
+   level in it. These never change once they've been published, so anyone
+   holding a reference to one can read it without locking the lobby (see
+   lobby_members_get()). */
+typedef struct lobby_member {
+    uint32_t guildcard;
+    uint32_t level;
+    uint8_t client_id;
+    uint8_t version;
+    uint8_t ch_class;
+    uint8_t language;
+    char name[16];
+} lobby_member_t;
+
+typedef struct lobby_members {
+    int refcnt;
+    int count;
+    lobby_member_t members[LOBBY_MAX_CLIENTS];
+} lobby_members_t;
+
 typedef struct lobby_qfunc {
     SLIST_ENTRY(lobby_qfunc) entry;
 
@@ -92,6 +140,7 @@ SLIST_HEAD(lobby_qfunc_list, lobby_qfunc);
 
 struct lobby {
     TAILQ_ENTRY(lobby) qentry;
+    LIST_ENTRY(lobby) id_qentry;
 
     pthread_mutex_t mutex;
 
@@ -132,14 +181,36 @@ struct lobby {
     uint32_t highest_item[4];
 
     ship_client_t *clients[LOBBY_MAX_CLIENTS];
+    lobby_members_t *members;
 
     struct lobby_pkt_queue pkt_queue;
     struct lobby_item_queue item_queue;
+
+    /* The items in item_queue, hashed by item ID (open addressing, with
+       2^item_hash_bits slots). item_dups counts items that were added with an
+       ID that was already on the floor, which only the newest of shows up in
+       the hash. */
+    lobby_item_t **item_hash;
+    uint32_t item_hash_bits;
+    uint32_t item_hash_count;
+    uint32_t item_dups;
     struct lobby_pkt_queue burst_queue;
+    struct lobby_arena pkt_arena;
+    ship_client_t *burst_client;
     time_t create_time;
 
-    game_enemies_t *map_enemies;
-    game_objs_t *map_objs;
+    /* Which of the block's worker threads handles the lobby, and how busy the
+       lobby has been lately (in packets per second), for keeping the workers
+       balanced. These are only touched while the workers are idle or by the
+       worker that owns the lobby, except for pkt_count, which is bumped for
+       every packet from a client in the lobby (on whatever thread reads it),
+       and so is only ever changed atomically. */
+    int worker;
+    uint32_t pkt_count;
+    uint32_t pkt_rate;
+
+    game_map_enemies_t *map_enemies;
+    game_map_objs_t *map_objs;
     bb_battle_param_t *bb_params;
 
     int num_mtypes;
@@ -148,6 +219,8 @@ struct lobby {
     qenemy_t *mtypes;
     qenemy_t *mids;
     sylverant_limits_t *limits_list;
+    struct pt_gen *pt_gen;              /* ItemPT/ItemRT data for drops */
+    struct rt_gen *rt_gen;
 
     int (*dropfunc)(ship_client_t *c, struct lobby *l, void *req);
 
@@ -172,9 +245,21 @@ struct lobby {
     int script_ref;
     int script_table;
     int *script_ids;
-    FILE *logfp;
+    uint32_t script_events;
+    pktlog_t *logfp;
 
     struct lobby_qfunc_list qfunc_list;
+    struct lobby_qfunc_list qfunc_free;
+
+    /* Memory that lasts until the lobby is destroyed. The lobby itself is at
+       the start of the first chunk. arena_size is how much the chunks add up
+       to, for seeing how much memory each lobby is using. */
+    struct lobby_arena arena;
+    size_t arena_size;
+
+    /* Random numbers for drops and quests, seeded from the block's generator
+       when the lobby is made. This is big, so it stays at the end. */
+    rng_stream_t rng;
 };
 
 #ifndef LOBBY_DEFINED
@@ -183,6 +268,7 @@ typedef struct lobby lobby_t;
 #endif
 
 TAILQ_HEAD(lobby_queue, lobby);
+LIST_HEAD(lobby_id_list, lobby);
 
 /* Possible values for the type parameter. */
 #define LOBBY_TYPE_LOBBY        0x00000001
@@ -206,6 +292,8 @@ TAILQ_HEAD(lobby_queue, lobby);
 #define LOBBY_FLAG_DBG_SDROPS   0x00002000
 #define LOBBY_FLAG_NTE          0x00004000
 #define LOBBY_FLAG_HAS_NPC      0x00008000
+#define LOBBY_FLAG_STREAMING    0x00010000
+#define LOBBY_FLAG_BURST_SENT   0x00020000
 
 /* Team log entry types. */
 #define TLOG_BASIC              0x00000001
@@ -246,6 +334,11 @@ TAILQ_HEAD(lobby_queue, lobby);
 /* The required level for various difficulties. */
 const static int game_required_level[4] = { 1, 20, 40, 80 };
 
+/* If set, the other players in a game keep going while someone joins, and only
+   the packets headed to the joining player are held until its burst is done.
+   Otherwise, the whole game waits on the joining player, as it always has. */
+extern int lobby_stream_joins;
+
 lobby_t *lobby_create_default(block_t *block, uint32_t lobby_id, uint8_t ev);
 lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
                            uint8_t difficulty, uint8_t battle, uint8_t chal,
@@ -277,6 +370,15 @@ int lobby_change_lobby(ship_client_t *c, lobby_t *req);
    they disconnected). */
 int lobby_remove_player(ship_client_t *c);
 
+/* Grab a reference to the lobby's current list of members, which may be NULL
+   if nobody has ever joined it. Release it with lobby_members_put(). */
+lobby_members_t *lobby_members_get(lobby_t *l);
+void lobby_members_put(lobby_members_t *m);
+
+/* Put out a new list of the lobby's members after one of them has changed
+   level. */
+void lobby_members_update(lobby_t *l);
+
 /* Send an information reply packet with information about the lobby. */
 int lobby_info_reply(ship_client_t *c, uint32_t lobby);
 
@@ -294,6 +396,37 @@ int lobby_resend_burst(lobby_t *l, ship_client_t *c);
 int lobby_enqueue_pkt(lobby_t *l, ship_client_t *c, dc_pkt_hdr_t *p);
 int lobby_enqueue_burst(lobby_t *l, ship_client_t *c, dc_pkt_hdr_t *p);
 
+/* Hold a packet for the client currently bursting into the lobby, rather than
+   sending it right away. The caller must hold the lobby's mutex. */
+int lobby_hold_pkt_dc(lobby_t *l, ship_client_t *c, dc_pkt_hdr_t *p);
+int lobby_hold_pkt_bb(lobby_t *l, ship_client_t *c, bb_pkt_hdr_t *p);
+
+/* Note that c has started sending its burst to the player joining. Once the
+   leader has, anything held for the joining player up to then is already part
+   of the game state it's getting, so it's thrown away rather than sent again
+   when the burst is done. The caller must hold the lobby's mutex. */
+void lobby_burst_started(lobby_t *l, ship_client_t *c);
+
+/* Is a packet to the given client supposed to be held until it has finished
+   bursting? The caller must hold the lobby's mutex. */
+static inline int lobby_is_holding(lobby_t *l, ship_client_t *c) {
+    return (l->flags & LOBBY_FLAG_STREAMING) && l->burst_client == c;
+}
+
+/* Free any memory cached for queueing packets during bursts. */
+void lobby_pool_cleanup(void);
+
+/* Allocate zeroed memory that lasts as long as the lobby does. None of it can
+   be freed on its own, it all goes at once when the lobby is destroyed. The
+   lobby's mutex must be held, unless nobody else can see the lobby yet.
+   Returns NULL if there isn't enough memory. */
+void *lobby_alloc(lobby_t *l, size_t len);
+
+/* Make sure that the next len bytes allocated from the lobby all come out of
+   one chunk, so a set of allocations that are known up front don't end up
+   scattered (and leaving gaps) over several of them. */
+int lobby_reserve(lobby_t *l, size_t len);
+
 /* Add an item to the lobby's inventory. The caller must hold the lobby's mutex
    before calling this. Returns NULL on any problems... */
 item_t *lobby_add_item_locked(lobby_t *l, uint32_t item_data[4]);
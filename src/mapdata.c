@@ -21,13 +21,18 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <sylverant/debug.h>
+#include <sylverant/checksum.h>
 #include <psoarchive/PRS.h>
 
 #include "mapdata.h"
 #include "lobby.h"
 #include "clients.h"
+#include "snapshot.h"
 
 /* Enemy battle parameters. The array is organized in the following levels:
    multi/single player, episode, difficulty, entry.*/
@@ -71,9 +76,13 @@ typedef struct quest_dat_hdr {
     uint8_t data[];
 } quest_dat_hdr_t;
 
-static int read_param_file(bb_battle_param_t dst[4][0x60], const char *fn) {
+static int read_param_file(bb_battle_param_t dst[4][0x60], const char *dir,
+                           const char *name) {
     FILE *fp;
     const size_t sz = 0x60 * sizeof(bb_battle_param_t);
+    char fn[1024];
+
+    snprintf(fn, sizeof(fn), "%s/%s", dir, name);
 
     if(!(fp = fopen(fn, "rb"))) {
         debug(DBG_ERROR, "Cannot open %s for reading: %s\n", fn,
@@ -106,15 +115,18 @@ static int read_param_file(bb_battle_param_t dst[4][0x60], const char *fn) {
     return 0;
 }
 
-static int read_bb_level_data(const char *fn) {
+static int read_bb_level_data(const char *dir, const char *name) {
     uint8_t *buf;
     int decsize;
+    char fn[1024];
 
 #if defined(WORDS_BIGENDIAN) || defined(__BIG_ENDIAN__)
     int i, j;
 #endif
 
     /* Read in the file and decompress it. */
+    snprintf(fn, sizeof(fn), "%s/%s", dir, name);
+
     if((decsize = pso_prs_decompress_file(fn, &buf)) < 0) {
         debug(DBG_ERROR, "Cannot read levels %s: %s\n", fn, strerror(-decsize));
         return -1;
@@ -137,15 +149,18 @@ static int read_bb_level_data(const char *fn) {
     return 0;
 }
 
-static int read_v2_level_data(const char *fn) {
+static int read_v2_level_data(const char *dir, const char *name) {
     uint8_t *buf;
     int decsize;
+    char fn[1024];
 
 #if defined(WORDS_BIGENDIAN) || defined(__BIG_ENDIAN__)
     int i, j;
 #endif
 
     /* Read in the file and decompress it. */
+    snprintf(fn, sizeof(fn), "%s/%s", dir, name);
+
     if((decsize = pso_prs_decompress_file(fn, &buf)) < 0) {
         debug(DBG_ERROR, "Cannot read levels %s: %s\n", fn, strerror(-decsize));
         return -1;
@@ -700,9 +715,9 @@ static int parse_map(map_enemy_t *en, int en_ct, game_enemies_t *game,
     return 0;
 }
 
-static int read_bb_map_set(int solo, int i, int j) {
+static int read_bb_map_set(const char *dir, int solo, int i, int j) {
     int srv;
-    char fn[256];
+    char fn[1024];
     int k, l, nmaps, nvars, m;
     FILE *fp;
     long sz;
@@ -750,8 +765,9 @@ static int read_bb_map_set(int solo, int i, int j) {
             /* For single-player mode, try the single-player specific map first,
                then try the multi-player one (since some maps are shared). */
             if(solo) {
-                srv = snprintf(fn, 256, "s%d%X%d%d.dat", i + 1, j, k, l);
-                if(srv >= 256) {
+                srv = snprintf(fn, sizeof(fn), "%s/s%d%X%d%d.dat", dir,
+                               i + 1, j, k, l);
+                if(srv >= (int)sizeof(fn)) {
                     return 1;
                 }
 
@@ -759,8 +775,9 @@ static int read_bb_map_set(int solo, int i, int j) {
             }
 
             if(!fp) {
-                srv = snprintf(fn, 256, "m%d%X%d%d.dat", i + 1, j, k, l);
-                if(srv >= 256) {
+                srv = snprintf(fn, sizeof(fn), "%s/m%d%X%d%d.dat", dir,
+                               i + 1, j, k, l);
+                if(srv >= (int)sizeof(fn)) {
                     return 1;
                 }
 
@@ -827,8 +844,9 @@ static int read_bb_map_set(int solo, int i, int j) {
 
             /* Now, grab the objects */
             if(solo) {
-                srv = snprintf(fn, 256, "s%d%X%d%d_o.dat", i + 1, j, k, l);
-                if(srv >= 256) {
+                srv = snprintf(fn, sizeof(fn), "%s/s%d%X%d%d_o.dat", dir,
+                               i + 1, j, k, l);
+                if(srv >= (int)sizeof(fn)) {
                     return 1;
                 }
 
@@ -836,8 +854,9 @@ static int read_bb_map_set(int solo, int i, int j) {
             }
 
             if(!fp) {
-                srv = snprintf(fn, 256, "m%d%X%d%d_o.dat", i + 1, j, k, l);
-                if(srv >= 256) {
+                srv = snprintf(fn, sizeof(fn), "%s/m%d%X%d%d_o.dat", dir,
+                               i + 1, j, k, l);
+                if(srv >= (int)sizeof(fn)) {
                     return 1;
                 }
 
@@ -903,7 +922,6 @@ static int read_bb_map_set(int solo, int i, int j) {
             /* Store what we'll actually use later... */
             for(m = 0; m < sz / 0x44; ++m) {
                 gobj[m].data = obj[m];
-                gobj[m].flags = 0;
                 gobj[m].area = j;
             }
 
@@ -918,9 +936,9 @@ static int read_bb_map_set(int solo, int i, int j) {
     return 0;
 }
 
-static int read_v2_map_set(int j, int gcep) {
+static int read_v2_map_set(const char *dir, int j, int gcep) {
     int srv, ep;
-    char fn[256];
+    char fn[1024];
     int k, l, nmaps, nvars, i;
     FILE *fp;
     long sz;
@@ -980,11 +998,12 @@ static int read_v2_map_set(int j, int gcep) {
             tmp[k * nvars + l].count = 0;
 
             if(!gcep)
-                srv = snprintf(fn, 256, "m%X%d%d.dat", j, k, l);
+                srv = snprintf(fn, sizeof(fn), "%s/m%X%d%d.dat", dir, j, k, l);
             else
-                srv = snprintf(fn, 256, "m%d%X%d%d.dat", gcep, j, k, l);
+                srv = snprintf(fn, sizeof(fn), "%s/m%d%X%d%d.dat", dir,
+                               gcep, j, k, l);
 
-            if(srv >= 256) {
+            if(srv >= (int)sizeof(fn)) {
                 return 1;
             }
 
@@ -1048,11 +1067,13 @@ static int read_v2_map_set(int j, int gcep) {
 
             /* Now, grab the objects */
             if(!gcep)
-                srv = snprintf(fn, 256, "m%X%d%d_o.dat", j, k, l);
+                srv = snprintf(fn, sizeof(fn), "%s/m%X%d%d_o.dat", dir,
+                               j, k, l);
             else
-                srv = snprintf(fn, 256, "m%d%X%d%d_o.dat", gcep, j, k, l);
+                srv = snprintf(fn, sizeof(fn), "%s/m%d%X%d%d_o.dat", dir,
+                               gcep, j, k, l);
 
-            if(srv >= 256) {
+            if(srv >= (int)sizeof(fn)) {
                 return 1;
             }
 
@@ -1116,7 +1137,6 @@ static int read_v2_map_set(int j, int gcep) {
             /* Store what we'll actually use later... */
             for(i = 0; i < sz / 0x44; ++i) {
                 gobj[i].data = obj[i];
-                gobj[i].flags = 0;
                 gobj[i].area = j;
             }
 
@@ -1131,15 +1151,15 @@ static int read_v2_map_set(int j, int gcep) {
     return 0;
 }
 
-static int read_bb_map_files(void) {
+static int read_bb_map_files(const char *dir) {
     int srv, i, j;
 
     for(i = 0; i < 3; ++i) {                            /* Episode */
         for(j = 0; j < 16 && j <= max_area[i]; ++j) {   /* Area */
             /* Read both the multi-player and single-player maps. */
-            if((srv = read_bb_map_set(0, i, j)))
+            if((srv = read_bb_map_set(dir, 0, i, j)))
                 return srv;
-            if((srv = read_bb_map_set(1, i, j)))
+            if((srv = read_bb_map_set(dir, 1, i, j)))
                 return srv;
         }
     }
@@ -1147,37 +1167,38 @@ static int read_bb_map_files(void) {
     return 0;
 }
 
-static int read_v2_map_files(void) {
+static int read_v2_map_files(const char *dir) {
     int srv, j;
 
     for(j = 0; j < 16 && j <= max_area[0]; ++j) {
-        if((srv = read_v2_map_set(j, 0)))
+        if((srv = read_v2_map_set(dir, j, 0)))
             return srv;
     }
 
     return 0;
 }
 
-static int read_gc_map_files(void) {
+static int read_gc_map_files(const char *dir) {
     int srv, j;
 
     for(j = 0; j < 16 && j <= max_area[0]; ++j) {
-        if((srv = read_v2_map_set(j, 1)))
+        if((srv = read_v2_map_set(dir, j, 1)))
             return srv;
     }
 
     for(j = 0; j < 16 && j <= max_area[1]; ++j) {
-        if((srv = read_v2_map_set(j, 2)))
+        if((srv = read_v2_map_set(dir, j, 2)))
             return srv;
     }
 
     return 0;
 }
 
+/* The loaders run in parallel at startup, so files are opened by their full
+   paths in here rather than by changing into each directory. */
 int bb_read_params(sylverant_ship_t *cfg) {
+    const char *dir = cfg->bb_param_dir;
     int rv = 0;
-    long sz;
-    char *buf, *path;
 
     /* Make sure we have a directory set... */
     if(!cfg->bb_param_dir || !cfg->bb_map_dir) {
@@ -1186,46 +1207,26 @@ int bb_read_params(sylverant_ship_t *cfg) {
         return 1;
     }
 
-    /* Save the current working directory, so we can do this a bit easier. */
-    sz = pathconf(".", _PC_PATH_MAX);
-    if(!(buf = malloc(sz))) {
-        debug(DBG_ERROR, "Error allocating memory: %s\n", strerror(errno));
-        return -1;
-    }
-
-    if(!(path = getcwd(buf, (size_t)sz))) {
-        debug(DBG_ERROR, "Error getting current dir: %s\n", strerror(errno));
-        free(buf);
-        return -1;
-    }
-
-    if(chdir(cfg->bb_param_dir)) {
-        debug(DBG_ERROR, "Error changing to Blue Burst param dir: %s\n",
+    if(access(dir, X_OK)) {
+        debug(DBG_ERROR, "Cannot access Blue Burst param dir: %s\n",
               strerror(errno));
-        free(buf);
         return 1;
     }
 
     /* Attempt to read all the files. */
     debug(DBG_LOG, "Loading Blue Burst battle parameter data...\n");
-    rv = read_param_file(battle_params[0][0], "BattleParamEntry_on.dat");
-    rv += read_param_file(battle_params[0][1], "BattleParamEntry_lab_on.dat");
-    rv += read_param_file(battle_params[0][2], "BattleParamEntry_ep4_on.dat");
-    rv += read_param_file(battle_params[1][0], "BattleParamEntry.dat");
-    rv += read_param_file(battle_params[1][1], "BattleParamEntry_lab.dat");
-    rv += read_param_file(battle_params[1][2], "BattleParamEntry_ep4.dat");
+    rv = read_param_file(battle_params[0][0], dir, "BattleParamEntry_on.dat");
+    rv += read_param_file(battle_params[0][1], dir,
+                          "BattleParamEntry_lab_on.dat");
+    rv += read_param_file(battle_params[0][2], dir,
+                          "BattleParamEntry_ep4_on.dat");
+    rv += read_param_file(battle_params[1][0], dir, "BattleParamEntry.dat");
+    rv += read_param_file(battle_params[1][1], dir, "BattleParamEntry_lab.dat");
+    rv += read_param_file(battle_params[1][2], dir, "BattleParamEntry_ep4.dat");
 
     /* Try to read the levelup data */
     debug(DBG_LOG, "Loading Blue Burst levelup table...\n");
-    rv += read_bb_level_data("PlyLevelTbl.prs");
-
-    /* Change back to the original directory. */
-    if(chdir(path)) {
-        debug(DBG_ERROR, "Cannot change back to original dir: %s\n",
-              strerror(errno));
-        free(buf);
-        return -1;
-    }
+    rv += read_bb_level_data(dir, "PlyLevelTbl.prs");
 
     /* Bail out early, if appropriate. */
     if(rv) {
@@ -1233,23 +1234,14 @@ int bb_read_params(sylverant_ship_t *cfg) {
     }
 
     /* Next, try to read the map data */
-    if(chdir(cfg->bb_map_dir)) {
-        debug(DBG_ERROR, "Error changing to Blue Burst param dir: %s\n",
+    if(access(cfg->bb_map_dir, X_OK)) {
+        debug(DBG_ERROR, "Cannot access Blue Burst map dir: %s\n",
               strerror(errno));
-        free(buf);
         return 1;
     }
 
     debug(DBG_LOG, "Loading Blue Burst Map Enemy Data...\n");
-    rv = read_bb_map_files();
-
-    /* Change back to the original directory */
-    if(chdir(path)) {
-        debug(DBG_ERROR, "Cannot change back to original dir: %s\n",
-              strerror(errno));
-        free(buf);
-        return -1;
-    }
+    rv = read_bb_map_files(cfg->bb_map_dir);
 
 bail:
     if(rv) {
@@ -1260,15 +1252,11 @@ bail:
         have_bb_maps = 1;
     }
 
-    /* Clean up and return. */
-    free(buf);
     return rv;
 }
 
 int v2_read_params(sylverant_ship_t *cfg) {
     int rv = 0;
-    long sz;
-    char *buf, *path;
 
     /* Make sure we have a directory set... */
     if(!cfg->v2_map_dir) {
@@ -1277,58 +1265,28 @@ int v2_read_params(sylverant_ship_t *cfg) {
         return 1;
     }
 
-    /* Save the current working directory, so we can do this a bit easier. */
-    sz = pathconf(".", _PC_PATH_MAX);
-    if(!(buf = malloc(sz))) {
-        debug(DBG_ERROR, "Error allocating memory: %s\n", strerror(errno));
-        return -1;
-    }
-
-    if(!(path = getcwd(buf, (size_t)sz))) {
-        debug(DBG_ERROR, "Error getting current dir: %s\n", strerror(errno));
-        free(buf);
-        return -1;
-    }
-
     if(cfg->v2_param_dir) {
-        if(chdir(cfg->v2_param_dir)) {
-            debug(DBG_ERROR, "Error changing to v2 param dir: %s\n",
+        if(access(cfg->v2_param_dir, X_OK)) {
+            debug(DBG_ERROR, "Cannot access v2 param dir: %s\n",
                   strerror(errno));
-            free(buf);
             return -1;
         }
 
         /* Try to read the levelup data */
         debug(DBG_LOG, "Loading v2 levelup table...\n");
-        read_v2_level_data("PlayerTable.prs");
-
-        /* Change back to the original directory. */
-        if(chdir(path)) {
-            debug(DBG_ERROR, "Cannot change back to original dir: %s\n",
-                  strerror(errno));
-            free(buf);
-            return -1;
-        }
+        read_v2_level_data(cfg->v2_param_dir, "PlayerTable.prs");
     }
 
     /* Next, try to read the map data */
-    if(chdir(cfg->v2_map_dir)) {
-        debug(DBG_ERROR, "Error changing to v2 map dir: %s\n",
+    if(access(cfg->v2_map_dir, X_OK)) {
+        debug(DBG_ERROR, "Cannot access v2 map dir: %s\n",
               strerror(errno));
         rv = 1;
         goto bail;
     }
 
     debug(DBG_LOG, "Loading v2 Map Enemy Data...\n");
-    rv = read_v2_map_files();
-
-    /* Change back to the original directory */
-    if(chdir(path)) {
-        debug(DBG_ERROR, "Cannot change back to original dir: %s\n",
-              strerror(errno));
-        free(buf);
-        return -1;
-    }
+    rv = read_v2_map_files(cfg->v2_map_dir);
 
 bail:
     if(rv) {
@@ -1339,15 +1297,11 @@ bail:
         have_v2_maps = 1;
     }
 
-    /* Clean up and return. */
-    free(buf);
     return rv;
 }
 
 int gc_read_params(sylverant_ship_t *cfg) {
     int rv = 0;
-    long sz;
-    char *buf, *path;
 
     /* Make sure we have a directory set... */
     if(!cfg->gc_map_dir) {
@@ -1356,37 +1310,16 @@ int gc_read_params(sylverant_ship_t *cfg) {
         return 1;
     }
 
-    /* Save the current working directory, so we can do this a bit easier. */
-    sz = pathconf(".", _PC_PATH_MAX);
-    if(!(buf = malloc(sz))) {
-        debug(DBG_ERROR, "Error allocating memory: %s\n", strerror(errno));
-        return -1;
-    }
-
-    if(!(path = getcwd(buf, (size_t)sz))) {
-        debug(DBG_ERROR, "Error getting current dir: %s\n", strerror(errno));
-        free(buf);
-        return -1;
-    }
-
     /* Next, try to read the map data */
-    if(chdir(cfg->gc_map_dir)) {
-        debug(DBG_ERROR, "Error changing to GC map dir: %s\n",
+    if(access(cfg->gc_map_dir, X_OK)) {
+        debug(DBG_ERROR, "Cannot access GC map dir: %s\n",
               strerror(errno));
         rv = 1;
         goto bail;
     }
 
     debug(DBG_LOG, "Loading GC Map Enemy Data...\n");
-    rv = read_gc_map_files();
-
-    /* Change back to the original directory */
-    if(chdir(path)) {
-        debug(DBG_ERROR, "Cannot change back to original dir: %s\n",
-              strerror(errno));
-        free(buf);
-        return -1;
-    }
+    rv = read_gc_map_files(cfg->gc_map_dir);
 
 bail:
     if(rv) {
@@ -1397,11 +1330,260 @@ bail:
         have_gc_maps = 1;
     }
 
-    /* Clean up and return. */
-    free(buf);
     return rv;
 }
 
+/* All of the parsed map data, in the order it goes into a snapshot. */
+#define MAP_SNAPSHOT_SETS   (2 * 3 * 0x10 + 0x10 + 2 * 0x10)
+#define MAP_SNAPSHOT_MAX    0x1000      /* Most maps * variations in a set */
+
+static const struct {
+    parsed_map_t *maps;
+    parsed_objs_t *objs;
+    int count;
+} map_groups[3] = {
+    { &bb_parsed_maps[0][0][0], &bb_parsed_objs[0][0][0], 2 * 3 * 0x10 },
+    { &v2_parsed_maps[0], &v2_parsed_objs[0], 0x10 },
+    { &gc_parsed_maps[0][0], &gc_parsed_objs[0][0], 2 * 0x10 }
+};
+
+/* Which of the groups above point into a snapshot, rather than at their own
+   copies of the enemies and objects. */
+static int maps_snapshot[3] = { 0, 0, 0 };
+
+typedef struct map_snapshot_entry {
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t offset;                    /* In the map data section */
+} map_snapshot_entry_t;
+
+int map_snapshot_write(snapshot_writer_t *w) {
+    int32_t have[4] = { have_bb_maps, have_v2_maps, have_gc_maps, 0 };
+    map_snapshot_entry_t ent;
+    uint32_t counts[4], l, n;
+    uint64_t off = 0;
+    parsed_map_t *m;
+    parsed_objs_t *o;
+    int g, i;
+
+    if(snapshot_section(w, SNAPSHOT_PARAMS) ||
+       snapshot_write(w, have, sizeof(have), NULL) ||
+       snapshot_write(w, battle_params, sizeof(battle_params), NULL) ||
+       snapshot_write(w, &char_stats, sizeof(char_stats), NULL) ||
+       snapshot_write(w, &v2_char_stats, sizeof(v2_char_stats), NULL))
+        return -1;
+
+    /* The enemies and objects themselves go first... */
+    if(snapshot_section(w, SNAPSHOT_MAP_DATA))
+        return -1;
+
+    for(g = 0; g < 3; ++g) {
+        for(i = 0; i < map_groups[g].count; ++i) {
+            m = &map_groups[g].maps[i];
+            o = &map_groups[g].objs[i];
+
+            for(l = 0, n = m->map_count * m->variation_count; l < n; ++l) {
+                if(snapshot_write(w, m->data[l].enemies, m->data[l].count *
+                                  sizeof(game_enemy_t), NULL))
+                    return -1;
+            }
+
+            for(l = 0, n = o->map_count * o->variation_count; l < n; ++l) {
+                if(snapshot_write(w, o->data[l].objs, o->data[l].count *
+                                  sizeof(game_object_t), NULL))
+                    return -1;
+            }
+        }
+    }
+
+    /* ...and then where to find each of them, which is worked out the same way
+       that the writes above were laid out. */
+    if(snapshot_section(w, SNAPSHOT_MAP_INDEX))
+        return -1;
+
+    ent.reserved = 0;
+
+    for(g = 0; g < 3; ++g) {
+        for(i = 0; i < map_groups[g].count; ++i) {
+            m = &map_groups[g].maps[i];
+            o = &map_groups[g].objs[i];
+            counts[0] = m->map_count;
+            counts[1] = m->variation_count;
+            counts[2] = o->map_count;
+            counts[3] = o->variation_count;
+
+            if(snapshot_write(w, counts, sizeof(counts), NULL))
+                return -1;
+
+            for(l = 0, n = m->map_count * m->variation_count; l < n; ++l) {
+                ent.count = m->data[l].count;
+                ent.offset = off;
+                off += SNAPSHOT_PAD(ent.count * sizeof(game_enemy_t));
+
+                if(snapshot_write(w, &ent, sizeof(ent), NULL))
+                    return -1;
+            }
+
+            for(l = 0, n = o->map_count * o->variation_count; l < n; ++l) {
+                ent.count = o->data[l].count;
+                ent.offset = off;
+                off += SNAPSHOT_PAD(ent.count * sizeof(game_object_t));
+
+                if(snapshot_write(w, &ent, sizeof(ent), NULL))
+                    return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Go through one set's worth of entries in the index, making sure all of them
+   are in bounds. If dst isn't NULL, it gets filled in with the count and where
+   each one is. */
+static int snapshot_entries(snapshot_cursor_t *idx, const snapshot_cursor_t *d,
+                            uint32_t n, size_t size, void *dst, int objs) {
+    const map_snapshot_entry_t *ent;
+    const void *data;
+    uint32_t l;
+
+    for(l = 0; l < n; ++l) {
+        if(!(ent = snapshot_read(idx, sizeof(map_snapshot_entry_t))))
+            return -1;
+
+        if(!(data = snapshot_at(d, ent->offset, (uint64_t)ent->count * size)))
+            return -1;
+
+        if(!dst)
+            continue;
+
+        /* The data is never written to once it's been parsed, so it's fine for
+           it to point right into the (read-only) snapshot. */
+        if(objs) {
+            ((game_objs_t *)dst)[l].count = ent->count;
+            ((game_objs_t *)dst)[l].objs = (game_object_t *)data;
+        }
+        else {
+            ((game_enemies_t *)dst)[l].count = ent->count;
+            ((game_enemies_t *)dst)[l].enemies = (game_enemy_t *)data;
+        }
+    }
+
+    return 0;
+}
+
+/* Read through the whole index. On the first pass (with fill set to 0), this
+   just checks it all over. On the second, it allocates and fills in the data
+   arrays for each set. */
+static int snapshot_index(const snapshot_t *s, const snapshot_cursor_t *d,
+                          int fill, const uint32_t *counts[],
+                          game_enemies_t *md[], game_objs_t *od[]) {
+    snapshot_cursor_t idx;
+    uint32_t nm, no;
+    int g, i, k = 0;
+
+    snapshot_cursor(s, SNAPSHOT_MAP_INDEX, &idx);
+
+    for(g = 0; g < 3; ++g) {
+        for(i = 0; i < map_groups[g].count; ++i, ++k) {
+            if(!(counts[k] = snapshot_read(&idx, sizeof(uint32_t) * 4)))
+                return -1;
+
+            if(counts[k][0] > MAP_SNAPSHOT_MAX ||
+               counts[k][1] > MAP_SNAPSHOT_MAX ||
+               counts[k][2] > MAP_SNAPSHOT_MAX ||
+               counts[k][3] > MAP_SNAPSHOT_MAX)
+                return -1;
+
+            nm = counts[k][0] * counts[k][1];
+            no = counts[k][2] * counts[k][3];
+
+            if(nm > MAP_SNAPSHOT_MAX || no > MAP_SNAPSHOT_MAX)
+                return -1;
+
+            if(fill) {
+                if(nm && !(md[k] = (game_enemies_t *)
+                           malloc(nm * sizeof(game_enemies_t))))
+                    return -1;
+
+                if(no && !(od[k] = (game_objs_t *)
+                           malloc(no * sizeof(game_objs_t))))
+                    return -1;
+            }
+
+            if(snapshot_entries(&idx, d, nm, sizeof(game_enemy_t), md[k], 0) ||
+               snapshot_entries(&idx, d, no, sizeof(game_object_t), od[k], 1))
+                return -1;
+        }
+    }
+
+    return idx.pos == idx.size ? 0 : -1;
+}
+
+int map_snapshot_read(const snapshot_t *s, int load) {
+    snapshot_cursor_t c, d;
+    const int32_t *have;
+    const void *bp, *cs, *v2cs;
+    const uint32_t *counts[MAP_SNAPSHOT_SETS];
+    game_enemies_t *md[MAP_SNAPSHOT_SETS] = { NULL };
+    game_objs_t *od[MAP_SNAPSHOT_SETS] = { NULL };
+    parsed_map_t *m;
+    parsed_objs_t *o;
+    int g, i, k;
+
+    snapshot_cursor(s, SNAPSHOT_PARAMS, &c);
+
+    if(!(have = snapshot_read(&c, sizeof(int32_t) * 4)) ||
+       !(bp = snapshot_read(&c, sizeof(battle_params))) ||
+       !(cs = snapshot_read(&c, sizeof(char_stats))) ||
+       !(v2cs = snapshot_read(&c, sizeof(v2_char_stats))) ||
+       c.pos != c.size)
+        return -1;
+
+    /* Check everything over before touching anything, then go back and build
+       the arrays that point into the snapshot. */
+    snapshot_cursor(s, SNAPSHOT_MAP_DATA, &d);
+
+    if(snapshot_index(s, &d, 0, counts, md, od))
+        return -1;
+
+    if(!load)
+        return 0;
+
+    if(snapshot_index(s, &d, 1, counts, md, od)) {
+        for(k = 0; k < MAP_SNAPSHOT_SETS; ++k) {
+            free(md[k]);
+            free(od[k]);
+        }
+
+        return -1;
+    }
+
+    for(g = 0, k = 0; g < 3; ++g) {
+        for(i = 0; i < map_groups[g].count; ++i, ++k) {
+            m = &map_groups[g].maps[i];
+            o = &map_groups[g].objs[i];
+            m->map_count = counts[k][0];
+            m->variation_count = counts[k][1];
+            m->data = md[k];
+            o->map_count = counts[k][2];
+            o->variation_count = counts[k][3];
+            o->data = od[k];
+        }
+
+        maps_snapshot[g] = 1;
+    }
+
+    memcpy(battle_params, bp, sizeof(battle_params));
+    memcpy(&char_stats, cs, sizeof(char_stats));
+    memcpy(&v2_char_stats, v2cs, sizeof(v2_char_stats));
+    have_bb_maps = have[0];
+    have_v2_maps = have[1];
+    have_gc_maps = have[2];
+
+    return 0;
+}
+
 void bb_free_params(void) {
     int i, j, k;
     uint32_t l, nmaps;
@@ -1415,7 +1597,7 @@ void bb_free_params(void) {
                 o = &bb_parsed_objs[i][j][k];
                 nmaps = m->map_count * m->variation_count;
 
-                for(l = 0; l < nmaps; ++l) {
+                for(l = 0; l < nmaps && !maps_snapshot[0]; ++l) {
                     free(m->data[l].enemies);
                     free(o->data[l].objs);
                 }
@@ -1429,6 +1611,8 @@ void bb_free_params(void) {
             }
         }
     }
+
+    maps_snapshot[0] = 0;
 }
 
 void v2_free_params(void) {
@@ -1442,7 +1626,7 @@ void v2_free_params(void) {
         o = &v2_parsed_objs[k];
         nmaps = m->map_count * m->variation_count;
 
-        for(l = 0; l < nmaps; ++l) {
+        for(l = 0; l < nmaps && !maps_snapshot[1]; ++l) {
             free(m->data[l].enemies);
             free(o->data[l].objs);
         }
@@ -1454,6 +1638,8 @@ void v2_free_params(void) {
         o->data = NULL;
         o->map_count = o->variation_count = 0;
     }
+
+    maps_snapshot[1] = 0;
 }
 
 void gc_free_params(void) {
@@ -1468,7 +1654,7 @@ void gc_free_params(void) {
             o = &gc_parsed_objs[j][k];
             nmaps = m->map_count * m->variation_count;
 
-            for(l = 0; l < nmaps; ++l) {
+            for(l = 0; l < nmaps && !maps_snapshot[2]; ++l) {
                 free(m->data[l].enemies);
                 free(o->data[l].objs);
             }
@@ -1481,350 +1667,246 @@ void gc_free_params(void) {
             o->map_count = o->variation_count = 0;
         }
     }
-}
-
-int bb_load_game_enemies(lobby_t *l) {
-    game_enemies_t *en;
-    game_objs_t *ob;
-    int solo = (l->flags & LOBBY_FLAG_SINGLEPLAYER) ? 1 : 0, i;
-    uint32_t enemies = 0, index, objects = 0, index2;
-    parsed_map_t *maps;
-    parsed_objs_t *objs;
-    game_enemies_t *sets[0x10];
-    game_objs_t *osets[0x10];
 
-    /* Figure out the parameter set that will be in use first... */
-    l->bb_params = battle_params[solo][l->episode - 1][l->difficulty];
-
-    /* Figure out the total number of enemies that the game will have... */
-    for(i = 0; i < 0x20; i += 2) {
-        maps = &bb_parsed_maps[solo][l->episode - 1][i >> 1];
-        objs = &bb_parsed_objs[solo][l->episode - 1][i >> 1];
-
-        /* If we hit zeroes, then we're done already... */
-        if(maps->map_count == 0 && maps->variation_count == 0) {
-            sets[i >> 1] = NULL;
-            break;
-        }
-
-        /* Sanity Check! */
-        if(l->maps[i] > maps->map_count ||
-           l->maps[i + 1] > maps->variation_count) {
-            debug(DBG_ERROR, "Invalid map set generated for level %d (ep %d): "
-                  "(%d %d)\n", i, l->episode, l->maps[i], l->maps[i + 1]);
-            return -1;
-        }
-
-        index = l->maps[i] * maps->variation_count + l->maps[i + 1];
-        enemies += maps->data[index].count;
-        objects += objs->data[index].count;
-        sets[i >> 1] = &maps->data[index];
-        osets[i >> 1] = &objs->data[index];
-    }
-
-    /* Allocate space for the enemy set and the enemies therein. */
-    if(!(en = (game_enemies_t *)malloc(sizeof(game_enemies_t)))) {
-        debug(DBG_ERROR, "Error allocating enemy set: %s\n", strerror(errno));
-        return -2;
-    }
-
-    if(!(en->enemies = (game_enemy_t *)malloc(sizeof(game_enemy_t) *
-                                              enemies))) {
-        debug(DBG_ERROR, "Error allocating enemies: %s\n", strerror(errno));
-        free(en);
-        return -3;
-    }
+    maps_snapshot[2] = 0;
+}
 
-    /* Allocate space for the object set and the objects therein. */
-    if(!(ob = (game_objs_t *)malloc(sizeof(game_objs_t)))) {
-        debug(DBG_ERROR, "Error allocating object set: %s\n", strerror(errno));
-        free(en->enemies);
-        free(en);
-        return -4;
+/* Figure out what the special rappies turn into for the given event. */
+static uint8_t rappy_rt_index(uint8_t event) {
+    switch(event) {
+        case LOBBY_EVENT_CHRISTMAS:
+            return 79;
+        case LOBBY_EVENT_EASTER:
+            return 81;
+        case LOBBY_EVENT_HALLOWEEN:
+            return 80;
+        default:
+            return 51;
     }
+}
 
-    if(!(ob->objs = (game_object_t *)malloc(sizeof(game_object_t) * objects))) {
-        debug(DBG_ERROR, "Error allocating objects: %s\n", strerror(errno));
-        free(ob);
-        free(en->enemies);
-        free(en);
-        return -5;
-    }
+/* How much of the game's arena the enemies and objects need, given how many
+   of each there are. */
+static size_t game_maps_size(uint32_t enemies, uint32_t objs) {
+    /* Add 8 bytes for each allocation, in case they need to be padded out. */
+    return sizeof(game_map_enemies_t) + sizeof(game_map_objs_t) +
+        (enemies + 1) * sizeof(game_enemy_state_t) + (objs + 1) + 32;
+}
 
-    en->count = enemies;
-    ob->count = objects;
-    index = index2 = 0;
+/* The most memory a game that uses the given maps might need, whatever
+   variations it picks. */
+static size_t max_game_maps_size(const parsed_map_t *pmaps,
+                                 const parsed_objs_t *pobjs) {
+    uint32_t en = 0, ob = 0, en_max, ob_max, j;
+    int i;
 
-    /* Copy in the enemy data. */
     for(i = 0; i < 0x10; ++i) {
-        if(!sets[i] || !osets[i])
+        if(pmaps[i].map_count == 0 && pmaps[i].variation_count == 0)
             break;
 
-        memcpy(&en->enemies[index], sets[i]->enemies,
-               sizeof(game_enemy_t) * sets[i]->count);
-        index += sets[i]->count;
-        memcpy(&ob->objs[index2], osets[i]->objs,
-               sizeof(game_object_t) * osets[i]->count);
-        index2 += osets[i]->count;
-    }
+        en_max = ob_max = 0;
 
-    /* Fixup Dark Falz' data for difficulties other than normal and the special
-       Rappy data too... */
-    for(i = 0; i < en->count; ++i) {
-        if(en->enemies[i].bp_entry == 0x37 && l->difficulty) {
-            en->enemies[i].bp_entry = 0x38;
-        }
-        else if(en->enemies[i].rt_index == (uint8_t)-1) {
-            switch(l->event) {
-                case LOBBY_EVENT_CHRISTMAS:
-                    en->enemies[i].rt_index = 79;
-                    break;
-                case LOBBY_EVENT_EASTER:
-                    en->enemies[i].rt_index = 81;
-                    break;
-                case LOBBY_EVENT_HALLOWEEN:
-                    en->enemies[i].rt_index = 80;
-                    break;
-                default:
-                    en->enemies[i].rt_index = 51;
-                    break;
-            }
+        for(j = 0; j < pmaps[i].map_count * pmaps[i].variation_count; ++j) {
+            if(pmaps[i].data[j].count > en_max)
+                en_max = pmaps[i].data[j].count;
+            if(pobjs[i].data[j].count > ob_max)
+                ob_max = pobjs[i].data[j].count;
         }
+
+        en += en_max;
+        ob += ob_max;
     }
 
-    /* Done! */
-    l->map_enemies = en;
-    l->map_objs = ob;
-    return 0;
+    return game_maps_size(en, ob);
 }
 
-int v2_load_game_enemies(lobby_t *l) {
-    game_enemies_t *en;
-    game_objs_t *ob;
-    int i;
-    uint32_t enemies = 0, index, objects = 0, index2;
-    parsed_map_t *maps;
-    parsed_objs_t *objs;
-    game_enemies_t *sets[0x10];
-    game_objs_t *osets[0x10];
-
-    /* Figure out the total number of enemies that the game will have... */
-    for(i = 0; i < 0x20; i += 2) {
-        maps = &v2_parsed_maps[i >> 1];
-        objs = &v2_parsed_objs[i >> 1];
+size_t map_game_footprint(const lobby_t *l) {
+    int solo = (l->flags & LOBBY_FLAG_SINGLEPLAYER) ? 1 : 0;
 
-        /* If we hit zeroes, then we're done already... */
-        if(maps->map_count == 0 && maps->variation_count == 0) {
-            sets[i >> 1] = NULL;
-            break;
-        }
+    /* This has to line up with which of the *_load_game_enemies() functions
+       lobby_create_game() calls. */
+    if(l->version == CLIENT_VERSION_BB)
+        return max_game_maps_size(bb_parsed_maps[solo][l->episode - 1],
+                                  bb_parsed_objs[solo][l->episode - 1]);
+    else if(l->battle || l->challenge)
+        return 0;
+    else if(l->version <= CLIENT_VERSION_PC && have_v2_maps)
+        return max_game_maps_size(v2_parsed_maps, v2_parsed_objs);
+    else if(l->version == CLIENT_VERSION_GC && have_gc_maps)
+        return max_game_maps_size(gc_parsed_maps[l->episode - 1],
+                                  gc_parsed_objs[l->episode - 1]);
 
-        /* Sanity Check! */
-        if(l->maps[i] > maps->map_count ||
-           l->maps[i + 1] > maps->variation_count) {
-            debug(DBG_ERROR, "Invalid map set generated for level %d (ep %d): "
-                  "(%d %d)\n", i, l->episode, l->maps[i], l->maps[i + 1]);
-            return -1;
-        }
+    return 0;
+}
 
-        index = l->maps[i] * maps->variation_count + l->maps[i + 1];
-        enemies += maps->data[index].count;
-        objects += objs->data[index].count;
-        sets[i >> 1] = &maps->data[index];
-        osets[i >> 1] = &objs->data[index];
-    }
+/* Everything here comes out of the game's arena, so it'll all be freed along
+   with the game. */
+static int alloc_game_maps(lobby_t *l, game_map_enemies_t **enp,
+                           game_map_objs_t **obp) {
+    game_map_enemies_t *en;
+    game_map_objs_t *ob;
 
-    /* Allocate space for the enemy set and the enemies therein. */
-    if(!(en = (game_enemies_t *)malloc(sizeof(game_enemies_t)))) {
+    if(!(en = (game_map_enemies_t *)lobby_alloc(l,
+                                                sizeof(game_map_enemies_t)))) {
         debug(DBG_ERROR, "Error allocating enemy set: %s\n", strerror(errno));
         return -2;
     }
 
-    if(!(en->enemies = (game_enemy_t *)malloc(sizeof(game_enemy_t) *
-                                              enemies))) {
-        debug(DBG_ERROR, "Error allocating enemies: %s\n", strerror(errno));
-        free(en);
-        return -3;
-    }
-
-    /* Allocate space for the object set and the objects therein. */
-    if(!(ob = (game_objs_t *)malloc(sizeof(game_objs_t)))) {
+    if(!(ob = (game_map_objs_t *)lobby_alloc(l, sizeof(game_map_objs_t)))) {
         debug(DBG_ERROR, "Error allocating object set: %s\n", strerror(errno));
-        free(en->enemies);
-        free(en);
         return -4;
     }
 
-    if(!(ob->objs = (game_object_t *)malloc(sizeof(game_object_t) * objects))) {
-        debug(DBG_ERROR, "Error allocating objects: %s\n", strerror(errno));
-        free(ob);
-        free(en->enemies);
-        free(en);
-        return -5;
-    }
-
-    en->count = enemies;
-    ob->count = objects;
-    index = index2 = 0;
+    *enp = en;
+    *obp = ob;
+    return 0;
+}
 
-    /* Copy in the enemy data. */
-    for(i = 0; i < 0x10; ++i) {
-        if(!sets[i] || !osets[i])
-            break;
+/* Drop the enemies' reference to the quest map cache, if they have one. The
+   memory itself belongs to the game's arena. */
+static void free_game_maps(game_map_enemies_t *en, game_map_objs_t *ob) {
+    (void)ob;
 
-        memcpy(&en->enemies[index], sets[i]->enemies,
-               sizeof(game_enemy_t) * sets[i]->count);
-        index += sets[i]->count;
+    if(en && en->qcache)
+        qmap_cache_unref(en->qcache);
+}
 
-        memcpy(&ob->objs[index2], osets[i]->objs,
-               sizeof(game_object_t) * osets[i]->count);
-        index2 += osets[i]->count;
+/* Allocate the per-game state for each enemy and object, and hand everything
+   over to the lobby. */
+static int finish_game_maps(lobby_t *l, game_map_enemies_t *en,
+                            game_map_objs_t *ob) {
+    /* Add one to each, so that we don't try to allocate zero bytes. */
+    if(!(en->state = (game_enemy_state_t *)lobby_alloc(l, (en->count + 1) *
+                                                sizeof(game_enemy_state_t)))) {
+        debug(DBG_ERROR, "Error allocating enemies: %s\n", strerror(errno));
+        free_game_maps(en, ob);
+        return -3;
     }
 
-    /* Fixup Dark Falz' data for difficulties other than normal... */
-    if(l->difficulty) {
-        for(i = 0; i < en->count; ++i) {
-            if(en->enemies[i].bp_entry == 0x37) {
-                en->enemies[i].bp_entry = 0x38;
-            }
-        }
+    if(!(ob->state = (uint8_t *)lobby_alloc(l, ob->count + 1))) {
+        debug(DBG_ERROR, "Error allocating objects: %s\n", strerror(errno));
+        free_game_maps(en, ob);
+        return -5;
     }
 
-    /* Done! */
+    en->start[en->set_count] = en->count;
+    ob->start[ob->set_count] = ob->count;
     l->map_enemies = en;
     l->map_objs = ob;
     return 0;
 }
 
-int gc_load_game_enemies(lobby_t *l) {
-    game_enemies_t *en;
-    game_objs_t *ob;
-    int i;
-    uint32_t enemies = 0, index, objects = 0, index2;
+/* Set up the game's view of the enemies and objects on its maps. Nothing from
+   the parsed maps is copied, the game just points at the variation of each
+   area that it is using. */
+static int load_game_maps(lobby_t *l, parsed_map_t *pmaps,
+                          parsed_objs_t *pobjs, int rappies) {
+    game_map_enemies_t *en;
+    game_map_objs_t *ob;
     parsed_map_t *maps;
     parsed_objs_t *objs;
-    game_enemies_t *sets[0x10];
-    game_objs_t *osets[0x10];
+    uint32_t index;
+    int i, rv;
+
+    if((rv = alloc_game_maps(l, &en, &ob)))
+        return rv;
 
-    /* Figure out the total number of enemies that the game will have... */
     for(i = 0; i < 0x20; i += 2) {
-        maps = &gc_parsed_maps[l->episode - 1][i >> 1];
-        objs = &gc_parsed_objs[l->episode - 1][i >> 1];
+        maps = &pmaps[i >> 1];
+        objs = &pobjs[i >> 1];
 
         /* If we hit zeroes, then we're done already... */
-        if(maps->map_count == 0 && maps->variation_count == 0) {
-            sets[i >> 1] = NULL;
+        if(maps->map_count == 0 && maps->variation_count == 0)
             break;
-        }
 
         /* Sanity Check! */
         if(l->maps[i] > maps->map_count ||
            l->maps[i + 1] > maps->variation_count) {
             debug(DBG_ERROR, "Invalid map set generated for level %d (ep %d): "
                   "(%d %d)\n", i, l->episode, l->maps[i], l->maps[i + 1]);
+            free_game_maps(en, ob);
             return -1;
         }
 
         index = l->maps[i] * maps->variation_count + l->maps[i + 1];
-        enemies += maps->data[index].count;
-        objects += objs->data[index].count;
-        sets[i >> 1] = &maps->data[index];
-        osets[i >> 1] = &objs->data[index];
-    }
 
-    /* Allocate space for the enemy set and the enemies therein. */
-    if(!(en = (game_enemies_t *)malloc(sizeof(game_enemies_t)))) {
-        debug(DBG_ERROR, "Error allocating enemy set: %s\n", strerror(errno));
-        return -2;
-    }
+        en->start[en->set_count] = en->count;
+        en->sets[en->set_count++] = maps->data[index].enemies;
+        en->count += maps->data[index].count;
 
-    if(!(en->enemies = (game_enemy_t *)malloc(sizeof(game_enemy_t) *
-                                              enemies))) {
-        debug(DBG_ERROR, "Error allocating enemies: %s\n", strerror(errno));
-        free(en);
-        return -3;
+        ob->start[ob->set_count] = ob->count;
+        ob->sets[ob->set_count++] = objs->data[index].objs;
+        ob->count += objs->data[index].count;
     }
 
-    /* Allocate space for the object set and the objects therein. */
-    if(!(ob = (game_objs_t *)malloc(sizeof(game_objs_t)))) {
-        debug(DBG_ERROR, "Error allocating object set: %s\n", strerror(errno));
-        free(en->enemies);
-        free(en);
-        return -4;
-    }
+    /* Dark Falz' data is different for difficulties other than normal, and
+       the special rappies depend on the event going on. */
+    en->falz_fixup = !!l->difficulty;
 
-    if(!(ob->objs = (game_object_t *)malloc(sizeof(game_object_t) * objects))) {
-        debug(DBG_ERROR, "Error allocating objects: %s\n", strerror(errno));
-        free(ob);
-        free(en->enemies);
-        free(en);
-        return -5;
-    }
+    if(rappies)
+        en->rappy_rt = rappy_rt_index(l->event);
 
-    en->count = enemies;
-    ob->count = objects;
-    index = index2 = 0;
+    return finish_game_maps(l, en, ob);
+}
 
-    /* Copy in the enemy data. */
-    for(i = 0; i < 0x10; ++i) {
-        if(!sets[i] || !osets[i])
-            break;
+int bb_load_game_enemies(lobby_t *l) {
+    int solo = (l->flags & LOBBY_FLAG_SINGLEPLAYER) ? 1 : 0;
 
-        memcpy(&en->enemies[index], sets[i]->enemies,
-               sizeof(game_enemy_t) * sets[i]->count);
-        index += sets[i]->count;
+    /* Figure out the parameter set that will be in use first... */
+    l->bb_params = battle_params[solo][l->episode - 1][l->difficulty];
 
-        memcpy(&ob->objs[index2], osets[i]->objs,
-               sizeof(game_object_t) * osets[i]->count);
-        index2 += osets[i]->count;
-    }
+    return load_game_maps(l, bb_parsed_maps[solo][l->episode - 1],
+                          bb_parsed_objs[solo][l->episode - 1], 1);
+}
 
-    /* Fixup Dark Falz' data for difficulties other than normal and the special
-       Rappy data too... */
-    for(i = 0; i < en->count; ++i) {
-        if(en->enemies[i].bp_entry == 0x37 && l->difficulty) {
-            en->enemies[i].bp_entry = 0x38;
-        }
-        else if(en->enemies[i].rt_index == (uint8_t)-1) {
-            switch(l->event) {
-                case LOBBY_EVENT_CHRISTMAS:
-                    en->enemies[i].rt_index = 79;
-                    break;
-                case LOBBY_EVENT_EASTER:
-                    en->enemies[i].rt_index = 81;
-                    break;
-                case LOBBY_EVENT_HALLOWEEN:
-                    en->enemies[i].rt_index = 80;
-                    break;
-                default:
-                    en->enemies[i].rt_index = 51;
-                    break;
-            }
-        }
-    }
+int v2_load_game_enemies(lobby_t *l) {
+    return load_game_maps(l, v2_parsed_maps, v2_parsed_objs, 0);
+}
 
-    /* Done! */
-    l->map_enemies = en;
-    l->map_objs = ob;
-    return 0;
+int gc_load_game_enemies(lobby_t *l) {
+    return load_game_maps(l, gc_parsed_maps[l->episode - 1],
+                          gc_parsed_objs[l->episode - 1], 1);
 }
 
 void free_game_enemies(lobby_t *l) {
-    if(l->map_enemies) {
-        free(l->map_enemies->enemies);
-        free(l->map_enemies);
-    }
-
-    if(l->map_objs) {
-        free(l->map_objs->objs);
-        free(l->map_objs);
-    }
+    free_game_maps(l->map_enemies, l->map_objs);
 
     l->map_enemies = NULL;
     l->map_objs = NULL;
     l->bb_params = NULL;
 }
 
+const game_enemy_t *map_get_enemy(const game_map_enemies_t *en, uint32_t mid,
+                                  game_enemy_t *buf) {
+    int i;
+
+    if(!en || mid >= en->count)
+        return NULL;
+
+    /* Find the area the enemy is in... */
+    for(i = en->set_count - 1; i > 0 && en->start[i] > mid; --i) ;
+
+    *buf = en->sets[i][mid - en->start[i]];
+
+    if(buf->bp_entry == 0x37 && en->falz_fixup)
+        buf->bp_entry = 0x38;
+    else if(buf->rt_index == (uint8_t)-1 && en->rappy_rt)
+        buf->rt_index = en->rappy_rt;
+
+    return buf;
+}
+
+const game_object_t *map_get_object(const game_map_objs_t *ob, uint32_t oid) {
+    int i;
+
+    if(!ob || oid >= ob->count)
+        return NULL;
+
+    for(i = ob->set_count - 1; i > 0 && ob->start[i] > oid; --i) ;
+
+    return &ob->sets[i][oid - ob->start[i]];
+}
+
 int map_have_v2_maps(void) {
     return have_v2_maps;
 }
@@ -1874,65 +1956,138 @@ static void parse_quest_objects(const uint8_t *data, uint32_t len,
     *obj_cnt = obj_count;
 }
 
-int cache_quest_enemies(const char *ofn, const uint8_t *dat, uint32_t sz,
-                        int episode) {
+/* Write to the cache file, padding it out to keep everything aligned. */
+static int qmap_cache_write(qmap_cache_builder_t *b, const void *data,
+                            size_t len) {
+    static const uint8_t zeroes[QMAP_CACHE_ALIGN] = { 0 };
+    size_t pad;
+
+    if(len && fwrite(data, 1, len, b->fp) != len)
+        return -1;
+
+    b->offset += len;
+    pad = (QMAP_CACHE_ALIGN - (b->offset % QMAP_CACHE_ALIGN)) %
+        QMAP_CACHE_ALIGN;
+
+    if(pad && fwrite(zeroes, 1, pad, b->fp) != pad)
+        return -1;
+
+    b->offset += pad;
+    return 0;
+}
+
+int qmap_cache_begin(qmap_cache_builder_t *b, const char *fn) {
+    static uint32_t serial = 0;
+    qmap_cache_hdr_t hdr;
+    size_t len = strlen(fn) + 32;
+
+    memset(b, 0, sizeof(qmap_cache_builder_t));
+
+    if(!(b->fn = strdup(fn)) || !(b->tmpfn = (char *)malloc(len))) {
+        debug(DBG_WARN, "Cannot allocate memory: %s\n", strerror(errno));
+        free(b->fn);
+        return -1;
+    }
+
+    /* Two refreshes can be building the same cache at once, so each one gets
+       its own temporary file. Whichever gets renamed last wins. */
+    snprintf(b->tmpfn, len, "%s.%ld.%" PRIu32 ".tmp", fn, (long)getpid(),
+             __atomic_add_fetch(&serial, 1, __ATOMIC_RELAXED));
+
+    if(!(b->fp = fopen(b->tmpfn, "w+b"))) {
+        debug(DBG_WARN, "Cannot open cache file \"%s\" for writing: %s\n",
+              b->tmpfn, strerror(errno));
+        free(b->tmpfn);
+        free(b->fn);
+        return -2;
+    }
+
+    /* Leave space for the header, it gets filled in at the end. */
+    memset(&hdr, 0, sizeof(qmap_cache_hdr_t));
+    if(qmap_cache_write(b, &hdr, sizeof(qmap_cache_hdr_t))) {
+        debug(DBG_WARN, "Error writing to cache file \"%s\": %s\n", b->tmpfn,
+              strerror(errno));
+        qmap_cache_abort(b);
+        return -3;
+    }
+
+    return 0;
+}
+
+void qmap_cache_abort(qmap_cache_builder_t *b) {
+    if(b->fp) {
+        fclose(b->fp);
+        unlink(b->tmpfn);
+    }
+
+    free(b->index);
+    free(b->tmpfn);
+    free(b->fn);
+    memset(b, 0, sizeof(qmap_cache_builder_t));
+}
+
+int qmap_cache_add(qmap_cache_builder_t *b, uint32_t qid, const uint8_t *dat,
+                   uint32_t sz, int episode) {
     int i, alt;
-    uint32_t index, area, objects, j;
+    uint32_t objects, area, j;
     const quest_dat_hdr_t *ptrs[2][17] = { { 0 } };
     game_enemies_t tmp_en;
-    FILE *fp;
+    game_object_t obj;
     const quest_dat_hdr_t *hdr;
-    off_t offs;
+    qmap_cache_entry_t *ent;
+    void *tmp;
 
-    /* Open the cache file... */
-    if(!(fp = fopen(ofn, "wb"))) {
-        debug(DBG_WARN, "Cannot open cache file \"%s\" for writing: %s\n", ofn,
-              strerror(errno));
-        return -1;
+    /* Make room in the index for the new quest. */
+    if(b->count == b->max) {
+        j = b->max ? b->max * 2 : 64;
+
+        if(!(tmp = realloc(b->index, j * sizeof(qmap_cache_entry_t)))) {
+            debug(DBG_WARN, "Cannot allocate cache index: %s\n",
+                  strerror(errno));
+            return -1;
+        }
+
+        b->index = (qmap_cache_entry_t *)tmp;
+        b->max = j;
     }
 
-    /* Figure out the total number of enemies that the quest has... */
+    ent = &b->index[b->count];
+    memset(ent, 0, sizeof(qmap_cache_entry_t));
+    ent->qid = qid;
+
+    /* Figure out the total number of objects that the quest has... */
     parse_quest_objects(dat, sz, &objects, ptrs);
-    debug(DBG_LOG, "Cache file: %s\n", ofn);
-    debug(DBG_LOG, "Number of objects: %" PRIu32 "\n", objects);
 
     /* Write out the objects in exactly the same form that they'll be needed
-       when loaded later on. */
-    objects = LE32(objects);
-    if(fwrite(&objects, 1, 4, fp) != 4) {
-        debug(DBG_WARN, "Error writing to cache file \"%s\": %s\n", ofn,
-              strerror(errno));
-        fclose(fp);
-        return -2;
-    }
+       when loaded later on, running through each area in order. */
+    ent->obj_offset = b->offset;
+    ent->obj_count = objects;
 
-    /* Run through each area and write them in order. */
     for(i = 0; i < 17; ++i) {
         if((hdr = ptrs[0][i])) {
-            sz = LE32(hdr->size);
-            objects = sz / sizeof(map_object_t);
+            objects = LE32(hdr->size) / sizeof(map_object_t);
 
             for(j = 0; j < objects; ++j) {
-                /* Write the object itself. */
-                if(fwrite(hdr->data + j * sizeof(map_object_t), 1,
-                          sizeof(map_object_t), fp) != sizeof(map_object_t)) {
-                    debug(DBG_WARN, "Error writing to cache file \"%s\": %s\n",
-                          ofn, strerror(errno));
-                    fclose(fp);
-                    return -3;
-                }
+                memcpy(&obj.data, hdr->data + j * sizeof(map_object_t),
+                       sizeof(map_object_t));
+                obj.area = i;
+
+                if(fwrite(&obj, 1, sizeof(game_object_t),
+                          b->fp) != sizeof(game_object_t))
+                    goto err;
             }
+
+            b->offset += objects * sizeof(game_object_t);
         }
     }
 
-    /* Save our position, as we don't know in advance how many parsed enemies
-       we will have... */
-    offs = ftello(fp);
-    fseeko(fp, 4, SEEK_CUR);
-    debug(DBG_LOG, "Enemy data position: %" PRIx64 "\n", (uint64_t)offs);
-    index = 0;
+    /* Pad out the end of the objects. */
+    if(qmap_cache_write(b, NULL, 0))
+        goto err;
 
     /* Copy in the enemy data. */
+    ent->enemy_offset = b->offset;
+
     for(i = 0; i < 17; ++i) {
         if((hdr = ptrs[1][i])) {
             /* XXXX: Ugly! */
@@ -1943,56 +2098,253 @@ int cache_quest_enemies(const char *ofn, const uint8_t *dat, uint32_t sz,
             if((episode == 3 && area > 5) || (episode == 2 && area > 15))
                 alt = 1;
 
+            /* Whatever we've already written is accounted for, so the
+               cache is still fine if we leave this quest out of it. */
             if(parse_map((map_enemy_t *)(hdr->data), sz / sizeof(map_enemy_t),
                          &tmp_en, episode, alt, area)) {
                 debug(DBG_WARN, "Canot parse map for cache!\n");
-                fclose(fp);
-                return -4;
+                return qmap_cache_write(b, NULL, 0) ? -5 : -4;
             }
 
             sz = tmp_en.count * sizeof(game_enemy_t);
-            if(fwrite(tmp_en.enemies, 1, sz, fp) != sz) {
-                debug(DBG_WARN, "Error writing to cache file \"%s\": %s\n", ofn,
-                      strerror(errno));
+            if(fwrite(tmp_en.enemies, 1, sz, b->fp) != sz) {
                 free(tmp_en.enemies);
-                fclose(fp);
-                return -5;
+                goto err;
             }
 
-            index += tmp_en.count;
+            b->offset += sz;
+            ent->enemy_count += tmp_en.count;
             free(tmp_en.enemies);
         }
     }
 
-    /* Go back and write the amount of enemies we have. */
-    fseeko(fp, offs, SEEK_SET);
-    debug(DBG_LOG, "Number of enemies: %" PRIu32 "\n", index);
-    index = LE32(index);
+    if(qmap_cache_write(b, NULL, 0))
+        goto err;
 
-    if(fwrite(&index, 1, 4, fp) != 4) {
-        debug(DBG_WARN, "Error writing to cache file \"%s\": %s\n", ofn,
-              strerror(errno));
-        fclose(fp);
-        return -6;
+    ++b->count;
+    return 0;
+
+err:
+    debug(DBG_WARN, "Error writing to cache file \"%s\": %s\n", b->tmpfn,
+          strerror(errno));
+    return -5;
+}
+
+static int qmap_entry_cmp(const void *a, const void *b) {
+    const qmap_cache_entry_t *e1 = (const qmap_cache_entry_t *)a;
+    const qmap_cache_entry_t *e2 = (const qmap_cache_entry_t *)b;
+
+    if(e1->qid < e2->qid)
+        return -1;
+    else if(e1->qid > e2->qid)
+        return 1;
+
+    return 0;
+}
+
+int qmap_cache_finish(qmap_cache_builder_t *b) {
+    qmap_cache_hdr_t hdr;
+    void *map;
+    int fd;
+
+    /* Write the index, sorted by quest ID so it can be searched. */
+    if(b->count)
+        qsort(b->index, b->count, sizeof(qmap_cache_entry_t), qmap_entry_cmp);
+
+    memset(&hdr, 0, sizeof(qmap_cache_hdr_t));
+    hdr.magic = QMAP_CACHE_MAGIC;
+    hdr.version = QMAP_CACHE_VERSION;
+    hdr.enemy_size = sizeof(game_enemy_t);
+    hdr.object_size = sizeof(game_object_t);
+    hdr.count = b->count;
+    hdr.index_offset = b->offset;
+
+    if(qmap_cache_write(b, b->index, b->count * sizeof(qmap_cache_entry_t)) ||
+       fflush(b->fp))
+        goto err;
+
+    hdr.size = b->offset;
+
+    /* Checksum everything after the header, then go back and fill it in. */
+    fd = fileno(b->fp);
+    map = mmap(NULL, (size_t)hdr.size, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)
+        goto err;
+
+    hdr.checksum = sylverant_crc32((const uint8_t *)map + sizeof(hdr),
+                                   (int)(hdr.size - sizeof(hdr)));
+    munmap(map, (size_t)hdr.size);
+
+    if(fseeko(b->fp, 0, SEEK_SET) ||
+       fwrite(&hdr, 1, sizeof(hdr), b->fp) != sizeof(hdr))
+        goto err;
+
+    if(fclose(b->fp)) {
+        b->fp = NULL;
+        unlink(b->tmpfn);
+        goto err;
     }
 
-    /* We're done with the cache file now, so clean up and return. */
-    fclose(fp);
+    b->fp = NULL;
+
+    /* Anything that already has the old file mapped keeps the old data, so
+       it's safe to swap the new one into place now. */
+    if(rename(b->tmpfn, b->fn)) {
+        unlink(b->tmpfn);
+        goto err;
+    }
+
+    debug(DBG_LOG, "Wrote %" PRIu32 " quests to map cache \"%s\"\n", b->count,
+          b->fn);
+    qmap_cache_abort(b);
     return 0;
+
+err:
+    debug(DBG_WARN, "Error writing to cache file \"%s\": %s\n", b->tmpfn,
+          strerror(errno));
+    qmap_cache_abort(b);
+    return -1;
+}
+
+qmap_cache_t *qmap_cache_open(const char *fn) {
+    int fd;
+    struct stat st;
+    void *map;
+    const qmap_cache_hdr_t *hdr;
+    const qmap_cache_entry_t *ent;
+    qmap_cache_t *rv;
+    uint32_t i;
+    uint64_t end;
+
+    if((fd = open(fn, O_RDONLY)) < 0) {
+        debug(DBG_WARN, "Cannot open map cache \"%s\": %s\n", fn,
+              strerror(errno));
+        return NULL;
+    }
+
+    if(fstat(fd, &st) || st.st_size < (off_t)sizeof(qmap_cache_hdr_t)) {
+        debug(DBG_WARN, "Invalid map cache \"%s\"\n", fn);
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(map == MAP_FAILED) {
+        debug(DBG_WARN, "Cannot map cache \"%s\": %s\n", fn, strerror(errno));
+        return NULL;
+    }
+
+    /* Make sure the file is one we can use, and that it's intact. */
+    hdr = (const qmap_cache_hdr_t *)map;
+    if(hdr->magic != QMAP_CACHE_MAGIC || hdr->version != QMAP_CACHE_VERSION ||
+       hdr->enemy_size != sizeof(game_enemy_t) ||
+       hdr->object_size != sizeof(game_object_t) ||
+       hdr->size != (uint64_t)st.st_size ||
+       hdr->index_offset % QMAP_CACHE_ALIGN ||
+       hdr->index_offset + (uint64_t)hdr->count * sizeof(qmap_cache_entry_t) >
+       hdr->size) {
+        debug(DBG_WARN, "Map cache \"%s\" has a bad header\n", fn);
+        goto err;
+    }
+
+    if(sylverant_crc32((const uint8_t *)map + sizeof(qmap_cache_hdr_t),
+                       (int)(hdr->size - sizeof(qmap_cache_hdr_t))) !=
+       hdr->checksum) {
+        debug(DBG_WARN, "Map cache \"%s\" has a bad checksum\n", fn);
+        goto err;
+    }
+
+    /* Check each entry once here so lookups don't need to later. */
+    ent = (const qmap_cache_entry_t *)((const uint8_t *)map +
+                                       hdr->index_offset);
+
+    for(i = 0; i < hdr->count; ++i) {
+        end = ent[i].obj_offset +
+            (uint64_t)ent[i].obj_count * sizeof(game_object_t);
+
+        if(end > hdr->index_offset)
+            break;
+
+        end = ent[i].enemy_offset +
+            (uint64_t)ent[i].enemy_count * sizeof(game_enemy_t);
+
+        if(end > hdr->index_offset || ent[i].enemy_offset % QMAP_CACHE_ALIGN)
+            break;
+
+        if(i && ent[i].qid <= ent[i - 1].qid)
+            break;
+    }
+
+    if(i != hdr->count) {
+        debug(DBG_WARN, "Map cache \"%s\" has a bad index entry (%" PRIu32
+              ")\n", fn, i);
+        goto err;
+    }
+
+    if(!(rv = (qmap_cache_t *)malloc(sizeof(qmap_cache_t)))) {
+        debug(DBG_WARN, "Cannot allocate map cache: %s\n", strerror(errno));
+        goto err;
+    }
+
+    if(pthread_mutex_init(&rv->mutex, NULL)) {
+        debug(DBG_WARN, "Cannot create map cache mutex\n");
+        free(rv);
+        goto err;
+    }
+
+    rv->refcnt = 1;
+    rv->base = (const uint8_t *)map;
+    rv->size = (size_t)st.st_size;
+    rv->index = ent;
+    rv->count = hdr->count;
+
+    return rv;
+
+err:
+    munmap(map, (size_t)st.st_size);
+    return NULL;
+}
+
+void qmap_cache_ref(qmap_cache_t *c) {
+    pthread_mutex_lock(&c->mutex);
+    ++c->refcnt;
+    pthread_mutex_unlock(&c->mutex);
+}
+
+void qmap_cache_unref(qmap_cache_t *c) {
+    int last;
+
+    pthread_mutex_lock(&c->mutex);
+    last = !--c->refcnt;
+    pthread_mutex_unlock(&c->mutex);
+
+    if(last) {
+        munmap((void *)c->base, c->size);
+        pthread_mutex_destroy(&c->mutex);
+        free(c);
+    }
+}
+
+const qmap_cache_entry_t *qmap_cache_find(const qmap_cache_t *c, uint32_t qid) {
+    qmap_cache_entry_t key;
+
+    key.qid = qid;
+    return (const qmap_cache_entry_t *)bsearch(&key, c->index, c->count,
+                                               sizeof(qmap_cache_entry_t),
+                                               qmap_entry_cmp);
 }
 
 int load_quest_enemies(lobby_t *l, uint32_t qid, int ver) {
-    FILE *fp;
-    size_t dlen = strlen(ship->cfg->quests_dir);
-    char fn[dlen + 40];
-    void *tmp;
-    uint32_t cnt, i;
+    uint32_t i;
     sylverant_quest_t *q;
     quest_map_elem_t *el;
     uint32_t flags = l->flags;
-    game_enemies_t *newen;
-    game_objs_t *newob;
-    ssize_t amt;
+    game_map_enemies_t *newen;
+    game_map_objs_t *newob;
+    qmap_cache_t *qc;
+    const qmap_cache_entry_t *ent;
 
     /* Cowardly refuse to do this on challenge or battle mode. */
     if(l->challenge || l->battle)
@@ -2005,155 +2357,48 @@ int load_quest_enemies(lobby_t *l, uint32_t qid, int ver) {
     if(ver == CLIENT_VERSION_PC)
         ver = CLIENT_VERSION_DCV2;
 
-    /* Figure out where we're looking... */
-    sprintf(fn, "%s/.mapcache/%s/%08x", ship->cfg->quests_dir,
-            version_codes[ver], qid);
-
-    if(!(fp = fopen(fn, "rb"))) {
-        debug(DBG_WARN, "Cannot open file \"%s\": %s\n", fn, strerror(errno));
+    /* Find the quest in the map cache. The caller holds the quest lock, so the
+       cache can't go anywhere while we grab our reference to it. */
+    if(!(qc = ship->qmap_cache[ver]) || !(ent = qmap_cache_find(qc, qid))) {
+        debug(DBG_WARN, "Quest %" PRIu32 " (version %d) not in map cache\n",
+              qid, ver);
         return -1;
     }
 
-    /* Start by reading in the objects array. */
-    if(fread(&cnt, 1, 4, fp) != 4) {
-        debug(DBG_WARN, "Cannot read file \"%s\": %s\n", fn, strerror(errno));
-        fclose(fp);
-        return -2;
-    }
+    /* Allocate the storage for the new enemy/object arrays. Whatever the game
+       was using before stays in its arena until the game is gone. */
+    lobby_reserve(l, game_maps_size(ent->enemy_count, ent->obj_count));
 
-    /* Allocate the storage for the new enemy/object arrays. */
-    if(!(newen = (game_enemies_t *)malloc(sizeof(game_enemies_t)))) {
-        debug(DBG_WARN, "Cannot allocate enemies for quest: %s\n",
-              strerror(errno));
-        fclose(fp);
+    if(alloc_game_maps(l, &newen, &newob)) {
+        debug(DBG_WARN, "Cannot allocate enemies for quest\n");
         return -10;
     }
 
-    if(!(newob = (game_objs_t *)malloc(sizeof(game_objs_t)))) {
-        debug(DBG_WARN, "Cannot allocate objects for quest: %s\n",
-              strerror(errno));
-        free(newen);
-        fclose(fp);
-        return -11;
-    }
-
-    memset(newen, 0, sizeof(game_enemies_t));
-    memset(newob, 0, sizeof(game_objs_t));
-
-    /* Allocate the objects array. */
-    newob->count = cnt = LE32(cnt);
-    if(!(tmp = malloc(cnt * sizeof(game_object_t)))) {
-        debug(DBG_WARN, "Cannot allocate object array for quest: %s\n",
-              strerror(errno));
-        debug(DBG_WARN, "Quest ID: %" PRIu32 " Version: %d\n", qid, ver);
-        debug(DBG_WARN, "Object count: %" PRIu32 "\n", cnt);
-        free(newob);
-        free(newen);
-        fclose(fp);
-        return -3;
-    }
-
-    newob->objs = (game_object_t *)tmp;
-
-    /* Read the objects in from the cache file. */
-    for(i = 0; i < cnt; ++i) {
-        if((amt = fread(&newob->objs[i].data, 1, sizeof(map_object_t),
-                        fp)) != sizeof(map_object_t)) {
-            if(amt < 0) {
-                debug(DBG_WARN, "Cannot read cached map objects at object id "
-                      "%" PRIu32 ": %s\n", i, strerror(errno));
-            }
-            else {
-                debug(DBG_WARN, "Cannot read cached map objects at object id "
-                      "%" PRIu32 ": needed %zu, got %z\n", i,
-                      sizeof(map_object_t), amt);
-            }
-
-            debug(DBG_WARN, "Quest ID: %" PRIu32 " Version: %d\n", qid, ver);
-            debug(DBG_WARN, "Object count: %" PRIu32 "\n", cnt);
-            free(newob->objs);
-            free(newob);
-            free(newen);
-            fclose(fp);
-            return -4;
-        }
+    /* Point right at the cached data. */
+    newob->count = ent->obj_count;
+    newob->sets[0] = (const game_object_t *)(qc->base + ent->obj_offset);
+    newob->set_count = 1;
 
-        newob->objs[i].flags = 0;
-    }
+    newen->count = ent->enemy_count;
+    newen->sets[0] = (const game_enemy_t *)(qc->base + ent->enemy_offset);
+    newen->set_count = 1;
 
-    if(fread(&cnt, 1, 4, fp) != 4) {
-        debug(DBG_WARN, "Cannot read file \"%s\": %s\n", fn, strerror(errno));
-        free(newob->objs);
-        free(newob);
-        free(newen);
-        fclose(fp);
-        return -5;
-    }
+    qmap_cache_ref(qc);
+    newen->qcache = qc;
 
-    /* Allocate the enemies array. */
-    newen->count = cnt = LE32(cnt);
-    if(!(tmp = malloc(cnt * sizeof(game_enemy_t)))) {
-        debug(DBG_WARN, "Cannot allocate enemies array for quest: %s\n",
-              strerror(errno));
-        debug(DBG_WARN, "Quest ID: %" PRIu32 " Version: %d\n", qid, ver);
-        debug(DBG_WARN, "Enemy count: %" PRIu32 "\n", cnt);
-        free(newob->objs);
-        free(newob);
-        free(newen);
-        fclose(fp);
-        return -6;
-    }
-
-    newen->enemies = (game_enemy_t *)tmp;
-
-    /* Read the enemies in from the cache file. */
-    if(fread(newen->enemies, sizeof(game_enemy_t), cnt, fp) != cnt) {
-        debug(DBG_WARN, "Cannot read map cache: %s\n", strerror(errno));
-        debug(DBG_WARN, "Quest ID: %" PRIu32 " Version: %d\n", qid, ver);
-        debug(DBG_WARN, "Object count: %" PRIu32 "\n", newob->count);
-        debug(DBG_WARN, "Enemy count: %" PRIu32 "\n", newen->count);
-        free(newen->enemies);
-        free(newob->objs);
-        free(newob);
-        free(newen);
-        fclose(fp);
-        return -7;
-    }
-
-    /* We're done with the file now, so close it. */
-    fclose(fp);
+    /* Fixup Dark Falz' data for difficulties other than normal and the special
+       Rappy data too... These get applied when the enemies are looked up. */
+    newen->falz_fixup = !!l->difficulty;
+    newen->rappy_rt = rappy_rt_index(l->event);
 
     /* It should be safe to swap things out now, so do it. */
-    free(l->map_enemies->enemies);
-    free(l->map_objs->objs);
-    free(l->map_enemies);
-    free(l->map_objs);
-
-    l->map_enemies = newen;
-    l->map_objs = newob;
+    free_game_maps(l->map_enemies, l->map_objs);
+    l->map_enemies = NULL;
+    l->map_objs = NULL;
 
-    /* Fixup Dark Falz' data for difficulties other than normal and the special
-       Rappy data too... */
-    for(i = 0; i < cnt; ++i) {
-        if(l->map_enemies->enemies[i].bp_entry == 0x37 && l->difficulty) {
-            l->map_enemies->enemies[i].bp_entry = 0x38;
-        }
-        else if(l->map_enemies->enemies[i].rt_index == (uint8_t)-1) {
-            switch(l->event) {
-                case LOBBY_EVENT_CHRISTMAS:
-                    l->map_enemies->enemies[i].rt_index = 79;
-                    break;
-                case LOBBY_EVENT_EASTER:
-                    l->map_enemies->enemies[i].rt_index = 81;
-                    break;
-                case LOBBY_EVENT_HALLOWEEN:
-                    l->map_enemies->enemies[i].rt_index = 80;
-                    break;
-                default:
-                    l->map_enemies->enemies[i].rt_index = 51;
-                    break;
-            }
-        }
+    if(finish_game_maps(l, newen, newob)) {
+        debug(DBG_WARN, "Cannot allocate enemy state for quest\n");
+        return -8;
     }
 
     /* Find the quest since we need to check the enemies later for drops... */
@@ -2180,16 +2425,17 @@ int load_quest_enemies(lobby_t *l, uint32_t qid, int ver) {
 
     /* Make a copy of the monster data from the quest. */
     l->num_mtypes = q->num_monster_types;
-    if(!(l->mtypes = (qenemy_t *)malloc(sizeof(qenemy_t) * l->num_mtypes))) {
+    if(!(l->mtypes = (qenemy_t *)lobby_alloc(l, sizeof(qenemy_t) *
+                                             l->num_mtypes))) {
         debug(DBG_WARN, "Cannot allocate monster types: %s\n", strerror(errno));
         l->num_mtypes = 0;
         goto done;
     }
 
     l->num_mids = q->num_monster_ids;
-    if(!(l->mids = (qenemy_t *)malloc(sizeof(qenemy_t) * l->num_mids))) {
+    if(!(l->mids = (qenemy_t *)lobby_alloc(l, sizeof(qenemy_t) *
+                                           l->num_mids))) {
         debug(DBG_WARN, "Cannot allocate monster ids: %s\n", strerror(errno));
-        free(l->mtypes);
         l->mtypes = NULL;
         l->num_mtypes = 0;
         l->num_mids = 0;
@@ -18,10 +18,14 @@
 #ifndef MAPDATA_H
 #define MAPDATA_H
 
+#include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include <sylverant/config.h>
 
+#include "snapshot.h"
+
 #ifdef PACKED
 #undef PACKED
 #endif
@@ -114,15 +118,20 @@ typedef struct map_object {
     };
 } PACKED map_object_t;
 
-/* Enemy data as used in the game. */
+/* Enemy data as used in the game. Once parsed, this is shared between every
+   game that uses the same map, so it must never be modified. Anything that
+   changes during a game lives in a game_enemy_state_t instead. */
 typedef struct game_enemy {
     uint32_t bp_entry;
     uint8_t rt_index;
+    uint8_t area;
+} game_enemy_t;
+
+typedef struct game_enemy_state {
     uint8_t clients_hit;
     uint8_t last_client;
     uint8_t drop_done;
-    uint8_t area;
-} game_enemy_t;
+} game_enemy_state_t;
 
 typedef struct game_enemies {
     uint32_t count;
@@ -135,13 +144,17 @@ typedef struct parsed_map {
     game_enemies_t *data;
 } parsed_map_t;
 
-/* Object data as used in the game. */
+/* Object data as used in the game. Just like the enemies, this is shared, and
+   what changes during the game is kept in a separate state array. */
 typedef struct game_object {
     map_object_t data;
-    uint32_t flags;
     uint8_t area;
 } game_object_t;
 
+/* Per-game object state flags. */
+#define GAME_OBJ_DROP_DONE  0x01
+#define GAME_OBJ_HIT        0x02
+
 typedef struct game_objects {
     uint32_t count;
     game_object_t *objs;
@@ -153,6 +166,90 @@ typedef struct parsed_objects {
     game_objs_t *data;
 } parsed_objs_t;
 
+/* The enemies in one game. The game's enemy list is the concatenation of one
+   parsed map per area, so rather than copying all of them for each game, this
+   just points at the shared parsed data for each area along with the index of
+   the first enemy from each. Only the state array belongs to the game. */
+typedef struct game_map_enemies {
+    uint32_t count;
+    int set_count;
+    uint32_t start[0x11];
+    const game_enemy_t *sets[0x10];
+
+    /* Fixups to apply to the shared data for this game's difficulty and
+       event. A rappy_rt of zero means to leave the rappies alone. */
+    int falz_fixup;
+    uint8_t rappy_rt;
+
+    game_enemy_state_t *state;
+
+    /* The quest map cache the enemies and objects point into, if any. */
+    struct qmap_cache *qcache;
+} game_map_enemies_t;
+
+typedef struct game_map_objs {
+    uint32_t count;
+    int set_count;
+    uint32_t start[0x11];
+    const game_object_t *sets[0x10];
+
+    /* Per-game state for each object (GAME_OBJ_* flags). */
+    uint8_t *state;
+} game_map_objs_t;
+
+/* The quest map cache. One file is built for each version with the parsed
+   objects and enemies for every quest, and it gets mapped read-only so that
+   games running a quest all point directly at it. The file starts with the
+   header, followed by the data for each quest (each array aligned to
+   QMAP_CACHE_ALIGN bytes), with the index (sorted by quest ID) at the end.
+   Everything is in host byte order, since the file never leaves the machine
+   that built it. */
+#define QMAP_CACHE_MAGIC        0x434D5153      /* "SQMC" */
+#define QMAP_CACHE_VERSION      1
+#define QMAP_CACHE_ALIGN        8
+
+typedef struct qmap_cache_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t enemy_size;
+    uint32_t object_size;
+    uint32_t count;
+    uint32_t checksum;              /* CRC32 of everything after the header */
+    uint64_t index_offset;
+    uint64_t size;
+} qmap_cache_hdr_t;
+
+typedef struct qmap_cache_entry {
+    uint32_t qid;
+    uint32_t obj_count;
+    uint32_t enemy_count;
+    uint32_t reserved;
+    uint64_t obj_offset;
+    uint64_t enemy_offset;
+} qmap_cache_entry_t;
+
+typedef struct qmap_cache {
+    pthread_mutex_t mutex;
+    int refcnt;
+
+    const uint8_t *base;
+    size_t size;
+    const qmap_cache_entry_t *index;
+    uint32_t count;
+} qmap_cache_t;
+
+/* State used while writing out a quest map cache file. */
+typedef struct qmap_cache_builder {
+    FILE *fp;
+    char *fn;
+    char *tmpfn;
+    uint64_t offset;
+
+    qmap_cache_entry_t *index;
+    uint32_t count;
+    uint32_t max;
+} qmap_cache_builder_t;
+
 #undef PACKED
 
 /* Object types */
@@ -182,17 +279,54 @@ void v2_free_params(void);
 int gc_read_params(sylverant_ship_t *cfg);
 void gc_free_params(void);
 
+/* Write out or load all of the above in a snapshot (see snapshot.h). A
+   snapshot that's been loaded from must be kept open until the data gets freed
+   again, since the enemies and objects point right into it. With load set to
+   0, the sections are only checked over. If loading fails, nothing has been
+   changed. */
+int map_snapshot_write(snapshot_writer_t *w);
+int map_snapshot_read(const snapshot_t *s, int load);
+
 int bb_load_game_enemies(lobby_t *l);
 int v2_load_game_enemies(lobby_t *l);
 int gc_load_game_enemies(lobby_t *l);
 void free_game_enemies(lobby_t *l);
 
+/* The most memory that setting up the enemies and objects for the game might
+   take, for sizing its arena. This is 0 if it won't have any. */
+size_t map_game_footprint(const lobby_t *l);
+
+/* Look up an enemy in a game by its ID, with any fixups for the game applied.
+   The enemy is copied into the buffer provided, which is returned. Returns
+   NULL if the ID is out of range. */
+const game_enemy_t *map_get_enemy(const game_map_enemies_t *en, uint32_t mid,
+                                  game_enemy_t *buf);
+
+/* Look up an object in a game by its ID. Returns NULL if the ID is out of
+   range. */
+const game_object_t *map_get_object(const game_map_objs_t *ob, uint32_t oid);
+
 int map_have_v2_maps(void);
 int map_have_gc_maps(void);
 int map_have_bb_maps(void);
 
 int load_quest_enemies(lobby_t *l, uint32_t qid, int ver);
-int cache_quest_enemies(const char *ofn, const uint8_t *dat, uint32_t sz,
-                        int episode);
+
+/* Build a quest map cache file. The new file is written next to the old one
+   and only replaces it when qmap_cache_finish() succeeds. */
+int qmap_cache_begin(qmap_cache_builder_t *b, const char *fn);
+int qmap_cache_add(qmap_cache_builder_t *b, uint32_t qid, const uint8_t *dat,
+                   uint32_t sz, int episode);
+int qmap_cache_finish(qmap_cache_builder_t *b);
+void qmap_cache_abort(qmap_cache_builder_t *b);
+
+/* Map a quest map cache file, checking that it is intact. The returned cache
+   has one reference, which belongs to the caller. */
+qmap_cache_t *qmap_cache_open(const char *fn);
+void qmap_cache_ref(qmap_cache_t *c);
+void qmap_cache_unref(qmap_cache_t *c);
+
+/* Find a quest in the cache. Returns NULL if it isn't there. */
+const qmap_cache_entry_t *qmap_cache_find(const qmap_cache_t *c, uint32_t qid);
 
 #endif /* !MAPDATA_H */
@@ -0,0 +1,592 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <sylverant/debug.h>
+
+#include "metrics.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+TAILQ_HEAD(metrics_list, metrics_set);
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t set_key;
+
+/* Every live thread's set, plus the totals of all the threads that have
+   exited. The mutex is only taken when a thread's set comes or goes, and when
+   the metrics are read out, never when recording something. */
+static pthread_mutex_t sets_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_list sets = TAILQ_HEAD_INITIALIZER(sets);
+static metrics_set_t retired;
+
+static int64_t gauges[METRIC_GAUGE_COUNT];
+static uint32_t timing_gen;
+
+int metrics_pkt_timing = 0;
+uint32_t metrics_slow_pkt_ms = 0;
+
+static int listen_sock = -1;
+static int pipes[2] = { -1, -1 };
+static pthread_t http_thd;
+static char *sock_path;
+
+static const char *hist_names[METRIC_HIST_COUNT] = {
+    "ship_sendq_depth_bytes",
+    "ship_burst_duration_seconds",
+    "ship_quest_load_seconds",
+    "ship_lua_seconds",
+    "ship_game_memory_bytes"
+};
+
+static const char *hist_help[METRIC_HIST_COUNT] = {
+    "Bytes queued for a client after adding a packet to its send queue.",
+    "Time from a player joining a game to it being done bursting.",
+    "Time from a quest being sent to a player to it being loaded.",
+    "Time spent running a Lua script.",
+    "Memory a game had allocated when it was destroyed."
+};
+
+/* Whether each histogram is in microseconds (and should be shown as
+   seconds), or is a plain count of something. */
+static const int hist_is_time[METRIC_HIST_COUNT] = { 0, 1, 1, 1, 0 };
+
+static const char *gauge_names[METRIC_GAUGE_COUNT] = {
+    "ship_clients",
+    "ship_games"
+};
+
+static const char *gauge_help[METRIC_GAUGE_COUNT] = {
+    "Clients connected to the ship and its blocks.",
+    "Games in progress on the ship."
+};
+
+static void set_add(metrics_set_t *d, metrics_set_t *s) {
+    int i, j;
+
+    for(i = 0; i < 0x100; ++i) {
+        d->dc_pkts[i] += __atomic_load_n(&s->dc_pkts[i], __ATOMIC_RELAXED);
+        d->dc_subcmds[i] += __atomic_load_n(&s->dc_subcmds[i],
+                                            __ATOMIC_RELAXED);
+        d->bb_subcmds[i] += __atomic_load_n(&s->bb_subcmds[i],
+                                            __ATOMIC_RELAXED);
+    }
+
+    for(i = 0; i < 0x1000; ++i) {
+        d->bb_pkts[i] += __atomic_load_n(&s->bb_pkts[i], __ATOMIC_RELAXED);
+    }
+
+    for(i = 0; i < METRIC_HIST_COUNT; ++i) {
+        d->hist[i].count += __atomic_load_n(&s->hist[i].count,
+                                            __ATOMIC_RELAXED);
+        d->hist[i].sum += __atomic_load_n(&s->hist[i].sum, __ATOMIC_RELAXED);
+
+        for(j = 0; j < METRICS_HIST_BUCKETS; ++j) {
+            d->hist[i].b[j] += __atomic_load_n(&s->hist[i].b[j],
+                                               __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void timing_add(metrics_timing_t *d, metrics_timing_t *s, int count) {
+    uint64_t max;
+    int i;
+
+    for(i = 0; i < count; ++i) {
+        d[i].count += __atomic_load_n(&s[i].count, __ATOMIC_RELAXED);
+        d[i].total += __atomic_load_n(&s[i].total, __ATOMIC_RELAXED);
+        max = __atomic_load_n(&s[i].max, __ATOMIC_RELAXED);
+
+        if(max > d[i].max)
+            d[i].max = max;
+    }
+}
+
+static void timings_add(metrics_timings_t *d, metrics_set_t *s) {
+    /* Skip over any set that hasn't been cleared since the last reset. */
+    if(__atomic_load_n(&s->timing_gen, __ATOMIC_ACQUIRE) !=
+       __atomic_load_n(&timing_gen, __ATOMIC_RELAXED))
+        return;
+
+    timing_add(d->dc_pkts, s->timings.dc_pkts, 0x100);
+    timing_add(d->bb_pkts, s->timings.bb_pkts, 0x1000);
+    timing_add(d->dc_subcmds, s->timings.dc_subcmds, 0x100);
+    timing_add(d->bb_subcmds, s->timings.bb_subcmds, 0x100);
+}
+
+static void set_destructor(void *d) {
+    metrics_set_t *s = (metrics_set_t *)d;
+
+    pthread_mutex_lock(&sets_mutex);
+    TAILQ_REMOVE(&sets, s, qentry);
+    set_add(&retired, s);
+    timings_add(&retired.timings, s);
+    pthread_mutex_unlock(&sets_mutex);
+
+    free(s);
+}
+
+static void make_key(void) {
+    pthread_key_create(&set_key, &set_destructor);
+}
+
+metrics_set_t *metrics_get(void) {
+    metrics_set_t *s;
+
+    pthread_once(&key_once, &make_key);
+
+    if((s = (metrics_set_t *)pthread_getspecific(set_key)))
+        return s;
+
+    if(!(s = (metrics_set_t *)calloc(1, sizeof(metrics_set_t))))
+        return NULL;
+
+    s->timing_gen = __atomic_load_n(&timing_gen, __ATOMIC_RELAXED);
+
+    if(pthread_setspecific(set_key, s)) {
+        free(s);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&sets_mutex);
+    TAILQ_INSERT_TAIL(&sets, s, qentry);
+    pthread_mutex_unlock(&sets_mutex);
+
+    return s;
+}
+
+void metrics_count_pkt(int bb, uint16_t type) {
+    metrics_set_t *s = metrics_get();
+
+    if(!s)
+        return;
+
+    if(!bb)
+        metrics_add(&s->dc_pkts[type & 0xFF], 1);
+    else if(type < 0x1000)
+        metrics_add(&s->bb_pkts[type], 1);
+}
+
+void metrics_count_subcmd(int bb, uint8_t type) {
+    metrics_set_t *s = metrics_get();
+
+    if(s)
+        metrics_add(bb ? &s->bb_subcmds[type] : &s->dc_subcmds[type], 1);
+}
+
+static int hist_bucket(uint64_t v) {
+    int e;
+
+    if(v < 16)
+        return (int)v;
+    else if(v >> 32)
+        return METRICS_HIST_BUCKETS - 1;
+
+    e = 63 - __builtin_clzll(v);
+    return 16 + (e - 4) * 8 + (int)((v >> (e - 3)) & 7);
+}
+
+/* The smallest value that goes past the given bucket. */
+static uint64_t hist_limit(int b) {
+    if(b < 16)
+        return (uint64_t)b + 1;
+
+    b -= 16;
+    return (uint64_t)(9 + (b & 7)) << (b / 8 + 1);
+}
+
+void metrics_observe(metrics_hist_id_t h, uint64_t v) {
+    metrics_set_t *s = metrics_get();
+
+    if(!s)
+        return;
+
+    metrics_add(&s->hist[h].count, 1);
+    metrics_add(&s->hist[h].sum, v);
+    metrics_add(&s->hist[h].b[hist_bucket(v)], 1);
+}
+
+static void timing_record(metrics_timing_t *t, uint64_t us) {
+    metrics_add(&t->count, 1);
+    metrics_add(&t->total, us);
+
+    if(us > t->max)
+        __atomic_store_n(&t->max, us, __ATOMIC_RELAXED);
+}
+
+void metrics_time_pkt(int bb, uint16_t type, int subtype, uint64_t us) {
+    metrics_set_t *s = metrics_get();
+    uint32_t gen = __atomic_load_n(&timing_gen, __ATOMIC_RELAXED);
+    uint64_t *p, *end;
+
+    if(!s)
+        return;
+
+    /* Has someone asked for the times to be reset? */
+    if(s->timing_gen != gen) {
+        p = (uint64_t *)&s->timings;
+        end = (uint64_t *)(&s->timings + 1);
+
+        while(p < end) {
+            __atomic_store_n(p++, 0, __ATOMIC_RELAXED);
+        }
+
+        __atomic_store_n(&s->timing_gen, gen, __ATOMIC_RELEASE);
+    }
+
+    if(!bb)
+        timing_record(&s->timings.dc_pkts[type & 0xFF], us);
+    else if(type < 0x1000)
+        timing_record(&s->timings.bb_pkts[type], us);
+
+    if(subtype >= 0) {
+        timing_record(bb ? &s->timings.bb_subcmds[subtype & 0xFF] :
+                      &s->timings.dc_subcmds[subtype & 0xFF], us);
+    }
+}
+
+void metrics_timing_read(metrics_timings_t *t) {
+    metrics_set_t *s;
+
+    pthread_mutex_lock(&sets_mutex);
+    memcpy(t, &retired.timings, sizeof(metrics_timings_t));
+
+    TAILQ_FOREACH(s, &sets, qentry) {
+        timings_add(t, s);
+    }
+
+    pthread_mutex_unlock(&sets_mutex);
+}
+
+void metrics_timing_reset(void) {
+    pthread_mutex_lock(&sets_mutex);
+    __atomic_add_fetch(&timing_gen, 1, __ATOMIC_RELAXED);
+    memset(&retired.timings, 0, sizeof(metrics_timings_t));
+    pthread_mutex_unlock(&sets_mutex);
+}
+
+void metrics_set_gauge(metrics_gauge_id_t g, int64_t v) {
+    __atomic_store_n(&gauges[g], v, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void write_counters(FILE *fp, const char *name, const char *label,
+                           const uint64_t *ctrs, int count) {
+    int i;
+
+    for(i = 0; i < count; ++i) {
+        if(ctrs[i])
+            fprintf(fp, "%s{%s,type=\"0x%02X\"} %" PRIu64 "\n", name, label,
+                    i, ctrs[i]);
+    }
+}
+
+static void write_value(FILE *fp, uint64_t v, int is_time) {
+    if(is_time)
+        fprintf(fp, "%.6f", v / 1000000.0);
+    else
+        fprintf(fp, "%" PRIu64, v);
+}
+
+/* Prometheus wants cumulative buckets, so only write out the ones that end
+   just short of a power of two, which is still plenty of resolution for a
+   dashboard. */
+static void write_hist(FILE *fp, int h, const metrics_hist_t *hist) {
+    uint64_t total = 0;
+    int i;
+
+    fprintf(fp, "# HELP %s %s\n# TYPE %s histogram\n", hist_names[h],
+            hist_help[h], hist_names[h]);
+
+    for(i = 0; i < METRICS_HIST_BUCKETS - 1; ++i) {
+        total += hist->b[i];
+
+        if(i >= 15 && (i - 15) % 8 == 0) {
+            fprintf(fp, "%s_bucket{le=\"", hist_names[h]);
+            write_value(fp, hist_limit(i) - 1, hist_is_time[h]);
+            fprintf(fp, "\"} %" PRIu64 "\n", total);
+        }
+    }
+
+    /* The count is read separately from the buckets, so it might not quite
+       agree with them if something was recorded in the middle of reading. Go
+       with what the buckets say. */
+    total += hist->b[METRICS_HIST_BUCKETS - 1];
+    fprintf(fp, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", hist_names[h], total);
+    fprintf(fp, "%s_sum ", hist_names[h]);
+    write_value(fp, hist->sum, hist_is_time[h]);
+    fprintf(fp, "\n%s_count %" PRIu64 "\n", hist_names[h], total);
+}
+
+int metrics_write(FILE *fp) {
+    metrics_set_t *tot, *s;
+    int i;
+
+    if(!(tot = (metrics_set_t *)malloc(sizeof(metrics_set_t))))
+        return -1;
+
+    pthread_mutex_lock(&sets_mutex);
+    memcpy(tot, &retired, sizeof(metrics_set_t));
+
+    TAILQ_FOREACH(s, &sets, qentry) {
+        set_add(tot, s);
+    }
+
+    pthread_mutex_unlock(&sets_mutex);
+
+    for(i = 0; i < METRIC_GAUGE_COUNT; ++i) {
+        fprintf(fp, "# HELP %s %s\n# TYPE %s gauge\n%s %" PRId64 "\n",
+                gauge_names[i], gauge_help[i], gauge_names[i], gauge_names[i],
+                __atomic_load_n(&gauges[i], __ATOMIC_RELAXED));
+    }
+
+    fprintf(fp, "# HELP ship_packets_total Packets received from clients, by "
+            "type.\n# TYPE ship_packets_total counter\n");
+    write_counters(fp, "ship_packets_total", "proto=\"dc\"", tot->dc_pkts,
+                   0x100);
+    write_counters(fp, "ship_packets_total", "proto=\"bb\"", tot->bb_pkts,
+                   0x1000);
+
+    fprintf(fp, "# HELP ship_subcommands_total 0x60 subcommands received "
+            "from clients, by type.\n# TYPE ship_subcommands_total counter\n");
+    write_counters(fp, "ship_subcommands_total", "proto=\"dc\"",
+                   tot->dc_subcmds, 0x100);
+    write_counters(fp, "ship_subcommands_total", "proto=\"bb\"",
+                   tot->bb_subcmds, 0x100);
+
+    for(i = 0; i < METRIC_HIST_COUNT; ++i) {
+        write_hist(fp, i, &tot->hist[i]);
+    }
+
+    free(tot);
+    return 0;
+}
+
+static void send_all(int sock, const char *buf, size_t len) {
+    ssize_t rv;
+
+    while(len) {
+        if((rv = send(sock, buf, len, MSG_NOSIGNAL)) <= 0)
+            return;
+
+        buf += rv;
+        len -= rv;
+    }
+}
+
+/* Answer one request. Anything that looks like an HTTP GET gets a proper HTTP
+   response, anything else (including a connection that just sits there for a
+   second without asking for anything) just gets the metrics themselves, so
+   that something like socat can read them off of a Unix socket. */
+static void handle_conn(int sock) {
+    static const char hdr[] = "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Connection: close\r\n\r\n";
+    static const char notfound[] = "HTTP/1.0 404 Not Found\r\n"
+        "Connection: close\r\n\r\n";
+    struct timeval tv = { 1, 0 };
+    char req[1024];
+    ssize_t len;
+    char *buf = NULL;
+    size_t sz = 0;
+    FILE *fp;
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if((len = recv(sock, req, sizeof(req) - 1, 0)) < 0)
+        len = 0;
+
+    req[len] = 0;
+
+    if(!strncmp(req, "GET ", 4)) {
+        if(strncmp(req + 4, "/ ", 2) && strncmp(req + 4, "/metrics", 8)) {
+            send_all(sock, notfound, sizeof(notfound) - 1);
+            return;
+        }
+
+        send_all(sock, hdr, sizeof(hdr) - 1);
+    }
+
+    if(!(fp = open_memstream(&buf, &sz)))
+        return;
+
+    metrics_write(fp);
+    fclose(fp);
+
+    send_all(sock, buf, sz);
+    free(buf);
+}
+
+static void *http_thd_func(void *d) {
+    struct pollfd fds[2];
+    int sock;
+
+    (void)d;
+    fds[0].fd = listen_sock;
+    fds[0].events = POLLIN;
+    fds[1].fd = pipes[0];
+    fds[1].events = POLLIN;
+
+    for(;;) {
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR)
+                continue;
+
+            debug(DBG_ERROR, "Error polling metrics socket: %s\n",
+                  strerror(errno));
+            break;
+        }
+
+        if(fds[1].revents)
+            break;
+
+        if((fds[0].revents & POLLIN) &&
+           (sock = accept(listen_sock, NULL, NULL)) >= 0) {
+            handle_conn(sock);
+            close(sock);
+        }
+    }
+
+    return NULL;
+}
+
+static int open_listener(const char *addr) {
+    struct sockaddr_in a4;
+    struct sockaddr_un un;
+    int sock, port, on = 1;
+
+    if(strchr(addr, '/')) {
+        if(strlen(addr) >= sizeof(un.sun_path)) {
+            debug(DBG_ERROR, "Metrics socket path too long: %s\n", addr);
+            return -1;
+        }
+
+        if((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            goto err;
+
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        strcpy(un.sun_path, addr);
+        unlink(addr);
+
+        if(bind(sock, (struct sockaddr *)&un, sizeof(un)))
+            goto err_close;
+
+        if(!(sock_path = strdup(addr)))
+            goto err_close;
+    }
+    else {
+        if((port = atoi(addr)) <= 0 || port > 65535) {
+            debug(DBG_ERROR, "Invalid metrics port: %s\n", addr);
+            return -1;
+        }
+
+        if((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            goto err;
+
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(int));
+
+        memset(&a4, 0, sizeof(a4));
+        a4.sin_family = AF_INET;
+        a4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        a4.sin_port = htons((uint16_t)port);
+
+        if(bind(sock, (struct sockaddr *)&a4, sizeof(a4)))
+            goto err_close;
+    }
+
+    if(listen(sock, 8))
+        goto err_close;
+
+    return sock;
+
+err_close:
+    close(sock);
+err:
+    debug(DBG_ERROR, "Cannot open metrics socket %s: %s\n", addr,
+          strerror(errno));
+    return -1;
+}
+
+int metrics_init(const char *addr) {
+    if((listen_sock = open_listener(addr)) < 0)
+        return -1;
+
+    if(pipe(pipes)) {
+        debug(DBG_ERROR, "Cannot create metrics pipe: %s\n", strerror(errno));
+        goto err;
+    }
+
+    if(pthread_create(&http_thd, NULL, &http_thd_func, NULL)) {
+        debug(DBG_ERROR, "Cannot start metrics thread!\n");
+        close(pipes[0]);
+        close(pipes[1]);
+        pipes[0] = pipes[1] = -1;
+        goto err;
+    }
+
+    debug(DBG_LOG, "Serving metrics on %s\n", addr);
+    return 0;
+
+err:
+    close(listen_sock);
+    listen_sock = -1;
+    return -1;
+}
+
+void metrics_shutdown(void) {
+    if(listen_sock < 0)
+        return;
+
+    if(write(pipes[1], "\0", 1) != 1)
+        debug(DBG_WARN, "Cannot wake metrics thread: %s\n", strerror(errno));
+
+    pthread_join(http_thd, NULL);
+
+    close(pipes[0]);
+    close(pipes[1]);
+    close(listen_sock);
+    pipes[0] = pipes[1] = listen_sock = -1;
+
+    if(sock_path) {
+        unlink(sock_path);
+        free(sock_path);
+        sock_path = NULL;
+    }
+}
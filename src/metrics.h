@@ -0,0 +1,146 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+/* Counters and histograms of what the ship is up to. Every thread that
+   records anything gets its own set of them (found through a pthread key), so
+   recording never takes a lock or does an atomic read-modify-write. Whoever
+   reads the metrics adds up all of the threads' sets, and when a thread exits
+   its counts are folded into a set kept for threads that are gone.
+
+   The metrics can be read in the Prometheus text format over a local HTTP
+   endpoint (see metrics_init()). */
+
+/* Histograms. Values under 16 get a bucket each, everything else goes in one
+   of 8 linear steps between each power of two (so a bucket is never more than
+   12.5% wide). Anything 2^32 or over ends up in the last bucket. */
+#define METRICS_HIST_BUCKETS    240
+
+typedef enum metrics_hist_id {
+    METRIC_SENDQ_DEPTH = 0,             /* Bytes queued for a client */
+    METRIC_BURST_TIME,                  /* Joining a game, in microseconds */
+    METRIC_QUEST_LOAD_TIME,             /* Loading a quest, in microseconds */
+    METRIC_LUA_TIME,                    /* Running a script, in microseconds */
+    METRIC_GAME_MEMORY,                 /* Bytes in a game's arena */
+    METRIC_HIST_COUNT
+} metrics_hist_id_t;
+
+typedef struct metrics_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t b[METRICS_HIST_BUCKETS];
+} metrics_hist_t;
+
+/* Gauges. These are just set to their current value by whoever changes them,
+   rather than being kept per thread. */
+typedef enum metrics_gauge_id {
+    METRIC_CLIENTS = 0,
+    METRIC_GAMES,
+    METRIC_GAUGE_COUNT
+} metrics_gauge_id_t;
+
+/* How long the blocks have spent handling packets of one type. */
+typedef struct metrics_timing {
+    uint64_t count;
+    uint64_t total;                     /* Microseconds */
+    uint64_t max;
+} metrics_timing_t;
+
+/* Handler times, by packet type. Packets that carry subcommands (0x60, 0x62,
+   0x6C and 0x6D) are also counted by the type of the subcommand. */
+typedef struct metrics_timings {
+    metrics_timing_t dc_pkts[0x100];
+    metrics_timing_t bb_pkts[0x1000];
+    metrics_timing_t dc_subcmds[0x100];
+    metrics_timing_t bb_subcmds[0x100];
+} metrics_timings_t;
+
+/* One thread's metrics. Only the thread that owns it ever writes to it. */
+typedef struct metrics_set {
+    TAILQ_ENTRY(metrics_set) qentry;
+
+    uint64_t dc_pkts[0x100];            /* By packet type */
+    uint64_t bb_pkts[0x1000];
+    uint64_t dc_subcmds[0x100];         /* 0x60 subcommands, by type */
+    uint64_t bb_subcmds[0x100];
+    metrics_hist_t hist[METRIC_HIST_COUNT];
+
+    uint32_t timing_gen;                /* See metrics_timing_reset() */
+    metrics_timings_t timings;
+} metrics_set_t;
+
+/* Whether to time each packet the blocks handle, and how many milliseconds
+   one can take before it's logged as being slow (0 to not log any). */
+extern int metrics_pkt_timing;
+extern uint32_t metrics_slow_pkt_ms;
+
+/* Grab the calling thread's metrics, setting them up on the first call. This
+   returns NULL if there wasn't enough memory to do so (in which case whatever
+   it was just doesn't get counted). */
+metrics_set_t *metrics_get(void);
+
+/* Bump a counter in the calling thread's set. */
+static inline void metrics_add(uint64_t *ctr, uint64_t v) {
+    __atomic_store_n(ctr, __atomic_load_n(ctr, __ATOMIC_RELAXED) + v,
+                     __ATOMIC_RELAXED);
+}
+
+/* Count a packet received from a client. BB packet types are only counted up
+   to 0x0FFF, which covers all of the ones actually in use. */
+void metrics_count_pkt(int bb, uint16_t type);
+
+/* Count a 0x60 subcommand. */
+void metrics_count_subcmd(int bb, uint8_t type);
+
+/* Add a value to one of the histograms. */
+void metrics_observe(metrics_hist_id_t h, uint64_t v);
+
+/* Record the time taken to handle a packet. Pass -1 as the subtype for a
+   packet without a subcommand. */
+void metrics_time_pkt(int bb, uint16_t type, int subtype, uint64_t us);
+
+/* Add up the handler times of all of the threads. */
+void metrics_timing_read(metrics_timings_t *t);
+
+/* Throw away all of the handler times recorded so far. Each thread notices
+   that this has happened (by the generation changing) the next time it
+   records something and clears its own times then, so nobody has to write
+   into a set that isn't theirs. */
+void metrics_timing_reset(void);
+
+/* Set the current value of a gauge. */
+void metrics_set_gauge(metrics_gauge_id_t g, int64_t v);
+
+/* A monotonic clock, in microseconds, for timing things for the metrics. */
+uint64_t metrics_now(void);
+
+/* Start up the endpoint that serves up the metrics. If addr has a slash in it,
+   it's taken as the path of a Unix domain socket, otherwise it's a TCP port to
+   listen on (on the loopback interface only). */
+int metrics_init(const char *addr);
+void metrics_shutdown(void);
+
+/* Write out all of the metrics in the Prometheus text format. */
+int metrics_write(FILE *fp);
+
+#endif /* !METRICS_H */
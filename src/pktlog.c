@@ -0,0 +1,622 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <sylverant/debug.h>
+
+#include "pktlog.h"
+#include "utils.h"
+
+/* How many entries the queue can hold (must be a power of two), and how much
+   data can be sitting in it at once before we start dropping things. */
+#define PKTLOG_QUEUE_SIZE   65536
+#define PKTLOG_QUEUE_MASK   (PKTLOG_QUEUE_SIZE - 1)
+#define PKTLOG_MAX_BYTES    (32 * 1024 * 1024)
+
+/* Internal record types, never written to a file as such. */
+#define PKTLOG_RAW          0x80
+#define PKTLOG_CLOSE        0xFF
+
+typedef struct pktlog_rec {
+    pktlog_t *log;
+    uint64_t timestamp;
+    uint32_t len;
+    uint8_t type;
+    uint8_t data[];
+} pktlog_rec_t;
+
+struct pktlog {
+    FILE *fp;
+    int mode;
+    uint32_t dropped;
+    int dirty;
+    pktlog_t *next_dirty;
+
+    /* Allocated up front, so that closing the log can't fail. */
+    pktlog_rec_t *close_rec;
+};
+
+/* The queue itself is a ring of slots with a sequence number on each one, so
+   that any number of threads can add to it with nothing more than a
+   compare-and-swap on the head. Only the writer thread ever takes anything out
+   of it, so the tail needs no such care. */
+static struct {
+    uint64_t seq;
+    pktlog_rec_t *rec;
+} ring[PKTLOG_QUEUE_SIZE];
+
+static uint64_t ring_head;
+static uint64_t ring_tail;
+static size_t ring_bytes;
+static int ring_init;
+
+static sem_t writer_sem;
+static pthread_t writer_thd;
+static int writer_running;
+static int writer_exit;
+
+static uint64_t pktlog_time(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static void put_le64(uint8_t *p, uint64_t v) {
+    put_le32(p, (uint32_t)v);
+    put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+/* Format a timestamp the same way fdebug() does. */
+static void format_time(uint64_t ts, char str[32]) {
+    struct tm cooked;
+    time_t secs = (time_t)(ts / 1000000);
+
+    gmtime_r(&secs, &cooked);
+    snprintf(str, 32, "%u:%02u:%02u: %02u:%02u:%02u.%03u",
+             cooked.tm_year + 1900, cooked.tm_mon + 1, cooked.tm_mday,
+             cooked.tm_hour, cooked.tm_min, cooked.tm_sec,
+             (unsigned int)((ts % 1000000) / 1000));
+}
+
+static uint16_t get_le16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static void write_rec(pktlog_t *l, int type, uint64_t ts, const void *data,
+                      uint32_t len) {
+    static const uint8_t pad[8] = { 0 };
+    uint8_t hdr[PKTLOG_REC_SIZE];
+    char tstr[32];
+
+    if(l->mode == PKTLOG_MODE_BINARY) {
+        if(type == PKTLOG_RAW)
+            type = PKTLOG_NOTE;
+
+        put_le64(hdr, ts);
+        put_le32(hdr + 8, len);
+        hdr[12] = (uint8_t)type;
+        hdr[13] = hdr[14] = hdr[15] = 0;
+
+        fwrite(hdr, 1, PKTLOG_REC_SIZE, l->fp);
+        fwrite(data, 1, len, l->fp);
+
+        if(len & 7)
+            fwrite(pad, 1, 8 - (len & 7), l->fp);
+    }
+    else if(type == PKTLOG_NOTE) {
+        format_time(ts, tstr);
+        fprintf(l->fp, "[%s]: ", tstr);
+        fwrite(data, 1, len, l->fp);
+    }
+    else if(type == PKTLOG_RAW) {
+        fwrite(data, 1, len, l->fp);
+    }
+}
+
+/* Write out one record. Anything that touches a file gets put onto the dirty
+   list, so that it'll be flushed once the queue has been emptied. */
+static void handle_rec(pktlog_rec_t *r, pktlog_t **dirty) {
+    pktlog_t *l = r->log, **i;
+    uint32_t dropped;
+    char str[64];
+    int len;
+
+    if((dropped = __atomic_exchange_n(&l->dropped, 0, __ATOMIC_RELAXED))) {
+        len = snprintf(str, sizeof(str), "%" PRIu32 " log entries dropped\n",
+                       dropped);
+        write_rec(l, PKTLOG_NOTE, r->timestamp, str, (uint32_t)len);
+    }
+
+    if(r->type != PKTLOG_CLOSE) {
+        write_rec(l, r->type, r->timestamp, r->data, r->len);
+
+        if(!l->dirty) {
+            l->dirty = 1;
+            l->next_dirty = *dirty;
+            *dirty = l;
+        }
+
+        free(r);
+        return;
+    }
+
+    /* It's a close, so take the log off of the dirty list and get rid of it.
+       The record is the log's own close_rec, so it goes with it. */
+    if(l->dirty) {
+        for(i = dirty; *i; i = &(*i)->next_dirty) {
+            if(*i == l) {
+                *i = l->next_dirty;
+                break;
+            }
+        }
+    }
+
+    fclose(l->fp);
+    free(l->close_rec);
+    free(l);
+}
+
+static pktlog_rec_t *ring_pop(void) {
+    uint64_t pos = ring_tail;
+    pktlog_rec_t *r;
+
+    if(__atomic_load_n(&ring[pos & PKTLOG_QUEUE_MASK].seq, __ATOMIC_ACQUIRE) !=
+       pos + 1)
+        return NULL;
+
+    r = ring[pos & PKTLOG_QUEUE_MASK].rec;
+    __atomic_store_n(&ring[pos & PKTLOG_QUEUE_MASK].seq,
+                     pos + PKTLOG_QUEUE_SIZE, __ATOMIC_RELEASE);
+    ring_tail = pos + 1;
+
+    if(r->type != PKTLOG_CLOSE)
+        __atomic_sub_fetch(&ring_bytes, r->len, __ATOMIC_RELAXED);
+
+    return r;
+}
+
+static int ring_push(pktlog_rec_t *r) {
+    uint64_t pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED), seq;
+    int64_t diff;
+
+    for(;;) {
+        seq = __atomic_load_n(&ring[pos & PKTLOG_QUEUE_MASK].seq,
+                              __ATOMIC_ACQUIRE);
+        diff = (int64_t)(seq - pos);
+
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if(diff < 0) {
+            /* Full. */
+            return -1;
+        }
+        else {
+            pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    ring[pos & PKTLOG_QUEUE_MASK].rec = r;
+    __atomic_store_n(&ring[pos & PKTLOG_QUEUE_MASK].seq, pos + 1,
+                     __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Write out everything in the queue, then flush whatever got written to. */
+static void drain(void) {
+    pktlog_rec_t *r;
+    pktlog_t *dirty = NULL, *l;
+
+    while((r = ring_pop())) {
+        handle_rec(r, &dirty);
+    }
+
+    while((l = dirty)) {
+        dirty = l->next_dirty;
+        l->dirty = 0;
+        fflush(l->fp);
+    }
+}
+
+static void *writer_thd_func(void *d) {
+    (void)d;
+
+    for(;;) {
+        while(sem_wait(&writer_sem) && errno == EINTR) {
+        }
+
+        drain();
+
+        if(__atomic_load_n(&writer_exit, __ATOMIC_ACQUIRE))
+            break;
+    }
+
+    drain();
+    return NULL;
+}
+
+/* Hand a record off to the writer. If the writer isn't running (say, during
+   shutdown), there's no one else to race with, so just write it directly. */
+static int submit(pktlog_rec_t *r) {
+    pktlog_t *dirty = NULL;
+
+    if(!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+        if(r->type != PKTLOG_CLOSE)
+            __atomic_sub_fetch(&ring_bytes, r->len, __ATOMIC_RELAXED);
+
+        handle_rec(r, &dirty);
+
+        if(dirty) {
+            dirty->dirty = 0;
+            fflush(dirty->fp);
+        }
+
+        return 0;
+    }
+
+    if(ring_push(r))
+        return -1;
+
+    sem_post(&writer_sem);
+    return 0;
+}
+
+static void queue_rec(pktlog_t *l, int type, const void *data, size_t len) {
+    pktlog_rec_t *r;
+
+    if(!l)
+        return;
+
+    if(__atomic_add_fetch(&ring_bytes, len, __ATOMIC_RELAXED) >
+       PKTLOG_MAX_BYTES)
+        goto drop;
+
+    if(!(r = (pktlog_rec_t *)malloc(sizeof(pktlog_rec_t) + len)))
+        goto drop;
+
+    r->log = l;
+    r->timestamp = pktlog_time();
+    r->len = (uint32_t)len;
+    r->type = (uint8_t)type;
+    memcpy(r->data, data, len);
+
+    if(!submit(r))
+        return;
+
+    free(r);
+
+drop:
+    __atomic_sub_fetch(&ring_bytes, len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&l->dropped, 1, __ATOMIC_RELAXED);
+}
+
+int pktlog_init(void) {
+    int i;
+
+    if(!ring_init) {
+        for(i = 0; i < PKTLOG_QUEUE_SIZE; ++i) {
+            ring[i].seq = i;
+        }
+
+        ring_init = 1;
+    }
+
+    if(sem_init(&writer_sem, 0, 0)) {
+        perror("sem_init");
+        return -1;
+    }
+
+    writer_exit = 0;
+
+    if(pthread_create(&writer_thd, NULL, &writer_thd_func, NULL)) {
+        debug(DBG_ERROR, "Cannot start log writer thread!\n");
+        sem_destroy(&writer_sem);
+        return -1;
+    }
+
+    __atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void pktlog_shutdown(void) {
+    if(!writer_running)
+        return;
+
+    __atomic_store_n(&writer_exit, 1, __ATOMIC_RELEASE);
+    sem_post(&writer_sem);
+    pthread_join(writer_thd, NULL);
+
+    __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+    sem_destroy(&writer_sem);
+
+    /* Catch anything that snuck in while the thread was on its way out. */
+    drain();
+}
+
+pktlog_t *pktlog_open(const char *fn, int mode) {
+    pktlog_t *l;
+    uint8_t hdr[PKTLOG_HDR_SIZE];
+
+    if(!(l = (pktlog_t *)malloc(sizeof(pktlog_t))))
+        return NULL;
+
+    if(!(l->close_rec = (pktlog_rec_t *)malloc(sizeof(pktlog_rec_t)))) {
+        free(l);
+        return NULL;
+    }
+
+    if(!(l->fp = fopen(fn, mode == PKTLOG_MODE_BINARY ? "wb" : "wt"))) {
+        free(l->close_rec);
+        free(l);
+        return NULL;
+    }
+
+    l->mode = mode;
+    l->dropped = 0;
+    l->dirty = 0;
+    l->next_dirty = NULL;
+
+    l->close_rec->log = l;
+    l->close_rec->len = 0;
+    l->close_rec->type = PKTLOG_CLOSE;
+
+    /* Nobody else knows about the log yet, so it's fine to write this here. */
+    if(mode == PKTLOG_MODE_BINARY) {
+        memcpy(hdr, PKTLOG_MAGIC, 8);
+        put_le32(hdr + 8, PKTLOG_VERSION);
+        put_le32(hdr + 12, 0);
+        fwrite(hdr, 1, PKTLOG_HDR_SIZE, l->fp);
+    }
+
+    return l;
+}
+
+void pktlog_close(pktlog_t *l) {
+    struct timespec ts = { 0, 1000000 };
+    pktlog_rec_t *r;
+
+    if(!l)
+        return;
+
+    r = l->close_rec;
+    r->timestamp = pktlog_time();
+
+    /* This one can't be dropped, so wait for the writer to make room if the
+       queue happens to be full. */
+    while(submit(r)) {
+        nanosleep(&ts, NULL);
+    }
+}
+
+void pktlog_packet(pktlog_t *l, int type, const void *pkt, size_t len) {
+    if(l && l->mode == PKTLOG_MODE_BINARY)
+        queue_rec(l, type, pkt, len);
+}
+
+void pktlog_vnote(pktlog_t *l, const char *fmt, va_list args) {
+    char str[512];
+    int len;
+
+    if(!l)
+        return;
+
+    len = vsnprintf(str, sizeof(str), fmt, args);
+
+    if(len < 0)
+        return;
+    else if(len >= (int)sizeof(str))
+        len = sizeof(str) - 1;
+
+    queue_rec(l, PKTLOG_NOTE, str, (size_t)len);
+}
+
+void pktlog_note(pktlog_t *l, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    pktlog_vnote(l, fmt, args);
+    va_end(args);
+}
+
+void pktlog_raw(pktlog_t *l, const char *str, size_t len) {
+    queue_rec(l, PKTLOG_RAW, str, len);
+}
+
+void pktlog_session(pktlog_t *l, const pktlog_session_t *s) {
+    uint8_t buf[PKTLOG_SESSION_SIZE];
+
+    if(!l || l->mode != PKTLOG_MODE_BINARY)
+        return;
+
+    put_le32(buf, s->guildcard);
+    buf[4] = (uint8_t)s->block;
+    buf[5] = (uint8_t)(s->block >> 8);
+    buf[6] = s->version;
+    buf[7] = s->hdr_size;
+    put_le32(buf + 8, s->flags);
+    put_le32(buf + 12, 0);
+
+    queue_rec(l, PKTLOG_SESSION, buf, PKTLOG_SESSION_SIZE);
+}
+
+int pktlog_reader_open(pktlog_reader_t *r, const char *fn) {
+    int fd;
+    struct stat st;
+    void *base;
+
+    if((fd = open(fn, O_RDONLY)) < 0)
+        return -1;
+
+    if(fstat(fd, &st) || st.st_size < PKTLOG_HDR_SIZE) {
+        close(fd);
+        return -2;
+    }
+
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(base == MAP_FAILED)
+        return -1;
+
+    r->base = (const uint8_t *)base;
+    r->size = (size_t)st.st_size;
+    r->pos = PKTLOG_HDR_SIZE;
+    r->version = get_le32(r->base + 8);
+
+    if(memcmp(r->base, PKTLOG_MAGIC, 8) || !r->version ||
+       r->version > PKTLOG_VERSION) {
+        pktlog_reader_close(r);
+        return -2;
+    }
+
+    return 0;
+}
+
+void pktlog_reader_close(pktlog_reader_t *r) {
+    if(r->base)
+        munmap((void *)r->base, r->size);
+
+    r->base = NULL;
+    r->size = r->pos = 0;
+}
+
+int pktlog_reader_next(pktlog_reader_t *r, pktlog_entry_t *e) {
+    const uint8_t *p;
+    size_t len;
+
+    if(r->pos == r->size)
+        return 0;
+
+    if(r->size - r->pos < PKTLOG_REC_SIZE)
+        return -1;
+
+    p = r->base + r->pos;
+    e->timestamp = get_le64(p);
+    e->len = get_le32(p + 8);
+    e->type = p[12];
+    e->data = p + PKTLOG_REC_SIZE;
+
+    len = e->len;
+
+    if(r->version >= 2)
+        len = (len + 7) & ~(size_t)7;
+
+    if(r->size - r->pos - PKTLOG_REC_SIZE < e->len)
+        return -1;
+
+    /* The final record's padding might not have made it out. */
+    if(r->size - r->pos - PKTLOG_REC_SIZE < len)
+        len = r->size - r->pos - PKTLOG_REC_SIZE;
+
+    r->pos += PKTLOG_REC_SIZE + len;
+    return 1;
+}
+
+int pktlog_read_session(const pktlog_entry_t *e, pktlog_session_t *s) {
+    if(e->type != PKTLOG_SESSION || e->len < PKTLOG_SESSION_SIZE)
+        return -1;
+
+    s->guildcard = get_le32(e->data);
+    s->block = get_le16(e->data + 4);
+    s->version = e->data[6];
+    s->hdr_size = e->data[7];
+    s->flags = get_le32(e->data + 8);
+    return 0;
+}
+
+int pktlog_dump(const char *fn, FILE *fp) {
+    pktlog_reader_t r;
+    pktlog_entry_t e;
+    pktlog_session_t s;
+    char tstr[32];
+    int rv;
+
+    if((rv = pktlog_reader_open(&r, fn))) {
+        fprintf(stderr, "%s: %s\n", fn, rv == -1 ? strerror(errno) :
+                "not a packet log (or unknown version)");
+        return rv;
+    }
+
+    while((rv = pktlog_reader_next(&r, &e)) == 1) {
+        format_time(e.timestamp, tstr);
+
+        switch(e.type) {
+            case PKTLOG_RECV:
+            case PKTLOG_SENT:
+                fprintf(fp, "[%s] Packet %s by server\n", tstr,
+                        e.type == PKTLOG_RECV ? "received" : "sent");
+                fprint_packet(fp, e.data, (int)e.len, -1);
+                break;
+
+            case PKTLOG_NOTE:
+                fprintf(fp, "[%s] %.*s", tstr, (int)e.len, (char *)e.data);
+                break;
+
+            case PKTLOG_SESSION:
+                if(!pktlog_read_session(&e, &s)) {
+                    fprintf(fp, "[%s] Session: guild card %" PRIu32 ", block "
+                            "%d, version %d, flags %08" PRIx32 "\n", tstr,
+                            s.guildcard, (int)s.block, (int)s.version,
+                            s.flags);
+                    break;
+                }
+                /* Fall through... */
+
+            default:
+                fprintf(fp, "[%s] Unknown record type %d (%" PRIu32
+                        " bytes)\n", tstr, e.type, e.len);
+                break;
+        }
+    }
+
+    if(rv < 0)
+        fprintf(stderr, "%s: truncated record\n", fn);
+
+    pktlog_reader_close(&r);
+    return rv;
+}
@@ -0,0 +1,147 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PKTLOG_H
+#define PKTLOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+/* Packet and team logs don't get written by the threads that generate them.
+   Each entry is copied into a record and pushed onto a bounded, lock-free
+   queue, and a single writer thread does all of the actual file I/O. If the
+   queue fills up, entries are dropped (and a note is made of how many in the
+   log itself) rather than stalling the thread that's trying to log. */
+
+/* Packet logs are written in a compact binary format, rather than formatting a
+   hex dump for every packet as it goes by. Use the --dump-pktlog option to the
+   ship_server binary to print one out in a readable form, or the reader
+   functions at the bottom of this file to go through one in code (for instance,
+   to replay a captured session). The file starts with a header of:
+       8 bytes: PKTLOG_MAGIC
+       4 bytes: PKTLOG_VERSION
+       4 bytes: reserved (zero)
+   followed by any number of records, each of which is:
+       8 bytes: timestamp, in microseconds since the epoch
+       4 bytes: length of the data that follows
+       1 byte:  type (below)
+       3 bytes: reserved (zero)
+       n bytes: data (the raw, decrypted packet or the text of a note)
+       padding: zeros, to bring the record up to a multiple of 8 bytes
+   All multibyte values are little endian. Version 1 logs are the same, but
+   with no padding between the records.
+
+   Every record (and thus every packet in the file) starts 8-byte aligned, so a
+   log can be mapped into memory and read in place. */
+#define PKTLOG_MAGIC        "SYLPKLOG"
+#define PKTLOG_VERSION      2
+
+#define PKTLOG_HDR_SIZE     16
+#define PKTLOG_REC_SIZE     16
+
+/* Record types. */
+#define PKTLOG_RECV         0
+#define PKTLOG_SENT         1
+#define PKTLOG_NOTE         2
+#define PKTLOG_SESSION      3
+
+/* A session record describes the connection the log was taken from, so that
+   its packets can be fed back through the server later. It's written at the
+   start of every packet log, and its data is:
+       4 bytes: guild card number (0 if not logged in yet)
+       2 bytes: block number (0 for the ship itself)
+       1 byte:  client version (CLIENT_VERSION_*)
+       1 byte:  packet header size
+       4 bytes: client flags
+       4 bytes: reserved (zero) */
+#define PKTLOG_SESSION_SIZE 16
+
+typedef struct pktlog_session {
+    uint32_t guildcard;
+    uint16_t block;
+    uint8_t version;
+    uint8_t hdr_size;
+    uint32_t flags;
+} pktlog_session_t;
+
+/* Open modes for pktlog_open(). Text logs (used for teams) get each note
+   written out with a timestamp in front of it, like fdebug() would. */
+#define PKTLOG_MODE_TEXT    0
+#define PKTLOG_MODE_BINARY  1
+
+typedef struct pktlog pktlog_t;
+
+/* Start and stop the writer thread. Anything still in the queue at shutdown is
+   written out before the thread exits. */
+int pktlog_init(void);
+void pktlog_shutdown(void);
+
+/* Open a log file, writing the binary header if appropriate. */
+pktlog_t *pktlog_open(const char *fn, int mode);
+
+/* Close a log. The close happens in order with anything else queued for the
+   log, and the log must not be used by the caller again afterwards. */
+void pktlog_close(pktlog_t *l);
+
+/* Queue a packet for the log. Packets in text logs are ignored. */
+void pktlog_packet(pktlog_t *l, int type, const void *pkt, size_t len);
+
+/* Queue a note for the log. Notes are timestamped when they're queued. */
+void pktlog_note(pktlog_t *l, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void pktlog_vnote(pktlog_t *l, const char *fmt, va_list args);
+
+/* Queue already formatted text to be written to a text log exactly as is. */
+void pktlog_raw(pktlog_t *l, const char *str, size_t len);
+
+/* Queue a session record for a binary log. */
+void pktlog_session(pktlog_t *l, const pktlog_session_t *s);
+
+/* Print the binary log in fn out to fp in a human readable form. */
+int pktlog_dump(const char *fn, FILE *fp);
+
+/* Reading binary logs. The whole file is mapped into memory, and each entry
+   points right into the mapping, so nothing gets copied. */
+typedef struct pktlog_reader {
+    const uint8_t *base;
+    size_t size;
+    size_t pos;
+    uint32_t version;
+} pktlog_reader_t;
+
+typedef struct pktlog_entry {
+    uint64_t timestamp;
+    uint32_t len;
+    int type;
+    const uint8_t *data;
+} pktlog_entry_t;
+
+/* Map the log in fn. Returns 0 on success, -1 if the file can't be opened or
+   mapped, or -2 if it isn't a packet log of a version we know about. */
+int pktlog_reader_open(pktlog_reader_t *r, const char *fn);
+void pktlog_reader_close(pktlog_reader_t *r);
+
+/* Fetch the next entry. Returns 1 if there was one, 0 at the end of the log, or
+   -1 if the log is truncated or otherwise damaged. */
+int pktlog_reader_next(pktlog_reader_t *r, pktlog_entry_t *e);
+
+/* Decode the data of a PKTLOG_SESSION entry. Returns -1 if it's too short. */
+int pktlog_read_session(const pktlog_entry_t *e, pktlog_session_t *s);
+
+#endif /* !PKTLOG_H */
@@ -24,7 +24,6 @@
 #include <arpa/inet.h>
 
 #include <sylverant/debug.h>
-#include <sylverant/mtwist.h>
 
 #include <psoarchive/PRS.h>
 
@@ -1158,6 +1157,226 @@ static int build_bb_units(int norestrict) {
     return 0;
 }
 
+/* The flat tables of items (see pmt_item_t). The entries for the items with a
+   given first byte (0 = weapon, 1 = guard) and second byte of their item code
+   start at base[type][subtype], and there are count[type][subtype] of them, so
+   the third byte of the code just indexes from there. */
+typedef struct pmt_table {
+    pmt_item_t *items;
+    uint32_t base[2][0x100];
+    uint32_t count[2][0x100];
+} pmt_table_t;
+
+static pmt_table_t table_v2, table_gc, table_bb;
+
+static int table_alloc(pmt_table_t *t, uint32_t cnt) {
+    void *p;
+
+    memset(t, 0, sizeof(pmt_table_t));
+
+    /* Keep the entries lined up with cache lines. */
+    if(posix_memalign(&p, 64, sizeof(pmt_item_t) * (cnt ? cnt : 1))) {
+        debug(DBG_ERROR, "Cannot allocate PMT item table\n");
+        return -1;
+    }
+
+    memset(p, 0, sizeof(pmt_item_t) * (cnt ? cnt : 1));
+    t->items = (pmt_item_t *)p;
+    return 0;
+}
+
+/* Make space in the table for a group of items, returning the first entry.
+   Only the first 256 items of any group can actually be referred to by an
+   item code, so that's all that gets kept. */
+static pmt_item_t *table_group(pmt_table_t *t, int type, int sub, uint32_t cnt,
+                               uint32_t *next) {
+    pmt_item_t *rv = t->items + *next;
+
+    if(cnt > 0x100)
+        cnt = 0x100;
+
+    t->base[type][sub] = *next;
+    t->count[type][sub] = cnt;
+    *next += cnt;
+
+    return rv;
+}
+
+/* How many entries the table for a version needs. */
+static uint32_t table_size(uint32_t nweap_types, const uint32_t *nweaps,
+                           uint32_t nguard_types, const uint32_t *nguards,
+                           uint32_t nunits) {
+    uint32_t i, rv = 0;
+
+    for(i = 0; i < nweap_types && i < 0x100; ++i) {
+        rv += nweaps[i] > 0x100 ? 0x100 : nweaps[i];
+    }
+
+    /* Guards start at a subtype of 1, and 3 is for units. */
+    for(i = 0; i < nguard_types && i < 0xFF; ++i) {
+        if(i != 2)
+            rv += nguards[i] > 0x100 ? 0x100 : nguards[i];
+    }
+
+    return rv + (nunits > 0x100 ? 0x100 : nunits);
+}
+
+static uint8_t table_stars(uint32_t index, uint32_t lowest, const uint8_t *tbl,
+                           uint32_t max) {
+    if(index - lowest >= max)
+        return (uint8_t)-1;
+
+    return tbl[index - lowest];
+}
+
+static const pmt_item_t *table_lookup(const pmt_table_t *t, uint32_t code) {
+    uint8_t type = (uint8_t)(code & 0xFF);
+    uint8_t sub = (uint8_t)((code >> 8) & 0xFF);
+    uint8_t idx = (uint8_t)((code >> 16) & 0xFF);
+
+    if(!t->items || type > 0x01 || idx >= t->count[type][sub])
+        return NULL;
+
+    return &t->items[t->base[type][sub] + idx];
+}
+
+static int build_v2_table(void) {
+    pmt_table_t *t = &table_v2;
+    pmt_item_t *it;
+    uint32_t i, j, next = 0;
+
+    if(table_alloc(t, table_size(num_weapon_types, num_weapons,
+                                 num_guard_types, num_guards, num_units)))
+        return -1;
+
+    for(i = 0; i < num_weapon_types && i < 0x100; ++i) {
+        it = table_group(t, 0, i, num_weapons[i], &next);
+
+        for(j = 0; j < t->count[0][i]; ++j) {
+            it[j].index = weapons[i][j].index;
+            it[j].stars = table_stars(it[j].index, weapon_lowest, star_table,
+                                      star_max);
+        }
+    }
+
+    for(i = 0; i < num_guard_types && i < 0xFF; ++i) {
+        if(i == 2)
+            continue;
+
+        it = table_group(t, 1, i + 1, num_guards[i], &next);
+
+        for(j = 0; j < t->count[1][i + 1]; ++j) {
+            it[j].index = guards[i][j].index;
+            it[j].stars = table_stars(it[j].index, weapon_lowest, star_table,
+                                      star_max);
+            it[j].dfp_range = guards[i][j].dfp_range;
+            it[j].evp_range = guards[i][j].evp_range;
+        }
+    }
+
+    it = table_group(t, 1, 3, num_units, &next);
+
+    for(j = 0; j < t->count[1][3]; ++j) {
+        it[j].index = units[j].index;
+        it[j].stars = table_stars(it[j].index, weapon_lowest, star_table,
+                                  star_max);
+    }
+
+    return 0;
+}
+
+static int build_gc_table(void) {
+    pmt_table_t *t = &table_gc;
+    pmt_item_t *it;
+    uint32_t i, j, next = 0;
+
+    if(table_alloc(t, table_size(num_weapon_types_gc, num_weapons_gc,
+                                 num_guard_types_gc, num_guards_gc,
+                                 num_units_gc)))
+        return -1;
+
+    for(i = 0; i < num_weapon_types_gc && i < 0x100; ++i) {
+        it = table_group(t, 0, i, num_weapons_gc[i], &next);
+
+        for(j = 0; j < t->count[0][i]; ++j) {
+            it[j].index = weapons_gc[i][j].index;
+            it[j].stars = table_stars(it[j].index, weapon_lowest_gc,
+                                      star_table_gc, star_max_gc);
+        }
+    }
+
+    for(i = 0; i < num_guard_types_gc && i < 0xFF; ++i) {
+        if(i == 2)
+            continue;
+
+        it = table_group(t, 1, i + 1, num_guards_gc[i], &next);
+
+        for(j = 0; j < t->count[1][i + 1]; ++j) {
+            it[j].index = guards_gc[i][j].index;
+            it[j].stars = table_stars(it[j].index, weapon_lowest_gc,
+                                      star_table_gc, star_max_gc);
+            it[j].dfp_range = guards_gc[i][j].dfp_range;
+            it[j].evp_range = guards_gc[i][j].evp_range;
+        }
+    }
+
+    it = table_group(t, 1, 3, num_units_gc, &next);
+
+    for(j = 0; j < t->count[1][3]; ++j) {
+        it[j].index = units_gc[j].index;
+        it[j].stars = table_stars(it[j].index, weapon_lowest_gc, star_table_gc,
+                                  star_max_gc);
+    }
+
+    return 0;
+}
+
+static int build_bb_table(void) {
+    pmt_table_t *t = &table_bb;
+    pmt_item_t *it;
+    uint32_t i, j, next = 0;
+
+    if(table_alloc(t, table_size(num_weapon_types_bb, num_weapons_bb,
+                                 num_guard_types_bb, num_guards_bb,
+                                 num_units_bb)))
+        return -1;
+
+    for(i = 0; i < num_weapon_types_bb && i < 0x100; ++i) {
+        it = table_group(t, 0, i, num_weapons_bb[i], &next);
+
+        for(j = 0; j < t->count[0][i]; ++j) {
+            it[j].index = weapons_bb[i][j].index;
+            it[j].stars = table_stars(it[j].index, weapon_lowest_bb,
+                                      star_table_bb, star_max_bb);
+        }
+    }
+
+    for(i = 0; i < num_guard_types_bb && i < 0xFF; ++i) {
+        if(i == 2)
+            continue;
+
+        it = table_group(t, 1, i + 1, num_guards_bb[i], &next);
+
+        for(j = 0; j < t->count[1][i + 1]; ++j) {
+            it[j].index = guards_bb[i][j].index;
+            it[j].stars = table_stars(it[j].index, weapon_lowest_bb,
+                                      star_table_bb, star_max_bb);
+            it[j].dfp_range = guards_bb[i][j].dfp_range;
+            it[j].evp_range = guards_bb[i][j].evp_range;
+        }
+    }
+
+    it = table_group(t, 1, 3, num_units_bb, &next);
+
+    for(j = 0; j < t->count[1][3]; ++j) {
+        it[j].index = units_bb[j].index;
+        it[j].stars = table_stars(it[j].index, weapon_lowest_bb, star_table_bb,
+                                  star_max_bb);
+    }
+
+    return 0;
+}
+
 int pmt_read_v2(const char *fn, int norestrict) {
     int ucsz;
     uint8_t *ucbuf;
@@ -1207,6 +1426,11 @@ int pmt_read_v2(const char *fn, int norestrict) {
         return -14;
     }
 
+    /* ...and the flat table of items. */
+    if(build_v2_table()) {
+        return -15;
+    }
+
     have_v2_pmt = 1;
 
     return 0;
@@ -1261,6 +1485,11 @@ int pmt_read_gc(const char *fn, int norestrict) {
         return -14;
     }
 
+    /* ...and the flat table of items. */
+    if(build_gc_table()) {
+        return -15;
+    }
+
     have_gc_pmt = 1;
 
     return 0;
@@ -1315,6 +1544,11 @@ int pmt_read_bb(const char *fn, int norestrict) {
         return -14;
     }
 
+    /* ...and the flat table of items. */
+    if(build_bb_table()) {
+        return -15;
+    }
+
     have_bb_pmt = 1;
 
     return 0;
@@ -1389,6 +1623,13 @@ void pmt_cleanup(void) {
     free(guards_bb);
     free(num_guards_bb);
 
+    free(table_v2.items);
+    free(table_gc.items);
+    free(table_bb.items);
+    memset(&table_v2, 0, sizeof(pmt_table_t));
+    memset(&table_gc, 0, sizeof(pmt_table_t));
+    memset(&table_bb, 0, sizeof(pmt_table_t));
+
     weapons = NULL;
     num_weapons = NULL;
     weapons_gc = NULL;
@@ -1529,54 +1770,14 @@ int pmt_lookup_unit_v2(uint32_t code, pmt_unit_v2_t *rv) {
     return 0;
 }
 
-uint8_t pmt_lookup_stars_v2(uint32_t code) {
-    uint8_t parts[3];
-    pmt_weapon_v2_t weap;
-    pmt_guard_v2_t guard;
-    pmt_unit_v2_t unit;
-
-    /* Make sure we loaded the PMT stuff to start with. */
-    if(!have_v2_pmt)
-        return (uint8_t)-1;
-
-    parts[0] = (uint8_t)(code & 0xFF);
-    parts[1] = (uint8_t)((code >> 8) & 0xFF);
-    parts[2] = (uint8_t)((code >> 16) & 0xFF);
-
-    switch(parts[0]) {
-        case 0x00:                      /* Weapons */
-            if(pmt_lookup_weapon_v2(code, &weap))
-                return (uint8_t)-1;
-
-            if(weap.index - weapon_lowest > star_max)
-                return (uint8_t)-1;
-
-            return star_table[weap.index - weapon_lowest];
-
-        case 0x01:                      /* Guards */
-            switch(parts[1]) {
-                case 0x01:              /* Armors */
-                case 0x02:              /* Shields */
-                    if(pmt_lookup_guard_v2(code, &guard))
-                        return (uint8_t)-1;
-
-                    if(guard.index - weapon_lowest > star_max)
-                        return (uint8_t)-1;
-
-                    return star_table[guard.index - weapon_lowest];
-
-                case 0x03:              /* Units */
-                    if(pmt_lookup_unit_v2(code, &unit))
-                        return (uint8_t)-1;
-
-                    if(unit.index - weapon_lowest > star_max)
-                        return (uint8_t)-1;
+const pmt_item_t *pmt_lookup_item_v2(uint32_t code) {
+    return table_lookup(&table_v2, code);
+}
 
-                    return star_table[unit.index - weapon_lowest];
-            }
-    }
+uint8_t pmt_lookup_stars_v2(uint32_t code) {
+    const pmt_item_t *it = table_lookup(&table_v2, code);
 
-    return (uint8_t)-1;
+    return it ? it->stars : (uint8_t)-1;
 }
 
 int pmt_lookup_weapon_gc(uint32_t code, pmt_weapon_gc_t *rv) {
@@ -1675,54 +1876,14 @@ int pmt_lookup_unit_gc(uint32_t code, pmt_unit_gc_t *rv) {
     return 0;
 }
 
-uint8_t pmt_lookup_stars_gc(uint32_t code) {
-    uint8_t parts[3];
-    pmt_weapon_gc_t weap;
-    pmt_guard_gc_t guard;
-    pmt_unit_gc_t unit;
-
-    /* Make sure we loaded the PMT stuff to start with. */
-    if(!have_gc_pmt)
-        return (uint8_t)-1;
-
-    parts[0] = (uint8_t)(code & 0xFF);
-    parts[1] = (uint8_t)((code >> 8) & 0xFF);
-    parts[2] = (uint8_t)((code >> 16) & 0xFF);
-
-    switch(parts[0]) {
-        case 0x00:                      /* Weapons */
-            if(pmt_lookup_weapon_gc(code, &weap))
-                return (uint8_t)-1;
-
-            if(weap.index - weapon_lowest_gc > star_max_gc)
-                return (uint8_t)-1;
-
-            return star_table_gc[weap.index - weapon_lowest_gc];
-
-        case 0x01:                      /* Guards */
-            switch(parts[1]) {
-                case 0x01:              /* Armors */
-                case 0x02:              /* Shields */
-                    if(pmt_lookup_guard_gc(code, &guard))
-                        return (uint8_t)-1;
-
-                    if(guard.index - weapon_lowest_gc > star_max_gc)
-                        return (uint8_t)-1;
-
-                    return star_table_gc[guard.index - weapon_lowest_gc];
-
-                case 0x03:              /* Units */
-                    if(pmt_lookup_unit_gc(code, &unit))
-                        return (uint8_t)-1;
-
-                    if(unit.index - weapon_lowest_gc > star_max_gc)
-                        return (uint8_t)-1;
+const pmt_item_t *pmt_lookup_item_gc(uint32_t code) {
+    return table_lookup(&table_gc, code);
+}
 
-                    return star_table_gc[unit.index - weapon_lowest_gc];
-            }
-    }
+uint8_t pmt_lookup_stars_gc(uint32_t code) {
+    const pmt_item_t *it = table_lookup(&table_gc, code);
 
-    return (uint8_t)-1;
+    return it ? it->stars : (uint8_t)-1;
 }
 
 int pmt_lookup_weapon_bb(uint32_t code, pmt_weapon_bb_t *rv) {
@@ -1821,54 +1982,14 @@ int pmt_lookup_unit_bb(uint32_t code, pmt_unit_bb_t *rv) {
     return 0;
 }
 
-uint8_t pmt_lookup_stars_bb(uint32_t code) {
-    uint8_t parts[3];
-    pmt_weapon_bb_t weap;
-    pmt_guard_bb_t guard;
-    pmt_unit_bb_t unit;
-
-    /* Make sure we loaded the PMT stuff to start with. */
-    if(!have_bb_pmt)
-        return (uint8_t)-1;
-
-    parts[0] = (uint8_t)(code & 0xFF);
-    parts[1] = (uint8_t)((code >> 8) & 0xFF);
-    parts[2] = (uint8_t)((code >> 16) & 0xFF);
-
-    switch(parts[0]) {
-        case 0x00:                      /* Weapons */
-            if(pmt_lookup_weapon_bb(code, &weap))
-                return (uint8_t)-1;
-
-            if(weap.index - weapon_lowest_bb > star_max_bb)
-                return (uint8_t)-1;
-
-            return star_table_bb[weap.index - weapon_lowest_bb];
-
-        case 0x01:                      /* Guards */
-            switch(parts[1]) {
-                case 0x01:              /* Armors */
-                case 0x02:              /* Shields */
-                    if(pmt_lookup_guard_bb(code, &guard))
-                        return (uint8_t)-1;
-
-                    if(guard.index - weapon_lowest_bb > star_max_bb)
-                        return (uint8_t)-1;
-
-                    return star_table_bb[guard.index - weapon_lowest_bb];
-
-                case 0x03:              /* Units */
-                    if(pmt_lookup_unit_bb(code, &unit))
-                        return (uint8_t)-1;
-
-                    if(unit.index - weapon_lowest_bb > star_max_bb)
-                        return (uint8_t)-1;
+const pmt_item_t *pmt_lookup_item_bb(uint32_t code) {
+    return table_lookup(&table_bb, code);
+}
 
-                    return star_table_bb[unit.index - weapon_lowest_bb];
-            }
-    }
+uint8_t pmt_lookup_stars_bb(uint32_t code) {
+    const pmt_item_t *it = table_lookup(&table_bb, code);
 
-    return (uint8_t)-1;
+    return it ? it->stars : (uint8_t)-1;
 }
 
 /*
@@ -1895,9 +2016,9 @@ uint8_t pmt_lookup_stars_bb(uint32_t code) {
    is actually defined as a 0 increment anyway).
 */
 int pmt_random_unit_v2(uint8_t max, uint32_t item[4],
-                       struct mt19937_state *rng, lobby_t *l) {
+                       rng_stream_t *rng, lobby_t *l) {
     uint64_t unit;
-    uint32_t rnd = mt19937_genrand_int32(rng);
+    uint32_t rnd = rng_int32(rng);
 
 #ifdef DEBUG
     if(l->flags & LOBBY_FLAG_DBG_SDROPS)
@@ -1925,9 +2046,9 @@ int pmt_random_unit_v2(uint8_t max, uint32_t item[4],
 }
 
 int pmt_random_unit_gc(uint8_t max, uint32_t item[4],
-                       struct mt19937_state *rng, lobby_t *l) {
+                       rng_stream_t *rng, lobby_t *l) {
     uint64_t unit;
-    uint32_t rnd = mt19937_genrand_int32(rng);
+    uint32_t rnd = rng_int32(rng);
 
 #ifdef DEBUG
     if(l->flags & LOBBY_FLAG_DBG_SDROPS)
@@ -1955,9 +2076,9 @@ int pmt_random_unit_gc(uint8_t max, uint32_t item[4],
 }
 
 int pmt_random_unit_bb(uint8_t max, uint32_t item[4],
-                       struct mt19937_state *rng, lobby_t *l) {
+                       rng_stream_t *rng, lobby_t *l) {
     uint64_t unit;
-    uint32_t rnd = mt19937_genrand_int32(rng);
+    uint32_t rnd = rng_int32(rng);
 
 #ifdef DEBUG
     if(l->flags & LOBBY_FLAG_DBG_SDROPS)
@@ -20,7 +20,7 @@
 
 #include <stdint.h>
 
-#include <sylverant/mtwist.h>
+#include "rng.h"
 
 #include "lobby.h"
 
@@ -256,6 +256,18 @@ typedef struct pmt_mag_bb {
 
 #undef PACKED
 
+/* The parts of a PMT entry that get looked at most often (when generating and
+   checking drops), kept for every weapon, armor, shield, and unit in one flat
+   table per version that can be indexed by item code. Everything in here is
+   already in native byte order. */
+typedef struct pmt_item {
+    uint32_t index;
+    uint8_t stars;                      /* 0xFF if not in the star table */
+    uint8_t dfp_range;                  /* Armors and shields only */
+    uint8_t evp_range;
+    uint8_t unused;
+} pmt_item_t;
+
 int pmt_read_v2(const char *fn, int norestrict);
 int pmt_read_gc(const char *fn, int norestrict);
 int pmt_read_bb(const char *fn, int norestrict);
@@ -265,13 +277,20 @@ int pmt_bb_enabled(void);
 
 void pmt_cleanup(void);
 
+/* Look up an item in the flat table. These return NULL if the item isn't in
+   the PMT (or no PMT has been read for that version). The pointer returned is
+   good until pmt_cleanup() is called. */
+const pmt_item_t *pmt_lookup_item_v2(uint32_t code);
+const pmt_item_t *pmt_lookup_item_gc(uint32_t code);
+const pmt_item_t *pmt_lookup_item_bb(uint32_t code);
+
 int pmt_lookup_weapon_v2(uint32_t code, pmt_weapon_v2_t *rv);
 int pmt_lookup_guard_v2(uint32_t code, pmt_guard_v2_t *rv);
 int pmt_lookup_unit_v2(uint32_t code, pmt_unit_v2_t *rv);
 
 uint8_t pmt_lookup_stars_v2(uint32_t code);
 int pmt_random_unit_v2(uint8_t max, uint32_t item[4],
-                       struct mt19937_state *rng, lobby_t *l);
+                       rng_stream_t *rng, lobby_t *l);
 
 int pmt_lookup_weapon_gc(uint32_t code, pmt_weapon_gc_t *rv);
 int pmt_lookup_guard_gc(uint32_t code, pmt_guard_gc_t *rv);
@@ -279,14 +298,14 @@ int pmt_lookup_unit_gc(uint32_t code, pmt_unit_gc_t *rv);
 
 uint8_t pmt_lookup_stars_gc(uint32_t code);
 int pmt_random_unit_gc(uint8_t max, uint32_t item[4],
-                       struct mt19937_state *rng, lobby_t *l);
+                       rng_stream_t *rng, lobby_t *l);
 
 int pmt_lookup_weapon_bb(uint32_t code, pmt_weapon_bb_t *rv);
 int pmt_lookup_guard_bb(uint32_t code, pmt_guard_bb_t *rv);
 int pmt_lookup_unit_bb(uint32_t code, pmt_unit_bb_t *rv);
 
 int pmt_random_unit_bb(uint8_t max, uint32_t item[4],
-                       struct mt19937_state *rng, lobby_t *l);
+                       rng_stream_t *rng, lobby_t *l);
 uint8_t pmt_lookup_stars_bb(uint32_t code);
 
 #endif /* !PMTDATA_H */
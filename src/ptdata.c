@@ -19,12 +19,12 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include <arpa/inet.h>
 
 #include <sylverant/items.h>
 #include <sylverant/debug.h>
-#include <sylverant/mtwist.h>
 
 #include <psoarchive/AFS.h>
 #include <psoarchive/GSL.h>
@@ -36,6 +36,8 @@
 #include "items.h"
 #include "utils.h"
 #include "quests.h"
+#include "legit.h"
+#include "snapshot.h"
 
 #define PACKED __attribute__((packed))
 
@@ -111,13 +113,24 @@ typedef struct fpt_v2_entry {
 
 #define MIN(x, y) (x < y ? x : y)
 
-static int have_v2pt = 0;
-static int have_gcpt = 0;
-static int have_bbpt = 0;
+/* One generation of the ItemPT data. This works just like the rare tables do
+   (see rtdata.c): games hang onto the one they were made with, and a refresh
+   just swaps the pointer to the current one. */
+struct pt_gen {
+    uint32_t refcnt;
+    int have_v2;
+    int have_gc;
+    int have_bb;
+    pt_v2_entry_t v2[4][10];
+    pt_v3_entry_t gc[2][4][10];
+    pt_v3_entry_t bb[2][4][10];
+};
+
+typedef struct pt_gen pt_gen_t;
 
-static pt_v2_entry_t v2_ptdata[4][10];
-static pt_v3_entry_t gc_ptdata[2][4][10];
-static pt_v3_entry_t bb_ptdata[2][4][10];
+static pt_gen_t pt_first = { 1 };
+static pt_gen_t *pt_cur = &pt_first;
+static pthread_mutex_t pt_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static const int tool_base[28] = {
     Item_Monomate, Item_Dimate, Item_Trimate,
@@ -166,7 +179,106 @@ static const int attr_count[4] = { 8, 10, 12, 12 };
 
 #define EPSILON 0.001f
 
-int pt_read_v2(const char *fn) {
+/* Build the running total of one column of a probability table. */
+static void build_cum8(uint32_t *cum, const uint8_t *vals, int n, int stride) {
+    uint32_t total = 0;
+    int i;
+
+    for(i = 0; i < n; ++i) {
+        total += vals[i * stride];
+        cum[i] = total;
+    }
+}
+
+static void build_cum16(uint32_t *cum, const uint16_t *vals, int n,
+                        int stride) {
+    uint32_t total = 0;
+    int i;
+
+    for(i = 0; i < n; ++i) {
+        total += vals[i * stride];
+        cum[i] = total;
+    }
+}
+
+/* Work out which weapon types can drop on a floor, and what rank and grind
+   pattern each of them would have there. See the big comment above
+   generate_weapon_v2() for how this all works. */
+static void build_weapon_table(pt_weapon_table_t *w, const int8_t *ratio,
+                               const int8_t *minrank, const int8_t *upgfloor,
+                               int area) {
+    uint32_t total = 0;
+    int i, warea, rank;
+
+    w->count = 0;
+    w->bad_type = -1;
+
+    for(i = 0; i < 12; ++i) {
+        if((minrank[i] + area) < 0 || ratio[i] <= 0)
+            continue;
+
+        /* The loop below would never end with one of these, so just remember
+           it's here so it can be complained about when something drops. */
+        if(upgfloor[i] <= 0) {
+            w->bad_type = i;
+            return;
+        }
+
+        if(minrank[i] >= 0) {
+            warea = area;
+            rank = minrank[i];
+        }
+        else {
+            warea = minrank[i] + area;
+            rank = 0;
+        }
+
+        while((warea - upgfloor[i]) >= 0) {
+            ++rank;
+            warea -= upgfloor[i];
+        }
+
+        total += ratio[i];
+        w->types[w->count] = (uint8_t)i;
+        w->ranks[w->count] = (uint8_t)rank;
+        w->patterns[w->count] = (uint8_t)MIN(warea, 3);
+        w->cum[w->count++] = total;
+    }
+}
+
+/* Build the tables that are the same between v2 and v3. The percent patterns
+   are different sizes in each, so those are left to the caller. */
+static void build_tables(pt_tables_t *t, const int8_t *ratio,
+                         const int8_t *minrank, const int8_t *upgfloor,
+                         uint16_t tools[28][10], uint8_t techs[19][10]) {
+    int i;
+
+    for(i = 0; i < 10; ++i) {
+        build_weapon_table(&t->weapons[i], ratio, minrank, upgfloor, i);
+        build_cum16(t->tools[i], &tools[0][i], 28, 10);
+        build_cum8(t->techs[i], &techs[0][i], 19, 10);
+    }
+}
+
+/* Find the first entry in a running total that's past rnd, or n if there isn't
+   one. This picks the same entry as subtracting each one from rnd in turn and
+   stopping at the one that takes it below zero. */
+static int cum_pick(const uint32_t *cum, int n, uint32_t rnd) {
+    int lo = 0, hi = n, mid;
+
+    while(lo < hi) {
+        mid = (lo + hi) >> 1;
+
+        if(cum[mid] > rnd)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return lo;
+}
+
+static int read_v2(pt_gen_t *g, const char *fn) {
     pso_afs_read_t *a;
     pso_error_t err;
     ssize_t sz;
@@ -216,7 +328,7 @@ int pt_read_v2(const char *fn) {
             }
 
             /* Dump it into our nicer (not packed) structure. */
-            ent = &v2_ptdata[i][j];
+            ent = &g->v2[i][j];
             memcpy(ent->weapon_ratio, buf->weapon_ratio, 12);
             memcpy(ent->weapon_minrank, buf->weapon_minrank, 12);
             memcpy(ent->weapon_upgfloor, buf->weapon_upgfloor, 12);
@@ -279,10 +391,19 @@ int pt_read_v2(const char *fn) {
                 ent->box_meseta[k][1] = LE16(ent->box_meseta[k][1]);
 #endif
             }
+
+            build_tables(&ent->tables, ent->weapon_ratio, ent->weapon_minrank,
+                         ent->weapon_upgfloor, ent->tool_frequency,
+                         ent->tech_frequency);
+
+            for(k = 0; k < 5; ++k) {
+                build_cum8(ent->tables.percents[k], &ent->percent_pattern[0][k],
+                           23, 5);
+            }
         }
     }
 
-    have_v2pt = 1;
+    g->have_v2 = 1;
 
 out:
     pso_afs_read_close(a);
@@ -290,7 +411,7 @@ out:
     return rv;
 }
 
-int pt_read_v3(const char *fn, int bb) {
+static int read_v3(pt_gen_t *g, const char *fn, int bb) {
     pso_gsl_read_t *a;
     const char difficulties[4] = { 'n', 'h', 'v', 'u' };
     const char *episodes[2] = { "", "l" };
@@ -355,9 +476,9 @@ int pt_read_v3(const char *fn, int bb) {
 
                 /* Dump it into our nicer (not packed) structure. */
                 if(bb)
-                    ent = &bb_ptdata[i][j][k];
+                    ent = &g->bb[i][j][k];
                 else
-                    ent = &gc_ptdata[i][j][k];
+                    ent = &g->gc[i][j][k];
 
                 memcpy(ent->weapon_ratio, buf->weapon_ratio, 12);
                 memcpy(ent->weapon_minrank, buf->weapon_minrank, 12);
@@ -416,14 +537,23 @@ int pt_read_v3(const char *fn, int bb) {
                     ent->box_meseta[l][0] = ntohs(buf->box_meseta[l][0]);
                     ent->box_meseta[l][1] = ntohs(buf->box_meseta[l][1]);
                 }
+
+                build_tables(&ent->tables, ent->weapon_ratio,
+                             ent->weapon_minrank, ent->weapon_upgfloor,
+                             ent->tool_frequency, ent->tech_frequency);
+
+                for(l = 0; l < 6; ++l) {
+                    build_cum16(ent->tables.percents[l],
+                                &ent->percent_pattern[0][l], 23, 6);
+                }
             }
         }
     }
 
     if(bb)
-        have_bbpt = 1;
+        g->have_bb = 1;
     else
-        have_gcpt = 1;
+        g->have_gc = 1;
 
 out:
     pso_gsl_read_close(a);
@@ -431,16 +561,126 @@ out:
     return rv;
 }
 
+int pt_read_v2(const char *fn) {
+    return read_v2(pt_cur, fn);
+}
+
+int pt_read_v3(const char *fn, int bb) {
+    return read_v3(pt_cur, fn, bb);
+}
+
+int pt_refresh(const char *v2fn, const char *gcfn, const char *bbfn) {
+    pt_gen_t *g, *old;
+
+    if(!(g = (pt_gen_t *)calloc(1, sizeof(pt_gen_t)))) {
+        debug(DBG_ERROR, "Cannot allocate ItemPT data: %s\n",
+              strerror(errno));
+        return -1;
+    }
+
+    g->refcnt = 1;
+
+    if((v2fn && read_v2(g, v2fn)) || (gcfn && read_v3(g, gcfn, 0)) ||
+       (bbfn && read_v3(g, bbfn, 1))) {
+        free(g);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pt_lock);
+    old = pt_cur;
+    pt_cur = g;
+    pthread_mutex_unlock(&pt_lock);
+
+    pt_gen_unref(old);
+    return 0;
+}
+
+pt_gen_t *pt_gen_ref(void) {
+    pt_gen_t *g;
+
+    pthread_mutex_lock(&pt_lock);
+    g = pt_cur;
+    __atomic_add_fetch(&g->refcnt, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pt_lock);
+
+    return g;
+}
+
+void pt_gen_unref(pt_gen_t *g) {
+    if(g && !__atomic_sub_fetch(&g->refcnt, 1, __ATOMIC_ACQ_REL) &&
+       g != &pt_first)
+        free(g);
+}
+
+int pt_snapshot_write(snapshot_writer_t *w) {
+    pt_gen_t *g = pt_cur;
+    int32_t have[4] = { g->have_v2, g->have_gc, g->have_bb, 0 };
+
+    if(snapshot_section(w, SNAPSHOT_PT) ||
+       snapshot_write(w, have, sizeof(have), NULL) ||
+       snapshot_write(w, g->v2, sizeof(g->v2), NULL) ||
+       snapshot_write(w, g->gc, sizeof(g->gc), NULL) ||
+       snapshot_write(w, g->bb, sizeof(g->bb), NULL))
+        return -1;
+
+    return 0;
+}
+
+int pt_snapshot_read(const snapshot_t *s, int load) {
+    pt_gen_t *g = pt_cur;
+    snapshot_cursor_t c;
+    const int32_t *have;
+    const void *v2, *gc, *bb;
+
+    snapshot_cursor(s, SNAPSHOT_PT, &c);
+
+    if(!(have = snapshot_read(&c, sizeof(int32_t) * 4)) ||
+       !(v2 = snapshot_read(&c, sizeof(g->v2))) ||
+       !(gc = snapshot_read(&c, sizeof(g->gc))) ||
+       !(bb = snapshot_read(&c, sizeof(g->bb))) ||
+       c.pos != c.size)
+        return -1;
+
+    if(!load)
+        return 0;
+
+    memcpy(g->v2, v2, sizeof(g->v2));
+    memcpy(g->gc, gc, sizeof(g->gc));
+    memcpy(g->bb, bb, sizeof(g->bb));
+    g->have_v2 = have[0];
+    g->have_gc = have[1];
+    g->have_bb = have[2];
+    return 0;
+}
+
 int pt_v2_enabled(void) {
-    return have_v2pt;
+    int rv;
+
+    pthread_mutex_lock(&pt_lock);
+    rv = pt_cur->have_v2;
+    pthread_mutex_unlock(&pt_lock);
+
+    return rv;
 }
 
 int pt_gc_enabled(void) {
-    return have_gcpt;
+    int rv;
+
+    pthread_mutex_lock(&pt_lock);
+    rv = pt_cur->have_gc;
+    pthread_mutex_unlock(&pt_lock);
+
+    return rv;
 }
 
 int pt_bb_enabled(void) {
-    return have_bbpt;
+    int rv;
+
+    pthread_mutex_lock(&pt_lock);
+    rv = pt_cur->have_bb;
+    pthread_mutex_unlock(&pt_lock);
+
+    return rv;
 }
 
 /*
@@ -527,11 +767,11 @@ int pt_bb_enabled(void) {
    below. :P
 */
 static int generate_weapon_v2(pt_v2_entry_t *ent, int area, uint32_t item[4],
-                              struct mt19937_state *rng, int picked, int v1,
+                              rng_stream_t *rng, int picked, int v1,
                               lobby_t *l) {
     uint32_t rnd, upcts = 0;
-    int i, j = 0, k, wchance = 0, warea = 0, npcts = 0;
-    int wtypes[12] = { 0 }, wranks[12] = { 0 }, gptrn[12] = { 0 };
+    int i, j, k, warea = 0, npcts = 0;
+    pt_weapon_table_t *wt;
     uint8_t *item_b = (uint8_t *)item;
     int semirare = 0, rare = 0;
 
@@ -552,67 +792,31 @@ static int generate_weapon_v2(pt_v2_entry_t *ent, int area, uint32_t item[4],
 
     item[0] = item[1] = item[2] = item[3] = 0;
 
-    /* Go through each weapon type to see what ones we actually will have to
-       work with right now... */
-    for(i = 0; i < 12; ++i) {
-        if((ent->weapon_minrank[i] + area) >= 0 && ent->weapon_ratio[i] > 0) {
-            wtypes[j] = i;
-            wchance += ent->weapon_ratio[i];
-
-            if(ent->weapon_minrank[i] >= 0) {
-                warea = area;
-                wranks[j] = ent->weapon_minrank[i];
-            }
-            else {
-                warea = ent->weapon_minrank[i] + area;
-                wranks[j] = 0;
-            }
-
-            /* Sanity check... Make sure this is sane before we go to the loop
-               below, since it will end up being an infinite loop if its not
-               sane... */
-            if(ent->weapon_upgfloor[i] <= 0) {
-                debug(DBG_WARN, "Invalid v2 weapon upgrade floor value for "
-                      "floor %d, weapon type %d. Please check your ItemPT.afs "
-                      "file for validity!\n", area, i);
-                return -1;
-            }
-
-            while((warea - ent->weapon_upgfloor[i]) >= 0) {
-                ++wranks[j];
-                warea -= ent->weapon_upgfloor[i];
-            }
+    /* Figure out what weapon types we actually have to work with right now
+       (this was all worked out when the ItemPT file was read)... */
+    wt = &ent->tables.weapons[area];
 
-            gptrn[j] = MIN(warea, 3);
-            ++j;
-        }
+    if(wt->bad_type >= 0) {
+        debug(DBG_WARN, "Invalid v2 weapon upgrade floor value for "
+              "floor %d, weapon type %d. Please check your ItemPT.afs "
+              "file for validity!\n", area, wt->bad_type);
+        return -1;
     }
 
     /* Sanity check... This shouldn't happen! */
-    if(!j) {
+    if(!wt->count) {
         debug(DBG_WARN, "No v2 weapon to generate on floor %d, please check "
               "your ItemPT.afs file for validity!\n", area);
         return -1;
     }
 
     /* Roll the dice! */
-    rnd = mt19937_genrand_int32(rng) % wchance;
-    for(i = 0; i < j; ++i) {
-        if((rnd -= ent->weapon_ratio[wtypes[i]]) > wchance) {
-            item[0] = ((wtypes[i] + 1) << 8) | (wranks[i] << 16);
+    rnd = rng_int32(rng) % wt->cum[wt->count - 1];
+    i = cum_pick(wt->cum, wt->count, rnd);
+    item[0] = ((wt->types[i] + 1) << 8) | (wt->ranks[i] << 16);
 
-            /* Save off the grind pattern to use... */
-            warea = gptrn[i];
-            break;
-        }
-    }
-
-    /* Sanity check... Once again, this shouldn't happen! */
-    if(!item[0]) {
-        debug(DBG_WARN, "Generated invalid v2 weapon. Please report this "
-              "error!\n");
-        return -1;
-    }
+    /* Save off the grind pattern to use... */
+    warea = wt->patterns[i];
 
     /* See if we made a "semi-rare" item. */
     if((item_b[1] >= 10 && item_b[2] > 3) || item_b[2] > 4)
@@ -620,7 +824,7 @@ static int generate_weapon_v2(pt_v2_entry_t *ent, int area, uint32_t item[4],
 
 already_picked:
     /* Next up, determine the grind value. */
-    rnd = mt19937_genrand_int32(rng) % 100;
+    rnd = rng_int32(rng) % 100;
     for(i = 0; i < 9; ++i) {
         if((rnd -= ent->power_pattern[i][warea]) > 100) {
             item[0] |= (i << 24);
@@ -643,33 +847,27 @@ already_picked:
         if(ent->area_pattern[i][area] < 0)
             continue;
 
-        rnd = mt19937_genrand_int32(rng) % 100;
+        rnd = rng_int32(rng) % 100;
         warea = ent->area_pattern[i][area];
 
-        for(j = 0; j < 23; ++j) {
-            /* See if we're going to generate this one... */
-            if((rnd -= ent->percent_pattern[j][warea]) > 100) {
-                /* If it would be 0%, don't bother... */
-                if(j == 2) {
-                    break;
-                }
+        /* See if we're going to generate one... If it would be 0%, or if we
+           didn't pick anything at all, don't bother... */
+        j = cum_pick(ent->tables.percents[warea], 23, rnd);
+        if(j >= 23 || j == 2)
+            continue;
 
-                /* Lets see what type we'll generate now... */
-                rnd = mt19937_genrand_int32(rng) % 100;
-                for(k = 0; k < 6; ++k) {
-                    if((rnd -= ent->percent_attachment[k][area]) > 100) {
-                        if(k == 0 || (upcts & (1 << k)))
-                            break;
-
-                        j = (j - 2) * 5;
-                        item_b[(npcts << 1) + 6] = k;
-                        item_b[(npcts << 1) + 7] = (uint8_t)j;
-                        ++npcts;
-                        upcts |= 1 << k;
-                        break;
-                    }
-                }
+        /* Lets see what type we'll generate now... */
+        rnd = rng_int32(rng) % 100;
+        for(k = 0; k < 6; ++k) {
+            if((rnd -= ent->percent_attachment[k][area]) > 100) {
+                if(k == 0 || (upcts & (1 << k)))
+                    break;
 
+                j = (j - 2) * 5;
+                item_b[(npcts << 1) + 6] = k;
+                item_b[(npcts << 1) + 7] = (uint8_t)j;
+                ++npcts;
+                upcts |= 1 << k;
                 break;
             }
         }
@@ -678,9 +876,9 @@ already_picked:
     /* Finally, lets see if there's going to be an elemental attribute applied
        to this weapon, or if its rare and we need to set the flag. */
     if(!semirare && ent->element_ranking[area]) {
-        rnd = mt19937_genrand_int32(rng) % 100;
+        rnd = rng_int32(rng) % 100;
         if(rnd < ent->element_probability[area]) {
-            rnd = mt19937_genrand_int32(rng) %
+            rnd = rng_int32(rng) %
                 attr_count[ent->element_ranking[area] - 1];
             item[1] = 0x80 | attr_list[ent->element_ranking[area] - 1][rnd];
         }
@@ -693,11 +891,11 @@ already_picked:
 }
 
 static int generate_weapon_v3(pt_v3_entry_t *ent, int area, uint32_t item[4],
-                              struct mt19937_state *rng, int picked, int bb,
+                              rng_stream_t *rng, int picked, int bb,
                               lobby_t *l) {
     uint32_t rnd, upcts = 0;
-    int i, j = 0, k, wchance = 0, warea = 0, npcts = 0;
-    int wtypes[12] = { 0 }, wranks[12] = { 0 }, gptrn[12] = { 0 };
+    int i, j, k, warea = 0, npcts = 0;
+    pt_weapon_table_t *wt;
     uint8_t *item_b = (uint8_t *)item;
     int semirare = 0, rare = 0;
 
@@ -718,44 +916,20 @@ static int generate_weapon_v3(pt_v3_entry_t *ent, int area, uint32_t item[4],
 
     item[0] = item[1] = item[2] = item[3] = 0;
 
-    /* Go through each weapon type to see what ones we actually will have to
-       work with right now... */
-    for(i = 0; i < 12; ++i) {
-        if((ent->weapon_minrank[i] + area) >= 0 && ent->weapon_ratio[i] > 0) {
-            wtypes[j] = i;
-            wchance += ent->weapon_ratio[i];
-
-            if(ent->weapon_minrank[i] >= 0) {
-                warea = area;
-                wranks[j] = ent->weapon_minrank[i];
-            }
-            else {
-                warea = ent->weapon_minrank[i] + area;
-                wranks[j] = 0;
-            }
-
-            /* Sanity check... Make sure this is sane before we go to the loop
-               below, since it will end up being an infinite loop if its not
-               sane... */
-            if(ent->weapon_upgfloor[i] <= 0) {
-                debug(DBG_WARN, "Invalid v3 weapon upgrade floor value for "
-                      "floor %d, weapon type %d. Please check your ItemPT.gsl "
-                      "file (%s) for validity!\n", area, i, bb ? "BB" : "GC");
-                return -1;
-            }
-
-            while((warea - ent->weapon_upgfloor[i]) >= 0) {
-                ++wranks[j];
-                warea -= ent->weapon_upgfloor[i];
-            }
+    /* Figure out what weapon types we actually have to work with right now
+       (this was all worked out when the ItemPT file was read)... */
+    wt = &ent->tables.weapons[area];
 
-            gptrn[j] = MIN(warea, 3);
-            ++j;
-        }
+    if(wt->bad_type >= 0) {
+        debug(DBG_WARN, "Invalid v3 weapon upgrade floor value for "
+              "floor %d, weapon type %d. Please check your ItemPT.gsl "
+              "file (%s) for validity!\n", area, wt->bad_type,
+              bb ? "BB" : "GC");
+        return -1;
     }
 
     /* Sanity check... This shouldn't happen! */
-    if(!j) {
+    if(!wt->count) {
         debug(DBG_WARN, "No v3 weapon to generate on floor %d, please check "
               "your ItemPT.gsl file (%s) for validity!\n", area,
               bb ? "BB" : "GC");
@@ -763,23 +937,12 @@ static int generate_weapon_v3(pt_v3_entry_t *ent, int area, uint32_t item[4],
     }
 
     /* Roll the dice! */
-    rnd = mt19937_genrand_int32(rng) % wchance;
-    for(i = 0; i < j; ++i) {
-        if((rnd -= ent->weapon_ratio[wtypes[i]]) > wchance) {
-            item[0] = ((wtypes[i] + 1) << 8) | (wranks[i] << 16);
+    rnd = rng_int32(rng) % wt->cum[wt->count - 1];
+    i = cum_pick(wt->cum, wt->count, rnd);
+    item[0] = ((wt->types[i] + 1) << 8) | (wt->ranks[i] << 16);
 
-            /* Save off the grind pattern to use... */
-            warea = gptrn[i];
-            break;
-        }
-    }
-
-    /* Sanity check... Once again, this shouldn't happen! */
-    if(!item[0]) {
-        debug(DBG_WARN, "Generated invalid v3 weapon. Please report this "
-              "error!\n");
-        return -1;
-    }
+    /* Save off the grind pattern to use... */
+    warea = wt->patterns[i];
 
     /* See if we made a "semi-rare" item. */
     if((item_b[1] >= 10 && item_b[2] > 3) || item_b[2] > 4)
@@ -787,7 +950,7 @@ static int generate_weapon_v3(pt_v3_entry_t *ent, int area, uint32_t item[4],
 
 already_picked:
     /* Next up, determine the grind value. */
-    rnd = mt19937_genrand_int32(rng) % 100;
+    rnd = rng_int32(rng) % 100;
     for(i = 0; i < 9; ++i) {
         if((rnd -= ent->power_pattern[i][warea]) > 100) {
             item[0] |= (i << 24);
@@ -810,33 +973,27 @@ already_picked:
         if(ent->area_pattern[i][area] < 0)
             continue;
 
-        rnd = mt19937_genrand_int32(rng) % 10000;
+        rnd = rng_int32(rng) % 10000;
         warea = ent->area_pattern[i][area];
 
-        for(j = 0; j < 23; ++j) {
-            /* See if we're going to generate this one... */
-            if((rnd -= ent->percent_pattern[j][warea]) > 10000) {
-                /* If it would be 0%, don't bother... */
-                if(j == 2) {
-                    break;
-                }
+        /* See if we're going to generate one... If it would be 0%, or if we
+           didn't pick anything at all, don't bother... */
+        j = cum_pick(ent->tables.percents[warea], 23, rnd);
+        if(j >= 23 || j == 2)
+            continue;
 
-                /* Lets see what type we'll generate now... */
-                rnd = mt19937_genrand_int32(rng) % 100;
-                for(k = 0; k < 6; ++k) {
-                    if((rnd -= ent->percent_attachment[k][area]) > 100) {
-                        if(k == 0 || (upcts & (1 << k)))
-                            break;
-
-                        j = (j - 2) * 5;
-                        item_b[(npcts << 1) + 6] = k;
-                        item_b[(npcts << 1) + 7] = (uint8_t)j;
-                        ++npcts;
-                        upcts |= 1 << k;
-                        break;
-                    }
-                }
+        /* Lets see what type we'll generate now... */
+        rnd = rng_int32(rng) % 100;
+        for(k = 0; k < 6; ++k) {
+            if((rnd -= ent->percent_attachment[k][area]) > 100) {
+                if(k == 0 || (upcts & (1 << k)))
+                    break;
 
+                j = (j - 2) * 5;
+                item_b[(npcts << 1) + 6] = k;
+                item_b[(npcts << 1) + 7] = (uint8_t)j;
+                ++npcts;
+                upcts |= 1 << k;
                 break;
             }
         }
@@ -845,9 +1002,9 @@ already_picked:
     /* Finally, lets see if there's going to be an elemental attribute applied
        to this weapon, or if its rare and we need to set the flag. */
     if(!semirare && ent->element_ranking[area]) {
-        rnd = mt19937_genrand_int32(rng) % 100;
+        rnd = rng_int32(rng) % 100;
         if(rnd < ent->element_probability[area]) {
-            rnd = mt19937_genrand_int32(rng) %
+            rnd = rng_int32(rng) %
                 attr_count[ent->element_ranking[area] - 1];
             item[1] = 0x80 | attr_list[ent->element_ranking[area] - 1][rnd];
         }
@@ -894,18 +1051,18 @@ already_picked:
    evp range defined in the PMT data.
 */
 static int generate_armor_v2(pt_v2_entry_t *ent, int area, uint32_t item[4],
-                             struct mt19937_state *rng, int picked,
+                             rng_stream_t *rng, int picked,
                              lobby_t *l) {
     uint32_t rnd;
     int i, armor = -1;
     uint8_t *item_b = (uint8_t *)item;
     uint16_t *item_w = (uint16_t *)item;
-    pmt_guard_v2_t guard;
+    const pmt_item_t *guard;
 
     if(!picked) {
         /* Go through each slot in the armor rankings to figure out which one
            that we'll be generating. */
-        rnd = mt19937_genrand_int32(rng) % 100;
+        rnd = rng_int32(rng) % 100;
 
 #ifdef DEBUG
         if(l->flags & LOBBY_FLAG_DBG_SDROPS)
@@ -950,7 +1107,7 @@ static int generate_armor_v2(pt_v2_entry_t *ent, int area, uint32_t item[4],
     item[1] = item[2] = item[3] = 0;
 
     /* Pick a number of unit slots */
-    rnd = mt19937_genrand_int32(rng) % 100;
+    rnd = rng_int32(rng) % 100;
 
 #ifdef DEBUG
     if(l->flags & LOBBY_FLAG_DBG_SDROPS)
@@ -973,7 +1130,7 @@ static int generate_armor_v2(pt_v2_entry_t *ent, int area, uint32_t item[4],
 
     /* Look up the item in the ItemPMT data so we can see what boosts we might
        apply... */
-    if(pmt_lookup_guard_v2(item[0], &guard)) {
+    if(!(guard = pmt_lookup_item_v2(item[0]))) {
         debug(DBG_WARN, "ItemPMT.prs file for v2 seems to be missing an armor "
               "type item (code %08x).\n", item[0]);
         return -2;
@@ -982,16 +1139,16 @@ static int generate_armor_v2(pt_v2_entry_t *ent, int area, uint32_t item[4],
 #ifdef DEBUG
     if(l->flags & LOBBY_FLAG_DBG_SDROPS)
         debug(DBG_LOG, "generate_armor_v2: DFP Range: %d, EVP Range: %d\n",
-              guard.dfp_range, guard.evp_range);
+              guard->dfp_range, guard->evp_range);
 #endif
 
-    if(guard.dfp_range) {
-        rnd = mt19937_genrand_int32(rng) % (guard.dfp_range + 1);
+    if(guard->dfp_range) {
+        rnd = rng_int32(rng) % (guard->dfp_range + 1);
         item_w[3] = (uint16_t)rnd;
     }
 
-    if(guard.evp_range) {
-        rnd = mt19937_genrand_int32(rng) % (guard.evp_range + 1);
+    if(guard->evp_range) {
+        rnd = rng_int32(rng) % (guard->evp_range + 1);
         item_w[4] = (uint16_t)rnd;
     }
 
@@ -1005,20 +1162,19 @@ static int generate_armor_v2(pt_v2_entry_t *ent, int area, uint32_t item[4],
 }
 
 static int generate_armor_v3(pt_v3_entry_t *ent, int area, uint32_t item[4],
-                             struct mt19937_state *rng, int picked, int bb,
+                             rng_stream_t *rng, int picked, int bb,
                              lobby_t *l) {
     uint32_t rnd;
     int i, armor = -1;
     uint8_t *item_b = (uint8_t *)item;
     uint16_t *item_w = (uint16_t *)item;
-    pmt_guard_gc_t gcg;
-    pmt_guard_bb_t bbg;
+    const pmt_item_t *guard;
     uint8_t dfp, evp;
 
     if(!picked) {
         /* Go through each slot in the armor rankings to figure out which one
            that we'll be generating. */
-        rnd = mt19937_genrand_int32(rng) % 100;
+        rnd = rng_int32(rng) % 100;
 
 #ifdef DEBUG
         if(l->flags & LOBBY_FLAG_DBG_SDROPS)
@@ -1064,7 +1220,7 @@ static int generate_armor_v3(pt_v3_entry_t *ent, int area, uint32_t item[4],
     item[1] = item[2] = item[3] = 0;
 
     /* Pick a number of unit slots */
-    rnd = mt19937_genrand_int32(rng) % 100;
+    rnd = rng_int32(rng) % 100;
 #ifdef DEBUG
     if(l->flags & LOBBY_FLAG_DBG_SDROPS)
         debug(DBG_LOG, "generate_armor_v3: RNG picked %" PRIu32 " for slots\n",
@@ -1087,24 +1243,24 @@ static int generate_armor_v3(pt_v3_entry_t *ent, int area, uint32_t item[4],
     /* Look up the item in the ItemPMT data so we can see what boosts we might
        apply... */
     if(!bb) {
-        if(pmt_lookup_guard_gc(item[0], &gcg)) {
+        if(!(guard = pmt_lookup_item_gc(item[0]))) {
             debug(DBG_WARN, "ItemPMT.prs file for GC seems to be missing an "
                   "armor type item (code %08x).\n", item[0]);
             return -2;
         }
 
-        dfp = gcg.dfp_range;
-        evp = gcg.evp_range;
+        dfp = guard->dfp_range;
+        evp = guard->evp_range;
     }
     else {
-        if(pmt_lookup_guard_bb(item[0], &bbg)) {
+        if(!(guard = pmt_lookup_item_bb(item[0]))) {
             debug(DBG_WARN, "ItemPMT.prs file for BB seems to be missing an "
                   "armor type item (code %08x).\n", item[0]);
             return -2;
         }
 
-        dfp = bbg.dfp_range;
-        evp = bbg.evp_range;
+        dfp = guard->dfp_range;
+        evp = guard->evp_range;
     }
 
 #ifdef DEBUG
@@ -1114,12 +1270,12 @@ static int generate_armor_v3(pt_v3_entry_t *ent, int area, uint32_t item[4],
 #endif
 
     if(dfp) {
-        rnd = mt19937_genrand_int32(rng) % (dfp + 1);
+        rnd = rng_int32(rng) % (dfp + 1);
         item_w[3] = (uint16_t)rnd;
     }
 
     if(evp) {
-        rnd = mt19937_genrand_int32(rng) % (evp + 1);
+        rnd = rng_int32(rng) % (evp + 1);
         item_w[4] = (uint16_t)rnd;
     }
 
@@ -1135,17 +1291,17 @@ static int generate_armor_v3(pt_v3_entry_t *ent, int area, uint32_t item[4],
 /* Generate a random shield, based on data for PSOv2. This is exactly the same
    as the armor version, but without unit slots. */
 static int generate_shield_v2(pt_v2_entry_t *ent, int area, uint32_t item[4],
-                              struct mt19937_state *rng, int picked,
+                              rng_stream_t *rng, int picked,
                               lobby_t *l) {
     uint32_t rnd;
     int i, armor = -1;
     uint16_t *item_w = (uint16_t *)item;
-    pmt_guard_v2_t guard;
+    const pmt_item_t *guard;
 
     if(!picked) {
         /* Go through each slot in the armor rankings to figure out which one
            that we'll be generating. */
-        rnd = mt19937_genrand_int32(rng) % 100;
+        rnd = rng_int32(rng) % 100;
 
 #ifdef DEBUG
         if(l->flags & LOBBY_FLAG_DBG_SDROPS)
@@ -1191,7 +1347,7 @@ static int generate_shield_v2(pt_v2_entry_t *ent, int area, uint32_t item[4],
 
     /* Look up the item in the ItemPMT data so we can see what boosts we might
        apply... */
-    if(pmt_lookup_guard_v2(item[0], &guard)) {
+    if(!(guard = pmt_lookup_item_v2(item[0]))) {
         debug(DBG_WARN, "ItemPMT.prs file for v2 seems to be missing a shield "
               "type item (code %08x).\n", item[0]);
         return -2;
@@ -1200,16 +1356,16 @@ static int generate_shield_v2(pt_v2_entry_t *ent, int area, uint32_t item[4],
 #ifdef DEBUG
     if(l->flags & LOBBY_FLAG_DBG_SDROPS)
         debug(DBG_LOG, "generate_shield_v2: DFP Range: %d, EVP Range: %d\n",
-              guard.dfp_range, guard.evp_range);
+              guard->dfp_range, guard->evp_range);
 #endif
 
-    if(guard.dfp_range) {
-        rnd = mt19937_genrand_int32(rng) % (guard.dfp_range + 1);
+    if(guard->dfp_range) {
+        rnd = rng_int32(rng) % (guard->dfp_range + 1);
         item_w[3] = (uint16_t)rnd;
     }
 
-    if(guard.evp_range) {
-        rnd = mt19937_genrand_int32(rng) % (guard.evp_range + 1);
+    if(guard->evp_range) {
+        rnd = rng_int32(rng) % (guard->evp_range + 1);
         item_w[4] = (uint16_t)rnd;
     }
 
@@ -1223,19 +1379,18 @@ static int generate_shield_v2(pt_v2_entry_t *ent, int area, uint32_t item[4],
 }
 
 static int generate_shield_v3(pt_v3_entry_t *ent, int area, uint32_t item[4],
-                              struct mt19937_state *rng, int picked, int bb,
+                              rng_stream_t *rng, int picked, int bb,
                               lobby_t *l) {
     uint32_t rnd;
     int i, armor = -1;
     uint16_t *item_w = (uint16_t *)item;
-    pmt_guard_gc_t gcg;
-    pmt_guard_bb_t bbg;
+    const pmt_item_t *guard;
     uint8_t dfp, evp;
 
     if(!picked) {
         /* Go through each slot in the armor rankings to figure out which one
            that we'll be generating. */
-        rnd = mt19937_genrand_int32(rng) % 100;
+        rnd = rng_int32(rng) % 100;
 
 #ifdef DEBUG
         if(l->flags & LOBBY_FLAG_DBG_SDROPS)
@@ -1283,24 +1438,24 @@ static int generate_shield_v3(pt_v3_entry_t *ent, int area, uint32_t item[4],
     /* Look up the item in the ItemPMT data so we can see what boosts we might
        apply... */
     if(!bb) {
-        if(pmt_lookup_guard_gc(item[0], &gcg)) {
+        if(!(guard = pmt_lookup_item_gc(item[0]))) {
             debug(DBG_WARN, "ItemPMT.prs file for GC seems to be missing a "
                   "shield type item (code %08x).\n", item[0]);
             return -2;
         }
 
-        dfp = gcg.dfp_range;
-        evp = gcg.evp_range;
+        dfp = guard->dfp_range;
+        evp = guard->evp_range;
     }
     else {
-        if(pmt_lookup_guard_bb(item[0], &bbg)) {
+        if(!(guard = pmt_lookup_item_bb(item[0]))) {
             debug(DBG_WARN, "ItemPMT.prs file for BB seems to be missing a "
                   "shield type item (code %08x).\n", item[0]);
             return -2;
         }
 
-        dfp = bbg.dfp_range;
-        evp = bbg.evp_range;
+        dfp = guard->dfp_range;
+        evp = guard->evp_range;
     }
 
 #ifdef DEBUG
@@ -1310,12 +1465,12 @@ static int generate_shield_v3(pt_v3_entry_t *ent, int area, uint32_t item[4],
 #endif
 
     if(dfp) {
-        rnd = mt19937_genrand_int32(rng) % (dfp + 1);
+        rnd = rng_int32(rng) % (dfp + 1);
         item_w[3] = (uint16_t)rnd;
     }
 
     if(evp) {
-        rnd = mt19937_genrand_int32(rng) % (evp + 1);
+        rnd = rng_int32(rng) % (evp + 1);
         item_w[4] = (uint16_t)rnd;
     }
 
@@ -1328,9 +1483,9 @@ static int generate_shield_v3(pt_v3_entry_t *ent, int area, uint32_t item[4],
     return 0;
 }
 
-static uint32_t generate_tool_base(uint16_t freqs[28][10], int area,
-                                   struct mt19937_state *rng, lobby_t *l) {
-    uint32_t rnd = mt19937_genrand_int32(rng) % 10000;
+static uint32_t generate_tool_base(const uint32_t cum[28],
+                                   rng_stream_t *rng, lobby_t *l) {
+    uint32_t rnd = rng_int32(rng) % 10000;
     int i;
 
 #ifdef DEBUG
@@ -1339,21 +1494,14 @@ static uint32_t generate_tool_base(uint16_t freqs[28][10], int area,
     }
 #endif
 
-    for(i = 0; i < 28; ++i) {
+    if((i = cum_pick(cum, 28, rnd)) < 28) {
 #ifdef DEBUG
         if(l->flags & LOBBY_FLAG_DBG_SDROPS)
-            debug(DBG_LOG, "    index: %d, code %08" PRIx32 " chance: %" PRIu16
-                  " left: %" PRIu32 "\n", i, tool_base[i], LE16(freqs[i][area]),
-                  rnd);
-#endif
-        if((rnd -= LE16(freqs[i][area])) > 10000) {
-#ifdef DEBUG
-            if(l->flags & LOBBY_FLAG_DBG_SDROPS)
-                debug(DBG_LOG, "    Generating item.\n");
+            debug(DBG_LOG, "    Generating item index: %d, code %08" PRIx32
+                  "\n", i, tool_base[i]);
 #endif
 
-            return tool_base[i];
-        }
+        return tool_base[i];
     }
 
 #ifdef DEBUG
@@ -1365,14 +1513,14 @@ static uint32_t generate_tool_base(uint16_t freqs[28][10], int area,
 }
 
 /* XXXX: There's something afoot here generating invalid techs. */
-static int generate_tech(uint8_t freqs[19][10], int8_t levels[19][20],
+static int generate_tech(const uint32_t cum[19], int8_t levels[19][20],
                          int area, uint32_t item[4],
-                         struct mt19937_state *rng, lobby_t *l) {
+                         rng_stream_t *rng, lobby_t *l) {
     uint32_t rnd, tech, level;
     int8_t t1, t2;
     int i;
 
-    rnd = mt19937_genrand_int32(rng);
+    rnd = rng_int32(rng);
     tech = rnd % 1000;
 
 #ifdef DEBUG
@@ -1383,57 +1531,49 @@ static int generate_tech(uint8_t freqs[19][10], int8_t levels[19][20],
 
     rnd /= 1000;
 
-    for(i = 0; i < 19; ++i) {
+    if((i = cum_pick(cum, 19, tech)) < 19) {
 #ifdef DEBUG
         if(l->flags & LOBBY_FLAG_DBG_SDROPS)
-            debug(DBG_LOG, "    index: %d, chance: %" PRIu8 " left: %" PRIu32
-                  "\n", i, freqs[i][area], tech);
+            debug(DBG_LOG, "    Generating tech index: %d\n", i);
 #endif
 
-        if((tech -= freqs[i][area]) > 1000) {
-#ifdef DEBUG
-            if(l->flags & LOBBY_FLAG_DBG_SDROPS)
-                debug(DBG_LOG, "    Generating tech.\n");
-#endif
-
-            t1 = levels[i][area << 1];
-            t2 = levels[i][(area << 1) + 1];
+        t1 = levels[i][area << 1];
+        t2 = levels[i][(area << 1) + 1];
 
 #ifdef DEBUG
-            if(l->flags & LOBBY_FLAG_DBG_SDROPS)
-                debug(DBG_LOG, "    Min: %" PRId8 " Max: " PRId8 "\n", t1, t2);
+        if(l->flags & LOBBY_FLAG_DBG_SDROPS)
+            debug(DBG_LOG, "    Min: %" PRId8 " Max: " PRId8 "\n", t1, t2);
 #endif
 
-            /* Make sure that the minimum level isn't -1 and that the minimum is
-               actually less than the maximum. */
-            if(t1 == -1 || t1 > t2) {
-                debug(DBG_WARN, "Invalid tech level set for area %d, tech %d\n",
-                      area, i);
-                return -1;
-            }
+        /* Make sure that the minimum level isn't -1 and that the minimum is
+           actually less than the maximum. */
+        if(t1 == -1 || t1 > t2) {
+            debug(DBG_WARN, "Invalid tech level set for area %d, tech %d\n",
+                  area, i);
+            return -1;
+        }
 
-            /* Cap the levels from the ItemPT data, since Sega's files sometimes
-               have stupid values here. */
-            if(t1 >= 30)
-                t1 = 29;
+        /* Cap the levels from the ItemPT data, since Sega's files sometimes
+           have stupid values here. */
+        if(t1 >= 30)
+            t1 = 29;
 
-            if(t2 >= 30)
-                t2 = 29;
+        if(t2 >= 30)
+            t2 = 29;
 
-            if(t1 < t2)
-                level = (rnd % ((t2 + 1) - t1)) + t1;
-            else
-                level = t1;
+        if(t1 < t2)
+            level = (rnd % ((t2 + 1) - t1)) + t1;
+        else
+            level = t1;
 
 #ifdef DEBUG
-            if(l->flags & LOBBY_FLAG_DBG_SDROPS)
-                debug(DBG_LOG, "    Level selected: %" PRIu32 "\n", level);
+        if(l->flags & LOBBY_FLAG_DBG_SDROPS)
+            debug(DBG_LOG, "    Level selected: %" PRIu32 "\n", level);
 #endif
 
-            item[1] = i;
-            item[0] |= (level << 16);
-            return 0;
-        }
+        item[1] = i;
+        item[0] |= (level << 16);
+        return 0;
     }
 
     /* Shouldn't get here... */
@@ -1442,8 +1582,8 @@ static int generate_tech(uint8_t freqs[19][10], int8_t levels[19][20],
 }
 
 static int generate_tool_v2(pt_v2_entry_t *ent, int area, uint32_t item[4],
-                            struct mt19937_state *rng, lobby_t *l) {
-    item[0] = generate_tool_base(ent->tool_frequency, area, rng, l);
+                            rng_stream_t *rng, lobby_t *l) {
+    item[0] = generate_tool_base(ent->tables.tools[area], rng, l);
 
     /* Neither of these should happen, but just in case... */
     if(item[0] == Item_Photon_Drop || item[0] == Item_NoSuchItem) {
@@ -1471,7 +1611,7 @@ static int generate_tool_v2(pt_v2_entry_t *ent, int area, uint32_t item[4],
             debug(DBG_LOG, "Item is technique disk. Picking technique.\n");
 #endif
 
-        if(generate_tech(ent->tech_frequency, ent->tech_levels, area,
+        if(generate_tech(ent->tables.techs[area], ent->tech_levels, area,
                          item, rng, l)) {
             debug(DBG_WARN, "Generated invalid technique! Please check "
                   "your ItemPT.afs file for validity!\n");
@@ -1483,8 +1623,8 @@ static int generate_tool_v2(pt_v2_entry_t *ent, int area, uint32_t item[4],
 }
 
 static int generate_tool_v3(pt_v3_entry_t *ent, int area, uint32_t item[4],
-                            struct mt19937_state *rng, lobby_t *l) {
-    item[0] = generate_tool_base(ent->tool_frequency, area, rng, l);
+                            rng_stream_t *rng, lobby_t *l) {
+    item[0] = generate_tool_base(ent->tables.tools[area], rng, l);
 
     /* This shouldn't happen happen, but just in case... */
     if(item[0] == Item_NoSuchItem) {
@@ -1512,7 +1652,7 @@ static int generate_tool_v3(pt_v3_entry_t *ent, int area, uint32_t item[4],
             debug(DBG_LOG, "Item is technique disk. Picking technique.\n");
 #endif
 
-        if(generate_tech(ent->tech_frequency, ent->tech_levels, area,
+        if(generate_tech(ent->tables.techs[area], ent->tech_levels, area,
                          item, rng, l)) {
             debug(DBG_WARN, "Generated invalid technique! Please check "
                   "your ItemPT.gsl file for validity!\n");
@@ -1524,11 +1664,11 @@ static int generate_tool_v3(pt_v3_entry_t *ent, int area, uint32_t item[4],
 }
 
 static int generate_meseta(int min, int max, uint32_t item[4],
-                           struct mt19937_state *rng, lobby_t *l) {
+                           rng_stream_t *rng, lobby_t *l) {
     uint32_t rnd;
 
     if(min < max)
-        rnd = (mt19937_genrand_int32(rng) % ((max + 1) - min)) + min;
+        rnd = (rng_int32(rng) % ((max + 1) - min)) + min;
     else
         rnd = min;
 
@@ -1591,7 +1731,7 @@ static int check_and_send(ship_client_t *c, lobby_t *l, uint32_t item[4],
         iitem.data_l[2] = LE32(item[2]);
         iitem.data2_l = LE32(item[3]);
 
-        if(!sylverant_limits_check_item(l->limits_list, &iitem, v)) {
+        if(!legit_check_item(l->limits_list, &iitem, v)) {
             section = l->clients[l->leader_id]->pl->v1.section;
             debug(DBG_LOG, "Potentially non-legit dropped by server:\n"
                   "%08x %08x %08x %08x\n"
@@ -1672,9 +1812,10 @@ int pt_generate_v2_drop(ship_client_t *c, lobby_t *l, void *r) {
     uint32_t rnd;
     uint32_t item[4];
     int area, rarea, do_rare = 1;
-    struct mt19937_state *rng = &c->cur_block->rng;
+    rng_stream_t *rng = &l->rng;
     uint16_t mid;
-    game_enemy_t *enemy;
+    game_enemy_t enbuf;
+    const game_enemy_t *enemy;
     int csr = 0;
     uint32_t qdrop = 0xFFFFFFFF;
 
@@ -1688,10 +1829,10 @@ int pt_generate_v2_drop(ship_client_t *c, lobby_t *l, void *r) {
 
 #ifdef DEBUG
     if(l->flags & LOBBY_FLAG_DBG_SDROPS)
-        ent = &v2_ptdata[l->sdrops_diff][l->sdrops_section];
+        ent = &l->pt_gen->v2[l->sdrops_diff][l->sdrops_section];
     else
 #endif
-    ent = &v2_ptdata[l->difficulty][section];
+    ent = &l->pt_gen->v2[l->difficulty][section];
 
     /* Figure out the area we'll be worried with */
     rarea = area = c->cur_area;
@@ -1725,7 +1866,7 @@ int pt_generate_v2_drop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Make sure the enemy's id is sane... */
     mid = LE16(req->req);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
 #ifdef DEBUG
         debug(DBG_WARN, "Guildcard %" PRIu32 " requested v2 drop for invalid "
               "enemy (%d -- max: %d, quest=%" PRIu32 ")!\n", c->guildcard,
@@ -1739,7 +1880,7 @@ int pt_generate_v2_drop(ship_client_t *c, lobby_t *l, void *r) {
     }
 
     /* Grab the map enemy to make sure it hasn't already dropped something. */
-    enemy = &l->map_enemies->enemies[mid];
+    enemy = map_get_enemy(l->map_enemies, mid, &enbuf);
 
     LOG(l, "Guildcard %" PRIu32 " requested v2 drop...\n"
         "mid: %d (max: %d), pt: %d (%d), area: %d (%d), quest: %" PRIu32
@@ -1747,15 +1888,15 @@ int pt_generate_v2_drop(ship_client_t *c, lobby_t *l, void *r) {
         c->guildcard, mid, l->map_enemies->count, req->pt_index,
         enemy->rt_index, area + 1, rarea, l->qid, section, l->difficulty);
 
-    if(enemy->drop_done) {
+    if(l->map_enemies->state[mid].drop_done) {
         LOGV(l, "Drop already done.\n");
         return 0;
     }
 
-    enemy->drop_done = 1;
+    l->map_enemies->state[mid].drop_done = 1;
 
     /* See if the enemy is going to drop anything at all this time... */
-    rnd = mt19937_genrand_int32(rng) % 100;
+    rnd = rng_int32(rng) % 100;
 
     if(rnd >= ent->enemy_dar[req->pt_index]) {
         /* Nope. You get nothing! */
@@ -1874,7 +2015,7 @@ int pt_generate_v2_drop(ship_client_t *c, lobby_t *l, void *r) {
     }
 
     /* Figure out what type to drop... */
-    rnd = mt19937_genrand_int32(rng) % 3;
+    rnd = rng_int32(rng) % 3;
     switch(rnd) {
         case 0:
             /* Drop the enemy's designated type of item. */
@@ -1962,13 +2103,13 @@ int pt_generate_v2_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     int section = l->clients[l->leader_id]->pl->v1.section;
     pt_v2_entry_t *ent;
     uint16_t obj_id;
-    game_object_t *gobj;
-    map_object_t *obj;
+    const game_object_t *gobj;
+    const map_object_t *obj;
     uint32_t rnd, t1, t2;
     int area, do_rare = 1;
     uint32_t item[4];
     float f1, f2;
-    struct mt19937_state *rng = &c->cur_block->rng;
+    rng_stream_t *rng = &l->rng;
     int csr = 0;
     uint32_t qdrop = 0xFFFFFFFF;
 
@@ -1978,22 +2119,22 @@ int pt_generate_v2_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
 
 #ifdef DEBUG
     if(l->flags & LOBBY_FLAG_DBG_SDROPS)
-        ent = &v2_ptdata[l->sdrops_diff][l->sdrops_section];
+        ent = &l->pt_gen->v2[l->sdrops_diff][l->sdrops_section];
     else
 #endif
-    ent = &v2_ptdata[l->difficulty][section];
+    ent = &l->pt_gen->v2[l->difficulty][section];
 
     /* Grab the object ID and make sure its sane, then grab the object itself */
     obj_id = LE16(req->req);
-    if(obj_id > l->map_objs->count) {
+    if(obj_id >= l->map_objs->count) {
         debug(DBG_WARN, "Guildard %u requested drop from invalid box\n",
               c->guildcard);
         return -1;
     }
 
     /* Don't bother if the box has already been opened */
-    gobj = &l->map_objs->objs[obj_id];
-    if(gobj->flags & 0x00000001)
+    gobj = map_get_object(l->map_objs, obj_id);
+    if(l->map_objs->state[obj_id] & GAME_OBJ_DROP_DONE)
         return 0;
 
     obj = &gobj->data;
@@ -2027,7 +2168,7 @@ int pt_generate_v2_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     --area;
 
     /* Mark the box as spent now... */
-    gobj->flags |= 0x00000001;
+    l->map_objs->state[obj_id] |= GAME_OBJ_DROP_DONE;
 
     /* See if we'll do a rare roll. */
     if(l->qid) {
@@ -2181,7 +2322,7 @@ int pt_generate_v2_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     }
 
     /* Generate an item, according to the PT data */
-    rnd = mt19937_genrand_int32(rng) % 100;
+    rnd = rng_int32(rng) % 100;
 
     if((rnd -= ent->box_drop[BOX_TYPE_WEAPON][area]) > 100) {
 generate_weapon:
@@ -2245,9 +2386,8 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
     uint32_t rnd;
     uint32_t item[4];
     int area, darea, do_rare = 1;
-    struct mt19937_state *rng = &c->cur_block->rng;
+    rng_stream_t *rng = &l->rng;
     uint16_t mid;
-    game_enemy_t *enemy;
     int csr = 0;
 
     /* Make sure the PT index in the packet is sane */
@@ -2260,10 +2400,11 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
 
 #ifdef DEBUG
     if(l->flags & LOBBY_FLAG_DBG_SDROPS)
-        ent = &gc_ptdata[l->sdrops_ep - 1][l->sdrops_diff][l->sdrops_section];
+        ent = &l->pt_gen->gc[l->sdrops_ep - 1][l->sdrops_diff]
+                            [l->sdrops_section];
     else
 #endif
-    ent = &gc_ptdata[l->episode - 1][l->difficulty][section];
+    ent = &l->pt_gen->gc[l->episode - 1][l->difficulty][section];
 
     /* Figure out the area we'll be worried with */
     area = darea = c->cur_area;
@@ -2348,7 +2489,7 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
     /* We only really need this separate for debugging... */
     area = darea;
 
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
 #ifdef DEBUG
         debug(DBG_WARN, "Guildcard %" PRIu32 " requested GC drop for invalid "
               "enemy (%d -- max: %d, quest=%" PRIu32 ")!\n", c->guildcard, mid,
@@ -2356,17 +2497,16 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
 #endif
 
         if(l->logfp) {
-            fdebug(l->logfp, DBG_WARN, "Guildcard %" PRIu32 " requested GC "
-                   "drop for invalid enemy (%d -- max: %d, quest=%" PRIu32
-                   ")!\n", c->guildcard, mid, l->map_enemies->count, l->qid);
+            LOG(l, "Guildcard %" PRIu32 " requested GC "
+                "drop for invalid enemy (%d -- max: %d, quest=%" PRIu32
+                ")!\n", c->guildcard, mid, l->map_enemies->count, l->qid);
         }
 
         return -1;
     }
 
-    /* Grab the map enemy to make sure it hasn't already dropped something. */
-    enemy = &l->map_enemies->enemies[mid];
-    if(enemy->drop_done) {
+    /* Make sure the enemy hasn't already dropped something. */
+    if(l->map_enemies->state[mid].drop_done) {
 #ifdef DEBUG
         if(l->flags & LOBBY_FLAG_DBG_SDROPS)
             debug(DBG_LOG, "Drop already done. Returning no item.\n");
@@ -2374,10 +2514,10 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
         return 0;
     }
 
-    enemy->drop_done = 1;
+    l->map_enemies->state[mid].drop_done = 1;
 
     /* See if the enemy is going to drop anything at all this time... */
-    rnd = mt19937_genrand_int32(rng) % 100;
+    rnd = rng_int32(rng) % 100;
 
 #ifdef DEBUG
     if(l->flags & LOBBY_FLAG_DBG_SDROPS)
@@ -2445,8 +2585,8 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
 #endif
 
                         if(l->logfp) {
-                            fdebug(l->logfp, DBG_WARN, "GC ItemRT generated an "
-                                   "invalid item: %08x\n", item[0]);
+                            LOG(l, "GC ItemRT generated an "
+                                "invalid item: %08x\n", item[0]);
                         }
 
                         return 0;
@@ -2476,8 +2616,8 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
 #endif
 
                 if(l->logfp) {
-                    fdebug(l->logfp, DBG_WARN, "GC ItemRT generated an invalid "
-                           "item: %08x\n", item[0]);
+                    LOG(l, "GC ItemRT generated an invalid "
+                        "item: %08x\n", item[0]);
                 }
 
                 return 0;
@@ -2487,7 +2627,7 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
     }
 
     /* Figure out what type to drop... */
-    rnd = mt19937_genrand_int32(rng) % 3;
+    rnd = rng_int32(rng) % 3;
 
 #ifdef DEBUG
     if(l->flags & LOBBY_FLAG_DBG_SDROPS) {
@@ -2556,9 +2696,9 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
 #endif
 
                     if(l->logfp) {
-                        fdebug(l->logfp, DBG_WARN, "Unknown/Invalid GC enemy "
-                              "drop (%d) for index %d\n",
-                              ent->enemy_drop[req->pt_index], req->pt_index);
+                        LOG(l, "Unknown/Invalid GC enemy "
+                           "drop (%d) for index %d\n",
+                           ent->enemy_drop[req->pt_index], req->pt_index);
                     }
 
                     return 0;
@@ -2594,13 +2734,13 @@ int pt_generate_gc_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     int section = l->clients[l->leader_id]->pl->v1.section;
     pt_v3_entry_t *ent;
     uint16_t obj_id;
-    game_object_t *gobj;
-    map_object_t *obj;
+    const game_object_t *gobj;
+    const map_object_t *obj;
     uint32_t rnd, t1, t2;
     int area, darea, do_rare = 1;
     uint32_t item[4];
     float f1, f2;
-    struct mt19937_state *rng = &c->cur_block->rng;
+    rng_stream_t *rng = &l->rng;
     int csr = 0;
 
     /* Make sure this is actually a box drop... */
@@ -2609,22 +2749,23 @@ int pt_generate_gc_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
 
 #ifdef DEBUG
     if(l->flags & LOBBY_FLAG_DBG_SDROPS)
-        ent = &gc_ptdata[l->sdrops_ep - 1][l->sdrops_diff][l->sdrops_section];
+        ent = &l->pt_gen->gc[l->sdrops_ep - 1][l->sdrops_diff]
+                            [l->sdrops_section];
     else
 #endif
-    ent = &gc_ptdata[l->episode - 1][l->difficulty][section];
+    ent = &l->pt_gen->gc[l->episode - 1][l->difficulty][section];
 
     /* Grab the object ID and make sure its sane, then grab the object itself */
     obj_id = LE16(req->req);
-    if(obj_id > l->map_objs->count) {
+    if(obj_id >= l->map_objs->count) {
         debug(DBG_WARN, "Guildard %u requested drop from invalid box\n",
               c->guildcard);
         return -1;
     }
 
     /* Don't bother if the box has already been opened */
-    gobj = &l->map_objs->objs[obj_id];
-    if(gobj->flags & 0x00000001) {
+    gobj = map_get_object(l->map_objs, obj_id);
+    if(l->map_objs->state[obj_id] & GAME_OBJ_DROP_DONE) {
 #ifdef DEBUG
         if(l->flags & LOBBY_FLAG_DBG_SDROPS)
             debug(DBG_LOG, "Requested drop from opened box: %d\n", obj_id);
@@ -2694,7 +2835,7 @@ int pt_generate_gc_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     --darea;
 
     /* Mark the box as spent now... */
-    gobj->flags |= 0x00000001;
+    l->map_objs->state[obj_id] |= GAME_OBJ_DROP_DONE;
 
 #ifdef DEBUG
     if(l->flags & LOBBY_FLAG_DBG_SDROPS) {
@@ -2831,8 +2972,8 @@ int pt_generate_gc_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
 #endif
 
                         if(l->logfp) {
-                            fdebug(l->logfp, DBG_WARN, "GC ItemRT generated an "
-                                   "invalid item: %08x\n", item[0]);
+                            LOG(l, "GC ItemRT generated an "
+                                "invalid item: %08x\n", item[0]);
                         }
 
                         return 0;
@@ -2863,8 +3004,8 @@ int pt_generate_gc_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
 #endif
 
                 if(l->logfp) {
-                    fdebug(l->logfp, DBG_WARN, "GC ItemRT generated an invalid "
-                           "item: %08x\n", item[0]);
+                    LOG(l, "GC ItemRT generated an invalid "
+                        "item: %08x\n", item[0]);
                 }
 
                 return 0;
@@ -2875,7 +3016,7 @@ int pt_generate_gc_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     }
 
     /* Generate an item, according to the PT data */
-    rnd = mt19937_genrand_int32(rng) % 100;
+    rnd = rng_int32(rng) % 100;
 
 #ifdef DEBUG
     if(l->flags & LOBBY_FLAG_DBG_SDROPS)
@@ -2947,16 +3088,15 @@ int pt_generate_bb_drop(ship_client_t *c, lobby_t *l, void *r) {
     uint32_t rnd;
     uint32_t item[4];
     int area, do_rare = 1;
-    struct mt19937_state *rng = &c->cur_block->rng;
+    rng_stream_t *rng = &l->rng;
     uint16_t mid;
-    game_enemy_t *enemy;
     int csr = 0;
 
     /* XXXX: Handle Episode 4 */
     if(l->episode == 3)
         return 0;
 
-    ent = &bb_ptdata[l->episode - 1][l->difficulty][section];
+    ent = &l->pt_gen->bb[l->episode - 1][l->difficulty][section];
 
     /* Make sure the PT index in the packet is sane */
     //if(req->pt_index > 0x33)
@@ -3025,22 +3165,21 @@ int pt_generate_bb_drop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Make sure the enemy's id is sane... */
     mid = LE16(req->req);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " requested drop for invalid "
               "enemy (%d -- max: %d, quest=%" PRIu32 ")!\n", c->guildcard, mid,
               l->map_enemies->count, l->qid);
         return -1;
     }
 
-    /* Grab the map enemy to make sure it hasn't already dropped something. */
-    enemy = &l->map_enemies->enemies[mid];
-    if(enemy->drop_done)
+    /* Make sure the enemy hasn't already dropped something. */
+    if(l->map_enemies->state[mid].drop_done)
         return 0;
 
-    enemy->drop_done = 1;
+    l->map_enemies->state[mid].drop_done = 1;
 
     /* See if the enemy is going to drop anything at all this time... */
-    rnd = mt19937_genrand_int32(rng) % 100;
+    rnd = rng_int32(rng) % 100;
 
     if(rnd >= ent->enemy_dar[req->pt_index])
         /* Nope. You get nothing! */
@@ -3116,7 +3255,7 @@ int pt_generate_bb_drop(ship_client_t *c, lobby_t *l, void *r) {
     }
 
     /* Figure out what type to drop... */
-    rnd = mt19937_genrand_int32(rng) % 3;
+    rnd = rng_int32(rng) % 3;
     switch(rnd) {
         case 0:
             /* Drop the enemy's designated type of item. */
@@ -3196,20 +3335,20 @@ int pt_generate_bb_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     int section = l->clients[l->leader_id]->pl->bb.character.section;
     pt_v3_entry_t *ent;
     uint16_t obj_id;
-    game_object_t *gobj;
-    map_object_t *obj;
+    const game_object_t *gobj;
+    const map_object_t *obj;
     uint32_t rnd, t1, t2;
     int area, do_rare = 1;
     uint32_t item[4];
     float f1, f2;
-    struct mt19937_state *rng = &c->cur_block->rng;
+    rng_stream_t *rng = &l->rng;
     int csr = 0;
 
     /* XXXX: Handle Episode 4 */
     if(l->episode == 3)
         return 0;
 
-    ent = &bb_ptdata[l->episode][l->difficulty][section];
+    ent = &l->pt_gen->bb[l->episode][l->difficulty][section];
 
     /* Make sure this is actually a box drop... */
     if(req->pt_index != 0x30)
@@ -3217,15 +3356,15 @@ int pt_generate_bb_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Grab the object ID and make sure its sane, then grab the object itself */
     obj_id = LE16(req->req);
-    if(obj_id > l->map_objs->count) {
+    if(obj_id >= l->map_objs->count) {
         debug(DBG_WARN, "Guildard %u requested drop from invalid box\n",
               c->guildcard);
         return -1;
     }
 
     /* Don't bother if the box has already been opened */
-    gobj = &l->map_objs->objs[obj_id];
-    if(gobj->flags & 0x00000001)
+    gobj = map_get_object(l->map_objs, obj_id);
+    if(l->map_objs->state[obj_id] & GAME_OBJ_DROP_DONE)
         return 0;
 
     obj = &gobj->data;
@@ -3289,7 +3428,7 @@ int pt_generate_bb_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     --area;
 
     /* Mark the box as spent now... */
-    gobj->flags |= 0x00000001;
+    l->map_objs->state[obj_id] |= GAME_OBJ_DROP_DONE;
 
     /* See if we'll do a rare roll. */
     if(l->qid) {
@@ -3411,7 +3550,7 @@ int pt_generate_bb_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     }
 
     /* Generate an item, according to the PT data */
-    rnd = mt19937_genrand_int32(rng) % 100;
+    rnd = rng_int32(rng) % 100;
 
     if((rnd -= ent->box_drop[BOX_TYPE_WEAPON][area]) > 100) {
 generate_weapon:
@@ -21,6 +21,7 @@
 #include <stdint.h>
 
 #include "lobby.h"
+#include "snapshot.h"
 
 #ifdef PACKED
 #undef PACKED
@@ -34,6 +35,28 @@
 #define BOX_TYPE_MESETA     5
 #define BOX_TYPE_NOTHING    6
 
+/* The weapon types that can drop on one floor, worked out ahead of time from
+   the weapon ratio, minimum rank and upgrade floor data. */
+typedef struct pt_weapon_table {
+    int count;                              /* Types that can drop */
+    int bad_type;                           /* Type with a bad upgrade floor */
+    uint8_t types[12];
+    uint8_t ranks[12];
+    uint8_t patterns[12];                   /* Grind pattern to use */
+    uint32_t cum[12];                       /* Running total of the ratios */
+} pt_weapon_table_t;
+
+/* Running totals of the probability tables that get walked through on most
+   drops, built when the ItemPT file is read. Picking from one of these is a
+   binary search rather than subtracting each entry in turn, but picks exactly
+   the same thing for any given random number. */
+typedef struct pt_tables {
+    pt_weapon_table_t weapons[10];          /* By floor */
+    uint32_t tools[10][28];
+    uint32_t techs[10][19];
+    uint32_t percents[6][23];               /* By percent pattern */
+} pt_tables_t;
+
 /* Clean (non-packed) version of the v3 ItemPT entry structure. */
 typedef struct pt_v3_entry {
     int8_t weapon_ratio[12];                /* 0x0000 */
@@ -57,6 +80,7 @@ typedef struct pt_v3_entry {
     uint16_t box_meseta[10][2];             /* 0x08A0 */
     uint8_t box_drop[7][10];                /* 0x08C8 */
     int32_t armor_level;                    /* 0x0958 */
+    pt_tables_t tables;                     /* Not in the file */
 } pt_v3_entry_t;
 
 /* Clean (non-packed) version of the v2 ItemPT entry structure. */
@@ -82,6 +106,7 @@ typedef struct pt_v2_entry {
     uint16_t box_meseta[10][2];             /* 0x0800 */
     uint8_t box_drop[7][10];                /* 0x0828 */
     int32_t armor_level;                    /* 0x08B8 */
+    pt_tables_t tables;                     /* Not in the file */
 } pt_v2_entry_t;
 
 /* Read the ItemPT data from a v2-style (ItemPT.afs) file. */
@@ -90,6 +115,20 @@ int pt_read_v2(const char *fn);
 /* Read the ItemPT data from a v3-style (ItemPT.gsl) file. */
 int pt_read_v3(const char *fn, int bb);
 
+/* Read in a whole new set of ItemPT data and make it the current one. Games
+   that already exist keep using the data they started with. Any of the
+   filenames may be NULL to leave that version without any data. */
+int pt_refresh(const char *v2fn, const char *gcfn, const char *bbfn);
+
+/* Grab or release a reference to the current ItemPT data. */
+struct pt_gen *pt_gen_ref(void);
+void pt_gen_unref(struct pt_gen *g);
+
+/* Write out or load the ItemPT data in a snapshot (see snapshot.h). With load
+   set to 0, the section is only checked over. */
+int pt_snapshot_write(snapshot_writer_t *w);
+int pt_snapshot_read(const snapshot_t *s, int load);
+
 /* Did we read in a v2 ItemPT? */
 int pt_v2_enabled(void);
 
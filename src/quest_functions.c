@@ -556,8 +556,7 @@ static uint32_t get_random_integer(ship_client_t *c, lobby_t *l) {
 
     max -= min;
 
-    rnd = (uint32_t)(mt19937_genrand_int32(&l->block->rng) %
-                     ((uint64_t)max + 1) + min);
+    rnd = (uint32_t)(rng_int32(&l->rng) % ((uint64_t)max + 1) + min);
 
     send_sync_register(c, c->q_stack[5], rnd);
     return QUEST_FUNC_RET_NO_ERROR;
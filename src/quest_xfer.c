@@ -0,0 +1,277 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <sylverant/debug.h>
+
+#include "quest_xfer.h"
+#include "clients.h"
+#include "block.h"
+#include "ship.h"
+#include "packets.h"
+#include "ship_packets.h"
+
+static void xfer_free(quest_xfer_t *x) {
+    if(x->tmp[0])
+        quest_file_free(x->tmp[0]);
+
+    if(x->tmp[1])
+        quest_file_free(x->tmp[1]);
+
+    if(x->cache)
+        quest_files_unref(x->cache);
+
+    free(x);
+}
+
+/* Find the next piece of the quest to send. For .bin/.dat quests, that's the
+   next chunk packet, alternating between the files (dat first). For .qst
+   quests, the file is already made up of packets, so just take it a chunk's
+   worth at a time. */
+static int xfer_next(quest_xfer_t *x, const uint8_t **p, uint32_t *len) {
+    const quest_file_t *f;
+    uint32_t i;
+
+    if(x->qst) {
+        if(x->pos >= x->qst->len) {
+            x->done = 1;
+            return 0;
+        }
+
+        *p = x->qst->data + x->pos;
+        *len = x->qst->len - x->pos;
+
+        if(*len > DC_QUEST_CHUNK_LENGTH)
+            *len = DC_QUEST_CHUNK_LENGTH;
+
+        x->pos += *len;
+        return 1;
+    }
+
+    while(x->pos < x->count) {
+        i = x->pos;
+
+        if(x->half) {
+            f = x->bin;
+            x->half = 0;
+            ++x->pos;
+        }
+        else {
+            f = x->dat;
+            x->half = 1;
+        }
+
+        if(i < f->chunk_count) {
+            *p = f->chunks + i * DC_QUEST_CHUNK_LENGTH;
+            *len = DC_QUEST_CHUNK_LENGTH;
+            return 1;
+        }
+    }
+
+    x->done = 1;
+    return 0;
+}
+
+/* This must be called with the transfer's lock held. */
+static int xfer_pump(ship_client_t *c) {
+    quest_xfer_t *x = c->qxfer;
+    uint8_t *sendbuf = get_sendbuf();
+    dc_quest_chunk_pkt *chunk;
+    const uint8_t *p;
+    uint32_t plen;
+    uint8_t flags;
+    int len;
+
+    if(!x)
+        return 0;
+
+    if(!sendbuf)
+        return -1;
+
+    /* Only hand the client more once the socket has taken everything we gave
+       it before, so nothing ever piles up in the send queue. */
+    while(!x->done && sendq_empty(&c->sendq)) {
+        len = 0;
+
+        while(len + DC_QUEST_CHUNK_LENGTH <= 65536 &&
+              (x->no_acks || x->sent - x->acked < QUEST_XFER_WINDOW) &&
+              xfer_next(x, &p, &plen)) {
+            memcpy(sendbuf + len, p, plen);
+
+            /* The chunks are cached with the DC header on them, but PC wants
+               its own header layout. */
+            if(!x->qst && c->version == CLIENT_VERSION_PC) {
+                chunk = (dc_quest_chunk_pkt *)(sendbuf + len);
+                flags = chunk->hdr.dc.flags;
+                chunk->hdr.pc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
+                chunk->hdr.pc.pkt_type = QUEST_CHUNK_TYPE;
+                chunk->hdr.pc.flags = flags;
+            }
+
+            len += plen;
+            ++x->sent;
+        }
+
+        if(!len)
+            break;
+
+        if(crypt_send(c, len, sendbuf))
+            return -1;
+    }
+
+    /* The timer will notice that the transfer is gone on its own. */
+    if(x->done) {
+        c->qxfer = NULL;
+        xfer_free(x);
+    }
+
+    return 0;
+}
+
+int quest_xfer_start(ship_client_t *c, const quest_file_t *bin,
+                     const quest_file_t *dat, const quest_file_t *qst,
+                     quest_file_t *tmp[2]) {
+    quest_xfer_t *x;
+    int rv;
+
+    if(!(x = (quest_xfer_t *)malloc(sizeof(quest_xfer_t)))) {
+        debug(DBG_WARN, "Cannot allocate quest transfer: %s\n",
+              strerror(errno));
+
+        if(tmp[0])
+            quest_file_free(tmp[0]);
+
+        if(tmp[1])
+            quest_file_free(tmp[1]);
+
+        return -1;
+    }
+
+    memset(x, 0, sizeof(quest_xfer_t));
+    x->bin = bin;
+    x->dat = dat;
+    x->qst = qst;
+    x->tmp[0] = tmp[0];
+    x->tmp[1] = tmp[1];
+
+    if(!qst)
+        x->count = bin->chunk_count > dat->chunk_count ? bin->chunk_count :
+            dat->chunk_count;
+
+    /* Hold onto the cache, in case the quests get reloaded while we're still
+       sending this one. */
+    if((x->cache = ship->qfiles))
+        quest_files_ref(x->cache);
+
+    pthread_mutex_lock(&c->qxfer_mutex);
+
+    if(c->qxfer)
+        xfer_free(c->qxfer);
+
+    c->qxfer = x;
+    rv = xfer_pump(c);
+
+    pthread_mutex_unlock(&c->qxfer_mutex);
+
+    if(c->cur_block)
+        twheel_add(&c->cur_block->timers, &c->qxfer_timer, time(NULL) + 1);
+
+    return rv;
+}
+
+int quest_xfer_pump(ship_client_t *c) {
+    int rv;
+
+    pthread_mutex_lock(&c->qxfer_mutex);
+    rv = xfer_pump(c);
+    pthread_mutex_unlock(&c->qxfer_mutex);
+
+    return rv;
+}
+
+int quest_xfer_ack(ship_client_t *c) {
+    int rv = 0;
+
+    pthread_mutex_lock(&c->qxfer_mutex);
+
+    if(c->qxfer) {
+        if(c->qxfer->acked < c->qxfer->sent)
+            ++c->qxfer->acked;
+
+        rv = xfer_pump(c);
+    }
+
+    pthread_mutex_unlock(&c->qxfer_mutex);
+    return rv;
+}
+
+void quest_xfer_cancel(ship_client_t *c) {
+    pthread_mutex_lock(&c->qxfer_mutex);
+
+    if(c->qxfer) {
+        xfer_free(c->qxfer);
+        c->qxfer = NULL;
+    }
+
+    pthread_mutex_unlock(&c->qxfer_mutex);
+
+    if(c->cur_block)
+        twheel_del(&c->cur_block->timers, &c->qxfer_timer);
+}
+
+int quest_xfer_timer(twheel_timer_t *t, time_t now) {
+    ship_client_t *c = (ship_client_t *)t->data;
+    quest_xfer_t *x;
+    int rv = 0;
+
+    pthread_mutex_lock(&c->qxfer_mutex);
+
+    if(!(x = c->qxfer))
+        goto out;
+
+    if(!x->no_acks && x->acked == x->last_acked &&
+       x->sent - x->acked >= QUEST_XFER_WINDOW) {
+        if(++x->stalls >= QUEST_XFER_STALL) {
+            debug(DBG_LOG, "Quest transfer to guildcard %" PRIu32 " not being "
+                  "acknowledged, sending without waiting\n", c->guildcard);
+            x->no_acks = 1;
+        }
+    }
+    else {
+        x->stalls = 0;
+    }
+
+    x->last_acked = x->acked;
+
+    if(xfer_pump(c)) {
+        client_disconnect(c);
+        rv = 1;
+        goto out;
+    }
+
+    /* Keep watching, as long as there's still more to go. */
+    if(c->qxfer)
+        twheel_add(&c->cur_block->timers, t, now + 1);
+
+out:
+    pthread_mutex_unlock(&c->qxfer_mutex);
+    return rv;
+}
@@ -0,0 +1,86 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef QUEST_XFER_H
+#define QUEST_XFER_H
+
+#include <time.h>
+#include <inttypes.h>
+
+#include "quests.h"
+#include "twheel.h"
+
+/* Quests get sent to clients a bit at a time, rather than all at once, so that
+   a bunch of people starting a quest at once don't end up with hundreds of KB
+   sitting in their send queues. Each client gets at most this many quest
+   chunks ahead of what it has acknowledged receiving. */
+#define QUEST_XFER_WINDOW       16
+
+/* If the client sits on a full window for this many seconds without saying
+   anything, assume it just doesn't acknowledge chunks and fall back to sending
+   whenever the socket will take more. */
+#define QUEST_XFER_STALL        3
+
+#ifndef SHIP_CLIENT_DEFINED
+#define SHIP_CLIENT_DEFINED
+struct ship_client;
+typedef struct ship_client ship_client_t;
+#endif
+
+typedef struct quest_xfer {
+    quest_file_cache_t *cache;
+
+    /* Either the bin and dat files are set, or the qst file is. */
+    const quest_file_t *bin;
+    const quest_file_t *dat;
+    const quest_file_t *qst;
+    quest_file_t *tmp[2];
+
+    uint32_t pos;
+    uint32_t count;
+    int half;
+
+    uint32_t sent;
+    uint32_t acked;
+    uint32_t last_acked;
+    int stalls;
+    int no_acks;
+    int done;
+} quest_xfer_t;
+
+/* Start sending a quest to the client, after the file info packets have been
+   sent. Either bin and dat or just qst should be set. Any files in tmp (which
+   aren't from the cache) are freed when the transfer is done with them, even
+   if this fails. The caller must hold the quest lock. */
+int quest_xfer_start(ship_client_t *c, const quest_file_t *bin,
+                     const quest_file_t *dat, const quest_file_t *qst,
+                     quest_file_t *tmp[2]);
+
+/* Send the client more of its quest, if it has room for it. This is called
+   whenever the client's send queue empties out. */
+int quest_xfer_pump(ship_client_t *c);
+
+/* Handle the client acknowledging a quest chunk. */
+int quest_xfer_ack(ship_client_t *c);
+
+/* Throw away any transfer in progress for the client. */
+void quest_xfer_cancel(ship_client_t *c);
+
+/* Timer callback that watches for transfers that have stalled out. */
+int quest_xfer_timer(twheel_timer_t *t, time_t now);
+
+#endif /* !QUEST_XFER_H */
@@ -44,11 +44,17 @@ uint32_t quest_search_enemy_list(uint32_t id, qenemy_t *list, int len, int sd) {
     return 0xFFFFFFFF;
 }
 
+/* Set up an empty map. */
+void quest_map_init(quest_map_t *map) {
+    memset(map, 0, sizeof(quest_map_t));
+    TAILQ_INIT(&map->list);
+}
+
 /* Find a quest by ID, if it exists */
 quest_map_elem_t *quest_lookup(quest_map_t *map, uint32_t qid) {
     quest_map_elem_t *i;
 
-    TAILQ_FOREACH(i, map, qentry) {
+    for(i = map->hash[qid & (QUEST_MAP_HASH_SIZE - 1)]; i; i = i->hnext) {
         if(qid == i->qid) {
             return i;
         }
@@ -60,6 +66,7 @@ quest_map_elem_t *quest_lookup(quest_map_t *map, uint32_t qid) {
 /* Add a quest to the list */
 quest_map_elem_t *quest_add(quest_map_t *map, uint32_t qid) {
     quest_map_elem_t *el;
+    uint32_t h = qid & (QUEST_MAP_HASH_SIZE - 1);
 
     /* Create the element */
     el = (quest_map_elem_t *)malloc(sizeof(quest_map_elem_t));
@@ -72,17 +79,43 @@ quest_map_elem_t *quest_add(quest_map_t *map, uint32_t qid) {
     memset(el, 0, sizeof(quest_map_elem_t));
     el->qid = qid;
 
-    /* Add to the list */
-    TAILQ_INSERT_TAIL(map, el, qentry);
+    /* Add to the list and the hash */
+    TAILQ_INSERT_TAIL(&map->list, el, qentry);
+    el->hnext = map->hash[h];
+    map->hash[h] = el;
     return el;
 }
 
+static void free_menus(quest_map_t *map) {
+    int i, j, k;
+    quest_menu_set_t *set;
+
+    for(i = 0; i < CLIENT_VERSION_COUNT; ++i) {
+        for(j = 0; j < CLIENT_LANG_COUNT; ++j) {
+            set = &map->menus[i][j];
+
+            if(set->menus) {
+                for(k = 0; k < set->cat_count * QUEST_MENU_MAX_PLAYERS; ++k) {
+                    free(set->menus[k].entries);
+                }
+
+                free(set->menus);
+            }
+
+            set->menus = NULL;
+            set->cat_count = 0;
+        }
+    }
+}
+
 /* Clean the list out */
 void quest_cleanup(quest_map_t *map) {
     quest_map_elem_t *tmp, *i;
 
+    free_menus(map);
+
     /* Remove all elements, freeing them as we go along */
-    i = TAILQ_FIRST(map);
+    i = TAILQ_FIRST(&map->list);
     while(i) {
         tmp = TAILQ_NEXT(i, qentry);
 
@@ -91,7 +124,7 @@ void quest_cleanup(quest_map_t *map) {
     }
 
     /* Reinit the map, just in case we reuse it */
-    TAILQ_INIT(map);
+    quest_map_init(map);
 }
 
 /* Process an entire list of quests read in for a version/language combo. */
@@ -135,37 +168,158 @@ int quest_map(quest_map_t *map, sylverant_quest_list_t *list, int version,
     return 0;
 }
 
-static uint32_t quest_cat_type(ship_t *s, int ver, int lang,
-                               sylverant_quest_t *q) {
-    int i, j;
+/* Can the quest be loaded with this many players? This only checks the things
+   about the quest that never change, everything else is left to whoever is
+   sending the menu. */
+static int menu_can_show(sylverant_quest_t *q, int players) {
+    if((q->flags & SYLVERANT_QUEST_HIDDEN))
+        return 0;
 
-    /* Look for it. */
-    for(i = 0; i < s->qlist[ver][lang].cat_count; ++i) {
-        for(j = 0; j < s->qlist[ver][lang].cats[i].quest_count; ++j) {
-            if(q == s->qlist[ver][lang].cats[i].quests[j])
-                return s->qlist[ver][lang].cats[i].type;
+    return q->max_players >= players && q->min_players <= players;
+}
+
+static int build_menu(quest_menu_t *m, sylverant_quest_category_t *cat,
+                      sylverant_quest_category_t *caten, int version,
+                      int language, int players) {
+    int i, k, count = 0;
+    sylverant_quest_category_t *c = cat;
+    sylverant_quest_t *q;
+    quest_map_elem_t *elem;
+
+    m->count = 0;
+    m->entries = NULL;
+
+    /* The menu is the quests in the language's list, followed by anything
+       from the English list that isn't available in the language itself. Go
+       through once to count them up, and again to fill them in. */
+    for(k = 0; k < 2; ++k) {
+        if(k) {
+            if(!count)
+                return 0;
+
+            m->entries = (quest_menu_entry_t *)malloc(sizeof(quest_menu_entry_t)
+                                                      * count);
+            if(!m->entries)
+                return -1;
+        }
+
+        for(c = cat; c; c = (c == cat && caten != cat) ? caten : NULL) {
+            for(i = 0; i < c->quest_count; ++i) {
+                q = c->quests[i];
+                elem = (quest_map_elem_t *)q->user_data;
+
+                if(c != cat && elem->qptr[version][language])
+                    continue;
+
+                if(!menu_can_show(q, players))
+                    continue;
+
+                if(k) {
+                    m->entries[m->count].quest = q;
+                    m->entries[m->count].elem = elem;
+                    m->entries[m->count].index = i;
+                    m->entries[m->count].english = (c != cat);
+                    ++m->count;
+                }
+                else {
+                    ++count;
+                }
+            }
         }
     }
 
     return 0;
 }
 
-static int check_cache_age(const char *fn1, const char *fn2) {
-    struct stat s1, s2;
+/* Build the quest menus for every version/language combo, once all of the
+   lists have been mapped. */
+int quest_build_menus(quest_map_t *map,
+                      sylverant_quest_list_t list[][CLIENT_LANG_COUNT]) {
+    int i, j, k, p;
+    sylverant_quest_list_t *l, *len;
+    sylverant_quest_category_t *caten;
+    quest_menu_set_t *set;
 
-    if(stat(fn1, &s1))
-        return -1;
+    free_menus(map);
+
+    for(i = 0; i < CLIENT_VERSION_COUNT; ++i) {
+        len = &list[i][CLIENT_LANG_ENGLISH];
 
-    if(stat(fn2, &s2))
-        /* Assume it doesn't exist */
-        return 1;
+        for(j = 0; j < CLIENT_LANG_COUNT; ++j) {
+            l = &list[i][j];
+            set = &map->menus[i][j];
 
-    if(s1.st_mtime >= s2.st_mtime)
-        /* The quest file is newer than the cache, regenerate it. */
-        return 1;
+            if(!l->cats || !l->cat_count)
+                continue;
+
+            set->menus = (quest_menu_t *)malloc(sizeof(quest_menu_t) *
+                                                l->cat_count *
+                                                QUEST_MENU_MAX_PLAYERS);
+            if(!set->menus) {
+                debug(DBG_WARN, "Cannot allocate quest menus: %s\n",
+                      strerror(errno));
+                free_menus(map);
+                return -1;
+            }
+
+            memset(set->menus, 0, sizeof(quest_menu_t) * l->cat_count *
+                   QUEST_MENU_MAX_PLAYERS);
+            set->cat_count = l->cat_count;
+
+            for(k = 0; k < l->cat_count; ++k) {
+                /* Like the list sending code has always done, this assumes
+                   that the categories are in the same order regardless of the
+                   language. */
+                if(len->cats && k < len->cat_count)
+                    caten = &len->cats[k];
+                else
+                    caten = &l->cats[k];
+
+                for(p = 0; p < QUEST_MENU_MAX_PLAYERS; ++p) {
+                    if(build_menu(&set->menus[k * QUEST_MENU_MAX_PLAYERS + p],
+                                  &l->cats[k], caten, i, j, p + 1)) {
+                        debug(DBG_WARN, "Cannot allocate quest menu: %s\n",
+                              strerror(errno));
+                        free_menus(map);
+                        return -1;
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+const quest_menu_t *quest_get_menu(const quest_map_t *map, int version,
+                                   int language, int cat, int players) {
+    const quest_menu_set_t *set;
+
+    if(version < 0 || version >= CLIENT_VERSION_COUNT || language < 0 ||
+       language >= CLIENT_LANG_COUNT)
+        return NULL;
+
+    set = &map->menus[version][language];
+
+    if(!set->menus || cat < 0 || cat >= set->cat_count || players < 1 ||
+       players > QUEST_MENU_MAX_PLAYERS)
+        return NULL;
+
+    return &set->menus[cat * QUEST_MENU_MAX_PLAYERS + players - 1];
+}
+
+static uint32_t quest_cat_type(sylverant_quest_list_t *l,
+                               sylverant_quest_t *q) {
+    int i, j;
+
+    /* Look for it. */
+    for(i = 0; i < l->cat_count; ++i) {
+        for(j = 0; j < l->cats[i].quest_count; ++j) {
+            if(q == l->cats[i].quests[j])
+                return l->cats[i].type;
+        }
+    }
 
-    /* The cache file is newer than the quest, so we should be safe to use what
-       we already have. */
     return 0;
 }
 
@@ -555,18 +709,22 @@ static uint8_t *read_and_dec_qst(const char *fn, uint32_t *osz, int ver) {
 }
 
 /* Build/rebuild the quest enemy/object data cache. */
-int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir) {
+int quest_cache_maps(quest_map_t *map,
+                     sylverant_quest_list_t list[][CLIENT_LANG_COUNT],
+                     const char *dir, qmap_cache_t *qcs[CLIENT_VERSION_COUNT]) {
     quest_map_elem_t *i;
     size_t dlen = strlen(dir);
     char mdir[dlen + 20];
-    char *fn1, *fn2;
-    int j, k;
+    char *fn1;
+    int j, k, rv = 0, fatal = 0;
     sylverant_quest_t *q;
     const static char exts[2][4] = { "dat", "qst" };
     uint8_t *dat;
     uint32_t dat_sz, tmp;
+    qmap_cache_builder_t b[CLIENT_VERSION_COUNT];
+    qmap_cache_t *qc;
 
-    /* Make sure we have all the directories we'll need. */
+    /* Make sure we have the directory we'll need. */
     sprintf(mdir, "%s/.mapcache", dir);
     if(mkdir(mdir, 0755) && errno != EEXIST) {
         debug(DBG_ERROR, "Error creating map cache directory: %s\n",
@@ -574,45 +732,29 @@ int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir) {
         return -1;
     }
 
-    sprintf(mdir, "%s/.mapcache/v1", dir);
-    if(mkdir(mdir, 0755) && errno != EEXIST) {
-        debug(DBG_ERROR, "Error creating map cache directory: %s\n",
-              strerror(errno));
-        return -1;
-    }
+    /* Start a new cache file for each version. PC is the same as v2, so it
+       doesn't get its own. */
+    for(j = 0; j < CLIENT_VERSION_COUNT; ++j) {
+        memset(&b[j], 0, sizeof(qmap_cache_builder_t));
 
-    sprintf(mdir, "%s/.mapcache/v2", dir);
-    if(mkdir(mdir, 0755) && errno != EEXIST) {
-        debug(DBG_ERROR, "Error creating map cache directory: %s\n",
-              strerror(errno));
-        return -1;
-    }
+        if(j == CLIENT_VERSION_PC)
+            continue;
 
-    sprintf(mdir, "%s/.mapcache/gc", dir);
-    if(mkdir(mdir, 0755) && errno != EEXIST) {
-        debug(DBG_ERROR, "Error creating map cache directory: %s\n",
-              strerror(errno));
-        return -1;
+        sprintf(mdir, "%s/.mapcache/%s.qmc", dir, version_codes[j]);
+        if(qmap_cache_begin(&b[j], mdir))
+            rv = -1;
     }
 
-    sprintf(mdir, "%s/.mapcache/bb", dir);
-    if(mkdir(mdir, 0755) && errno != EEXIST) {
-        debug(DBG_ERROR, "Error creating map cache directory: %s\n",
-              strerror(errno));
-        return -1;
-    }
-
-    TAILQ_FOREACH(i, map, qentry) {
+    TAILQ_FOREACH(i, &map->list, qentry) {
         /* Process it. */
         for(j = 0; j < CLIENT_VERSION_COUNT; ++j) {
-            /* Skip PC, it is the same as v2. */
-            if(j == CLIENT_VERSION_PC)
+            if(!b[j].fp)
                 continue;
 
             for(k = 0; k < CLIENT_LANG_COUNT; ++k) {
                 if((q = i->qptr[j][k])) {
                     /* Don't bother with battle or challenge quests. */
-                    tmp = quest_cat_type(s, j, k, q);
+                    tmp = quest_cat_type(&list[j][k], q);
                     if(tmp & (SYLVERANT_QUEST_BATTLE |
                               SYLVERANT_QUEST_CHALLENGE))
                         break;
@@ -620,40 +762,27 @@ int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir) {
                     if(!(fn1 = (char *)malloc(dlen + 25 + strlen(q->prefix)))) {
                         debug(DBG_ERROR, "Error allocating memory: %s\n",
                               strerror(errno));
-                        return -1;
-                    }
-
-                    if(!(fn2 = (char *)malloc(dlen + 35))) {
-                        debug(DBG_ERROR, "Error allocating memory: %s\n",
-                              strerror(errno));
-                        free(fn1);
-                        return -1;
+                        rv = fatal = -1;
+                        goto out;
                     }
 
                     sprintf(fn1, "%s/%s-%s/%s.%s", dir, version_codes[j],
                             language_codes[k], q->prefix, exts[q->format]);
-                    sprintf(fn2, "%s/.mapcache/%s/%08x", dir, version_codes[j],
-                            q->qid);
-
-                    if(check_cache_age(fn1, fn2)) {
-                        debug(DBG_LOG, "Cache for %s-%s %d needs updating!\n",
-                              version_codes[j], language_codes[k], q->qid);
-                    }
 
-                    if(q->format == SYLVERANT_QUEST_BINDAT) {
-                        if((dat = read_and_dec_dat(fn1, &dat_sz))) {
-                            cache_quest_enemies(fn2, dat, dat_sz, q->episode);
-                            free(dat);
-                        }
-                    }
-                    else {
-                        if((dat = read_and_dec_qst(fn1, &dat_sz, j))) {
-                            cache_quest_enemies(fn2, dat, dat_sz, q->episode);
-                            free(dat);
-                        }
+                    if(q->format == SYLVERANT_QUEST_BINDAT)
+                        dat = read_and_dec_dat(fn1, &dat_sz);
+                    else
+                        dat = read_and_dec_qst(fn1, &dat_sz, j);
+
+                    /* If we can't write to the file anymore, then give up on
+                       this version entirely. */
+                    if(dat && qmap_cache_add(&b[j], q->qid, dat, dat_sz,
+                                             q->episode) == -5) {
+                        qmap_cache_abort(&b[j]);
+                        rv = -1;
                     }
 
-                    free(fn2);
+                    free(dat);
                     free(fn1);
 
                     break;
@@ -662,5 +791,290 @@ int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir) {
         }
     }
 
+out:
+    /* Write out each cache file and map it back in. Each one goes to a new file
+       that gets renamed over the old one, so anyone still using the old cache
+       keeps their mapping of it until they let go of it. */
+    for(j = 0; j < CLIENT_VERSION_COUNT; ++j) {
+        if(!b[j].fp)
+            continue;
+
+        if(fatal) {
+            qmap_cache_abort(&b[j]);
+            continue;
+        }
+
+        sprintf(mdir, "%s/.mapcache/%s.qmc", dir, version_codes[j]);
+        if(qmap_cache_finish(&b[j]) || !(qc = qmap_cache_open(mdir))) {
+            rv = -1;
+            continue;
+        }
+
+        qcs[j] = qc;
+    }
+
+    return rv;
+}
+
+static uint32_t quest_file_hash(const char *path) {
+    uint32_t h = 2166136261U;
+
+    while(*path) {
+        h ^= (uint8_t)*path++;
+        h *= 16777619U;
+    }
+
+    return h & (QUEST_FILE_HASH_SIZE - 1);
+}
+
+/* Cut the file up into the chunk packets that'll be sent for it. The last
+   chunk is always short (even if that means it's empty), since that's how the
+   client knows that the file is done. */
+static int quest_file_chunk(quest_file_t *f, const uint8_t *data,
+                            const char *cname) {
+    dc_quest_chunk_pkt *chunk;
+    uint32_t i, amt;
+
+    f->chunk_count = f->len / 0x400 + 1;
+
+    if(!(f->chunks = (uint8_t *)malloc(f->chunk_count *
+                                       DC_QUEST_CHUNK_LENGTH))) {
+        debug(DBG_WARN, "Cannot allocate quest chunks: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for(i = 0; i < f->chunk_count; ++i) {
+        chunk = (dc_quest_chunk_pkt *)(f->chunks + i * DC_QUEST_CHUNK_LENGTH);
+        amt = f->len - i * 0x400;
+        if(amt > 0x400)
+            amt = 0x400;
+
+        memset(chunk, 0, DC_QUEST_CHUNK_LENGTH);
+
+        chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
+        chunk->hdr.dc.flags = (uint8_t)i;
+        chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
+
+        snprintf(chunk->filename, 16, "%s", cname);
+        memcpy(chunk->data, data + i * 0x400, amt);
+        chunk->length = LE32(amt);
+    }
+
     return 0;
 }
+
+quest_file_t *quest_file_read(const char *path, const char *cname) {
+    FILE *fp;
+    long len;
+    quest_file_t *rv;
+    uint8_t *buf;
+
+    if(!(fp = fopen(path, "rb")))
+        return NULL;
+
+    /* Figure out how long the file is. */
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if(len < 0 || !(buf = (uint8_t *)malloc(len + 1))) {
+        debug(DBG_WARN, "Cannot read quest file %s: %s\n", path,
+              strerror(errno));
+        fclose(fp);
+        return NULL;
+    }
+
+    if(fread(buf, 1, len, fp) != (size_t)len) {
+        debug(DBG_WARN, "Error reading quest file %s: %s\n", path,
+              strerror(errno));
+        free(buf);
+        fclose(fp);
+        return NULL;
+    }
+
+    fclose(fp);
+
+    if(!(rv = (quest_file_t *)malloc(sizeof(quest_file_t)))) {
+        debug(DBG_WARN, "Cannot allocate quest file: %s\n", strerror(errno));
+        free(buf);
+        return NULL;
+    }
+
+    memset(rv, 0, sizeof(quest_file_t));
+    rv->len = (uint32_t)len;
+
+    if(!(rv->path = strdup(path))) {
+        debug(DBG_WARN, "Cannot allocate quest file: %s\n", strerror(errno));
+        free(rv);
+        free(buf);
+        return NULL;
+    }
+
+    /* If we're making chunks out of it, then we don't need the plain copy of
+       the data any more. */
+    if(cname) {
+        snprintf(rv->cname, 16, "%s", cname);
+
+        if(quest_file_chunk(rv, buf, cname)) {
+            free(rv->path);
+            free(rv);
+            free(buf);
+            return NULL;
+        }
+
+        free(buf);
+    }
+    else {
+        rv->data = buf;
+    }
+
+    return rv;
+}
+
+void quest_file_free(quest_file_t *f) {
+    free(f->chunks);
+    free(f->data);
+    free(f->path);
+    free(f);
+}
+
+const quest_file_t *quest_file_lookup(const quest_file_cache_t *c,
+                                      const char *path, const char *cname) {
+    const quest_file_t *i;
+
+    if(!c)
+        return NULL;
+
+    LIST_FOREACH(i, &c->files[quest_file_hash(path)], qentry) {
+        if(!strcmp(i->path, path) && (!cname || !strcmp(i->cname, cname)))
+            return i;
+    }
+
+    return NULL;
+}
+
+static void quest_cache_file(quest_file_cache_t *c, const char *path,
+                             const char *cname) {
+    quest_file_t *f;
+
+    /* Lots of quests share files between versions, so only read each once. */
+    if(quest_file_lookup(c, path, cname))
+        return;
+
+    /* Not every quest has every variant of its files, so don't complain about
+       any that don't exist. */
+    if(!(f = quest_file_read(path, cname)))
+        return;
+
+    LIST_INSERT_HEAD(&c->files[quest_file_hash(path)], f, qentry);
+    ++c->count;
+    c->bytes += f->data ? f->len : f->chunk_count * DC_QUEST_CHUNK_LENGTH;
+}
+
+static void quest_cache_prefix(quest_file_cache_t *c, const char *dir,
+                               int ver, int lang, sylverant_quest_t *q,
+                               const char *suffix) {
+    size_t dlen = strlen(dir) + strlen(q->prefix) + 32;
+    char fn[dlen], cname[16];
+
+    if(q->format == SYLVERANT_QUEST_BINDAT) {
+        sprintf(fn, "%s/%s-%s/%s%s.bin", dir, version_codes[ver],
+                language_codes[lang], q->prefix, suffix);
+        snprintf(cname, 16, "%-.11s.bin", q->prefix);
+        quest_cache_file(c, fn, cname);
+
+        sprintf(fn, "%s/%s-%s/%s%s.dat", dir, version_codes[ver],
+                language_codes[lang], q->prefix, suffix);
+        snprintf(cname, 16, "%-.11s.dat", q->prefix);
+        quest_cache_file(c, fn, cname);
+    }
+    else if(q->format == SYLVERANT_QUEST_QST) {
+        sprintf(fn, "%s/%s-%s/%s%s.qst", dir, version_codes[ver],
+                language_codes[lang], q->prefix, suffix);
+        quest_cache_file(c, fn, NULL);
+    }
+}
+
+quest_file_cache_t *quest_cache_files(quest_map_t *map, const char *dir) {
+    quest_file_cache_t *rv;
+    quest_map_elem_t *i;
+    sylverant_quest_t *q;
+    int j, k, v;
+
+    if(!(rv = (quest_file_cache_t *)malloc(sizeof(quest_file_cache_t)))) {
+        debug(DBG_ERROR, "Cannot allocate quest file cache: %s\n",
+              strerror(errno));
+        return NULL;
+    }
+
+    memset(rv, 0, sizeof(quest_file_cache_t));
+
+    if(pthread_mutex_init(&rv->mutex, NULL)) {
+        debug(DBG_ERROR, "Cannot create quest file cache mutex\n");
+        free(rv);
+        return NULL;
+    }
+
+    rv->refcnt = 1;
+
+    for(j = 0; j < QUEST_FILE_HASH_SIZE; ++j) {
+        LIST_INIT(&rv->files[j]);
+    }
+
+    /* Grab every file that the send_*_quest functions might look for. That
+       means the v1-compatible versions of each quest, and the v1 directory
+       for any v2 quests. Xbox clients get sent the files out of the GC
+       directories, both .bin/.dat and .qst, so look for theirs there. */
+    TAILQ_FOREACH(i, &map->list, qentry) {
+        for(j = 0; j < CLIENT_VERSION_COUNT; ++j) {
+            v = j == CLIENT_VERSION_XBOX ? CLIENT_VERSION_GC : j;
+
+            for(k = 0; k < CLIENT_LANG_COUNT; ++k) {
+                if(!(q = i->qptr[j][k]))
+                    continue;
+
+                quest_cache_prefix(rv, dir, v, k, q, "");
+                quest_cache_prefix(rv, dir, v, k, q, "v1");
+
+                if(j == CLIENT_VERSION_DCV2)
+                    quest_cache_prefix(rv, dir, CLIENT_VERSION_DCV1, k, q, "");
+            }
+        }
+    }
+
+    debug(DBG_LOG, "Cached %" PRIu32 " quest files (%zu bytes)\n", rv->count,
+          rv->bytes);
+
+    return rv;
+}
+
+void quest_files_ref(quest_file_cache_t *c) {
+    pthread_mutex_lock(&c->mutex);
+    ++c->refcnt;
+    pthread_mutex_unlock(&c->mutex);
+}
+
+void quest_files_unref(quest_file_cache_t *c) {
+    quest_file_t *f;
+    int i, last;
+
+    if(!c)
+        return;
+
+    pthread_mutex_lock(&c->mutex);
+    last = !--c->refcnt;
+    pthread_mutex_unlock(&c->mutex);
+
+    if(!last)
+        return;
+
+    for(i = 0; i < QUEST_FILE_HASH_SIZE; ++i) {
+        while((f = LIST_FIRST(&c->files[i]))) {
+            LIST_REMOVE(f, qentry);
+            quest_file_free(f);
+        }
+    }
+
+    pthread_mutex_destroy(&c->mutex);
+    free(c);
+}
@@ -20,6 +20,7 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sys/queue.h>
 #include <sylverant/quest.h>
 
@@ -27,6 +28,8 @@
 #include "clients.h"
 #undef CLIENTS_H_COUNTS_ONLY
 
+struct qmap_cache;
+
 #ifndef SHIP_DEFINED
 #define SHIP_DEFINED
 struct ship;
@@ -40,13 +43,79 @@ typedef struct sylverant_quest_enemy qenemy_t;
 
 typedef struct quest_map_elem {
     TAILQ_ENTRY(quest_map_elem) qentry;
+    struct quest_map_elem *hnext;
     uint32_t qid;
 
     sylverant_quest_t *qptr[CLIENT_VERSION_COUNT][CLIENT_LANG_COUNT];
 } quest_map_elem_t;
 
-TAILQ_HEAD(quest_map, quest_map_elem);
-typedef struct quest_map quest_map_t;
+TAILQ_HEAD(quest_map_queue, quest_map_elem);
+
+/* One quest in a precomputed quest menu. The index is the quest's position in
+   its category (for challenge mode), and english is set for the quests that
+   come from the English list because there's no version in the language the
+   menu is for. */
+typedef struct quest_menu_entry {
+    sylverant_quest_t *quest;
+    quest_map_elem_t *elem;
+    int index;
+    int english;
+} quest_menu_entry_t;
+
+typedef struct quest_menu {
+    int count;
+    quest_menu_entry_t *entries;
+} quest_menu_t;
+
+/* Number of buckets in the quest ID hash. Must be a power of two. */
+#define QUEST_MAP_HASH_SIZE     512
+
+/* Quest menus are built for each number of players from 1 up to this. */
+#define QUEST_MENU_MAX_PLAYERS  4
+
+/* Menus for one version/language combo, one set of QUEST_MENU_MAX_PLAYERS for
+   each category in the list. */
+typedef struct quest_menu_set {
+    int cat_count;
+    quest_menu_t *menus;
+} quest_menu_set_t;
+
+typedef struct quest_map {
+    struct quest_map_queue list;
+    quest_map_elem_t *hash[QUEST_MAP_HASH_SIZE];
+    quest_menu_set_t menus[CLIENT_VERSION_COUNT][CLIENT_LANG_COUNT];
+} quest_map_t;
+
+/* A quest file read into memory. For .bin/.dat quests, the file is kept as
+   the chunk packets (unencrypted, with a DC header) that are sent to the
+   client, rather than as the raw file data. */
+typedef struct quest_file {
+    LIST_ENTRY(quest_file) qentry;
+    char *path;
+    char cname[16];
+    uint32_t len;
+
+    uint8_t *data;
+    uint8_t *chunks;
+    uint32_t chunk_count;
+} quest_file_t;
+
+LIST_HEAD(quest_file_list, quest_file);
+
+/* Number of buckets in the quest file cache. Must be a power of two. */
+#define QUEST_FILE_HASH_SIZE    512
+
+typedef struct quest_file_cache {
+    pthread_mutex_t mutex;
+    int refcnt;
+
+    struct quest_file_list files[QUEST_FILE_HASH_SIZE];
+    uint32_t count;
+    size_t bytes;
+} quest_file_cache_t;
+
+/* Set up an empty map. */
+void quest_map_init(quest_map_t *map);
 
 /* Find a quest by ID, if it exists */
 quest_map_elem_t *quest_lookup(quest_map_t *map, uint32_t qid);
@@ -61,8 +130,42 @@ void quest_cleanup(quest_map_t *map);
 int quest_map(quest_map_t *map, sylverant_quest_list_t *list, int version,
               int language);
 
-/* Build/rebuild the quest enemy/object data cache. */
-int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir);
+/* Build the quest menus for every version/language combo, once all of the
+   lists have been mapped. Quests that are hidden or can't be played with the
+   number of players in a menu are left out of it entirely. */
+int quest_build_menus(quest_map_t *map,
+                      sylverant_quest_list_t list[][CLIENT_LANG_COUNT]);
+
+/* Grab the menu for a category for the given number of players. Returns NULL
+   if there isn't one. */
+const quest_menu_t *quest_get_menu(const quest_map_t *map, int version,
+                                   int language, int cat, int players);
+
+/* Build/rebuild the quest enemy/object data cache. This doesn't touch the
+   ship's current caches, the new ones are put in qcs (where any version that
+   couldn't be built is left alone) for the caller to swap in. */
+int quest_cache_maps(quest_map_t *map,
+                     sylverant_quest_list_t list[][CLIENT_LANG_COUNT],
+                     const char *dir,
+                     struct qmap_cache *qcs[CLIENT_VERSION_COUNT]);
+
+/* Read every quest file into memory. This doesn't need any locks held, since
+   it only touches the map passed in. The cache starts out with one reference,
+   which belongs to the caller. Anything that holds onto files from the cache
+   after dropping the quest lock must hold a reference too. */
+quest_file_cache_t *quest_cache_files(quest_map_t *map, const char *dir);
+void quest_files_ref(quest_file_cache_t *c);
+void quest_files_unref(quest_file_cache_t *c);
+
+/* Look up a quest file by its full path in the cache. For .bin/.dat files,
+   the name in the chunks must match cname as well. */
+const quest_file_t *quest_file_lookup(const quest_file_cache_t *c,
+                                      const char *path, const char *cname);
+
+/* Read a quest file that isn't in the cache. For .bin/.dat files, cname is the
+   name to put in the chunk packets, for .qst files it should be NULL. */
+quest_file_t *quest_file_read(const char *path, const char *cname);
+void quest_file_free(quest_file_t *f);
 
 /* Search an enemy list from a quest for an entry. */
 uint32_t quest_search_enemy_list(uint32_t id, qenemy_t *list, int len, int sd);
@@ -0,0 +1,73 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "rng.h"
+
+#define RNG_M       397
+#define MATRIX_A    0x9908B0DFU
+#define UPPER_MASK  0x80000000U
+#define LOWER_MASK  0x7FFFFFFFU
+
+void rng_seed(rng_stream_t *r, uint32_t seed) {
+    int i;
+
+    r->mt[0] = seed;
+
+    for(i = 1; i < RNG_N; ++i) {
+        r->mt[i] = 1812433253U * (r->mt[i - 1] ^ (r->mt[i - 1] >> 30)) + i;
+    }
+
+    r->seed = seed;
+    r->pos = RNG_N;
+}
+
+static inline uint32_t twist(uint32_t a, uint32_t b, uint32_t m) {
+    uint32_t y = (a & UPPER_MASK) | (b & LOWER_MASK);
+
+    return m ^ (y >> 1) ^ (-(y & 1) & MATRIX_A);
+}
+
+void rng_refill(rng_stream_t *r) {
+    uint32_t *mt = r->mt, *out = r->out, y;
+    int i;
+
+    /* The twist is split up where it wraps around the state so that none of
+       the loops have a branch in them or depend on anything less than 227
+       entries back, so the compiler can do them with vector instructions. */
+    for(i = 0; i < RNG_N - RNG_M; ++i) {
+        mt[i] = twist(mt[i], mt[i + 1], mt[i + RNG_M]);
+    }
+
+    for(; i < RNG_N - 1; ++i) {
+        mt[i] = twist(mt[i], mt[i + 1], mt[i + RNG_M - RNG_N]);
+    }
+
+    mt[RNG_N - 1] = twist(mt[RNG_N - 1], mt[0], mt[RNG_M - 1]);
+
+    /* Temper the whole batch at once. */
+    for(i = 0; i < RNG_N; ++i) {
+        y = mt[i];
+        y ^= y >> 11;
+        y ^= (y << 7) & 0x9D2C5680U;
+        y ^= (y << 15) & 0xEFC60000U;
+        y ^= y >> 18;
+        out[i] = y;
+    }
+
+    r->pos = 0;
+}
@@ -0,0 +1,58 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/* A Mersenne Twister stream that generates its numbers a whole state's worth
+   at a time into a buffer, rather than tempering each one as it's asked for.
+   Each game has one of these for its drops, so taking a number is usually
+   just a read from the buffer. The numbers are exactly the same ones that
+   mt19937_genrand_int32() would give for the same seed. */
+#define RNG_N       624
+
+typedef struct rng_stream {
+    uint32_t mt[RNG_N];
+    uint32_t out[RNG_N];
+    int pos;
+    uint32_t seed;
+} rng_stream_t;
+
+/* Seed the stream. The seed is kept around, so a game's drops can be gone
+   through again from it. */
+void rng_seed(rng_stream_t *r, uint32_t seed);
+
+/* Generate the next batch of numbers. Only the inline functions below should
+   need to call this. */
+void rng_refill(rng_stream_t *r);
+
+static inline uint32_t rng_int32(rng_stream_t *r) {
+    if(r->pos >= RNG_N)
+        rng_refill(r);
+
+    return r->out[r->pos++];
+}
+
+/* A number in [0, 1], like mt19937_genrand_real1(). */
+static inline double rng_real1(rng_stream_t *r) {
+    return rng_int32(r) * (1.0 / 4294967295.0);
+}
+
+#endif /* !RNG_H */
@@ -18,12 +18,14 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 #include <sylverant/debug.h>
-#include <sylverant/mtwist.h>
 
 #include "rtdata.h"
 #include "ship_packets.h"
+#include "snapshot.h"
 
 /* Our internal representation of the ItemRT entry. This way, we don't have to
    expand it every time we want to use it. */
@@ -40,10 +42,24 @@ typedef struct rt_set {
     rt_data_t box_rares[30];
 } rt_set_t;
 
-static int have_v2rt = 0;
-static rt_set_t v2_rtdata[4][10];
-static int have_gcrt = 0;
-static rt_set_t gc_rtdata[2][4][10];
+/* One generation of the rare tables. Each game holds a reference to the one
+   that was current when it was made, so a refresh only swaps the pointer to
+   the current one and the old one goes away with the last game using it. The
+   first one is read in at startup (before anyone can be using it), so it
+   isn't allocated. */
+struct rt_gen {
+    uint32_t refcnt;
+    int have_v2;
+    int have_gc;
+    rt_set_t v2[4][10];
+    rt_set_t gc[2][4][10];
+};
+
+typedef struct rt_gen rt_gen_t;
+
+static rt_gen_t rt_first = { 1 };
+static rt_gen_t *rt_cur = &rt_first;
+static pthread_mutex_t rt_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* This function based on information from a couple of different sources, namely
    Fuzziqer's newserv and information from Lee (through Aleron Ives). */
@@ -58,14 +74,14 @@ static double expand_rate(uint8_t rate) {
     return (double)expd / (double)0x100000000ULL;
 }
 
-int rt_read_v2(const char *fn) {
+static int read_v2(rt_gen_t *g, const char *fn) {
     FILE *fp;
     uint8_t buf[30];
     int rv = 0, i, j, k;
     uint32_t offsets[40], tmp;
     rt_entry_t ent;
 
-    have_v2rt = 0;
+    g->have_v2 = 0;
 
     /* Open up the file */
     if(!(fp = fopen(fn, "rb"))) {
@@ -142,9 +158,9 @@ int rt_read_v2(const char *fn) {
 
                 tmp = ent.item_data[0] | (ent.item_data[1] << 8) |
                     (ent.item_data[2] << 16);
-                v2_rtdata[i][j].enemy_rares[k].prob = expand_rate(ent.prob);
-                v2_rtdata[i][j].enemy_rares[k].item_data = tmp;
-                v2_rtdata[i][j].enemy_rares[k].area = 0; /* Unused */
+                g->v2[i][j].enemy_rares[k].prob = expand_rate(ent.prob);
+                g->v2[i][j].enemy_rares[k].item_data = tmp;
+                g->v2[i][j].enemy_rares[k].area = 0; /* Unused */
             }
 
             /* Read in the box entries */
@@ -164,28 +180,28 @@ int rt_read_v2(const char *fn) {
 
                 tmp = ent.item_data[0] | (ent.item_data[1] << 8) |
                     (ent.item_data[2] << 16);
-                v2_rtdata[i][j].box_rares[k].prob = expand_rate(ent.prob);
-                v2_rtdata[i][j].box_rares[k].item_data = tmp;
-                v2_rtdata[i][j].box_rares[k].area = buf[k];
+                g->v2[i][j].box_rares[k].prob = expand_rate(ent.prob);
+                g->v2[i][j].box_rares[k].item_data = tmp;
+                g->v2[i][j].box_rares[k].area = buf[k];
             }
         }
     }
 
-    have_v2rt = 1;
+    g->have_v2 = 1;
 
 out:
     fclose(fp);
     return rv;
 }
 
-int rt_read_gc(const char *fn) {
+static int read_gc(rt_gen_t *g, const char *fn) {
     FILE *fp;
     uint8_t buf[30];
     int rv = 0, i, j, k, l;
     uint32_t offsets[80], tmp;
     rt_entry_t ent;
 
-    have_gcrt = 0;
+    g->have_gc = 0;
 
     /* Open up the file */
     if(!(fp = fopen(fn, "rb"))) {
@@ -253,10 +269,10 @@ int rt_read_gc(const char *fn) {
 
                     tmp = ent.item_data[0] | (ent.item_data[1] << 8) |
                         (ent.item_data[2] << 16);
-                    gc_rtdata[i][j][k].enemy_rares[l].prob =
+                    g->gc[i][j][k].enemy_rares[l].prob =
                         expand_rate(ent.prob);
-                    gc_rtdata[i][j][k].enemy_rares[l].item_data = tmp;
-                    gc_rtdata[i][j][k].enemy_rares[l].area = 0; /* Unused */
+                    g->gc[i][j][k].enemy_rares[l].item_data = tmp;
+                    g->gc[i][j][k].enemy_rares[l].area = 0; /* Unused */
                 }
 
                 /* Read in the box entries */
@@ -277,51 +293,152 @@ int rt_read_gc(const char *fn) {
 
                     tmp = ent.item_data[0] | (ent.item_data[1] << 8) |
                         (ent.item_data[2] << 16);
-                    gc_rtdata[i][j][k].box_rares[l].prob =
+                    g->gc[i][j][k].box_rares[l].prob =
                         expand_rate(ent.prob);
-                    gc_rtdata[i][j][k].box_rares[l].item_data = tmp;
-                    gc_rtdata[i][j][k].box_rares[l].area = buf[k];
+                    g->gc[i][j][k].box_rares[l].item_data = tmp;
+                    g->gc[i][j][k].box_rares[l].area = buf[k];
                 }
             }
         }
     }
 
-    have_gcrt = 1;
+    g->have_gc = 1;
 
 out:
     fclose(fp);
     return rv;
 }
 
+int rt_read_v2(const char *fn) {
+    return read_v2(rt_cur, fn);
+}
+
+int rt_read_gc(const char *fn) {
+    return read_gc(rt_cur, fn);
+}
+
+int rt_refresh(const char *v2fn, const char *gcfn) {
+    rt_gen_t *g, *old;
+
+    if(!(g = (rt_gen_t *)calloc(1, sizeof(rt_gen_t)))) {
+        debug(DBG_ERROR, "Cannot allocate rare tables: %s\n", strerror(errno));
+        return -1;
+    }
+
+    g->refcnt = 1;
+
+    /* Read everything in before anyone sees it, and keep the old tables if
+       anything goes wrong. */
+    if((v2fn && read_v2(g, v2fn)) || (gcfn && read_gc(g, gcfn))) {
+        free(g);
+        return -1;
+    }
+
+    pthread_mutex_lock(&rt_lock);
+    old = rt_cur;
+    rt_cur = g;
+    pthread_mutex_unlock(&rt_lock);
+
+    rt_gen_unref(old);
+    return 0;
+}
+
+rt_gen_t *rt_gen_ref(void) {
+    rt_gen_t *g;
+
+    pthread_mutex_lock(&rt_lock);
+    g = rt_cur;
+    __atomic_add_fetch(&g->refcnt, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&rt_lock);
+
+    return g;
+}
+
+void rt_gen_unref(rt_gen_t *g) {
+    if(g && !__atomic_sub_fetch(&g->refcnt, 1, __ATOMIC_ACQ_REL) &&
+       g != &rt_first)
+        free(g);
+}
+
+int rt_snapshot_write(snapshot_writer_t *w) {
+    rt_gen_t *g = rt_cur;
+    int32_t have[2] = { g->have_v2, g->have_gc };
+
+    if(snapshot_section(w, SNAPSHOT_RT) ||
+       snapshot_write(w, have, sizeof(have), NULL) ||
+       snapshot_write(w, g->v2, sizeof(g->v2), NULL) ||
+       snapshot_write(w, g->gc, sizeof(g->gc), NULL))
+        return -1;
+
+    return 0;
+}
+
+int rt_snapshot_read(const snapshot_t *s, int load) {
+    rt_gen_t *g = rt_cur;
+    snapshot_cursor_t c;
+    const int32_t *have;
+    const void *v2, *gc;
+
+    snapshot_cursor(s, SNAPSHOT_RT, &c);
+
+    if(!(have = snapshot_read(&c, sizeof(int32_t) * 2)) ||
+       !(v2 = snapshot_read(&c, sizeof(g->v2))) ||
+       !(gc = snapshot_read(&c, sizeof(g->gc))) ||
+       c.pos != c.size)
+        return -1;
+
+    if(!load)
+        return 0;
+
+    memcpy(g->v2, v2, sizeof(g->v2));
+    memcpy(g->gc, gc, sizeof(g->gc));
+    g->have_v2 = have[0];
+    g->have_gc = have[1];
+    return 0;
+}
+
 int rt_v2_enabled(void) {
-    return have_v2rt;
+    int rv;
+
+    pthread_mutex_lock(&rt_lock);
+    rv = rt_cur->have_v2;
+    pthread_mutex_unlock(&rt_lock);
+
+    return rv;
 }
 
 int rt_gc_enabled(void) {
-    return have_gcrt;
+    int rv;
+
+    pthread_mutex_lock(&rt_lock);
+    rv = rt_cur->have_gc;
+    pthread_mutex_unlock(&rt_lock);
+
+    return rv;
 }
 
 uint32_t rt_generate_v2_rare(ship_client_t *c, lobby_t *l, int rt_index,
                              int area) {
-    struct mt19937_state *rng = &c->cur_block->rng;
+    rng_stream_t *rng = &l->rng;
     double rnd;
+    rt_gen_t *g = l->rt_gen;
     rt_set_t *set;
     int i;
     int section = l->clients[l->leader_id]->pl->v1.section;
 
     /* Make sure we read in a rare table and we have a sane index */
-    if(!have_v2rt)
+    if(!g->have_v2)
         return 0;
 
     if(rt_index < -1 || rt_index > 100)
         return -1;
 
     /* Grab the rare set for the game */
-    set = &v2_rtdata[l->difficulty][section];
+    set = &g->v2[l->difficulty][section];
 
     /* Are we doing a drop for an enemy or a box? */
     if(rt_index >= 0) {
-        rnd = mt19937_genrand_real1(rng);
+        rnd = rng_real1(rng);
 
         if(rnd < set->enemy_rares[rt_index].prob)
             return set->enemy_rares[rt_index].item_data;
@@ -329,7 +446,7 @@ uint32_t rt_generate_v2_rare(ship_client_t *c, lobby_t *l, int rt_index,
     else {
         for(i = 0; i < 30; ++i) {
             if(set->box_rares[i].area == area) {
-                rnd = mt19937_genrand_real1(rng);
+                rnd = rng_real1(rng);
 
                 if(rnd < set->box_rares[i].prob)
                     return set->box_rares[i].item_data;
@@ -342,25 +459,26 @@ uint32_t rt_generate_v2_rare(ship_client_t *c, lobby_t *l, int rt_index,
 
 uint32_t rt_generate_gc_rare(ship_client_t *c, lobby_t *l, int rt_index,
                              int area) {
-    struct mt19937_state *rng = &c->cur_block->rng;
+    rng_stream_t *rng = &l->rng;
     double rnd;
+    rt_gen_t *g = l->rt_gen;
     rt_set_t *set;
     int i;
     int section = l->clients[l->leader_id]->pl->v1.section;
 
     /* Make sure we read in a rare table and we have a sane index */
-    if(!have_gcrt)
+    if(!g->have_gc)
         return 0;
 
     if(rt_index < -1 || rt_index > 100)
         return -1;
 
     /* Grab the rare set for the game */
-    set = &gc_rtdata[l->episode - 1][l->difficulty][section];
+    set = &g->gc[l->episode - 1][l->difficulty][section];
 
     /* Are we doing a drop for an enemy or a box? */
     if(rt_index >= 0) {
-        rnd = mt19937_genrand_real1(rng);
+        rnd = rng_real1(rng);
 
         if(rnd < set->enemy_rares[rt_index].prob)
             return set->enemy_rares[rt_index].item_data;
@@ -368,7 +486,7 @@ uint32_t rt_generate_gc_rare(ship_client_t *c, lobby_t *l, int rt_index,
     else {
         for(i = 0; i < 30; ++i) {
             if(set->box_rares[i].area == area) {
-                rnd = mt19937_genrand_real1(rng);
+                rnd = rng_real1(rng);
 
                 if(rnd < set->box_rares[i].prob)
                     return set->box_rares[i].item_data;
@@ -21,6 +21,7 @@
 #include <stdint.h>
 
 #include "lobby.h"
+#include "snapshot.h"
 
 #ifdef PACKED
 #undef PACKED
@@ -39,6 +40,17 @@ typedef struct rt_entry {
 
 int rt_read_v2(const char *fn);
 int rt_read_gc(const char *fn);
+
+/* Read in new rare tables and make them the current ones. Games that already
+   exist keep using the tables they started with. Either filename may be NULL
+   to leave that version without rare tables. */
+int rt_refresh(const char *v2fn, const char *gcfn);
+
+/* Grab or release a reference to the current rare tables. */
+struct rt_gen *rt_gen_ref(void);
+void rt_gen_unref(struct rt_gen *g);
+int rt_snapshot_write(snapshot_writer_t *w);
+int rt_snapshot_read(const snapshot_t *s, int load);
 int rt_v2_enabled(void);
 int rt_gc_enabled(void);
 
@@ -20,6 +20,7 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/queue.h>
 
 #include <sylverant/debug.h>
@@ -32,6 +33,7 @@
 #include "clients.h"
 #include "lobby.h"
 #include "quest_functions.h"
+#include "metrics.h"
 
 #ifdef ENABLE_LUA
 #include <lua.h>
@@ -47,12 +49,80 @@
 
 #ifdef ENABLE_LUA
 
-static pthread_mutex_t script_mutex = PTHREAD_MUTEX_INITIALIZER;
-static lua_State *lstate;
-static int scripts_ref = 0;
+/* Each block gets a Lua state of its own (and the ship has one for everything
+   that isn't on a block), so that scripts running for different blocks don't
+   all have to wait on one lock. Each state still has a lock, since the clients
+   and lobbies on a block can be poked at from other threads now and then. The
+   lock is recursive, since scripts can end up doing things that run more
+   scripts. */
+struct script_state {
+    TAILQ_ENTRY(script_state) qentry;
+    pthread_mutex_t mutex;
+    lua_State *l;
+    int scripts_ref;
+
+    int script_ids[ScriptActionCount];
+    int script_ids_gate[ScriptActionCount];
+
+    /* Bitmap of the events that have a script in either of the above. This is
+       only changed with the lock held, but it is read without it, so that the
+       events nobody has a script for never have to touch the lock. */
+    uint32_t events;
+
+    /* Instructions run by the script currently running in this state. */
+    uint64_t call_insns;
+    int aborted;
+};
+
+/* The count hook runs every this many instructions, so instruction counts (and
+   the budget) are only this precise. */
+#define SCRIPT_HOOK_COUNT   1000
+
+/* Make sure every event fits in the bitmaps. */
+typedef char script_events_fit[ScriptActionCount <= 32 ? 1 : -1];
+
+TAILQ_HEAD(script_state_queue, script_state);
+
+/* Values shared between all of the states, with ship.setShared() and
+   ship.getShared(). */
+typedef struct script_shared {
+    TAILQ_ENTRY(script_shared) qentry;
+    char *key;
+    int type;
+    int is_int;
+    lua_Integer ival;
+    lua_Number nval;
+    char *sval;
+    size_t slen;
+} script_shared_t;
+
+TAILQ_HEAD(script_shared_queue, script_shared);
+
+/* Registry key for the table that ship.getTable() returns in each state. */
+#define SCRIPT_SHIP_TABLE   "sylverant.ship_table"
+
+static pthread_mutex_t states_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct script_state_queue states = TAILQ_HEAD_INITIALIZER(states);
+static script_state_t *ship_state;
+
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct script_shared_queue shared_data =
+    TAILQ_HEAD_INITIALIZER(shared_data);
+
+/* The scripts configured locally and the ones the shipgate has sent us, so
+   that they can be loaded into every state (including ones made later). */
+static char *script_files[ScriptActionCount] = { 0 };
+static char *script_files_gate[ScriptActionCount] = { 0 };
+static char *module_path;
 
-static int script_ids[ScriptActionCount] = { 0 };
-static int script_ids_gate[ScriptActionCount] = { 0 };
+/* Maximum number of instructions a script can run in one call, or 0 for no
+   limit. */
+static uint32_t insn_budget = 0;
+
+/* Profiling information for all of the states. This is only ever touched with
+   atomic operations, so that reading it from a script can't deadlock against
+   the locks on the other states. */
+static script_stats_t stats[SCRIPT_SLOT_COUNT][SCRIPT_SRC_COUNT];
 
 /* Text versions of the script actions. This must match the list in the
    script_action_t enum in scripts.h. */
@@ -96,12 +166,160 @@ static inline script_action_t script_action_to_index(xmlChar *str) {
     return ScriptActionInvalid;
 }
 
+const char *script_slot_name(int slot) {
+    if(slot == SCRIPT_SLOT_QFUNC)
+        return "QUEST_FUNC";
+    else if(slot == SCRIPT_SLOT_FILE)
+        return "TEAM_SCRIPT";
+    else if(slot >= 0 && slot < ScriptActionCount)
+        return (const char *)script_action_text[slot];
+
+    return "UNKNOWN";
+}
+
+const char *script_source_name(int src) {
+    static const char *names[SCRIPT_SRC_COUNT] = { "local", "gate", "team" };
+
+    if(src >= 0 && src < SCRIPT_SRC_COUNT)
+        return names[src];
+
+    return "unknown";
+}
+
+static inline script_state_t *block_state(block_t *b) {
+    if(b && b->scripts)
+        return b->scripts;
+
+    return ship_state;
+}
+
+static inline script_state_t *client_state(ship_client_t *c) {
+    return block_state(c ? c->cur_block : NULL);
+}
+
+static inline uint32_t state_events(script_state_t *st) {
+    return __atomic_load_n(&st->events, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t lobby_events(lobby_t *l) {
+    return l ? __atomic_load_n(&l->script_events, __ATOMIC_ACQUIRE) : 0;
+}
+
+/* Publish the bitmap of events that have scripts in this state. This must be
+   called with the state locked any time one of the script ids changes. */
+static void update_events(script_state_t *st) {
+    uint32_t ev = 0;
+    int i;
+
+    for(i = 0; i < ScriptActionCount; ++i) {
+        if(st->script_ids[i] || st->script_ids_gate[i])
+            ev |= SCRIPT_EVENT_BIT(i);
+    }
+
+    __atomic_store_n(&st->events, ev, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void count_hook(lua_State *l, lua_Debug *ar) {
+    script_state_t *st = *(script_state_t **)lua_getextraspace(l);
+    uint32_t budget = __atomic_load_n(&insn_budget, __ATOMIC_RELAXED);
+
+    (void)ar;
+    st->call_insns += SCRIPT_HOOK_COUNT;
+
+    if(budget && st->call_insns > budget) {
+        st->aborted = 1;
+        luaL_error(l, "script exceeded its budget of %d instructions",
+                   (int)budget);
+    }
+}
+
+/* Call the function on the stack (with its arguments above it) and keep track
+   of how long it took. This must be called with the state locked. Scripts can
+   run other scripts, so the instruction count of whatever called us is set
+   aside while this one runs. */
+static int run_script(script_state_t *st, int slot, int src, int nargs,
+                      int nres) {
+    script_stats_t *s = &stats[slot][src];
+    uint64_t start, elapsed, max, outer = st->call_insns;
+    int outer_aborted = st->aborted, rv;
+
+    st->call_insns = 0;
+    st->aborted = 0;
+    start = now_ns();
+
+    rv = lua_pcall(st->l, nargs, nres, 0);
+
+    elapsed = now_ns() - start;
+    __atomic_add_fetch(&s->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->total_ns, elapsed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->insns, st->call_insns, __ATOMIC_RELAXED);
+    metrics_observe(METRIC_LUA_TIME, elapsed / 1000);
+
+    max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+    while(elapsed > max &&
+          !__atomic_compare_exchange_n(&s->max_ns, &max, elapsed, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+
+    if(st->aborted) {
+        __atomic_add_fetch(&s->aborts, 1, __ATOMIC_RELAXED);
+        debug(DBG_WARN, "Aborted runaway %s script for %s\n",
+              script_source_name(src), script_slot_name(slot));
+    }
+
+    st->call_insns = outer;
+    st->aborted = outer_aborted;
+    return rv;
+}
+
+/* Load a script into the scripts table of a state, replacing whatever was
+   there before. This must be called with the state locked. */
+static int load_script(script_state_t *st, int *id, const char *fn) {
+    /* Pull the scripts table out to the top of the stack. */
+    lua_rawgeti(st->l, LUA_REGISTRYINDEX, st->scripts_ref);
+
+    /* Attempt to read in the script. */
+    if(luaL_loadfile(st->l, fn) != LUA_OK) {
+        lua_pop(st->l, 2);
+        return -1;
+    }
+
+    if(*id)
+        luaL_unref(st->l, -2, *id);
+
+    /* Add the script to the Lua table. */
+    *id = luaL_ref(st->l, -2);
+
+    /* Pop off the scripts table to clean up. */
+    lua_pop(st->l, 1);
+
+    return 0;
+}
+
+static void unload_script(script_state_t *st, int *id) {
+    if(!*id)
+        return;
+
+    lua_rawgeti(st->l, LUA_REGISTRYINDEX, st->scripts_ref);
+    luaL_unref(st->l, -1, *id);
+    lua_pop(st->l, 1);
+    *id = 0;
+}
+
 int script_add(script_action_t action, const char *filename) {
     char realfn[64];
-    int len;
+    int len, rv = 0;
+    script_state_t *st;
 
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!ship_state)
         return 0;
 
     /* Make the real filename we'll try to load from... */
@@ -111,76 +329,89 @@ int script_add(script_action_t action, const char *filename) {
         return -1;
     }
 
-    pthread_mutex_lock(&script_mutex);
-
-    /* Pull the scripts table out to the top of the stack. */
-    lua_rawgeti(lstate, LUA_REGISTRYINDEX, scripts_ref);
-
-    /* Attempt to read in the script. */
-    if(luaL_loadfile(lstate, realfn) != LUA_OK) {
-        debug(DBG_WARN, "Couldn't load script \"%s\"\n", filename);
-        lua_pop(lstate, 1);
-        pthread_mutex_unlock(&script_mutex);
-        return -1;
-    }
+    pthread_mutex_lock(&states_mutex);
 
     /* Issue a warning if we're redefining something before doing it. */
-    if(script_ids_gate[action]) {
+    if(script_files_gate[action]) {
         debug(DBG_WARN, "Redefining script event %d\n", (int)action);
-        luaL_unref(lstate, -2, script_ids_gate[action]);
+        free(script_files_gate[action]);
     }
 
-    /* Add the script to the Lua table. */
-    script_ids_gate[action] = luaL_ref(lstate, -2);
-    debug(DBG_LOG, "Script for type %d added as ID %d\n", (int)action,
-          script_ids_gate[action]);
+    script_files_gate[action] = strdup(realfn);
 
-    /* Pop off the scripts table and unlock the mutex to clean up. */
-    lua_pop(lstate, 1);
-    pthread_mutex_unlock(&script_mutex);
+    /* Load it into every state. */
+    TAILQ_FOREACH(st, &states, qentry) {
+        pthread_mutex_lock(&st->mutex);
 
-    return 0;
+        if(load_script(st, &st->script_ids_gate[action], realfn))
+            rv = -1;
+
+        update_events(st);
+        pthread_mutex_unlock(&st->mutex);
+    }
+
+    pthread_mutex_unlock(&states_mutex);
+
+    if(rv)
+        debug(DBG_WARN, "Couldn't load script \"%s\"\n", filename);
+    else
+        debug(DBG_LOG, "Script for type %d added\n", (int)action);
+
+    return rv;
 }
 
 int script_add_lobby_locked(lobby_t *l, script_action_t action) {
+    script_state_t *st = block_state(l->block);
+    lua_State *ls;
+
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!st)
         return 0;
 
+    /* This is only ever called from a script running in the lobby's state, so
+       the function is sitting on top of its stack. */
+    ls = st->l;
+
     /* Pull the scripts table out to the top of the stack. */
-    lua_rawgeti(lstate, LUA_REGISTRYINDEX, l->script_table);
+    lua_rawgeti(ls, LUA_REGISTRYINDEX, l->script_table);
 
     /* Issue a warning if we're redefining something before doing it. */
     if(l->script_ids[action]) {
         debug(DBG_WARN, "Redefining lobby event %d for lobby %" PRIu32 "\n",
               (int)action, l->lobby_id);
-        luaL_unref(lstate, -1, l->script_ids[action]);
+        luaL_unref(ls, -1, l->script_ids[action]);
     }
 
     /* Pull the function out to the top of the stack. */
-    lua_pushvalue(lstate, -2);
+    lua_pushvalue(ls, -2);
 
     /* Add the script to the Lua table. */
-    l->script_ids[action] = luaL_ref(lstate, -2);
+    l->script_ids[action] = luaL_ref(ls, -2);
+    __atomic_or_fetch(&l->script_events, SCRIPT_EVENT_BIT(action),
+                      __ATOMIC_RELEASE);
     debug(DBG_LOG, "Lobby %" PRIu32 " callback for type %d added as Lua ID "
           "%d\n", l->lobby_id, (int)action, l->script_ids[action]);
 
     /* Pop off the scripts table and the function to clean up. */
-    lua_pop(lstate, 2);
+    lua_pop(ls, 2);
 
     return 0;
 }
 
 int script_add_lobby_qfunc_locked(lobby_t *l, uint32_t id, int args, int rvs) {
+    script_state_t *st = block_state(l->block);
+    lua_State *ls;
     lobby_qfunc_t *i;
     int found = 0;
 
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!st)
         return 0;
 
+    ls = st->l;
+
     /* Pull the scripts table out to the top of the stack. */
-    lua_rawgeti(lstate, LUA_REGISTRYINDEX, l->script_table);
+    lua_rawgeti(ls, LUA_REGISTRYINDEX, l->script_table);
 
     /* Check if the entry is already in the list and issue a warning that we're
        going to redefine it. */
@@ -188,25 +419,32 @@ int script_add_lobby_qfunc_locked(lobby_t *l, uint32_t id, int args, int rvs) {
         if(i->func_id == id) {
             debug(DBG_WARN, "Redefining lobby quest function %" PRIu32
                   " for lobby %" PRIu32 "\n", id, l->lobby_id);
-            luaL_unref(lstate, -1, i->script_id);
+            luaL_unref(ls, -1, i->script_id);
             found = 1;
+            break;
         }
     }
 
-    if(!found) {
-        if(!(i = (lobby_qfunc_t *)malloc(sizeof(lobby_qfunc_t)))) {
+    /* New entries come out of the lobby's arena, reusing any that were removed
+       earlier. */
+    if(!found && (i = SLIST_FIRST(&l->qfunc_free))) {
+        SLIST_REMOVE_HEAD(&l->qfunc_free, entry);
+    }
+    else if(!found) {
+        if(!(i = (lobby_qfunc_t *)lobby_alloc(l, sizeof(lobby_qfunc_t)))) {
             debug(DBG_WARN, "Cannot allocate memory for lobby quest function: "
                   "%s\n", strerror(errno));
+            lua_pop(ls, 1);
             return -1;
         }
     }
 
     /* Pull the function out to the top of the stack. */
-    lua_pushvalue(lstate, -2);
+    lua_pushvalue(ls, -2);
 
     /* Fill in the structure and add the script reference to the Lua table. */
     i->func_id = id;
-    i->script_id = luaL_ref(lstate, -2);
+    i->script_id = luaL_ref(ls, -2);
     i->nargs = args;
     i->nretvals = rvs;
 
@@ -219,43 +457,49 @@ int script_add_lobby_qfunc_locked(lobby_t *l, uint32_t id, int args, int rvs) {
           " added as Lua ID %d\n", l->lobby_id, id, i->script_id);
 
     /* Pop off the scripts table and the function to clean up. */
-    lua_pop(lstate, 2);
+    lua_pop(ls, 2);
 
     return 0;
 }
 
 int script_remove(script_action_t action) {
+    script_state_t *st;
+
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!ship_state)
         return 0;
 
-    pthread_mutex_lock(&script_mutex);
+    pthread_mutex_lock(&states_mutex);
 
     /* Make sure there's actually something registered. */
-    if(!script_ids_gate[action]) {
+    if(!script_files_gate[action]) {
         debug(DBG_WARN, "Attempt to unregister script for event %d that does "
               "not exist.\n", (int)action);
-        pthread_mutex_unlock(&script_mutex);
+        pthread_mutex_unlock(&states_mutex);
         return -1;
     }
 
-    /* Pull the scripts table out to the top of the stack and remove the
-       script reference from it. */
-    lua_rawgeti(lstate, LUA_REGISTRYINDEX, scripts_ref);
-    luaL_unref(lstate, -2, script_ids_gate[action]);
+    free(script_files_gate[action]);
+    script_files_gate[action] = NULL;
+
+    /* Take it out of every state. */
+    TAILQ_FOREACH(st, &states, qentry) {
+        pthread_mutex_lock(&st->mutex);
+        unload_script(st, &st->script_ids_gate[action]);
+        update_events(st);
+        pthread_mutex_unlock(&st->mutex);
+    }
 
-    /* Pop off the scripts table, clear out the id stored in the script_ids_gate
-       array, and unlock the mutex to finish up. */
-    lua_pop(lstate, 1);
-    script_ids_gate[action] = 0;
-    pthread_mutex_unlock(&script_mutex);
+    pthread_mutex_unlock(&states_mutex);
 
     return 0;
 }
 
 int script_remove_lobby_locked(lobby_t *l, script_action_t action) {
+    script_state_t *st = block_state(l->block);
+
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!st)
         return 0;
 
     /* Make sure there's actually something registered. */
@@ -267,22 +511,27 @@ int script_remove_lobby_locked(lobby_t *l, script_action_t action) {
 
     /* Pull the scripts table out to the top of the stack and remove the
        script reference from it. */
-    lua_rawgeti(lstate, LUA_REGISTRYINDEX, l->script_table);
-    luaL_unref(lstate, -2, l->script_ids[action]);
+    pthread_mutex_lock(&st->mutex);
+    lua_rawgeti(st->l, LUA_REGISTRYINDEX, l->script_table);
+    luaL_unref(st->l, -1, l->script_ids[action]);
 
     /* Pop off the scripts table and clear out the id stored in the lobby's
        script_ids array to finish up. */
-    lua_pop(lstate, 1);
+    lua_pop(st->l, 1);
     l->script_ids[action] = 0;
+    __atomic_and_fetch(&l->script_events, ~SCRIPT_EVENT_BIT(action),
+                       __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&st->mutex);
 
     return 0;
 }
 
 int script_remove_lobby_qfunc_locked(lobby_t *l, uint32_t id) {
+    script_state_t *st = block_state(l->block);
     lobby_qfunc_t *i;
 
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!st)
         return 0;
 
     /* Look for the requested function. Note that we do not need the _SAFE
@@ -292,13 +541,15 @@ int script_remove_lobby_qfunc_locked(lobby_t *l, uint32_t id) {
         if(i->func_id == id) {
             /* Pull the scripts table out to the top of the stack and remove the
                script reference from it, then pop the script table. */
-            lua_rawgeti(lstate, LUA_REGISTRYINDEX, l->script_table);
-            luaL_unref(lstate, -2, i->script_id);
-            lua_pop(lstate, 1);
+            pthread_mutex_lock(&st->mutex);
+            lua_rawgeti(st->l, LUA_REGISTRYINDEX, l->script_table);
+            luaL_unref(st->l, -1, i->script_id);
+            lua_pop(st->l, 1);
+            pthread_mutex_unlock(&st->mutex);
 
-            /* Now remove it from the list and clean up. */
+            /* Now remove it from the list and keep it around for reuse. */
             SLIST_REMOVE(&l->qfunc_list, i, lobby_qfunc, entry);
-            free(i);
+            SLIST_INSERT_HEAD(&l->qfunc_free, i, entry);
 
             return 0;
         }
@@ -312,35 +563,64 @@ int script_remove_lobby_qfunc_locked(lobby_t *l, uint32_t id) {
 }
 
 int script_cleanup_lobby_locked(lobby_t *l) {
-    lobby_qfunc_t *j, *tmp;
-
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!block_state(l->block))
         return 0;
 
     /* Unreference the script table for the lobby/team. This will cause all the
        elements in the table to be marked for collection. */
-    luaL_unref(lstate, LUA_REGISTRYINDEX, l->script_table);
+    __atomic_store_n(&l->script_events, 0, __ATOMIC_RELEASE);
+    script_table_free(l->block, l->script_table);
+    l->script_table = 0;
 
-    /* Clean up the linked list of quest functions, if any were allocated. */
-    j = SLIST_FIRST(&l->qfunc_list);
-    while(j) {
-        tmp = SLIST_NEXT(j, entry);
-        SLIST_REMOVE_HEAD(&l->qfunc_list, entry);
-        free(j);
-        j = tmp;
-    }
+    /* The quest functions themselves are in the lobby's arena, so they go
+       along with it. */
+    SLIST_INIT(&l->qfunc_list);
+    SLIST_INIT(&l->qfunc_free);
 
     return 0;
 }
 
+int script_state_owns(block_t *b, lua_State *l) {
+    script_state_t *st = block_state(b);
+
+    return st && st->l == l;
+}
+
+int script_table_new(block_t *b) {
+    script_state_t *st = block_state(b);
+    int rv;
+
+    if(!st)
+        return 0;
+
+    pthread_mutex_lock(&st->mutex);
+    lua_newtable(st->l);
+    rv = luaL_ref(st->l, LUA_REGISTRYINDEX);
+    pthread_mutex_unlock(&st->mutex);
+
+    return rv;
+}
+
+void script_table_free(block_t *b, int ref) {
+    script_state_t *st = block_state(b);
+
+    if(!st || ref <= 0)
+        return;
+
+    pthread_mutex_lock(&st->mutex);
+    luaL_unref(st->l, LUA_REGISTRYINDEX, ref);
+    pthread_mutex_unlock(&st->mutex);
+}
+
 int script_update_module(const char *filename) {
     char *script;
     size_t size;
     char *modname, *tmp;
+    script_state_t *st;
 
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!ship_state)
         return 0;
 
     /* Chop off the extension of the filename. */
@@ -353,15 +633,23 @@ int script_update_module(const char *filename) {
 
     size = strlen(modname);
 
-    if(!(script = (char *)malloc(size + 100)))
+    if(!(script = (char *)malloc(size + 100))) {
+        free(modname);
         return -1;
+    }
 
     snprintf(script, size + 100, "package.loaded['%s'] = nil", modname);
 
-    /* Set the module search path to include the scripts/modules dir. */
-    pthread_mutex_lock(&script_mutex);
-    (void)luaL_dostring(lstate, script);
-    pthread_mutex_unlock(&script_mutex);
+    /* Make every state load the module again the next time it's needed. */
+    pthread_mutex_lock(&states_mutex);
+
+    TAILQ_FOREACH(st, &states, qentry) {
+        pthread_mutex_lock(&st->mutex);
+        (void)luaL_dostring(st->l, script);
+        pthread_mutex_unlock(&st->mutex);
+    }
+
+    pthread_mutex_unlock(&states_mutex);
     free(script);
     free(modname);
 
@@ -369,7 +657,7 @@ int script_update_module(const char *filename) {
 }
 
 /* Parse the XML for the script definitions */
-int script_eventlist_read(const char *fn) {
+static int script_eventlist_read(const char *fn) {
     xmlParserCtxtPtr cxt;
     xmlDoc *doc;
     xmlNode *n;
@@ -377,11 +665,6 @@ int script_eventlist_read(const char *fn) {
     int rv = 0;
     script_action_t idx;
 
-    /* If we're reloading, kill the old list. */
-    if(scripts_ref) {
-        luaL_unref(lstate, LUA_REGISTRYINDEX, scripts_ref);
-    }
-
     /* Create an XML Parsing context */
     cxt = xmlNewParserCtxt();
     if(!cxt) {
@@ -422,9 +705,6 @@ int script_eventlist_read(const char *fn) {
         goto err_doc;
     }
 
-    /* Create a table for storing our pre-parsed scripts in... */
-    lua_newtable(lstate);
-
     n = n->children;
     while(n) {
         if(n->type != XML_ELEMENT_NODE) {
@@ -456,23 +736,14 @@ int script_eventlist_read(const char *fn) {
             }
 
             /* Issue a warning if we're redefining something */
-            if(script_ids[idx]) {
+            if(script_files[idx]) {
                 debug(DBG_WARN, "Redefining event \"%s\" on line %hu\n",
                       (char *)event, n->line);
+                free(script_files[idx]);
             }
 
-            /* Attempt to read in the script. */
-            if(luaL_loadfile(lstate, (const char *)file) != LUA_OK) {
-                debug(DBG_WARN, "Couldn't load script \"%s\" on line %hu\n",
-                      (char *)file, n->line);
-                lua_pop(lstate, 1);
-                goto next;
-            }
-
-            /* Add the script to the Lua table. */
-            script_ids[idx] = luaL_ref(lstate, -2);
-            debug(DBG_LOG, "Script for type %s added as ID %d\n", event,
-                  script_ids[idx]);
+            /* The scripts get loaded into each state as it's made. */
+            script_files[idx] = strdup((const char *)file);
 
 next:
             /* Free the memory we allocated here... */
@@ -483,9 +754,6 @@ next:
         n = n->next;
     }
 
-    /* Store the table of scripts to the registry for later use. */
-    scripts_ref = luaL_ref(lstate, LUA_REGISTRYINDEX);
-
     /* Cleanup/error handling below... */
 err_doc:
     xmlFreeDoc(doc);
@@ -496,136 +764,231 @@ err:
     return rv;
 }
 
-void init_scripts(ship_t *s) {
-    long size = pathconf(".", _PC_PATH_MAX);
-    char *path_str, *script;
+script_state_t *script_state_create(void) {
+    script_state_t *st;
+    pthread_mutexattr_t attr;
+    char *script;
+    size_t size;
+    int i;
 
-    if(!(path_str = (char *)malloc(size))) {
-        debug(DBG_WARN, "Out of memory, bailing out!\n");
-        return;
-    }
-    else if(!getcwd(path_str, size)) {
-        debug(DBG_WARN, "Cannot save path, local packages will not work!\n");
+    if(!(st = (script_state_t *)malloc(sizeof(script_state_t)))) {
+        debug(DBG_ERROR, "Cannot allocate Lua state: %s\n", strerror(errno));
+        return NULL;
     }
 
-    /* Not that this should happen, but just in case... */
-    if(lstate) {
-        debug(DBG_WARN, "Attempt to initialize scripting twice!\n");
-        return;
-    }
+    memset(st, 0, sizeof(script_state_t));
 
     /* Initialize the Lua interpreter */
-    debug(DBG_LOG, "Initializing scripting support...\n");
-    if(!(lstate = luaL_newstate())) {
+    if(!(st->l = luaL_newstate())) {
         debug(DBG_ERROR, "Cannot initialize Lua!\n");
-        return;
+        free(st);
+        return NULL;
     }
 
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&st->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    /* Let the count hook find its way back to us. */
+    *(script_state_t **)lua_getextraspace(st->l) = st;
+    lua_sethook(st->l, &count_hook, LUA_MASKCOUNT, SCRIPT_HOOK_COUNT);
+
     /* Load up the standard libraries. */
-    luaL_openlibs(lstate);
+    luaL_openlibs(st->l);
 
     /* Register various scripting libraries. */
-    luaL_requiref(lstate, "ship", ship_register_lua, 1);
-    lua_pop(lstate, 1);
-    luaL_requiref(lstate, "client", client_register_lua, 1);
-    lua_pop(lstate, 1);
-    luaL_requiref(lstate, "lobby", lobby_register_lua, 1);
-    lua_pop(lstate, 1);
+    luaL_requiref(st->l, "ship", ship_register_lua, 1);
+    lua_pop(st->l, 1);
+    luaL_requiref(st->l, "client", client_register_lua, 1);
+    lua_pop(st->l, 1);
+    luaL_requiref(st->l, "lobby", lobby_register_lua, 1);
+    lua_pop(st->l, 1);
 
-    if(path_str) {
-        size = strlen(path_str) + 100;
+    if(module_path) {
+        size = strlen(module_path) + 100;
 
         if(!(script = (char *)malloc(size)))
             debug(DBG_WARN, "Cannot save path in scripts!\n");
 
         if(script) {
             snprintf(script, size, "package.path = package.path .. "
-                     "\";%s/scripts/modules/?.lua\"", path_str);
+                     "\";%s/scripts/modules/?.lua\"", module_path);
 
             /* Set the module search path to include the scripts/modules dir. */
-            (void)luaL_dostring(lstate, script);
+            (void)luaL_dostring(st->l, script);
             free(script);
         }
+    }
+
+    /* Make the table that ship.getTable() hands out in this state. */
+    lua_newtable(st->l);
+    lua_setfield(st->l, LUA_REGISTRYINDEX, SCRIPT_SHIP_TABLE);
 
-        free(path_str);
+    /* Make a table for storing our pre-parsed scripts in... */
+    lua_newtable(st->l);
+    st->scripts_ref = luaL_ref(st->l, LUA_REGISTRYINDEX);
+
+    /* Load all the scripts that we know about already. */
+    pthread_mutex_lock(&states_mutex);
+
+    for(i = 0; i < ScriptActionCount; ++i) {
+        if(script_files[i] && load_script(st, &st->script_ids[i],
+                                          script_files[i]))
+            debug(DBG_WARN, "Couldn't load script \"%s\"\n", script_files[i]);
+
+        if(script_files_gate[i] && load_script(st, &st->script_ids_gate[i],
+                                               script_files_gate[i]))
+            debug(DBG_WARN, "Couldn't load script \"%s\"\n",
+                  script_files_gate[i]);
     }
 
-    /* Read in the configuration into our script table */
+    update_events(st);
+
+    TAILQ_INSERT_TAIL(&states, st, qentry);
+    pthread_mutex_unlock(&states_mutex);
+
+    return st;
+}
+
+void script_state_destroy(script_state_t *st) {
+    if(!st)
+        return;
+
+    pthread_mutex_lock(&states_mutex);
+    TAILQ_REMOVE(&states, st, qentry);
+    pthread_mutex_unlock(&states_mutex);
+
+    /* For good measure, remove the scripts table from the registry. This
+       should garbage collect everything in it, I hope. */
+    luaL_unref(st->l, LUA_REGISTRYINDEX, st->scripts_ref);
+    lua_close(st->l);
+
+    pthread_mutex_destroy(&st->mutex);
+    free(st);
+}
+
+void init_scripts(ship_t *s) {
+    long size = pathconf(".", _PC_PATH_MAX);
+    int i;
+
+    /* Not that this should happen, but just in case... */
+    if(ship_state) {
+        debug(DBG_WARN, "Attempt to initialize scripting twice!\n");
+        return;
+    }
+
+    if(!(module_path = (char *)malloc(size))) {
+        debug(DBG_WARN, "Out of memory, bailing out!\n");
+        return;
+    }
+    else if(!getcwd(module_path, size)) {
+        debug(DBG_WARN, "Cannot save path, local packages will not work!\n");
+        free(module_path);
+        module_path = NULL;
+    }
+
+    debug(DBG_LOG, "Initializing scripting support...\n");
+
+    /* Read in the configuration, so that every state can load the scripts. */
     if(script_eventlist_read(s->cfg->scripts_file)) {
         debug(DBG_WARN, "Couldn't load scripts configuration!\n");
-
-        /* Make a scripts table, in case the gate sends us some later. */
-        lua_newtable(lstate);
-        scripts_ref = luaL_ref(lstate, LUA_REGISTRYINDEX);
     }
     else {
         debug(DBG_LOG, "Read script configuration\n");
+
+        for(i = 0; i < ScriptActionCount; ++i) {
+            if(script_files[i])
+                debug(DBG_LOG, "Script for type %s is %s\n",
+                      (const char *)script_action_text[i], script_files[i]);
+        }
     }
 
-    s->lstate = lstate;
+    /* Make the state for everything that isn't on a block. The blocks make
+       their own when they start up. */
+    if(!(ship_state = script_state_create()))
+        return;
+
+    s->scripts = ship_state;
 }
 
 void cleanup_scripts(ship_t *s) {
     int i;
+    script_shared_t *j, *tmp;
 
-    if(lstate) {
-        /* For good measure, remove the scripts table from the registry. This
-           should garbage collect everything in it, I hope. */
-        if(scripts_ref)
-            luaL_unref(lstate, LUA_REGISTRYINDEX, scripts_ref);
-
-        lua_close(lstate);
+    if(ship_state) {
+        script_state_destroy(ship_state);
 
         /* Clean everything back to a sensible state. */
-        lstate = NULL;
-        scripts_ref = 0;
-        for(i = 0; i < ScriptActionCount; ++i) {
-            script_ids[i] = 0;
-            script_ids_gate[i] = 0;
-        }
+        ship_state = NULL;
+        s->scripts = NULL;
+    }
+
+    for(i = 0; i < ScriptActionCount; ++i) {
+        free(script_files[i]);
+        free(script_files_gate[i]);
+        script_files[i] = NULL;
+        script_files_gate[i] = NULL;
+    }
+
+    free(module_path);
+    module_path = NULL;
 
-        s->lstate = NULL;
+    pthread_mutex_lock(&shared_mutex);
+
+    j = TAILQ_FIRST(&shared_data);
+    while(j) {
+        tmp = TAILQ_NEXT(j, qentry);
+        free(j->key);
+        free(j->sval);
+        free(j);
+        j = tmp;
     }
+
+    TAILQ_INIT(&shared_data);
+    pthread_mutex_unlock(&shared_mutex);
 }
 
-static lua_Integer exec_pkt(int scr, script_action_t event, ship_client_t *c,
+static lua_Integer exec_pkt(script_state_t *st, int scr, int src,
+                            script_action_t event, ship_client_t *c,
                             const void *pkt, uint16_t len) {
+    lua_State *ls = st->l;
     lua_Integer rv = 0;
     int err;
     const char *errmsg;
 
     /* There is an script defined, grab it from the table. */
-    lua_rawgeti(lstate, -1, scr);
+    lua_rawgeti(ls, -1, scr);
 
     /* Now, push the arguments onto the stack. First up is a light userdata
        for the client object. */
-    lua_pushlightuserdata(lstate, c);
+    lua_pushlightuserdata(ls, c);
 
     /* Next is a string of the packet itself. */
-    lua_pushlstring(lstate, (const char *)pkt, (size_t)len);
+    lua_pushlstring(ls, (const char *)pkt, (size_t)len);
 
     /* Done with that, call the function. */
-    if((err = lua_pcall(lstate, 2, 1, 0)) != LUA_OK) {
+    if((err = run_script(st, event, src, 2, 1)) != LUA_OK) {
         debug(DBG_ERROR, "Error running Lua script for event %d (%d)\n",
               (int)event, err);
 
-        if((errmsg = lua_tostring(lstate, -1))) {
+        if((errmsg = lua_tostring(ls, -1))) {
             debug(DBG_ERROR, "Error message:\n%s\n", errmsg);
         }
 
-        lua_pop(lstate, 1);
+        lua_pop(ls, 1);
         goto out;
     }
 
     /* Grab the return value from the lua function (it should be of type
        integer). */
-    rv = lua_tointegerx(lstate, -1, &err);
+    rv = lua_tointegerx(ls, -1, &err);
     if(!err) {
         debug(DBG_ERROR, "Script for event %d didn't return int\n", (int)event);
     }
 
     /* Pop off the return value. */
-    lua_pop(lstate, 1);
+    lua_pop(ls, 1);
 
 out:
     return rv;
@@ -634,40 +997,48 @@ out:
 int script_execute_pkt(script_action_t event, ship_client_t *c, const void *pkt,
                        uint16_t len) {
     lua_Integer grv = 0, lrv = 0;
+    script_state_t *st = client_state(c);
 
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!st)
         return 0;
 
-    pthread_mutex_lock(&script_mutex);
+    /* Don't bother locking anything if there's nothing to run. */
+    if(!(state_events(st) & SCRIPT_EVENT_BIT(event)))
+        return 0;
+
+    pthread_mutex_lock(&st->mutex);
 
     /* Pull the scripts table out to the top of the stack. */
-    lua_rawgeti(lstate, LUA_REGISTRYINDEX, scripts_ref);
+    lua_rawgeti(st->l, LUA_REGISTRYINDEX, st->scripts_ref);
 
     /* See if there's a script event defined by the shipgate. */
-    if(script_ids_gate[event])
-        grv = exec_pkt(script_ids_gate[event], event, c, pkt, len);
+    if(st->script_ids_gate[event])
+        grv = exec_pkt(st, st->script_ids_gate[event], SCRIPT_SRC_GATE, event,
+                       c, pkt, len);
 
     /* See if there's a script event defined locally */
-    if(script_ids[event])
-        lrv = exec_pkt(script_ids[event], event, c, pkt, len);
+    if(st->script_ids[event])
+        lrv = exec_pkt(st, st->script_ids[event], SCRIPT_SRC_LOCAL, event,
+                       c, pkt, len);
 
     /* Pop off the table reference that we pushed up above. */
-    lua_pop(lstate, 1);
-    pthread_mutex_unlock(&script_mutex);
+    lua_pop(st->l, 1);
+    pthread_mutex_unlock(&st->mutex);
 
     /* Return success if either script ran and returned success. */
     return (int)(grv | lrv);
 }
 
-static lua_Integer push_args_and_exec(int scr, script_action_t event,
-                                      va_list ap) {
+static lua_Integer push_args_and_exec(script_state_t *st, int scr, int src,
+                                      script_action_t event, va_list ap) {
+    lua_State *ls = st->l;
     lua_Integer rv = 0;
     int err = 0, argtype, argcount = 0;
     const char *errmsg;
 
     /* Push the script that we're looking at onto the stack. */
-    lua_rawgeti(lstate, -1, scr);
+    lua_rawgeti(ls, -1, scr);
 
     /* Now, push the arguments onto the stack. */
     while((argtype = va_arg(ap, int))) {
@@ -676,7 +1047,7 @@ static lua_Integer push_args_and_exec(int scr, script_action_t event,
             {
                 int arg = va_arg(ap, int);
                 lua_Integer larg = (lua_Integer)arg;
-                lua_pushinteger(lstate, larg);
+                lua_pushinteger(ls, larg);
                 break;
             }
 
@@ -684,7 +1055,7 @@ static lua_Integer push_args_and_exec(int scr, script_action_t event,
             {
                 uint8_t arg = (uint8_t)va_arg(ap, int);
                 lua_Integer larg = (lua_Integer)arg;
-                lua_pushinteger(lstate, larg);
+                lua_pushinteger(ls, larg);
                 break;
             }
 
@@ -692,7 +1063,7 @@ static lua_Integer push_args_and_exec(int scr, script_action_t event,
             {
                 uint16_t arg = (uint16_t)va_arg(ap, int);
                 lua_Integer larg = (lua_Integer)arg;
-                lua_pushinteger(lstate, larg);
+                lua_pushinteger(ls, larg);
                 break;
             }
 
@@ -700,7 +1071,7 @@ static lua_Integer push_args_and_exec(int scr, script_action_t event,
             {
                 uint32_t arg = va_arg(ap, uint32_t);
                 lua_Integer larg = (lua_Integer)arg;
-                lua_pushinteger(lstate, larg);
+                lua_pushinteger(ls, larg);
                 break;
             }
 
@@ -708,14 +1079,14 @@ static lua_Integer push_args_and_exec(int scr, script_action_t event,
             {
                 double arg = va_arg(ap, double);
                 lua_Number larg = (lua_Number)arg;
-                lua_pushnumber(lstate, larg);
+                lua_pushnumber(ls, larg);
                 break;
             }
 
             case SCRIPT_ARG_PTR:
             {
                 void *arg = va_arg(ap, void *);
-                lua_pushlightuserdata(lstate, arg);
+                lua_pushlightuserdata(ls, arg);
                 break;
             }
 
@@ -723,21 +1094,21 @@ static lua_Integer push_args_and_exec(int scr, script_action_t event,
             {
                 size_t len = va_arg(ap, size_t);
                 char *str = va_arg(ap, char *);
-                lua_pushlstring(lstate, str, len);
+                lua_pushlstring(ls, str, len);
                 break;
             }
 
             case SCRIPT_ARG_CSTRING:
             {
                 char *str = va_arg(ap, char *);
-                lua_pushstring(lstate, str);
+                lua_pushstring(ls, str);
                 break;
             }
 
             default:
                 /* Fix the stack and stop trying to parse now... */
                 debug(DBG_WARN, "Invalid script argument type: %d\n", argtype);
-                lua_pop(lstate, argcount);
+                lua_pop(ls, argcount + 1);
                 rv = 0;
                 goto out;
         }
@@ -746,85 +1117,130 @@ static lua_Integer push_args_and_exec(int scr, script_action_t event,
     }
 
     /* Done with that, call the function. */
-    if((err = lua_pcall(lstate, argcount, 1, 0)) != LUA_OK) {
+    if((err = run_script(st, event, src, argcount, 1)) != LUA_OK) {
         debug(DBG_ERROR, "Error running Lua script for event %d (%d)\n",
               (int)event, err);
 
-        if((errmsg = lua_tostring(lstate, -1))) {
+        if((errmsg = lua_tostring(ls, -1))) {
             debug(DBG_ERROR, "Error message:\n%s\n", errmsg);
         }
 
-        lua_pop(lstate, 1);
+        lua_pop(ls, 1);
         goto out;
     }
 
     /* Grab the return value from the lua function (it should be of type
        integer). */
-    rv = lua_tointegerx(lstate, -1, &err);
+    rv = lua_tointegerx(ls, -1, &err);
     if(!err) {
         debug(DBG_ERROR, "Script for event %d didn't return int\n", (int)event);
     }
 
     /* Pop off the return value. */
-    lua_pop(lstate, 1);
+    lua_pop(ls, 1);
 
 out:
     return rv;
 }
 
-int script_execute(script_action_t event, ship_client_t *c, ...) {
+/* Run the scripts for an event in the given state, along with the event
+   callback set on the lobby, if there is one. */
+static int execute_va(script_state_t *st, script_action_t event, lobby_t *l,
+                      va_list ap) {
     lua_Integer llrv = 0, lrv = 0, grv = 0;
-    va_list ap;
+    va_list aq;
+    int lid = 0;
 
-    /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    /* Don't bother locking anything if there's nothing to run. */
+    if(!((state_events(st) | lobby_events(l)) & SCRIPT_EVENT_BIT(event)))
         return 0;
 
-    pthread_mutex_lock(&script_mutex);
+    pthread_mutex_lock(&st->mutex);
+
+    if(l && l->script_ids)
+        lid = l->script_ids[event];
 
     /* Pull the scripts table out to the top of the stack. */
-    lua_rawgeti(lstate, LUA_REGISTRYINDEX, scripts_ref);
+    lua_rawgeti(st->l, LUA_REGISTRYINDEX, st->scripts_ref);
 
     /* See if there's a script event defined by the gate */
-    if(script_ids_gate[event]) {
-        va_start(ap, c);
-        grv = push_args_and_exec(script_ids_gate[event], event, ap);
-        va_end(ap);
+    if(st->script_ids_gate[event]) {
+        va_copy(aq, ap);
+        grv = push_args_and_exec(st, st->script_ids_gate[event],
+                                 SCRIPT_SRC_GATE, event, aq);
+        va_end(aq);
     }
 
     /* See if there's a script event defined locally */
-    if(script_ids[event]) {
-        va_start(ap, c);
-        lrv = push_args_and_exec(script_ids[event], event, ap);
-        va_end(ap);
+    if(st->script_ids[event]) {
+        va_copy(aq, ap);
+        lrv = push_args_and_exec(st, st->script_ids[event], SCRIPT_SRC_LOCAL,
+                                 event, aq);
+        va_end(aq);
     }
 
-    /* See if there is a team-defined event. */
-    if(c && c->cur_lobby && c->cur_lobby->script_ids) {
-        if(c->cur_lobby->script_ids[event]) {
-            va_start(ap, c);
-            llrv = push_args_and_exec(c->cur_lobby->script_ids[event], event,
-                                      ap);
-            va_end(ap);
-        }
+    /* See if there is a team-defined event. These live in the lobby's own
+       table, not the main one. */
+    if(lid) {
+        lua_rawgeti(st->l, LUA_REGISTRYINDEX, l->script_table);
+        va_copy(aq, ap);
+        llrv = push_args_and_exec(st, lid, SCRIPT_SRC_LOBBY, event, aq);
+        va_end(aq);
+        lua_pop(st->l, 1);
     }
 
     /* Pop off the table reference that we pushed up above. */
-    lua_pop(lstate, 1);
-    pthread_mutex_unlock(&script_mutex);
+    lua_pop(st->l, 1);
+    pthread_mutex_unlock(&st->mutex);
     return (int)(llrv | lrv | grv);
 }
 
+int script_execute(script_action_t event, ship_client_t *c, ...) {
+    script_state_t *st = client_state(c);
+    va_list ap;
+    int rv;
+
+    /* Can't do anything if we don't have any scripts loaded. */
+    if(!st)
+        return 0;
+
+    va_start(ap, c);
+    rv = execute_va(st, event, c ? c->cur_lobby : NULL, ap);
+    va_end(ap);
+
+    return rv;
+}
+
+int script_execute_lobby(script_action_t event, lobby_t *l, ...) {
+    script_state_t *st = block_state(l->block);
+    va_list ap;
+    int rv;
+
+    /* Can't do anything if we don't have any scripts loaded. */
+    if(!st)
+        return 0;
+
+    va_start(ap, l);
+    rv = execute_va(st, event, NULL, ap);
+    va_end(ap);
+
+    return rv;
+}
+
 uint32_t script_execute_qfunc(ship_client_t *c, lobby_t *l) {
+    script_state_t *st = block_state(l->block);
+    lua_State *ls;
     lobby_qfunc_t *i;
     int j, err;
     lua_Integer rv;
     const char *errmsg;
 
     /* Can't do anything if we don't have any scripts loaded. */
-    if(!scripts_ref)
+    if(!st)
         return QUEST_FUNC_RET_INVALID_FUNC;
 
+    ls = st->l;
+
     /* Look for the requested function. */
     SLIST_FOREACH(i, &l->qfunc_list, entry) {
         if(i->func_id == c->q_stack[0]) {
@@ -841,53 +1257,54 @@ uint32_t script_execute_qfunc(ship_client_t *c, lobby_t *l) {
                     return QUEST_FUNC_RET_INVALID_REGISTER;
             }
 
-            /* We're gonna do a script if we get here, so... lock the mutex */
-            pthread_mutex_lock(&script_mutex);
+            /* We're gonna do a script if we get here, so... lock the state */
+            pthread_mutex_lock(&st->mutex);
 
             /* Pull the scripts table out to the top of the stack. */
-            lua_rawgeti(lstate, LUA_REGISTRYINDEX, l->script_table);
+            lua_rawgeti(ls, LUA_REGISTRYINDEX, l->script_table);
 
             /* Push the script that we're looking at onto the stack. */
-            lua_rawgeti(lstate, -1, i->script_id);
+            lua_rawgeti(ls, -1, i->script_id);
 
             /* Push the client and lobby structures */
-            lua_pushlightuserdata(lstate, c);
-            lua_pushlightuserdata(lstate, l);
+            lua_pushlightuserdata(ls, c);
+            lua_pushlightuserdata(ls, l);
 
             /* Build a table for the arguments */
-            lua_createtable(lstate, i->nargs, 0);
+            lua_createtable(ls, i->nargs, 0);
 
             for(j = 0; j < i->nargs; ++j) {
-                lua_pushinteger(lstate, j + 1);
-                lua_pushinteger(lstate, c->q_stack[j + 3]);
-                lua_settable(lstate, -3);
+                lua_pushinteger(ls, j + 1);
+                lua_pushinteger(ls, c->q_stack[j + 3]);
+                lua_settable(ls, -3);
             }
 
             /* Do the same for the returns */
-            lua_createtable(lstate, i->nretvals, 0);
+            lua_createtable(ls, i->nretvals, 0);
 
             for(j = 0; j < i->nretvals; ++j) {
-                lua_pushinteger(lstate, j + 1);
-                lua_pushinteger(lstate, c->q_stack[j + i->nargs + 3]);
-                lua_settable(lstate, -3);
+                lua_pushinteger(ls, j + 1);
+                lua_pushinteger(ls, c->q_stack[j + i->nargs + 3]);
+                lua_settable(ls, -3);
             }
 
             /* Done with that, call the function. */
-            if((err = lua_pcall(lstate, 4, 1, 0)) != LUA_OK) {
+            if((err = run_script(st, SCRIPT_SLOT_QFUNC, SCRIPT_SRC_LOBBY, 4,
+                                 1)) != LUA_OK) {
                 debug(DBG_ERROR, "Error running Lua script for qfunc %" PRIu32
                       " (%d)\n", i->func_id, err);
 
-                if((errmsg = lua_tostring(lstate, -1))) {
+                if((errmsg = lua_tostring(ls, -1))) {
                     debug(DBG_ERROR, "Error message:\n%s\n", errmsg);
                 }
 
-                lua_pop(lstate, 1);
+                lua_pop(ls, 1);
                 rv = QUEST_FUNC_RET_SCRIPT_ERROR;
             }
             else {
                 /* Grab the return value from the lua function (it should be of
                    type integer). */
-                rv = lua_tointegerx(lstate, -1, &err);
+                rv = lua_tointegerx(ls, -1, &err);
                 if(!err) {
                     debug(DBG_ERROR, "Script for qfunc %" PRIu32 " didn't "
                           "return an integer!\n", i->func_id);
@@ -895,12 +1312,12 @@ uint32_t script_execute_qfunc(ship_client_t *c, lobby_t *l) {
                 }
 
                 /* Pop off the return value. */
-                lua_pop(lstate, 1);
+                lua_pop(ls, 1);
             }
 
             /* Pop off the table reference that we pushed up above. */
-            lua_pop(lstate, 1);
-            pthread_mutex_unlock(&script_mutex);
+            lua_pop(ls, 1);
+            pthread_mutex_unlock(&st->mutex);
 
             return (uint32_t)rv;
         }
@@ -911,45 +1328,285 @@ uint32_t script_execute_qfunc(ship_client_t *c, lobby_t *l) {
 }
 
 int script_execute_file(const char *fn, lobby_t *l) {
+    script_state_t *st = block_state(l->block);
     lua_Integer rv;
     int err;
 
     /* Can't do anything if we can't run scripts. */
-    if(!scripts_ref)
+    if(!st)
         return -1;
 
-    pthread_mutex_lock(&script_mutex);
+    pthread_mutex_lock(&st->mutex);
 
     /* Attempt to read in the script. */
-    if(luaL_loadfile(lstate, (const char *)fn) != LUA_OK) {
+    if(luaL_loadfile(st->l, (const char *)fn) != LUA_OK) {
         debug(DBG_WARN, "Couldn't load script '%s'\n", fn);
-        lua_pop(lstate, 1);
+        lua_pop(st->l, 1);
+        pthread_mutex_unlock(&st->mutex);
         return -1;
     }
 
     /* Push the lobby structure for the team to the stack. */
-    lua_pushlightuserdata(lstate, l);
+    lua_pushlightuserdata(st->l, l);
 
     /* Run the script. */
-    if(lua_pcall(lstate, 1, 1, 0) != LUA_OK) {
+    if(run_script(st, SCRIPT_SLOT_FILE, SCRIPT_SRC_LOBBY, 1, 1) != LUA_OK) {
         debug(DBG_ERROR, "Error running Lua script '%s'\n", fn);
-        lua_pop(lstate, 1);
+        lua_pop(st->l, 1);
+        pthread_mutex_unlock(&st->mutex);
         return -1;
     }
 
     /* Grab the return value from the lua function (it should be of type
        integer). */
-    rv = lua_tointegerx(lstate, -1, &err);
+    rv = lua_tointegerx(st->l, -1, &err);
     if(!err) {
         debug(DBG_ERROR, "Script '%s' didn't return int\n", fn);
     }
 
     /* Pop off the return value. */
-    lua_pop(lstate, 1);
+    lua_pop(st->l, 1);
+    pthread_mutex_unlock(&st->mutex);
 
     return (int)rv;
 }
 
+void script_stats_read(script_stats_t out[SCRIPT_SLOT_COUNT][SCRIPT_SRC_COUNT]) {
+    script_stats_t *s, *o;
+    int i, j;
+
+    for(i = 0; i < SCRIPT_SLOT_COUNT; ++i) {
+        for(j = 0; j < SCRIPT_SRC_COUNT; ++j) {
+            s = &stats[i][j];
+            o = &out[i][j];
+
+            o->calls = __atomic_load_n(&s->calls, __ATOMIC_RELAXED);
+            o->total_ns = __atomic_load_n(&s->total_ns, __ATOMIC_RELAXED);
+            o->max_ns = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+            o->insns = __atomic_load_n(&s->insns, __ATOMIC_RELAXED);
+            o->aborts = __atomic_load_n(&s->aborts, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void script_stats_reset(void) {
+    script_stats_t *s;
+    int i, j;
+
+    for(i = 0; i < SCRIPT_SLOT_COUNT; ++i) {
+        for(j = 0; j < SCRIPT_SRC_COUNT; ++j) {
+            s = &stats[i][j];
+
+            __atomic_store_n(&s->calls, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&s->total_ns, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&s->max_ns, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&s->insns, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&s->aborts, 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void script_set_budget(uint32_t insns) {
+    __atomic_store_n(&insn_budget, insns, __ATOMIC_RELAXED);
+}
+
+uint32_t script_get_budget(void) {
+    return __atomic_load_n(&insn_budget, __ATOMIC_RELAXED);
+}
+
+/* ship.scriptStats(): Returns an array of tables, one for each script that has
+   been run since the stats were last reset, with the fields event, source,
+   calls, total and max (both in seconds), instructions, and aborts. */
+int script_stats_lua(lua_State *l) {
+    script_stats_t *all, *s;
+    int i, j, n = 0;
+
+    if(!(all = (script_stats_t *)malloc(sizeof(script_stats_t) *
+                                        SCRIPT_SLOT_COUNT *
+                                        SCRIPT_SRC_COUNT))) {
+        lua_pushnil(l);
+        return 1;
+    }
+
+    script_stats_read((script_stats_t (*)[SCRIPT_SRC_COUNT])all);
+    lua_newtable(l);
+
+    for(i = 0; i < SCRIPT_SLOT_COUNT; ++i) {
+        for(j = 0; j < SCRIPT_SRC_COUNT; ++j) {
+            s = &all[i * SCRIPT_SRC_COUNT + j];
+
+            if(!s->calls)
+                continue;
+
+            lua_createtable(l, 0, 7);
+            lua_pushstring(l, script_slot_name(i));
+            lua_setfield(l, -2, "event");
+            lua_pushstring(l, script_source_name(j));
+            lua_setfield(l, -2, "source");
+            lua_pushinteger(l, (lua_Integer)s->calls);
+            lua_setfield(l, -2, "calls");
+            lua_pushnumber(l, (lua_Number)s->total_ns / 1000000000.0);
+            lua_setfield(l, -2, "total");
+            lua_pushnumber(l, (lua_Number)s->max_ns / 1000000000.0);
+            lua_setfield(l, -2, "max");
+            lua_pushinteger(l, (lua_Integer)s->insns);
+            lua_setfield(l, -2, "instructions");
+            lua_pushinteger(l, (lua_Integer)s->aborts);
+            lua_setfield(l, -2, "aborts");
+            lua_rawseti(l, -2, ++n);
+        }
+    }
+
+    free(all);
+    return 1;
+}
+
+/* ship.setScriptBudget(insns): Set the maximum number of instructions a script
+   may run in one call before it is aborted (0 for no limit). Returns the old
+   budget. */
+int script_budget_lua(lua_State *l) {
+    lua_Integer n;
+    int isnum;
+
+    lua_pushinteger(l, (lua_Integer)script_get_budget());
+    n = lua_tointegerx(l, 1, &isnum);
+
+    if(isnum && n >= 0 && n <= UINT32_MAX)
+        script_set_budget((uint32_t)n);
+
+    return 1;
+}
+
+int script_ship_table_lua(lua_State *l) {
+    lua_getfield(l, LUA_REGISTRYINDEX, SCRIPT_SHIP_TABLE);
+    return 1;
+}
+
+/* ship.getShared(key): Look up a value that was stored with ship.setShared()
+   from any block. Only booleans, numbers and strings can be shared, since the
+   states can't see each other's tables. */
+int script_shared_get_lua(lua_State *l) {
+    const char *key;
+    script_shared_t *i;
+
+    if(!(key = lua_tostring(l, 1))) {
+        lua_pushnil(l);
+        return 1;
+    }
+
+    pthread_mutex_lock(&shared_mutex);
+
+    TAILQ_FOREACH(i, &shared_data, qentry) {
+        if(!strcmp(i->key, key))
+            break;
+    }
+
+    if(!i)
+        lua_pushnil(l);
+    else if(i->type == LUA_TBOOLEAN)
+        lua_pushboolean(l, (int)i->ival);
+    else if(i->type == LUA_TSTRING)
+        lua_pushlstring(l, i->sval, i->slen);
+    else if(i->is_int)
+        lua_pushinteger(l, i->ival);
+    else
+        lua_pushnumber(l, i->nval);
+
+    pthread_mutex_unlock(&shared_mutex);
+    return 1;
+}
+
+/* ship.setShared(key, value): Store a value for every block to see. Setting a
+   key to nil removes it. Returns true on success. */
+int script_shared_set_lua(lua_State *l) {
+    const char *key, *str = NULL;
+    script_shared_t *i;
+    int type = lua_type(l, 2);
+    size_t len = 0;
+    char *sval = NULL;
+
+    if(!(key = lua_tostring(l, 1)) ||
+       (type != LUA_TNIL && type != LUA_TBOOLEAN && type != LUA_TNUMBER &&
+        type != LUA_TSTRING)) {
+        lua_pushboolean(l, 0);
+        return 1;
+    }
+
+    /* Copy the string before taking the lock, so we don't hold it while
+       allocating memory. */
+    if(type == LUA_TSTRING) {
+        str = lua_tolstring(l, 2, &len);
+
+        if(!(sval = (char *)malloc(len + 1))) {
+            lua_pushboolean(l, 0);
+            return 1;
+        }
+
+        memcpy(sval, str, len);
+        sval[len] = '\0';
+    }
+
+    pthread_mutex_lock(&shared_mutex);
+
+    TAILQ_FOREACH(i, &shared_data, qentry) {
+        if(!strcmp(i->key, key))
+            break;
+    }
+
+    if(type == LUA_TNIL) {
+        if(i) {
+            TAILQ_REMOVE(&shared_data, i, qentry);
+            free(i->key);
+            free(i->sval);
+            free(i);
+        }
+
+        pthread_mutex_unlock(&shared_mutex);
+        lua_pushboolean(l, 1);
+        return 1;
+    }
+
+    if(!i) {
+        if(!(i = (script_shared_t *)malloc(sizeof(script_shared_t))))
+            goto err;
+
+        memset(i, 0, sizeof(script_shared_t));
+
+        if(!(i->key = strdup(key))) {
+            free(i);
+            goto err;
+        }
+
+        TAILQ_INSERT_TAIL(&shared_data, i, qentry);
+    }
+
+    free(i->sval);
+    i->sval = sval;
+    i->slen = len;
+    i->type = type;
+    i->is_int = 0;
+
+    if(type == LUA_TBOOLEAN) {
+        i->ival = lua_toboolean(l, 2);
+    }
+    else if(type == LUA_TNUMBER) {
+        if((i->is_int = lua_isinteger(l, 2)))
+            i->ival = lua_tointeger(l, 2);
+        else
+            i->nval = lua_tonumber(l, 2);
+    }
+
+    pthread_mutex_unlock(&shared_mutex);
+    lua_pushboolean(l, 1);
+    return 1;
+
+err:
+    pthread_mutex_unlock(&shared_mutex);
+    free(sval);
+    lua_pushboolean(l, 0);
+    return 1;
+}
+
 #else
 
 void init_scripts(ship_t *s) {
@@ -975,6 +1632,56 @@ int script_execute(script_action_t event, ship_client_t *c, ...) {
     return 0;
 }
 
+int script_execute_lobby(script_action_t event, lobby_t *l, ...) {
+    (void)event;
+    (void)l;
+    return 0;
+}
+
+script_state_t *script_state_create(void) {
+    return NULL;
+}
+
+const char *script_slot_name(int slot) {
+    (void)slot;
+    return "UNKNOWN";
+}
+
+const char *script_source_name(int src) {
+    (void)src;
+    return "unknown";
+}
+
+void script_stats_read(script_stats_t out[SCRIPT_SLOT_COUNT][SCRIPT_SRC_COUNT]) {
+    memset(out, 0, sizeof(script_stats_t) * SCRIPT_SLOT_COUNT *
+           SCRIPT_SRC_COUNT);
+}
+
+void script_stats_reset(void) {
+}
+
+void script_set_budget(uint32_t insns) {
+    (void)insns;
+}
+
+uint32_t script_get_budget(void) {
+    return 0;
+}
+
+void script_state_destroy(script_state_t *st) {
+    (void)st;
+}
+
+int script_table_new(block_t *b) {
+    (void)b;
+    return 0;
+}
+
+void script_table_free(block_t *b, int ref) {
+    (void)b;
+    (void)ref;
+}
+
 uint32_t script_execute_qfunc(ship_client_t *c, lobby_t *l) {
     (void)c;
     (void)l;
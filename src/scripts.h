@@ -55,6 +55,29 @@ typedef enum script_action {
     ScriptActionCount
 } script_action_t;
 
+/* Bit for an event in the bitmaps of events that have scripts attached. */
+#define SCRIPT_EVENT_BIT(e) (UINT32_C(1) << (e))
+
+/* Where a script that was run came from. */
+#define SCRIPT_SRC_LOCAL    0
+#define SCRIPT_SRC_GATE     1
+#define SCRIPT_SRC_LOBBY    2
+#define SCRIPT_SRC_COUNT    3
+
+/* Slots that profiling information is kept in. There is one for each event,
+   and two more for quest functions and team script files. */
+#define SCRIPT_SLOT_QFUNC   ScriptActionCount
+#define SCRIPT_SLOT_FILE    (ScriptActionCount + 1)
+#define SCRIPT_SLOT_COUNT   (ScriptActionCount + 2)
+
+typedef struct script_stats {
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t insns;
+    uint64_t aborts;
+} script_stats_t;
+
 /* Argument types. */
 #define SCRIPT_ARG_NONE     0
 #define SCRIPT_ARG_END      SCRIPT_ARG_NONE
@@ -67,9 +90,20 @@ typedef enum script_action {
 #define SCRIPT_ARG_STRING   7               /* Length-prepended string */
 #define SCRIPT_ARG_CSTRING  8               /* NUL-terminated string */
 
+/* Each block has its own Lua state, and the ship has one for everything else.
+   The scripts for an event run in the state of the block the client (or lobby)
+   is on. */
+#ifndef SCRIPT_STATE_DEFINED
+#define SCRIPT_STATE_DEFINED
+typedef struct script_state script_state_t;
+#endif
+
 /* Call the script function for the given event with the args listed */
 int script_execute(script_action_t event, ship_client_t *c, ...);
 
+/* Same as above, but for events that have a lobby and no client. */
+int script_execute_lobby(script_action_t event, lobby_t *l, ...);
+
 /* Call the script function for the given event that involves an unknown pkt */
 int script_execute_pkt(script_action_t event, ship_client_t *c, const void *pkt,
                        uint16_t len);
@@ -80,6 +114,22 @@ uint32_t script_execute_qfunc(ship_client_t *c, lobby_t *l);
 void init_scripts(ship_t *s);
 void cleanup_scripts(ship_t *s);
 
+/* Create or destroy the Lua state for a block. This must be done after
+   init_scripts() and before cleanup_scripts(). */
+script_state_t *script_state_create(void);
+void script_state_destroy(script_state_t *st);
+
+/* Create or free a table in the registry of the state for the given block (or
+   the ship's state, if b is NULL), for storing per-client or per-lobby data. */
+int script_table_new(block_t *b);
+void script_table_free(block_t *b, int ref);
+
+#ifdef ENABLE_LUA
+/* Returns non-zero if l is the Lua state used for things on block b. Tables
+   made with script_table_new() can only be used from that state. */
+int script_state_owns(block_t *b, lua_State *l);
+#endif
+
 int script_add(script_action_t action, const char *filename);
 int script_add_lobby_locked(lobby_t *l, script_action_t action);
 int script_add_lobby_qfunc_locked(lobby_t *l, uint32_t id, int args, int rvs);
@@ -91,4 +141,25 @@ int script_update_module(const char *modname);
 
 int script_execute_file(const char *fn, lobby_t *l);
 
+/* Profiling information, added up over all of the Lua states. */
+void script_stats_read(script_stats_t out[SCRIPT_SLOT_COUNT][SCRIPT_SRC_COUNT]);
+void script_stats_reset(void);
+const char *script_slot_name(int slot);
+const char *script_source_name(int src);
+
+/* Set or read the maximum number of instructions that a script can run in one
+   call before it is aborted. 0 means there is no limit. */
+void script_set_budget(uint32_t insns);
+uint32_t script_get_budget(void);
+
+#ifdef ENABLE_LUA
+/* Functions for the "ship" library. getTable returns a table private to the
+   calling state, the shared functions work across all of them. */
+int script_ship_table_lua(lua_State *l);
+int script_shared_get_lua(lua_State *l);
+int script_shared_set_lua(lua_State *l);
+int script_stats_lua(lua_State *l);
+int script_budget_lua(lua_State *l);
+#endif
+
 #endif /* !SCRIPTS_H */
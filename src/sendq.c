@@ -0,0 +1,204 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "sendq.h"
+#include "metrics.h"
+
+/* Don't hang on to more than this many free chunks (4MiB worth). */
+#define SENDQ_POOL_MAX          1024
+
+size_t sendq_limit = SENDQ_DEFAULT_LIMIT;
+uint32_t sendq_pkt_limit = 0;
+int sendq_policy = SENDQ_POLICY_DISCONNECT;
+int sendq_deferred = 0;
+
+static struct sendq_chunk_list pool = TAILQ_HEAD_INITIALIZER(pool);
+static int pool_count = 0;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static sendq_chunk_t *chunk_get(void) {
+    sendq_chunk_t *ch;
+
+    pthread_mutex_lock(&pool_mutex);
+
+    if((ch = TAILQ_FIRST(&pool))) {
+        TAILQ_REMOVE(&pool, ch, qentry);
+        --pool_count;
+    }
+
+    pthread_mutex_unlock(&pool_mutex);
+
+    if(!ch && !(ch = (sendq_chunk_t *)malloc(sizeof(sendq_chunk_t)))) {
+        perror("malloc");
+        return NULL;
+    }
+
+    ch->start = ch->end = 0;
+    ch->pkts = 0;
+    return ch;
+}
+
+static void chunk_put(sendq_chunk_t *ch) {
+    pthread_mutex_lock(&pool_mutex);
+
+    if(pool_count < SENDQ_POOL_MAX) {
+        TAILQ_INSERT_HEAD(&pool, ch, qentry);
+        ++pool_count;
+        ch = NULL;
+    }
+
+    pthread_mutex_unlock(&pool_mutex);
+    free(ch);
+}
+
+void sendq_init(sendq_t *q) {
+    TAILQ_INIT(&q->chunks);
+    q->bytes = q->peak = 0;
+    q->pkts = 0;
+}
+
+void sendq_clear(sendq_t *q) {
+    sendq_chunk_t *ch;
+
+    while((ch = TAILQ_FIRST(&q->chunks))) {
+        TAILQ_REMOVE(&q->chunks, ch, qentry);
+        chunk_put(ch);
+    }
+
+    q->bytes = 0;
+    q->pkts = 0;
+}
+
+int sendq_append(sendq_t *q, const uint8_t *data, size_t len) {
+    sendq_chunk_t *ch = TAILQ_LAST(&q->chunks, sendq_chunk_list);
+    size_t amt;
+
+    if(q->bytes + len > sendq_limit ||
+       (sendq_pkt_limit && q->pkts >= sendq_pkt_limit))
+        return -2;
+
+    while(len) {
+        /* Start a new chunk if the last one is full (or there isn't one). */
+        if(!ch || ch->end == SENDQ_CHUNK_SIZE) {
+            if(!(ch = chunk_get()))
+                return -1;
+
+            TAILQ_INSERT_TAIL(&q->chunks, ch, qentry);
+        }
+
+        amt = SENDQ_CHUNK_SIZE - ch->end;
+        if(amt > len)
+            amt = len;
+
+        memcpy(ch->data + ch->end, data, amt);
+        ch->end += amt;
+        q->bytes += amt;
+        data += amt;
+        len -= amt;
+    }
+
+    /* An empty packet with nothing before it doesn't end up anywhere. */
+    if(ch) {
+        ++ch->pkts;
+        ++q->pkts;
+    }
+
+    if(q->bytes > q->peak)
+        q->peak = q->bytes;
+
+    metrics_observe(METRIC_SENDQ_DEPTH, q->bytes);
+    return 0;
+}
+
+ssize_t sendq_flush(sendq_t *q, int sock) {
+    struct iovec iov[SENDQ_IOV_MAX];
+    sendq_chunk_t *ch;
+    ssize_t sent;
+    size_t want;
+    int cnt, full;
+
+    while(q->bytes) {
+        /* Gather up as much as we can to hand off in one go. */
+        cnt = 0;
+        want = 0;
+
+        TAILQ_FOREACH(ch, &q->chunks, qentry) {
+            if(cnt == SENDQ_IOV_MAX)
+                break;
+
+            iov[cnt].iov_base = ch->data + ch->start;
+            iov[cnt].iov_len = ch->end - ch->start;
+            want += iov[cnt++].iov_len;
+        }
+
+        if((sent = writev(sock, iov, cnt)) == -1) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+
+            return -1;
+        }
+
+        q->bytes -= sent;
+
+        /* If the socket didn't take everything we offered, its buffer is full,
+           so there's no sense trying again right now. */
+        full = (size_t)sent < want;
+
+        /* Give back any chunks that went out completely. */
+        while(sent && (ch = TAILQ_FIRST(&q->chunks))) {
+            if((size_t)sent < ch->end - ch->start) {
+                ch->start += sent;
+                break;
+            }
+
+            sent -= ch->end - ch->start;
+            q->pkts -= ch->pkts;
+            TAILQ_REMOVE(&q->chunks, ch, qentry);
+            chunk_put(ch);
+        }
+
+        if(full)
+            break;
+    }
+
+    if(!q->bytes)
+        q->pkts = 0;
+
+    return (ssize_t)q->bytes;
+}
+
+void sendq_pool_cleanup(void) {
+    sendq_chunk_t *ch;
+
+    pthread_mutex_lock(&pool_mutex);
+
+    while((ch = TAILQ_FIRST(&pool))) {
+        TAILQ_REMOVE(&pool, ch, qentry);
+        free(ch);
+    }
+
+    pool_count = 0;
+    pthread_mutex_unlock(&pool_mutex);
+}
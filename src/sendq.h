@@ -0,0 +1,106 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SENDQ_H
+#define SENDQ_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+
+/* Data that couldn't be written to a socket right away is held in a chain of
+   fixed-size chunks. Chunks come out of a shared pool and go back into it once
+   they've been sent, so a slow client doesn't cause constant trips to the heap
+   and nothing already queued ever has to be moved around. */
+#define SENDQ_CHUNK_SIZE        4096
+
+/* Default high-water mark for how much can be queued up for one socket before
+   we give up on it, in bytes. */
+#define SENDQ_DEFAULT_LIMIT     (1024 * 1024)
+
+/* What to do about a client that has fallen behind. Either way, one that goes
+   over a limit gets disconnected, but shedding also stops sending it movement
+   (which the next movement would replace anyway) once it's half way there. */
+#define SENDQ_POLICY_DISCONNECT 0
+#define SENDQ_POLICY_SHED       1
+
+typedef struct sendq_chunk {
+    TAILQ_ENTRY(sendq_chunk) qentry;
+    uint32_t start;
+    uint32_t end;
+    uint32_t pkts;                      /* Packets that end in this chunk */
+    uint8_t data[SENDQ_CHUNK_SIZE];
+} sendq_chunk_t;
+
+TAILQ_HEAD(sendq_chunk_list, sendq_chunk);
+
+typedef struct sendq {
+    struct sendq_chunk_list chunks;
+    size_t bytes;
+    size_t peak;                        /* Most ever queued at once */
+    uint32_t pkts;                      /* Not completely written out yet */
+} sendq_t;
+
+/* The most chunks that will be handed to the kernel in one writev(). */
+#define SENDQ_IOV_MAX           64
+
+/* The high-water mark, settable on the command line. */
+extern size_t sendq_limit;
+
+/* The most packets that can be waiting to go out on one socket (0 for no
+   limit), and what to do about anyone that's falling behind. Both are settable
+   on the command line. A packet counts until the chunk it ends in has been
+   written out. */
+extern uint32_t sendq_pkt_limit;
+extern int sendq_policy;
+
+/* If set, packets sent by a block's thread to its own clients are only queued
+   up, and each client's queue gets written out with one writev() at the end of
+   the block thread's loop, rather than making a syscall per packet. */
+extern int sendq_deferred;
+
+/* Set up an empty queue. */
+void sendq_init(sendq_t *q);
+
+/* Throw away anything in the queue, returning its chunks to the pool. */
+void sendq_clear(sendq_t *q);
+
+/* Add data to the end of the queue. Returns 0 on success, -1 if memory could
+   not be allocated, or -2 if adding the data would put the queue over the
+   high-water mark or the packet limit (in which case nothing is added). */
+int sendq_append(sendq_t *q, const uint8_t *data, size_t len);
+
+/* Write as much of the queue out to the socket as it'll take without blocking,
+   gathering up as many chunks as possible into each writev() call. Returns -1
+   on error, otherwise the number of bytes still queued. */
+ssize_t sendq_flush(sendq_t *q, int sock);
+
+/* Free all of the chunks sitting in the pool, at shutdown. */
+void sendq_pool_cleanup(void);
+
+static inline int sendq_empty(const sendq_t *q) {
+    return !q->bytes;
+}
+
+/* Whether the queue is more than half way to either limit. */
+static inline int sendq_behind(const sendq_t *q) {
+    return q->bytes > sendq_limit / 2 ||
+        (sendq_pkt_limit && q->pkts > sendq_pkt_limit / 2);
+}
+
+#endif /* !SENDQ_H */
@@ -23,7 +23,6 @@
 #include <errno.h>
 #include <time.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <arpa/inet.h>
 
 #include <sylverant/debug.h>
@@ -33,9 +32,11 @@
 #include "ship_packets.h"
 #include "shipgate.h"
 #include "utils.h"
+#include "handoff.h"
 #include "bans.h"
 #include "scripts.h"
 #include "admin.h"
+#include "metrics.h"
 
 #ifdef ENABLE_LUA
 #include <lua.h>
@@ -120,20 +121,103 @@ static sylverant_event_t *find_current_event(ship_t *s) {
     return s->cfg->events;
 }
 
-static void *ship_thd(void *d) {
-    int i, nfds;
-    ship_t *s = (ship_t *)d;
-    struct timeval timeout;
-    fd_set readfds, writefds;
-    ship_client_t *it, *tmp;
-    socklen_t len;
+/* Versions and names for each of the listening sockets on the ship, in the
+   same order as they're opened in ship_server_start(). */
+static const int listen_versions[6] = {
+    CLIENT_VERSION_DCV1, CLIENT_VERSION_PC, CLIENT_VERSION_GC,
+    CLIENT_VERSION_EP3, CLIENT_VERSION_BB, CLIENT_VERSION_XBOX
+};
+
+static const char *listen_names[6] = {
+    "DC", "PC", "GC", "Episode 3", "Blue Burst", "Xbox"
+};
+
+static void ship_accept(ship_t *s, int lsock, int version, const char *name) {
+    socklen_t len = sizeof(struct sockaddr_storage);
     struct sockaddr_storage addr;
     struct sockaddr *addr_p = (struct sockaddr *)&addr;
     char ipstr[INET6_ADDRSTRLEN];
-    int sock, rv;
-    ssize_t sent;
-    time_t now;
+    ship_client_t *c;
+    int sock;
+
+    if((sock = accept(lsock, addr_p, &len)) < 0) {
+        perror("accept");
+        return;
+    }
+
+    set_cloexec(sock);
+
+    my_ntop(&addr, ipstr);
+    debug(DBG_LOG, "%s: Accepted %s ship connection from %s\n", s->cfg->name,
+          name, ipstr);
+
+    if(!(c = client_create_connection(sock, version, CLIENT_TYPE_SHIP,
+                                      s->clients, s, NULL, addr_p, len))) {
+        return;
+    }
+
+    if(s->shutdown_time) {
+        send_message_box(c, "%s\n\n%s\n%s",
+                         __(c, "\tEShip is going down for shutdown."),
+                         __(c, "Please try another ship."),
+                         __(c, "Disconnecting."));
+        c->flags |= CLIENT_FLAG_DISCONNECTED;
+    }
+}
+
+/* Close the connection to the shipgate so that we can attempt to reconnect. */
+static void ship_close_shipgate(ship_t *s) {
+    evloop_del(s->evl, s->sg.sock);
+    gnutls_bye(s->sg.session, GNUTLS_SHUT_RDWR);
+    close(s->sg.sock);
+    gnutls_deinit(s->sg.session);
+    s->sg.sock = -1;
+}
+
+/* Check each client on the ship to see if it needs to be pinged or has timed
+   out. Returns non-zero if any clients need to be cleaned up. */
+static int ship_check_clients(ship_t *s, time_t now) {
+    ship_client_t *it;
+    int rv = 0;
+
+    TAILQ_FOREACH(it, s->clients, qentry) {
+        if(it->flags & CLIENT_FLAG_DISCONNECTED) {
+            rv = 1;
+            continue;
+        }
+
+        /* If we haven't heard from a client in 2 minutes, its dead.
+           Disconnect it. */
+        if(now > it->last_message + 120) {
+            it->flags |= CLIENT_FLAG_DISCONNECTED;
+            rv = 1;
+        }
+        /* Otherwise, if we haven't heard from them in a minute, ping it. */
+        else if(now > it->last_message + 60 && now > it->last_sent + 10) {
+            if(send_simple(it, PING_TYPE, 0)) {
+                it->flags |= CLIENT_FLAG_DISCONNECTED;
+                rv = 1;
+                continue;
+            }
+
+            it->last_sent = now;
+        }
+    }
+
+    return rv;
+}
+
+static void *ship_thd(void *d) {
+    ship_t *s = (ship_t *)d;
+    evloop_event_t evs[EVLOOP_MAX_EVENTS];
+    ship_client_t *it, *tmp;
+    int lsocks[12], lvers[12];
+    const char *lnames[12];
+    int nlsocks = 0, i, j, n, rv, reap, timeout;
+    int sg_sock = -1, sg_events = 0, events;
+    time_t now, next_check = 0;
     time_t last_ban_sweep = time(NULL);
+    char buf;
     int numsocks = 1;
     sylverant_event_t *event, *oldevent = s->cfg->events;
 
@@ -143,25 +227,45 @@ static void *ship_thd(void *d) {
     }
 #endif
 
+    /* Register all of the listening sockets and the pipe with the event loop.
+       Clients register themselves as they connect. */
+    for(i = 0; i < numsocks; ++i) {
+        lsocks[nlsocks++] = s->dcsock[i];
+        lsocks[nlsocks++] = s->pcsock[i];
+        lsocks[nlsocks++] = s->gcsock[i];
+        lsocks[nlsocks++] = s->ep3sock[i];
+        lsocks[nlsocks++] = s->bbsock[i];
+        lsocks[nlsocks++] = s->xbsock[i];
+    }
+
+    for(i = 0; i < nlsocks; ++i) {
+        lvers[i] = listen_versions[i % 6];
+        lnames[i] = listen_names[i % 6];
+        evloop_add(s->evl, lsocks[i], EVLOOP_READ, NULL);
+    }
+
+    evloop_add(s->evl, s->pipes[0], EVLOOP_READ, NULL);
+
     /* Fire up the threads for each block. */
     for(i = 1; i <= s->cfg->blocks; ++i) {
         s->blocks[i - 1] = block_server_start(s, i, s->cfg->base_port +
                                               (i * 6));
     }
 
+    /* Everything that's going to be listening is now, so anything left over
+       from a live restart isn't needed. */
+    handoff_release();
+
+    clear_menu_images();
+
     /* We've now started up completely, so run the startup script, if one is
        configured. */
     script_execute(ScriptActionStartup, NULL, SCRIPT_ARG_PTR, s, 0);
 
     /* While we're still supposed to run... do it. */
     while(s->run) {
-        /* Clear the fd_sets so we can use them again. */
-        nfds = 0;
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-        timeout.tv_sec = 30;
-        timeout.tv_usec = 0;
         now = time(NULL);
+        reap = 0;
 
         /* Break out if we're shutting down now */
         if(s->shutdown_time && s->shutdown_time <= now) {
@@ -180,13 +284,33 @@ static void *ship_thd(void *d) {
             if(shipgate_reconnect(&s->sg)) {
                 /* Set the next login attempt to ~15 seconds from now... */
                 s->sg.login_attempt = now + 14;
-                timeout.tv_sec = 15;
             }
             else {
                 s->sg.login_attempt = 0;
             }
         }
 
+        /* Keep the shipgate's registration with the event loop up to date,
+           since the socket changes every time we reconnect. */
+        if(s->sg.sock != -1) {
+            events = EVLOOP_READ;
+
+            if(s->sg.sendbuf_cur) {
+                events |= EVLOOP_WRITE;
+            }
+
+            if(s->sg.sock != sg_sock) {
+                if(!evloop_add(s->evl, s->sg.sock, events, &s->sg)) {
+                    sg_sock = s->sg.sock;
+                    sg_events = events;
+                }
+            }
+            else if(events != sg_events) {
+                evloop_mod(s->evl, sg_sock, events);
+                sg_events = events;
+            }
+        }
+
         /* Check the event to see if its changed on us... */
         event = find_current_event(s);
 
@@ -206,314 +330,101 @@ static void *ship_thd(void *d) {
             oldevent = event;
         }
 
-        /* Fill the sockets into the fd_sets so we can use select below. */
-        TAILQ_FOREACH(it, s->clients, qentry) {
-            /* If we haven't heard from a client in 2 minutes, its dead.
-               Disconnect it. */
-            if(now > it->last_message + 120) {
-                it->flags |= CLIENT_FLAG_DISCONNECTED;
-                continue;
-            }
-            /* Otherwise, if we haven't heard from them in a minute, ping it. */
-            else if(now > it->last_message + 60 && now > it->last_sent + 10) {
-                if(send_simple(it, PING_TYPE, 0)) {
-                    it->flags |= CLIENT_FLAG_DISCONNECTED;
-                    continue;
-                }
-
-                it->last_sent = now;
-            }
-
-            FD_SET(it->sock, &readfds);
-
-            /* Only add to the write fd set if we have something to send out. */
-            if(it->sendbuf_cur) {
-                FD_SET(it->sock, &writefds);
-            }
-
-            nfds = nfds > it->sock ? nfds : it->sock;
-        }
-
-        /* Add the listening sockets to the read fd_set. */
-        for(i = 0; i < numsocks; ++i) {
-            FD_SET(s->dcsock[i], &readfds);
-            nfds = nfds > s->dcsock[i] ? nfds : s->dcsock[i];
-            FD_SET(s->pcsock[i], &readfds);
-            nfds = nfds > s->pcsock[i] ? nfds : s->pcsock[i];
-            FD_SET(s->gcsock[i], &readfds);
-            nfds = nfds > s->gcsock[i] ? nfds : s->gcsock[i];
-            FD_SET(s->ep3sock[i], &readfds);
-            nfds = nfds > s->ep3sock[i] ? nfds : s->ep3sock[i];
-            FD_SET(s->bbsock[i], &readfds);
-            nfds = nfds > s->bbsock[i] ? nfds : s->bbsock[i];
-            FD_SET(s->xbsock[i], &readfds);
-            nfds = nfds > s->xbsock[i] ? nfds : s->xbsock[i];
+        /* Look for anyone that needs to be pinged or timed out, at most once
+           per second. */
+        if(now >= next_check) {
+            reap = ship_check_clients(s, now);
+            next_check = now + 1;
         }
 
-        FD_SET(s->pipes[1], &readfds);
-        nfds = nfds > s->pipes[1] ? nfds : s->pipes[1];
-
-        /* Add the shipgate socket to the fd_sets */
-        if(s->sg.sock != -1) {
-            FD_SET(s->sg.sock, &readfds);
-
-            if(s->sg.sendbuf_cur) {
-                FD_SET(s->sg.sock, &writefds);
-            }
-
-            nfds = nfds > s->sg.sock ? nfds : s->sg.sock;
-        }
-
-        /* If we're supposed to shut down soon, make sure we aren't in the
-           middle of a select still when its supposed to happen. */
-        if(s->shutdown_time && now + timeout.tv_sec > s->shutdown_time) {
-            timeout.tv_sec = s->shutdown_time - now;
-        }
+        timeout = reap ? 0 : (int)(next_check - now) * 1000;
 
         /* Wait for some activity... */
-        if(select(nfds + 1, &readfds, &writefds, NULL, &timeout) > 0) {
-            /* Clear anything written to the pipe */
-            if(FD_ISSET(s->pipes[1], &readfds)) {
-                read(s->pipes[1], &len, 1);
-            }
-
-            for(i = 0; i < numsocks; ++i) {
-                if(FD_ISSET(s->dcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(s->dcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s: Accepted DC ship connection from %s\n",
-                          s->cfg->name, ipstr);
-
-                    if(!(tmp = client_create_connection(sock,
-                                                        CLIENT_VERSION_DCV1,
-                                                        CLIENT_TYPE_SHIP,
-                                                        s->clients, s, NULL,
-                                                        addr_p, len))) {
-                        close(sock);
-                    }
-
-                    if(s->shutdown_time) {
-                        send_message_box(tmp, "%s\n\n%s\n%s",
-                                         __(tmp, "\tEShip is going down for "
-                                            "shutdown."),
-                                         __(tmp, "Please try another ship."),
-                                         __(tmp, "Disconnecting."));
-                        tmp->flags |= CLIENT_FLAG_DISCONNECTED;
-                    }
-                }
-
-                if(FD_ISSET(s->pcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(s->pcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s: Accepted PC ship connection from %s\n",
-                          s->cfg->name, ipstr);
-
-                    if(!(tmp = client_create_connection(sock, CLIENT_VERSION_PC,
-                                                        CLIENT_TYPE_SHIP,
-                                                        s->clients, s, NULL,
-                                                        addr_p, len))) {
-                        close(sock);
-                    }
-
-                    if(s->shutdown_time) {
-                        send_message_box(tmp, "%s\n\n%s\n%s",
-                                         __(tmp, "\tEShip is going down for "
-                                            "shutdown."),
-                                         __(tmp, "Please try another ship."),
-                                         __(tmp, "Disconnecting."));
-                        tmp->flags |= CLIENT_FLAG_DISCONNECTED;
-                    }
-                }
-
-                if(FD_ISSET(s->gcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(s->gcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s: Accepted GC ship connection from %s\n",
-                          s->cfg->name, ipstr);
-
-                    if(!(tmp = client_create_connection(sock, CLIENT_VERSION_GC,
-                                                        CLIENT_TYPE_SHIP,
-                                                        s->clients, s, NULL,
-                                                        addr_p, len))) {
-                        close(sock);
-                    }
-
-                    if(s->shutdown_time) {
-                        send_message_box(tmp, "%s\n\n%s\n%s",
-                                         __(tmp, "\tEShip is going down for "
-                                            "shutdown."),
-                                         __(tmp, "Please try another ship."),
-                                         __(tmp, "Disconnecting."));
-                        tmp->flags |= CLIENT_FLAG_DISCONNECTED;
-                    }
-                }
-
-                if(FD_ISSET(s->ep3sock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(s->ep3sock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s: Accepted Episode 3 ship connection "
-                          "from %s\n", s->cfg->name, ipstr);
-
-                    if(!(tmp = client_create_connection(sock,
-                                                        CLIENT_VERSION_EP3,
-                                                        CLIENT_TYPE_SHIP,
-                                                        s->clients, s, NULL,
-                                                        addr_p, len))) {
-                        close(sock);
-                    }
-
-                    if(s->shutdown_time) {
-                        send_message_box(tmp, "%s\n\n%s\n%s",
-                                         __(tmp, "\tEShip is going down for "
-                                            "shutdown."),
-                                         __(tmp, "Please try another ship."),
-                                         __(tmp, "Disconnecting."));
-                        tmp->flags |= CLIENT_FLAG_DISCONNECTED;
-                    }
-                }
-
-                if(FD_ISSET(s->bbsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(s->bbsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s: Accepted Blue Burst ship connection "
-                          "from %s\n", s->cfg->name, ipstr);
-
-                    if(!(tmp = client_create_connection(sock,
-                                                        CLIENT_VERSION_BB,
-                                                        CLIENT_TYPE_SHIP,
-                                                        s->clients, s, NULL,
-                                                        addr_p, len))) {
-                        close(sock);
-                    }
+        if((n = evloop_wait(s->evl, evs, EVLOOP_MAX_EVENTS, timeout)) < 0) {
+            perror("evloop_wait");
+            n = 0;
+        }
 
-                    if(s->shutdown_time) {
-                        send_message_box(tmp, "%s\n\n%s\n%s",
-                                         __(tmp, "\tEShip is going down for "
-                                            "shutdown."),
-                                         __(tmp, "Please try another ship."),
-                                         __(tmp, "Disconnecting."));
-                        tmp->flags |= CLIENT_FLAG_DISCONNECTED;
-                    }
+        for(i = 0; i < n; ++i) {
+            /* Process the shipgate */
+            if(evs[i].data == &s->sg) {
+                if(s->sg.sock != evs[i].fd) {
+                    continue;
                 }
 
-                if(FD_ISSET(s->xbsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(s->xbsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
+                if(evs[i].events & EVLOOP_READ) {
+                    if((rv = shipgate_process_pkt(&s->sg))) {
+                        debug(DBG_WARN, "%s: Lost connection with shipgate\n",
+                              s->cfg->name);
 
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s: Accepted Xbox ship connection "
-                          "from %s\n", s->cfg->name, ipstr);
+                        /* Close the connection so we can attempt to
+                           reconnect */
+                        ship_close_shipgate(s);
+                        sg_sock = -1;
 
-                    if(!(tmp = client_create_connection(sock,
-                                                        CLIENT_VERSION_XBOX,
-                                                        CLIENT_TYPE_SHIP,
-                                                        s->clients, s, NULL,
-                                                        addr_p, len))) {
-                        close(sock);
-                    }
+                        if(rv < -1) {
+                            debug(DBG_WARN, "%s: Fatal shipgate error, "
+                                  "bailing!\n", s->cfg->name);
+                            s->run = 0;
+                        }
 
-                    if(s->shutdown_time) {
-                        send_message_box(tmp, "%s\n\n%s\n%s",
-                                         __(tmp, "\tEShip is going down for "
-                                            "shutdown."),
-                                         __(tmp, "Please try another ship."),
-                                         __(tmp, "Disconnecting."));
-                        tmp->flags |= CLIENT_FLAG_DISCONNECTED;
+                        continue;
                     }
                 }
-            }
 
-            /* Process the shipgate */
-            if(s->sg.sock != -1 && FD_ISSET(s->sg.sock, &readfds)) {
-                if((rv = shipgate_process_pkt(&s->sg))) {
-                    debug(DBG_WARN, "%s: Lost connection with shipgate\n",
-                          s->cfg->name);
-
-                    /* Close the connection so we can attempt to reconnect */
-                    gnutls_bye(s->sg.session, GNUTLS_SHUT_RDWR);
-                    close(s->sg.sock);
-                    gnutls_deinit(s->sg.session);
-                    s->sg.sock = -1;
-
-                    if(rv < -1) {
-                        debug(DBG_WARN, "%s: Fatal shipgate error, bailing!\n",
+                if(evs[i].events & EVLOOP_WRITE) {
+                    if(shipgate_send_pkts(&s->sg)) {
+                        debug(DBG_WARN, "%s: Lost connection with shipgate\n",
                               s->cfg->name);
-                        s->run = 0;
+
+                        /* Close the connection so we can attempt to
+                           reconnect */
+                        ship_close_shipgate(s);
+                        sg_sock = -1;
                     }
                 }
             }
-
-            if(s->sg.sock != -1 && FD_ISSET(s->sg.sock, &writefds)) {
-                if(shipgate_send_pkts(&s->sg)) {
-                    debug(DBG_WARN, "%s: Lost connection with shipgate\n",
-                          s->cfg->name);
-
-                    /* Close the connection so we can attempt to reconnect */
-                    gnutls_bye(s->sg.session, GNUTLS_SHUT_RDWR);
-                    close(s->sg.sock);
-                    gnutls_deinit(s->sg.session);
-                    s->sg.sock = -1;
+            /* Process client connections. */
+            else if((it = (ship_client_t *)evs[i].data)) {
+                if(it->flags & CLIENT_FLAG_DISCONNECTED) {
+                    reap = 1;
+                    continue;
                 }
-            }
 
-            /* Process client connections. */
-            TAILQ_FOREACH(it, s->clients, qentry) {
-                /* Check if this connection was trying to send us something. */
-                if(FD_ISSET(it->sock, &readfds)) {
+                /* Check if this connection was trying to send us
+                   something. */
+                if(evs[i].events & EVLOOP_READ) {
                     if(client_process_pkt(it)) {
                         it->flags |= CLIENT_FLAG_DISCONNECTED;
+                        reap = 1;
                         continue;
                     }
                 }
 
-                /* If we have anything to write, check if we can right now. */
-                if(FD_ISSET(it->sock, &writefds)) {
-                    if(it->sendbuf_cur) {
-                        sent = send(it->sock, it->sendbuf + it->sendbuf_start,
-                                    it->sendbuf_cur - it->sendbuf_start, 0);
-
-                        /* If we fail to send, and the error isn't EAGAIN,
-                           bail. */
-                        if(sent == -1) {
-                            if(errno != EAGAIN) {
-                                it->flags |= CLIENT_FLAG_DISCONNECTED;
-                                continue;
-                            }
-                        }
-                        else {
-                            it->sendbuf_start += sent;
-
-                            /* If we've sent everything, free the buffer. */
-                            if(it->sendbuf_start == it->sendbuf_cur) {
-                                free(it->sendbuf);
-                                it->sendbuf = NULL;
-                                it->sendbuf_cur = 0;
-                                it->sendbuf_size = 0;
-                                it->sendbuf_start = 0;
-                            }
+                /* If we have anything to write, and we can, do so. */
+                if(evs[i].events & EVLOOP_WRITE) {
+                    if(client_send_queued(it)) {
+                        it->flags |= CLIENT_FLAG_DISCONNECTED;
+                        reap = 1;
+                    }
+                }
+            }
+            /* Clear anything written to the pipe */
+            else if(evs[i].fd == s->pipes[0]) {
+                read(s->pipes[0], &buf, 1);
+            }
+            else {
+                for(j = 0; j < nlsocks; ++j) {
+                    if(evs[i].fd == lsocks[j]) {
+                        ship_accept(s, lsocks[j], lvers[j], lnames[j]);
+
+                        /* Anyone turned away because of a shutdown needs to
+                           be cleaned up. */
+                        if(s->shutdown_time) {
+                            reap = 1;
                         }
+
+                        break;
                     }
                 }
             }
@@ -522,15 +433,17 @@ static void *ship_thd(void *d) {
         /* Clean up any dead connections (its not safe to do a TAILQ_REMOVE in
            the middle of a TAILQ_FOREACH, and destroy_connection does indeed
            use TAILQ_REMOVE). */
-        it = TAILQ_FIRST(s->clients);
-        while(it) {
-            tmp = TAILQ_NEXT(it, qentry);
+        if(reap) {
+            it = TAILQ_FIRST(s->clients);
+            while(it) {
+                tmp = TAILQ_NEXT(it, qentry);
 
-            if(it->flags & CLIENT_FLAG_DISCONNECTED) {
-                client_destroy_connection(it, s->clients);
-            }
+                if(it->flags & CLIENT_FLAG_DISCONNECTED) {
+                    client_destroy_connection(it, s->clients);
+                }
 
-            it = tmp;
+                it = tmp;
+            }
         }
     }
 
@@ -539,11 +452,6 @@ static void *ship_thd(void *d) {
     /* Before we shut down, run the shutdown script, if one is configured. */
     script_execute(ScriptActionShutdown, NULL, SCRIPT_ARG_PTR, s, 0);
 
-#ifdef ENABLE_LUA
-    /* Remove the table from the registry */
-    luaL_unref(s->lstate, LUA_REGISTRYINDEX, s->script_ref);
-#endif
-
     /* Disconnect any clients. */
     it = TAILQ_FIRST(s->clients);
     while(it) {
@@ -560,11 +468,16 @@ static void *ship_thd(void *d) {
     }
 
     /* Free the ship structure. */
+    ban_journal_stop(s);
     ban_list_clear(s);
     cleanup_scripts(s);
     pthread_rwlock_destroy(&s->banlock);
+    pthread_mutex_destroy(&s->ban_idx_lock);
+    pthread_mutex_destroy(&s->ban_journal.mutex);
+    pthread_cond_destroy(&s->ban_journal.cond);
     pthread_rwlock_destroy(&s->qlock);
     pthread_rwlock_destroy(&s->llock);
+    pthread_rwlock_destroy(&s->gc_lock);
     ship_free_limits(s);
     shipgate_cleanup(&s->sg);
     free(s->gm_list);
@@ -573,21 +486,22 @@ static void *ship_thd(void *d) {
     close(s->pipes[1]);
 #ifdef SYLVERANT_ENABLE_IPV6
     if(enable_ipv6) {
-        close(s->xbsock[1]);
-        close(s->bbsock[1]);
-        close(s->ep3sock[1]);
-        close(s->gcsock[1]);
-        close(s->pcsock[1]);
-        close(s->dcsock[1]);
+        handoff_close(s->xbsock[1]);
+        handoff_close(s->bbsock[1]);
+        handoff_close(s->ep3sock[1]);
+        handoff_close(s->gcsock[1]);
+        handoff_close(s->pcsock[1]);
+        handoff_close(s->dcsock[1]);
     }
 #endif
-    close(s->xbsock[0]);
-    close(s->bbsock[0]);
-    close(s->ep3sock[0]);
-    close(s->gcsock[0]);
-    close(s->pcsock[0]);
-    close(s->dcsock[0]);
+    handoff_close(s->xbsock[0]);
+    handoff_close(s->bbsock[0]);
+    handoff_close(s->ep3sock[0]);
+    handoff_close(s->gcsock[0]);
+    handoff_close(s->pcsock[0]);
+    handoff_close(s->dcsock[0]);
     clean_shiplist(s);
+    evloop_destroy(s->evl);
     free(s->clients);
     free(s->blocks);
     free(s);
@@ -687,12 +601,21 @@ ship_t *ship_server_start(sylverant_ship_t *s) {
         goto err_free;
     }
 
+    set_cloexec(rv->pipes[0]);
+    set_cloexec(rv->pipes[1]);
+
+    /* Set up the event loop for the ship's sockets. */
+    if(!(rv->evl = evloop_create())) {
+        debug(DBG_ERROR, "%s: Cannot create event loop!\n", s->name);
+        goto err_pipes;
+    }
+
     /* Make room for the block structures. */
     rv->blocks = (block_t **)malloc(sizeof(block_t *) * s->blocks);
 
     if(!rv->blocks) {
         debug(DBG_ERROR, "%s: Cannot allocate memory for blocks!\n", s->name);
-        goto err_pipes;
+        goto err_evl;
     }
 
     /* Make room for the client list. */
@@ -775,6 +698,11 @@ ship_t *ship_server_start(sylverant_ship_t *s) {
 
     /* Fill in the structure. */
     pthread_rwlock_init(&rv->banlock, NULL);
+    pthread_mutex_init(&rv->ban_idx_lock, NULL);
+    pthread_mutex_init(&rv->ban_journal.mutex, NULL);
+    pthread_cond_init(&rv->ban_journal.cond, NULL);
+    TAILQ_INIT(&rv->ban_journal.records);
+    pthread_rwlock_init(&rv->gc_lock, NULL);
     TAILQ_INIT(rv->clients);
     TAILQ_INIT(&rv->ships);
     TAILQ_INIT(&rv->guildcard_bans);
@@ -799,12 +727,6 @@ ship_t *ship_server_start(sylverant_ship_t *s) {
     /* Initialize scripting support */
     init_scripts(rv);
 
-#ifdef ENABLE_LUA
-    /* Initialize the script table */
-    lua_newtable(rv->lstate);
-    rv->script_ref = luaL_ref(rv->lstate, LUA_REGISTRYINDEX);
-#endif
-
     /* Attempt to read the ban list */
     if(s->bans_file) {
         if(ban_list_read(s->bans_file, rv)) {
@@ -812,6 +734,9 @@ ship_t *ship_server_start(sylverant_ship_t *s) {
         }
     }
 
+    /* Start up the thread that saves any changes to the bans. */
+    ban_journal_start(rv);
+
     /* Create the random number generator state */
     mt19937_init(&rv->rng, (uint32_t)time(NULL));
 
@@ -832,8 +757,13 @@ ship_t *ship_server_start(sylverant_ship_t *s) {
 err_shipgate:
     shipgate_cleanup(&rv->sg);
 err_bans_locks:
-    pthread_rwlock_destroy(&rv->banlock);
+    pthread_rwlock_destroy(&rv->gc_lock);
+    ban_journal_stop(rv);
     ban_list_clear(rv);
+    pthread_rwlock_destroy(&rv->banlock);
+    pthread_mutex_destroy(&rv->ban_idx_lock);
+    pthread_mutex_destroy(&rv->ban_journal.mutex);
+    pthread_cond_destroy(&rv->ban_journal.cond);
     cleanup_scripts(rv);
 err_limits:
     ship_free_limits(rv);
@@ -845,6 +775,8 @@ err_quests:
     free(rv->clients);
 err_blocks:
     free(rv->blocks);
+err_evl:
+    evloop_destroy(rv->evl);
 err_pipes:
     close(rv->pipes[0]);
     close(rv->pipes[1]);
@@ -853,31 +785,31 @@ err_free:
 err_close_all:
 #ifdef SYLVERANT_ENABLE_IPV6
     if(enable_ipv6) {
-        close(xbsock[1]);
+        handoff_close(xbsock[1]);
 err_close_bb_6:
-        close(bbsock[1]);
+        handoff_close(bbsock[1]);
 err_close_ep3_6:
-        close(ep3sock[1]);
+        handoff_close(ep3sock[1]);
 err_close_gc_6:
-        close(gcsock[1]);
+        handoff_close(gcsock[1]);
 err_close_pc_6:
-        close(pcsock[1]);
+        handoff_close(pcsock[1]);
 err_close_dc_6:
-        close(dcsock[1]);
+        handoff_close(dcsock[1]);
     }
 err_close_xb:
 #endif
-    close(xbsock[0]);
+    handoff_close(xbsock[0]);
 err_close_bb:
-    close(bbsock[0]);
+    handoff_close(bbsock[0]);
 err_close_ep3:
-    close(ep3sock[0]);
+    handoff_close(ep3sock[0]);
 err_close_gc:
-    close(gcsock[0]);
+    handoff_close(gcsock[0]);
 err_close_pc:
-    close(pcsock[0]);
+    handoff_close(pcsock[0]);
 err_close_dc:
-    close(dcsock[0]);
+    handoff_close(dcsock[0]);
 
     return NULL;
 }
@@ -901,8 +833,15 @@ void ship_check_cfg(sylverant_ship_t *s) {
 
     /* Clear it out */
     memset(rv, 0, sizeof(ship_t));
-    TAILQ_INIT(&rv->qmap);
+    quest_map_init(&rv->qmap);
     TAILQ_INIT(&rv->all_limits);
+    TAILQ_INIT(&rv->guildcard_bans);
+    TAILQ_INIT(&rv->ip_bans);
+    pthread_rwlock_init(&rv->banlock, NULL);
+    pthread_mutex_init(&rv->ban_idx_lock, NULL);
+    pthread_mutex_init(&rv->ban_journal.mutex, NULL);
+    pthread_cond_init(&rv->ban_journal.cond, NULL);
+    TAILQ_INIT(&rv->ban_journal.records);
     pthread_rwlock_init(&rv->llock, NULL);
     rv->cfg = s;
 
@@ -1009,6 +948,11 @@ void ship_check_cfg(sylverant_ship_t *s) {
     }
 
     ban_list_clear(rv);
+    pthread_rwlock_destroy(&rv->banlock);
+    pthread_mutex_destroy(&rv->ban_idx_lock);
+    pthread_mutex_destroy(&rv->ban_journal.mutex);
+    pthread_cond_destroy(&rv->ban_journal.cond);
+    cleanup_scripts(rv);
     ship_free_limits(rv);
     pthread_rwlock_destroy(&rv->llock);
     free(rv->gm_list);
@@ -1021,7 +965,7 @@ void ship_server_stop(ship_t *s) {
     s->run = 0;
 
     /* Send a byte to the pipe so that we actually break out of the select. */
-    write(s->pipes[0], "\xFF", 1);
+    write(s->pipes[1], "\xFF", 1);
 
     /* Wait for it to die. */
     pthread_join(s->thd, NULL);
@@ -1033,7 +977,7 @@ void ship_server_shutdown(ship_t *s, time_t when) {
 
         /* Send a byte to the pipe so that we actually break out of the select
            and put a probably more sane amount in the timeout there */
-        write(s->pipes[0], "\xFF", 1);
+        write(s->pipes[1], "\xFF", 1);
     }
 }
 
@@ -1551,6 +1495,8 @@ static int dc_process_pkt(ship_client_t *c, uint8_t *pkt) {
         len = LE16(pc->pkt_len);
     }
 
+    metrics_count_pkt(0, type);
+
     switch(type) {
         case PING_TYPE:
             /* Ignore these. */
@@ -1601,6 +1547,8 @@ static int bb_process_pkt(ship_client_t *c, uint8_t *pkt) {
     uint16_t type = LE16(hdr->pkt_type);
     uint16_t len = LE16(hdr->pkt_len);
 
+    metrics_count_pkt(1, type);
+
     switch(type) {
         case PING_TYPE:
             /* Ignore these. */
@@ -1643,23 +1591,103 @@ int ship_process_pkt(ship_client_t *c, uint8_t *pkt) {
     return -1;
 }
 
+static inline struct client_gc_list *gc_bucket(ship_t *s, uint32_t gc) {
+    /* Guildcard numbers are handed out sequentially, so the low bits are
+       already about as well distributed as they'll get. */
+    return &s->gc_index[gc & (SHIP_GC_INDEX_SIZE - 1)];
+}
+
+void ship_index_client(ship_t *s, ship_client_t *c) {
+    pthread_rwlock_wrlock(&s->gc_lock);
+
+    /* The guildcard number may have changed since the client was added (if
+       they sent more than one login packet), so pull them out first. */
+    if(c->gc_qentry.le_prev) {
+        LIST_REMOVE(c, gc_qentry);
+    }
+
+    LIST_INSERT_HEAD(gc_bucket(s, c->guildcard), c, gc_qentry);
+    pthread_rwlock_unlock(&s->gc_lock);
+}
+
+void ship_unindex_client(ship_t *s, ship_client_t *c) {
+    pthread_rwlock_wrlock(&s->gc_lock);
+
+    if(c->gc_qentry.le_prev) {
+        LIST_REMOVE(c, gc_qentry);
+        c->gc_qentry.le_prev = NULL;
+    }
+
+    pthread_rwlock_unlock(&s->gc_lock);
+}
+
+static ship_client_t *gc_lookup(ship_t *s, uint32_t gc, block_t *b) {
+    ship_client_t *i;
+
+    LIST_FOREACH(i, gc_bucket(s, gc), gc_qentry) {
+        if(i->guildcard == gc && (!b || i->cur_block == b)) {
+            return i;
+        }
+    }
+
+    return NULL;
+}
+
+ship_client_t *ship_find_client(ship_t *s, uint32_t gc, block_t **b) {
+    ship_client_t *c;
+    block_t *blk;
+
+    /* Figure out which block they're on first... */
+    pthread_rwlock_rdlock(&s->gc_lock);
+
+    if(!(c = gc_lookup(s, gc, NULL))) {
+        pthread_rwlock_unlock(&s->gc_lock);
+        return NULL;
+    }
+
+    blk = c->cur_block;
+    pthread_rwlock_unlock(&s->gc_lock);
+
+    /* ...then look again with the block locked. Clients are only removed from
+       the index with their block's lock held for writing, so once we have the
+       read lock, whatever we find will stick around until the caller is done
+       with it. The index lock must not be held while taking the block lock, or
+       we could deadlock against a block reaping its clients. */
+    pthread_rwlock_rdlock(&blk->lock);
+    pthread_rwlock_rdlock(&s->gc_lock);
+    c = gc_lookup(s, gc, blk);
+    pthread_rwlock_unlock(&s->gc_lock);
+
+    if(!c) {
+        pthread_rwlock_unlock(&blk->lock);
+        return NULL;
+    }
+
+    *b = blk;
+    return c;
+}
+
 void ship_inc_clients(ship_t *s) {
     ++s->num_clients;
+    metrics_set_gauge(METRIC_CLIENTS, s->num_clients);
     shipgate_send_cnt(&s->sg, s->num_clients, s->num_games);
 }
 
 void ship_dec_clients(ship_t *s) {
     --s->num_clients;
+    metrics_set_gauge(METRIC_CLIENTS, s->num_clients);
     shipgate_send_cnt(&s->sg, s->num_clients, s->num_games);
 }
 
 void ship_inc_games(ship_t *s) {
     ++s->num_games;
+    metrics_set_gauge(METRIC_GAMES, s->num_games);
     shipgate_send_cnt(&s->sg, s->num_clients, s->num_games);
 }
 
 void ship_dec_games(ship_t *s) {
     --s->num_games;
+    metrics_set_gauge(METRIC_GAMES, s->num_games);
     shipgate_send_cnt(&s->sg, s->num_clients, s->num_games);
 }
 
@@ -1713,20 +1741,6 @@ static int ship_name_lua(lua_State *l) {
     return 1;
 }
 
-static int ship_getTable_lua(lua_State *l) {
-    ship_t *sl;
-
-    if(lua_islightuserdata(l, 1)) {
-        sl = (ship_t *)lua_touserdata(l, 1);
-        lua_rawgeti(l, LUA_REGISTRYINDEX, sl->script_ref);
-    }
-    else {
-        lua_pushnil(l);
-    }
-
-    return 1;
-}
-
 static int ship_writeLog_lua(lua_State *l) {
     const char *s;
 
@@ -1740,7 +1754,11 @@ static int ship_writeLog_lua(lua_State *l) {
 
 static const luaL_Reg shiplib[] = {
     { "name", ship_name_lua },
-    { "getTable", ship_getTable_lua },
+    { "getTable", script_ship_table_lua },
+    { "getShared", script_shared_get_lua },
+    { "setShared", script_shared_set_lua },
+    { "scriptStats", script_stats_lua },
+    { "setScriptBudget", script_budget_lua },
     { "writeLog", ship_writeLog_lua },
     { NULL, NULL }
 };
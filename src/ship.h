@@ -36,6 +36,7 @@
 #include "gm.h"
 #include "block.h"
 #include "shipgate.h"
+#include "evloop.h"
 
 #define CLIENTS_H_COUNTS_ONLY
 #include "clients.h"
@@ -48,6 +49,7 @@
 struct client_queue;
 struct ship_client;
 struct block;
+struct qmap_cache;
 
 #ifndef SHIP_CLIENT_DEFINED
 #define SHIP_CLIENT_DEFINED
@@ -86,6 +88,11 @@ typedef struct limits_entry {
 
 TAILQ_HEAD(limits_queue, limits_entry);
 
+/* Number of buckets in the ship-wide guildcard index. Must be a power of two. */
+#define SHIP_GC_INDEX_SIZE  1024
+
+LIST_HEAD(client_gc_list, ship_client);
+
 struct ship {
     sylverant_ship_t *cfg;
 
@@ -103,6 +110,7 @@ struct ship {
 
     time_t shutdown_time;
     int pipes[2];
+    evloop_t *evl;
 
     uint16_t num_clients;
     uint16_t num_games;
@@ -111,6 +119,8 @@ struct ship {
 
     sylverant_quest_list_t qlist[CLIENT_VERSION_COUNT][CLIENT_LANG_COUNT];
     quest_map_t qmap;
+    struct qmap_cache *qmap_cache[CLIENT_VERSION_COUNT];
+    quest_file_cache_t *qfiles;
 
     shipgate_conn_t sg;
     pthread_rwlock_t qlock;
@@ -122,6 +132,9 @@ struct ship {
     pthread_rwlock_t banlock;
     struct gcban_queue guildcard_bans;
     struct ipban_queue ip_bans;
+    pthread_mutex_t ban_idx_lock;
+    struct ban_index *ban_idx;
+    ban_journal_t ban_journal;
 
     struct miniship_queue ships;
     int mccount;
@@ -132,11 +145,10 @@ struct ship {
     struct limits_queue all_limits;
     sylverant_limits_t *def_limits;
 
-#ifdef ENABLE_LUA
-    lua_State *lstate;
-#endif
+    pthread_rwlock_t gc_lock;
+    struct client_gc_list gc_index[SHIP_GC_INDEX_SIZE];
 
-    int script_ref;
+    struct script_state *scripts;
 };
 
 #ifndef SHIP_DEFINED
@@ -161,6 +173,17 @@ void ship_dec_clients(ship_t *s);
 void ship_inc_games(ship_t *s);
 void ship_dec_games(ship_t *s);
 
+/* Add or remove a block client to or from the ship-wide guildcard index. A
+   client should be added once its guildcard number is known, and must be
+   removed before it is freed. */
+void ship_index_client(ship_t *s, ship_client_t *c);
+void ship_unindex_client(ship_t *s, ship_client_t *c);
+
+/* Find a client on any of the ship's blocks by guildcard number. If the client
+   is found, it is returned with the read lock on its block held, and the block
+   is stored in b. The caller must unlock the block when it is done. */
+ship_client_t *ship_find_client(ship_t *s, uint32_t gc, block_t **b);
+
 void ship_free_limits(ship_t *s);
 void ship_free_limits_ex(struct limits_queue *l);
 
@@ -0,0 +1,782 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* ship_bench: an offline benchmark of the block's packet handling. It sets up
+   a ship and a block without any listening sockets, threads, or shipgate
+   connection, connects synthetic clients to the block over loopback TCP, and
+   pushes packets through client_process_pkt() one at a time, timing each one.
+   Packets can either be generated (joining a lobby, moving around, chatting)
+   or taken from session captures made with ship_server --capture. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <gnutls/gnutls.h>
+
+#include <sylverant/debug.h>
+#include <sylverant/config.h>
+#include <sylverant/encryption.h>
+#include <sylverant/mtwist.h>
+
+#include "ship.h"
+#include "block.h"
+#include "clients.h"
+#include "lobby.h"
+#include "subcmd.h"
+#include "utils.h"
+#include "pktlog.h"
+#include "shipgate.h"
+#include "scripts.h"
+
+/* Everything that ship_server.c would normally provide. */
+ship_t *ship;
+int enable_ipv6 = 0;
+int restart_on_shutdown = 0;
+uint32_t ship_ip4;
+uint8_t ship_ip6[16];
+gnutls_certificate_credentials_t tls_cred;
+gnutls_priority_t tls_prio;
+
+/* Synthetic clients get guild cards starting here. */
+#define BENCH_GC_BASE       10000000
+
+#define BENCH_MAX_PKT       0x10000
+
+typedef struct bench_client {
+    ship_client_t *c;
+    int peer;
+    CRYPT_SETUP key;
+
+    /* For replays, the capture this client's packets come from. */
+    pktlog_reader_t log;
+    pktlog_entry_t next;
+    int has_next;
+} bench_client_t;
+
+typedef struct bench_stats {
+    uint64_t *samples;
+    size_t count;
+    size_t size;
+    uint64_t allocs;
+    uint64_t handle_ns;
+    int errors;
+} bench_stats_t;
+
+static bench_client_t *clients;
+static int client_count;
+static block_t *blk;
+static int version = CLIENT_VERSION_GC;
+static uint8_t pktbuf[BENCH_MAX_PKT + 8];
+
+/* Count calls to the allocator, so we can report allocations per packet. This
+   relies on glibc's internal names for the real functions. */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t alloc_count;
+
+void *malloc(size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+#define ALLOCS()    __atomic_load_n(&alloc_count, __ATOMIC_RELAXED)
+#define HAVE_ALLOC_COUNT 1
+#else
+#define ALLOCS()    0
+#define HAVE_ALLOC_COUNT 0
+#endif
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void print_help(const char *bin) {
+    printf("Usage: %s [arguments] [capture files...]\n"
+           "-----------------------------------------------------------------\n"
+           "-n clients      Number of synthetic clients to connect\n"
+           "                (default: 48).\n"
+           "-r rounds       Number of packets each client sends in each of\n"
+           "                the generated tests (default: 1000).\n"
+           "-v version      Client version for synthetic clients: dc, pc, or\n"
+           "                gc (default: gc).\n"
+           "-t tests        Comma separated list of generated tests to run,\n"
+           "                out of join, move, and chat (default: all).\n"
+           "--help          Print this help and exit\n\n"
+           "If any capture files (from ship_server --capture) are given, the\n"
+           "client packets in them are replayed in the order they were\n"
+           "received instead of running the generated tests. Captures of\n"
+           "connections to the ship itself (rather than a block) are skipped.\n"
+           "\n"
+           "Nothing is loaded from the configuration, so anything that needs\n"
+           "map, item or quest data only gets as far as the server does\n"
+           "without it.\n", bin);
+}
+
+/* Make a connected pair of loopback TCP sockets. */
+static int loopback_pair(int sv[2]) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int ls, i;
+
+    if((ls = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if(bind(ls, (struct sockaddr *)&addr, sizeof(addr)) ||
+       listen(ls, 1) ||
+       getsockname(ls, (struct sockaddr *)&addr, &len))
+        goto err;
+
+    if((sv[1] = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        goto err;
+
+    if(connect(sv[1], (struct sockaddr *)&addr, sizeof(addr))) {
+        close(sv[1]);
+        goto err;
+    }
+
+    if((sv[0] = accept(ls, NULL, NULL)) < 0) {
+        close(sv[1]);
+        goto err;
+    }
+
+    close(ls);
+
+    if((i = fcntl(sv[1], F_GETFL)) == -1 ||
+       fcntl(sv[1], F_SETFL, i | O_NONBLOCK) == -1)
+        perror("fcntl");
+
+    return 0;
+
+err:
+    perror("loopback_pair");
+    close(ls);
+    return -1;
+}
+
+/* Set up a ship and one block for the clients to connect to. Only as much of
+   the ship is filled in as the block's packet handling needs. */
+static int bench_setup(void) {
+    sylverant_ship_t *cfg;
+
+    if(!(cfg = (sylverant_ship_t *)calloc(1, sizeof(sylverant_ship_t))) ||
+       !(ship = (ship_t *)calloc(1, sizeof(ship_t)))) {
+        perror("calloc");
+        return -1;
+    }
+
+    cfg->name = strdup("ship_bench");
+    cfg->blocks = 1;
+    ship->cfg = cfg;
+
+    if(pipe(ship->pipes) == -1) {
+        perror("pipe");
+        return -1;
+    }
+
+    if(!(ship->clients =
+         (struct client_queue *)malloc(sizeof(struct client_queue))) ||
+       !(ship->blocks = (block_t **)malloc(sizeof(block_t *)))) {
+        perror("malloc");
+        return -1;
+    }
+
+    TAILQ_INIT(ship->clients);
+    TAILQ_INIT(&ship->ships);
+    TAILQ_INIT(&ship->guildcard_bans);
+    TAILQ_INIT(&ship->ip_bans);
+    TAILQ_INIT(&ship->all_limits);
+    pthread_rwlock_init(&ship->qlock, NULL);
+    pthread_rwlock_init(&ship->llock, NULL);
+    pthread_rwlock_init(&ship->banlock, NULL);
+    pthread_rwlock_init(&ship->gc_lock, NULL);
+    pthread_mutex_init(&ship->ban_idx_lock, NULL);
+    mt19937_init(&ship->rng, (uint32_t)time(NULL));
+    ship->run = 1;
+
+    /* There's no shipgate, so anything sent to it just gets dropped. */
+    ship->sg.sock = -1;
+    ship->sg.ship = ship;
+    pthread_mutex_init(&ship->sg.send_mutex, NULL);
+
+    init_scripts(ship);
+
+    if(!(blk = block_create(ship, 1, 0)))
+        return -1;
+
+    ship->blocks[0] = blk;
+    return 0;
+}
+
+static void bench_cleanup(void) {
+    int i;
+
+    for(i = 0; i < client_count; ++i) {
+        close(clients[i].peer);
+
+        if(clients[i].log.base)
+            pktlog_reader_close(&clients[i].log);
+    }
+
+    block_destroy(blk);
+    cleanup_scripts(ship);
+    pthread_mutex_destroy(&ship->sg.send_mutex);
+    free(ship->sg.sendbuf);
+    free(ship->blocks);
+    free(ship->clients);
+    close(ship->pipes[0]);
+    close(ship->pipes[1]);
+    free(ship->cfg->name);
+    free(ship->cfg);
+    free(ship);
+    free(clients);
+}
+
+/* Read exactly len bytes from the peer end of a client's connection. */
+static int peer_read(bench_client_t *bc, void *buf, size_t len) {
+    struct pollfd pfd = { bc->peer, POLLIN, 0 };
+    uint8_t *p = (uint8_t *)buf;
+    ssize_t rv;
+
+    while(len) {
+        if((rv = read(bc->peer, p, len)) > 0) {
+            p += rv;
+            len -= rv;
+        }
+        else if(rv == -1 && errno == EAGAIN) {
+            if(poll(&pfd, 1, 1000) <= 0)
+                return -1;
+        }
+        else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Throw away everything the server has sent to the client so far, and let the
+   server write out anything it had to queue up. */
+static void peer_drain(bench_client_t *bc) {
+    static uint8_t buf[65536];
+
+    while(read(bc->peer, buf, sizeof(buf)) > 0) {
+    }
+
+    if(!sendq_empty(&bc->c->sendq))
+        client_send_queued(bc->c);
+}
+
+/* Connect a new client to the block, and set up our side of the encryption
+   from the welcome packet it gets. */
+static int bench_connect(bench_client_t *bc, int ver, uint32_t gc) {
+    struct sockaddr_in addr;
+    dc_welcome_pkt dw;
+    bb_welcome_pkt bw;
+    int sv[2];
+
+    if(loopback_pair(sv))
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if(!(bc->c = client_create_connection(sv[0], ver, CLIENT_TYPE_BLOCK,
+                                          blk->clients, ship, blk,
+                                          (struct sockaddr *)&addr,
+                                          sizeof(addr)))) {
+        close(sv[1]);
+        return -1;
+    }
+
+    bc->peer = sv[1];
+    bc->c->guildcard = gc;
+
+    switch(ver) {
+        case CLIENT_VERSION_BB:
+            if(peer_read(bc, &bw, BB_WELCOME_LENGTH))
+                return -1;
+
+            CRYPT_CreateKeys(&bc->key, bw.cvect, CRYPT_BLUEBURST);
+            break;
+
+        case CLIENT_VERSION_GC:
+        case CLIENT_VERSION_EP3:
+        case CLIENT_VERSION_XBOX:
+            if(peer_read(bc, &dw, DC_WELCOME_LENGTH))
+                return -1;
+
+            CRYPT_CreateKeys(&bc->key, &dw.cvect, CRYPT_GAMECUBE);
+            break;
+
+        default:
+            if(peer_read(bc, &dw, DC_WELCOME_LENGTH))
+                return -1;
+
+            CRYPT_CreateKeys(&bc->key, &dw.cvect, CRYPT_PC);
+            break;
+    }
+
+    return 0;
+}
+
+static bench_client_t *find_client(ship_client_t *c) {
+    uint32_t i = c->guildcard - BENCH_GC_BASE;
+
+    if(i < (uint32_t)client_count && clients[i].c == c)
+        return &clients[i];
+
+    for(i = 0; i < (uint32_t)client_count; ++i) {
+        if(clients[i].c == c)
+            return &clients[i];
+    }
+
+    return NULL;
+}
+
+static void stats_add(bench_stats_t *st, uint64_t ns, uint64_t allocs) {
+    uint64_t *tmp;
+
+    if(st->count == st->size) {
+        st->size = st->size ? st->size << 1 : 4096;
+
+        if(!(tmp = (uint64_t *)realloc(st->samples, st->size * 8))) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+
+        st->samples = tmp;
+    }
+
+    st->samples[st->count++] = ns;
+    st->handle_ns += ns;
+    st->allocs += allocs;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void stats_print(const char *name, bench_stats_t *st) {
+    double p50, p99;
+
+    if(!st->count) {
+        printf("%-8s no packets handled\n", name);
+        return;
+    }
+
+    qsort(st->samples, st->count, sizeof(uint64_t), &cmp_u64);
+    p50 = st->samples[st->count / 2] / 1000.0;
+    p99 = st->samples[(st->count * 99) / 100] / 1000.0;
+
+    printf("%-8s %8zu pkts %10.0f pkts/s  p50 %8.2f us  p99 %8.2f us",
+           name, st->count, st->count * 1e9 / st->handle_ns, p50, p99);
+
+    if(HAVE_ALLOC_COUNT)
+        printf("  %6.2f allocs/pkt", (double)st->allocs / st->count);
+
+    if(st->errors)
+        printf("  (%d errors)", st->errors);
+
+    printf("\n");
+
+    free(st->samples);
+    memset(st, 0, sizeof(bench_stats_t));
+}
+
+/* Encrypt a packet, hand it to the server, and time how long it takes to deal
+   with it. Whatever the server sends back to anyone in the same lobby is then
+   thrown away (outside of the timing). */
+static int bench_send(bench_client_t *bc, uint8_t *pkt, int len,
+                      bench_stats_t *st) {
+    struct pollfd pfd = { bc->c->sock, POLLIN, 0 };
+    ship_client_t *c = bc->c;
+    uint64_t t, ns = 0, allocs = 0, a;
+    ssize_t rv;
+    lobby_t *l;
+    bench_client_t *o;
+    int i, off = 0, err = 0;
+
+    while(len & (c->hdr_size - 1)) {
+        pkt[len++] = 0;
+    }
+
+    CRYPT_CryptData(&bc->key, pkt, len, 1);
+
+    /* The whole packet might not fit in the socket buffers at once, so let the
+       server chew on whatever has made it over so far until it's all gone. */
+    while((off < len || c->recvbuf) && !err) {
+        if(off < len) {
+            if((rv = write(bc->peer, pkt + off, len - off)) > 0)
+                off += rv;
+            else if(rv == 0 || errno != EAGAIN)
+                return -1;
+        }
+
+        if(poll(&pfd, 1, 1000) <= 0)
+            return -1;
+
+        a = ALLOCS();
+        t = now_ns();
+        err = client_process_pkt(c);
+        ns += now_ns() - t;
+        allocs += ALLOCS() - a;
+    }
+
+    stats_add(st, ns, allocs);
+
+    if(err)
+        ++st->errors;
+
+    /* Clean up after everyone that might have gotten something. */
+    if((l = c->cur_lobby)) {
+        for(i = 0; i < l->max_clients; ++i) {
+            if(l->clients[i] && (o = find_client(l->clients[i])))
+                peer_drain(o);
+        }
+    }
+
+    peer_drain(bc);
+    return err;
+}
+
+static int bench_hdr(uint8_t *pkt, int type, int flags, int len) {
+    dc_pkt_hdr_t *dc = (dc_pkt_hdr_t *)pkt;
+    pc_pkt_hdr_t *pc = (pc_pkt_hdr_t *)pkt;
+
+    len = (len + 3) & ~3;
+
+    if(version == CLIENT_VERSION_PC) {
+        pc->pkt_type = type;
+        pc->flags = flags;
+        pc->pkt_len = LE16(len);
+    }
+    else {
+        dc->pkt_type = type;
+        dc->flags = flags;
+        dc->pkt_len = LE16(len);
+    }
+
+    return len;
+}
+
+static int bench_join(bench_client_t *bc, bench_stats_t *st) {
+    dc_char_data_pkt *pkt = (dc_char_data_pkt *)pktbuf;
+    size_t sz;
+    int flags;
+
+    switch(version) {
+        case CLIENT_VERSION_DCV2:
+            sz = sizeof(v2_player_t);
+            flags = 2;
+            break;
+
+        case CLIENT_VERSION_PC:
+            sz = sizeof(pc_player_t);
+            flags = 2;
+            break;
+
+        default:
+            sz = sizeof(v3_player_t);
+            flags = 3;
+            break;
+    }
+
+    memset(pktbuf, 0, 4 + sz);
+    sprintf(pkt->data.v1.name, "Bench%04d", (int)(bc - clients));
+    pkt->data.v1.level = LE32(19);
+    pkt->data.v1.section = (uint8_t)(bc - clients) % 10;
+    pkt->data.v1.ch_class = (uint8_t)(bc - clients) % 9;
+
+    return bench_send(bc, pktbuf, bench_hdr(pktbuf, CHAR_DATA_TYPE, flags,
+                                            4 + (int)sz), st);
+}
+
+static int bench_move(bench_client_t *bc, int round, bench_stats_t *st) {
+    subcmd_move_t *pkt = (subcmd_move_t *)pktbuf;
+
+    memset(pktbuf, 0, sizeof(subcmd_move_t));
+    pkt->type = SUBCMD_MOVE_FAST;
+    pkt->size = 3;
+    pkt->client_id = (uint8_t)bc->c->client_id;
+    pkt->x = (float)(round % 200);
+    pkt->z = (float)((round * 7) % 200);
+
+    return bench_send(bc, pktbuf, bench_hdr(pktbuf, GAME_COMMAND0_TYPE, 0,
+                                            0x10), st);
+}
+
+static int bench_chat(bench_client_t *bc, int round, bench_stats_t *st) {
+    dc_chat_pkt *pkt = (dc_chat_pkt *)pktbuf;
+    char msg[64];
+    int len, i;
+
+    len = sprintf(msg, "\tEHello from bench %d, round %d",
+                  (int)(bc - clients), round) + 1;
+
+    memset(pktbuf, 0, 12 + len * 2 + 4);
+    pkt->guildcard = LE32(bc->c->guildcard);
+
+    if(version == CLIENT_VERSION_PC) {
+        for(i = 0; i < len; ++i) {
+            pkt->msg[i << 1] = msg[i];
+        }
+
+        len <<= 1;
+    }
+    else {
+        memcpy(pkt->msg, msg, len);
+    }
+
+    return bench_send(bc, pktbuf, bench_hdr(pktbuf, CHAT_TYPE, 0, 12 + len),
+                      st);
+}
+
+static int run_tests(int count, int rounds, const char *tests) {
+    bench_stats_t st;
+    int i, r;
+
+    memset(&st, 0, sizeof(st));
+
+    if(!(clients = (bench_client_t *)calloc(count, sizeof(bench_client_t)))) {
+        perror("calloc");
+        return -1;
+    }
+
+    for(i = 0; i < count; ++i) {
+        if(bench_connect(&clients[i], version, BENCH_GC_BASE + i)) {
+            fprintf(stderr, "Couldn't connect client %d\n", i);
+            return -1;
+        }
+
+        ++client_count;
+    }
+
+    /* Everyone needs to be in a lobby for the rest, so this always runs. */
+    for(i = 0; i < count; ++i) {
+        bench_join(&clients[i], &st);
+    }
+
+    if(strstr(tests, "join"))
+        stats_print("join", &st);
+    else
+        stats_print("(join)", &st);
+
+    if(strstr(tests, "move")) {
+        for(r = 0; r < rounds; ++r) {
+            for(i = 0; i < count; ++i) {
+                bench_move(&clients[i], r, &st);
+            }
+        }
+
+        stats_print("move", &st);
+    }
+
+    if(strstr(tests, "chat")) {
+        for(r = 0; r < rounds; ++r) {
+            for(i = 0; i < count; ++i) {
+                bench_chat(&clients[i], r, &st);
+            }
+        }
+
+        stats_print("chat", &st);
+    }
+
+    return 0;
+}
+
+static int next_recv(bench_client_t *bc) {
+    int rv;
+
+    while((rv = pktlog_reader_next(&bc->log, &bc->next)) == 1) {
+        if(bc->next.type == PKTLOG_RECV)
+            return (bc->has_next = 1);
+    }
+
+    return (bc->has_next = 0);
+}
+
+/* Replay the client side of a set of captures, interleaving them in the order
+   the server originally got the packets. */
+static int run_replay(int count, char *files[]) {
+    bench_stats_t st;
+    pktlog_entry_t e;
+    pktlog_session_t s;
+    bench_client_t *bc, *o;
+    int i, rv;
+
+    memset(&st, 0, sizeof(st));
+
+    if(!(clients = (bench_client_t *)calloc(count, sizeof(bench_client_t)))) {
+        perror("calloc");
+        return -1;
+    }
+
+    for(i = 0; i < count; ++i) {
+        bc = &clients[client_count];
+
+        if(pktlog_reader_open(&bc->log, files[i])) {
+            fprintf(stderr, "%s: can't read capture\n", files[i]);
+            continue;
+        }
+
+        /* Find out what kind of connection it was. */
+        while((rv = pktlog_reader_next(&bc->log, &e)) == 1 &&
+              e.type != PKTLOG_SESSION) {
+        }
+
+        if(rv != 1 || pktlog_read_session(&e, &s) || !s.block) {
+            fprintf(stderr, "%s: no block session, skipping\n", files[i]);
+            pktlog_reader_close(&bc->log);
+            continue;
+        }
+
+        if(bench_connect(bc, s.version, BENCH_GC_BASE + client_count)) {
+            fprintf(stderr, "%s: couldn't connect client\n", files[i]);
+            pktlog_reader_close(&bc->log);
+            continue;
+        }
+
+        ++client_count;
+        next_recv(bc);
+    }
+
+    for(;;) {
+        bc = NULL;
+
+        for(i = 0; i < client_count; ++i) {
+            o = &clients[i];
+
+            if(o->has_next &&
+               (!bc || o->next.timestamp < bc->next.timestamp))
+                bc = o;
+        }
+
+        if(!bc)
+            break;
+
+        if(bc->next.len <= BENCH_MAX_PKT) {
+            memcpy(pktbuf, bc->next.data, bc->next.len);
+            bench_send(bc, pktbuf, (int)bc->next.len, &st);
+        }
+
+        next_recv(bc);
+    }
+
+    stats_print("replay", &st);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int i, count = 48, rounds = 1000, rv;
+    const char *tests = "join,move,chat";
+
+    for(i = 1; i < argc && argv[i][0] == '-'; ++i) {
+        if(!strcmp(argv[i], "--help")) {
+            print_help(argv[0]);
+            return EXIT_SUCCESS;
+        }
+        else if(i == argc - 1) {
+            printf("%s requires an argument!\n\n", argv[i]);
+            print_help(argv[0]);
+            return EXIT_FAILURE;
+        }
+        else if(!strcmp(argv[i], "-n")) {
+            count = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "-r")) {
+            rounds = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "-t")) {
+            tests = argv[++i];
+        }
+        else if(!strcmp(argv[i], "-v")) {
+            ++i;
+
+            if(!strcmp(argv[i], "dc"))
+                version = CLIENT_VERSION_DCV2;
+            else if(!strcmp(argv[i], "pc"))
+                version = CLIENT_VERSION_PC;
+            else if(!strcmp(argv[i], "gc"))
+                version = CLIENT_VERSION_GC;
+            else {
+                printf("Unknown client version: %s\n\n", argv[i]);
+                print_help(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        else {
+            printf("Illegal command line argument: %s\n", argv[i]);
+            print_help(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(count < 1 || rounds < 0) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    debug_set_threshold(DBG_ERROR);
+
+    if(init_iconv() || client_init(NULL) || bench_setup())
+        return EXIT_FAILURE;
+
+    if(i < argc)
+        rv = run_replay(argc - i, argv + i);
+    else
+        rv = run_tests(count, rounds, tests);
+
+    bench_cleanup();
+    cleanup_iconv();
+    client_shutdown();
+    lobby_pool_cleanup();
+    sendq_pool_cleanup();
+
+    return rv ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1363 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* ship_loadgen: a synthetic load generator for a running ship. Each fake
+   client connects to the ship port for its version, logs in, picks a block,
+   follows the redirect to it, logs in again, sends its character data and
+   lands in a lobby (and optionally a game with some of the other fake
+   clients). From there, it sends movement subcommands and chat messages at the
+   requested rates.
+
+   Every movement packet carries the time it was sent in place of one of its
+   coordinates, so the clients that get it forwarded to them can tell how long
+   it took to get through the ship (fanout latency). Chat messages carry the
+   time in their text, and the ship sends them back to their sender along with
+   everyone else, which gives the round trip time (echo latency). All of the
+   clients live in one process, so they all share one clock. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <sylverant/encryption.h>
+
+#include "player.h"
+#include "packets.h"
+#include "evloop.h"
+#include "ship_packets.h"
+#include "subcmd.h"
+
+#define VERSION_DC          0
+#define VERSION_PC          1
+#define VERSION_GC          2
+#define VERSION_BB          3
+
+/* Offsets from the ship's base port for each version's listening sockets. */
+static const int port_offsets[4] = { 0, 1, 2, 4 };
+static const char *version_names[4] = { "dc", "pc", "gc", "bb" };
+
+/* Client states. */
+#define LG_ST_IDLE          0   /* Not connected yet */
+#define LG_ST_SHIP_WELCOME  1   /* Connecting to the ship */
+#define LG_ST_SHIP          2   /* Logged in, waiting for the redirect */
+#define LG_ST_BLOCK_WELCOME 3   /* Connecting to the block */
+#define LG_ST_BLOCK         4   /* Logged in, waiting for a lobby */
+#define LG_ST_LOBBY         5
+#define LG_ST_GAME_WAIT     6   /* Creating or looking for the group's game */
+#define LG_ST_GAME          7
+#define LG_ST_DEAD          8
+
+#define LG_IN_BUF_SIZE      8192
+#define LG_OUT_BUF_SIZE     8192
+
+/* How long a client gets from starting to connect to reaching a lobby. */
+#define LG_LOGIN_TIMEOUT    30000000
+
+/* How long to wait before trying again to create or find a game. */
+#define LG_GAME_RETRY       2000000
+
+/* Marker put in the unused byte of our own movement subcommands, so that
+   packets from any real clients in the same lobby get ignored. */
+#define LG_MOVE_MARKER      0xA5
+
+/* Latency histogram. Values under 16us get a bucket each, everything else is
+   bucketed by power of two with 8 linear steps in between (so each bucket is
+   within 12.5% of the values in it). */
+#define LG_HIST_BUCKETS     240
+
+typedef struct lg_hist {
+    uint64_t b[LG_HIST_BUCKETS];
+} lg_hist_t;
+
+typedef struct lg_stats {
+    uint64_t pkts_sent;
+    uint64_t pkts_recv;
+    uint64_t bytes_sent;
+    uint64_t bytes_recv;
+    uint64_t stalls;
+    uint64_t disconnects;
+    uint64_t timeouts;
+    lg_hist_t echo;
+    lg_hist_t fanout;
+} lg_stats_t;
+
+typedef struct lg_client {
+    int idx;
+    int sock;
+    int state;
+    uint32_t gc;
+    uint8_t client_id;
+    struct lg_thread *thd;
+
+    CRYPT_SETUP ckey;                   /* Client to server */
+    CRYPT_SETUP skey;                   /* Server to client */
+
+    uint8_t *inbuf;
+    int in_size;
+    int in_len;
+    int pkt_len;                        /* Non-zero once the header of the first
+                                           packet in inbuf is decrypted */
+
+    uint8_t outbuf[LG_OUT_BUF_SIZE];
+    int out_len;
+    int want_write;
+
+    uint64_t start_at;
+    uint64_t next_move;
+    uint64_t next_chat;
+    uint64_t next_try;
+    uint32_t move_seq;
+} lg_client_t;
+
+typedef struct lg_thread {
+    pthread_t thd;
+    evloop_t *evl;
+    int first;
+    unsigned int seed;
+} lg_thread_t;
+
+static lg_client_t *clients;
+static lg_thread_t *threads;
+static int client_count = 100;
+static int thread_count = 4;
+static int version = VERSION_GC;
+static int hdr_size = 4;
+static uint32_t gc_base = 10000000;
+static int block_count = 1;
+static int game_size = 0;
+static double move_rate = 10.0;
+static double chat_rate = 1.0;
+static double connect_rate = 50.0;
+static int duration = 60;
+static int interval = 5;
+static int keep_host = 0;
+static int bb_slot = 0;
+static const char *bb_password = "password";
+
+static struct sockaddr_storage ship_addr;
+static socklen_t ship_addr_len;
+
+static uint8_t *game_ready;
+static volatile sig_atomic_t stop = 0;
+static lg_stats_t stats;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+#define STAT_ADD(f, v)  __atomic_add_fetch(&stats.f, (v), __ATOMIC_RELAXED)
+
+static int hist_bucket(uint32_t v) {
+    int e;
+
+    if(v < 16)
+        return (int)v;
+
+    e = 31 - __builtin_clz(v);
+    return 16 + (e - 4) * 8 + ((v >> (e - 3)) & 7);
+}
+
+static uint32_t hist_value(int b) {
+    int e;
+
+    if(b < 16)
+        return (uint32_t)b;
+
+    e = (b - 16) / 8 + 4;
+    return (uint32_t)(8 + ((b - 16) & 7)) << (e - 3);
+}
+
+static void hist_add(lg_hist_t *h, uint32_t v) {
+    __atomic_add_fetch(&h->b[hist_bucket(v)], 1, __ATOMIC_RELAXED);
+}
+
+static void print_help(const char *bin) {
+    printf("Usage: %s [arguments] host\n"
+           "-----------------------------------------------------------------\n"
+           "-p port         The ship's base port (required). The port for the\n"
+           "                version in use is worked out from this.\n"
+           "-v version      Client version: dc, pc, gc, or bb (default: gc).\n"
+           "-n clients      Number of fake clients (default: 100).\n"
+           "-j threads      Number of threads to spread the clients over\n"
+           "                (default: 4).\n"
+           "-g guildcard    Guild card number of the first client, the rest\n"
+           "                count up from there (default: 10000000).\n"
+           "-b blocks       Spread the clients over blocks 1 through this\n"
+           "                (default: 1).\n"
+           "-G size         Put the clients in games of this many players\n"
+           "                (2-4), rather than leaving them in the lobby.\n"
+           "-m rate         Movement subcommands per second per client\n"
+           "                (default: 10).\n"
+           "-c rate         Chat messages per second per client\n"
+           "                (default: 1).\n"
+           "-r rate         New connections per second (default: 50).\n"
+           "-d seconds      How long to run for (default: 60).\n"
+           "-i seconds      How often to print stats (default: 5).\n"
+           "-s slot         Character slot for Blue Burst (default: 0).\n"
+           "-P password     Password for Blue Burst (default: password).\n"
+           "--keep-host     Connect to blocks on the host given, rather than\n"
+           "                the address the ship redirects to.\n"
+           "--help          Print this help and exit\n\n"
+           "The ship takes the guild card numbers given by the clients as is,\n"
+           "so pick a range that isn't in use by any real players. Blue Burst\n"
+           "characters come from the shipgate, so Blue Burst clients only get\n"
+           "as far as a lobby if there's a character in the slot given for\n"
+           "every guild card number used.\n", bin);
+}
+
+static int parse_version(const char *s) {
+    int i;
+
+    for(i = 0; i < 4; ++i) {
+        if(!strcmp(s, version_names[i]))
+            return i;
+    }
+
+    return -1;
+}
+
+static void parse_command_line(int argc, char *argv[]) {
+    const char *host = NULL;
+    struct addrinfo hints, *res;
+    int i, port = 0, err;
+    char pstr[16];
+
+    for(i = 1; i < argc; ++i) {
+        if(!strcmp(argv[i], "--help")) {
+            print_help(argv[0]);
+            exit(EXIT_SUCCESS);
+        }
+        else if(!strcmp(argv[i], "--keep-host")) {
+            keep_host = 1;
+        }
+        else if(argv[i][0] == '-' && argv[i][1] && !argv[i][2] &&
+                i + 1 < argc) {
+            switch(argv[i][1]) {
+                case 'p': port = atoi(argv[++i]); break;
+                case 'n': client_count = atoi(argv[++i]); break;
+                case 'j': thread_count = atoi(argv[++i]); break;
+                case 'g': gc_base = (uint32_t)strtoul(argv[++i], NULL, 0);
+                          break;
+                case 'b': block_count = atoi(argv[++i]); break;
+                case 'G': game_size = atoi(argv[++i]); break;
+                case 'm': move_rate = atof(argv[++i]); break;
+                case 'c': chat_rate = atof(argv[++i]); break;
+                case 'r': connect_rate = atof(argv[++i]); break;
+                case 'd': duration = atoi(argv[++i]); break;
+                case 'i': interval = atoi(argv[++i]); break;
+                case 's': bb_slot = atoi(argv[++i]); break;
+                case 'P': bb_password = argv[++i]; break;
+
+                case 'v':
+                    if((version = parse_version(argv[++i])) < 0) {
+                        printf("Unknown version: %s\n", argv[i]);
+                        exit(EXIT_FAILURE);
+                    }
+                    break;
+
+                default:
+                    printf("Illegal command line argument: %s\n", argv[i]);
+                    print_help(argv[0]);
+                    exit(EXIT_FAILURE);
+            }
+        }
+        else if(argv[i][0] != '-' && !host) {
+            host = argv[i];
+        }
+        else {
+            printf("Illegal command line argument: %s\n", argv[i]);
+            print_help(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(!host || port <= 0 || port > 65535 - 5) {
+        print_help(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if(client_count < 1 || thread_count < 1 || block_count < 1 ||
+       connect_rate <= 0.0 || interval < 1 ||
+       (game_size && (game_size < 2 || game_size > 4))) {
+        printf("Invalid arguments.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(thread_count > client_count)
+        thread_count = client_count;
+
+    hdr_size = version == VERSION_BB ? 8 : 4;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    sprintf(pstr, "%d", port + port_offsets[version]);
+
+    if((err = getaddrinfo(host, pstr, &hints, &res))) {
+        printf("Can't resolve %s: %s\n", host, gai_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(&ship_addr, res->ai_addr, res->ai_addrlen);
+    ship_addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+}
+
+static int lg_hdr(uint8_t *pkt, int type, int flags, int len) {
+    dc_pkt_hdr_t *dc = (dc_pkt_hdr_t *)pkt;
+    pc_pkt_hdr_t *pc = (pc_pkt_hdr_t *)pkt;
+    bb_pkt_hdr_t *bb = (bb_pkt_hdr_t *)pkt;
+
+    len = (len + 3) & ~3;
+
+    switch(version) {
+        case VERSION_PC:
+            pc->pkt_type = type;
+            pc->flags = flags;
+            pc->pkt_len = LE16(len);
+            break;
+
+        case VERSION_BB:
+            bb->pkt_type = LE16(type);
+            bb->flags = LE32(flags);
+            bb->pkt_len = LE16(len);
+            break;
+
+        default:
+            dc->pkt_type = type;
+            dc->flags = flags;
+            dc->pkt_len = LE16(len);
+            break;
+    }
+
+    return len;
+}
+
+static void lg_drop(lg_client_t *c, int timeout) {
+    if(c->sock >= 0) {
+        evloop_del(c->thd->evl, c->sock);
+        close(c->sock);
+        c->sock = -1;
+    }
+
+    if(c->state != LG_ST_DEAD) {
+        if(timeout)
+            STAT_ADD(timeouts, 1);
+        else
+            STAT_ADD(disconnects, 1);
+    }
+
+    __atomic_store_n(&c->state, LG_ST_DEAD, __ATOMIC_RELAXED);
+}
+
+static void lg_set_state(lg_client_t *c, int state) {
+    __atomic_store_n(&c->state, state, __ATOMIC_RELAXED);
+}
+
+static int lg_flush(lg_client_t *c) {
+    ssize_t rv;
+
+    while(c->out_len) {
+        if((rv = send(c->sock, c->outbuf, c->out_len, MSG_NOSIGNAL)) > 0) {
+            memmove(c->outbuf, c->outbuf + rv, c->out_len - rv);
+            c->out_len -= rv;
+            STAT_ADD(bytes_sent, rv);
+        }
+        else if(rv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        else {
+            return -1;
+        }
+    }
+
+    /* Only wait on the socket being writable while there's something left. */
+    if(!!c->out_len != c->want_write) {
+        c->want_write = !!c->out_len;
+        evloop_mod(c->thd->evl, c->sock, EVLOOP_READ |
+                   (c->want_write ? EVLOOP_WRITE : 0));
+    }
+
+    return 0;
+}
+
+/* Encrypt a packet and send it along. If the ship isn't keeping up with what
+   we're sending, the packet is dropped (and counted as a stall) rather than
+   piling up. */
+static int lg_send(lg_client_t *c, uint8_t *pkt, int len) {
+    while(len & (hdr_size - 1)) {
+        pkt[len++] = 0;
+    }
+
+    if(c->out_len + len > LG_OUT_BUF_SIZE) {
+        STAT_ADD(stalls, 1);
+        return 0;
+    }
+
+    CRYPT_CryptData(&c->ckey, pkt, len, 1);
+    memcpy(c->outbuf + c->out_len, pkt, len);
+    c->out_len += len;
+    STAT_ADD(pkts_sent, 1);
+
+    return lg_flush(c);
+}
+
+static int lg_send_simple(lg_client_t *c, int type, int flags) {
+    uint8_t pkt[8];
+
+    memset(pkt, 0, sizeof(pkt));
+    return lg_send(c, pkt, lg_hdr(pkt, type, flags, hdr_size));
+}
+
+static int lg_connect(lg_client_t *c, const struct sockaddr *addr,
+                      socklen_t len, int state) {
+    int i = 1;
+
+    if((c->sock = socket(addr->sa_family, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(int));
+
+    if((i = fcntl(c->sock, F_GETFL)) == -1 ||
+       fcntl(c->sock, F_SETFL, i | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        close(c->sock);
+        c->sock = -1;
+        return -1;
+    }
+
+    if(connect(c->sock, addr, len) && errno != EINPROGRESS) {
+        close(c->sock);
+        c->sock = -1;
+        return -1;
+    }
+
+    c->in_len = c->pkt_len = c->out_len = 0;
+    c->want_write = 1;
+    lg_set_state(c, state);
+
+    return evloop_add(c->thd->evl, c->sock, EVLOOP_READ | EVLOOP_WRITE, c);
+}
+
+static int lg_send_login(lg_client_t *c) {
+    uint8_t pkt[sizeof(gc_login_9e_pkt) + sizeof(bb_login_93_pkt)];
+    char serial[16];
+
+    memset(pkt, 0, sizeof(pkt));
+    sprintf(serial, "%08" PRIX32, c->gc);
+
+    switch(version) {
+        case VERSION_DC:
+        case VERSION_PC:
+        {
+            dcv2_login_9d_pkt *p = (dcv2_login_9d_pkt *)pkt;
+
+            p->tag = LE32(0x00010000);
+            p->guildcard = LE32(c->gc);
+            p->language_code = 1;
+            memcpy(p->serial, serial, 8);
+            memcpy(p->access_key, serial, 8);
+            memcpy(p->dc_id, serial, 8);
+
+            return lg_send(c, pkt, lg_hdr(pkt, LOGIN_9D_TYPE, 0,
+                                          sizeof(dcv2_login_9d_pkt)));
+        }
+
+        case VERSION_GC:
+        {
+            gc_login_9e_pkt *p = (gc_login_9e_pkt *)pkt;
+
+            p->tag = LE32(0x00010000);
+            p->guildcard = LE32(c->gc);
+            p->version = 0x30;
+            p->language_code = 1;
+            memcpy(p->serial, serial, 8);
+            memcpy(p->access_key, serial, 8);
+            memcpy(p->serial2, serial, 8);
+            memcpy(p->access_key2, serial, 8);
+            sprintf(p->name, "LG%d", c->idx);
+
+            return lg_send(c, pkt, lg_hdr(pkt, LOGIN_9E_TYPE, 0,
+                                          sizeof(gc_login_9e_pkt)));
+        }
+
+        case VERSION_BB:
+        {
+            bb_login_93_pkt *p = (bb_login_93_pkt *)pkt;
+
+            p->tag = LE32(0x00010000);
+            p->guildcard = LE32(c->gc);
+            sprintf(p->username, "lg%" PRIu32, c->gc);
+            strncpy(p->password, bb_password, sizeof(p->password));
+
+            /* The security data is what the login server would have handed
+               the client after it picked a character. */
+            put_le32(p->security_data, 0xDEADBEEF);
+            p->security_data[4] = (uint8_t)bb_slot;
+            p->security_data[5] = 1;
+
+            return lg_send(c, pkt, lg_hdr(pkt, LOGIN_93_TYPE, 0,
+                                          sizeof(bb_login_93_pkt)));
+        }
+    }
+
+    return -1;
+}
+
+static int lg_send_char(lg_client_t *c) {
+    uint8_t pkt[sizeof(dc_char_data_pkt) + 8];
+    dc_char_data_pkt *p = (dc_char_data_pkt *)pkt;
+    size_t sz;
+    int flags;
+
+    switch(version) {
+        case VERSION_DC:
+            sz = sizeof(v2_player_t);
+            flags = 2;
+            break;
+
+        case VERSION_PC:
+            sz = sizeof(pc_player_t);
+            flags = 2;
+            break;
+
+        default:
+            sz = sizeof(v3_player_t);
+            flags = 3;
+            break;
+    }
+
+    memset(pkt, 0, sizeof(pkt));
+    sprintf(p->data.v1.name, "LG%d", c->idx);
+    p->data.v1.level = LE32(19);
+    p->data.v1.section = (uint8_t)(c->idx % 10);
+    p->data.v1.ch_class = (uint8_t)(c->idx % 9);
+
+    return lg_send(c, pkt, lg_hdr(pkt, CHAR_DATA_TYPE, flags, 4 + (int)sz));
+}
+
+static int lg_send_select(lg_client_t *c, uint32_t menu, uint32_t item) {
+    uint8_t pkt[16];
+
+    memset(pkt, 0, sizeof(pkt));
+    put_le32(pkt + hdr_size, menu);
+    put_le32(pkt + hdr_size + 4, item);
+
+    return lg_send(c, pkt, lg_hdr(pkt, MENU_SELECT_TYPE, 0, hdr_size + 8));
+}
+
+/* Put a plain ASCII string into a packet in the client's encoding. */
+static int lg_put_str(uint8_t *p, const char *s, int max) {
+    int i, len = (int)strlen(s);
+
+    if(len > max)
+        len = max;
+
+    if(version == VERSION_PC || version == VERSION_BB) {
+        for(i = 0; i < len; ++i) {
+            p[i << 1] = (uint8_t)s[i];
+            p[(i << 1) + 1] = 0;
+        }
+
+        return len << 1;
+    }
+
+    memcpy(p, s, len);
+    return len;
+}
+
+/* And the reverse, taking the low byte of every character for the wide string
+   versions. */
+static int lg_get_str(char *out, const uint8_t *p, int len, int max) {
+    int i, j = 0;
+
+    if(version == VERSION_PC || version == VERSION_BB) {
+        for(i = 0; i + 1 < len && j < max - 1; i += 2) {
+            if(!p[i] && !p[i + 1])
+                break;
+
+            out[j++] = (char)p[i];
+        }
+    }
+    else {
+        for(i = 0; i < len && p[i] && j < max - 1; ++i) {
+            out[j++] = (char)p[i];
+        }
+    }
+
+    out[j] = 0;
+    return j;
+}
+
+static int lg_send_create(lg_client_t *c) {
+    uint8_t pkt[sizeof(bb_game_create_pkt) + 8];
+    char name[16];
+    int off = hdr_size + 8, namesz = 16;
+
+    memset(pkt, 0, sizeof(pkt));
+    sprintf(name, "LG%05d", c->idx / game_size);
+
+    if(version == VERSION_PC || version == VERSION_BB)
+        namesz = 32;
+
+    /* Name, then an empty password and normal difficulty/battle/challenge
+       settings. Episode 1 on the versions that care. */
+    lg_put_str(pkt + off, name, 15);
+    off += namesz * 2 + 3;
+
+    if(version == VERSION_GC || version == VERSION_BB)
+        pkt[off] = 1;
+
+    if(version == VERSION_BB)
+        off += 4;
+
+    return lg_send(c, pkt, lg_hdr(pkt, version == VERSION_DC ?
+                                  DC_GAME_CREATE_TYPE : GAME_CREATE_TYPE, 0,
+                                  off + 1));
+}
+
+/* Look for our group's game in a game list, and ask to join it if it's
+   there. */
+static int lg_find_game(lg_client_t *c, const uint8_t *pkt, int len) {
+    char want[16], name[20];
+    int esz, off;
+
+    esz = (version == VERSION_PC || version == VERSION_BB) ? 44 : 28;
+    sprintf(want, "LG%05d", c->idx / game_size);
+
+    for(off = hdr_size; off + esz <= len; off += esz) {
+        lg_get_str(name, pkt + off + 10, esz - 12, sizeof(name));
+
+        if(strstr(name, want))
+            return lg_send_select(c, MENU_ID_GAME, get_le32(pkt + off + 4));
+    }
+
+    return 0;
+}
+
+static int lg_send_move(lg_client_t *c, uint64_t now) {
+    uint8_t pkt[32];
+    uint8_t *sc = pkt + hdr_size;
+    int len;
+
+    memset(pkt, 0, sizeof(pkt));
+
+    /* Mostly running around, with some walking and a position update every
+       so often. The send time always ends up at the same spot in the
+       subcommand, whichever type it is. */
+    switch(c->move_seq++ & 7) {
+        case 3:
+            sc[0] = SUBCMD_MOVE_SLOW;
+            sc[1] = 4;
+            break;
+
+        case 7:
+            sc[0] = SUBCMD_SET_POS_3F;
+            sc[1] = 6;
+            break;
+
+        default:
+            sc[0] = SUBCMD_MOVE_FAST;
+            sc[1] = 3;
+            break;
+    }
+
+    sc[2] = c->client_id;
+    sc[3] = LG_MOVE_MARKER;
+    put_le32(sc + 4, c->move_seq);
+    put_le32(sc + 8, (uint32_t)now);
+    len = hdr_size + sc[1] * 4;
+
+    return lg_send(c, pkt, lg_hdr(pkt, GAME_COMMAND0_TYPE, 0, len));
+}
+
+static int lg_send_chat(lg_client_t *c, uint64_t now) {
+    uint8_t pkt[128];
+    char msg[32];
+    int len;
+
+    memset(pkt, 0, sizeof(pkt));
+    put_le32(pkt + hdr_size + 4, c->gc);
+    sprintf(msg, "\tELG:%08" PRIx32, (uint32_t)now);
+    len = hdr_size + 8 + lg_put_str(pkt + hdr_size + 8, msg, 31);
+    len += (version == VERSION_PC || version == VERSION_BB) ? 2 : 1;
+
+    return lg_send(c, pkt, lg_hdr(pkt, CHAT_TYPE, 0, len));
+}
+
+static void lg_got_move(lg_client_t *c, const uint8_t *pkt, int len) {
+    const uint8_t *sc = pkt + hdr_size;
+
+    if(len < hdr_size + 12 || sc[3] != LG_MOVE_MARKER || sc[2] == c->client_id)
+        return;
+
+    switch(sc[0]) {
+        case SUBCMD_MOVE_SLOW:
+        case SUBCMD_MOVE_FAST:
+        case SUBCMD_SET_POS_3F:
+            hist_add(&stats.fanout, (uint32_t)now_us() - get_le32(sc + 8));
+            break;
+    }
+}
+
+static void lg_got_chat(lg_client_t *c, const uint8_t *pkt, int len) {
+    char msg[128], *s;
+    uint32_t sent;
+
+    if(len < hdr_size + 8 || get_le32(pkt + hdr_size + 4) != c->gc)
+        return;
+
+    lg_get_str(msg, pkt + hdr_size + 8, len - hdr_size - 8, sizeof(msg));
+
+    if((s = strstr(msg, "LG:")) && sscanf(s + 3, "%8" SCNx32, &sent) == 1)
+        hist_add(&stats.echo, (uint32_t)now_us() - sent);
+}
+
+static void lg_enter_lobby(lg_client_t *c, uint64_t now) {
+    double r = (double)rand_r(&c->thd->seed) / RAND_MAX;
+
+    /* Spread everyone's traffic out, rather than having it all line up
+       behind the connection rate. */
+    if(move_rate > 0.0)
+        c->next_move = now + (uint64_t)(r * 1000000.0 / move_rate);
+
+    if(chat_rate > 0.0)
+        c->next_chat = now + (uint64_t)(r * 1000000.0 / chat_rate);
+
+    c->next_try = now;
+    lg_set_state(c, LG_ST_LOBBY);
+}
+
+static int lg_redirect(lg_client_t *c, const uint8_t *pkt, int len,
+                       int flags) {
+    struct sockaddr_storage addr;
+    struct sockaddr_in *a4 = (struct sockaddr_in *)&addr;
+    struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)&addr;
+    socklen_t alen = ship_addr_len;
+    uint16_t port;
+    int v6 = flags == 6;
+
+    if(len < hdr_size + (v6 ? 18 : 6))
+        return -1;
+
+    port = pkt[hdr_size + (v6 ? 16 : 4)] |
+        (pkt[hdr_size + (v6 ? 17 : 5)] << 8);
+    memcpy(&addr, &ship_addr, ship_addr_len);
+
+    if(!keep_host) {
+        memset(&addr, 0, sizeof(addr));
+
+        if(v6) {
+            a6->sin6_family = AF_INET6;
+            memcpy(&a6->sin6_addr, pkt + hdr_size, 16);
+            alen = sizeof(struct sockaddr_in6);
+        }
+        else {
+            a4->sin_family = AF_INET;
+            memcpy(&a4->sin_addr, pkt + hdr_size, 4);
+            alen = sizeof(struct sockaddr_in);
+        }
+    }
+
+    if(addr.ss_family == AF_INET6)
+        a6->sin6_port = htons(port);
+    else
+        a4->sin_port = htons(port);
+
+    evloop_del(c->thd->evl, c->sock);
+    close(c->sock);
+    c->sock = -1;
+
+    return lg_connect(c, (struct sockaddr *)&addr, alen, LG_ST_BLOCK_WELCOME);
+}
+
+static int lg_handle(lg_client_t *c, uint8_t *pkt, int len) {
+    int type, flags;
+    uint64_t now;
+
+    switch(version) {
+        case VERSION_PC:
+            type = pkt[2];
+            flags = pkt[3];
+            break;
+
+        case VERSION_BB:
+            type = pkt[2] | (pkt[3] << 8);
+            flags = pkt[4];
+            break;
+
+        default:
+            type = pkt[0];
+            flags = pkt[1];
+            break;
+    }
+
+    STAT_ADD(pkts_recv, 1);
+
+    switch(type) {
+        case PING_TYPE:
+            return lg_send_simple(c, PING_TYPE, 0);
+
+        case BLOCK_LIST_TYPE:
+            if(c->state == LG_ST_SHIP)
+                return lg_send_select(c, MENU_ID_BLOCK,
+                                      c->idx % block_count + 1);
+            return 0;
+
+        case REDIRECT_TYPE:
+            return lg_redirect(c, pkt, len, flags) ? -1 : 1;
+
+        case CHAR_DATA_REQUEST_TYPE:
+            if(version != VERSION_BB)
+                return lg_send_char(c);
+            return 0;
+
+        case LOBBY_JOIN_TYPE:
+            if(len > hdr_size)
+                c->client_id = pkt[hdr_size];
+
+            lg_enter_lobby(c, now_us());
+            return 0;
+
+        case GAME_JOIN_TYPE:
+            switch(version) {
+                case VERSION_PC:
+                    flags = offsetof(pc_game_join_pkt, client_id);
+                    break;
+
+                case VERSION_BB:
+                    flags = offsetof(bb_game_join_pkt, client_id);
+                    break;
+
+                default:
+                    flags = offsetof(dc_game_join_pkt, client_id);
+                    break;
+            }
+
+            if(len <= flags)
+                return -1;
+
+            c->client_id = pkt[flags];
+            now = now_us();
+            lg_enter_lobby(c, now);
+            lg_set_state(c, LG_ST_GAME);
+
+            if(!(c->idx % game_size))
+                __atomic_store_n(&game_ready[c->idx / game_size], 1,
+                                 __ATOMIC_RELEASE);
+
+            return lg_send_simple(c, DONE_BURSTING_TYPE, 0);
+
+        case GAME_LIST_TYPE:
+            if(c->state == LG_ST_GAME_WAIT)
+                return lg_find_game(c, pkt, len);
+            return 0;
+
+        case GAME_COMMAND0_TYPE:
+            lg_got_move(c, pkt, len);
+            return 0;
+
+        case CHAT_TYPE:
+            lg_got_chat(c, pkt, len);
+            return 0;
+    }
+
+    /* Anything else (message boxes, lobby lists, other players coming and
+       going, and so on) doesn't need an answer. */
+    return 0;
+}
+
+static int lg_welcome(lg_client_t *c) {
+    int wlen = version == VERSION_BB ? BB_WELCOME_LENGTH : DC_WELCOME_LENGTH;
+    dc_welcome_pkt *dw = (dc_welcome_pkt *)c->inbuf;
+    bb_welcome_pkt *bw = (bb_welcome_pkt *)c->inbuf;
+
+    if(c->in_len < wlen)
+        return 0;
+
+    switch(version) {
+        case VERSION_BB:
+            CRYPT_CreateKeys(&c->skey, bw->svect, CRYPT_BLUEBURST);
+            CRYPT_CreateKeys(&c->ckey, bw->cvect, CRYPT_BLUEBURST);
+            break;
+
+        case VERSION_GC:
+            CRYPT_CreateKeys(&c->skey, &dw->svect, CRYPT_GAMECUBE);
+            CRYPT_CreateKeys(&c->ckey, &dw->cvect, CRYPT_GAMECUBE);
+            break;
+
+        default:
+            CRYPT_CreateKeys(&c->skey, &dw->svect, CRYPT_PC);
+            CRYPT_CreateKeys(&c->ckey, &dw->cvect, CRYPT_PC);
+            break;
+    }
+
+    memmove(c->inbuf, c->inbuf + wlen, c->in_len - wlen);
+    c->in_len -= wlen;
+    lg_set_state(c, c->state == LG_ST_SHIP_WELCOME ? LG_ST_SHIP : LG_ST_BLOCK);
+
+    if(lg_send_login(c))
+        return -1;
+
+    return 1;
+}
+
+static int lg_read(lg_client_t *c) {
+    ssize_t rv;
+    int off = 0, len;
+    uint8_t *tmp;
+
+    if((rv = recv(c->sock, c->inbuf + c->in_len, c->in_size - c->in_len,
+                  0)) <= 0) {
+        if(rv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+
+        return -1;
+    }
+
+    c->in_len += rv;
+    STAT_ADD(bytes_recv, rv);
+
+    if(c->state == LG_ST_SHIP_WELCOME || c->state == LG_ST_BLOCK_WELCOME) {
+        if((rv = lg_welcome(c)) <= 0)
+            return (int)rv;
+    }
+
+    while(c->in_len - off >= hdr_size) {
+        /* Decrypt the header to see how long the packet is. */
+        if(!c->pkt_len) {
+            CRYPT_CryptData(&c->skey, c->inbuf + off, hdr_size, 0);
+
+            if(version == VERSION_DC || version == VERSION_GC)
+                len = c->inbuf[off + 2] | (c->inbuf[off + 3] << 8);
+            else
+                len = c->inbuf[off] | (c->inbuf[off + 1] << 8);
+
+            len = (len + hdr_size - 1) & ~(hdr_size - 1);
+
+            if(len < hdr_size)
+                return -1;
+
+            c->pkt_len = len;
+        }
+
+        if(c->in_len - off < c->pkt_len) {
+            /* Make sure the packet will fit once the rest of it shows up. */
+            if(c->pkt_len > c->in_size) {
+                if(!(tmp = (uint8_t *)realloc(c->inbuf, c->pkt_len)))
+                    return -1;
+
+                c->inbuf = tmp;
+                c->in_size = c->pkt_len;
+            }
+
+            break;
+        }
+
+        CRYPT_CryptData(&c->skey, c->inbuf + off + hdr_size,
+                        c->pkt_len - hdr_size, 0);
+        len = c->pkt_len;
+        c->pkt_len = 0;
+
+        /* A redirect starts everything over on a new connection. */
+        if((rv = lg_handle(c, c->inbuf + off, len)))
+            return rv < 0 ? -1 : 0;
+
+        off += len;
+    }
+
+    if(off) {
+        memmove(c->inbuf, c->inbuf + off, c->in_len - off);
+        c->in_len -= off;
+    }
+
+    return 0;
+}
+
+/* Deal with anything the client has to do at this point in time, returning
+   when it next needs looking at. */
+static uint64_t lg_run_client(lg_client_t *c, uint64_t now) {
+    uint64_t next = UINT64_MAX;
+    int leader = game_size && !(c->idx % game_size);
+
+    switch(c->state) {
+        case LG_ST_IDLE:
+            if(now < c->start_at)
+                return c->start_at;
+
+            if(lg_connect(c, (struct sockaddr *)&ship_addr, ship_addr_len,
+                          LG_ST_SHIP_WELCOME))
+                lg_drop(c, 0);
+
+            return now + LG_LOGIN_TIMEOUT;
+
+        case LG_ST_SHIP_WELCOME:
+        case LG_ST_SHIP:
+        case LG_ST_BLOCK_WELCOME:
+        case LG_ST_BLOCK:
+            if(now >= c->start_at + LG_LOGIN_TIMEOUT) {
+                lg_drop(c, 1);
+                return UINT64_MAX;
+            }
+
+            return c->start_at + LG_LOGIN_TIMEOUT;
+
+        case LG_ST_DEAD:
+            return UINT64_MAX;
+
+        case LG_ST_LOBBY:
+            if(game_size) {
+                if(leader) {
+                    if(lg_send_create(c))
+                        goto err;
+                }
+                else if(!__atomic_load_n(&game_ready[c->idx / game_size],
+                                         __ATOMIC_ACQUIRE) ||
+                        now < c->next_try) {
+                    next = now + 100000;
+                    break;
+                }
+                else if(lg_send_simple(c, GAME_LIST_TYPE, 0)) {
+                    goto err;
+                }
+
+                c->next_try = now + LG_GAME_RETRY;
+                lg_set_state(c, LG_ST_GAME_WAIT);
+                return c->next_try;
+            }
+            break;
+
+        case LG_ST_GAME_WAIT:
+            /* Nothing happened, so go back and try again. */
+            if(now >= c->next_try)
+                lg_set_state(c, LG_ST_LOBBY);
+
+            return c->next_try;
+    }
+
+    /* Everyone in a lobby or a game gets here. */
+    if(move_rate > 0.0) {
+        if(now >= c->next_move) {
+            if(lg_send_move(c, now))
+                goto err;
+
+            c->next_move += (uint64_t)(1000000.0 / move_rate);
+
+            /* Don't try to catch up if we've fallen way behind. */
+            if(c->next_move < now)
+                c->next_move = now;
+        }
+
+        if(c->next_move < next)
+            next = c->next_move;
+    }
+
+    if(chat_rate > 0.0) {
+        if(now >= c->next_chat) {
+            if(lg_send_chat(c, now))
+                goto err;
+
+            c->next_chat += (uint64_t)(1000000.0 / chat_rate);
+
+            if(c->next_chat < now)
+                c->next_chat = now;
+        }
+
+        if(c->next_chat < next)
+            next = c->next_chat;
+    }
+
+    return next;
+
+err:
+    lg_drop(c, 0);
+    return UINT64_MAX;
+}
+
+static void *lg_thread(void *d) {
+    lg_thread_t *t = (lg_thread_t *)d;
+    evloop_event_t evs[EVLOOP_MAX_EVENTS];
+    lg_client_t *c;
+    uint64_t now, next, n;
+    int i, count, timeout, err;
+    socklen_t len;
+
+    while(!stop) {
+        now = now_us();
+        next = now + 100000;
+
+        for(i = t->first; i < client_count; i += thread_count) {
+            if((n = lg_run_client(&clients[i], now)) < next)
+                next = n;
+        }
+
+        now = now_us();
+        timeout = next > now ? (int)((next - now + 999) / 1000) : 0;
+
+        if((count = evloop_wait(t->evl, evs, EVLOOP_MAX_EVENTS, timeout)) < 0) {
+            if(errno == EINTR)
+                continue;
+
+            perror("evloop_wait");
+            break;
+        }
+
+        for(i = 0; i < count; ++i) {
+            c = (lg_client_t *)evs[i].data;
+
+            if(c->sock != evs[i].fd)
+                continue;
+
+            if((evs[i].events & EVLOOP_ERROR)) {
+                lg_drop(c, 0);
+                continue;
+            }
+
+            if((evs[i].events & EVLOOP_WRITE)) {
+                /* The first time it's writable, the connect is done. */
+                if(c->state == LG_ST_SHIP_WELCOME ||
+                   c->state == LG_ST_BLOCK_WELCOME) {
+                    len = sizeof(int);
+
+                    if(getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err,
+                                  &len) || err) {
+                        lg_drop(c, 0);
+                        continue;
+                    }
+                }
+
+                if(lg_flush(c)) {
+                    lg_drop(c, 0);
+                    continue;
+                }
+            }
+
+            if((evs[i].events & EVLOOP_READ) && lg_read(c))
+                lg_drop(c, 0);
+        }
+    }
+
+    for(i = t->first; i < client_count; i += thread_count) {
+        if(clients[i].sock >= 0) {
+            evloop_del(t->evl, clients[i].sock);
+            close(clients[i].sock);
+            clients[i].sock = -1;
+        }
+    }
+
+    return NULL;
+}
+
+static void hist_print(const char *name, const lg_hist_t *cur,
+                       lg_hist_t *prev) {
+    uint64_t b[LG_HIST_BUCKETS], total = 0, sum;
+    uint32_t p50 = 0, p99 = 0, max = 0;
+    int i;
+
+    for(i = 0; i < LG_HIST_BUCKETS; ++i) {
+        b[i] = __atomic_load_n(&cur->b[i], __ATOMIC_RELAXED);
+
+        if(prev) {
+            sum = b[i];
+            b[i] -= prev->b[i];
+            prev->b[i] = sum;
+        }
+
+        total += b[i];
+    }
+
+    if(!total) {
+        printf("  %s -", name);
+        return;
+    }
+
+    for(i = 0, sum = 0; i < LG_HIST_BUCKETS; ++i) {
+        if(!b[i])
+            continue;
+
+        if(sum < total / 2 && sum + b[i] >= total / 2)
+            p50 = hist_value(i);
+
+        if(sum < (total * 99) / 100 && sum + b[i] >= (total * 99) / 100)
+            p99 = hist_value(i);
+
+        sum += b[i];
+        max = hist_value(i);
+    }
+
+    printf("  %s p50 %.2fms p99 %.2fms max %.2fms", name, p50 / 1000.0,
+           p99 / 1000.0, max / 1000.0);
+}
+
+static void print_stats(int secs, lg_stats_t *prev) {
+    int i, st[LG_ST_DEAD + 1];
+    uint64_t sent, recv, span = prev ? interval : (secs ? secs : 1);
+
+    memset(st, 0, sizeof(st));
+
+    for(i = 0; i < client_count; ++i) {
+        ++st[__atomic_load_n(&clients[i].state, __ATOMIC_RELAXED)];
+    }
+
+    sent = __atomic_load_n(&stats.pkts_sent, __ATOMIC_RELAXED);
+    recv = __atomic_load_n(&stats.pkts_recv, __ATOMIC_RELAXED);
+
+    printf("%4ds: lobby %d game %d login %d dead %d  tx %" PRIu64 "/s "
+           "rx %" PRIu64 "/s", secs, st[LG_ST_LOBBY] + st[LG_ST_GAME_WAIT],
+           st[LG_ST_GAME], st[LG_ST_SHIP_WELCOME] + st[LG_ST_SHIP] +
+           st[LG_ST_BLOCK_WELCOME] + st[LG_ST_BLOCK], st[LG_ST_DEAD],
+           (sent - (prev ? prev->pkts_sent : 0)) / span,
+           (recv - (prev ? prev->pkts_recv : 0)) / span);
+
+    hist_print("echo", &stats.echo, prev ? &prev->echo : NULL);
+    hist_print("fanout", &stats.fanout, prev ? &prev->fanout : NULL);
+    printf("\n");
+
+    if(prev) {
+        prev->pkts_sent = sent;
+        prev->pkts_recv = recv;
+    }
+}
+
+static void handle_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+int main(int argc, char *argv[]) {
+    lg_stats_t prev;
+    uint64_t start;
+    int i, secs = 0;
+
+    parse_command_line(argc, argv);
+
+    clients = (lg_client_t *)calloc(client_count, sizeof(lg_client_t));
+    threads = (lg_thread_t *)calloc(thread_count, sizeof(lg_thread_t));
+
+    if(!clients || !threads) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    if(game_size &&
+       !(game_ready = (uint8_t *)calloc(client_count / game_size + 1, 1))) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGINT, &handle_signal);
+    signal(SIGTERM, &handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    start = now_us();
+
+    for(i = 0; i < client_count; ++i) {
+        clients[i].idx = i;
+        clients[i].sock = -1;
+        clients[i].gc = gc_base + i;
+        clients[i].thd = &threads[i % thread_count];
+        clients[i].start_at = start + (uint64_t)(i * 1000000.0 / connect_rate);
+
+        if(!(clients[i].inbuf = (uint8_t *)malloc(LG_IN_BUF_SIZE))) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+
+        clients[i].in_size = LG_IN_BUF_SIZE;
+    }
+
+    printf("Starting %d %s clients on %d threads (%s)\n", client_count,
+           version_names[version], thread_count, evloop_backend());
+
+    for(i = 0; i < thread_count; ++i) {
+        threads[i].first = i;
+        threads[i].seed = (unsigned int)(start + i);
+
+        if(!(threads[i].evl = evloop_create())) {
+            printf("Can't create event loop\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if(pthread_create(&threads[i].thd, NULL, &lg_thread, &threads[i])) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    memset(&prev, 0, sizeof(prev));
+
+    while(!stop && secs < duration) {
+        sleep(1);
+
+        if(!(++secs % interval))
+            print_stats(secs, &prev);
+    }
+
+    stop = 1;
+
+    for(i = 0; i < thread_count; ++i) {
+        pthread_join(threads[i].thd, NULL);
+        evloop_destroy(threads[i].evl);
+    }
+
+    printf("Total:\n");
+    print_stats(secs, NULL);
+    printf("  sent %" PRIu64 " pkts (%" PRIu64 " bytes), received %" PRIu64
+           " pkts (%" PRIu64 " bytes), %" PRIu64 " stalls, %" PRIu64
+           " disconnects, %" PRIu64 " login timeouts\n", stats.pkts_sent,
+           stats.bytes_sent, stats.pkts_recv, stats.bytes_recv, stats.stalls,
+           stats.disconnects, stats.timeouts);
+
+    for(i = 0; i < client_count; ++i) {
+        free(clients[i].inbuf);
+    }
+
+    free(game_ready);
+    free(threads);
+    free(clients);
+
+    return 0;
+}
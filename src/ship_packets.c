@@ -36,7 +36,9 @@
 #include "utils.h"
 #include "subcmd.h"
 #include "quests.h"
+#include "quest_xfer.h"
 #include "admin.h"
+#include "metrics.h"
 
 extern uint32_t ship_ip4;
 extern uint8_t ship_ip6[16];
@@ -172,17 +174,29 @@ static gm_opt_t gm_opts[] = {
 static int send_dc_lobby_arrows(lobby_t *l, ship_client_t *c);
 static int send_bb_lobby_arrows(lobby_t *l, ship_client_t *c);
 
-/* Send a raw packet away. */
-static int send_raw(ship_client_t *c, int len, uint8_t *sendbuf) {
+/* Send a raw packet away. This must be called with the client's send_mutex
+   held. */
+static int send_raw_locked(ship_client_t *c, int len, uint8_t *sendbuf) {
     ssize_t rv, total = 0;
-    void *tmp;
+    int was_empty = sendq_empty(&c->sendq);
+    int defer = 0;
+
+    /* If we're deferring sends and this is one of the block's own threads,
+       just queue the packet up. It'll get flushed with everything else at the
+       end of the block's loop. */
+    if(sendq_deferred && c->cur_block && block_is_own_thread(c->cur_block)) {
+        defer = 1;
+    }
 
-    /* Keep trying until the whole thing's sent. */
-    if(!c->sendbuf_cur) {
+    /* Keep trying until the whole thing's sent, unless there's already stuff
+       waiting to go out ahead of this (in which case it has to wait its
+       turn). */
+    if(was_empty && !defer) {
         while(total < len) {
             rv = send(c->sock, sendbuf + total, len - total, 0);
 
-            if(rv == -1 && errno != EAGAIN) {
+            if(rv == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+               errno != EINTR) {
                 return -1;
             }
             else if(rv == -1) {
@@ -193,54 +207,77 @@ static int send_raw(ship_client_t *c, int len, uint8_t *sendbuf) {
         }
     }
 
-    rv = len - total;
+    if(total == len) {
+        return 0;
+    }
 
-    if(rv) {
-        /* Move out any already transferred data. */
-        if(c->sendbuf_start) {
-            memmove(c->sendbuf, c->sendbuf + c->sendbuf_start,
-                    c->sendbuf_cur - c->sendbuf_start);
-            c->sendbuf_cur -= c->sendbuf_start;
-            c->sendbuf_start = 0;
+    /* Queue up whatever the socket wouldn't take. */
+    if((rv = sendq_append(&c->sendq, sendbuf + total, len - total))) {
+        /* If the client has fallen that far behind, its not coming back, so
+           cut it loose. */
+        if(rv == -2) {
+            debug(DBG_WARN, "Send queue full for client with guildcard %"
+                  PRIu32 " (%zu bytes, %" PRIu32 " packets), disconnecting\n",
+                  c->guildcard, c->sendq.bytes, c->sendq.pkts);
+            client_disconnect(c);
         }
 
-        /* See if we need to reallocate the buffer. */
-        if(c->sendbuf_cur + rv > c->sendbuf_size) {
-            tmp = realloc(c->sendbuf, c->sendbuf_cur + rv);
+        return -1;
+    }
 
-            /* If we can't allocate the space, bail. */
-            if(tmp == NULL) {
-                return -1;
-            }
+    if(defer) {
+        pthread_mutex_lock(&c->cur_block->flush_mutex);
 
-            c->sendbuf_size = c->sendbuf_cur + rv;
-            c->sendbuf = (unsigned char *)tmp;
+        if(!c->flush_pending) {
+            TAILQ_INSERT_TAIL(&c->cur_block->flush_list, c, flush_qentry);
+            c->flush_pending = 1;
         }
 
-        /* Copy what's left of the packet into the output buffer. */
-        memcpy(c->sendbuf + c->sendbuf_cur, sendbuf + total, rv);
-        c->sendbuf_cur += rv;
+        pthread_mutex_unlock(&c->cur_block->flush_mutex);
+    }
+    /* If this is the first thing to be buffered, let the event loop know that
+       we need to hear about it when the socket is writable. */
+    else if(was_empty && c->evl) {
+        evloop_mod(c->evl, c->sock, EVLOOP_READ | EVLOOP_WRITE);
     }
 
     return 0;
 }
 
-/* Encrypt and send a packet away. */
+static int send_raw(ship_client_t *c, int len, uint8_t *sendbuf) {
+    int rv;
+
+    pthread_mutex_lock(&c->send_mutex);
+    rv = send_raw_locked(c, len, sendbuf);
+    pthread_mutex_unlock(&c->send_mutex);
+
+    return rv;
+}
+
+/* Encrypt and send a packet away. The cipher state and the send queue have to
+   move together, so nobody else can send to the client in between. */
 int crypt_send(ship_client_t *c, int len, uint8_t *sendbuf) {
+    int rv;
+
     /* Expand it to be a multiple of 8/4 bytes long */
     while(len & (c->hdr_size - 1)) {
         sendbuf[len++] = 0;
     }
 
+    pthread_mutex_lock(&c->send_mutex);
+
     /* If we're logging the client, write into the log */
     if(c->logfile) {
-        fprint_packet(c->logfile, sendbuf, len, 0);
+        pktlog_packet(c->logfile, PKTLOG_SENT, sendbuf, len);
     }
 
     /* Encrypt the packet */
     CRYPT_CryptData(&c->skey, sendbuf, len, 1);
 
-    return send_raw(c, len, sendbuf);
+    rv = send_raw_locked(c, len, sendbuf);
+    pthread_mutex_unlock(&c->send_mutex);
+
+    return rv;
 }
 
 /* Retrieve the thread-specific sendbuf for the current thread. */
@@ -300,7 +337,7 @@ int send_dc_welcome(ship_client_t *c, uint32_t svect, uint32_t cvect) {
     pkt->cvect = LE32(cvect);
 
     if(c->logfile) {
-        fprint_packet(c->logfile, sendbuf, DC_WELCOME_LENGTH, 0);
+        pktlog_packet(c->logfile, PKTLOG_SENT, sendbuf, DC_WELCOME_LENGTH);
     }
 
     /* Send the packet away */
@@ -333,7 +370,7 @@ int send_bb_welcome(ship_client_t *c, const uint8_t svect[48],
     memcpy(pkt->cvect, cvect, 48);
 
     if(c->logfile) {
-        fprint_packet(c->logfile, sendbuf, BB_WELCOME_LENGTH, 0);
+        pktlog_packet(c->logfile, PKTLOG_SENT, sendbuf, BB_WELCOME_LENGTH);
     }
 
     /* Send the packet away */
@@ -631,15 +668,128 @@ int send_timestamp(ship_client_t *c) {
     return -1;
 }
 
-/* Send the list of blocks to the client. */
-static int send_dc_block_list(ship_client_t *c, ship_t *s) {
-    uint8_t *sendbuf = get_sendbuf();
+/* Cached images of the menus that every client of a given version gets the
+   same copy of (the block, lobby, ship and game lists), so that we don't have
+   to build them over again for every client that asks. The images are kept
+   unencrypted, and are copied into the sendbuf to be sent. The variant covers
+   any client flags that change what's in the menu. */
+#define MENU_IMAGE_BLOCKS   0
+#define MENU_IMAGE_LOBBIES  1
+#define MENU_IMAGE_SHIPS    2
+#define MENU_IMAGE_GAMES    3
+
+#define MENU_VARIANT_NTE        0x01
+#define MENU_VARIANT_DCPC_ON_GC 0x02
+
+typedef struct menu_image {
+    TAILQ_ENTRY(menu_image) qentry;
+    int kind;
+    int version;
+    int variant;
+    uint32_t key;
+    int len;
+    uint8_t pkt[];
+} menu_image_t;
+
+TAILQ_HEAD(menu_image_queue, menu_image);
+
+static struct menu_image_queue menu_images =
+    TAILQ_HEAD_INITIALIZER(menu_images);
+static pthread_mutex_t menu_image_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t menu_image_gen = 0;
+
+/* Look for a cached image of the given menu for the client, copying it into
+   the buffer if one is found. Returns the length of the packet, or -1 if there
+   isn't one. The generation stored in gen must be passed to menu_image_put()
+   when storing the newly built image. */
+static int menu_image_get(ship_client_t *c, int kind, int variant,
+                          uint32_t key, uint8_t *buf, uint32_t *gen) {
+    menu_image_t *i;
+    int rv = -1;
+
+    pthread_mutex_lock(&menu_image_mutex);
+
+    TAILQ_FOREACH(i, &menu_images, qentry) {
+        if(i->kind == kind && i->version == c->version &&
+           i->variant == variant && i->key == key) {
+            memcpy(buf, i->pkt, i->len);
+            rv = i->len;
+            break;
+        }
+    }
+
+    *gen = menu_image_gen;
+    pthread_mutex_unlock(&menu_image_mutex);
+
+    return rv;
+}
+
+static void menu_image_put(ship_client_t *c, int kind, int variant,
+                           uint32_t key, const uint8_t *buf, int len,
+                           uint32_t gen) {
+    menu_image_t *i;
+
+    if(!(i = (menu_image_t *)malloc(sizeof(menu_image_t) + len)))
+        return;
+
+    i->kind = kind;
+    i->version = c->version;
+    i->variant = variant;
+    i->key = key;
+    i->len = len;
+    memcpy(i->pkt, buf, len);
+
+    /* Don't keep it if things changed while it was being built. */
+    pthread_mutex_lock(&menu_image_mutex);
+
+    if(gen == menu_image_gen) {
+        TAILQ_INSERT_TAIL(&menu_images, i, qentry);
+        i = NULL;
+    }
+
+    pthread_mutex_unlock(&menu_image_mutex);
+    free(i);
+}
+
+static void menu_images_drop(int kind, uint32_t key, int all) {
+    menu_image_t *i, *tmp;
+
+    pthread_mutex_lock(&menu_image_mutex);
+    ++menu_image_gen;
+
+    i = TAILQ_FIRST(&menu_images);
+    while(i) {
+        tmp = TAILQ_NEXT(i, qentry);
+
+        if(all || (i->kind == kind && i->key == key)) {
+            TAILQ_REMOVE(&menu_images, i, qentry);
+            free(i);
+        }
+
+        i = tmp;
+    }
+
+    pthread_mutex_unlock(&menu_image_mutex);
+}
+
+void clear_menu_images(void) {
+    menu_images_drop(0, 0, 1);
+}
+
+void clear_game_lists(block_t *b) {
+    menu_images_drop(MENU_IMAGE_GAMES, (uint32_t)b->b, 0);
+}
+
+static int menu_variant(ship_client_t *c) {
+    return (c->flags & CLIENT_FLAG_IS_NTE) ? MENU_VARIANT_NTE : 0;
+}
+
+/* Build the list of blocks for the client. */
+static int build_dc_block_list(uint8_t *sendbuf, ship_client_t *c,
+                               ship_t *s) {
     dc_block_list_pkt *pkt = (dc_block_list_pkt *)sendbuf;
     int i, len = 0x20, entries = 1;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf)
-        return -1;
 
     /* Clear the base packet */
     memset(pkt, 0, sizeof(dc_block_list_pkt));
@@ -704,17 +854,14 @@ static int send_dc_block_list(ship_client_t *c, ship_t *s) {
     pkt->hdr.flags = (uint8_t)(entries);
 
     /* Send the packet away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
-static int send_pc_block_list(ship_client_t *c, ship_t *s) {
-    uint8_t *sendbuf = get_sendbuf();
+static int build_pc_block_list(uint8_t *sendbuf, ship_client_t *c,
+                               ship_t *s) {
     pc_block_list_pkt *pkt = (pc_block_list_pkt *)sendbuf;
     int i, len = 0x30, entries = 1;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf)
-        return -1;
 
     /* Clear the base packet */
     memset(pkt, 0, sizeof(pc_block_list_pkt));
@@ -791,18 +938,14 @@ static int send_pc_block_list(ship_client_t *c, ship_t *s) {
     pkt->hdr.flags = (uint8_t)(entries);
 
     /* Send the packet away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
-static int send_bb_block_list(ship_client_t *c, ship_t *s) {
-    uint8_t *sendbuf = get_sendbuf();
+static int build_bb_block_list(uint8_t *sendbuf, ship_client_t *c,
+                               ship_t *s) {
     bb_block_list_pkt *pkt = (bb_block_list_pkt *)sendbuf;
     int i, len = 0x34, entries = 1;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
 
     /* Clear the base packet */
     memset(pkt, 0, sizeof(bb_block_list_pkt));
@@ -879,10 +1022,22 @@ static int send_bb_block_list(ship_client_t *c, ship_t *s) {
     pkt->hdr.flags = LE32(entries);
 
     /* Send the packet away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
 int send_block_list(ship_client_t *c, ship_t *s) {
+    uint8_t *sendbuf = get_sendbuf();
+    uint32_t gen;
+    int len;
+
+    /* Verify we got the sendbuf. */
+    if(!sendbuf)
+        return -1;
+
+    if((len = menu_image_get(c, MENU_IMAGE_BLOCKS, menu_variant(c), 0, sendbuf,
+                              &gen)) > 0)
+        return crypt_send(c, len, sendbuf);
+
     /* Call the appropriate function */
     switch(c->version) {
         case CLIENT_VERSION_DCV1:
@@ -890,16 +1045,23 @@ int send_block_list(ship_client_t *c, ship_t *s) {
         case CLIENT_VERSION_GC:
         case CLIENT_VERSION_EP3:
         case CLIENT_VERSION_XBOX:
-            return send_dc_block_list(c, s);
+            len = build_dc_block_list(sendbuf, c, s);
+            break;
 
         case CLIENT_VERSION_PC:
-            return send_pc_block_list(c, s);
+            len = build_pc_block_list(sendbuf, c, s);
+            break;
 
         case CLIENT_VERSION_BB:
-            return send_bb_block_list(c, s);
+            len = build_bb_block_list(sendbuf, c, s);
+            break;
+
+        default:
+            return -1;
     }
 
-    return -1;
+    menu_image_put(c, MENU_IMAGE_BLOCKS, menu_variant(c), 0, sendbuf, len, gen);
+    return crypt_send(c, len, sendbuf);
 }
 
 /* Send a block/ship information reply packet to the client. */
@@ -1099,17 +1261,11 @@ int send_simple(ship_client_t *c, int type, int flags) {
     return -1;
 }
 
-/* Send the lobby list packet to the client. */
-static int send_dc_lobby_list(ship_client_t *c) {
-    uint8_t *sendbuf = get_sendbuf();
+/* Build the lobby list packet for the client. */
+static int build_dc_lobby_list(uint8_t *sendbuf, ship_client_t *c) {
     dc_lobby_list_pkt *pkt = (dc_lobby_list_pkt *)sendbuf;
     uint32_t i, max = 15;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Fill in the header */
     if(c->version == CLIENT_VERSION_DCV1) {
         pkt->hdr.dc.pkt_type = LOBBY_LIST_TYPE;
@@ -1149,26 +1305,20 @@ static int send_dc_lobby_list(ship_client_t *c) {
     pkt->entries[max].padding = 0;
 
     if(c->version == CLIENT_VERSION_DCV1) {
-        return crypt_send(c, DC_LOBBY_LIST_LENGTH - 60, sendbuf);
+        return DC_LOBBY_LIST_LENGTH - 60;
     }
     else if(c->version != CLIENT_VERSION_EP3) {
-        return crypt_send(c, DC_LOBBY_LIST_LENGTH, sendbuf);
+        return DC_LOBBY_LIST_LENGTH;
     }
     else {
-        return crypt_send(c, EP3_LOBBY_LIST_LENGTH, sendbuf);
+        return EP3_LOBBY_LIST_LENGTH;
     }
 }
 
-static int send_bb_lobby_list(ship_client_t *c) {
-    uint8_t *sendbuf = get_sendbuf();
+static int build_bb_lobby_list(uint8_t *sendbuf, ship_client_t *c) {
     bb_lobby_list_pkt *pkt = (bb_lobby_list_pkt *)sendbuf;
     uint32_t i;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Fill in the header */
     pkt->hdr.pkt_type = LE16(LOBBY_LIST_TYPE);
     pkt->hdr.flags = LE32(0x0F);
@@ -1186,10 +1336,22 @@ static int send_bb_lobby_list(ship_client_t *c) {
     pkt->entries[15].item_id = 0;
     pkt->entries[15].padding = 0;
 
-    return crypt_send(c, BB_LOBBY_LIST_LENGTH, sendbuf);
+    return BB_LOBBY_LIST_LENGTH;
 }
 
 int send_lobby_list(ship_client_t *c) {
+    uint8_t *sendbuf = get_sendbuf();
+    uint32_t gen;
+    int len;
+
+    /* Verify we got the sendbuf. */
+    if(!sendbuf)
+        return -1;
+
+    if((len = menu_image_get(c, MENU_IMAGE_LOBBIES, menu_variant(c), 0, sendbuf,
+                              &gen)) > 0)
+        return crypt_send(c, len, sendbuf);
+
     /* Call the appropriate function. */
     switch(c->version) {
         case CLIENT_VERSION_DCV1:
@@ -1198,13 +1360,20 @@ int send_lobby_list(ship_client_t *c) {
         case CLIENT_VERSION_GC:
         case CLIENT_VERSION_EP3:
         case CLIENT_VERSION_XBOX:
-            return send_dc_lobby_list(c);
+            len = build_dc_lobby_list(sendbuf, c);
+            break;
 
         case CLIENT_VERSION_BB:
-            return send_bb_lobby_list(c);
+            len = build_bb_lobby_list(sendbuf, c);
+            break;
+
+        default:
+            return -1;
     }
 
-    return -1;
+    menu_image_put(c, MENU_IMAGE_LOBBIES, menu_variant(c), 0, sendbuf, len,
+                   gen);
+    return crypt_send(c, len, sendbuf);
 }
 
 /* Send the packet to join a lobby to the client. */
@@ -1697,6 +1866,135 @@ int send_pkt_bb(ship_client_t *c, const bb_pkt_hdr_t *pkt) {
     return crypt_send(c, len, sendbuf);
 }
 
+void pkt_bcast_init_dc(pkt_bcast_t *b, const dc_pkt_hdr_t *pkt) {
+    memset(b, 0, sizeof(pkt_bcast_t));
+    b->src = (const uint8_t *)pkt;
+
+    /* The original is already in the right form for the DC-style clients. */
+    b->forms[PKT_BCAST_DC] = (uint8_t *)pkt;
+    b->lens[PKT_BCAST_DC] = (int)LE16(pkt->pkt_len);
+}
+
+void pkt_bcast_init_bb(pkt_bcast_t *b, const bb_pkt_hdr_t *pkt) {
+    memset(b, 0, sizeof(pkt_bcast_t));
+    b->src = (const uint8_t *)pkt;
+    b->src_bb = 1;
+
+    /* The original is already in the right form for Blue Burst clients. */
+    b->forms[PKT_BCAST_BB] = (uint8_t *)pkt;
+    b->lens[PKT_BCAST_BB] = (int)LE16(pkt->pkt_len);
+}
+
+/* Lay out the packet for one kind of client. This does the same conversions
+   as send_pkt_dc() and send_pkt_bb() do, just into the broadcast buffer. */
+static uint8_t *pkt_bcast_form(pkt_bcast_t *b, int form) {
+    uint8_t *buf = (uint8_t *)pthread_getspecific(bcastbuf_key);
+    uint8_t *out;
+    int len;
+
+    if(b->forms[form]) {
+        return b->forms[form];
+    }
+
+    /* If we haven't initialized the broadcast buffer yet for this thread, do
+       that now. There's room for each of the converted forms. */
+    if(!buf) {
+        if(!(buf = (uint8_t *)malloc(65544 * 3))) {
+            perror("malloc");
+            return NULL;
+        }
+
+        if(pthread_setspecific(bcastbuf_key, buf)) {
+            perror("pthread_setspecific");
+            free(buf);
+            return NULL;
+        }
+    }
+
+    out = buf + 65544 * form;
+
+    if(!b->src_bb) {
+        const dc_pkt_hdr_t *pkt = (const dc_pkt_hdr_t *)b->src;
+        len = (int)LE16(pkt->pkt_len);
+
+        if(form == PKT_BCAST_PC) {
+            pc_pkt_hdr_t *hdr = (pc_pkt_hdr_t *)out;
+
+            hdr->pkt_len = pkt->pkt_len;
+            hdr->flags = pkt->flags;
+            hdr->pkt_type = pkt->pkt_type;
+
+            memcpy(out + 4, b->src + 4, len - 4);
+        }
+        else {
+            bb_pkt_hdr_t *hdr = (bb_pkt_hdr_t *)out;
+
+            hdr->pkt_len = LE16((len + 4));
+            hdr->flags = LE32(pkt->flags);
+            hdr->pkt_type = LE16(pkt->pkt_type);
+
+            memcpy(out + 8, b->src + 4, len - 4);
+            len += 4;
+        }
+    }
+    else {
+        const bb_pkt_hdr_t *pkt = (const bb_pkt_hdr_t *)b->src;
+        len = (int)LE16(pkt->pkt_len);
+
+        if(form == PKT_BCAST_PC) {
+            pc_pkt_hdr_t *hdr = (pc_pkt_hdr_t *)out;
+
+            hdr->pkt_len = LE16(len - 4);
+            hdr->flags = (uint8_t)pkt->flags;
+            hdr->pkt_type = (uint8_t)pkt->pkt_type;
+        }
+        else {
+            dc_pkt_hdr_t *hdr = (dc_pkt_hdr_t *)out;
+
+            hdr->pkt_len = LE16(len - 4);
+            hdr->flags = (uint8_t)pkt->flags;
+            hdr->pkt_type = (uint8_t)pkt->pkt_type;
+        }
+
+        memcpy(out + 4, b->src + 8, len - 8);
+        len -= 4;
+    }
+
+    b->forms[form] = out;
+    b->lens[form] = len;
+    return out;
+}
+
+/* Send a broadcast packet on to one client. */
+int send_pkt_bcast(ship_client_t *c, pkt_bcast_t *b) {
+    uint8_t *sendbuf = get_sendbuf();
+    uint8_t *pkt;
+    int form;
+
+    /* Verify we got the sendbuf. */
+    if(!sendbuf) {
+        return -1;
+    }
+
+    if(c->version == CLIENT_VERSION_PC) {
+        form = PKT_BCAST_PC;
+    }
+    else if(c->version == CLIENT_VERSION_BB) {
+        form = PKT_BCAST_BB;
+    }
+    else {
+        form = PKT_BCAST_DC;
+    }
+
+    if(!(pkt = pkt_bcast_form(b, form))) {
+        return -1;
+    }
+
+    /* The cipher works in place, so each client needs its own copy. */
+    memcpy(sendbuf, pkt, b->lens[form]);
+    return crypt_send(c, b->lens[form], sendbuf);
+}
+
 /* Send a packet to all clients in the lobby when a new player joins. */
 static int send_dcnte_lobby_add_player(lobby_t *l, ship_client_t *c,
                                        ship_client_t *nc) {
@@ -2115,9 +2413,80 @@ int send_lobby_leave(lobby_t *l, ship_client_t *c, int client_id) {
     return 0;
 }
 
-static int send_dc_lobby_chat(lobby_t *l, ship_client_t *c, ship_client_t *s,
-                              const char *msg, const char *cmsg) {
-    uint8_t *sendbuf = get_sendbuf();
+/* Forms of a chat message, one for each kind of client that might get it. The
+   Dreamcast forms differ depending on whether the recipient is NTE. Each form
+   exists in a censored and an uncensored flavor. */
+#define CHAT_FORM_DC        0
+#define CHAT_FORM_DCNTE     1
+#define CHAT_FORM_PC        2
+#define CHAT_FORM_BB        3
+#define CHAT_FORM_COUNT     4
+
+typedef struct chat_bcast {
+    uint8_t *forms[CHAT_FORM_COUNT][2];
+    int lens[CHAT_FORM_COUNT][2];
+} chat_bcast_t;
+
+static inline int chat_form(ship_client_t *c) {
+    switch(c->version) {
+        case CLIENT_VERSION_PC:
+            return CHAT_FORM_PC;
+
+        case CLIENT_VERSION_BB:
+            return CHAT_FORM_BB;
+
+        default:
+            if(c->flags & CLIENT_FLAG_IS_NTE)
+                return CHAT_FORM_DCNTE;
+
+            return CHAT_FORM_DC;
+    }
+}
+
+static void chat_bcast_free(chat_bcast_t *b) {
+    int i;
+
+    for(i = 0; i < CHAT_FORM_COUNT; ++i) {
+        free(b->forms[i][0]);
+        free(b->forms[i][1]);
+    }
+}
+
+/* Send a chat message that has been laid out in the sendbuf to one client,
+   keeping a copy of it for anyone else that needs the same form. If we can't
+   make the copy, the next one will just be built again. */
+static int chat_bcast_send(ship_client_t *c, chat_bcast_t *b, int form,
+                           int cen, uint8_t *sendbuf, int len) {
+    uint8_t *copy;
+
+    if(!b->forms[form][cen] && (copy = (uint8_t *)malloc(len))) {
+        memcpy(copy, sendbuf, len);
+        b->forms[form][cen] = copy;
+        b->lens[form][cen] = len;
+    }
+
+    return crypt_send(c, len, sendbuf);
+}
+
+/* Send a chat message on from a copy made by chat_bcast_send(). Returns 1 if
+   there was no copy to send. */
+static int chat_bcast_resend(ship_client_t *c, chat_bcast_t *b, int form,
+                             int cen) {
+    uint8_t *sendbuf;
+
+    if(!b->forms[form][cen])
+        return 1;
+
+    if(!(sendbuf = get_sendbuf()))
+        return -1;
+
+    /* The cipher works in place, so each client needs its own copy. */
+    memcpy(sendbuf, b->forms[form][cen], b->lens[form][cen]);
+    return crypt_send(c, b->lens[form][cen], sendbuf);
+}
+
+static int build_dc_lobby_chat(uint8_t *sendbuf, int nte, ship_client_t *s,
+                               const char *msg) {
     dc_chat_pkt *pkt = (dc_chat_pkt *)sendbuf;
     iconv_t ic;
     char tm[strlen(msg) + 32];
@@ -2125,11 +2494,6 @@ static int send_dc_lobby_chat(lobby_t *l, ship_client_t *c, ship_client_t *s,
     ICONV_CONST char *inptr;
     char *outptr;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Clear the packet header */
     memset(pkt, 0, sizeof(dc_chat_pkt));
 
@@ -2142,42 +2506,21 @@ static int send_dc_lobby_chat(lobby_t *l, ship_client_t *c, ship_client_t *s,
     else
         ic = ic_utf8_to_sjis;
 
-    if(!(c->flags & CLIENT_FLAG_WORD_CENSOR)) {
-        if(!(s->flags & CLIENT_FLAG_IS_NTE) ||
-           s->version != CLIENT_VERSION_DCV1) {
-            if(!(c->flags & CLIENT_FLAG_IS_NTE))
-                in = sprintf(tm, "%s\t%s", s->pl->v1.name, msg) + 1;
-            else {
-                in = sprintf(tm, "%s>%X%s", s->pl->v1.name, s->client_id,
-                             msg + 2) + 1;
-            }
-        }
+    if(!(s->flags & CLIENT_FLAG_IS_NTE) ||
+       s->version != CLIENT_VERSION_DCV1) {
+        if(!nte)
+            in = sprintf(tm, "%s\t%s", s->pl->v1.name, msg) + 1;
         else {
-            if(!(c->flags & CLIENT_FLAG_IS_NTE))
-                in = sprintf(tm, "%s\t\tJ%s", s->pl->v1.name, msg) + 1;
-            else {
-                in = sprintf(tm, "%s>%X%s", s->pl->v1.name, s->client_id,
-                             msg) + 1;
-            }
+            in = sprintf(tm, "%s>%X%s", s->pl->v1.name, s->client_id,
+                         msg + 2) + 1;
         }
     }
     else {
-        if(!(s->flags & CLIENT_FLAG_IS_NTE) ||
-           s->version != CLIENT_VERSION_DCV1) {
-            if(!(c->flags & CLIENT_FLAG_IS_NTE))
-                in = sprintf(tm, "%s\t%s", s->pl->v1.name, cmsg) + 1;
-            else {
-                in = sprintf(tm, "%s>%X%s", s->pl->v1.name, s->client_id,
-                             cmsg + 2) + 1;
-            }
-        }
+        if(!nte)
+            in = sprintf(tm, "%s\t\tJ%s", s->pl->v1.name, msg) + 1;
         else {
-            if(!(c->flags & CLIENT_FLAG_IS_NTE))
-                in = sprintf(tm, "%s\t\tJ%s", s->pl->v1.name, cmsg) + 1;
-            else {
-                in = sprintf(tm, "%s>%X%s", s->pl->v1.name, s->client_id,
-                             cmsg) + 1;
-            }
+            in = sprintf(tm, "%s>%X%s", s->pl->v1.name, s->client_id,
+                         msg) + 1;
         }
     }
 
@@ -2202,24 +2545,17 @@ static int send_dc_lobby_chat(lobby_t *l, ship_client_t *c, ship_client_t *s,
     pkt->hdr.dc.flags = 0;
     pkt->hdr.dc.pkt_len = LE16(len);
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return (int)len;
 }
 
-static int send_pc_lobby_chat(lobby_t *l, ship_client_t *c, ship_client_t *s,
-                              const char *msg, const char *cmsg) {
-    uint8_t *sendbuf = get_sendbuf();
+static int build_pc_lobby_chat(uint8_t *sendbuf, ship_client_t *s,
+                               const char *msg) {
     dc_chat_pkt *pkt = (dc_chat_pkt *)sendbuf;
     char tm[strlen(msg) + 32];
     size_t in, out, len;
     ICONV_CONST char *inptr;
     char *outptr;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Clear the packet header */
     memset(pkt, 0, sizeof(dc_chat_pkt));
 
@@ -2228,20 +2564,11 @@ static int send_pc_lobby_chat(lobby_t *l, ship_client_t *c, ship_client_t *s,
     pkt->padding = LE32(0x00010000);
 
     /* Fill in the message */
-    if(!(c->flags & CLIENT_FLAG_WORD_CENSOR)) {
-        if(!(s->flags & CLIENT_FLAG_IS_NTE) ||
-           s->version != CLIENT_VERSION_DCV1)
-            in = sprintf(tm, "%s\t%s", s->pl->v1.name, msg) + 1;
-        else
-            in = sprintf(tm, "%s\t\tJ%s", s->pl->v1.name, msg) + 1;
-    }
-    else {
-        if(!(s->flags & CLIENT_FLAG_IS_NTE) ||
-           s->version != CLIENT_VERSION_DCV1)
-            in = sprintf(tm, "%s\t%s", s->pl->v1.name, cmsg) + 1;
-        else
-            in = sprintf(tm, "%s\t\tJ%s", s->pl->v1.name, cmsg) + 1;
-    }
+    if(!(s->flags & CLIENT_FLAG_IS_NTE) ||
+       s->version != CLIENT_VERSION_DCV1)
+        in = sprintf(tm, "%s\t%s", s->pl->v1.name, msg) + 1;
+    else
+        in = sprintf(tm, "%s\t\tJ%s", s->pl->v1.name, msg) + 1;
 
     /* Convert the message to the appropriate encoding. */
     out = 65520;
@@ -2264,24 +2591,17 @@ static int send_pc_lobby_chat(lobby_t *l, ship_client_t *c, ship_client_t *s,
     pkt->hdr.pc.flags = 0;
     pkt->hdr.pc.pkt_len = LE16(len);
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return (int)len;
 }
 
-static int send_bb_lobby_chat(lobby_t *l, ship_client_t *c, ship_client_t *s,
-                              const char *msg, const char *cmsg) {
-    uint8_t *sendbuf = get_sendbuf();
+static int build_bb_lobby_chat(uint8_t *sendbuf, ship_client_t *s,
+                               const char *msg) {
     bb_chat_pkt *pkt = (bb_chat_pkt *)sendbuf;
     char tm[strlen(msg) + 32];
     size_t in, out, len;
     ICONV_CONST char *inptr;
     char *outptr;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Clear the packet header */
     memset(pkt, 0, sizeof(bb_chat_pkt));
 
@@ -2290,20 +2610,11 @@ static int send_bb_lobby_chat(lobby_t *l, ship_client_t *c, ship_client_t *s,
     pkt->padding = LE32(0x00010000);
 
     /* Fill in the message */
-    if(!(c->flags & CLIENT_FLAG_WORD_CENSOR)) {
-        if(!(s->flags & CLIENT_FLAG_IS_NTE) ||
-           s->version != CLIENT_VERSION_DCV1)
-            in = sprintf(tm, "%s\t%s", s->pl->v1.name, msg) + 1;
-        else
-            in = sprintf(tm, "%s\t\tJ%s", s->pl->v1.name, msg) + 1;
-    }
-    else {
-        if(!(s->flags & CLIENT_FLAG_IS_NTE) ||
-           s->version != CLIENT_VERSION_DCV1)
-            in = sprintf(tm, "%s\t%s", s->pl->v1.name, cmsg) + 1;
-        else
-            in = sprintf(tm, "%s\t\tJ%s", s->pl->v1.name, cmsg) + 1;
-    }
+    if(!(s->flags & CLIENT_FLAG_IS_NTE) ||
+       s->version != CLIENT_VERSION_DCV1)
+        in = sprintf(tm, "%s\t%s", s->pl->v1.name, msg) + 1;
+    else
+        in = sprintf(tm, "%s\t\tJ%s", s->pl->v1.name, msg) + 1;
 
     /* Convert the message to the appropriate encoding. */
     out = 65520;
@@ -2324,85 +2635,93 @@ static int send_bb_lobby_chat(lobby_t *l, ship_client_t *c, ship_client_t *s,
     pkt->hdr.flags = 0;
     pkt->hdr.pkt_len = LE16(len);
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return (int)len;
+}
+
+/* Send a chat message to one client, in whatever form that client needs. The
+   message is only laid out and converted once for each form. */
+static int send_lobby_chat_one(ship_client_t *c, ship_client_t *s,
+                               chat_bcast_t *b, const char *msg,
+                               const char *cmsg) {
+    uint8_t *sendbuf;
+    int form = chat_form(c), cen = 0, len, rv;
+
+    /* If censoring didn't change anything, everyone gets the same thing. */
+    if(cmsg && (c->flags & CLIENT_FLAG_WORD_CENSOR)) {
+        msg = cmsg;
+        cen = 1;
+    }
+
+    if((rv = chat_bcast_resend(c, b, form, cen)) != 1)
+        return rv;
+
+    /* Verify we got the sendbuf. */
+    if(!(sendbuf = get_sendbuf()))
+        return -1;
+
+    switch(form) {
+        case CHAT_FORM_DC:
+        case CHAT_FORM_DCNTE:
+            len = build_dc_lobby_chat(sendbuf, form == CHAT_FORM_DCNTE, s,
+                                      msg);
+            break;
+
+        case CHAT_FORM_PC:
+            len = build_pc_lobby_chat(sendbuf, s, msg);
+            break;
+
+        default:
+            len = build_bb_lobby_chat(sendbuf, s, msg);
+            break;
+    }
+
+    return chat_bcast_send(c, b, form, cen, sendbuf, len);
 }
 
-/* Send a talk packet to the specified lobby. */
+/* Send a talk packet to the specified lobby. cmsg may be NULL if the censored
+   version of the message is the same as the original. */
 int send_lobby_chat(lobby_t *l, ship_client_t *sender, const char *msg,
                     const char *cmsg) {
+    chat_bcast_t b;
     int i;
 
-    if((sender->flags & CLIENT_FLAG_STFU)) {
-        switch(sender->version) {
-            case CLIENT_VERSION_DCV1:
-            case CLIENT_VERSION_DCV2:
-            case CLIENT_VERSION_GC:
-            case CLIENT_VERSION_EP3:
-            case CLIENT_VERSION_XBOX:
-                return send_dc_lobby_chat(l, sender, sender, msg, cmsg);
-
-            case CLIENT_VERSION_PC:
-                return send_pc_lobby_chat(l, sender, sender, msg, cmsg);
+    memset(&b, 0, sizeof(chat_bcast_t));
 
-            case CLIENT_VERSION_BB:
-                return send_bb_lobby_chat(l, sender, sender, msg, msg);
-        }
+    if((sender->flags & CLIENT_FLAG_STFU)) {
+        /* Blue Burst clients never got the censored version of their own
+           message back. */
+        if(sender->version == CLIENT_VERSION_BB)
+            cmsg = NULL;
 
-        return 0;
+        i = send_lobby_chat_one(sender, sender, &b, msg, cmsg);
+        chat_bcast_free(&b);
+        return i;
     }
 
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] != NULL) {
             pthread_mutex_lock(&l->clients[i]->mutex);
 
-            /* Call the appropriate function. */
-            switch(l->clients[i]->version) {
-                case CLIENT_VERSION_DCV1:
-                case CLIENT_VERSION_DCV2:
-                case CLIENT_VERSION_GC:
-                case CLIENT_VERSION_EP3:
-                case CLIENT_VERSION_XBOX:
-                    /* Only send if they're not being /ignore'd */
-                    if(!client_has_ignored(l->clients[i], sender->guildcard)) {
-                        send_dc_lobby_chat(l, l->clients[i], sender, msg, cmsg);
-                    }
-                    break;
-
-                case CLIENT_VERSION_PC:
-                    /* Only send if they're not being /ignore'd */
-                    if(!client_has_ignored(l->clients[i], sender->guildcard)) {
-                        send_pc_lobby_chat(l, l->clients[i], sender, msg, cmsg);
-                    }
-                    break;
-
-                case CLIENT_VERSION_BB:
-                    /* Only send if they're not being /ignore'd */
-                    if(!client_has_ignored(l->clients[i], sender->guildcard)) {
-                        send_bb_lobby_chat(l, l->clients[i], sender, msg, cmsg);
-                    }
-                    break;
+            /* Only send if they're not being /ignore'd */
+            if(!client_has_ignored(l->clients[i], sender->guildcard)) {
+                send_lobby_chat_one(l->clients[i], sender, &b, msg, cmsg);
             }
 
             pthread_mutex_unlock(&l->clients[i]->mutex);
         }
     }
 
+    chat_bcast_free(&b);
     return 0;
 }
 
-static int send_dc_lobby_bbchat(lobby_t *l, ship_client_t *c, ship_client_t *s,
-                                const uint8_t *msg, size_t len) {
-    uint8_t *sendbuf = get_sendbuf();
+static int build_dc_lobby_bbchat(uint8_t *sendbuf, int nte, ship_client_t *s,
+                                 const uint8_t *msg, size_t len) {
     dc_chat_pkt *pkt = (dc_chat_pkt *)sendbuf;
     size_t in, out;
     ICONV_CONST char *inptr;
     char *outptr;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf)
-        return -1;
-
     /* Clear the packet header */
     memset(pkt, 0, sizeof(dc_chat_pkt));
 
@@ -2417,7 +2736,7 @@ static int send_dc_lobby_bbchat(lobby_t *l, ship_client_t *c, ship_client_t *s,
     outptr = pkt->msg;
     iconv(ic_utf16_to_ascii, &inptr, &in, &outptr, &out);
 
-    if(!(c->flags & CLIENT_FLAG_IS_NTE)) {
+    if(!nte) {
         /* Add the separator */
         *outptr++ = '\t';
         --out;
@@ -2433,13 +2752,13 @@ static int send_dc_lobby_bbchat(lobby_t *l, ship_client_t *c, ship_client_t *s,
     /* Fill in the message */
     in = len;
 
-    if(!(c->flags & CLIENT_FLAG_IS_NTE))
+    if(!nte)
         inptr = (char *)msg;
     else
         inptr = ((char *)msg) + 4;
 
     /* Convert the message to the appropriate encoding. */
-    if((c->flags & CLIENT_FLAG_IS_NTE) || msg[1] == LE16('J'))
+    if(nte || msg[1] == LE16('J'))
         iconv(ic_utf16_to_sjis, &inptr, &in, &outptr, &out);
     else
         iconv(ic_utf16_to_8859, &inptr, &in, &outptr, &out);
@@ -2459,19 +2778,14 @@ static int send_dc_lobby_bbchat(lobby_t *l, ship_client_t *c, ship_client_t *s,
     pkt->hdr.dc.flags = 0;
     pkt->hdr.dc.pkt_len = LE16(len);
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return (int)len;
 }
 
-static int send_pc_lobby_bbchat(lobby_t *l, ship_client_t *c, ship_client_t *s,
-                                const uint8_t *msg, size_t len) {
-    uint8_t *sendbuf = get_sendbuf();
+static int build_pc_lobby_bbchat(uint8_t *sendbuf, ship_client_t *s,
+                                 const uint8_t *msg) {
     dc_chat_pkt *pkt = (dc_chat_pkt *)sendbuf;
     uint16_t tmp[2] = { LE16('\t'), 0 };
-
-    /* Verify we got the sendbuf. */
-    if(!sendbuf)
-        return -1;
+    int len;
 
     /* Clear the packet header */
     memset(pkt, 0, sizeof(dc_chat_pkt));
@@ -2495,19 +2809,14 @@ static int send_pc_lobby_bbchat(lobby_t *l, ship_client_t *c, ship_client_t *s,
     pkt->hdr.pc.pkt_type = CHAT_TYPE;
     pkt->hdr.pc.flags = 0;
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
-static int send_bb_lobby_bbchat(lobby_t *l, ship_client_t *c, ship_client_t *s,
-                                const uint8_t *msg, size_t len) {
-    uint8_t *sendbuf = get_sendbuf();
+static int build_bb_lobby_bbchat(uint8_t *sendbuf, ship_client_t *s,
+                                 const uint8_t *msg) {
     bb_chat_pkt *pkt = (bb_chat_pkt *)sendbuf;
     uint16_t tmp[2] = { LE16('\t'), 0 };
-
-    /* Verify we got the sendbuf. */
-    if(!sendbuf)
-        return -1;
+    int len;
 
     /* Clear the packet header */
     memset(pkt, 0, sizeof(bb_chat_pkt));
@@ -2531,58 +2840,69 @@ static int send_bb_lobby_bbchat(lobby_t *l, ship_client_t *c, ship_client_t *s,
     pkt->hdr.pkt_type = LE16(CHAT_TYPE);
     pkt->hdr.flags = 0;
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return len;
+}
+
+static int send_lobby_bbchat_one(ship_client_t *c, ship_client_t *s,
+                                 chat_bcast_t *b, const uint8_t *msg,
+                                 size_t len) {
+    uint8_t *sendbuf;
+    int form = chat_form(c), plen, rv;
+
+    if((rv = chat_bcast_resend(c, b, form, 0)) != 1)
+        return rv;
+
+    /* Verify we got the sendbuf. */
+    if(!(sendbuf = get_sendbuf()))
+        return -1;
+
+    switch(form) {
+        case CHAT_FORM_DC:
+        case CHAT_FORM_DCNTE:
+            plen = build_dc_lobby_bbchat(sendbuf, form == CHAT_FORM_DCNTE, s,
+                                         msg, len);
+            break;
+
+        case CHAT_FORM_PC:
+            plen = build_pc_lobby_bbchat(sendbuf, s, msg);
+            break;
+
+        default:
+            plen = build_bb_lobby_bbchat(sendbuf, s, msg);
+            break;
+    }
+
+    return chat_bcast_send(c, b, form, 0, sendbuf, plen);
 }
 
 /* Send a talk packet to the specified lobby (UTF-16 - Blue Burst). */
 int send_lobby_bbchat(lobby_t *l, ship_client_t *sender, const uint8_t *msg,
                       size_t len) {
+    chat_bcast_t b;
     int i;
 
+    memset(&b, 0, sizeof(chat_bcast_t));
+
     if((sender->flags & CLIENT_FLAG_STFU)) {
-        return send_bb_lobby_bbchat(l, sender, sender, msg, len);
+        i = send_lobby_bbchat_one(sender, sender, &b, msg, len);
+        chat_bcast_free(&b);
+        return i;
     }
 
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] != NULL) {
             pthread_mutex_lock(&l->clients[i]->mutex);
 
-            /* Call the appropriate function. */
-            switch(l->clients[i]->version) {
-                case CLIENT_VERSION_DCV1:
-                case CLIENT_VERSION_DCV2:
-                case CLIENT_VERSION_GC:
-                case CLIENT_VERSION_EP3:
-                case CLIENT_VERSION_XBOX:
-                    /* Only send if they're not being /ignore'd */
-                    if(!client_has_ignored(l->clients[i], sender->guildcard)) {
-                        send_dc_lobby_bbchat(l, l->clients[i], sender, msg,
-                                             len);
-                    }
-                    break;
-
-                case CLIENT_VERSION_PC:
-                    /* Only send if they're not being /ignore'd */
-                    if(!client_has_ignored(l->clients[i], sender->guildcard)) {
-                        send_pc_lobby_bbchat(l, l->clients[i], sender, msg,
-                                             len);
-                    }
-                    break;
-
-                case CLIENT_VERSION_BB:
-                    /* Only send if they're not being /ignore'd */
-                    if(!client_has_ignored(l->clients[i], sender->guildcard)) {
-                        send_bb_lobby_bbchat(l, l->clients[i], sender, msg,
-                                             len);
-                    }
-                    break;
+            /* Only send if they're not being /ignore'd */
+            if(!client_has_ignored(l->clients[i], sender->guildcard)) {
+                send_lobby_bbchat_one(l->clients[i], sender, &b, msg, len);
             }
 
             pthread_mutex_unlock(&l->clients[i]->mutex);
         }
     }
 
+    chat_bcast_free(&b);
     return 0;
 }
 
@@ -4006,18 +4326,13 @@ int send_game_join(ship_client_t *c, lobby_t *l) {
     return -1;
 }
 
-/* Send a packet to a client giving them the list of games on the block. */
-static int send_dc_game_list(ship_client_t *c, block_t *b) {
-    uint8_t *sendbuf = get_sendbuf();
+/* Build a packet giving a client the list of games on the block. */
+static int build_dc_game_list(uint8_t *sendbuf, ship_client_t *c,
+                              block_t *b) {
     dc_game_list_pkt *pkt = (dc_game_list_pkt *)sendbuf;
     int entries = 1, len = 0x20;
     lobby_t *l;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Clear out the packet and the first entry */
     memset(pkt, 0, 0x20);
 
@@ -4124,21 +4439,15 @@ static int send_dc_game_list(ship_client_t *c, block_t *b) {
     pkt->hdr.flags = entries - 1;
     pkt->hdr.pkt_len = LE16(len);
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
-static int send_pc_game_list(ship_client_t *c, block_t *b) {
-    uint8_t *sendbuf = get_sendbuf();
+static int build_pc_game_list(uint8_t *sendbuf, ship_client_t *c,
+                              block_t *b) {
     pc_game_list_pkt *pkt = (pc_game_list_pkt *)sendbuf;
     int entries = 1, len = 0x30;
     lobby_t *l;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Clear out the packet and the first entry */
     memset(pkt, 0, 0x30);
 
@@ -4227,21 +4536,15 @@ static int send_pc_game_list(ship_client_t *c, block_t *b) {
     pkt->hdr.flags = entries - 1;
     pkt->hdr.pkt_len = LE16(len);
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
-static int send_gc_game_list(ship_client_t *c, block_t *b) {
-    uint8_t *sendbuf = get_sendbuf();
+static int build_gc_game_list(uint8_t *sendbuf, ship_client_t *c,
+                              block_t *b) {
     dc_game_list_pkt *pkt = (dc_game_list_pkt *)sendbuf;
     int entries = 1, len = 0x20;
     lobby_t *l;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Clear out the packet and the first entry */
     memset(pkt, 0, 0x20);
 
@@ -4326,21 +4629,15 @@ static int send_gc_game_list(ship_client_t *c, block_t *b) {
     pkt->hdr.flags = entries - 1;
     pkt->hdr.pkt_len = LE16(len);
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
-static int send_ep3_game_list(ship_client_t *c, block_t *b) {
-    uint8_t *sendbuf = get_sendbuf();
+static int build_ep3_game_list(uint8_t *sendbuf, ship_client_t *c,
+                               block_t *b) {
     dc_game_list_pkt *pkt = (dc_game_list_pkt *)sendbuf;
     int entries = 1, len = 0x20;
     lobby_t *l;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Clear out the packet and the first entry */
     memset(pkt, 0, 0x20);
 
@@ -4399,21 +4696,15 @@ static int send_ep3_game_list(ship_client_t *c, block_t *b) {
     pkt->hdr.flags = entries - 1;
     pkt->hdr.pkt_len = LE16(len);
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
-static int send_bb_game_list(ship_client_t *c, block_t *b) {
-    uint8_t *sendbuf = get_sendbuf();
+static int build_bb_game_list(uint8_t *sendbuf, ship_client_t *c,
+                              block_t *b) {
     bb_game_list_pkt *pkt = (bb_game_list_pkt *)sendbuf;
     int entries = 1, len = 0x34;
     lobby_t *l;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Clear out the packet and the first entry */
     memset(pkt, 0, 0x34);
 
@@ -4471,32 +4762,57 @@ static int send_bb_game_list(ship_client_t *c, block_t *b) {
     pkt->hdr.flags = LE32(entries - 1);
     pkt->hdr.pkt_len = LE16(len);
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
 int send_game_list(ship_client_t *c, block_t *b) {
+    uint8_t *sendbuf = get_sendbuf();
+    uint32_t gen;
+    int len, var = menu_variant(c);
+
+    /* Verify we got the sendbuf. */
+    if(!sendbuf)
+        return -1;
+
+    /* The list is kept for each block until one of its games changes, so the
+       games only need to be looked at again after that. */
+    if((c->flags & CLIENT_FLAG_SHOW_DCPC_ON_GC))
+        var |= MENU_VARIANT_DCPC_ON_GC;
+
+    if((len = menu_image_get(c, MENU_IMAGE_GAMES, var, (uint32_t)b->b,
+                             sendbuf, &gen)) > 0)
+        return crypt_send(c, len, sendbuf);
+
     /* Call the appropriate function. */
     switch(c->version) {
         case CLIENT_VERSION_DCV1:
         case CLIENT_VERSION_DCV2:
-            return send_dc_game_list(c, b);
+            len = build_dc_game_list(sendbuf, c, b);
+            break;
 
         case CLIENT_VERSION_PC:
-            return send_pc_game_list(c, b);
+            len = build_pc_game_list(sendbuf, c, b);
+            break;
 
         case CLIENT_VERSION_GC:
         case CLIENT_VERSION_XBOX:
-            return send_gc_game_list(c, b);
+            len = build_gc_game_list(sendbuf, c, b);
+            break;
 
         case CLIENT_VERSION_EP3:
-            return send_ep3_game_list(c, b);
+            len = build_ep3_game_list(sendbuf, c, b);
+            break;
 
         case CLIENT_VERSION_BB:
-            return send_bb_game_list(c, b);
+            len = build_bb_game_list(sendbuf, c, b);
+            break;
+
+        default:
+            return -1;
     }
 
-    return -1;
+    menu_image_put(c, MENU_IMAGE_GAMES, var, (uint32_t)b->b, sendbuf, len, gen);
+    return crypt_send(c, len, sendbuf);
 }
 
 /* Send the list of lobby info items to the client. */
@@ -5230,13 +5546,13 @@ int send_quest_categories(ship_client_t *c, int lang) {
 static int send_dc_quest_list(ship_client_t *c, int cn, int lang) {
     uint8_t *sendbuf = get_sendbuf();
     dc_quest_list_pkt *pkt = (dc_quest_list_pkt *)sendbuf;
-    int i, len = 0x04, entries = 0, max = INT_MAX, j, k, ver, v;
+    int i, len = 0x04, entries = 0, max = INT_MAX, j, k, m, ver, v;
     size_t in, out;
     ICONV_CONST char *inptr;
     char *outptr;
     sylverant_quest_list_t *qlist, *qlisten;
     lobby_t *l = c->cur_lobby;
-    sylverant_quest_category_t *cat, *caten;
+    const quest_menu_t *menu;
     sylverant_quest_t *quest;
     quest_map_elem_t *elem;
     ship_client_t *tmp;
@@ -5273,11 +5589,8 @@ static int send_dc_quest_list(ship_client_t *c, int cn, int lang) {
     if(!qlist->cats)
         return -1;
 
-    /* Grab the category... This implicitly assumes that the categories are in
-       the same order, regardless of language. At some point, I'll work this out
-       a better way, but for now, this will work. */
-    cat = &qlist->cats[cn];
-    caten = &qlisten->cats[cn];
+    /* Grab the menu for the category. */
+    menu = quest_get_menu(&ship->qmap, ver, lang, cn, l->num_clients);
 
     /* Clear out the header */
     memset(pkt, 0, 0x04);
@@ -5289,141 +5602,127 @@ static int send_dc_quest_list(ship_client_t *c, int cn, int lang) {
     /* Fill in the header */
     pkt->hdr.pkt_type = QUEST_LIST_TYPE;
 
-    for(k = 0; k < 2; ++k) {
-        for(i = 0; i < cat->quest_count && i < max; ++i) {
-            quest = cat->quests[i];
-            elem = (quest_map_elem_t *)quest->user_data;
+    /* The menu already leaves out anything that's hidden or can't be played
+       with this many people, so only check what can change. */
+    for(m = 0; menu && m < menu->count; ++m) {
+        i = menu->entries[m].index;
+        k = menu->entries[m].english;
 
-            /* Skip quests we should have already covered if we're on the second
-               pass through */
-            if(k && elem->qptr[ver][lang])
-                continue;
-
-            /* Skip quests that aren't for the current event */
-            if(!(quest->event & (1 << l->event)))
-                continue;
+        if(i >= max)
+            continue;
 
-            /* Skip quests where the number of players isn't in range. */
-            if(quest->max_players < l->num_clients ||
-               quest->min_players > l->num_clients)
-                continue;
+        quest = menu->entries[m].quest;
+        elem = menu->entries[m].elem;
 
-            /* Look through to make sure that all clients in the lobby can play
-               the quest */
-            for(j = 0; j < l->max_clients; ++j) {
-                if(!(tmp = l->clients[j]))
-                    continue;
+        /* Skip quests that aren't for the current event */
+        if(!(quest->event & (1 << l->event)))
+            continue;
 
-                v = tmp->version;
+        /* Look through to make sure that all clients in the lobby can play
+           the quest */
+        for(j = 0; j < l->max_clients; ++j) {
+            if(!(tmp = l->clients[j]))
+                continue;
 
-                switch(v) {
-                    case CLIENT_VERSION_DCV1:
-                    case CLIENT_VERSION_DCV2:
-                        hasdc = 1;
-                        break;
+            v = tmp->version;
 
-                    case CLIENT_VERSION_PC:
-                        haspc = 1;
-                        break;
+            switch(v) {
+                case CLIENT_VERSION_DCV1:
+                case CLIENT_VERSION_DCV2:
+                    hasdc = 1;
+                    break;
 
-                    case CLIENT_VERSION_GC:
-                        hasgc = 1;
-                        break;
+                case CLIENT_VERSION_PC:
+                    haspc = 1;
+                    break;
 
-                    case CLIENT_VERSION_XBOX:
-                        v = CLIENT_VERSION_GC;
-                        hasxb = 1;
-                        break;
-                }
+                case CLIENT_VERSION_GC:
+                    hasgc = 1;
+                    break;
 
-                if(!k && !elem->qptr[v][tmp->q_lang] &&
-                   !elem->qptr[v][tmp->language_code] &&
-                   !elem->qptr[v][CLIENT_LANG_ENGLISH] &&
-                   !elem->qptr[v][lang])
+                case CLIENT_VERSION_XBOX:
+                    v = CLIENT_VERSION_GC;
+                    hasxb = 1;
                     break;
             }
 
-            /* Skip quests where we can't play them due to restrictions by
-               users' versions or language codes */
-            if(j != l->max_clients)
-                continue;
+            if(!k && !elem->qptr[v][tmp->q_lang] &&
+               !elem->qptr[v][tmp->language_code] &&
+               !elem->qptr[v][CLIENT_LANG_ENGLISH] &&
+               !elem->qptr[v][lang])
+                break;
+        }
 
-            /* Make sure the user's privilege level is good enough. */
-            if((quest->privileges & c->privilege) != quest->privileges &&
-               !LOCAL_GM(c))
-                continue;
+        /* Skip quests where we can't play them due to restrictions by
+           users' versions or language codes */
+        if(j != l->max_clients)
+            continue;
 
-            /* Check the availability time against the current time. */
-            if(quest->start_time && quest->start_time > (uint64_t)now)
-                continue;
-            else if(quest->end_time && quest->end_time < (uint64_t)now)
-                continue;
+        /* Make sure the user's privilege level is good enough. */
+        if((quest->privileges & c->privilege) != quest->privileges &&
+           !LOCAL_GM(c))
+            continue;
 
-            /* Check the hidden flag */
-            if((quest->flags & SYLVERANT_QUEST_HIDDEN))
-                continue;
+        /* Check the availability time against the current time. */
+        if(quest->start_time && quest->start_time > (uint64_t)now)
+            continue;
+        else if(quest->end_time && quest->end_time < (uint64_t)now)
+            continue;
 
-            /* Check the various version-disable flags */
-            if((quest->versions & SYLVERANT_QUEST_NODC) && hasdc)
-                continue;
-            if((quest->versions & SYLVERANT_QUEST_NOPC) && haspc)
-                continue;
-            if((quest->versions & SYLVERANT_QUEST_NOGC) && hasgc)
-                continue;
-            if((quest->versions & SYLVERANT_QUEST_NOXB) && hasxb)
-                continue;
+        /* Check the various version-disable flags */
+        if((quest->versions & SYLVERANT_QUEST_NODC) && hasdc)
+            continue;
+        if((quest->versions & SYLVERANT_QUEST_NOPC) && haspc)
+            continue;
+        if((quest->versions & SYLVERANT_QUEST_NOGC) && hasgc)
+            continue;
+        if((quest->versions & SYLVERANT_QUEST_NOXB) && hasxb)
+            continue;
 
-            /* Clear the entry */
-            memset(pkt->entries + entries, 0, 0x98);
-
-            /* Copy the category's information over to the packet */
-            pkt->entries[entries].menu_id = LE32(((MENU_ID_QUEST) |
-                                                  (lang << 24)));
-            pkt->entries[entries].item_id = LE32(quest->qid);
-
-            /* Convert the name and the description to the appropriate
-               encoding */
-            in = 32;
-            out = 30;
-            inptr = quest->name;
-            outptr = &pkt->entries[entries].name[2];
-
-            if(lang == CLIENT_LANG_JAPANESE && !k) {
-                iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].name[0] = '\t';
-                pkt->entries[entries].name[1] = 'J';
-            }
-            else {
-                iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].name[0] = '\t';
-                pkt->entries[entries].name[1] = 'E';
-            }
+        /* Clear the entry */
+        memset(pkt->entries + entries, 0, 0x98);
 
-            in = 112;
-            out = 110;
-            inptr = quest->desc;
-            outptr = &pkt->entries[entries].desc[2];
+        /* Copy the category's information over to the packet */
+        pkt->entries[entries].menu_id = LE32(((MENU_ID_QUEST) |
+                                              (lang << 24)));
+        pkt->entries[entries].item_id = LE32(quest->qid);
 
-            if(lang == CLIENT_LANG_JAPANESE && !k) {
-                iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].desc[0] = '\t';
-                pkt->entries[entries].desc[1] = 'J';
-            }
-            else {
-                iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].desc[0] = '\t';
-                pkt->entries[entries].desc[1] = 'E';
-            }
+        /* Convert the name and the description to the appropriate
+           encoding */
+        in = 32;
+        out = 30;
+        inptr = quest->name;
+        outptr = &pkt->entries[entries].name[2];
 
-            ++entries;
-            len += 0x98;
+        if(lang == CLIENT_LANG_JAPANESE && !k) {
+            iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
+            pkt->entries[entries].name[0] = '\t';
+            pkt->entries[entries].name[1] = 'J';
+        }
+        else {
+            iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
+            pkt->entries[entries].name[0] = '\t';
+            pkt->entries[entries].name[1] = 'E';
         }
 
-        /* If we already did English, then we're done. */
-        if(cat == caten)
-            break;
+        in = 112;
+        out = 110;
+        inptr = quest->desc;
+        outptr = &pkt->entries[entries].desc[2];
+
+        if(lang == CLIENT_LANG_JAPANESE && !k) {
+            iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
+            pkt->entries[entries].desc[0] = '\t';
+            pkt->entries[entries].desc[1] = 'J';
+        }
+        else {
+            iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
+            pkt->entries[entries].desc[0] = '\t';
+            pkt->entries[entries].desc[1] = 'E';
+        }
 
-        cat = caten;
+        ++entries;
+        len += 0x98;
     }
 
     /* Fill in the rest of the header */
@@ -5437,13 +5736,13 @@ static int send_dc_quest_list(ship_client_t *c, int cn, int lang) {
 static int send_pc_quest_list(ship_client_t *c, int cn, int lang) {
     uint8_t *sendbuf = get_sendbuf();
     pc_quest_list_pkt *pkt = (pc_quest_list_pkt *)sendbuf;
-    int i, len = 0x04, entries = 0, max = INT_MAX, j, k, ver, v;
+    int i, len = 0x04, entries = 0, max = INT_MAX, j, k, m, ver, v;
     size_t in, out;
     ICONV_CONST char *inptr;
     char *outptr;
     sylverant_quest_list_t *qlist, *qlisten;
     lobby_t *l = c->cur_lobby;
-    sylverant_quest_category_t *cat, *caten;
+    const quest_menu_t *menu;
     sylverant_quest_t *quest;
     quest_map_elem_t *elem;
     ship_client_t *tmp;
@@ -5480,11 +5779,8 @@ static int send_pc_quest_list(ship_client_t *c, int cn, int lang) {
     if(!qlist->cats)
         return -1;
 
-    /* Grab the category... This implicitly assumes that the categories are in
-       the same order, regardless of language. At some point, I'll work this out
-       a better way, but for now, this will work. */
-    cat = &qlist->cats[cn];
-    caten = &qlisten->cats[cn];
+    /* Grab the menu for the category. */
+    menu = quest_get_menu(&ship->qmap, ver, lang, cn, l->num_clients);
 
     /* Clear out the header */
     memset(pkt, 0, 0x04);
@@ -5496,120 +5792,106 @@ static int send_pc_quest_list(ship_client_t *c, int cn, int lang) {
     /* Fill in the header */
     pkt->hdr.pkt_type = QUEST_LIST_TYPE;
 
-    for(k = 0; k < 2; ++k) {
-        for(i = 0; i < cat->quest_count && i < max; ++i) {
-            quest = cat->quests[i];
-            elem = (quest_map_elem_t *)quest->user_data;
+    /* The menu already leaves out anything that's hidden or can't be played
+       with this many people, so only check what can change. */
+    for(m = 0; menu && m < menu->count; ++m) {
+        i = menu->entries[m].index;
+        k = menu->entries[m].english;
 
-            /* Skip quests we should have already covered if we're on the second
-               pass through */
-            if(k && elem->qptr[ver][lang])
-                continue;
+        if(i >= max)
+            continue;
 
-            /* Skip quests that aren't for the current event */
-            if(!(quest->event & (1 << l->event)))
-                continue;
+        quest = menu->entries[m].quest;
+        elem = menu->entries[m].elem;
 
-            /* Skip quests where the number of players isn't in range. */
-            if(quest->max_players < l->num_clients ||
-               quest->min_players > l->num_clients)
-                continue;
+        /* Skip quests that aren't for the current event */
+        if(!(quest->event & (1 << l->event)))
+            continue;
 
-            /* Look through to make sure that all clients in the lobby can play
-               the quest */
-            for(j = 0; j < l->max_clients; ++j) {
-                if(!(tmp = l->clients[j]))
-                    continue;
+        /* Look through to make sure that all clients in the lobby can play
+           the quest */
+        for(j = 0; j < l->max_clients; ++j) {
+            if(!(tmp = l->clients[j]))
+                continue;
 
-                v = tmp->version;
+            v = tmp->version;
 
-                switch(v) {
-                    case CLIENT_VERSION_DCV1:
-                    case CLIENT_VERSION_DCV2:
-                        hasdc = 1;
-                        break;
-
-                    case CLIENT_VERSION_PC:
-                        haspc = 1;
-                        break;
+            switch(v) {
+                case CLIENT_VERSION_DCV1:
+                case CLIENT_VERSION_DCV2:
+                    hasdc = 1;
+                    break;
 
-                    case CLIENT_VERSION_GC:
-                        hasgc = 1;
-                        break;
+                case CLIENT_VERSION_PC:
+                    haspc = 1;
+                    break;
 
-                    case CLIENT_VERSION_XBOX:
-                        v = CLIENT_VERSION_GC;
-                        hasxb = 1;
-                        break;
-                }
+                case CLIENT_VERSION_GC:
+                    hasgc = 1;
+                    break;
 
-                if(!k && !elem->qptr[v][tmp->q_lang] &&
-                   !elem->qptr[v][tmp->language_code] &&
-                   !elem->qptr[v][CLIENT_LANG_ENGLISH] &&
-                   !elem->qptr[v][lang])
+                case CLIENT_VERSION_XBOX:
+                    v = CLIENT_VERSION_GC;
+                    hasxb = 1;
                     break;
             }
 
-            /* Skip quests where we can't play them due to restrictions by
-               users' versions or language codes */
-            if(j != l->max_clients)
-                continue;
-
-            /* Make sure the user's privilege level is good enough. */
-            if((quest->privileges & c->privilege) != quest->privileges &&
-               !LOCAL_GM(c))
-                continue;
-
-            /* Check the availability time against the current time. */
-            if(quest->start_time && quest->start_time > (uint64_t)now)
-                continue;
-            else if(quest->end_time && quest->end_time < (uint64_t)now)
-                continue;
+            if(!k && !elem->qptr[v][tmp->q_lang] &&
+               !elem->qptr[v][tmp->language_code] &&
+               !elem->qptr[v][CLIENT_LANG_ENGLISH] &&
+               !elem->qptr[v][lang])
+                break;
+        }
 
-            /* Check the hidden flag */
-            if((quest->flags & SYLVERANT_QUEST_HIDDEN))
-                continue;
+        /* Skip quests where we can't play them due to restrictions by
+           users' versions or language codes */
+        if(j != l->max_clients)
+            continue;
 
-            /* Check the various version-disable flags */
-            if((quest->versions & SYLVERANT_QUEST_NODC) && hasdc)
-                continue;
-            if((quest->versions & SYLVERANT_QUEST_NOPC) && haspc)
-                continue;
-            if((quest->versions & SYLVERANT_QUEST_NOGC) && hasgc)
-                continue;
-            if((quest->versions & SYLVERANT_QUEST_NOXB) && hasxb)
-                continue;
+        /* Make sure the user's privilege level is good enough. */
+        if((quest->privileges & c->privilege) != quest->privileges &&
+           !LOCAL_GM(c))
+            continue;
 
-            /* Clear the entry */
-            memset(pkt->entries + entries, 0, 0x128);
+        /* Check the availability time against the current time. */
+        if(quest->start_time && quest->start_time > (uint64_t)now)
+            continue;
+        else if(quest->end_time && quest->end_time < (uint64_t)now)
+            continue;
 
-            /* Copy the category's information over to the packet */
-            pkt->entries[entries].menu_id = LE32(((MENU_ID_QUEST) |
-                                                  (lang << 24)));
-            pkt->entries[entries].item_id = LE32(quest->qid);
+        /* Check the various version-disable flags */
+        if((quest->versions & SYLVERANT_QUEST_NODC) && hasdc)
+            continue;
+        if((quest->versions & SYLVERANT_QUEST_NOPC) && haspc)
+            continue;
+        if((quest->versions & SYLVERANT_QUEST_NOGC) && hasgc)
+            continue;
+        if((quest->versions & SYLVERANT_QUEST_NOXB) && hasxb)
+            continue;
 
-            /* Convert the name and the description to UTF-16. */
-            in = 32;
-            out = 64;
-            inptr = quest->name;
-            outptr = (char *)pkt->entries[entries].name;
-            iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+        /* Clear the entry */
+        memset(pkt->entries + entries, 0, 0x128);
 
-            in = 112;
-            out = 224;
-            inptr = quest->desc;
-            outptr = (char *)pkt->entries[entries].desc;
-            iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+        /* Copy the category's information over to the packet */
+        pkt->entries[entries].menu_id = LE32(((MENU_ID_QUEST) |
+                                              (lang << 24)));
+        pkt->entries[entries].item_id = LE32(quest->qid);
 
-            ++entries;
-            len += 0x128;
-        }
+        /* Convert the name and the description to UTF-16. */
+        in = 32;
+        out = 64;
+        inptr = quest->name;
+        outptr = (char *)pkt->entries[entries].name;
+        iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
-        /* If we already did English, then we're done. */
-        if(cat == caten)
-            break;
+        in = 112;
+        out = 224;
+        inptr = quest->desc;
+        outptr = (char *)pkt->entries[entries].desc;
+        iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
-        cat = caten;
+        ++entries;
+        len += 0x128;
     }
 
     /* Fill in the rest of the header */
@@ -5623,13 +5905,14 @@ static int send_pc_quest_list(ship_client_t *c, int cn, int lang) {
 static int send_gc_quest_list(ship_client_t *c, int cn, int lang) {
     uint8_t *sendbuf = get_sendbuf();
     dc_quest_list_pkt *pkt = (dc_quest_list_pkt *)sendbuf;
-    int i, len = 0x04, entries = 0, max = INT_MAX, max2 = INT_MAX, j, k, ver, v;
+    int i, len = 0x04, entries = 0, max = INT_MAX, max2 = INT_MAX, j, k, m;
+    int ver, v;
     size_t in, out;
     ICONV_CONST char *inptr;
     char *outptr;
     sylverant_quest_list_t *qlist, *qlisten;
     lobby_t *l = c->cur_lobby;
-    sylverant_quest_category_t *cat, *caten;
+    const quest_menu_t *menu;
     sylverant_quest_t *quest;
     quest_map_elem_t *elem;
     ship_client_t *tmp;
@@ -5671,11 +5954,8 @@ static int send_gc_quest_list(ship_client_t *c, int cn, int lang) {
     if(!qlist->cats)
         return -1;
 
-    /* Grab the category... This implicitly assumes that the categories are in
-       the same order, regardless of language. At some point, I'll work this out
-       a better way, but for now, this will work. */
-    cat = &qlist->cats[cn];
-    caten = &qlisten->cats[cn];
+    /* Grab the menu for the category. */
+    menu = quest_get_menu(&ship->qmap, ver, lang, cn, l->num_clients);
 
     /* Clear out the header */
     memset(pkt, 0, 0x04);
@@ -5689,151 +5969,134 @@ static int send_gc_quest_list(ship_client_t *c, int cn, int lang) {
     /* Fill in the header */
     pkt->hdr.pkt_type = QUEST_LIST_TYPE;
 
-    for(k = 0; k < 2; ++k) {
-        for(i = 0; i < cat->quest_count; ++i) {
-            if(c->cur_lobby->challenge) {
-                /* Skip episode 1 challenge quests we're not qualified for. */
-                if(i < 9 && i >= max)
-                    continue;
-                /* Same for episode 2. */
-                else if(i > 9 && (i - 9) >= max2)
-                    break;
-            }
+    /* The menu already leaves out anything that's hidden or can't be played
+       with this many people, so only check what can change. */
+    for(m = 0; menu && m < menu->count; ++m) {
+        i = menu->entries[m].index;
+        k = menu->entries[m].english;
 
-            quest = cat->quests[i];
-            elem = (quest_map_elem_t *)quest->user_data;
-
-            /* Skip quests we should have already covered if we're on the second
-               pass through */
-            if(k && elem->qptr[ver][lang])
+        if(c->cur_lobby->challenge) {
+            /* Skip episode 1 challenge quests we're not qualified for. */
+            if(i < 9 && i >= max)
                 continue;
-
-            /* Skip quests that aren't for the current event */
-            if(!(quest->event & (1 << l->event)))
+            /* Same for episode 2. */
+            else if(i > 9 && (i - 9) >= max2)
                 continue;
+        }
 
-            /* Skip quests where the number of players isn't in range. */
-            if(quest->max_players < l->num_clients ||
-               quest->min_players > l->num_clients)
-                continue;
+        quest = menu->entries[m].quest;
+        elem = menu->entries[m].elem;
 
-            /* Look through to make sure that all clients in the lobby can play
-               the quest */
-            for(j = 0; j < l->max_clients; ++j) {
-                if(!(tmp = l->clients[j]))
-                    continue;
+        /* Skip quests that aren't for the current event */
+        if(!(quest->event & (1 << l->event)))
+            continue;
 
-                v = tmp->version;
+        /* Look through to make sure that all clients in the lobby can play
+           the quest */
+        for(j = 0; j < l->max_clients; ++j) {
+            if(!(tmp = l->clients[j]))
+                continue;
 
-                switch(v) {
-                    case CLIENT_VERSION_DCV1:
-                    case CLIENT_VERSION_DCV2:
-                        hasdc = 1;
-                        break;
+            v = tmp->version;
 
-                    case CLIENT_VERSION_PC:
-                        haspc = 1;
-                        break;
+            switch(v) {
+                case CLIENT_VERSION_DCV1:
+                case CLIENT_VERSION_DCV2:
+                    hasdc = 1;
+                    break;
 
-                    case CLIENT_VERSION_GC:
-                        hasgc = 1;
-                        break;
+                case CLIENT_VERSION_PC:
+                    haspc = 1;
+                    break;
 
-                    case CLIENT_VERSION_XBOX:
-                        v = CLIENT_VERSION_GC;
-                        hasxb = 1;
-                        break;
-                }
+                case CLIENT_VERSION_GC:
+                    hasgc = 1;
+                    break;
 
-                if(!k && !elem->qptr[v][tmp->q_lang] &&
-                   !elem->qptr[v][tmp->language_code] &&
-                   !elem->qptr[v][CLIENT_LANG_ENGLISH] &&
-                   !elem->qptr[v][lang])
+                case CLIENT_VERSION_XBOX:
+                    v = CLIENT_VERSION_GC;
+                    hasxb = 1;
                     break;
             }
 
-            /* Skip quests where we can't play them due to restrictions by
-               users' versions or language codes */
-            if(j != l->max_clients)
-                continue;
+            if(!k && !elem->qptr[v][tmp->q_lang] &&
+               !elem->qptr[v][tmp->language_code] &&
+               !elem->qptr[v][CLIENT_LANG_ENGLISH] &&
+               !elem->qptr[v][lang])
+                break;
+        }
 
-            /* Make sure the user's privilege level is good enough. */
-            if((quest->privileges & c->privilege) != quest->privileges &&
-               !LOCAL_GM(c))
-                continue;
+        /* Skip quests where we can't play them due to restrictions by
+           users' versions or language codes */
+        if(j != l->max_clients)
+            continue;
 
-            /* Check the availability time against the current time. */
-            if(quest->start_time && quest->start_time > (uint64_t)now)
-                continue;
-            else if(quest->end_time && quest->end_time < (uint64_t)now)
-                continue;
+        /* Make sure the user's privilege level is good enough. */
+        if((quest->privileges & c->privilege) != quest->privileges &&
+           !LOCAL_GM(c))
+            continue;
 
-            /* Check the hidden flag */
-            if((quest->flags & SYLVERANT_QUEST_HIDDEN))
-                continue;
+        /* Check the availability time against the current time. */
+        if(quest->start_time && quest->start_time > (uint64_t)now)
+            continue;
+        else if(quest->end_time && quest->end_time < (uint64_t)now)
+            continue;
 
-            /* Check the various version-disable flags */
-            if((quest->versions & SYLVERANT_QUEST_NODC) && hasdc)
-                continue;
-            if((quest->versions & SYLVERANT_QUEST_NOPC) && haspc)
-                continue;
-            if((quest->versions & SYLVERANT_QUEST_NOGC) && hasgc)
-                continue;
-            if((quest->versions & SYLVERANT_QUEST_NOXB) && hasxb)
-                continue;
+        /* Check the various version-disable flags */
+        if((quest->versions & SYLVERANT_QUEST_NODC) && hasdc)
+            continue;
+        if((quest->versions & SYLVERANT_QUEST_NOPC) && haspc)
+            continue;
+        if((quest->versions & SYLVERANT_QUEST_NOGC) && hasgc)
+            continue;
+        if((quest->versions & SYLVERANT_QUEST_NOXB) && hasxb)
+            continue;
 
-            /* Clear the entry */
-            memset(pkt->entries + entries, 0, 0x98);
-
-            /* Copy the category's information over to the packet */
-            pkt->entries[entries].menu_id = LE32(((MENU_ID_QUEST) |
-                                                  (quest->episode << 8) |
-                                                  (lang << 24)));
-            pkt->entries[entries].item_id = LE32(quest->qid);
-
-            /* Convert the name and the description to the appropriate
-               encoding */
-            in = 32;
-            out = 30;
-            inptr = quest->name;
-            outptr = &pkt->entries[entries].name[2];
-
-            if(lang == CLIENT_LANG_JAPANESE && !k) {
-                iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].name[0] = '\t';
-                pkt->entries[entries].name[1] = 'J';
-            }
-            else {
-                iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].name[0] = '\t';
-                pkt->entries[entries].name[1] = 'E';
-            }
+        /* Clear the entry */
+        memset(pkt->entries + entries, 0, 0x98);
 
-            in = 112;
-            out = 110;
-            inptr = quest->desc;
-            outptr = &pkt->entries[entries].desc[2];
+        /* Copy the category's information over to the packet */
+        pkt->entries[entries].menu_id = LE32(((MENU_ID_QUEST) |
+                                              (quest->episode << 8) |
+                                              (lang << 24)));
+        pkt->entries[entries].item_id = LE32(quest->qid);
 
-            if(lang == CLIENT_LANG_JAPANESE && !k) {
-                iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].desc[0] = '\t';
-                pkt->entries[entries].desc[1] = 'J';
-            }
-            else {
-                iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].desc[0] = '\t';
-                pkt->entries[entries].desc[1] = 'E';
-            }
+        /* Convert the name and the description to the appropriate
+           encoding */
+        in = 32;
+        out = 30;
+        inptr = quest->name;
+        outptr = &pkt->entries[entries].name[2];
 
-            ++entries;
-            len += 0x98;
+        if(lang == CLIENT_LANG_JAPANESE && !k) {
+            iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
+            pkt->entries[entries].name[0] = '\t';
+            pkt->entries[entries].name[1] = 'J';
+        }
+        else {
+            iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
+            pkt->entries[entries].name[0] = '\t';
+            pkt->entries[entries].name[1] = 'E';
         }
 
-        /* If we already did English, then we're done. */
-        if(cat == caten)
-            break;
+        in = 112;
+        out = 110;
+        inptr = quest->desc;
+        outptr = &pkt->entries[entries].desc[2];
 
-        cat = caten;
+        if(lang == CLIENT_LANG_JAPANESE && !k) {
+            iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
+            pkt->entries[entries].desc[0] = '\t';
+            pkt->entries[entries].desc[1] = 'J';
+        }
+        else {
+            iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
+            pkt->entries[entries].desc[0] = '\t';
+            pkt->entries[entries].desc[1] = 'E';
+        }
+
+        ++entries;
+        len += 0x98;
     }
 
     /* Fill in the rest of the header */
@@ -5847,13 +6110,14 @@ static int send_gc_quest_list(ship_client_t *c, int cn, int lang) {
 static int send_xbox_quest_list(ship_client_t *c, int cn, int lang) {
     uint8_t *sendbuf = get_sendbuf();
     xb_quest_list_pkt *pkt = (xb_quest_list_pkt *)sendbuf;
-    int i, len = 0x04, entries = 0, max = INT_MAX, max2 = INT_MAX, j, k, ver, v;
+    int i, len = 0x04, entries = 0, max = INT_MAX, max2 = INT_MAX, j, k, m;
+    int ver, v;
     size_t in, out;
     ICONV_CONST char *inptr;
     char *outptr;
     sylverant_quest_list_t *qlist, *qlisten;
     lobby_t *l = c->cur_lobby;
-    sylverant_quest_category_t *cat, *caten;
+    const quest_menu_t *menu;
     sylverant_quest_t *quest;
     quest_map_elem_t *elem;
     ship_client_t *tmp;
@@ -5895,11 +6159,8 @@ static int send_xbox_quest_list(ship_client_t *c, int cn, int lang) {
     if(!qlist->cats)
         return -1;
 
-    /* Grab the category... This implicitly assumes that the categories are in
-       the same order, regardless of language. At some point, I'll work this out
-       a better way, but for now, this will work. */
-    cat = &qlist->cats[cn];
-    caten = &qlisten->cats[cn];
+    /* Grab the menu for the category. */
+    menu = quest_get_menu(&ship->qmap, ver, lang, cn, l->num_clients);
 
     /* Clear out the header */
     memset(pkt, 0, 0x04);
@@ -5913,151 +6174,134 @@ static int send_xbox_quest_list(ship_client_t *c, int cn, int lang) {
     /* Fill in the header */
     pkt->hdr.pkt_type = QUEST_LIST_TYPE;
 
-    for(k = 0; k < 2; ++k) {
-        for(i = 0; i < cat->quest_count; ++i) {
-            if(c->cur_lobby->challenge) {
-                /* Skip episode 1 challenge quests we're not qualified for. */
-                if(i < 9 && i >= max)
-                    continue;
-                /* Same for episode 2. */
-                else if(i > 9 && (i - 9) >= max2)
-                    break;
-            }
-
-            quest = cat->quests[i];
-            elem = (quest_map_elem_t *)quest->user_data;
+    /* The menu already leaves out anything that's hidden or can't be played
+       with this many people, so only check what can change. */
+    for(m = 0; menu && m < menu->count; ++m) {
+        i = menu->entries[m].index;
+        k = menu->entries[m].english;
 
-            /* Skip quests we should have already covered if we're on the second
-               pass through */
-            if(k && elem->qptr[ver][lang])
+        if(c->cur_lobby->challenge) {
+            /* Skip episode 1 challenge quests we're not qualified for. */
+            if(i < 9 && i >= max)
                 continue;
-
-            /* Skip quests that aren't for the current event */
-            if(!(quest->event & (1 << l->event)))
+            /* Same for episode 2. */
+            else if(i > 9 && (i - 9) >= max2)
                 continue;
+        }
 
-            /* Skip quests where the number of players isn't in range. */
-            if(quest->max_players < l->num_clients ||
-               quest->min_players > l->num_clients)
-                continue;
+        quest = menu->entries[m].quest;
+        elem = menu->entries[m].elem;
 
-            /* Look through to make sure that all clients in the lobby can play
-               the quest */
-            for(j = 0; j < l->max_clients; ++j) {
-                if(!(tmp = l->clients[j]))
-                    continue;
+        /* Skip quests that aren't for the current event */
+        if(!(quest->event & (1 << l->event)))
+            continue;
 
-                v = tmp->version;
+        /* Look through to make sure that all clients in the lobby can play
+           the quest */
+        for(j = 0; j < l->max_clients; ++j) {
+            if(!(tmp = l->clients[j]))
+                continue;
 
-                switch(v) {
-                    case CLIENT_VERSION_DCV1:
-                    case CLIENT_VERSION_DCV2:
-                        hasdc = 1;
-                        break;
+            v = tmp->version;
 
-                    case CLIENT_VERSION_PC:
-                        haspc = 1;
-                        break;
+            switch(v) {
+                case CLIENT_VERSION_DCV1:
+                case CLIENT_VERSION_DCV2:
+                    hasdc = 1;
+                    break;
 
-                    case CLIENT_VERSION_GC:
-                        hasgc = 1;
-                        break;
+                case CLIENT_VERSION_PC:
+                    haspc = 1;
+                    break;
 
-                    case CLIENT_VERSION_XBOX:
-                        v = CLIENT_VERSION_GC;
-                        hasxb = 1;
-                        break;
-                }
+                case CLIENT_VERSION_GC:
+                    hasgc = 1;
+                    break;
 
-                if(!k && !elem->qptr[v][tmp->q_lang] &&
-                   !elem->qptr[v][tmp->language_code] &&
-                   !elem->qptr[v][CLIENT_LANG_ENGLISH] &&
-                   !elem->qptr[v][lang])
+                case CLIENT_VERSION_XBOX:
+                    v = CLIENT_VERSION_GC;
+                    hasxb = 1;
                     break;
             }
 
-            /* Skip quests where we can't play them due to restrictions by
-               users' versions or language codes */
-            if(j != l->max_clients)
-                continue;
+            if(!k && !elem->qptr[v][tmp->q_lang] &&
+               !elem->qptr[v][tmp->language_code] &&
+               !elem->qptr[v][CLIENT_LANG_ENGLISH] &&
+               !elem->qptr[v][lang])
+                break;
+        }
 
-            /* Make sure the user's privilege level is good enough. */
-            if((quest->privileges & c->privilege) != quest->privileges &&
-               !LOCAL_GM(c))
-                continue;
+        /* Skip quests where we can't play them due to restrictions by
+           users' versions or language codes */
+        if(j != l->max_clients)
+            continue;
 
-            /* Check the availability time against the current time. */
-            if(quest->start_time && quest->start_time > (uint64_t)now)
-                continue;
-            else if(quest->end_time && quest->end_time < (uint64_t)now)
-                continue;
+        /* Make sure the user's privilege level is good enough. */
+        if((quest->privileges & c->privilege) != quest->privileges &&
+           !LOCAL_GM(c))
+            continue;
 
-            /* Check the hidden flag */
-            if((quest->flags & SYLVERANT_QUEST_HIDDEN))
-                continue;
+        /* Check the availability time against the current time. */
+        if(quest->start_time && quest->start_time > (uint64_t)now)
+            continue;
+        else if(quest->end_time && quest->end_time < (uint64_t)now)
+            continue;
 
-            /* Check the various version-disable flags */
-            if((quest->versions & SYLVERANT_QUEST_NODC) && hasdc)
-                continue;
-            if((quest->versions & SYLVERANT_QUEST_NOPC) && haspc)
-                continue;
-            if((quest->versions & SYLVERANT_QUEST_NOGC) && hasgc)
-                continue;
-            if((quest->versions & SYLVERANT_QUEST_NOXB) && hasxb)
-                continue;
+        /* Check the various version-disable flags */
+        if((quest->versions & SYLVERANT_QUEST_NODC) && hasdc)
+            continue;
+        if((quest->versions & SYLVERANT_QUEST_NOPC) && haspc)
+            continue;
+        if((quest->versions & SYLVERANT_QUEST_NOGC) && hasgc)
+            continue;
+        if((quest->versions & SYLVERANT_QUEST_NOXB) && hasxb)
+            continue;
 
-            /* Clear the entry */
-            memset(pkt->entries + entries, 0, 0x98);
-
-            /* Copy the category's information over to the packet */
-            pkt->entries[entries].menu_id = LE32(((MENU_ID_QUEST) |
-                                                  (quest->episode << 8) |
-                                                  (lang << 24)));
-            pkt->entries[entries].item_id = LE32(quest->qid);
-
-            /* Convert the name and the description to the appropriate
-               encoding */
-            in = 32;
-            out = 30;
-            inptr = quest->name;
-            outptr = &pkt->entries[entries].name[2];
-
-            if(lang == CLIENT_LANG_JAPANESE && !k) {
-                iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].name[0] = '\t';
-                pkt->entries[entries].name[1] = 'J';
-            }
-            else {
-                iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].name[0] = '\t';
-                pkt->entries[entries].name[1] = 'E';
-            }
+        /* Clear the entry */
+        memset(pkt->entries + entries, 0, 0x98);
 
-            in = 112;
-            out = 126;
-            inptr = quest->desc;
-            outptr = &pkt->entries[entries].desc[2];
+        /* Copy the category's information over to the packet */
+        pkt->entries[entries].menu_id = LE32(((MENU_ID_QUEST) |
+                                              (quest->episode << 8) |
+                                              (lang << 24)));
+        pkt->entries[entries].item_id = LE32(quest->qid);
 
-            if(lang == CLIENT_LANG_JAPANESE && !k) {
-                iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].desc[0] = '\t';
-                pkt->entries[entries].desc[1] = 'J';
-            }
-            else {
-                iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].desc[0] = '\t';
-                pkt->entries[entries].desc[1] = 'E';
-            }
+        /* Convert the name and the description to the appropriate
+           encoding */
+        in = 32;
+        out = 30;
+        inptr = quest->name;
+        outptr = &pkt->entries[entries].name[2];
 
-            ++entries;
-            len += 0xA8;
+        if(lang == CLIENT_LANG_JAPANESE && !k) {
+            iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
+            pkt->entries[entries].name[0] = '\t';
+            pkt->entries[entries].name[1] = 'J';
+        }
+        else {
+            iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
+            pkt->entries[entries].name[0] = '\t';
+            pkt->entries[entries].name[1] = 'E';
         }
 
-        /* If we already did English, then we're done. */
-        if(cat == caten)
-            break;
+        in = 112;
+        out = 126;
+        inptr = quest->desc;
+        outptr = &pkt->entries[entries].desc[2];
+
+        if(lang == CLIENT_LANG_JAPANESE && !k) {
+            iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
+            pkt->entries[entries].desc[0] = '\t';
+            pkt->entries[entries].desc[1] = 'J';
+        }
+        else {
+            iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
+            pkt->entries[entries].desc[0] = '\t';
+            pkt->entries[entries].desc[1] = 'E';
+        }
 
-        cat = caten;
+        ++entries;
+        len += 0xA8;
     }
 
     /* Fill in the rest of the header */
@@ -6071,13 +6315,13 @@ static int send_xbox_quest_list(ship_client_t *c, int cn, int lang) {
 static int send_bb_quest_list(ship_client_t *c, int cn, int lang) {
     uint8_t *sendbuf = get_sendbuf();
     bb_quest_list_pkt *pkt = (bb_quest_list_pkt *)sendbuf;
-    int i, len = 0x08, entries = 0, max = INT_MAX, max2 = INT_MAX, j, k;
+    int i, len = 0x08, entries = 0, max = INT_MAX, max2 = INT_MAX, j, k, m;
     size_t in, out;
     ICONV_CONST char *inptr;
     char *outptr;
     sylverant_quest_list_t *qlist, *qlisten;
     lobby_t *l = c->cur_lobby;
-    sylverant_quest_category_t *cat, *caten;
+    const quest_menu_t *menu;
     sylverant_quest_t *quest;
     quest_map_elem_t *elem;
     ship_client_t *tmp;
@@ -6105,11 +6349,9 @@ static int send_bb_quest_list(ship_client_t *c, int cn, int lang) {
     if(!qlist->cats)
         return -1;
 
-    /* Grab the category... This implicitly assumes that the categories are in
-       the same order, regardless of language. At some point, I'll work this out
-       a better way, but for now, this will work. */
-    cat = &qlist->cats[cn];
-    caten = &qlisten->cats[cn];
+    /* Grab the menu for the category. */
+    menu = quest_get_menu(&ship->qmap, CLIENT_VERSION_BB, lang, cn,
+                          l->num_clients);
 
     /* If this is for challenge mode, figure out our limit. */
     if(c->cur_lobby->challenge) {
@@ -6120,98 +6362,81 @@ static int send_bb_quest_list(ship_client_t *c, int cn, int lang) {
     /* Fill in the header */
     pkt->hdr.pkt_type = LE16(QUEST_LIST_TYPE);
 
-    for(k = 0; k < 2; ++k) {
-        for(i = 0; i < cat->quest_count; ++i) {
-            if(c->cur_lobby->challenge) {
-                /* Skip episode 1 challenge quests we're not qualified for. */
-                if(i < 9 && i >= max)
-                    continue;
-                /* Same for episode 2. */
-                else if(i > 9 && (i - 9) >= max2)
-                    break;
-            }
-
-            quest = cat->quests[i];
-            elem = (quest_map_elem_t *)quest->user_data;
-
-            /* Skip quests we should have already covered if we're on the second
-               pass through */
-            if(k && elem->qptr[CLIENT_VERSION_BB][lang])
-                continue;
+    /* The menu already leaves out anything that's hidden or can't be played
+       with this many people, so only check what can change. */
+    for(m = 0; menu && m < menu->count; ++m) {
+        i = menu->entries[m].index;
+        k = menu->entries[m].english;
 
-            /* Skip quests that aren't for the current event */
-            if(!(quest->event & (1 << l->event)))
+        if(c->cur_lobby->challenge) {
+            /* Skip episode 1 challenge quests we're not qualified for. */
+            if(i < 9 && i >= max)
                 continue;
-
-            /* Skip quests where the number of players isn't in range. */
-            if(quest->max_players < l->num_clients ||
-               quest->min_players > l->num_clients)
+            /* Same for episode 2. */
+            else if(i > 9 && (i - 9) >= max2)
                 continue;
+        }
 
-            /* Look through to make sure that all clients in the lobby can play
-               the quest */
-            for(j = 0; j < l->max_clients; ++j) {
-                if(!(tmp = l->clients[j]))
-                    continue;
+        quest = menu->entries[m].quest;
+        elem = menu->entries[m].elem;
 
-                if(!k && !elem->qptr[tmp->version][tmp->q_lang] &&
-                   !elem->qptr[tmp->version][tmp->language_code] &&
-                   !elem->qptr[tmp->version][CLIENT_LANG_ENGLISH] &&
-                   !elem->qptr[tmp->version][lang])
-                    break;
-            }
-
-            /* Skip quests where we can't play them due to restrictions by
-               users' versions or language codes */
-            if(j != l->max_clients)
-                continue;
+        /* Skip quests that aren't for the current event */
+        if(!(quest->event & (1 << l->event)))
+            continue;
 
-            /* Make sure the user's privilege level is good enough. */
-            if((quest->privileges & c->privilege) != quest->privileges &&
-               !LOCAL_GM(c))
+        /* Look through to make sure that all clients in the lobby can play
+           the quest */
+        for(j = 0; j < l->max_clients; ++j) {
+            if(!(tmp = l->clients[j]))
                 continue;
 
-            /* Check the availability time against the current time. */
-            if(quest->start_time && quest->start_time > (uint64_t)now)
-                continue;
-            else if(quest->end_time && quest->end_time < (uint64_t)now)
-                continue;
+            if(!k && !elem->qptr[tmp->version][tmp->q_lang] &&
+               !elem->qptr[tmp->version][tmp->language_code] &&
+               !elem->qptr[tmp->version][CLIENT_LANG_ENGLISH] &&
+               !elem->qptr[tmp->version][lang])
+                break;
+        }
 
-            /* Check the hidden flag */
-            if((quest->flags & SYLVERANT_QUEST_HIDDEN))
-                continue;
+        /* Skip quests where we can't play them due to restrictions by
+           users' versions or language codes */
+        if(j != l->max_clients)
+            continue;
 
-            /* Clear the entry */
-            memset(pkt->entries + entries, 0, 0x13C);
+        /* Make sure the user's privilege level is good enough. */
+        if((quest->privileges & c->privilege) != quest->privileges &&
+           !LOCAL_GM(c))
+            continue;
 
-            /* Copy the category's information over to the packet */
-            pkt->entries[entries].menu_id = LE32(((MENU_ID_QUEST) |
-                                                  (quest->episode << 8) |
-                                                  (lang << 24)));
-            pkt->entries[entries].item_id = LE32(quest->qid);
+        /* Check the availability time against the current time. */
+        if(quest->start_time && quest->start_time > (uint64_t)now)
+            continue;
+        else if(quest->end_time && quest->end_time < (uint64_t)now)
+            continue;
 
-            /* Convert the name and the description to UTF-16. */
-            in = 32;
-            out = 64;
-            inptr = quest->name;
-            outptr = (char *)pkt->entries[entries].name;
-            iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+        /* Clear the entry */
+        memset(pkt->entries + entries, 0, 0x13C);
 
-            in = 112;
-            out = 244;
-            inptr = quest->desc;
-            outptr = (char *)pkt->entries[entries].desc;
-            iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+        /* Copy the category's information over to the packet */
+        pkt->entries[entries].menu_id = LE32(((MENU_ID_QUEST) |
+                                              (quest->episode << 8) |
+                                              (lang << 24)));
+        pkt->entries[entries].item_id = LE32(quest->qid);
 
-            ++entries;
-            len += 0x13C;
-        }
+        /* Convert the name and the description to UTF-16. */
+        in = 32;
+        out = 64;
+        inptr = quest->name;
+        outptr = (char *)pkt->entries[entries].name;
+        iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
-        /* If we already did English, then we're done. */
-        if(cat == caten)
-            break;
+        in = 112;
+        out = 244;
+        inptr = quest->desc;
+        outptr = (char *)pkt->entries[entries].desc;
+        iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
-        cat = caten;
+        ++entries;
+        len += 0x13C;
     }
 
     /* Fill in the rest of the header */
@@ -6432,17 +6657,69 @@ int send_quest_info(lobby_t *l, uint32_t qid, int lang) {
     return 0;
 }
 
+/* Find a quest file in the cache, falling back to reading it from the disk if
+   it isn't there for some reason. If it had to be read, tmp is set to it, and
+   it must be freed when we're done with it. */
+static const quest_file_t *get_quest_file(const char *fn, const char *cname,
+                                          quest_file_t **tmp) {
+    const quest_file_t *rv;
+
+    *tmp = NULL;
+
+    if((rv = quest_file_lookup(ship->qfiles, fn, cname)))
+        return rv;
+
+    debug(DBG_LOG, "Quest file %s not cached, reading it\n", fn);
+    return (*tmp = quest_file_read(fn, cname));
+}
+
+static int get_bindat_files(const char *fn_base, const char *prefix,
+                            const quest_file_t **bin, const quest_file_t **dat,
+                            quest_file_t *tmp[2]) {
+    char filename[260], cname[16];
+
+    snprintf(filename, 260, "%s.bin", fn_base);
+    snprintf(cname, 16, "%-.11s.bin", prefix);
+
+    if(!(*bin = get_quest_file(filename, cname, &tmp[0]))) {
+        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
+              strerror(errno));
+        return -1;
+    }
+
+    snprintf(filename, 260, "%s.dat", fn_base);
+    snprintf(cname, 16, "%-.11s.dat", prefix);
+
+    if(!(*dat = get_quest_file(filename, cname, &tmp[1]))) {
+        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
+              strerror(errno));
+
+        if(tmp[0])
+            quest_file_free(tmp[0]);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+static void put_bindat_files(quest_file_t *tmp[2]) {
+    if(tmp[0])
+        quest_file_free(tmp[0]);
+
+    if(tmp[1])
+        quest_file_free(tmp[1]);
+}
+
 /* Send a quest to everyone in a lobby. */
 static int send_dcv1_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
                            int lang) {
     uint8_t *sendbuf = get_sendbuf();
     dc_quest_file_pkt *file = (dc_quest_file_pkt *)sendbuf;
-    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)sendbuf;
-    FILE *bin, *dat;
+    const quest_file_t *bin, *dat;
+    quest_file_t *tmp[2];
     uint32_t binlen, datlen;
-    int bindone = 0, datdone = 0, chunknum = 0;
-    char fn_base[256], filename[260];
-    size_t amt;
+    char fn_base[256];
     sylverant_quest_t *q = qm->qptr[c->version][lang];
 
     /* Verify we got the sendbuf. */
@@ -6456,33 +6733,11 @@ static int send_dcv1_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
              version_codes[CLIENT_VERSION_DCV1], language_codes[lang],
              q->prefix);
 
-    snprintf(filename, 260, "%s.bin", fn_base);
-    bin = fopen(filename, "rb");
-
-    if(!bin) {
-        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
-              strerror(errno));
+    if(get_bindat_files(fn_base, q->prefix, &bin, &dat, tmp))
         return -1;
-    }
 
-    snprintf(filename, 260, "%s.dat", fn_base);
-    dat = fopen(filename, "rb");
-
-    if(!dat) {
-        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        return -1;
-    }
-
-    /* Figure out how long each of the files are */
-    fseek(bin, 0, SEEK_END);
-    binlen = (uint32_t)ftell(bin);
-    fseek(bin, 0, SEEK_SET);
-
-    fseek(dat, 0, SEEK_END);
-    datlen = (uint32_t)ftell(dat);
-    fseek(dat, 0, SEEK_SET);
+    binlen = bin->len;
+    datlen = dat->len;
 
     /* Send the file info packets */
     /* Start with the .dat file. */
@@ -6499,8 +6754,7 @@ static int send_dcv1_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
     if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
         debug(DBG_WARN, "Error sending dat hdr %s: %s\n", fn_base,
               strerror(errno));
-        fclose(bin);
-        fclose(dat);
+        put_bindat_files(tmp);
         return -2;
     }
 
@@ -6518,80 +6772,17 @@ static int send_dcv1_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
     if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
         debug(DBG_WARN, "Error sending bin hdr %s: %s\n", fn_base,
               strerror(errno));
-        fclose(bin);
-        fclose(dat);
+        put_bindat_files(tmp);
         return -2;
     }
 
-    /* Now send the chunks of the file, interleaved. */
-    while(!bindone || !datdone) {
-        /* Start with the dat file if we've got any more to send from it */
-        if(!datdone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            snprintf(chunk->filename, 16, "%-.11s.dat", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, dat);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending dat file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                datdone = 1;
-            }
-        }
-
-        /* Then the bin file if we've got any more to send from it */
-        if(!bindone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            snprintf(chunk->filename, 16, "%-.11s.bin", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, bin);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending bin file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                bindone = 1;
-            }
-        }
-
-        ++chunknum;
+    /* Now start sending the chunks of the file, interleaved. */
+    if(quest_xfer_start(c, bin, dat, NULL, tmp)) {
+        debug(DBG_WARN, "Error sending quest files %s: %s\n", fn_base,
+              strerror(errno));
+        return -3;
     }
 
-    /* We're done with the files, close them */
-    fclose(bin);
-    fclose(dat);
-
     return 0;
 }
 
@@ -6599,12 +6790,10 @@ static int send_dcv2_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
                            int lang) {
     uint8_t *sendbuf = get_sendbuf();
     dc_quest_file_pkt *file = (dc_quest_file_pkt *)sendbuf;
-    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)sendbuf;
-    FILE *bin, *dat;
+    const quest_file_t *bin, *dat;
+    quest_file_t *tmp[2];
     uint32_t binlen, datlen;
-    int bindone = 0, datdone = 0, chunknum = 0;
-    char fn_base[256], filename[260];
-    size_t amt;
+    char fn_base[256];
     sylverant_quest_t *q = qm->qptr[c->version][lang];
 
     /* Verify we got the sendbuf. */
@@ -6624,33 +6813,11 @@ static int send_dcv2_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
                  q->prefix);
     }
 
-    snprintf(filename, 260, "%s.bin", fn_base);
-    bin = fopen(filename, "rb");
-
-    if(!bin) {
-        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
-              strerror(errno));
+    if(get_bindat_files(fn_base, q->prefix, &bin, &dat, tmp))
         return -1;
-    }
 
-    snprintf(filename, 260, "%s.dat", fn_base);
-    dat = fopen(filename, "rb");
-
-    if(!dat) {
-        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        return -1;
-    }
-
-    /* Figure out how long each of the files are */
-    fseek(bin, 0, SEEK_END);
-    binlen = (uint32_t)ftell(bin);
-    fseek(bin, 0, SEEK_SET);
-
-    fseek(dat, 0, SEEK_END);
-    datlen = (uint32_t)ftell(dat);
-    fseek(dat, 0, SEEK_SET);
+    binlen = bin->len;
+    datlen = dat->len;
 
     /* Send the file info packets */
     /* Start with the .dat file. */
@@ -6667,8 +6834,7 @@ static int send_dcv2_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
     if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
         debug(DBG_WARN, "Error sending dat hdr %s: %s\n", fn_base,
               strerror(errno));
-        fclose(bin);
-        fclose(dat);
+        put_bindat_files(tmp);
         return -2;
     }
 
@@ -6686,80 +6852,17 @@ static int send_dcv2_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
     if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
         debug(DBG_WARN, "Error sending bin hdr %s: %s\n", fn_base,
               strerror(errno));
-        fclose(bin);
-        fclose(dat);
+        put_bindat_files(tmp);
         return -2;
     }
 
-    /* Now send the chunks of the file, interleaved. */
-    while(!bindone || !datdone) {
-        /* Start with the dat file if we've got any more to send from it */
-        if(!datdone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            snprintf(chunk->filename, 16, "%-.11s.dat", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, dat);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending dat file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                datdone = 1;
-            }
-        }
-
-        /* Then the bin file if we've got any more to send from it */
-        if(!bindone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            snprintf(chunk->filename, 16, "%-.11s.bin", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, bin);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending bin file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                bindone = 1;
-            }
-        }
-
-        ++chunknum;
+    /* Now start sending the chunks of the file, interleaved. */
+    if(quest_xfer_start(c, bin, dat, NULL, tmp)) {
+        debug(DBG_WARN, "Error sending quest files %s: %s\n", fn_base,
+              strerror(errno));
+        return -3;
     }
 
-    /* We're done with the files, close them */
-    fclose(bin);
-    fclose(dat);
-
     return 0;
 }
 
@@ -6767,12 +6870,10 @@ static int send_pc_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
                          int lang) {
     uint8_t *sendbuf = get_sendbuf();
     pc_quest_file_pkt *file = (pc_quest_file_pkt *)sendbuf;
-    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)sendbuf;
-    FILE *bin, *dat;
+    const quest_file_t *bin, *dat;
+    quest_file_t *tmp[2];
     uint32_t binlen, datlen;
-    int bindone = 0, datdone = 0, chunknum = 0;
-    char fn_base[256], filename[260];
-    size_t amt;
+    char fn_base[256];
     sylverant_quest_t *q = qm->qptr[c->version][lang];
 
     /* Verify we got the sendbuf. */
@@ -6791,33 +6892,11 @@ static int send_pc_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
                  version_codes[c->version], language_codes[lang], q->prefix);
     }
 
-    snprintf(filename, 260, "%s.bin", fn_base);
-    bin = fopen(filename, "rb");
-
-    if(!bin) {
-        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
-              strerror(errno));
-        return -1;
-    }
-
-    snprintf(filename, 260, "%s.dat", fn_base);
-    dat = fopen(filename, "rb");
-
-    if(!dat) {
-        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
+    if(get_bindat_files(fn_base, q->prefix, &bin, &dat, tmp))
         return -1;
-    }
 
-    /* Figure out how long each of the files are */
-    fseek(bin, 0, SEEK_END);
-    binlen = (uint32_t)ftell(bin);
-    fseek(bin, 0, SEEK_SET);
-
-    fseek(dat, 0, SEEK_END);
-    datlen = (uint32_t)ftell(dat);
-    fseek(dat, 0, SEEK_SET);
+    binlen = bin->len;
+    datlen = dat->len;
 
     /* Send the file info packets */
     /* Start with the .dat file. */
@@ -6835,8 +6914,7 @@ static int send_pc_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
     if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
         debug(DBG_WARN, "Error sending dat hdr %s: %s\n", fn_base,
               strerror(errno));
-        fclose(bin);
-        fclose(dat);
+        put_bindat_files(tmp);
         return -2;
     }
 
@@ -6855,80 +6933,17 @@ static int send_pc_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
     if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
         debug(DBG_WARN, "Error sending bin hdr %s: %s\n", fn_base,
               strerror(errno));
-        fclose(bin);
-        fclose(dat);
+        put_bindat_files(tmp);
         return -2;
     }
 
-    /* Now send the chunks of the file, interleaved. */
-    while(!bindone || !datdone) {
-        /* Start with the dat file if we've got any more to send from it */
-        if(!datdone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.pc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.pc.flags = (uint8_t)chunknum;
-            chunk->hdr.pc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            snprintf(chunk->filename, 16, "%-.11s.dat", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, dat);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending dat file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                datdone = 1;
-            }
-        }
-
-        /* Then the bin file if we've got any more to send from it */
-        if(!bindone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.pc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.pc.flags = (uint8_t)chunknum;
-            chunk->hdr.pc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            snprintf(chunk->filename, 16, "%-.11s.bin", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, bin);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending bin file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                bindone = 1;
-            }
-        }
-
-        ++chunknum;
+    /* Now start sending the chunks of the file, interleaved. */
+    if(quest_xfer_start(c, bin, dat, NULL, tmp)) {
+        debug(DBG_WARN, "Error sending quest files %s: %s\n", fn_base,
+              strerror(errno));
+        return -3;
     }
 
-    /* We're done with the files, close them */
-    fclose(bin);
-    fclose(dat);
-
     return 0;
 }
 
@@ -6936,12 +6951,11 @@ static int send_gc_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
                          int lang) {
     uint8_t *sendbuf = get_sendbuf();
     gc_quest_file_pkt *file = (gc_quest_file_pkt *)sendbuf;
-    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)sendbuf;
-    FILE *bin, *dat;
+    const quest_file_t *bin, *dat;
+    quest_file_t *tmp[2];
     uint32_t binlen, datlen;
-    int bindone = 0, datdone = 0, chunknum = 0, v = c->version;
-    char fn_base[256], filename[260];
-    size_t amt;
+    int v = c->version;
+    char fn_base[256];
     sylverant_quest_t *q;
 
     if(v == CLIENT_VERSION_XBOX)
@@ -6965,33 +6979,11 @@ static int send_gc_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
                  version_codes[v], language_codes[lang], q->prefix);
     }
 
-    snprintf(filename, 260, "%s.bin", fn_base);
-    bin = fopen(filename, "rb");
-
-    if(!bin) {
-        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
-              strerror(errno));
+    if(get_bindat_files(fn_base, q->prefix, &bin, &dat, tmp))
         return -1;
-    }
 
-    snprintf(filename, 260, "%s.dat", fn_base);
-    dat = fopen(filename, "rb");
-
-    if(!dat) {
-        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        return -1;
-    }
-
-    /* Figure out how long each of the files are */
-    fseek(bin, 0, SEEK_END);
-    binlen = (uint32_t)ftell(bin);
-    fseek(bin, 0, SEEK_SET);
-
-    fseek(dat, 0, SEEK_END);
-    datlen = (uint32_t)ftell(dat);
-    fseek(dat, 0, SEEK_SET);
+    binlen = bin->len;
+    datlen = dat->len;
 
     /* Send the file info packets */
     /* Start with the .dat file. */
@@ -7009,8 +7001,7 @@ static int send_gc_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
     if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
         debug(DBG_WARN, "Error sending dat hdr %s: %s\n", fn_base,
               strerror(errno));
-        fclose(bin);
-        fclose(dat);
+        put_bindat_files(tmp);
         return -2;
     }
 
@@ -7029,94 +7020,29 @@ static int send_gc_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
     if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
         debug(DBG_WARN, "Error sending bin hdr %s: %s\n", fn_base,
               strerror(errno));
-        fclose(bin);
-        fclose(dat);
+        put_bindat_files(tmp);
         return -2;
     }
 
-    /* Now send the chunks of the file, interleaved. */
-    while(!bindone || !datdone) {
-        /* Start with the dat file if we've got any more to send from it */
-        if(!datdone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            snprintf(chunk->filename, 16, "%-.11s.dat", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, dat);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending dat file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                datdone = 1;
-            }
-        }
-
-        /* Then the bin file if we've got any more to send from it */
-        if(!bindone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            snprintf(chunk->filename, 16, "%-.11s.bin", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, bin);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending bin file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                bindone = 1;
-            }
-        }
-
-        ++chunknum;
+    /* Now start sending the chunks of the file, interleaved. */
+    if(quest_xfer_start(c, bin, dat, NULL, tmp)) {
+        debug(DBG_WARN, "Error sending quest files %s: %s\n", fn_base,
+              strerror(errno));
+        return -3;
     }
 
-    /* We're done with the files, close them */
-    fclose(bin);
-    fclose(dat);
-
     return 0;
 }
 
 static int send_qst_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
                           int lang, int ver) {
     char filename[256];
-    FILE *fp;
-    long len;
-    size_t read;
-    uint8_t *sendbuf = get_sendbuf();
+    const quest_file_t *qf;
+    quest_file_t *tmp, *tmps[2];
     sylverant_quest_t *q = qm->qptr[ver][lang];
 
-    /* Make sure we got the sendbuf and the quest */
-    if(!sendbuf || !q)
+    /* Make sure we got the quest */
+    if(!q)
         return -1;
 
     /* Figure out what file we're going to send. */
@@ -7155,53 +7081,22 @@ static int send_qst_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
         }
     }
 
-    fp = fopen(filename, "rb");
-
-    if(!fp) {
+    if(!(qf = get_quest_file(filename, NULL, &tmp))) {
         debug(DBG_WARN, "Cannot open qst file %s: %s\n", filename,
               strerror(errno));
         return -1;
     }
 
-    /* Figure out how long the file is. */
-    fseek(fp, 0, SEEK_END);
-    len = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    /* Copy the file (in chunks if necessary) to the sendbuf to actually send
-       away. */
-    while(len) {
-        read = fread(sendbuf, 1, 65536, fp);
+    /* The file is already made up of packets, so just start sending it. */
+    tmps[0] = tmp;
+    tmps[1] = NULL;
 
-        /* If we can't read from the file, bail. */
-        if(!read) {
-            debug(DBG_WARN, "Error reading qst file %s: %s\n", filename,
-                  strerror(errno));
-            fclose(fp);
-            return -2;
-        }
-
-        /* Make sure we read up to a header-size boundary. */
-        if((read & (c->hdr_size - 1)) && !feof(fp)) {
-            long amt = (read & (c->hdr_size - 1));
-
-            fseek(fp, -amt, SEEK_CUR);
-            read -= amt;
-        }
-
-        /* Send this chunk away. */
-        if(crypt_send(c, read, sendbuf)) {
-            debug(DBG_WARN, "Error sending qst file %s: %s\n", filename,
-                  strerror(errno));
-            fclose(fp);
-            return -3;
-        }
-
-        len -= read;
+    if(quest_xfer_start(c, NULL, NULL, qf, tmps)) {
+        debug(DBG_WARN, "Error sending qst file %s: %s\n", filename,
+              strerror(errno));
+        return -3;
     }
 
-    /* We're finished. */
-    fclose(fp);
     return 0;
 }
 
@@ -7224,6 +7119,7 @@ int send_quest(lobby_t *l, uint32_t qid, int lc) {
     for(i = 0; i < l->max_clients; ++i) {
         if((c = l->clients[i])) {
             c->flags &= ~CLIENT_FLAG_QLOAD_DONE;
+            c->qload_start = metrics_now();
 
             /* What type of quest file are we sending? */
             if(v1 && c->version == CLIENT_VERSION_DCV2)
@@ -7264,7 +7160,7 @@ int send_quest(lobby_t *l, uint32_t qid, int lc) {
 
                     /* Unfortunately, we're going to have to disconnect the user
                        if this happens, since we really have no recourse. */
-                    c->flags |= CLIENT_FLAG_DISCONNECTED;
+                    client_disconnect(c);
                     continue;
                 }
             }
@@ -7311,7 +7207,7 @@ int send_quest(lobby_t *l, uint32_t qid, int lc) {
                                  "this problem!\nInclude your guildcard\n"
                                  "number and the approximate\ntime in your "
                                  "error report.");
-                c->flags |= CLIENT_FLAG_DISCONNECTED;
+                client_disconnect(c);
             }
         }
     }
@@ -7334,6 +7230,7 @@ int send_quest_one(lobby_t *l, ship_client_t *c, uint32_t qid, int lc) {
         v1 = 1;
 
     c->flags &= ~CLIENT_FLAG_QLOAD_DONE;
+    c->qload_start = metrics_now();
 
     /* What type of quest file are we sending? */
     if(v1 && c->version == CLIENT_VERSION_DCV2)
@@ -7374,7 +7271,7 @@ int send_quest_one(lobby_t *l, ship_client_t *c, uint32_t qid, int lc) {
 
             /* Unfortunately, we're going to have to disconnect the user
                if this happens, since we really have no recourse. */
-            c->flags |= CLIENT_FLAG_DISCONNECTED;
+            client_disconnect(c);
             return -1;
         }
     }
@@ -7421,7 +7318,7 @@ int send_quest_one(lobby_t *l, ship_client_t *c, uint32_t qid, int lc) {
                          "this problem!\nInclude your guildcard\n"
                          "number and the approximate\ntime in your "
                          "error report.");
-        c->flags |= CLIENT_FLAG_DISCONNECTED;
+        client_disconnect(c);
     }
 
     return 0;
@@ -7775,17 +7672,14 @@ static int is_ship_menu_empty(ship_client_t *c, ship_t *s, uint16_t menu_code) {
     return 1;
 }
 
-/* Send a ship list packet to the client. */
-static int send_dc_ship_list(ship_client_t *c, ship_t *s, uint16_t menu_code) {
-    uint8_t *sendbuf = get_sendbuf();
+/* Build a ship list packet for the client. */
+static int build_dc_ship_list(uint8_t *sendbuf, ship_client_t *c, ship_t *s,
+                              uint16_t menu_code) {
     dc_ship_list_pkt *pkt = (dc_ship_list_pkt *)sendbuf;
     int len = 0x20, entries = 0, j;
     miniship_t *i;
     char tmp[3];
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf)
-        return -1;
 
     /* Clear the packet's header. */
     memset(pkt, 0, 0x20);
@@ -7889,19 +7783,16 @@ static int send_dc_ship_list(ship_client_t *c, ship_t *s, uint16_t menu_code) {
     pkt->hdr.pkt_len = LE16(((uint16_t)len));
 
     /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
-static int send_pc_ship_list(ship_client_t *c, ship_t *s, uint16_t menu_code) {
-    uint8_t *sendbuf = get_sendbuf();
+static int build_pc_ship_list(uint8_t *sendbuf, ship_client_t *c, ship_t *s,
+                              uint16_t menu_code) {
     pc_ship_list_pkt *pkt = (pc_ship_list_pkt *)sendbuf;
     int len = 0x30, entries = 0, j;
     miniship_t *i;
     char tmp[18], tmp2[3];
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf)
-        return -1;
 
     /* Clear the packet's header. */
     memset(pkt, 0, 0x30);
@@ -8005,19 +7896,16 @@ static int send_pc_ship_list(ship_client_t *c, ship_t *s, uint16_t menu_code) {
     pkt->hdr.pkt_len = LE16(((uint16_t)len));
 
     /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
-static int send_bb_ship_list(ship_client_t *c, ship_t *s, uint16_t menu_code) {
-    uint8_t *sendbuf = get_sendbuf();
+static int build_bb_ship_list(uint8_t *sendbuf, ship_client_t *c, ship_t *s,
+                              uint16_t menu_code) {
     bb_ship_list_pkt *pkt = (bb_ship_list_pkt *)sendbuf;
     int len = 0x34, entries = 0, j;
     miniship_t *i;
     char tmp[18], tmp2[3];
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf)
-        return -1;
 
     /* Clear the packet's header. */
     memset(pkt, 0, 0x30);
@@ -8118,10 +8006,26 @@ static int send_bb_ship_list(ship_client_t *c, ship_t *s, uint16_t menu_code) {
     pkt->hdr.pkt_len = LE16(((uint16_t)len));
 
     /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
 int send_ship_list(ship_client_t *c, ship_t *s, uint16_t menu_code) {
+    uint8_t *sendbuf = get_sendbuf();
+    uint32_t gen = 0;
+    int len, cache;
+
+    /* Verify we got the sendbuf. */
+    if(!sendbuf)
+        return -1;
+
+    /* Which ships show up depends on the client's privileges, so only cache
+       the list for those without any (which is nearly everyone). */
+    cache = !c->privilege;
+
+    if(cache && (len = menu_image_get(c, MENU_IMAGE_SHIPS, menu_variant(c),
+                                      menu_code, sendbuf, &gen)) > 0)
+        return crypt_send(c, len, sendbuf);
+
     /* Call the appropriate function. */
     switch(c->version) {
         case CLIENT_VERSION_DCV1:
@@ -8129,16 +8033,26 @@ int send_ship_list(ship_client_t *c, ship_t *s, uint16_t menu_code) {
         case CLIENT_VERSION_GC:
         case CLIENT_VERSION_EP3:
         case CLIENT_VERSION_XBOX:
-            return send_dc_ship_list(c, s, menu_code);
+            len = build_dc_ship_list(sendbuf, c, s, menu_code);
+            break;
 
         case CLIENT_VERSION_PC:
-            return send_pc_ship_list(c, s, menu_code);
+            len = build_pc_ship_list(sendbuf, c, s, menu_code);
+            break;
 
         case CLIENT_VERSION_BB:
-            return send_bb_ship_list(c, s, menu_code);
+            len = build_bb_ship_list(sendbuf, c, s, menu_code);
+            break;
+
+        default:
+            return -1;
     }
 
-    return -1;
+    if(cache)
+        menu_image_put(c, MENU_IMAGE_SHIPS, menu_variant(c), menu_code,
+                       sendbuf, len, gen);
+
+    return crypt_send(c, len, sendbuf);
 }
 
 /* Send a warp command to the client. */
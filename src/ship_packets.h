@@ -146,13 +146,34 @@ int send_lobby_join(ship_client_t *c, lobby_t *l);
 int send_pkt_dc(ship_client_t *c, const dc_pkt_hdr_t *pkt);
 int send_pkt_bb(ship_client_t *c, const bb_pkt_hdr_t *pkt);
 
+/* A packet that is being sent to a bunch of clients at once. The packet gets
+   laid out with the right header for each kind of client the first time it is
+   needed and reused for every other client of that kind, so that each send is
+   just the copy and the cipher. Each thread can only have one of these in use
+   at a time, since the converted copies live in a thread-specific buffer. */
+#define PKT_BCAST_DC    0
+#define PKT_BCAST_PC    1
+#define PKT_BCAST_BB    2
+
+typedef struct pkt_bcast {
+    const uint8_t *src;
+    int src_bb;
+    uint8_t *forms[3];
+    int lens[3];
+} pkt_bcast_t;
+
+void pkt_bcast_init_dc(pkt_bcast_t *b, const dc_pkt_hdr_t *pkt);
+void pkt_bcast_init_bb(pkt_bcast_t *b, const bb_pkt_hdr_t *pkt);
+int send_pkt_bcast(ship_client_t *c, pkt_bcast_t *b);
+
 /* Send a packet to all clients in the lobby when a new player joins. */
 int send_lobby_add_player(lobby_t *l, ship_client_t *c);
 
 /* Send a packet to all clients in the lobby when a player leaves. */
 int send_lobby_leave(lobby_t *l, ship_client_t *c, int client_id);
 
-/* Send a chat packet to the specified lobby (UTF-8). */
+/* Send a chat packet to the specified lobby (UTF-8). cmsg is the censored
+   version of the message, or NULL if censoring wouldn't change it. */
 int send_lobby_chat(lobby_t *l, ship_client_t *sender, const char *msg,
                     const char *cmsg);
 
@@ -183,6 +204,11 @@ int send_game_join(ship_client_t *c, lobby_t *l);
 /* Send a packet to a client giving them the list of games on the block. */
 int send_game_list(ship_client_t *c, block_t *b);
 
+/* Throw away the cached game list packets for the block. This must be called
+   whenever a game is added or removed, or anything shown in the list about one
+   of its games changes (name, password, player count or flags). */
+void clear_game_lists(block_t *b);
+
 /* Send a packet containing the lobby info menu to the client. */
 int send_info_list(ship_client_t *c, ship_t *s);
 
@@ -218,6 +244,10 @@ int send_arrows(ship_client_t *c, lobby_t *l);
 /* Send a ship list packet to the client. */
 int send_ship_list(ship_client_t *c, ship_t *s, uint16_t menu_code);
 
+/* Throw away the cached block, lobby and ship list packets. This must be called
+   whenever anything that goes into them changes. */
+void clear_menu_images(void);
+
 /* Send a warp command to the client. */
 int send_warp(ship_client_t *c, uint8_t area);
 
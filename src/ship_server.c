@@ -24,6 +24,7 @@
 #include <pthread.h>
 #include <signal.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <pwd.h>
 #include <grp.h>
 #include <arpa/inet.h>
@@ -43,6 +44,7 @@ struct pidfh;
 struct pidfh *pidfile_open(const char *path, mode_t mode, pid_t *pidptr);
 int pidfile_write(struct pidfh *pfh);
 int pidfile_remove(struct pidfh *pfh);
+int pidfile_close(struct pidfh *pfh);
 int pidfile_fileno(struct pidfh *pfh);
 #elif HAVE_LIBUTIL_H == 1
 #include <libutil.h>
@@ -54,7 +56,11 @@ int pidfile_fileno(struct pidfh *pfh);
 
 #include "ship.h"
 #include "clients.h"
+#include "sendq.h"
+#include "pktlog.h"
+#include "metrics.h"
 #include "shipgate.h"
+#include "subcmd.h"
 #include "utils.h"
 #include "scripts.h"
 #include "mapdata.h"
@@ -63,6 +69,8 @@ int pidfile_fileno(struct pidfh *pfh);
 #include "rtdata.h"
 #include "admin.h"
 #include "smutdata.h"
+#include "snapshot.h"
+#include "handoff.h"
 #include "version.h"
 
 #ifndef PID_DIR
@@ -92,6 +100,10 @@ static int check_only = 0;
 static const char *pidfile_name = NULL;
 static struct pidfh *pf = NULL;
 static const char *runas_user = RUNAS_DEFAULT;
+static const char *metrics_addr = NULL;
+static const char *snapshot_file = NULL;
+static snapshot_t *snapshot = NULL;
+static int handoff_fd = -1;
 
 /* Print information about this program to stdout. */
 static void print_program_info(void) {
@@ -131,14 +143,70 @@ static void print_help(const char *bin) {
            "-P filename     Use the specified name for the pid file to write\n"
            "                instead of the default.\n"
            "-U username     Run as the specified user instead of '%s'\n"
+           "--sendq-limit kb\n"
+           "                Disconnect any client that has more than this\n"
+           "                many KiB of data waiting to be sent to it\n"
+           "                (default: %d).\n"
+           "--sendq-pkts n  Also disconnect any client that has more than n\n"
+           "                packets waiting to go out to it (default: no\n"
+           "                limit).\n"
+           "--sendq-policy policy\n"
+           "                What to do about clients that are falling behind,\n"
+           "                either disconnect (default) to only disconnect\n"
+           "                them once they hit a limit, or shed to also stop\n"
+           "                sending them movement once they're half way to\n"
+           "                one.\n"
+           "--deferred-flush\n"
+           "                Batch up packets sent to each client and write\n"
+           "                them out together once per pass through the\n"
+           "                block's loop.\n"
+           "--block-workers n\n"
+           "                Spread the clients of each block out over n\n"
+           "                worker threads, keeping each lobby on one\n"
+           "                thread (default: 0, meaning only use the\n"
+           "                block's own thread).\n"
+           "--block-acceptors n\n"
+           "                Accept new connections to each block on n\n"
+           "                threads of their own, with separate listening\n"
+           "                sockets where SO_REUSEPORT is supported\n"
+           "                (default: 0, meaning the block's own thread\n"
+           "                accepts them).\n"
+           "--stream-joins  Let the rest of a game keep playing while a\n"
+           "                player joins, holding only the packets going to\n"
+           "                the player joining until it's done loading.\n"
+           "--move-aoi      Only send movement in a game to those in the same\n"
+           "                area, and send at most one movement from each\n"
+           "                player per pass through the block's loop.\n"
+           "--capture       Log the packets of every connection to the ship,\n"
+           "                as if /logme was used on everyone.\n"
+           "--dump-pktlog filename\n"
+           "                Print out a packet log (as written by /logme) in\n"
+           "                a readable form and exit.\n"
+           "--pkt-timing ms Time how long the blocks take to handle each\n"
+           "                packet, and log any that take longer than ms\n"
+           "                milliseconds (0 to only keep the times, which\n"
+           "                can be seen with /pprof).\n"
+           "--metrics addr  Serve up metrics in the Prometheus text format.\n"
+           "                addr is either a TCP port to listen on (on the\n"
+           "                loopback interface only) or the path of a Unix\n"
+           "                domain socket.\n"
+           "--snapshot filename\n"
+           "                Load the parsed item and map data from a snapshot\n"
+           "                in filename if it's still up to date, or write\n"
+           "                one out after parsing everything if not.\n"
+           "--live-restart  Restart by running the ship server binary again,\n"
+           "                passing the listening sockets along so that\n"
+           "                nobody gets refused while it comes back up.\n"
            "--help          Print this help and exit\n\n"
            "Note that if more than one verbosity level is specified, the last\n"
            "one specified will be used. The default is --verbose.\n", bin,
-           RUNAS_DEFAULT);
+           RUNAS_DEFAULT, SENDQ_DEFAULT_LIMIT / 1024);
 }
 
 /* Parse any command-line arguments passed in. */
 static void parse_command_line(int argc, char *argv[]) {
+    unsigned long ul;
+    char *endp;
     int i;
 
     for(i = 1; i < argc; ++i) {
@@ -203,6 +271,165 @@ static void parse_command_line(int argc, char *argv[]) {
 
             runas_user = argv[++i];
         }
+        else if(!strcmp(argv[i], "--sendq-limit")) {
+            if(i == argc - 1) {
+                printf("--sendq-limit requires an argument!\n\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            sendq_limit = (size_t)strtoul(argv[++i], NULL, 0) * 1024;
+
+            if(!sendq_limit) {
+                printf("Invalid send queue limit: %s\n\n", argv[i]);
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(!strcmp(argv[i], "--sendq-pkts")) {
+            if(i == argc - 1) {
+                printf("--sendq-pkts requires an argument!\n\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            errno = 0;
+            ul = strtoul(argv[++i], &endp, 0);
+
+            if(errno || !*argv[i] || *endp || ul > UINT32_MAX) {
+                printf("Invalid send queue packet limit: %s\n\n", argv[i]);
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            sendq_pkt_limit = (uint32_t)ul;
+        }
+        else if(!strcmp(argv[i], "--sendq-policy")) {
+            if(i == argc - 1) {
+                printf("--sendq-policy requires an argument!\n\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            ++i;
+
+            if(!strcmp(argv[i], "disconnect")) {
+                sendq_policy = SENDQ_POLICY_DISCONNECT;
+            }
+            else if(!strcmp(argv[i], "shed")) {
+                sendq_policy = SENDQ_POLICY_SHED;
+            }
+            else {
+                printf("Invalid send queue policy: %s\n\n", argv[i]);
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(!strcmp(argv[i], "--block-workers")) {
+            if(i == argc - 1) {
+                printf("--block-workers requires an argument!\n\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            block_workers = atoi(argv[++i]);
+
+            if(block_workers < 0 || block_workers > 64) {
+                printf("Invalid number of block workers: %s\n\n", argv[i]);
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(!strcmp(argv[i], "--block-acceptors")) {
+            if(i == argc - 1) {
+                printf("--block-acceptors requires an argument!\n\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            block_acceptors = atoi(argv[++i]);
+
+            if(block_acceptors < 0 || block_acceptors > 64) {
+                printf("Invalid number of block acceptors: %s\n\n",
+                       argv[i]);
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(!strcmp(argv[i], "--deferred-flush")) {
+            sendq_deferred = 1;
+        }
+        else if(!strcmp(argv[i], "--stream-joins")) {
+            lobby_stream_joins = 1;
+        }
+        else if(!strcmp(argv[i], "--move-aoi")) {
+            subcmd_move_aoi = 1;
+        }
+        else if(!strcmp(argv[i], "--capture")) {
+            pkt_log_capture = 1;
+        }
+        else if(!strcmp(argv[i], "--pkt-timing")) {
+            if(i == argc - 1) {
+                printf("--pkt-timing requires an argument!\n\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            errno = 0;
+            ul = strtoul(argv[++i], &endp, 10);
+
+            if(errno || !*argv[i] || *endp || ul > UINT32_MAX) {
+                printf("Invalid slow packet time: %s\n\n", argv[i]);
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            metrics_pkt_timing = 1;
+            metrics_slow_pkt_ms = (uint32_t)ul;
+        }
+        else if(!strcmp(argv[i], "--snapshot")) {
+            if(i == argc - 1) {
+                printf("--snapshot requires an argument!\n\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            snapshot_file = argv[++i];
+        }
+        else if(!strcmp(argv[i], "--live-restart")) {
+            handoff_enabled = 1;
+        }
+        else if(!strcmp(argv[i], "--handoff")) {
+            /* This one is only passed by a live restart (see handoff.c). */
+            if(i == argc - 1) {
+                printf("--handoff requires an argument!\n\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            handoff_fd = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--metrics")) {
+            if(i == argc - 1) {
+                printf("--metrics requires an argument!\n\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            metrics_addr = argv[++i];
+        }
+        else if(!strcmp(argv[i], "--dump-pktlog")) {
+            if(i == argc - 1) {
+                printf("--dump-pktlog requires an argument!\n\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            if(pktlog_dump(argv[++i], stdout))
+                exit(EXIT_FAILURE);
+
+            exit(EXIT_SUCCESS);
+        }
         else if(!strcmp(argv[i], "--help")) {
             print_help(argv[0]);
             exit(EXIT_SUCCESS);
@@ -373,6 +600,8 @@ static void open_log(sylverant_ship_t *cfg) {
         exit(EXIT_FAILURE);
     }
 
+    set_cloexec(fileno(dbgfp));
+
     debug_set_file(dbgfp);
 }
 
@@ -390,6 +619,7 @@ static void reopen_log(void) {
         perror("fopen");
     }
     else {
+        set_cloexec(fileno(dbgfp));
         ofp = debug_set_file(dbgfp);
         fclose(ofp);
     }
@@ -626,7 +856,33 @@ int setup_addresses(sylverant_ship_t *cfg) {
 }
 
 void cleanup_pidfile(void) {
-    pidfile_remove(pf);
+    if(pf)
+        pidfile_remove(pf);
+}
+
+/* The new image of a live restart locks the pidfile for itself, so let go of
+   it first. The pid doesn't change across the exec, so what's in it stays
+   right. */
+static void release_pidfile(void) {
+    if(pf) {
+        pidfile_close(pf);
+        pf = NULL;
+    }
+}
+
+/* Take the pidfile back if the exec for a live restart didn't work out. */
+static void reclaim_pidfile(void) {
+    pid_t op;
+
+    if(dont_daemonize || pf || !pidfile_name)
+        return;
+
+    if(!(pf = pidfile_open(pidfile_name, 0660, &op))) {
+        debug(DBG_WARN, "Cannot reopen pidfile: %s\n", strerror(errno));
+        return;
+    }
+
+    pidfile_write(pf);
 }
 
 static int drop_privs(void) {
@@ -706,12 +962,345 @@ static int drop_privs(void) {
     return 0;
 }
 
+/* Everything that gets read in at startup. Most of these don't depend on each
+   other at all, so they get spread out over a few threads. The loaders only
+   ever read from the configuration; a loader returns less than zero if the
+   ship can't start at all, or greater than zero if Blue Burst support needs to
+   be turned off, and that gets dealt with once they're all done. */
+typedef struct load_task {
+    const char *name;
+    int (*load)(sylverant_ship_t *cfg);
+    uint32_t deps;                      /* Tasks that have to finish first */
+    int in_snapshot;                    /* Covered by a snapshot? */
+    int state;
+    int rv;
+    uint64_t time;                      /* Microseconds */
+} load_task_t;
+
+#define LOAD_WAITING    0
+#define LOAD_RUNNING    1
+#define LOAD_DONE       2
+
+#define LOAD_MAX_THREADS    8
+
+enum {
+    LOAD_V2_PT = 0,
+    LOAD_GC_PT,
+    LOAD_BB_PT,
+    LOAD_V2_PMT,
+    LOAD_GC_PMT,
+    LOAD_BB_PMT,
+    LOAD_V2_RT,
+    LOAD_GC_RT,
+    LOAD_V2_MAPS,
+    LOAD_GC_MAPS,
+    LOAD_BB_MAPS,
+    LOAD_SMUTDATA,
+    LOAD_TASK_COUNT
+};
+
+static int load_v2_pt(sylverant_ship_t *cfg) {
+    if(cfg->v2_ptdata_file) {
+        debug(DBG_LOG, "Reading v2 ItemPT file: %s\n", cfg->v2_ptdata_file);
+        if(pt_read_v2(cfg->v2_ptdata_file)) {
+            debug(DBG_WARN, "Couldn't read v2 ItemPT data!\n");
+        }
+    }
+
+    return 0;
+}
+
+static int load_gc_pt(sylverant_ship_t *cfg) {
+    if(cfg->gc_ptdata_file) {
+        debug(DBG_LOG, "Reading GC ItemPT file: %s\n", cfg->gc_ptdata_file);
+        if(pt_read_v3(cfg->gc_ptdata_file, 0)) {
+            debug(DBG_WARN, "Couldn't read GC ItemPT file!\n");
+        }
+    }
+
+    return 0;
+}
+
+/* The BB ItemPT data is needed for Blue Burst... */
+static int load_bb_pt(sylverant_ship_t *cfg) {
+    if(!cfg->bb_ptdata_file) {
+        debug(DBG_WARN, "No BB ItemPT file specified, disabling Blue Burst "
+              "support!\n");
+        return 1;
+    }
+
+    debug(DBG_LOG, "Reading BB ItemPT file: %s\n", cfg->bb_ptdata_file);
+    if(pt_read_v3(cfg->bb_ptdata_file, 1)) {
+        debug(DBG_WARN, "Couldn't read BB ItemPT data, disabling Blue "
+              "Burst support!\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static int load_v2_pmt(sylverant_ship_t *cfg) {
+    if(cfg->v2_pmtdata_file) {
+        debug(DBG_LOG, "Reading v2 ItemPMT file: %s\n", cfg->v2_pmtdata_file);
+        if(pmt_read_v2(cfg->v2_pmtdata_file,
+                       !(cfg->local_flags & SYLVERANT_SHIP_PMT_LIMITV2))) {
+            debug(DBG_WARN, "Couldn't read v2 ItemPMT file!\n");
+        }
+    }
+
+    return 0;
+}
+
+static int load_gc_pmt(sylverant_ship_t *cfg) {
+    if(cfg->gc_pmtdata_file) {
+        debug(DBG_LOG, "Reading GC ItemPMT file: %s\n", cfg->gc_pmtdata_file);
+        if(pmt_read_gc(cfg->gc_pmtdata_file,
+                       !(cfg->local_flags & SYLVERANT_SHIP_PMT_LIMITGC))) {
+            debug(DBG_WARN, "Couldn't read GC ItemPMT file!\n");
+        }
+    }
+
+    return 0;
+}
+
+static int load_bb_pmt(sylverant_ship_t *cfg) {
+    if(!cfg->bb_pmtdata_file) {
+        debug(DBG_WARN, "No BB ItemPMT file specified, disabling Blue Burst "
+              "support!\n");
+        return 1;
+    }
+
+    debug(DBG_LOG, "Reading BB ItemPMT file: %s\n", cfg->bb_pmtdata_file);
+    if(pmt_read_bb(cfg->bb_pmtdata_file,
+                   !(cfg->local_flags & SYLVERANT_SHIP_PMT_LIMITBB))) {
+        debug(DBG_WARN, "Couldn't read BB ItemPMT file!\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static int load_v2_rt(sylverant_ship_t *cfg) {
+    if(cfg->v2_rtdata_file) {
+        debug(DBG_LOG, "Reading v2 ItemRT file: %s\n", cfg->v2_rtdata_file);
+        if(rt_read_v2(cfg->v2_rtdata_file)) {
+            debug(DBG_WARN, "Couldn't read v2 ItemRT file!\n");
+        }
+    }
+
+    return 0;
+}
+
+static int load_gc_rt(sylverant_ship_t *cfg) {
+    if(cfg->gc_rtdata_file) {
+        debug(DBG_LOG, "Reading GC ItemRT file: %s\n", cfg->gc_rtdata_file);
+        if(rt_read_gc(cfg->gc_rtdata_file)) {
+            debug(DBG_WARN, "Couldn't read GC ItemRT file!\n");
+        }
+    }
+
+    return 0;
+}
+
+static int load_v2_maps(sylverant_ship_t *cfg) {
+    if(cfg->v2_map_dir && v2_read_params(cfg) < 0)
+        return -1;
+
+    return 0;
+}
+
+static int load_gc_maps(sylverant_ship_t *cfg) {
+    if(cfg->gc_map_dir && gc_read_params(cfg) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* Less than 0 = fatal error. Greater than 0 = Blue Burst problem. */
+static int load_bb_maps(sylverant_ship_t *cfg) {
+    return bb_read_params(cfg);
+}
+
+static int load_smutdata(sylverant_ship_t *cfg) {
+    if(cfg->smutdata_file) {
+        debug(DBG_LOG, "Reading smutdata file: %s\n", cfg->smutdata_file);
+        if(smutdata_read(cfg->smutdata_file)) {
+            debug(DBG_WARN, "Couldn't read smutdata file!\n");
+        }
+    }
+
+    return 0;
+}
+
+static load_task_t load_tasks[LOAD_TASK_COUNT] = {
+    { "v2 ItemPT", load_v2_pt, 0, 1 },
+    { "GC ItemPT", load_gc_pt, 0, 1 },
+    { "BB ItemPT", load_bb_pt, 0, 1 },
+    { "v2 ItemPMT", load_v2_pmt, 0, 0 },
+    { "GC ItemPMT", load_gc_pmt, 0, 0 },
+    { "BB ItemPMT", load_bb_pmt, 0, 0 },
+    { "v2 ItemRT", load_v2_rt, 0, 1 },
+    { "GC ItemRT", load_gc_rt, 0, 1 },
+    { "v2 maps", load_v2_maps, 0, 1 },
+    { "GC maps", load_gc_maps, 0, 1 },
+    { "BB parameters and maps", load_bb_maps,
+      (1 << LOAD_BB_PT) | (1 << LOAD_BB_PMT), 1 },
+    { "smutdata", load_smutdata, 0, 0 }
+};
+
+static pthread_mutex_t load_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t load_cond = PTHREAD_COND_INITIALIZER;
+
+/* Find something that's ready to be loaded. Returns NULL if there isn't
+   anything, and sets *left to how many tasks haven't finished yet. */
+static load_task_t *load_next(int *left, int *deps_failed) {
+    int i, j, ready;
+    load_task_t *t;
+
+    *left = 0;
+
+    for(i = 0; i < LOAD_TASK_COUNT; ++i) {
+        t = &load_tasks[i];
+
+        if(t->state == LOAD_DONE)
+            continue;
+
+        ++*left;
+
+        if(t->state != LOAD_WAITING)
+            continue;
+
+        ready = 1;
+        *deps_failed = 0;
+
+        for(j = 0; j < LOAD_TASK_COUNT && ready; ++j) {
+            if(!(t->deps & (1 << j)))
+                continue;
+
+            if(load_tasks[j].state != LOAD_DONE)
+                ready = 0;
+            else if(load_tasks[j].rv)
+                *deps_failed = 1;
+        }
+
+        if(ready)
+            return t;
+    }
+
+    return NULL;
+}
+
+static void *load_thd(void *d) {
+    sylverant_ship_t *cfg = (sylverant_ship_t *)d;
+    load_task_t *t;
+    uint64_t start;
+    int left, deps_failed;
+
+    pthread_mutex_lock(&load_mutex);
+
+    for(;;) {
+        if(!(t = load_next(&left, &deps_failed))) {
+            if(!left)
+                break;
+
+            pthread_cond_wait(&load_cond, &load_mutex);
+            continue;
+        }
+
+        t->state = LOAD_RUNNING;
+        pthread_mutex_unlock(&load_mutex);
+
+        /* If something this needs didn't work out, don't bother with it (the
+           failure already got reported). */
+        start = metrics_now();
+        t->rv = deps_failed ? 1 : t->load(cfg);
+        t->time = metrics_now() - start;
+
+        pthread_mutex_lock(&load_mutex);
+        t->state = LOAD_DONE;
+        pthread_cond_broadcast(&load_cond);
+    }
+
+    pthread_mutex_unlock(&load_mutex);
+    return NULL;
+}
+
+static int load_data(sylverant_ship_t *cfg) {
+    pthread_t thds[LOAD_MAX_THREADS];
+    long nthds = sysconf(_SC_NPROCESSORS_ONLN);
+    int32_t results[LOAD_TASK_COUNT];
+    uint64_t start;
+    int i, started, rv = 0;
+
+    if(nthds < 1)
+        nthds = 1;
+    else if(nthds > LOAD_MAX_THREADS)
+        nthds = LOAD_MAX_THREADS;
+
+    for(i = 0; i < LOAD_TASK_COUNT; ++i) {
+        load_tasks[i].state = LOAD_WAITING;
+        load_tasks[i].rv = 0;
+        load_tasks[i].time = 0;
+    }
+
+    start = metrics_now();
+
+    /* If there's an up to date snapshot, everything it covers is already done
+       (with whatever happened when the snapshot was made). */
+    if(snapshot_file &&
+       (snapshot = snapshot_load(snapshot_file, cfg, results,
+                                 LOAD_TASK_COUNT))) {
+        for(i = 0; i < LOAD_TASK_COUNT; ++i) {
+            if(load_tasks[i].in_snapshot) {
+                load_tasks[i].state = LOAD_DONE;
+                load_tasks[i].rv = results[i];
+            }
+        }
+    }
+
+    for(started = 0; started < nthds; ++started) {
+        if(pthread_create(&thds[started], NULL, &load_thd, cfg))
+            break;
+    }
+
+    /* If we couldn't get any threads, just do it all here. */
+    if(!started)
+        load_thd(cfg);
+
+    for(i = 0; i < started; ++i) {
+        pthread_join(thds[i], NULL);
+    }
+
+    for(i = 0; i < LOAD_TASK_COUNT; ++i) {
+        debug(DBG_LOG, "Loaded %s in %" PRIu64 "ms\n", load_tasks[i].name,
+              load_tasks[i].time / 1000);
+
+        if(load_tasks[i].rv < 0)
+            rv = -1;
+        else if(load_tasks[i].rv > 0)
+            cfg->shipgate_flags |= SHIPGATE_FLAG_NOBB;
+    }
+
+    debug(DBG_LOG, "Read all game data in %" PRIu64 "ms (%d threads)\n",
+          (metrics_now() - start) / 1000, started ? started : 1);
+
+    /* Save everything for next time, if it all went well enough. */
+    if(snapshot_file && !snapshot && !rv) {
+        for(i = 0; i < LOAD_TASK_COUNT; ++i) {
+            results[i] = load_tasks[i].rv;
+        }
+
+        snapshot_save(snapshot_file, cfg, results, LOAD_TASK_COUNT);
+    }
+
+    return rv;
+}
+
 int main(int argc, char *argv[]) {
     void *tmp;
     sylverant_ship_t *cfg;
     char *initial_path;
     long size;
-    int rv;
     pid_t op;
 
     /* Parse the command line... */
@@ -760,7 +1349,8 @@ int main(int argc, char *argv[]) {
             atexit(&cleanup_pidfile);
         }
 
-        if(daemon(1, 0)) {
+        /* If we were started by a live restart, we're already a daemon. */
+        if(handoff_fd < 0 && daemon(1, 0)) {
             debug(DBG_ERROR, "Cannot daemonize\n");
             perror("daemon");
             exit(EXIT_FAILURE);
@@ -779,6 +1369,10 @@ int main(int argc, char *argv[]) {
             exit(EXIT_FAILURE);
     }
 
+    /* Pick up the listening sockets from before a live restart. */
+    if(handoff_fd >= 0 && handoff_recv(handoff_fd))
+        debug(DBG_WARN, "Couldn't get all the sockets from the last image\n");
+
 restart:
     print_config(cfg);
 
@@ -796,115 +1390,17 @@ restart:
             exit(EXIT_FAILURE);
     }
 
-    /* Try to read the v2 ItemPT data... */
-    if(cfg->v2_ptdata_file) {
-        debug(DBG_LOG, "Reading v2 ItemPT file: %s\n", cfg->v2_ptdata_file);
-        if(pt_read_v2(cfg->v2_ptdata_file)) {
-            debug(DBG_WARN, "Couldn't read v2 ItemPT data!\n");
-        }
-    }
-
-    /* Read the v2 ItemPMT file... */
-    if(cfg->v2_pmtdata_file) {
-        debug(DBG_LOG, "Reading v2 ItemPMT file: %s\n", cfg->v2_pmtdata_file);
-        if(pmt_read_v2(cfg->v2_pmtdata_file,
-                       !(cfg->local_flags & SYLVERANT_SHIP_PMT_LIMITV2))) {
-            debug(DBG_WARN, "Couldn't read v2 ItemPMT file!\n");
-        }
-    }
-
-    /* Read the GC ItemPT file... */
-    if(cfg->gc_ptdata_file) {
-        debug(DBG_LOG, "Reading GC ItemPT file: %s\n", cfg->gc_ptdata_file);
-
-        if(pt_read_v3(cfg->gc_ptdata_file, 0)) {
-            debug(DBG_WARN, "Couldn't read GC ItemPT file!\n");
-        }
-    }
-
-    /* Read the BB ItemPT data, which is needed for Blue Burst... */
-    if(cfg->bb_ptdata_file) {
-        debug(DBG_LOG, "Reading BB ItemPT file: %s\n", cfg->bb_ptdata_file);
-
-        if(pt_read_v3(cfg->bb_ptdata_file, 1)) {
-            debug(DBG_WARN, "Couldn't read BB ItemPT data, disabling Blue "
-                  "Burst support!\n");
-            cfg->shipgate_flags |= SHIPGATE_FLAG_NOBB;
-        }
-    }
-    else {
-        debug(DBG_WARN, "No BB ItemPT file specified, disabling Blue Burst "
-              "support!\n");
-        cfg->shipgate_flags |= SHIPGATE_FLAG_NOBB;
-    }
-
-    /* Read the GC ItemPMT file... */
-    if(cfg->gc_pmtdata_file) {
-        debug(DBG_LOG, "Reading GC ItemPMT file: %s\n", cfg->gc_pmtdata_file);
-        if(pmt_read_gc(cfg->gc_pmtdata_file,
-                       !(cfg->local_flags & SYLVERANT_SHIP_PMT_LIMITGC))) {
-            debug(DBG_WARN, "Couldn't read GC ItemPMT file!\n");
-        }
-    }
-
-    /* Read the BB ItemPMT file... */
-    if(cfg->bb_pmtdata_file) {
-        debug(DBG_LOG, "Reading BB ItemPMT file: %s\n", cfg->bb_pmtdata_file);
-        if(pmt_read_bb(cfg->bb_pmtdata_file,
-                       !(cfg->local_flags & SYLVERANT_SHIP_PMT_LIMITBB))) {
-            debug(DBG_WARN, "Couldn't read BB ItemPMT file!\n");
-            cfg->shipgate_flags |= SHIPGATE_FLAG_NOBB;
-        }
-    }
-    else {
-        debug(DBG_WARN, "No BB ItemPT file specified, disabling Blue Burst "
-              "support!\n");
-        cfg->shipgate_flags |= SHIPGATE_FLAG_NOBB;
-    }
-
-    /* If we have a v2 map dir set, try to read the maps. */
-    if(cfg->v2_map_dir) {
-        rv = v2_read_params(cfg);
-
-        if(rv < 0)
-            exit(EXIT_FAILURE);
-    }
-
-    /* If we have a GC map dir set, try to read the maps. */
-    if(cfg->gc_map_dir) {
-        rv = gc_read_params(cfg);
-
-        if(rv < 0)
-            exit(EXIT_FAILURE);
-    }
-
-    /* Read the v2 ItemRT file... */
-    if(cfg->v2_rtdata_file) {
-        debug(DBG_LOG, "Reading v2 ItemRT file: %s\n", cfg->v2_rtdata_file);
-        if(rt_read_v2(cfg->v2_rtdata_file)) {
-            debug(DBG_WARN, "Couldn't read v2 ItemRT file!\n");
-        }
-    }
-
-    /* Read the GC ItemRT file... */
-    if(cfg->gc_rtdata_file) {
-        debug(DBG_LOG, "Reading GC ItemRT file: %s\n", cfg->gc_rtdata_file);
-        if(rt_read_gc(cfg->gc_rtdata_file)) {
-            debug(DBG_WARN, "Couldn't read GC ItemRT file!\n");
-        }
-    }
+    /* Initialize all the iconv contexts we'll need (the smutdata needs them
+       while it's being read in) */
+    if(init_iconv())
+        exit(EXIT_FAILURE);
 
-    /* If Blue Burst isn't disabled already, read the parameter data and map
-       data... */
-    if(!(cfg->shipgate_flags & SHIPGATE_FLAG_NOBB)) {
-        rv = bb_read_params(cfg);
+    /* Init mini18n if we have it */
+    init_i18n();
 
-        /* Less than 0 = fatal error. Greater than 0 = Blue Burst problem. */
-        if(rv > 0)
-            cfg->shipgate_flags |= SHIPGATE_FLAG_NOBB;
-        else if(rv < 0)
-            exit(EXIT_FAILURE);
-    }
+    /* Read in all of the item, map and parameter data. */
+    if(load_data(cfg))
+        exit(EXIT_FAILURE);
 
     /* Set a few other shipgate flags, if appropriate. */
 #ifdef ENABLE_LUA
@@ -919,30 +1415,25 @@ restart:
     cfg->shipgate_flags |= LOGIN_FLAG_32BIT;
 #endif
 
-    /* Initialize all the iconv contexts we'll need */
-    if(init_iconv())
-        exit(EXIT_FAILURE);
-
-    /* Init mini18n if we have it */
-    init_i18n();
-
-    /* Init the word censor. */
-    if(cfg->smutdata_file) {
-        debug(DBG_LOG, "Reading smutdata file: %s\n", cfg->smutdata_file);
-        if(smutdata_read(cfg->smutdata_file)) {
-            debug(DBG_WARN, "Couldn't read smutdata file!\n");
-        }
-    }
-
     if(!check_only) {
         /* Install signal handlers */
         install_signal_handlers();
 
+        /* Start up the thread that writes out packet and team logs. */
+        if(pktlog_init())
+            exit(EXIT_FAILURE);
+
+        if(metrics_addr && metrics_init(metrics_addr))
+            exit(EXIT_FAILURE);
+
         /* Set up the ship and start it. */
         ship = ship_server_start(cfg);
         if(ship)
             pthread_join(ship->thd, NULL);
 
+        pktlog_shutdown();
+        metrics_shutdown();
+
         /* Clean up... */
         if((tmp = pthread_getspecific(sendbuf_key))) {
             free(tmp);
@@ -964,6 +1455,7 @@ restart:
 
     if(!check_only) {
         client_shutdown();
+        lobby_pool_cleanup();
         cleanup_gnutls();
     }
 
@@ -972,8 +1464,29 @@ restart:
     v2_free_params();
     gc_free_params();
     pmt_cleanup();
+    snapshot_close(snapshot);
+    snapshot = NULL;
 
     if(restart_on_shutdown) {
+        /* For a live restart, start over with whatever binary is there now,
+           from the directory we were started in. If that doesn't work, just
+           restart in place like normal. */
+        if(handoff_enabled && initial_path) {
+            char *cwd = getcwd(NULL, 0);
+
+            if(!chdir(initial_path)) {
+                release_pidfile();
+                handoff_exec(argv);
+            }
+
+            if(cwd && chdir(cwd))
+                debug(DBG_WARN, "Cannot change directory: %s\n",
+                      strerror(errno));
+
+            free(cwd);
+            reclaim_pidfile();
+        }
+
         cfg = load_config();
         goto restart;
     }
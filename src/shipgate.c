@@ -21,7 +21,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <poll.h>
+#include <time.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -58,28 +61,63 @@ static inline ssize_t sg_send(shipgate_conn_t *c, void *buffer, size_t len) {
     return gnutls_record_send(c->session, buffer, len);
 }
 
-/* Send a raw packet away. */
+/* Send queue limits. Anything queued up gets sent in records of at most
+   SG_RECORD_SIZE bytes, so lots of small packets end up sharing a record. */
+#define SG_RECORD_SIZE      16384
+#define SG_SENDQ_MAX        (4 * 1024 * 1024)
+
+/* How long to wait, in seconds, for the send queue to go out when the
+   connection is being closed. */
+#define SG_DRAIN_TIME       10
+
+/* Queue a raw packet to be sent away by the ship's thread. */
 static int send_raw(shipgate_conn_t *c, int len, uint8_t *sendbuf, int crypt) {
-    ssize_t rv, total = 0;
+    int wake = 0, rv = 0, sz;
+    void *tmp;
 
-    /* Keep trying until the whole thing's sent. */
-    if((!crypt || c->has_key) && c->sock >= 0 && !c->sendbuf_cur) {
-        while(total < len) {
-            rv = sg_send(c, sendbuf + total, len - total);
+    pthread_mutex_lock(&c->send_mutex);
 
-            if(rv == GNUTLS_E_AGAIN || rv == GNUTLS_E_INTERRUPTED) {
-                /* Try again. */
-                continue;
-            }
-            else if(rv <= 0) {
-                return -1;
-            }
+    /* Drop anything sent while we're not connected, like we always have. */
+    if((crypt && !c->has_key) || c->sock < 0)
+        goto out;
 
-            total += rv;
+    if(c->sendbuf_cur + len > SG_SENDQ_MAX) {
+        debug(DBG_WARN, "%s: Shipgate send queue full, dropping packet\n",
+              c->ship->cfg->name);
+        rv = -1;
+        goto out;
+    }
+
+    /* Make room for it, if we need to. */
+    if(c->sendbuf_cur + len > c->sendbuf_size) {
+        sz = c->sendbuf_size ? c->sendbuf_size : SG_RECORD_SIZE;
+
+        while(sz < c->sendbuf_cur + len)
+            sz <<= 1;
+
+        if(!(tmp = realloc(c->sendbuf, sz))) {
+            perror("realloc");
+            rv = -1;
+            goto out;
         }
+
+        c->sendbuf = (unsigned char *)tmp;
+        c->sendbuf_size = sz;
     }
 
-    return 0;
+    wake = !c->sendbuf_cur;
+    memcpy(c->sendbuf + c->sendbuf_cur, sendbuf, len);
+    c->sendbuf_cur += len;
+
+out:
+    pthread_mutex_unlock(&c->send_mutex);
+
+    /* Poke the ship's thread so it starts waiting for the socket to be
+       writable. */
+    if(wake)
+        write(c->ship->pipes[1], "\xFF", 1);
+
+    return rv;
 }
 
 /* Encrypt a packet, and send it away. */
@@ -137,19 +175,27 @@ static int shipgate_conn(ship_t *s, shipgate_conn_t *rv, int reconn) {
             i = tmp;
         }
 
+        clear_menu_images();
+
         rv->has_key = 0;
+        rv->features = 0;
         rv->hdr_read = 0;
         free(rv->recvbuf);
         rv->recvbuf = NULL;
         rv->recvbuf_cur = rv->recvbuf_size = 0;
 
+        pthread_mutex_lock(&rv->send_mutex);
         free(rv->sendbuf);
         rv->sendbuf = NULL;
-        rv->sendbuf_cur = rv->sendbuf_size = 0;
+        rv->sendbuf_cur = rv->sendbuf_size = rv->sendbuf_start = 0;
+        pthread_mutex_unlock(&rv->send_mutex);
     }
     else {
         /* Clear it first. */
         memset(rv, 0, sizeof(shipgate_conn_t));
+        rv->sock = -1;
+        rv->ship = s;
+        pthread_mutex_init(&rv->send_mutex, NULL);
     }
 
     debug(DBG_LOG, "%s: Looking up shipgate (%s)...\n", s->cfg->name,
@@ -190,6 +236,8 @@ static int shipgate_conn(ship_t *s, shipgate_conn_t *rv, int reconn) {
             return -1;
         }
 
+        set_cloexec(sock);
+
         if(connect(sock, j->ai_addr, j->ai_addrlen)) {
             debug(DBG_WARN, "connect: %s\n", strerror(errno));
             close(sock);
@@ -271,6 +319,11 @@ static int shipgate_conn(ship_t *s, shipgate_conn_t *rv, int reconn) {
         return -5;
     }
 
+    /* Now that the handshake is done, don't block on the socket anymore. The
+       ship's thread only reads or writes when it knows it can. */
+    if(fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0)
+        debug(DBG_WARN, "fcntl: %s\n", strerror(errno));
+
     /* Save a few other things in the struct */
     rv->sock = sock;
     rv->ship = s;
@@ -287,9 +340,45 @@ int shipgate_reconnect(shipgate_conn_t *conn) {
     return shipgate_conn(conn->ship, conn, 1);
 }
 
+/* Write out whatever is still queued (like the character saves from everyone
+   that just got disconnected), waiting on the socket for up to SG_DRAIN_TIME
+   seconds for it all to go. */
+static void shipgate_drain(shipgate_conn_t *c) {
+    struct pollfd pfd;
+    time_t end = time(NULL) + SG_DRAIN_TIME, left;
+    int queued;
+
+    pfd.fd = c->sock;
+    pfd.events = POLLOUT;
+
+    for(;;) {
+        if(shipgate_send_pkts(c))
+            return;
+
+        pthread_mutex_lock(&c->send_mutex);
+        queued = c->sendbuf_cur;
+        pthread_mutex_unlock(&c->send_mutex);
+
+        if(!queued)
+            return;
+
+        if((left = end - time(NULL)) <= 0) {
+            debug(DBG_WARN, "Dropping %d bytes queued for the shipgate\n",
+                  queued);
+            return;
+        }
+
+        if(poll(&pfd, 1, (int)left * 1000) < 0 && errno != EINTR) {
+            debug(DBG_WARN, "poll: %s\n", strerror(errno));
+            return;
+        }
+    }
+}
+
 /* Clean up a shipgate connection. */
 void shipgate_cleanup(shipgate_conn_t *c) {
     if(c->sock > 0) {
+        shipgate_drain(c);
         gnutls_bye(c->session, GNUTLS_SHUT_RDWR);
         close(c->sock);
         gnutls_deinit(c->session);
@@ -297,48 +386,32 @@ void shipgate_cleanup(shipgate_conn_t *c) {
 
     free(c->recvbuf);
     free(c->sendbuf);
+    pthread_mutex_destroy(&c->send_mutex);
 }
 
 static int handle_dc_greply(shipgate_conn_t *conn, dc_guild_reply_pkt *pkt) {
-    int i;
     ship_t *s = conn->ship;
     block_t *b;
     ship_client_t *c;
     uint32_t dest = LE32(pkt->gc_search);
-    int done = 0, rv = 0;
-
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
+    int rv = 0;
 
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
+    if((c = ship_find_client(s, dest, &b))) {
+        pthread_mutex_lock(&c->mutex);
 
-                if(c->guildcard == dest) {
 #ifdef SYLVERANT_ENABLE_IPV6
-                    if(pkt->hdr.flags != 6) {
-                        send_guild_reply_sg(c, pkt);
-                    }
-                    else {
-                        send_guild_reply6_sg(c, (dc_guild_reply6_pkt *)pkt);
-                    }
+        if(pkt->hdr.flags != 6) {
+            send_guild_reply_sg(c, pkt);
+        }
+        else {
+            send_guild_reply6_sg(c, (dc_guild_reply6_pkt *)pkt);
+        }
 #else
-                    send_guild_reply_sg(c, pkt);
+        send_guild_reply_sg(c, pkt);
 #endif
 
-                    done = 1;
-                }
-
-                pthread_mutex_unlock(&c->mutex);
-
-                if(done) {
-                    break;
-                }
-            }
-
-            pthread_rwlock_unlock(&b->lock);
-        }
+        pthread_mutex_unlock(&c->mutex);
+        pthread_rwlock_unlock(&b->lock);
     }
 
     return rv;
@@ -456,155 +529,110 @@ static void handle_mail_autoreply(shipgate_conn_t *c, ship_client_t *s,
 }
 
 static int handle_dc_mail(shipgate_conn_t *conn, dc_simple_mail_pkt *pkt) {
-    int i;
     ship_t *s = conn->ship;
     block_t *b;
     ship_client_t *c;
     uint32_t dest = LE32(pkt->gc_dest);
     uint32_t sender = LE32(pkt->gc_sender);
-    int done = 0, rv = 0;
-
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* Make sure the user hasn't blacklisted the sender. */
-                    if(client_has_blacklisted(c, sender) ||
-                       client_has_ignored(c, sender)) {
-                        done = 1;
-                        pthread_mutex_unlock(&c->mutex);
-                        rv = 0;
-                        break;
-                    }
-
-                    /* Check if the user has an autoreply set. */
-                    if(c->autoreply_on) {
-                        handle_mail_autoreply(conn, c, sender);
-                    }
+    int rv = 0;
 
-                    /* Forward the packet there. */
-                    rv = send_simple_mail(CLIENT_VERSION_DCV1, c,
-                                          (dc_pkt_hdr_t *)pkt);
-                    done = 1;
-                }
+    if((c = ship_find_client(s, dest, &b))) {
+        pthread_mutex_lock(&c->mutex);
 
+        if(c->pl) {
+            /* Make sure the user hasn't blacklisted the sender. */
+            if(client_has_blacklisted(c, sender) ||
+               client_has_ignored(c, sender)) {
                 pthread_mutex_unlock(&c->mutex);
+                pthread_rwlock_unlock(&b->lock);
+                return 0;
+            }
 
-                if(done) {
-                    break;
-                }
+            /* Check if the user has an autoreply set. */
+            if(c->autoreply_on) {
+                handle_mail_autoreply(conn, c, sender);
             }
 
-            pthread_rwlock_unlock(&b->lock);
+            /* Forward the packet there. */
+            rv = send_simple_mail(CLIENT_VERSION_DCV1, c,
+                                  (dc_pkt_hdr_t *)pkt);
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        pthread_rwlock_unlock(&b->lock);
     }
 
     return rv;
 }
 
 static int handle_pc_mail(shipgate_conn_t *conn, pc_simple_mail_pkt *pkt) {
-    int i;
     ship_t *s = conn->ship;
     block_t *b;
     ship_client_t *c;
     uint32_t dest = LE32(pkt->gc_dest);
     uint32_t sender = LE32(pkt->gc_sender);
-    int done = 0, rv = 0;
-
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* Make sure the user hasn't blacklisted the sender. */
-                    if(client_has_blacklisted(c, sender) ||
-                       client_has_ignored(c, sender)) {
-                        done = 1;
-                        pthread_mutex_unlock(&c->mutex);
-                        rv = 0;
-                        break;
-                    }
-
-                    /* Check if the user has an autoreply set. */
-                    if(c->autoreply) {
-                        handle_mail_autoreply(conn, c, sender);
-                    }
+    int rv = 0;
 
-                    /* Forward the packet there. */
-                    rv = send_simple_mail(CLIENT_VERSION_PC, c,
-                                          (dc_pkt_hdr_t *)pkt);
-                    done = 1;
-                }
+    if((c = ship_find_client(s, dest, &b))) {
+        pthread_mutex_lock(&c->mutex);
 
+        if(c->pl) {
+            /* Make sure the user hasn't blacklisted the sender. */
+            if(client_has_blacklisted(c, sender) ||
+               client_has_ignored(c, sender)) {
                 pthread_mutex_unlock(&c->mutex);
+                pthread_rwlock_unlock(&b->lock);
+                return 0;
+            }
 
-                if(done) {
-                    break;
-                }
+            /* Check if the user has an autoreply set. */
+            if(c->autoreply) {
+                handle_mail_autoreply(conn, c, sender);
             }
 
-            pthread_rwlock_unlock(&b->lock);
+            /* Forward the packet there. */
+            rv = send_simple_mail(CLIENT_VERSION_PC, c,
+                                  (dc_pkt_hdr_t *)pkt);
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        pthread_rwlock_unlock(&b->lock);
     }
 
     return rv;
 }
 
 static int handle_bb_mail(shipgate_conn_t *conn, bb_simple_mail_pkt *pkt) {
-    int i;
     ship_t *s = conn->ship;
     block_t *b;
     ship_client_t *c;
     uint32_t dest = LE32(pkt->gc_dest);
     uint32_t sender = LE32(pkt->gc_sender);
-    int done = 0, rv = 0;
-
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* Make sure the user hasn't blacklisted the sender. */
-                    if(client_has_blacklisted(c, sender) ||
-                       client_has_ignored(c, sender)) {
-                        done = 1;
-                        pthread_mutex_unlock(&c->mutex);
-                        rv = 0;
-                        break;
-                    }
-
-                    /* Check if the user has an autoreply set. */
-                    if(c->autoreply) {
-                        handle_mail_autoreply(conn, c, sender);
-                    }
+    int rv = 0;
 
-                    /* Forward the packet there. */
-                    rv = send_bb_simple_mail(c, pkt);
-                    done = 1;
-                }
+    if((c = ship_find_client(s, dest, &b))) {
+        pthread_mutex_lock(&c->mutex);
 
+        if(c->pl) {
+            /* Make sure the user hasn't blacklisted the sender. */
+            if(client_has_blacklisted(c, sender) ||
+               client_has_ignored(c, sender)) {
                 pthread_mutex_unlock(&c->mutex);
+                pthread_rwlock_unlock(&b->lock);
+                return 0;
+            }
 
-                if(done) {
-                    break;
-                }
+            /* Check if the user has an autoreply set. */
+            if(c->autoreply) {
+                handle_mail_autoreply(conn, c, sender);
             }
 
-            pthread_rwlock_unlock(&b->lock);
+            /* Forward the packet there. */
+            rv = send_bb_simple_mail(c, pkt);
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        pthread_rwlock_unlock(&b->lock);
     }
 
     return rv;
@@ -795,6 +823,10 @@ static int handle_sstatus(shipgate_conn_t *conn, shipgate_ship_status_pkt *p) {
             if(!tmp) {
                 perror("realloc");
                 free(i);
+
+                if(ship_found)
+                    clear_menu_images();
+
                 return 0;
             }
 
@@ -837,6 +869,7 @@ static int handle_sstatus(shipgate_conn_t *conn, shipgate_ship_status_pkt *p) {
         }
     }
 
+    clear_menu_images();
     return 0;
 }
 
@@ -846,7 +879,6 @@ static int handle_creq(shipgate_conn_t *conn, shipgate_char_data_pkt *pkt) {
     block_t *b;
     ship_client_t *c;
     uint32_t dest = ntohl(pkt->guildcard);
-    int done = 0;
     uint16_t flags = ntohs(pkt->hdr.flags);
     uint16_t plen = ntohs(pkt->hdr.pkt_len);
     int clen = plen - sizeof(shipgate_char_data_pkt);
@@ -856,42 +888,34 @@ static int handle_creq(shipgate_conn_t *conn, shipgate_char_data_pkt *pkt) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest) {
-                    if(!c->bb_pl && c->pl) {
-                        /* We've found them, overwrite their data, and send the
-                           refresh packet. */
-                        memcpy(c->pl, pkt->data, clen);
-                        send_lobby_join(c, c->cur_lobby);
-                    }
-                    else if(c->bb_pl) {
-                        memcpy(c->bb_pl, pkt->data, clen);
-
-                        /* Clear the item ids from the inventory. */
-                        for(i = 0; i < 30; ++i) {
-                            c->bb_pl->inv.items[i].item_id = 0xFFFFFFFF;
-                        }
-                    }
-
-                    done = 1;
-                }
+    if((c = ship_find_client(s, dest, &b))) {
+        pthread_mutex_lock(&c->mutex);
 
-                pthread_mutex_unlock(&c->mutex);
+        if(!c->bb_pl && c->pl) {
+            /* We've found them, overwrite their data, and send the refresh
+               packet. */
+            memcpy(c->pl, pkt->data, clen);
+            clear_disp_data(c);
+            send_lobby_join(c, c->cur_lobby);
+        }
+        else if(c->bb_pl) {
+            memcpy(c->bb_pl, pkt->data, clen);
 
-                if(done) {
-                    break;
-                }
+            /* Clear the item ids from the inventory. */
+            for(i = 0; i < 30; ++i) {
+                c->bb_pl->inv.items[i].item_id = 0xFFFFFFFF;
             }
 
-            pthread_rwlock_unlock(&b->lock);
+            /* Remember what the shipgate has, so it isn't sent right back
+               unchanged (see client_save_char()). */
+            if(clen == sizeof(sylverant_bb_db_char_t)) {
+                c->save_crc = client_char_crc(c);
+                c->save_crc_valid = 1;
+            }
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        pthread_rwlock_unlock(&b->lock);
     }
 
     return 0;
@@ -949,6 +973,9 @@ static int handle_login(shipgate_conn_t *conn, shipgate_login_pkt *pkt) {
           conn->ship->cfg->name, (int)pkt->ver_major, (int)pkt->ver_minor,
           (int)pkt->ver_micro);
 
+    /* Older shipgates leave the features field zeroed out. */
+    conn->features = ntohl(pkt->features);
+
     /* Send our info to the shipgate so it can have things set up right. */
     return shipgate_send_ship_info(conn, conn->ship);
 }
@@ -972,12 +999,10 @@ static int handle_count(shipgate_conn_t *conn, shipgate_cnt_pkt *pkt) {
 }
 
 static int handle_cdata(shipgate_conn_t *conn, shipgate_cdata_err_pkt *pkt) {
-    int i;
     ship_t *s = conn->ship;
     block_t *b;
     ship_client_t *c;
     uint32_t dest = ntohl(pkt->guildcard);
-    int done = 0;
     uint16_t flags = ntohs(pkt->base.hdr.flags);
 
     /* Make sure the packet looks sane */
@@ -985,54 +1010,33 @@ static int handle_cdata(shipgate_conn_t *conn, shipgate_cdata_err_pkt *pkt) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* We've found them, figure out what to tell them. */
-                    if(flags & SHDR_FAILURE) {
-                        send_txt(c, "%s", __(c, "\tE\tC7Couldn't save "
-                                                "character data."));
-                    }
-                    else {
-                        send_txt(c, "%s", __(c, "\tE\tC7Saved character "
-                                             "data."));
-                    }
-
-                    done = 1;
-                }
-                else if(c->guildcard == dest) {
-                    /* Act like they don't exist for right now (they don't
-                       really exist right now) */
-                    done = 1;
-                }
-
-                pthread_mutex_unlock(&c->mutex);
+    if((c = ship_find_client(s, dest, &b))) {
+        pthread_mutex_lock(&c->mutex);
 
-                if(done) {
-                    break;
-                }
+        if(c->pl) {
+            /* We've found them, figure out what to tell them. */
+            if(flags & SHDR_FAILURE) {
+                send_txt(c, "%s", __(c, "\tE\tC7Couldn't save "
+                                        "character data."));
+            }
+            else {
+                send_txt(c, "%s", __(c, "\tE\tC7Saved character "
+                                     "data."));
             }
-
-            pthread_rwlock_unlock(&b->lock);
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        pthread_rwlock_unlock(&b->lock);
     }
 
     return 0;
 }
 
 static int handle_ban(shipgate_conn_t *conn, shipgate_ban_err_pkt *pkt) {
-    int i;
     ship_t *s = conn->ship;
     block_t *b;
     ship_client_t *c;
     uint32_t dest = ntohl(pkt->req_gc);
-    int done = 0;
     uint16_t flags = ntohs(pkt->base.hdr.flags);
 
     /* Make sure the packet looks sane */
@@ -1040,58 +1044,37 @@ static int handle_ban(shipgate_conn_t *conn, shipgate_ban_err_pkt *pkt) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* We've found them, figure out what to tell them. */
-                    if(flags & SHDR_FAILURE) {
-                        /* If the not gm flag is set, disconnect the user. */
-                        if(ntohl(pkt->base.error_code) == ERR_BAN_NOT_GM) {
-                            c->flags |= CLIENT_FLAG_DISCONNECTED;
-                        }
-
-                        send_txt(c, "%s", __(c, "\tE\tC7Error setting ban."));
-
-                    }
-                    else {
-                        send_txt(c, "%s", __(c, "\tE\tC7User banned."));
-                    }
+    if((c = ship_find_client(s, dest, &b))) {
+        pthread_mutex_lock(&c->mutex);
 
-                    done = 1;
-                }
-                else if(c->guildcard == dest) {
-                    /* Act like they don't exist for right now (they don't
-                       really exist right now) */
-                    done = 1;
+        if(c->pl) {
+            /* We've found them, figure out what to tell them. */
+            if(flags & SHDR_FAILURE) {
+                /* If the not gm flag is set, disconnect the user. */
+                if(ntohl(pkt->base.error_code) == ERR_BAN_NOT_GM) {
+                    client_disconnect(c);
                 }
 
-                pthread_mutex_unlock(&c->mutex);
+                send_txt(c, "%s", __(c, "\tE\tC7Error setting ban."));
 
-                if(done) {
-                    break;
-                }
             }
-
-            pthread_rwlock_unlock(&b->lock);
+            else {
+                send_txt(c, "%s", __(c, "\tE\tC7User banned."));
+            }
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        pthread_rwlock_unlock(&b->lock);
     }
 
     return 0;
 }
 
 static int handle_creq_err(shipgate_conn_t *conn, shipgate_cdata_err_pkt *pkt) {
-    int i;
     ship_t *s = conn->ship;
     block_t *b;
     ship_client_t *c;
     uint32_t dest = ntohl(pkt->guildcard);
-    int done = 0;
     uint16_t flags = ntohs(pkt->base.hdr.flags);
     uint32_t err = ntohl(pkt->base.error_code);
 
@@ -1100,42 +1083,23 @@ static int handle_creq_err(shipgate_conn_t *conn, shipgate_cdata_err_pkt *pkt) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* We've found them, figure out what to tell them. */
-                    if(err == ERR_CREQ_NO_DATA) {
-                        send_txt(c, "%s", __(c, "\tE\tC7No character data "
-                                             "found."));
-                    }
-                    else {
-                        send_txt(c, "%s", __(c, "\tE\tC7Couldn't request "
-                                             "character data."));
-                    }
-
-                    done = 1;
-                }
-                else if(c->guildcard == dest) {
-                    /* Act like they don't exist for right now (they don't
-                       really exist right now) */
-                    done = 1;
-                }
-
-                pthread_mutex_unlock(&c->mutex);
+    if((c = ship_find_client(s, dest, &b))) {
+        pthread_mutex_lock(&c->mutex);
 
-                if(done) {
-                    break;
-                }
+        if(c->pl) {
+            /* We've found them, figure out what to tell them. */
+            if(err == ERR_CREQ_NO_DATA) {
+                send_txt(c, "%s", __(c, "\tE\tC7No character data "
+                                     "found."));
+            }
+            else {
+                send_txt(c, "%s", __(c, "\tE\tC7Couldn't request "
+                                     "character data."));
             }
-
-            pthread_rwlock_unlock(&b->lock);
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        pthread_rwlock_unlock(&b->lock);
     }
 
     return 0;
@@ -1195,7 +1159,7 @@ static int handle_blogin_err(shipgate_conn_t *c, shipgate_blogin_err_pkt *pkt) {
        for now) */
     TAILQ_FOREACH(i, b->clients, qentry) {
         if(i->guildcard == gc) {
-            i->flags |= CLIENT_FLAG_DISCONNECTED;
+            client_disconnect(i);
         }
     }
 
@@ -1303,12 +1267,10 @@ static int handle_friend(shipgate_conn_t *c, shipgate_friend_login_pkt *pkt) {
 }
 
 static int handle_addfriend(shipgate_conn_t *c, shipgate_friend_err_pkt *pkt) {
-    int i;
     ship_t *s = c->ship;
     block_t *b;
     ship_client_t *cl;
     uint32_t dest = ntohl(pkt->user_gc);
-    int done = 0;
     uint16_t flags = ntohs(pkt->base.hdr.flags);
     uint32_t err = ntohl(pkt->base.error_code);
 
@@ -1317,53 +1279,32 @@ static int handle_addfriend(shipgate_conn_t *c, shipgate_friend_err_pkt *pkt) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
+    if((cl = ship_find_client(s, dest, &b))) {
+        pthread_mutex_lock(&cl->mutex);
 
-            TAILQ_FOREACH(cl, b->clients, qentry) {
-                pthread_mutex_lock(&cl->mutex);
-
-                if(cl->guildcard == dest && cl->pl) {
-                    /* We've found them, figure out what to tell them. */
-                    if(err == ERR_NO_ERROR) {
-                        send_txt(cl, "%s", __(cl, "\tE\tC7Friend added."));
-                    }
-                    else {
-                        send_txt(cl, "%s", __(cl, "\tE\tC7Couldn't add "
-                                              "friend."));
-                    }
-
-                    done = 1;
-                }
-                else if(cl->guildcard == dest) {
-                    /* Act like they don't exist for right now (they don't
-                       really exist right now) */
-                    done = 1;
-                }
-
-                pthread_mutex_unlock(&cl->mutex);
-
-                if(done) {
-                    break;
-                }
+        if(cl->pl) {
+            /* We've found them, figure out what to tell them. */
+            if(err == ERR_NO_ERROR) {
+                send_txt(cl, "%s", __(cl, "\tE\tC7Friend added."));
+            }
+            else {
+                send_txt(cl, "%s", __(cl, "\tE\tC7Couldn't add "
+                                      "friend."));
             }
-
-            pthread_rwlock_unlock(&b->lock);
         }
+
+        pthread_mutex_unlock(&cl->mutex);
+        pthread_rwlock_unlock(&b->lock);
     }
 
     return 0;
 }
 
 static int handle_delfriend(shipgate_conn_t *c, shipgate_friend_err_pkt *pkt) {
-    int i;
     ship_t *s = c->ship;
     block_t *b;
     ship_client_t *cl;
     uint32_t dest = ntohl(pkt->user_gc);
-    int done = 0;
     uint16_t flags = ntohs(pkt->base.hdr.flags);
     uint32_t err = ntohl(pkt->base.error_code);
 
@@ -1372,41 +1313,22 @@ static int handle_delfriend(shipgate_conn_t *c, shipgate_friend_err_pkt *pkt) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(cl, b->clients, qentry) {
-                pthread_mutex_lock(&cl->mutex);
-
-                if(cl->guildcard == dest && cl->pl) {
-                    /* We've found them, figure out what to tell them. */
-                    if(err == ERR_NO_ERROR) {
-                        send_txt(cl, "%s", __(cl, "\tE\tC7Friend removed."));
-                    }
-                    else {
-                        send_txt(cl, "%s", __(cl, "\tE\tC7Couldn't remove "
-                                              "friend."));
-                    }
-
-                    done = 1;
-                }
-                else if(cl->guildcard == dest) {
-                    /* Act like they don't exist for right now (they don't
-                       really exist right now) */
-                    done = 1;
-                }
-
-                pthread_mutex_unlock(&cl->mutex);
+    if((cl = ship_find_client(s, dest, &b))) {
+        pthread_mutex_lock(&cl->mutex);
 
-                if(done) {
-                    break;
-                }
+        if(cl->pl) {
+            /* We've found them, figure out what to tell them. */
+            if(err == ERR_NO_ERROR) {
+                send_txt(cl, "%s", __(cl, "\tE\tC7Friend removed."));
+            }
+            else {
+                send_txt(cl, "%s", __(cl, "\tE\tC7Couldn't remove "
+                                      "friend."));
             }
-
-            pthread_rwlock_unlock(&b->lock);
         }
+
+        pthread_mutex_unlock(&cl->mutex);
+        pthread_rwlock_unlock(&b->lock);
     }
 
     return 0;
@@ -1441,7 +1363,7 @@ static int handle_kick(shipgate_conn_t *conn, shipgate_kick_pkt *pkt) {
                                  __(i, "\tEYou have been kicked by a GM."));
             }
 
-            i->flags |= CLIENT_FLAG_DISCONNECTED;
+            client_disconnect(i);
             break;
         }
     }
@@ -1518,7 +1440,7 @@ static int handle_frlist(shipgate_conn_t *c, shipgate_friend_list_pkt *pkt) {
 
             /* Send the message to the user */
             if(send_message_box(i, "%s", msg)) {
-                i->flags |= CLIENT_FLAG_DISCONNECTED;
+                client_disconnect(i);
             }
 
             pthread_mutex_unlock(&i->mutex);
@@ -1633,11 +1555,10 @@ static int handle_useropt(shipgate_conn_t *c, shipgate_user_opt_pkt *pkt) {
                            one. It is a boolean saying whether or not to enable
                            the guildcard protection feature. */
                         if(opt->data[0]) {
-                            i->flags |= CLIENT_FLAG_GC_PROTECT;
                             send_txt(i, __(i, "\tE\tC7Guildcard is "
                                            "protected.\nYou will be kicked\n"
                                            "if you do not login."));
-                            i->join_time = time(NULL);
+                            block_start_gc_protect(i);
                         }
                         break;
 
@@ -2548,6 +2469,10 @@ int shipgate_process_pkt(shipgate_conn_t *c) {
     /* Attempt to read, and if we don't get anything, punt. */
     if((sz = sg_recv(c, recvbuf + c->recvbuf_cur,
                      65536 - c->recvbuf_cur)) <= 0) {
+        /* Not a whole record there yet, so wait for the rest of it. */
+        if(sz == GNUTLS_E_AGAIN || sz == GNUTLS_E_INTERRUPTED)
+            return 0;
+
         if(sz == -1) {
             perror("recv");
         }
@@ -2628,28 +2553,57 @@ int shipgate_process_pkt(shipgate_conn_t *c) {
 /* Send any piled up data. */
 int shipgate_send_pkts(shipgate_conn_t *c) {
     ssize_t amt;
+    int len, rv = 0;
 
     /* Don't even try if there's not a connection. */
-    if(!c->has_key || c->sock < 0) {
+    if(c->sock < 0) {
         return 0;
     }
 
-    /* Send as much as we can. */
-    amt = sg_send(c, c->sendbuf, c->sendbuf_cur);
+    pthread_mutex_lock(&c->send_mutex);
 
-    if(amt == -1) {
-        perror("send");
-        return -1;
-    }
-    else if(amt == c->sendbuf_cur) {
-        c->sendbuf_cur = 0;
-    }
-    else {
-        memmove(c->sendbuf, c->sendbuf + amt, c->sendbuf_cur - amt);
-        c->sendbuf_cur -= amt;
+    /* Send as much as we can, a record at a time. */
+    while(c->sendbuf_cur) {
+        /* If gnutls is still in the middle of a record, it wants to finish
+           that off before anything else. */
+        if(c->sendbuf_start) {
+            amt = sg_send(c, NULL, 0);
+        }
+        else {
+            len = c->sendbuf_cur < SG_RECORD_SIZE ? c->sendbuf_cur :
+                SG_RECORD_SIZE;
+            c->sendbuf_start = len;
+            amt = sg_send(c, c->sendbuf, len);
+        }
+
+        if(amt == GNUTLS_E_AGAIN || amt == GNUTLS_E_INTERRUPTED) {
+            break;
+        }
+        else if(amt < 0) {
+            debug(DBG_WARN, "gnutls_record_send: %s\n",
+                  gnutls_strerror((int)amt));
+            rv = -1;
+            break;
+        }
+
+        /* Finishing off a pending record reports how much of it went. */
+        if(!amt)
+            amt = c->sendbuf_start;
+
+        c->sendbuf_start = 0;
+
+        if(amt >= c->sendbuf_cur) {
+            c->sendbuf_cur = 0;
+        }
+        else {
+            memmove(c->sendbuf, c->sendbuf + amt, c->sendbuf_cur - amt);
+            c->sendbuf_cur -= amt;
+        }
     }
 
-    return 0;
+    pthread_mutex_unlock(&c->send_mutex);
+
+    return rv;
 }
 
 /* Packets are below here. */
@@ -3388,17 +3342,136 @@ int shipgate_send_cbkup_req(shipgate_conn_t *c, uint32_t gc, uint32_t block,
     return send_crypt(c, sizeof(shipgate_char_bkup_pkt), sendbuf);
 }
 
+/* Largest batch of monster kill updates to build up before sending it. */
+#define MKILL2_MAX_SIZE     16384
+
+static uint8_t mkill_version(ship_client_t *cl, lobby_t *l) {
+    uint8_t v = (uint8_t)cl->version;
+
+    if(l->battle)
+        v |= CLIENT_BATTLE_MODE;
+    else if(l->challenge)
+        v |= CLIENT_CHALLENGE_MODE;
+
+    if(l->qid)
+        v |= CLIENT_QUESTING;
+
+    return v;
+}
+
+static int flush_mkills_locked(shipgate_conn_t *c, block_t *b) {
+    shipgate_mkill2_pkt *pkt = (shipgate_mkill2_pkt *)b->mkill_buf;
+    int rv;
+
+    if(!b->mkill_entries)
+        return 0;
+
+    pkt->hdr.pkt_len = htons(b->mkill_len);
+    pkt->hdr.pkt_type = htons(SHDR_TYPE_MKILL2);
+    pkt->hdr.version = pkt->hdr.reserved = 0;
+    pkt->hdr.flags = 0;
+    pkt->block = htonl(b->b);
+    pkt->entries = htonl(b->mkill_entries);
+
+    rv = send_crypt(c, b->mkill_len, b->mkill_buf);
+
+    b->mkill_len = sizeof(shipgate_mkill2_pkt);
+    b->mkill_entries = 0;
+
+    return rv;
+}
+
+int shipgate_flush_mkills(shipgate_conn_t *c, block_t *b) {
+    int rv;
+
+    pthread_mutex_lock(&b->mkill_mutex);
+    rv = flush_mkills_locked(c, b);
+    pthread_mutex_unlock(&b->mkill_mutex);
+
+    return rv;
+}
+
+/* Add an update to the block's batch, only including the enemies that were
+   actually killed. The client's counts are only cleared once they're in the
+   batch, so if it can't be set up they get sent along with the next update. */
+static int queue_mkill2(shipgate_conn_t *c, uint32_t gc, ship_client_t *cl,
+                        lobby_t *l) {
+    block_t *b = cl->cur_block;
+    shipgate_mkill2_entry_t *ent;
+    int i, count = 0, len, rv = 0;
+
+    for(i = 0; i < 0x60; ++i) {
+        if(cl->enemy_kills[i])
+            ++count;
+    }
+
+    if(!count)
+        return 0;
+
+    len = sizeof(shipgate_mkill2_entry_t) + count * sizeof(ent->kills[0]);
+
+    pthread_mutex_lock(&b->mkill_mutex);
+
+    if(!b->mkill_buf) {
+        if(!(b->mkill_buf = (uint8_t *)malloc(MKILL2_MAX_SIZE))) {
+            perror("malloc");
+            pthread_mutex_unlock(&b->mkill_mutex);
+            return -1;
+        }
+
+        b->mkill_len = sizeof(shipgate_mkill2_pkt);
+        b->mkill_entries = 0;
+    }
+
+    /* Send off what we have if this one won't fit. */
+    if(b->mkill_len + len > MKILL2_MAX_SIZE)
+        rv = flush_mkills_locked(c, b);
+
+    ent = (shipgate_mkill2_entry_t *)(b->mkill_buf + b->mkill_len);
+    ent->guildcard = htonl(gc);
+    ent->episode = l->episode ? l->episode : 1;
+    ent->difficulty = l->difficulty;
+    ent->version = mkill_version(cl, l);
+    ent->count = (uint8_t)count;
+
+    for(i = 0, count = 0; i < 0x60; ++i) {
+        if(cl->enemy_kills[i]) {
+            ent->kills[count].index = (uint8_t)i;
+            memset(ent->kills[count].reserved, 0, 3);
+            ent->kills[count].kills = htonl(cl->enemy_kills[i]);
+            ++count;
+        }
+    }
+
+    b->mkill_len += len;
+    ++b->mkill_entries;
+
+    pthread_mutex_unlock(&b->mkill_mutex);
+
+    memset(cl->enemy_kills, 0, sizeof(uint32_t) * 0x60);
+
+    return rv;
+}
+
 /* Send a monster kill count update */
 int shipgate_send_mkill(shipgate_conn_t *c, uint32_t gc, uint32_t block,
                         ship_client_t *cl, lobby_t *l) {
-    uint8_t *sendbuf = get_sendbuf();
-    shipgate_mkill_pkt *pkt = (shipgate_mkill_pkt *)sendbuf;
+    uint8_t *sendbuf;
+    shipgate_mkill_pkt *pkt;
     int i;
 
+    /* Batch them up if the shipgate can deal with that. */
+    if((c->features & SHIPGATE_FEATURE_MKILL2) && cl->cur_block &&
+       cl->cur_block->b == (int)block) {
+        return queue_mkill2(c, gc, cl, l);
+    }
+
     /* Verify we got the sendbuf. */
-    if(!sendbuf)
+    if(!(sendbuf = get_sendbuf()))
         return -1;
 
+    pkt = (shipgate_mkill_pkt *)sendbuf;
+
     /* Fill in the header and the body. */
     pkt->hdr.pkt_len = htons(sizeof(shipgate_mkill_pkt));
     pkt->hdr.pkt_type = htons(SHDR_TYPE_MKILL);
@@ -3409,21 +3482,15 @@ int shipgate_send_mkill(shipgate_conn_t *c, uint32_t gc, uint32_t block,
     pkt->block = htonl(block);
     pkt->episode = l->episode ? l->episode : 1;
     pkt->difficulty = l->difficulty;
-    pkt->version = (uint8_t)cl->version;
+    pkt->version = mkill_version(cl, l);
     pkt->reserved = 0;
 
-    if(l->battle)
-        pkt->version |= CLIENT_BATTLE_MODE;
-    else if(l->challenge)
-        pkt->version |= CLIENT_CHALLENGE_MODE;
-
-    if(l->qid)
-        pkt->version |= CLIENT_QUESTING;
-
     for(i = 0; i < 0x60; ++i) {
         pkt->counts[i] = ntohl(cl->enemy_kills[i]);
     }
 
+    memset(cl->enemy_kills, 0, sizeof(uint32_t) * 0x60);
+
     /* Send it away. */
     return send_crypt(c, sizeof(shipgate_mkill_pkt), sendbuf);
 }
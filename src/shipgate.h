@@ -36,6 +36,7 @@
 struct ship;
 struct ship_client;
 struct lobby;
+struct block;
 
 #ifndef SHIP_DEFINED
 #define SHIP_DEFINED
@@ -52,6 +53,11 @@ typedef struct ship_client ship_client_t;
 typedef struct lobby lobby_t;
 #endif
 
+#ifndef BLOCK_DEFINED
+#define BLOCK_DEFINED
+typedef struct block block_t;
+#endif
+
 #ifdef PACKED
 #undef PACKED
 #endif
@@ -77,6 +83,7 @@ struct shipgate_conn {
 
     time_t login_attempt;
     ship_t *ship;
+    uint32_t features;
 
     gnutls_session_t session;
 
@@ -85,6 +92,10 @@ struct shipgate_conn {
     int recvbuf_size;
     shipgate_hdr_t pkt;
 
+    /* Everything sent to the shipgate is queued up here and written out by
+       the ship's thread when the socket is writable. sendbuf_start is the size
+       of a record that gnutls is still in the middle of sending, if any. */
+    pthread_mutex_t send_mutex;
     unsigned char *sendbuf;
     int sendbuf_cur;
     int sendbuf_size;
@@ -191,7 +202,8 @@ typedef struct shipgate_login {
     uint8_t ver_major;
     uint8_t ver_minor;
     uint8_t ver_micro;
-    uint32_t reserved[2];
+    uint32_t features;                  /* Was reserved, zero on older gates */
+    uint32_t reserved;
 } PACKED shipgate_login_pkt;
 
 /* The reply to the login request from the shipgate (with IPv6 support).
@@ -451,6 +463,30 @@ typedef struct shipgate_mkill {
     uint32_t counts[0x60];
 } PACKED shipgate_mkill_pkt;
 
+/* Packet used to send a batch of monster kill count updates for one block, if
+   the shipgate supports it (SHIPGATE_FEATURE_MKILL2). Each entry is followed
+   by its count of index/kills pairs, which only cover the enemies that the
+   player actually killed since the last update. */
+typedef struct shipgate_mkill2_entry {
+    uint32_t guildcard;
+    uint8_t episode;
+    uint8_t difficulty;
+    uint8_t version;
+    uint8_t count;
+    struct {
+        uint8_t index;
+        uint8_t reserved[3];
+        uint32_t kills;
+    } kills[0];
+} PACKED shipgate_mkill2_entry_t;
+
+typedef struct shipgate_mkill2 {
+    shipgate_hdr_t hdr;
+    uint32_t block;
+    uint32_t entries;
+    uint8_t data[0];
+} PACKED shipgate_mkill2_pkt;
+
 /* Packet used to send a script chunk to a ship. */
 typedef struct shipgate_schunk {
     shipgate_hdr_t hdr;
@@ -630,6 +666,10 @@ static const char shipgate_login_msg[] =
 #define SHDR_TYPE_SHIP_CTL  0x0030      /* Ship control packet */
 #define SHDR_TYPE_UBLOCKS   0x0031      /* User blocklist */
 #define SHDR_TYPE_UBL_ADD   0x0032      /* User blocklist add */
+#define SHDR_TYPE_MKILL2    0x0033      /* Batched monster kill update */
+
+/* Features the shipgate can say it supports in its login packet. */
+#define SHIPGATE_FEATURE_MKILL2     0x00000001
 
 /* Flags that can be set in the login packet */
 #define LOGIN_FLAG_GMONLY   0x00000001  /* Only Global GMs are allowed */
@@ -837,10 +877,15 @@ int shipgate_send_cbkup(shipgate_conn_t *c, uint32_t gc, uint32_t block,
 int shipgate_send_cbkup_req(shipgate_conn_t *c, uint32_t gc, uint32_t block,
                             const char *name);
 
-/* Send a monster kill count update */
+/* Send a monster kill count update, and clear the client's counts. If the
+   shipgate supports it, this is only queued up on the client's block, to be
+   sent along with everyone else's by shipgate_flush_mkills(). */
 int shipgate_send_mkill(shipgate_conn_t *c, uint32_t gc, uint32_t block,
                         ship_client_t *cl, lobby_t *l);
 
+/* Send the block's queued monster kill count updates. */
+int shipgate_flush_mkills(shipgate_conn_t *c, block_t *b);
+
 /* Send a script data packet */
 int shipgate_send_sdata(shipgate_conn_t *c, ship_client_t *sc, uint32_t event,
                         const uint8_t *data, uint32_t len);
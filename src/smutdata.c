@@ -20,6 +20,8 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <iconv.h>
 #include <wchar.h>
 #include <wctype.h>
@@ -31,11 +33,50 @@
 #include "smutdata.h"
 #include "utils.h"
 
-static uint32_t smutdata_west_count = 0;
-static wchar_t **smutdata_west = NULL;
-
-static uint32_t smutdata_east_count = 0;
-static wchar_t **smutdata_east = NULL;
+/* The word lists are compiled into Aho-Corasick automata when they are read in,
+   so that a string can be checked against every word in one pass over it. The
+   matching rules are encoded right in the automata:
+     - In the western list, a tab matches a tab, 'l', or '|'.
+     - A word that starts with a space also matches at the start of the string
+       without the space (the start of the string is the SMUT_BOS symbol).
+     - A word that ends with a space also matches at the end of the string
+       without the space (the end of the string is the SMUT_EOS symbol).
+   The two special symbols are outside of the range of Unicode, so that they
+   can't show up in a real string. */
+#define SMUT_BOS        ((wchar_t)0x110000)
+#define SMUT_EOS        ((wchar_t)0x110001)
+
+/* No word in the file is longer than this. */
+#define SMUT_MAX_WORD   32
+
+typedef struct smut_node {
+    wchar_t sym;                        /* Symbol on the edge to this node */
+    uint32_t child;                     /* First child (sorted by symbol) */
+    uint32_t sibling;                   /* Next child of our parent */
+    uint32_t fail;                      /* Longest proper suffix in the trie */
+    uint32_t out;                       /* Nearest word end on the fail chain */
+    int32_t word;                       /* Lowest word that ends here, or -1 */
+    uint8_t depth;
+    uint8_t bos;                        /* Path starts with SMUT_BOS */
+    uint8_t trail;                      /* Word ends with a space */
+} smut_node_t;
+
+typedef struct smut_ac {
+    smut_node_t *nodes;
+    uint32_t count;
+    uint32_t size;
+} smut_ac_t;
+
+/* The best match starting at each position of a string being censored. */
+typedef struct smut_match {
+    int32_t word;
+    uint8_t len;
+    uint8_t skip;
+    uint8_t trail;
+} smut_match_t;
+
+static smut_ac_t smutdata_west = { NULL, 0, 0 };
+static smut_ac_t smutdata_east = { NULL, 0, 0 };
 
 #define LE16_AT_OFFSET(buf, offset) \
     buf[offset] | (buf[offset + 1] << 8)
@@ -44,134 +85,224 @@ static wchar_t **smutdata_east = NULL;
     buf[offset] | (buf[offset + 1] << 8) | \
         (buf[offset + 2] << 16) | (buf[offset + 3] << 24)
 
-int smutdata_read(const char *fn) {
-    uint32_t entries1, entries2, i, j, off1, off2;
-    uint16_t wordbuf[32];
-    char convbuf[128];
-    size_t inb, outb;
-    ICONV_CONST char *inptr;
-    char *outptr;
-    int ucsz;
-    uint8_t *ucbuf;
-    mbstate_t state;
+static uint32_t ac_new_node(smut_ac_t *ac, wchar_t sym, uint8_t depth,
+                            uint8_t bos) {
+    smut_node_t *tmp;
+    uint32_t sz;
 
-    /* Read in the file and decompress it. */
-    if((ucsz = pso_prs_decompress_file(fn, &ucbuf)) < 0) {
-        debug(DBG_ERROR, "Cannot read smutdata file %s: %s\n", fn,
-              strerror(-ucsz));
-        return -1;
+    if(ac->count == ac->size) {
+        sz = ac->size ? ac->size << 1 : 256;
+
+        if(!(tmp = (smut_node_t *)realloc(ac->nodes,
+                                          sz * sizeof(smut_node_t))))
+            return 0;
+
+        ac->nodes = tmp;
+        ac->size = sz;
     }
 
-    i = LE32_AT_OFFSET(ucbuf, 0);
-    if(i != 2) {
-        debug(DBG_WARN, "Smutdata header has invalid number of entries: %d\n", (int)i);
-        free(ucbuf);
-        return -2;
+    tmp = &ac->nodes[ac->count];
+    memset(tmp, 0, sizeof(smut_node_t));
+    tmp->sym = sym;
+    tmp->word = -1;
+    tmp->depth = depth;
+    tmp->bos = bos;
+
+    return ac->count++;
+}
+
+static inline uint32_t ac_child(const smut_ac_t *ac, uint32_t n, wchar_t sym) {
+    uint32_t i;
+
+    for(i = ac->nodes[n].child; i; i = ac->nodes[i].sibling) {
+        if(ac->nodes[i].sym == sym)
+            return i;
+        else if(ac->nodes[i].sym > sym)
+            break;
     }
 
-    /* Read the number of elements in the file. */
-    entries1 = LE32_AT_OFFSET(ucbuf, 4);
-    entries2 = LE32_AT_OFFSET(ucbuf, 8);
+    return 0;
+}
 
-    /* Sanity check before we go any farther... */
-    if(((entries1 + entries2 + 3) << 2) > (uint32_t)ucsz) {
-        debug(DBG_WARN, "Smutdata file is too short reading headers!\n");
-        free(ucbuf);
-        return -3;
+/* Find or make the child of node n for the given symbol, keeping the list of
+   children sorted. */
+static uint32_t ac_add_child(smut_ac_t *ac, uint32_t n, wchar_t sym) {
+    uint32_t i, prev = 0, rv;
+
+    for(i = ac->nodes[n].child; i; prev = i, i = ac->nodes[i].sibling) {
+        if(ac->nodes[i].sym == sym)
+            return i;
+        else if(ac->nodes[i].sym > sym)
+            break;
     }
 
-    /* Allocate the arrays... */
-    if(!(smutdata_west = (wchar_t **)malloc(sizeof(wchar_t *) * entries1))) {
-        debug(DBG_WARN, "Error allocating smutdata array\n");
-        free(ucbuf);
-        return -4;
+    /* Note that this can move the nodes around, so no pointers here. */
+    if(!(rv = ac_new_node(ac, sym, ac->nodes[n].depth + 1,
+                          ac->nodes[n].bos || sym == SMUT_BOS)))
+        return 0;
+
+    ac->nodes[rv].sibling = i;
+
+    if(prev)
+        ac->nodes[prev].sibling = rv;
+    else
+        ac->nodes[n].child = rv;
+
+    return rv;
+}
+
+/* Add one form of a word to the trie, expanding out any tabs in the western
+   list into each of the characters they can match. */
+static int ac_insert(smut_ac_t *ac, uint32_t n, const wchar_t *syms, int len,
+                     int west, int32_t word, uint8_t trail) {
+    static const wchar_t tab_matches[3] = { L'\t', L'l', L'|' };
+    uint32_t c;
+    int i;
+
+    if(!len) {
+        if(ac->nodes[n].word < 0 || word < ac->nodes[n].word)
+            ac->nodes[n].word = word;
+
+        ac->nodes[n].trail = trail;
+        return 0;
     }
 
-    if(!(smutdata_east = (wchar_t **)malloc(sizeof(wchar_t *) * entries2))) {
-        debug(DBG_WARN, "Error allocating smutdata array\n");
-        free(smutdata_west);
-        free(ucbuf);
-        return -5;
+    if(west && syms[0] == L'\t') {
+        for(i = 0; i < 3; ++i) {
+            if(!(c = ac_add_child(ac, n, tab_matches[i])) ||
+               ac_insert(ac, c, syms + 1, len - 1, west, word, trail))
+                return -1;
+        }
+
+        return 0;
     }
 
-    /* Clear these just in case something goes wrong below, so we can call the
-       normal cleanup function any time after this... */
-    memset(smutdata_west, 0, sizeof(wchar_t *) * entries1);
-    memset(smutdata_east, 0, sizeof(wchar_t *) * entries2);
+    if(!(c = ac_add_child(ac, n, syms[0])))
+        return -1;
 
-    /* The last entry in each is always blank, so ignore it. */
-    smutdata_west_count = entries1 - 1;
-    smutdata_east_count = entries2 - 1;
+    return ac_insert(ac, c, syms + 1, len - 1, west, word, trail);
+}
 
-    off1 = 12;
+/* Add all of the forms of a word: as it is, without a leading space at the
+   start of the string, and without a trailing space at the end of it. */
+static int ac_add_word(smut_ac_t *ac, const wchar_t *w, int west,
+                       int32_t word) {
+    wchar_t syms[SMUT_MAX_WORD + 2];
+    int len = (int)wcslen(w), lead, trail, bos, eos, start, end, n;
 
-    /* Read each entry in */
-    for(i = 0; i < smutdata_west_count; ++i) {
-        /* Read the pointer in... */
-        off2 = LE32_AT_OFFSET(ucbuf, off1);
-        off1 = off1 + 4;
+    if(!len)
+        return 0;
 
-        /* Read each letter of the string in. */
-        for(j = 0; j < 32; ++j) {
-            if(off2 + 2 > (uint32_t)ucsz) {
-                debug(DBG_WARN, "Smutdata file is too short reading word!\n");
-                free(ucbuf);
-                smutdata_cleanup();
-                return -6;
-            }
+    lead = w[0] == L' ';
+    trail = w[len - 1] == L' ';
 
-            wordbuf[j] = LE16_AT_OFFSET(ucbuf, off2);
-            off2 += 2;
+    for(bos = 0; bos <= lead; ++bos) {
+        for(eos = 0; eos <= trail; ++eos) {
+            start = bos;
+            end = len - eos;
 
-            /* Have we reached the end of the string? */
-            if(wordbuf[j] == 0)
-                break;
-        }
+            /* There has to be something to match other than the ends. */
+            if(end <= start)
+                continue;
 
-        /* Convert the string to UTF-8 */
-        inb = (j << 1) + 2;
-        outb = 128;
-        inptr = (ICONV_CONST char *)wordbuf;
-        outptr = convbuf;
-        if(iconv(ic_utf16_to_utf8, &inptr, &inb, &outptr,
-                 &outb) == (size_t)-1) {
-            debug(DBG_WARN, "Error converting smutdata string: %s\n",
-                  strerror(errno));
-            continue;
+            n = 0;
+
+            if(bos)
+                syms[n++] = SMUT_BOS;
+
+            memcpy(syms + n, w + start, (end - start) * sizeof(wchar_t));
+            n += end - start;
+
+            if(eos)
+                syms[n++] = SMUT_EOS;
+
+            if(ac_insert(ac, 0, syms, n, west, word, (uint8_t)trail))
+                return -1;
         }
+    }
+
+    return 0;
+}
+
+/* Fill in the failure and output links, breadth first. */
+static int ac_finish(smut_ac_t *ac) {
+    uint32_t *queue, head = 0, tail = 0, u, v, f, c;
+
+    if(!(queue = (uint32_t *)malloc(ac->count * sizeof(uint32_t))))
+        return -1;
+
+    for(v = ac->nodes[0].child; v; v = ac->nodes[v].sibling) {
+        ac->nodes[v].fail = 0;
+        queue[tail++] = v;
+    }
 
-        /* Copy it over to the main array. */
-        outb = 128 - outb;
-        smutdata_west[i] = (wchar_t *)malloc(outb * sizeof(wchar_t));
-        if(!smutdata_west[i]) {
-            debug(DBG_WARN, "Error allocating smutdata string\n");
-            free(ucbuf);
-            smutdata_cleanup();
-            return -7;
+    while(head < tail) {
+        u = queue[head++];
+
+        for(v = ac->nodes[u].child; v; v = ac->nodes[v].sibling) {
+            f = ac->nodes[u].fail;
+
+            while(!(c = ac_child(ac, f, ac->nodes[v].sym)) && f)
+                f = ac->nodes[f].fail;
+
+            ac->nodes[v].fail = c;
+            queue[tail++] = v;
         }
 
-        memset(&state, 0, sizeof(mbstate_t));
-        outptr = convbuf;
-        mbsnrtowcs(smutdata_west[i], (const char **)&outptr, outb, outb,
-                   &state);
+        /* The fail link is closer to the root, so its output is done. */
+        ac->nodes[u].out = ac->nodes[u].word >= 0 ? u :
+            ac->nodes[ac->nodes[u].fail].out;
     }
 
-    /* Skip the blank entry from the end of the western list before we start
-       on the eastern one... */
-    off1 += 4;
+    free(queue);
+    return 0;
+}
+
+static void ac_free(smut_ac_t *ac) {
+    free(ac->nodes);
+    ac->nodes = NULL;
+    ac->count = ac->size = 0;
+}
+
+static inline uint32_t ac_step(const smut_ac_t *ac, uint32_t n, wchar_t sym) {
+    uint32_t c;
+
+    while(!(c = ac_child(ac, n, sym)) && n)
+        n = ac->nodes[n].fail;
 
-    for(i = 0; i < smutdata_east_count; ++i) {
+    return c;
+}
+
+/* Read one of the word lists in from the file and compile it. */
+static int read_words(const uint8_t *ucbuf, int ucsz, uint32_t *off1,
+                      uint32_t count, smut_ac_t *ac, int west) {
+    uint32_t i, j, off2;
+    uint16_t wordbuf[SMUT_MAX_WORD];
+    char convbuf[128];
+    wchar_t wbuf[SMUT_MAX_WORD + 1];
+    size_t inb, outb, wlen;
+    ICONV_CONST char *inptr;
+    char *outptr;
+    mbstate_t state;
+
+    /* Make the root node. */
+    ac_new_node(ac, 0, 0, 0);
+
+    if(!ac->count) {
+        debug(DBG_WARN, "Error allocating smutdata automaton\n");
+        return -1;
+    }
+
+    for(i = 0; i < count; ++i) {
         /* Read the pointer in... */
-        off2 = LE32_AT_OFFSET(ucbuf, off1);
-        off1 = off1 + 4;
+        off2 = LE32_AT_OFFSET(ucbuf, *off1);
+        *off1 = *off1 + 4;
 
         /* Read each letter of the string in. */
-        for(j = 0; j < 32; ++j) {
+        for(j = 0; j < SMUT_MAX_WORD; ++j) {
             if(off2 + 2 > (uint32_t)ucsz) {
                 debug(DBG_WARN, "Smutdata file is too short reading word!\n");
-                free(ucbuf);
-                smutdata_cleanup();
-                return -8;
+                return -1;
             }
 
             wordbuf[j] = LE16_AT_OFFSET(ucbuf, off2);
@@ -183,8 +314,8 @@ int smutdata_read(const char *fn) {
         }
 
         /* Convert the string to UTF-8 */
-        inb = (j << 1) + 2;
-        outb = 128;
+        inb = j << 1;
+        outb = 127;
         inptr = (ICONV_CONST char *)wordbuf;
         outptr = convbuf;
         if(iconv(ic_utf16_to_utf8, &inptr, &inb, &outptr,
@@ -194,22 +325,85 @@ int smutdata_read(const char *fn) {
             continue;
         }
 
-        /* Copy it over to the main array. */
-        outb = 128 - outb;
-        smutdata_east[i] = (wchar_t *)malloc(outb * sizeof(wchar_t));
-        if(!smutdata_east[i]) {
-            debug(DBG_WARN, "Error allocating smutdata string\n");
-            free(ucbuf);
-            smutdata_cleanup();
-            return -7;
-        }
+        *outptr = '\0';
 
+        /* ... and then to wide characters, like the strings we check. */
         memset(&state, 0, sizeof(mbstate_t));
         outptr = convbuf;
-        mbsnrtowcs(smutdata_east[i], (const char **)&outptr, outb, outb,
-                   &state);
+        wlen = mbsrtowcs(wbuf, (const char **)&outptr, SMUT_MAX_WORD, &state);
+
+        if(wlen == (size_t)-1)
+            continue;
+
+        wbuf[wlen] = L'\0';
+
+        if(ac_add_word(ac, wbuf, west, (int32_t)i)) {
+            debug(DBG_WARN, "Error allocating smutdata automaton\n");
+            return -1;
+        }
+    }
+
+    if(ac_finish(ac)) {
+        debug(DBG_WARN, "Error allocating smutdata automaton\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int smutdata_read(const char *fn) {
+    uint32_t entries1, entries2, i, off1;
+    int ucsz;
+    uint8_t *ucbuf;
+
+    /* Read in the file and decompress it. */
+    if((ucsz = pso_prs_decompress_file(fn, &ucbuf)) < 0) {
+        debug(DBG_ERROR, "Cannot read smutdata file %s: %s\n", fn,
+              strerror(-ucsz));
+        return -1;
+    }
+
+    i = LE32_AT_OFFSET(ucbuf, 0);
+    if(i != 2) {
+        debug(DBG_WARN, "Smutdata header has invalid number of entries: %d\n", (int)i);
+        free(ucbuf);
+        return -2;
+    }
+
+    /* Read the number of elements in the file. */
+    entries1 = LE32_AT_OFFSET(ucbuf, 4);
+    entries2 = LE32_AT_OFFSET(ucbuf, 8);
+
+    /* Sanity check before we go any farther... */
+    if(!entries1 || !entries2 ||
+       ((entries1 + entries2 + 3) << 2) > (uint32_t)ucsz) {
+        debug(DBG_WARN, "Smutdata file is too short reading headers!\n");
+        free(ucbuf);
+        return -3;
     }
 
+    off1 = 12;
+
+    /* The last entry in each is always blank, so ignore it. */
+    if(read_words(ucbuf, ucsz, &off1, entries1 - 1, &smutdata_west, 1)) {
+        free(ucbuf);
+        smutdata_cleanup();
+        return -6;
+    }
+
+    /* Skip the blank entry from the end of the western list before we start
+       on the eastern one... */
+    off1 += 4;
+
+    if(read_words(ucbuf, ucsz, &off1, entries2 - 1, &smutdata_east, 0)) {
+        free(ucbuf);
+        smutdata_cleanup();
+        return -8;
+    }
+
+    debug(DBG_LOG, "Smutdata automata: %" PRIu32 " western, %" PRIu32
+          " eastern states\n", smutdata_west.count, smutdata_east.count);
+
     /* Clean up... */
     free(ucbuf);
 
@@ -217,193 +411,152 @@ int smutdata_read(const char *fn) {
 }
 
 void smutdata_cleanup(void) {
-    uint32_t i;
+    ac_free(&smutdata_west);
+    ac_free(&smutdata_east);
+}
 
-    if(!smutdata_west)
-        return;
+static inline wchar_t fold(wchar_t c, int west) {
+    return west ? (wchar_t)towlower(c) : c;
+}
 
-    for(i = 0; i < smutdata_west_count; ++i) {
-        free(smutdata_west[i]);
-    }
+/* Run the UTF-8 string through an automaton, stopping at the first match. */
+static int check_ac(const smut_ac_t *ac, const char *str, int west) {
+    uint32_t n;
+    size_t clen;
+    mbstate_t state;
+    wchar_t wc;
+
+    memset(&state, 0, sizeof(mbstate_t));
 
-    free(smutdata_west);
-    smutdata_west_count = 0;
-    smutdata_west = NULL;
+    if(ac->nodes[(n = ac_step(ac, 0, SMUT_BOS))].out)
+        return 1;
 
-    for(i = 0; i < smutdata_east_count; ++i) {
-        free(smutdata_east[i]);
+    while(*str) {
+        clen = mbrtowc(&wc, str, MB_LEN_MAX, &state);
+
+        /* Treat anything that doesn't decode as the end of the string. */
+        if(clen == (size_t)-1 || clen == (size_t)-2 || !clen)
+            break;
+
+        str += clen;
+
+        if(ac->nodes[(n = ac_step(ac, n, fold(wc, west)))].out)
+            return 1;
     }
 
-    free(smutdata_east);
-    smutdata_east_count = 0;
-    smutdata_east = NULL;
+    return !!ac->nodes[ac_step(ac, n, SMUT_EOS)].out;
 }
 
 int smutdata_check_string(const char *str, int which) {
-    size_t len = strlen(str);
-    uint32_t i, k;
-    size_t j, len2;
-    int matched = 1;
-    wchar_t *real_wstr, *cmp, *wstr;
-    mbstate_t state;
-    const char *tmp;
-    wchar_t tc;
-
     /* If we don't have the censor loaded, then there's nothing to do. */
-    if(!smutdata_west)
+    if(!smutdata_west.nodes)
         return 0;
 
-    /* Sanity check... */
-    if(!(which & SMUTDATA_BOTH))
-        return 0;
+    /* Does this string start with a language marker? If so, ignore it. */
+    if(str[0] == '\t' && (str[1] == 'J' || str[1] == 'E'))
+        str += 2;
 
-    /* Convert the input string to a string of wchar_t. */
-    if(!(real_wstr = (wchar_t *)malloc((len + 1) * sizeof(wchar_t))))
-        return 0;
+    if((which & SMUTDATA_WEST) && check_ac(&smutdata_west, str, 1))
+        return 1;
 
-    memset(&state, 0, sizeof(mbstate_t));
-    tmp = str;
-    mbsrtowcs(real_wstr, &tmp, len + 1, &state);
+    if((which & SMUTDATA_EAST) && check_ac(&smutdata_east, str, 0))
+        return 1;
 
-    /* Does this string start with a language marker? If so, ignore it. */
-    if(len >= 2 && real_wstr[0] == L'\t' &&
-       (real_wstr[1] == L'J' || real_wstr[1] == L'E')) {
-        len -= 2;
-        wstr = real_wstr + 2;
+    return 0;
+}
+
+static const char censor_str[] = "#!@%";
+
+/* Record every word that ends after symbol e (-1 for SMUT_BOS) by where it
+   starts, keeping the one that comes first in the list for each start. */
+static void record_matches(const smut_ac_t *ac, uint32_t n, long e,
+                           smut_match_t *m) {
+    const smut_node_t *t;
+    long s;
+
+    for(n = ac->nodes[n].out; n; n = ac->nodes[ac->nodes[n].fail].out) {
+        t = &ac->nodes[n];
+        s = e - t->depth + 1 + t->bos;
+
+        if(m[s].word < 0 || t->word < m[s].word) {
+            m[s].word = t->word;
+            m[s].len = t->depth - t->bos;
+            m[s].skip = t->bos;
+            m[s].trail = t->trail;
+        }
     }
-    else {
-        wstr = real_wstr;
+}
+
+static void censor_ac(const smut_ac_t *ac, wchar_t *wstr, size_t len,
+                      smut_match_t *m, int west) {
+    uint32_t n;
+    size_t j, k;
+
+    for(j = 0; j <= len; ++j) {
+        m[j].word = -1;
     }
 
+    /* Find the matches on the string as it is now. Censoring something never
+       changes any of the string after it, so the matches found after each
+       censored word are still what we'd find if we looked again. */
+    n = ac_step(ac, 0, SMUT_BOS);
+    record_matches(ac, n, -1, m);
 
-    /* Check the western language list. */
-    if((which & SMUTDATA_WEST)) {
-        for(j = 0; j < len; ++j) {
-            for(i = 0; i < smutdata_west_count; ++i) {
-                len2 = wcslen(smutdata_west[i]);
-                cmp = smutdata_west[i];
-                matched = 1;
-
-                /* If we're at the beginning of the string and the word we're
-                   checking starts with a space, ignore it. */
-                if(j == 0 && cmp[0] == L' ') {
-                    ++cmp;
-                    --len2;
-                }
-
-                for(k = 0; k < len - j && k < len2; ++k) {
-                    /* Check if we have a match. Note that a tab character
-                       matches 'l' and '|'. */
-                    tc = towlower(wstr[j + k]);
-                    if(cmp[k] != tc) {
-                        if(cmp[k] != L'\t' || (tc != L'l' && tc != L'|')) {
-                            matched = 0;
-                            break;
-                        }
-                    }
-                }
-
-                /* If we appear to have something matched right now, check if
-                   it is only set because we ran out of stuff to compare or if
-                   there's actually a match. */
-                if(matched && !wstr[j + k]) {
-                    /* We're at the end of the string... Did we have a real
-                       match (or one sans an ending space at most)? */
-                    if(len2 > k) {
-                        if(cmp[k] != L' ')
-                            matched = 0;
-
-                        if(len2 != k + 1)
-                            matched = 0;
-                    }
-                }
-
-                /* If we've still got a match, then return that we matched
-                   something... */
-                if(matched) {
-                    free(real_wstr);
-                    return 1;
-                }
-            }
-        }
+    for(j = 0; j < len; ++j) {
+        n = ac_step(ac, n, fold(wstr[j], west));
+        record_matches(ac, n, (long)j, m);
     }
 
-    /* Check the eastern language list. */
-    if((which & SMUTDATA_EAST)) {
-        for(j = 0; j < len; ++j) {
-            for(i = 0; i < smutdata_east_count; ++i) {
-                len2 = wcslen(smutdata_east[i]);
-                cmp = smutdata_east[i];
-                matched = 1;
-
-                /* If we're at the beginning of the string and the word we're
-                   checking starts with a space, ignore it. */
-                if(j == 0 && cmp[0] == L' ') {
-                    ++cmp;
-                    --len2;
-                }
-
-                for(k = 0; k < len - j && k < len2; ++k) {
-                    /* Check if we have a match. */
-                    if(cmp[k] != wstr[j + k]) {
-                        matched = 0;
-                        break;
-                    }
-                }
-
-                /* If we appear to have something matched right now, check if
-                   it is only set because we ran out of stuff to compare or if
-                   there's actually a match. */
-                if(matched && !wstr[j + k]) {
-                    /* We're at the end of the string... Did we have a real
-                       match (or one sans an ending space at most)? */
-                    if(len2 > k) {
-                        if(cmp[k] != L' ')
-                            matched = 0;
-
-                        if(len2 != k + 1)
-                            matched = 0;
-                    }
-                }
-
-                /* If we've still got a match, then return that we matched
-                   something... */
-                if(matched) {
-                    free(real_wstr);
-                    return 1;
-                }
+    n = ac_step(ac, n, SMUT_EOS);
+    record_matches(ac, n, (long)len, m);
+
+    /* Censor each match and move on to the next character after it. */
+    for(j = 0; j < len; ++j) {
+        if(m[j].word < 0)
+            continue;
+
+        for(k = 0; k < m[j].len; ++k) {
+            /* Don't censor spaces. */
+            if(wstr[j + k] && wstr[j + k] != L' ') {
+                wstr[j + k] = censor_str[(k + m[j].skip) & 0x03];
             }
         }
-    }
 
-    free(real_wstr);
-    return 0;
+        /* A trailing space can start the next word. */
+        if(m[j].trail && m[j].len > 1)
+            j += m[j].len - 2;
+        else
+            j += m[j].len - 1;
+    }
 }
 
-static const char censor_str[] = "#!@%";
-
 char *smutdata_censor_string(const char *str, int which) {
-    size_t len = strlen(str);
-    uint32_t i, k;
-    size_t j, len2;
-    int matched = 0, skip = 0;
-    wchar_t *wstr, *cmp, *real_wstr;
+    size_t len = strlen(str), len2;
+    wchar_t *wstr, *real_wstr;
+    smut_match_t *m;
     const wchar_t *tmp2;
     mbstate_t state;
     const char *tmp;
     char *rv;
-    wchar_t tc;
 
-    /* Convert the input string to a string of wchar_t. */
-    if(!(real_wstr = (wchar_t *)malloc((len + 1) * sizeof(wchar_t))))
+    /* Convert the input string to a string of wchar_t, with room after it for
+       the matches. The matches go first, to keep them aligned. */
+    if(!(m = (smut_match_t *)malloc((len + 1) * (sizeof(smut_match_t) +
+                                                 sizeof(wchar_t)))))
         return NULL;
 
+    real_wstr = (wchar_t *)(m + len + 1);
     memset(&state, 0, sizeof(mbstate_t));
     tmp = str;
     len = mbsrtowcs(real_wstr, &tmp, len + 1, &state);
 
+    if(len == (size_t)-1) {
+        real_wstr[0] = L'\0';
+        len = 0;
+    }
+
     /* Sanity check... */
-    if(!smutdata_west)
+    if(!smutdata_west.nodes)
         goto out;
 
     if(!(which & SMUTDATA_BOTH))
@@ -420,138 +573,12 @@ char *smutdata_censor_string(const char *str, int which) {
     }
 
     /* Check the western language list. */
-    if((which & SMUTDATA_WEST)) {
-        for(j = 0; j < len; ++j) {
-            for(i = 0; i < smutdata_west_count; ++i) {
-                len2 = wcslen(smutdata_west[i]);
-                cmp = smutdata_west[i];
-                matched = 1;
-                skip = 0;
-
-                /* If we're at the beginning of the string and the word we're
-                   checking starts with a space, ignore it. */
-                if(j == 0 && cmp[0] == L' ') {
-                    ++cmp;
-                    --len2;
-                    skip = 1;
-                }
-
-                for(k = 0; k < len - j && k < len2; ++k) {
-                    /* Check if we have a match. Note that a tab character
-                       matches 'l' and '|'. */
-                    tc = towlower(wstr[j + k]);
-                    if(cmp[k] != tc) {
-                        if(cmp[k] != L'\t' || (tc != L'l' && tc != L'|')) {
-                            matched = 0;
-                            break;
-                        }
-                    }
-                }
-
-                /* If we appear to have something matched right now, check if
-                   it is only set because we ran out of stuff to compare or if
-                   there's actually a match. */
-                if(matched && !wstr[j + k]) {
-                    /* We're at the end of the string... Did we have a real
-                       match (or one sans an ending space at most)? */
-                    if(len2 > k) {
-                        if(cmp[k] != L' ')
-                            matched = 0;
-
-                        if(len2 != k + 1)
-                            matched = 0;
-                    }
-                }
-
-                /* If we've still got a match, then break out, so we can do the
-                   censoring...*/
-                if(matched) {
-                    break;
-                }
-            }
-
-            /* Do we have something to censor? If so, do it and move on to the
-               next character after what we censored. */
-            if(matched) {
-                for(k = 0; k < len2; ++k) {
-                    /* Don't censor spaces. */
-                    if(wstr[j + k] && wstr[j + k] != L' ') {
-                        wstr[j + k] = censor_str[(k + skip) & 0x03];
-                    }
-                }
-
-                j += len2 - 1;
-
-                if(cmp[len2 - 1] == L' ')
-                    --j;
-            }
-        }
-    }
+    if((which & SMUTDATA_WEST))
+        censor_ac(&smutdata_west, wstr, len, m, 1);
 
     /* Check the eastern language list. */
-    if((which & SMUTDATA_EAST)) {
-        for(j = 0; j < len; ++j) {
-            for(i = 0; i < smutdata_east_count; ++i) {
-                len2 = wcslen(smutdata_east[i]);
-                cmp = smutdata_east[i];
-                matched = 1;
-                skip = 0;
-
-                /* If we're at the beginning of the string and the word we're
-                   checking starts with a space, ignore it. */
-                if(j == 0 && cmp[0] == L' ') {
-                    ++cmp;
-                    --len2;
-                    skip = 1;
-                }
-
-                for(k = 0; k < len - j && k < len2; ++k) {
-                    /* Check if we have a match. */
-                    if(cmp[k] != wstr[j + k]) {
-                        matched = 0;
-                        break;
-                    }
-                }
-
-                /* If we appear to have something matched right now, check if
-                   it is only set because we ran out of stuff to compare or if
-                   there's actually a match. */
-                if(matched && !wstr[j + k]) {
-                    /* We're at the end of the string... Did we have a real
-                       match (or one sans an ending space at most)? */
-                    if(len2 > k) {
-                        if(cmp[k] != L' ')
-                            matched = 0;
-
-                        if(len2 != k + 1)
-                            matched = 0;
-                    }
-                }
-
-                /* If we've still got a match, then break out, so we can do the
-                   censoring...*/
-                if(matched) {
-                    break;
-                }
-            }
-
-            /* Do we have something to censor? If so, do it and move on to the
-               next character after what we censored. */
-            if(matched) {
-                for(k = 0; k < len2; ++k) {
-                    /* Don't censor spaces. */
-                    if(wstr[j + k] && wstr[j + k] != L' ') {
-                        wstr[j + k] = censor_str[(k + skip) & 0x03];
-                    }
-                }
-
-                j += len2 - 1;
-
-                if(cmp[len2 - 1] == L' ')
-                    --j;
-            }
-        }
-    }
+    if((which & SMUTDATA_EAST))
+        censor_ac(&smutdata_east, wstr, len, m, 0);
 
     /* Copy over the output. */
 out:
@@ -560,18 +587,18 @@ out:
     len2 = wcsrtombs(NULL, &tmp2, 0, &state);
 
     if(!(rv = (char *)malloc(len2 + 1))) {
-        free(real_wstr);
+        free(m);
         return NULL;
     }
 
     memset(&state, 0, sizeof(mbstate_t));
     tmp2 = real_wstr;
     wcsrtombs(rv, &tmp2, len2 + 1, &state);
-    free(real_wstr);
+    free(m);
 
     return rv;
 }
 
 int smutdata_enabled(void) {
-    return !!smutdata_west;
+    return !!smutdata_west.nodes;
 }
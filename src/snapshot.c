@@ -0,0 +1,401 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <sylverant/debug.h>
+#include <sylverant/checksum.h>
+
+#include "snapshot.h"
+#include "ptdata.h"
+#include "rtdata.h"
+#include "mapdata.h"
+
+/* Fill in what a source looks like right now. Anything that doesn't exist
+   just gets recorded as being empty, since that's what it was loaded as. */
+static int stat_source(snapshot_source_t *src, const char *path) {
+    struct stat st;
+    DIR *d;
+    struct dirent *ent;
+    char fn[SNAPSHOT_MAX_PATH * 2];
+
+    memset(src, 0, sizeof(snapshot_source_t));
+
+    if(!path)
+        return 0;
+
+    if(strlen(path) >= SNAPSHOT_MAX_PATH)
+        return -1;
+
+    strcpy(src->path, path);
+
+    if(stat(path, &st))
+        return 0;
+
+    if(!S_ISDIR(st.st_mode)) {
+        src->size = (uint64_t)st.st_size;
+        src->mtime = (int64_t)st.st_mtime;
+        src->files = 1;
+        return 0;
+    }
+
+    if(!(d = opendir(path)))
+        return -1;
+
+    while((ent = readdir(d))) {
+        snprintf(fn, sizeof(fn), "%s/%s", path, ent->d_name);
+
+        if(stat(fn, &st) || !S_ISREG(st.st_mode))
+            continue;
+
+        src->size += (uint64_t)st.st_size;
+        ++src->files;
+
+        if((int64_t)st.st_mtime > src->mtime)
+            src->mtime = (int64_t)st.st_mtime;
+    }
+
+    closedir(d);
+    return 0;
+}
+
+/* Everything the snapshotted data gets read from. The BB ItemPMT file isn't
+   in the snapshot, but whether the BB maps get loaded at all depends on it. */
+static int build_sources(sylverant_ship_t *cfg,
+                         snapshot_source_t src[SNAPSHOT_MAX_SOURCES],
+                         int *count) {
+    const char *paths[] = {
+        cfg->v2_ptdata_file, cfg->gc_ptdata_file, cfg->bb_ptdata_file,
+        cfg->v2_rtdata_file, cfg->gc_rtdata_file, cfg->bb_pmtdata_file,
+        cfg->v2_param_dir, cfg->v2_map_dir, cfg->gc_map_dir,
+        cfg->bb_param_dir, cfg->bb_map_dir
+    };
+    int i, n = sizeof(paths) / sizeof(paths[0]);
+
+    for(i = 0; i < n; ++i) {
+        if(stat_source(&src[i], paths[i]))
+            return -1;
+    }
+
+    *count = n;
+    return 0;
+}
+
+static void section_end(snapshot_writer_t *w) {
+    if(w->cur >= 0)
+        w->hdr.sections[w->cur].size = w->offset -
+            w->hdr.sections[w->cur].offset;
+}
+
+int snapshot_section(snapshot_writer_t *w, snapshot_section_id_t id) {
+    section_end(w);
+    w->hdr.sections[id].offset = w->offset;
+    w->cur = (int)id;
+    return 0;
+}
+
+int snapshot_write(snapshot_writer_t *w, const void *data, uint64_t len,
+                   uint64_t *off) {
+    static const uint8_t zeroes[SNAPSHOT_ALIGN] = { 0 };
+    uint64_t pad = SNAPSHOT_PAD(len) - len;
+
+    if(off)
+        *off = w->offset - w->hdr.sections[w->cur].offset;
+
+    if(len && fwrite(data, 1, (size_t)len, w->fp) != (size_t)len)
+        return -1;
+
+    if(pad && fwrite(zeroes, 1, (size_t)pad, w->fp) != (size_t)pad)
+        return -1;
+
+    w->offset += len + pad;
+    return 0;
+}
+
+int snapshot_cursor(const snapshot_t *s, snapshot_section_id_t id,
+                    snapshot_cursor_t *c) {
+    c->base = s->base + s->hdr->sections[id].offset;
+    c->size = s->hdr->sections[id].size;
+    c->pos = 0;
+    return 0;
+}
+
+const void *snapshot_read(snapshot_cursor_t *c, uint64_t len) {
+    const void *rv;
+
+    if(len > c->size - c->pos)
+        return NULL;
+
+    rv = c->base + c->pos;
+    c->pos += SNAPSHOT_PAD(len);
+
+    if(c->pos > c->size)
+        c->pos = c->size;
+
+    return rv;
+}
+
+const void *snapshot_at(const snapshot_cursor_t *c, uint64_t off,
+                        uint64_t len) {
+    if(off > c->size || len > c->size - off || off % SNAPSHOT_ALIGN)
+        return NULL;
+
+    return c->base + off;
+}
+
+static void writer_abort(snapshot_writer_t *w) {
+    if(w->fp) {
+        fclose(w->fp);
+        unlink(w->tmpfn);
+    }
+
+    free(w->tmpfn);
+    free(w->fn);
+}
+
+int snapshot_save(const char *fn, sylverant_ship_t *cfg,
+                  const int32_t *results, uint32_t count) {
+    snapshot_writer_t w;
+    snapshot_source_t src[SNAPSHOT_MAX_SOURCES];
+    int nsrc;
+    uint32_t hdr[2] = { count, 0 };
+    void *map;
+
+    if(build_sources(cfg, src, &nsrc)) {
+        debug(DBG_WARN, "Cannot look over game data files for snapshot\n");
+        return -1;
+    }
+
+    memset(&w, 0, sizeof(snapshot_writer_t));
+    w.cur = -1;
+
+    if(!(w.fn = strdup(fn)) || !(w.tmpfn = (char *)malloc(strlen(fn) + 5))) {
+        debug(DBG_WARN, "Cannot allocate memory: %s\n", strerror(errno));
+        writer_abort(&w);
+        return -1;
+    }
+
+    sprintf(w.tmpfn, "%s.tmp", fn);
+
+    if(!(w.fp = fopen(w.tmpfn, "w+b"))) {
+        debug(DBG_WARN, "Cannot open snapshot \"%s\" for writing: %s\n",
+              w.tmpfn, strerror(errno));
+        writer_abort(&w);
+        return -1;
+    }
+
+    /* Leave space for the header, it gets filled in at the end. */
+    if(snapshot_write(&w, &w.hdr, sizeof(snapshot_hdr_t), NULL))
+        goto err;
+
+    if(snapshot_section(&w, SNAPSHOT_SOURCES) ||
+       snapshot_write(&w, src, nsrc * sizeof(snapshot_source_t), NULL))
+        goto err;
+
+    if(snapshot_section(&w, SNAPSHOT_RESULTS) ||
+       snapshot_write(&w, hdr, sizeof(hdr), NULL) ||
+       snapshot_write(&w, results, count * sizeof(int32_t), NULL))
+        goto err;
+
+    if(pt_snapshot_write(&w) || rt_snapshot_write(&w) ||
+       map_snapshot_write(&w))
+        goto err;
+
+    section_end(&w);
+
+    if(fflush(w.fp))
+        goto err;
+
+    w.hdr.magic = SNAPSHOT_MAGIC;
+    w.hdr.version = SNAPSHOT_VERSION;
+    w.hdr.size = w.offset;
+
+    /* Checksum everything after the header, then go back and fill it in. */
+    map = mmap(NULL, (size_t)w.offset, PROT_READ, MAP_SHARED, fileno(w.fp), 0);
+    if(map == MAP_FAILED)
+        goto err;
+
+    w.hdr.checksum = sylverant_crc32((const uint8_t *)map +
+                                     sizeof(snapshot_hdr_t),
+                                     (int)(w.offset - sizeof(snapshot_hdr_t)));
+    munmap(map, (size_t)w.offset);
+
+    if(fseeko(w.fp, 0, SEEK_SET) ||
+       fwrite(&w.hdr, 1, sizeof(snapshot_hdr_t), w.fp) !=
+       sizeof(snapshot_hdr_t))
+        goto err;
+
+    if(fclose(w.fp)) {
+        w.fp = NULL;
+        unlink(w.tmpfn);
+        goto err;
+    }
+
+    w.fp = NULL;
+
+    if(rename(w.tmpfn, w.fn)) {
+        unlink(w.tmpfn);
+        goto err;
+    }
+
+    debug(DBG_LOG, "Wrote game data snapshot \"%s\" (%" PRIu64 " bytes)\n", fn,
+          w.offset);
+    writer_abort(&w);
+    return 0;
+
+err:
+    debug(DBG_WARN, "Error writing snapshot \"%s\": %s\n", w.tmpfn,
+          strerror(errno));
+    writer_abort(&w);
+    return -1;
+}
+
+snapshot_t *snapshot_load(const char *fn, sylverant_ship_t *cfg,
+                          int32_t *results, uint32_t count) {
+    int fd, i, nsrc;
+    struct stat st;
+    void *map;
+    const snapshot_hdr_t *hdr;
+    snapshot_source_t src[SNAPSHOT_MAX_SOURCES];
+    snapshot_cursor_t c;
+    const uint32_t *nres;
+    const void *data;
+    snapshot_t *rv;
+
+    if((fd = open(fn, O_RDONLY)) < 0) {
+        if(errno != ENOENT)
+            debug(DBG_WARN, "Cannot open snapshot \"%s\": %s\n", fn,
+                  strerror(errno));
+        return NULL;
+    }
+
+    if(fstat(fd, &st) || st.st_size < (off_t)sizeof(snapshot_hdr_t)) {
+        debug(DBG_WARN, "Invalid snapshot \"%s\"\n", fn);
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(map == MAP_FAILED) {
+        debug(DBG_WARN, "Cannot map snapshot \"%s\": %s\n", fn,
+              strerror(errno));
+        return NULL;
+    }
+
+    /* Make sure the file is one we can use, and that it's intact. */
+    hdr = (const snapshot_hdr_t *)map;
+    if(hdr->magic != SNAPSHOT_MAGIC || hdr->version != SNAPSHOT_VERSION ||
+       hdr->size != (uint64_t)st.st_size) {
+        debug(DBG_WARN, "Snapshot \"%s\" has a bad header\n", fn);
+        goto err;
+    }
+
+    for(i = 0; i < SNAPSHOT_SECTION_COUNT; ++i) {
+        if(hdr->sections[i].offset % SNAPSHOT_ALIGN ||
+           hdr->sections[i].offset > hdr->size ||
+           hdr->sections[i].size > hdr->size - hdr->sections[i].offset) {
+            debug(DBG_WARN, "Snapshot \"%s\" has a bad header\n", fn);
+            goto err;
+        }
+    }
+
+    if(sylverant_crc32((const uint8_t *)map + sizeof(snapshot_hdr_t),
+                       (int)(hdr->size - sizeof(snapshot_hdr_t))) !=
+       hdr->checksum) {
+        debug(DBG_WARN, "Snapshot \"%s\" has a bad checksum\n", fn);
+        goto err;
+    }
+
+    if(!(rv = (snapshot_t *)malloc(sizeof(snapshot_t)))) {
+        debug(DBG_WARN, "Cannot allocate snapshot: %s\n", strerror(errno));
+        goto err;
+    }
+
+    rv->base = (const uint8_t *)map;
+    rv->size = (size_t)st.st_size;
+    rv->hdr = hdr;
+
+    /* Make sure none of the files it was made from have changed since. */
+    if(build_sources(cfg, src, &nsrc)) {
+        debug(DBG_WARN, "Cannot look over game data files for snapshot\n");
+        goto err_free;
+    }
+
+    snapshot_cursor(rv, SNAPSHOT_SOURCES, &c);
+
+    if(c.size != nsrc * sizeof(snapshot_source_t) ||
+       memcmp(c.base, src, (size_t)c.size)) {
+        debug(DBG_LOG, "Snapshot \"%s\" is out of date\n", fn);
+        goto err_free;
+    }
+
+    snapshot_cursor(rv, SNAPSHOT_RESULTS, &c);
+
+    if(!(nres = snapshot_read(&c, sizeof(uint32_t) * 2)) || nres[0] != count ||
+       !(data = snapshot_read(&c, count * sizeof(int32_t))) ||
+       c.pos != c.size) {
+        debug(DBG_WARN, "Snapshot \"%s\" has a bad results section\n", fn);
+        goto err_free;
+    }
+
+    /* Check every section over before loading any of them, so that a bad one
+       doesn't leave the others half in place. The maps go first, since that's
+       the only one that can still fail (on allocation) once it's been checked,
+       and it doesn't change anything when it does. */
+    if(pt_snapshot_read(rv, 0) || rt_snapshot_read(rv, 0) ||
+       map_snapshot_read(rv, 0)) {
+        debug(DBG_WARN, "Snapshot \"%s\" doesn't match this build\n", fn);
+        goto err_free;
+    }
+
+    if(map_snapshot_read(rv, 1)) {
+        debug(DBG_WARN, "Cannot load maps from snapshot \"%s\"\n", fn);
+        goto err_free;
+    }
+
+    pt_snapshot_read(rv, 1);
+    rt_snapshot_read(rv, 1);
+
+    memcpy(results, data, count * sizeof(int32_t));
+    debug(DBG_LOG, "Loaded game data from snapshot \"%s\"\n", fn);
+    return rv;
+
+err_free:
+    free(rv);
+err:
+    munmap(map, (size_t)st.st_size);
+    return NULL;
+}
+
+void snapshot_close(snapshot_t *s) {
+    if(s) {
+        munmap((void *)s->base, s->size);
+        free(s);
+    }
+}
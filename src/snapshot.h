@@ -0,0 +1,129 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <sylverant/config.h>
+
+/* A snapshot of all of the game data that gets parsed at startup (the ItemPT
+   and ItemRT tables, the battle parameters, levelup tables and parsed maps), so
+   that later startups can just map it in rather than parsing everything again.
+   Like the quest map cache, everything is in host byte order and pointers are
+   stored as offsets. The file starts with the header, followed by each of the
+   sections (aligned to SNAPSHOT_ALIGN bytes). The sources section records the
+   size and modification time of every file the data came from, and the
+   snapshot is only used if none of them have changed. */
+#define SNAPSHOT_MAGIC          0x50414E53      /* "SNAP" */
+#define SNAPSHOT_VERSION        1
+#define SNAPSHOT_ALIGN          8
+#define SNAPSHOT_PAD(x)         (((x) + SNAPSHOT_ALIGN - 1) & \
+                                 ~((uint64_t)SNAPSHOT_ALIGN - 1))
+
+#define SNAPSHOT_MAX_SOURCES    16
+#define SNAPSHOT_MAX_PATH       256
+
+typedef enum snapshot_section_id {
+    SNAPSHOT_SOURCES = 0,
+    SNAPSHOT_RESULTS,                   /* Whatever the caller wants kept */
+    SNAPSHOT_PT,
+    SNAPSHOT_RT,
+    SNAPSHOT_PARAMS,
+    SNAPSHOT_MAP_DATA,
+    SNAPSHOT_MAP_INDEX,
+    SNAPSHOT_SECTION_COUNT
+} snapshot_section_id_t;
+
+typedef struct snapshot_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t checksum;                  /* CRC32 of everything after this */
+    uint32_t reserved;
+    uint64_t size;
+
+    struct {
+        uint64_t offset;
+        uint64_t size;
+    } sections[SNAPSHOT_SECTION_COUNT];
+} snapshot_hdr_t;
+
+/* One of the files (or directories) the data came from. For a directory, this
+   covers all of the regular files in it. */
+typedef struct snapshot_source {
+    char path[SNAPSHOT_MAX_PATH];
+    uint64_t size;
+    int64_t mtime;
+    uint32_t files;
+    uint32_t reserved;
+} snapshot_source_t;
+
+/* State used while writing out a snapshot. */
+typedef struct snapshot_writer {
+    FILE *fp;
+    char *fn;
+    char *tmpfn;
+    uint64_t offset;
+    int cur;
+    snapshot_hdr_t hdr;
+} snapshot_writer_t;
+
+typedef struct snapshot {
+    const uint8_t *base;
+    size_t size;
+    const snapshot_hdr_t *hdr;
+} snapshot_t;
+
+/* For reading through a section in the same order it was written. */
+typedef struct snapshot_cursor {
+    const uint8_t *base;
+    uint64_t size;
+    uint64_t pos;
+} snapshot_cursor_t;
+
+/* Start a section of the snapshot, and write to it. If off is not NULL, it is
+   set to where in the section the data ended up. */
+int snapshot_section(snapshot_writer_t *w, snapshot_section_id_t id);
+int snapshot_write(snapshot_writer_t *w, const void *data, uint64_t len,
+                   uint64_t *off);
+
+/* Grab a section of a snapshot that's been loaded, and read from it. These
+   return NULL if the section is too short for what's being read. */
+int snapshot_cursor(const snapshot_t *s, snapshot_section_id_t id,
+                    snapshot_cursor_t *c);
+const void *snapshot_read(snapshot_cursor_t *c, uint64_t len);
+const void *snapshot_at(const snapshot_cursor_t *c, uint64_t off,
+                        uint64_t len);
+
+/* Write a snapshot of everything that's been loaded for the given config. The
+   results array is stored as is, and handed back when the snapshot is
+   loaded. */
+int snapshot_save(const char *fn, sylverant_ship_t *cfg,
+                  const int32_t *results, uint32_t count);
+
+/* Load everything from a snapshot, if it exists and is still up to date with
+   the config and the files it was made from. Returns NULL (without having
+   loaded anything) if it can't be used. The snapshot has to be kept around
+   until the map data is freed. */
+snapshot_t *snapshot_load(const char *fn, sylverant_ship_t *cfg,
+                          int32_t *results, uint32_t count);
+void snapshot_close(snapshot_t *s);
+
+#endif /* !SNAPSHOT_H */
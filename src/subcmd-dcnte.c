@@ -26,6 +26,7 @@
 #include "clients.h"
 #include "ship_packets.h"
 #include "utils.h"
+#include "metrics.h"
 
 static int handle_set_area(ship_client_t *c, subcmd_set_area_t *pkt) {
     lobby_t *l = c->cur_lobby;
@@ -113,8 +114,13 @@ int subcmd_dcnte_handle_bcast(ship_client_t *c, subcmd_pkt_t *pkt) {
             }
             else {
                 /* XXXX: Hacky... Very hacky. FIXME sometime. */
-                c->cur_lobby->flags &= ~LOBBY_FLAG_BURSTING;
+                c->cur_lobby->flags &= ~(LOBBY_FLAG_BURSTING |
+                                         LOBBY_FLAG_STREAMING |
+                                         LOBBY_FLAG_BURST_SENT);
+                c->cur_lobby->burst_client = NULL;
                 c->flags &= ~CLIENT_FLAG_BURSTING;
+                metrics_observe(METRIC_BURST_TIME,
+                                metrics_now() - c->burst_start);
             }
             sent = 0;
             break;
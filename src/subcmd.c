@@ -34,6 +34,8 @@
 #include "scripts.h"
 #include "shipgate.h"
 #include "quest_functions.h"
+#include "metrics.h"
+#include "legit.h"
 
 /* Forward declarations */
 static int subcmd_send_shop_inv(ship_client_t *c, subcmd_bb_shop_req_t *req);
@@ -50,6 +52,24 @@ static int subcmd_send_lobby_mhit(lobby_t *l, ship_client_t *c,
                                   uint16_t enemy_id, uint16_t enemy_id2,
                                   uint16_t damage, uint32_t flags);
 
+int subcmd_move_aoi = 0;
+
+/* Send a packet on to one player in a game, or hold it for them if they're in
+   the middle of joining it. The caller must hold the lobby's mutex. */
+static int send_game_pkt_dc(lobby_t *l, ship_client_t *c, void *pkt) {
+    if(lobby_is_holding(l, c))
+        return lobby_hold_pkt_dc(l, c, (dc_pkt_hdr_t *)pkt);
+
+    return send_pkt_dc(c, (dc_pkt_hdr_t *)pkt);
+}
+
+static int send_game_pkt_bb(lobby_t *l, ship_client_t *c, void *pkt) {
+    if(lobby_is_holding(l, c))
+        return lobby_hold_pkt_bb(l, c, (bb_pkt_hdr_t *)pkt);
+
+    return send_pkt_bb(c, (bb_pkt_hdr_t *)pkt);
+}
+
 /* Handle a Guild card send packet. */
 int handle_dc_gcsend(ship_client_t *s, ship_client_t *d,
                      subcmd_dc_gcsend_t *pkt) {
@@ -994,7 +1014,7 @@ static int handle_gm_itemreq(ship_client_t *c, subcmd_itemreq_t *req) {
     /* Send the packet to every client in the lobby. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i]) {
-            send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&gen);
+            send_game_pkt_dc(l, l->clients[i], &gen);
         }
     }
 
@@ -1063,6 +1083,8 @@ static int handle_levelup(ship_client_t *c, subcmd_levelup_t *pkt) {
     c->pl->v1.dfp = pkt->dfp;
     c->pl->v1.ata = pkt->ata;
     c->pl->v1.level = pkt->level;
+    clear_disp_data(c);
+    lobby_members_update(c->cur_lobby);
 
     return subcmd_send_lobby_dc(c->cur_lobby, c, (subcmd_pkt_t *)pkt, 0);
 }
@@ -1139,7 +1161,7 @@ static int handle_take_item(ship_client_t *c, subcmd_take_item_t *pkt) {
         /* Fill in the item structure so we can check it. */
         memcpy(&item.data_l[0], &pkt->data_l[0], sizeof(uint32_t) * 5);
 
-        if(!sylverant_limits_check_item(l->limits_list, &item, v)) {
+        if(!legit_check_item(l->limits_list, &item, v)) {
             debug(DBG_LOG, "Potentially non-legit item in legit mode:\n"
                   "%08x %08x %08x %08x\n", LE32(pkt->data_l[0]),
                   LE32(pkt->data_l[1]), LE32(pkt->data_l[2]),
@@ -1196,10 +1218,10 @@ send_pkt:
         for(i = 0; i < l->max_clients; ++i) {
             if(l->clients[i] && l->clients[i] != c) {
                 if(l->clients[i]->version == c->version) {
-                    send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)pkt);
+                    send_game_pkt_dc(l, l->clients[i], pkt);
                 }
                 else {
-                    send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&tr);
+                    send_game_pkt_dc(l, l->clients[i], &tr);
                 }
             }
         }
@@ -1258,7 +1280,7 @@ static int handle_itemdrop(ship_client_t *c, subcmd_itemgen_t *pkt) {
         /* Fill in the item structure so we can check it. */
         memcpy(&item.data_l[0], &pkt->item[0], 5 * sizeof(uint32_t));
 
-        if(!sylverant_limits_check_item(l->limits_list, &item, v)) {
+        if(!legit_check_item(l->limits_list, &item, v)) {
             /* The item failed the check, deal with it. */
             debug(DBG_LOG, "Potentially non-legit item dropped in legit mode:\n"
                   "%08x %08x %08x %08x\n", LE32(pkt->item[0]),
@@ -1325,10 +1347,10 @@ static int handle_itemdrop(ship_client_t *c, subcmd_itemgen_t *pkt) {
         for(i = 0; i < l->max_clients; ++i) {
             if(l->clients[i] && l->clients[i] != c) {
                 if(l->clients[i]->version == c->version) {
-                    send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)pkt);
+                    send_game_pkt_dc(l, l->clients[i], pkt);
                 }
                 else {
-                    send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&tr);
+                    send_game_pkt_dc(l, l->clients[i], &tr);
                 }
             }
         }
@@ -1451,8 +1473,168 @@ static void update_qpos(ship_client_t *c, lobby_t *l) {
     }
 }
 
+/* Send a movement subcommand from c to everyone else in the lobby. If aoi is
+   set, then in a game this only goes to those in the same area as c. */
+static void send_lobby_move(lobby_t *l, ship_client_t *c, uint8_t *pkt,
+                            int aoi) {
+    pkt_bcast_t b;
+    ship_client_t *c2;
+    int i, bb = c->version == CLIENT_VERSION_BB;
+
+    if(bb)
+        pkt_bcast_init_bb(&b, (bb_pkt_hdr_t *)pkt);
+    else
+        pkt_bcast_init_dc(&b, (dc_pkt_hdr_t *)pkt);
+
+    for(i = 0; i < l->max_clients; ++i) {
+        c2 = l->clients[i];
+
+        if(!c2 || c2 == c)
+            continue;
+
+        if(aoi && l->type == LOBBY_TYPE_GAME && c2->cur_area != c->cur_area)
+            continue;
+
+        /* Someone who's falling behind can do without this, since the next
+           movement replaces it anyway. */
+        if(sendq_policy == SENDQ_POLICY_SHED && sendq_behind(&c2->sendq))
+            continue;
+
+        if(lobby_is_holding(l, c2)) {
+            if(bb)
+                lobby_hold_pkt_bb(l, c2, (bb_pkt_hdr_t *)pkt);
+            else
+                lobby_hold_pkt_dc(l, c2, (dc_pkt_hdr_t *)pkt);
+            continue;
+        }
+
+        if(c2->version != CLIENT_VERSION_DCV1 ||
+           !(c2->flags & CLIENT_FLAG_IS_NTE))
+            send_pkt_bcast(c2, &b);
+        else if(bb)
+            subcmd_translate_bb_to_nte(c2, (bb_subcmd_pkt_t *)pkt);
+        else
+            subcmd_translate_dc_to_nte(c2, (subcmd_pkt_t *)pkt);
+    }
+}
+
+/* Hang onto a movement subcommand until the end of this pass through the
+   block's loop, replacing whatever the client sent before it. */
+static int queue_move(ship_client_t *c, void *pkt, int len) {
+    block_t *b = c->cur_block;
+
+    if(len > (int)sizeof(c->move_pkt))
+        return -1;
+
+    pthread_mutex_lock(&b->move_mutex);
+
+    memcpy(c->move_pkt, pkt, len);
+    c->move_len = len;
+    c->move_lobby_id = c->cur_lobby->lobby_id;
+    c->move_queued = 1;
+
+    if(!c->move_pending) {
+        TAILQ_INSERT_TAIL(&b->move_list, c, move_qentry);
+        c->move_pending = 1;
+    }
+
+    pthread_mutex_unlock(&b->move_mutex);
+    return 0;
+}
+
+/* Forget about the client's last movement, since it's been put somewhere else
+   entirely. */
+static void forget_move(ship_client_t *c) {
+    block_t *b = c->cur_block;
+
+    pthread_mutex_lock(&b->move_mutex);
+    c->move_queued = 0;
+    c->move_len = 0;
+    pthread_mutex_unlock(&b->move_mutex);
+}
+
+/* Tell c where everyone else in the area it just went to last moved to, since
+   none of that was sent to it while it was somewhere else. */
+static void send_area_moves(ship_client_t *c, lobby_t *l) {
+    block_t *b = c->cur_block;
+    ship_client_t *c2;
+    uint8_t buf[sizeof(c->move_pkt)];
+    int i, len;
+
+    for(i = 0; i < l->max_clients; ++i) {
+        c2 = l->clients[i];
+
+        if(!c2 || c2 == c || c2->cur_area != c->cur_area)
+            continue;
+
+        /* If it hasn't gone out yet, it'll get here on its own. */
+        pthread_mutex_lock(&b->move_mutex);
+
+        if(c2->move_queued || c2->move_lobby_id != l->lobby_id)
+            len = 0;
+        else if((len = c2->move_len))
+            memcpy(buf, c2->move_pkt, len);
+
+        pthread_mutex_unlock(&b->move_mutex);
+
+        if(!len)
+            continue;
+
+        if(c->version == CLIENT_VERSION_BB)
+            send_pkt_bb(c, (bb_pkt_hdr_t *)buf);
+        else if(c->version == CLIENT_VERSION_DCV1 &&
+                (c->flags & CLIENT_FLAG_IS_NTE))
+            subcmd_translate_dc_to_nte(c, (subcmd_pkt_t *)buf);
+        else
+            send_pkt_dc(c, (dc_pkt_hdr_t *)buf);
+    }
+}
+
+void subcmd_flush_moves(block_t *b) {
+    ship_client_t *c;
+    lobby_t *l;
+    uint8_t buf[sizeof(c->move_pkt)];
+    uint32_t lobby_id;
+    int len;
+
+    pthread_mutex_lock(&b->move_mutex);
+
+    while((c = TAILQ_FIRST(&b->move_list))) {
+        TAILQ_REMOVE(&b->move_list, c, move_qentry);
+        c->move_pending = 0;
+
+        if(!c->move_queued) {
+            continue;
+        }
+
+        c->move_queued = 0;
+        len = c->move_len;
+        lobby_id = c->move_lobby_id;
+        memcpy(buf, c->move_pkt, len);
+        pthread_mutex_unlock(&b->move_mutex);
+
+        pthread_mutex_lock(&c->mutex);
+
+        /* Don't bother if they've gone off somewhere else since. */
+        l = c->cur_lobby;
+
+        if(l && l->lobby_id == lobby_id &&
+           !(c->flags & CLIENT_FLAG_DISCONNECTED)) {
+            pthread_mutex_lock(&l->mutex);
+            send_lobby_move(l, c, buf, 1);
+            pthread_mutex_unlock(&l->mutex);
+        }
+
+        pthread_mutex_unlock(&c->mutex);
+        pthread_mutex_lock(&b->move_mutex);
+    }
+
+    pthread_mutex_unlock(&b->move_mutex);
+}
+
 static int handle_set_area(ship_client_t *c, subcmd_set_area_t *pkt) {
     lobby_t *l = c->cur_lobby;
+    int rv;
 
     /* Make sure the area is valid */
     if(pkt->area > 17) {
@@ -1475,13 +1657,22 @@ static int handle_set_area(ship_client_t *c, subcmd_set_area_t *pkt) {
 
         if((l->flags & LOBBY_FLAG_QUESTING))
             update_qpos(c, l);
+
+        if(subcmd_move_aoi)
+            forget_move(c);
     }
 
-    return subcmd_send_lobby_dc(l, c, (subcmd_pkt_t *)pkt, 0);
+    rv = subcmd_send_lobby_dc(l, c, (subcmd_pkt_t *)pkt, 0);
+
+    if(subcmd_move_aoi && c->client_id == pkt->client_id)
+        send_area_moves(c, l);
+
+    return rv;
 }
 
 static int handle_bb_set_area(ship_client_t *c, subcmd_bb_set_area_t *pkt) {
     lobby_t *l = c->cur_lobby;
+    int rv;
 
     /* Make sure the area is valid */
     if(pkt->area > 17) {
@@ -1497,9 +1688,17 @@ static int handle_bb_set_area(ship_client_t *c, subcmd_bb_set_area_t *pkt) {
 
         if((l->flags & LOBBY_FLAG_QUESTING))
             update_qpos(c, l);
+
+        if(subcmd_move_aoi)
+            forget_move(c);
     }
 
-    return subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)pkt, 0);
+    rv = subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)pkt, 0);
+
+    if(subcmd_move_aoi && c->client_id == pkt->client_id)
+        send_area_moves(c, l);
+
+    return rv;
 }
 
 static int handle_set_pos(ship_client_t *c, subcmd_set_pos_t *pkt) {
@@ -1514,6 +1713,9 @@ static int handle_set_pos(ship_client_t *c, subcmd_set_pos_t *pkt) {
 
         if((l->flags & LOBBY_FLAG_QUESTING))
             update_qpos(c, l);
+
+        if(subcmd_move_aoi)
+            forget_move(c);
     }
 
     /* Clear this, in case we're at the lobby counter */
@@ -1532,9 +1734,14 @@ static int handle_move(ship_client_t *c, subcmd_move_t *pkt) {
 
         if((l->flags & LOBBY_FLAG_QUESTING))
             update_qpos(c, l);
+
+        if(subcmd_move_aoi &&
+           !queue_move(c, pkt, LE16(pkt->hdr.pkt_len)))
+            return 0;
     }
 
-    return subcmd_send_lobby_dc(l, c, (subcmd_pkt_t *)pkt, 0);
+    send_lobby_move(l, c, (uint8_t *)pkt, 0);
+    return 0;
 }
 
 static int handle_bb_set_pos(ship_client_t *c, subcmd_bb_set_pos_t *pkt) {
@@ -1549,6 +1756,9 @@ static int handle_bb_set_pos(ship_client_t *c, subcmd_bb_set_pos_t *pkt) {
 
         if((l->flags & LOBBY_FLAG_QUESTING))
             update_qpos(c, l);
+
+        if(subcmd_move_aoi)
+            forget_move(c);
     }
 
     return subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)pkt, 0);
@@ -1564,9 +1774,14 @@ static int handle_bb_move(ship_client_t *c, subcmd_bb_move_t *pkt) {
 
         if((l->flags & LOBBY_FLAG_QUESTING))
             update_qpos(c, l);
+
+        if(subcmd_move_aoi &&
+           !queue_move(c, pkt, LE16(pkt->hdr.pkt_len)))
+            return 0;
     }
 
-    return subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)pkt, 0);
+    send_lobby_move(l, c, (uint8_t *)pkt, 0);
+    return 0;
 }
 
 static int handle_delete_inv(ship_client_t *c, subcmd_destroy_item_t *pkt) {
@@ -1928,6 +2143,7 @@ static int handle_bb_drop_stack(ship_client_t *c,
 
         c->bb_pl->character.meseta = LE32(tmp2 - tmp);
         c->pl->bb.character.meseta = c->bb_pl->character.meseta;
+        clear_disp_data(c);
     }
 
     /* Now we have two packets to send on. First, send the one telling everyone
@@ -1986,6 +2202,7 @@ static int handle_bb_pick_up(ship_client_t *c, subcmd_bb_pick_up_t *pkt) {
 
             c->bb_pl->character.meseta = LE32(tmp);
             c->pl->bb.character.meseta = c->bb_pl->character.meseta;
+            clear_disp_data(c);
         }
         else {
             item_data.flags = 0;
@@ -2236,11 +2453,11 @@ static int handle_cmode_grave(ship_client_t *c, subcmd_pkt_t *pkt) {
         if(l->clients[i] && l->clients[i] != c) {
             switch(l->clients[i]->version) {
                 case CLIENT_VERSION_DCV2:
-                    send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&dc);
+                    send_game_pkt_dc(l, l->clients[i], &dc);
                     break;
 
                 case CLIENT_VERSION_PC:
-                    send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&pc);
+                    send_game_pkt_dc(l, l->clients[i], &pc);
                     break;
             }
         }
@@ -2284,7 +2501,7 @@ static int handle_bb_bank(ship_client_t *c, subcmd_bb_bank_open_t *req) {
     pkt->type = SUBCMD_BANK_INV;
     pkt->unused[0] = pkt->unused[1] = pkt->unused[2] = 0;
     pkt->size = LE32(size);
-    pkt->checksum = mt19937_genrand_int32(&b->rng); /* Client doesn't care */
+    pkt->checksum = mt19937_genrand_int32(block_rng(b)); /* Client ignores */
     memcpy(&pkt->item_count, &c->bb_pl->bank, sizeof(sylverant_bank_t));
 
     return crypt_send(c, (int)size, sendbuf);
@@ -2345,6 +2562,7 @@ static int handle_bb_bank_action(ship_client_t *c, subcmd_bb_bank_act_t *pkt) {
                 c->bb_pl->character.meseta = LE32((inv - amt));
                 c->pl->bb.character.meseta = c->bb_pl->character.meseta;
                 c->bb_pl->bank.meseta = LE32((bank + amt));
+                clear_disp_data(c);
 
                 /* No need to tell everyone else, I guess? */
                 return 0;
@@ -2457,6 +2675,7 @@ static int handle_bb_bank_action(ship_client_t *c, subcmd_bb_bank_act_t *pkt) {
                 c->bb_pl->character.meseta = LE32((inv + amt));
                 c->pl->bb.character.meseta = c->bb_pl->character.meseta;
                 c->bb_pl->bank.meseta = LE32((bank - amt));
+                clear_disp_data(c);
 
                 /* No need to tell everyone else... */
                 return 0;
@@ -2631,6 +2850,7 @@ static int handle_bb_medic(ship_client_t *c, bb_subcmd_pkt_t *pkt) {
     /* Subtract 10 meseta from the client. */
     c->bb_pl->character.meseta -= 10;
     c->pl->bb.character.meseta -= 10;
+    clear_disp_data(c);
 
     /* Send it along to the rest of the lobby. */
     return subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)pkt, 0);
@@ -2705,6 +2925,7 @@ static int handle_bb_sort_inv(ship_client_t *c, subcmd_bb_sort_inv_t *pkt) {
     /* We're good, so copy the inventory into the client's data. */
     memcpy(&c->bb_pl->inv, &inv, sizeof(sylverant_inventory_t));
     memcpy(&c->pl->bb.inv, &inv, sizeof(sylverant_inventory_t));
+    clear_disp_data(c);
 
     /* Nobody else really needs to care about this one... */
     return 0;
@@ -2715,7 +2936,9 @@ static int handle_bb_sort_inv(ship_client_t *c, subcmd_bb_sort_inv_t *pkt) {
 static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
     lobby_t *l = c->cur_lobby;
     uint16_t mid, mid2, dmg;
-    game_enemy_t *en;
+    game_enemy_t enbuf;
+    const game_enemy_t *en;
+    game_enemy_state_t *st;
     uint32_t flags;
 
     /* We can't get these in a lobby without someone messing with something that
@@ -2758,7 +2981,7 @@ static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
     }
 
     /* Make sure the enemy is in range. */
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
 #ifdef DEBUG
         debug(DBG_WARN, "Guild card %" PRIu32 " hit invalid enemy (%d -- max: "
               "%d)!\n"
@@ -2771,15 +2994,16 @@ static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
 #endif
 
         if(l->logfp) {
-            fdebug(l->logfp, DBG_WARN, "Guild card %" PRIu32 " hit invalid "
-                   "enemy (%d -- max: %d)!\n"
-                   "Episode: %d, Floor: %d, Map: (%d, %d)\n", c->guildcard, mid,
-                   l->map_enemies->count, l->episode, c->cur_area,
-                   l->maps[c->cur_area << 1], l->maps[(c->cur_area << 1) + 1]);
+            team_log_write(l, TLOG_BASIC, "Guild card %" PRIu32 " hit "
+                           "invalid enemy (%d -- max: %d)!\n"
+                           "Episode: %d, Floor: %d, Map: (%d, %d)\n",
+                           c->guildcard, mid, l->map_enemies->count,
+                           l->episode, c->cur_area, l->maps[c->cur_area << 1],
+                           l->maps[(c->cur_area << 1) + 1]);
 
             if((l->flags & LOBBY_FLAG_QUESTING))
-                fdebug(l->logfp, DBG_WARN, "Quest ID: %d, Version: %d\n",
-                       l->qid, l->version);
+                team_log_write(l, TLOG_BASIC, "Quest ID: %d, Version: %d\n",
+                               l->qid, l->version);
         }
 
         script_execute(ScriptActionEnemyHit, c, SCRIPT_ARG_PTR, c,
@@ -2797,27 +3021,31 @@ static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
         return -1;
     }
 
+    en = map_get_enemy(l->map_enemies, mid, &enbuf);
+    st = &l->map_enemies->state[mid];
+
     /* Make sure it looks like they're in the right area for this... */
     /* XXXX: There are some issues still with Episode 2, so only spit this out
        for now on Episode 1. */
 #ifdef DEBUG
-    if(c->cur_area != l->map_enemies->enemies[mid].area && l->episode == 1 &&
+    if(c->cur_area != en->area && l->episode == 1 &&
        !(l->flags & LOBBY_FLAG_QUESTING)) {
         debug(DBG_WARN, "Guild card %" PRIu32 " hit enemy in wrong area "
               "(%d -- max: %d)!\n Episode: %d, Area: %d, Enemy Area: %d "
               "Map: (%d, %d)\n", c->guildcard, mid, l->map_enemies->count,
-              l->episode, c->cur_area, l->map_enemies->enemies[mid].area,
+              l->episode, c->cur_area, en->area,
               l->maps[c->cur_area << 1], l->maps[(c->cur_area << 1) + 1]);
     }
 #endif
 
-    if(l->logfp && c->cur_area != l->map_enemies->enemies[mid].area &&
+    if(l->logfp && c->cur_area != en->area &&
        !(l->flags & LOBBY_FLAG_QUESTING)) {
-        fdebug(l->logfp, DBG_WARN, "Guild card %" PRIu32 " hit enemy in wrong "
-               "area (%d -- max: %d)!\n Episode: %d, Area: %d, Enemy Area: %d "
-               "Map: (%d, %d)\n", c->guildcard, mid, l->map_enemies->count,
-               l->episode, c->cur_area, l->map_enemies->enemies[mid].area,
-               l->maps[c->cur_area << 1], l->maps[(c->cur_area << 1) + 1]);
+        team_log_write(l, TLOG_BASIC, "Guild card %" PRIu32 " hit enemy in "
+                       "wrong area (%d -- max: %d)!\n Episode: %d, Area: %d, "
+                       "Enemy Area: %d Map: (%d, %d)\n", c->guildcard, mid,
+                       l->map_enemies->count, l->episode, c->cur_area,
+                       en->area, l->maps[c->cur_area << 1],
+                       l->maps[(c->cur_area << 1) + 1]);
     }
 
     /* Make sure the person's allowed to be on this floor in the first place. */
@@ -2836,25 +3064,24 @@ static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
     }
 
     /* Save the hit, assuming the enemy isn't already dead. */
-    en = &l->map_enemies->enemies[mid];
-    if(!(en->clients_hit & 0x80)) {
-        en->clients_hit |= (1 << c->client_id);
-        en->last_client = c->client_id;
+    if(!(st->clients_hit & 0x80)) {
+        st->clients_hit |= (1 << c->client_id);
+        st->last_client = c->client_id;
 
         script_execute(ScriptActionEnemyHit, c, SCRIPT_ARG_PTR, c,
                        SCRIPT_ARG_UINT16, mid, SCRIPT_ARG_UINT32, en->bp_entry,
                        SCRIPT_ARG_UINT8, en->rt_index, SCRIPT_ARG_UINT8,
-                       en->clients_hit, SCRIPT_ARG_END);
+                       st->clients_hit, SCRIPT_ARG_END);
 
         /* If the kill flag is set, mark it as dead and update the client's
            counter. */
         if(flags & 0x00000800) {
-            en->clients_hit |= 0x80;
+            st->clients_hit |= 0x80;
 
             script_execute(ScriptActionEnemyKill, c, SCRIPT_ARG_PTR, c,
                            SCRIPT_ARG_UINT16, mid, SCRIPT_ARG_UINT32,
                            en->bp_entry, SCRIPT_ARG_UINT8, en->rt_index,
-                           SCRIPT_ARG_UINT8, en->clients_hit, SCRIPT_ARG_END);
+                           SCRIPT_ARG_UINT8, st->clients_hit, SCRIPT_ARG_END);
 
             if(en->bp_entry < 0x60 && !(l->flags & LOBBY_FLAG_HAS_NPC))
                 ++c->enemy_kills[en->bp_entry];
@@ -2886,16 +3113,16 @@ static int handle_bb_mhit(ship_client_t *c, subcmd_bb_mhit_pkt_t *pkt) {
 
     /* Make sure the enemy is in range. */
     mid = LE16(pkt->enemy_id);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " hit invalid enemy (%d -- max: "
               "%d)!\n", c->guildcard, mid, l->map_enemies->count);
         return -1;
     }
 
     /* Save the hit, assuming the enemy isn't already dead. */
-    if(!(l->map_enemies->enemies[mid].clients_hit & 0x80)) {
-        l->map_enemies->enemies[mid].clients_hit |= (1 << c->client_id);
-        l->map_enemies->enemies[mid].last_client = c->client_id;
+    if(!(l->map_enemies->state[mid].clients_hit & 0x80)) {
+        l->map_enemies->state[mid].clients_hit |= (1 << c->client_id);
+        l->map_enemies->state[mid].last_client = c->client_id;
     }
 
     return subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)pkt, 0);
@@ -2910,7 +3137,7 @@ static void handle_objhit_common(ship_client_t *c, lobby_t *l, uint16_t bid) {
         bid &= 0x0FFF;
 
         /* Make sure the object is in range. */
-        if(bid > l->map_objs->count) {
+        if(bid >= l->map_objs->count) {
             debug(DBG_WARN, "Guild card %" PRIu32 " hit invalid object "
                   "(%d -- max: %d)!\n"
                   "Episode: %d, Floor: %d, Map: (%d, %d)\n", c->guildcard,
@@ -2928,11 +3155,11 @@ static void handle_objhit_common(ship_client_t *c, lobby_t *l, uint16_t bid) {
         }
 
         /* Make sure it isn't marked as hit already. */
-        if((l->map_objs->objs[bid].flags & 0x80000000))
+        if((l->map_objs->state[bid] & GAME_OBJ_HIT))
             return;
 
         /* Now, see if we care about the type of the object that was hit. */
-        obj_type = l->map_objs->objs[bid].data.skin & 0xFFFF;
+        obj_type = map_get_object(l->map_objs, bid)->data.skin & 0xFFFF;
 
         /* We'll probably want to do a bit more with this at some point, but
            for now this will do. */
@@ -2951,7 +3178,7 @@ static void handle_objhit_common(ship_client_t *c, lobby_t *l, uint16_t bid) {
         }
 
         /* Mark it as hit. */
-        l->map_objs->objs[bid].flags |= 0x80000000;
+        l->map_objs->state[bid] |= GAME_OBJ_HIT;
     }
     else if((bid & 0xF000) == 0x1000) {
         /* An enemy was hit. We don't really do anything with these here,
@@ -3167,7 +3394,9 @@ static int handle_bb_req_exp(ship_client_t *c, subcmd_bb_req_exp_pkt_t *pkt) {
     lobby_t *l = c->cur_lobby;
     uint16_t mid;
     uint32_t bp, exp;
-    game_enemy_t *en;
+    game_enemy_t enbuf;
+    const game_enemy_t *en;
+    game_enemy_state_t *st;
 
     /* We can't get these in a lobby without someone messing with something that
        they shouldn't be... Disconnect anyone that tries. */
@@ -3187,7 +3416,7 @@ static int handle_bb_req_exp(ship_client_t *c, subcmd_bb_req_exp_pkt_t *pkt) {
 
     /* Make sure the enemy is in range. */
     mid = LE16(pkt->enemy_id);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " killed invalid enemy (%d -- "
               "max: %d)!\n", c->guildcard, mid, l->map_enemies->count);
         return -1;
@@ -3195,15 +3424,16 @@ static int handle_bb_req_exp(ship_client_t *c, subcmd_bb_req_exp_pkt_t *pkt) {
 
     /* Make sure this client actually hit the enemy and that the client didn't
        already claim their experience. */
-    en = &l->map_enemies->enemies[mid];
+    en = map_get_enemy(l->map_enemies, mid, &enbuf);
+    st = &l->map_enemies->state[mid];
 
-    if(!(en->clients_hit & (1 << c->client_id))) {
+    if(!(st->clients_hit & (1 << c->client_id))) {
         return 0;
     }
 
     /* Set that the client already got their experience and that the monster is
        indeed dead. */
-    en->clients_hit = (en->clients_hit & (~(1 << c->client_id))) | 0x80;
+    st->clients_hit = (st->clients_hit & (~(1 << c->client_id))) | 0x80;
 
     /* Give the client their experience! */
     bp = en->bp_entry;
@@ -3659,10 +3889,10 @@ int handle_dragon_act(ship_client_t *c, subcmd_dragon_act_t *pkt) {
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c) {
             if(l->clients[i]->version == v) {
-                send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)pkt);
+                send_game_pkt_dc(l, l->clients[i], pkt);
             }
             else {
-                send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&tr);
+                send_game_pkt_dc(l, l->clients[i], &tr);
             }
         }
     }
@@ -3695,10 +3925,10 @@ int handle_gol_dragon_act(ship_client_t *c, subcmd_gol_dragon_act_t *pkt) {
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c) {
             if(l->clients[i]->version == v) {
-                send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)pkt);
+                send_game_pkt_dc(l, l->clients[i], pkt);
             }
             else {
-                send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&tr);
+                send_game_pkt_dc(l, l->clients[i], &tr);
             }
         }
     }
@@ -3747,6 +3977,7 @@ int subcmd_handle_one(ship_client_t *c, subcmd_pkt_t *pkt) {
 
             case SUBCMD_BURST5:
             case SUBCMD_BURST6:
+                lobby_burst_started(l, c);
                 rv |= send_pkt_dc(dest, (dc_pkt_hdr_t *)pkt);
                 break;
 
@@ -3755,13 +3986,23 @@ int subcmd_handle_one(ship_client_t *c, subcmd_pkt_t *pkt) {
                 break;
 
             default:
-                rv = lobby_enqueue_pkt(l, c, (dc_pkt_hdr_t *)pkt);
+                /* If we're streaming the join, only hold up what's going to
+                   the player that's joining. */
+                if(lobby_is_holding(l, dest) ||
+                   !(l->flags & LOBBY_FLAG_STREAMING)) {
+                    rv = lobby_enqueue_pkt(l, c, (dc_pkt_hdr_t *)pkt);
+                }
+                else {
+                    goto not_bursting;
+                }
         }
 
         pthread_mutex_unlock(&l->mutex);
         return rv;
     }
 
+not_bursting:
+
     switch(type) {
         case SUBCMD_GUILDCARD:
             /* Make sure the recipient is not ignoring the sender... */
@@ -3852,6 +4093,17 @@ int subcmd_bb_handle_one(ship_client_t *c, bb_subcmd_pkt_t *pkt) {
     }
 
     switch(type) {
+        case SUBCMD_BURST1:
+        case SUBCMD_BURST2:
+        case SUBCMD_BURST3:
+        case SUBCMD_BURST4:
+        case SUBCMD_BURST5:
+        case SUBCMD_BURST6:
+            if(lobby_is_holding(l, dest))
+                lobby_burst_started(l, c);
+            rv = send_pkt_bb(dest, (bb_pkt_hdr_t *)pkt);
+            break;
+
         case SUBCMD_GUILDCARD:
             /* Make sure the recipient is not ignoring the sender... */
             if(client_has_ignored(dest, c->guildcard)) {
@@ -3889,8 +4141,9 @@ int subcmd_bb_handle_one(ship_client_t *c, bb_subcmd_pkt_t *pkt) {
             debug(DBG_LOG, "Unknown 0x62/0x6D: 0x%02X\n", type);
             print_packet((unsigned char *)pkt, LE16(pkt->hdr.pkt_len));
 #endif /* BB_LOG_UNKNOWN_SUBS */
-            /* Forward the packet unchanged to the destination. */
-            rv = send_pkt_bb(dest, (bb_pkt_hdr_t *)pkt);
+            /* Forward the packet unchanged to the destination, holding it if
+               they're still joining. */
+            rv = send_game_pkt_bb(l, dest, pkt);
     }
 
     pthread_mutex_unlock(&l->mutex);
@@ -3903,6 +4156,8 @@ int subcmd_handle_bcast(ship_client_t *c, subcmd_pkt_t *pkt) {
     lobby_t *l = c->cur_lobby;
     int rv, sent = 1, i;
 
+    metrics_count_subcmd(0, type);
+
     /* The DC NTE must be treated specially, so deal with that elsewhere... */
     if(c->version == CLIENT_VERSION_DCV1 && (c->flags & CLIENT_FLAG_IS_NTE))
         return subcmd_dcnte_handle_bcast(c, pkt);
@@ -3934,13 +4189,20 @@ int subcmd_handle_bcast(ship_client_t *c, subcmd_pkt_t *pkt) {
                 break;
 
             default:
-                rv = lobby_enqueue_pkt(l, c, (dc_pkt_hdr_t *)pkt);
+                /* If we're streaming the join, everyone else gets the packet
+                   now, and the player joining gets it once it's done. */
+                if(!(l->flags & LOBBY_FLAG_STREAMING))
+                    rv = lobby_enqueue_pkt(l, c, (dc_pkt_hdr_t *)pkt);
+                else
+                    goto not_bursting;
         }
 
         pthread_mutex_unlock(&l->mutex);
         return rv;
     }
 
+not_bursting:
+
     switch(type) {
         case SUBCMD_TAKE_ITEM:
             rv = handle_take_item(c, (subcmd_take_item_t *)pkt);
@@ -4123,6 +4385,8 @@ int subcmd_bb_handle_bcast(ship_client_t *c, bb_subcmd_pkt_t *pkt) {
     lobby_t *l = c->cur_lobby;
     int rv, sent = 1, i;
 
+    metrics_count_subcmd(1, type);
+
     /* Ignore these if the client isn't in a lobby or team. */
     if(!l)
         return 0;
@@ -4293,7 +4557,7 @@ int subcmd_send_lobby_item(lobby_t *l, subcmd_itemreq_t *req,
     /* Send the packet to every client in the lobby. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i]) {
-            send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&gen);
+            send_game_pkt_dc(l, l->clients[i], &gen);
         }
     }
 
@@ -4330,7 +4594,7 @@ int subcmd_send_bb_lobby_item(lobby_t *l, subcmd_bb_itemreq_t *req,
     /* Send the packet to every client in the lobby. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i]) {
-            send_pkt_bb(l->clients[i], (bb_pkt_hdr_t *)&gen);
+            send_game_pkt_bb(l, l->clients[i], &gen);
         }
     }
 
@@ -4356,7 +4620,7 @@ static int subcmd_send_shop_inv(ship_client_t *c, subcmd_bb_shop_req_t *req) {
     for(i = 0; i < 0x0B; ++i) {
         shop.items[i].item_data[0] = LE32((0x03 | (i << 8)));
         shop.items[i].reserved = 0xFFFFFFFF;
-        shop.items[i].cost = LE32((mt19937_genrand_int32(&b->rng) % 255));
+        shop.items[i].cost = LE32((mt19937_genrand_int32(block_rng(b)) % 255));
     }
 
     return send_pkt_bb(c, (bb_pkt_hdr_t *)&shop);
@@ -4523,8 +4787,11 @@ int subcmd_send_bb_level(ship_client_t *c) {
 
 int subcmd_send_lobby_dc(lobby_t *l, ship_client_t *c, subcmd_pkt_t *pkt,
                          int igcheck) {
+    pkt_bcast_t b;
     int i;
 
+    pkt_bcast_init_dc(&b, (dc_pkt_hdr_t *)pkt);
+
     /* Send the packet to every connected client. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c) {
@@ -4534,9 +4801,16 @@ int subcmd_send_lobby_dc(lobby_t *l, ship_client_t *c, subcmd_pkt_t *pkt,
                 continue;
             }
 
+            /* Don't send anything to someone joining the game until they're
+               ready for it. */
+            if(lobby_is_holding(l, l->clients[i])) {
+                lobby_hold_pkt_dc(l, l->clients[i], (dc_pkt_hdr_t *)pkt);
+                continue;
+            }
+
             if(l->clients[i]->version != CLIENT_VERSION_DCV1 ||
                !(l->clients[i]->flags & CLIENT_FLAG_IS_NTE))
-                send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)pkt);
+                send_pkt_bcast(l->clients[i], &b);
             else
                 subcmd_translate_dc_to_nte(l->clients[i], pkt);
         }
@@ -4545,8 +4819,8 @@ int subcmd_send_lobby_dc(lobby_t *l, ship_client_t *c, subcmd_pkt_t *pkt,
     return 0;
 }
 
-static int send_mhit(ship_client_t *c, uint16_t enemy_id, uint16_t enemy_id2,
-                     uint16_t damage, uint32_t flags) {
+static int send_mhit(lobby_t *l, ship_client_t *c, uint16_t enemy_id,
+                     uint16_t enemy_id2, uint16_t damage, uint32_t flags) {
     subcmd_mhit_pkt_t pkt;
 
     memset(&pkt, 0, sizeof(subcmd_mhit_pkt_t));
@@ -4559,11 +4833,11 @@ static int send_mhit(ship_client_t *c, uint16_t enemy_id, uint16_t enemy_id2,
     pkt.damage = LE16(damage);
     pkt.flags = LE32(flags);
 
-    return send_pkt_dc(c, (dc_pkt_hdr_t *)&pkt);
+    return send_game_pkt_dc(l, c, &pkt);
 }
 
-static int send_mhit_gc(ship_client_t *c, uint16_t enemy_id, uint16_t enemy_id2,
-                        uint16_t damage, uint32_t flags) {
+static int send_mhit_gc(lobby_t *l, ship_client_t *c, uint16_t enemy_id,
+                        uint16_t enemy_id2, uint16_t damage, uint32_t flags) {
     subcmd_mhit_pkt_t pkt;
 
     memset(&pkt, 0, sizeof(subcmd_mhit_pkt_t));
@@ -4576,7 +4850,7 @@ static int send_mhit_gc(ship_client_t *c, uint16_t enemy_id, uint16_t enemy_id2,
     pkt.damage = LE16(damage);
     pkt.flags = LE32(SWAP32(flags));
 
-    return send_pkt_dc(c, (dc_pkt_hdr_t *)&pkt);
+    return send_game_pkt_dc(l, c, &pkt);
 }
 
 static int subcmd_send_lobby_mhit(lobby_t *l, ship_client_t *c,
@@ -4588,9 +4862,10 @@ static int subcmd_send_lobby_mhit(lobby_t *l, ship_client_t *c,
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c) {
             if(l->clients[i]->version == CLIENT_VERSION_GC)
-                send_mhit_gc(l->clients[i], enemy_id, enemy_id2, damage, flags);
+                send_mhit_gc(l, l->clients[i], enemy_id, enemy_id2, damage,
+                             flags);
             else
-                send_mhit(l->clients[i], enemy_id, enemy_id2, damage, flags);
+                send_mhit(l, l->clients[i], enemy_id, enemy_id2, damage, flags);
         }
     }
 
@@ -4599,8 +4874,11 @@ static int subcmd_send_lobby_mhit(lobby_t *l, ship_client_t *c,
 
 int subcmd_send_lobby_bb(lobby_t *l, ship_client_t *c, bb_subcmd_pkt_t *pkt,
                          int igcheck) {
+    pkt_bcast_t b;
     int i;
 
+    pkt_bcast_init_bb(&b, (bb_pkt_hdr_t *)pkt);
+
     /* Send the packet to every connected client. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c) {
@@ -4610,9 +4888,16 @@ int subcmd_send_lobby_bb(lobby_t *l, ship_client_t *c, bb_subcmd_pkt_t *pkt,
                 continue;
             }
 
+            /* Don't send anything to someone joining the game until they're
+               ready for it. */
+            if(lobby_is_holding(l, l->clients[i])) {
+                lobby_hold_pkt_bb(l, l->clients[i], (bb_pkt_hdr_t *)pkt);
+                continue;
+            }
+
             if(l->clients[i]->version != CLIENT_VERSION_DCV1 ||
                !(l->clients[i]->flags & CLIENT_FLAG_IS_NTE))
-                send_pkt_bb(l->clients[i], (bb_pkt_hdr_t *)pkt);
+                send_pkt_bcast(l->clients[i], &b);
             else
                 subcmd_translate_bb_to_nte(l->clients[i], pkt);
         }
@@ -1114,6 +1114,15 @@ int subcmd_send_lobby_bb(lobby_t *l, ship_client_t *c, bb_subcmd_pkt_t *pkt,
 int subcmd_send_lobby_dcnte(lobby_t *l, ship_client_t *c, subcmd_pkt_t *pkt,
                             int igcheck);
 
+/* Whether to hold movement subcommands back until the end of each pass through
+   the block's loop (sending only the latest one from each client), and only
+   send them to those in the same area of the game as the one moving. */
+extern int subcmd_move_aoi;
+
+/* Send out all of the movement that's been held back on the block. This must
+   be called with the client list's lock held. */
+void subcmd_flush_moves(block_t *b);
+
 /* Stuff dealing with the Dreamcast Network Trial edition */
 int subcmd_translate_dc_to_nte(ship_client_t *c, subcmd_pkt_t *pkt);
 int subcmd_translate_nte_to_dc(ship_client_t *c, subcmd_pkt_t *pkt);
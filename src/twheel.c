@@ -0,0 +1,211 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "twheel.h"
+
+/* Put a timer in the right list, based on how far out its deadline is from the
+   last tick that was processed. Must be called with the lock held. */
+static void place(twheel_t *w, twheel_timer_t *t) {
+    time_t when = t->expires;
+    struct twheel_list *l;
+
+    /* Anything that's already due goes off on the next tick. */
+    if(when <= w->now)
+        when = w->now + 1;
+
+    if(when - w->now < TWHEEL_SLOTS)
+        l = &w->level0[when & TWHEEL_MASK];
+    else if((when >> TWHEEL_BITS) - (w->now >> TWHEEL_BITS) < TWHEEL_SLOTS)
+        l = &w->level1[(when >> TWHEEL_BITS) & TWHEEL_MASK];
+    else
+        l = &w->overflow;
+
+    TAILQ_INSERT_TAIL(l, t, qentry);
+    t->list = l;
+}
+
+/* Take everything off of one list and put it back where it belongs. Must be
+   called with the lock held. */
+static void replace_list(twheel_t *w, struct twheel_list *l) {
+    struct twheel_list tmp;
+    twheel_timer_t *t;
+
+    TAILQ_INIT(&tmp);
+    TAILQ_CONCAT(&tmp, l, qentry);
+
+    while((t = TAILQ_FIRST(&tmp))) {
+        TAILQ_REMOVE(&tmp, t, qentry);
+        place(w, t);
+    }
+}
+
+/* Rebuild the whole wheel around a new time, for when the clock jumps. Must be
+   called with the lock held. */
+static void rebase(twheel_t *w, time_t now) {
+    struct twheel_list tmp;
+    twheel_timer_t *t;
+    int i;
+
+    TAILQ_INIT(&tmp);
+
+    for(i = 0; i < TWHEEL_SLOTS; ++i) {
+        TAILQ_CONCAT(&tmp, &w->level0[i], qentry);
+        TAILQ_CONCAT(&tmp, &w->level1[i], qentry);
+    }
+
+    TAILQ_CONCAT(&tmp, &w->overflow, qentry);
+    w->now = now;
+
+    while((t = TAILQ_FIRST(&tmp))) {
+        TAILQ_REMOVE(&tmp, t, qentry);
+        place(w, t);
+    }
+}
+
+int twheel_init(twheel_t *w, time_t now) {
+    int i;
+
+    if(pthread_mutex_init(&w->mutex, NULL))
+        return -1;
+
+    w->now = now;
+    w->count = 0;
+
+    for(i = 0; i < TWHEEL_SLOTS; ++i) {
+        TAILQ_INIT(&w->level0[i]);
+        TAILQ_INIT(&w->level1[i]);
+    }
+
+    TAILQ_INIT(&w->overflow);
+    return 0;
+}
+
+void twheel_destroy(twheel_t *w) {
+    pthread_mutex_destroy(&w->mutex);
+}
+
+void twheel_timer_init(twheel_timer_t *t, twheel_cb_t cb, void *data) {
+    memset(t, 0, sizeof(twheel_timer_t));
+    t->cb = cb;
+    t->data = data;
+}
+
+void twheel_add(twheel_t *w, twheel_timer_t *t, time_t expires) {
+    pthread_mutex_lock(&w->mutex);
+
+    if(t->list)
+        TAILQ_REMOVE(t->list, t, qentry);
+    else
+        ++w->count;
+
+    t->expires = expires;
+    place(w, t);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+void twheel_del(twheel_t *w, twheel_timer_t *t) {
+    pthread_mutex_lock(&w->mutex);
+
+    if(t->list) {
+        TAILQ_REMOVE(t->list, t, qentry);
+        t->list = NULL;
+        --w->count;
+    }
+
+    pthread_mutex_unlock(&w->mutex);
+}
+
+int twheel_run(twheel_t *w, time_t now) {
+    twheel_timer_t *t;
+    struct twheel_list *l;
+    time_t tick;
+    int rv = 0;
+
+    pthread_mutex_lock(&w->mutex);
+
+    /* If the clock went backwards or jumped way ahead, don't bother stepping
+       through every second in between. */
+    if(now < w->now || now - w->now > TWHEEL_SLOTS * TWHEEL_SLOTS)
+        rebase(w, now - 1);
+
+    while(w->now < now) {
+        tick = w->now + 1;
+
+        /* Every so often, pull everything down from the higher levels. The
+           overflow list has to go first, since some of it may well land in the
+           second level slot that's about to be cascaded. */
+        if(!(tick & TWHEEL_MASK)) {
+            if(!((tick >> TWHEEL_BITS) & TWHEEL_MASK))
+                replace_list(w, &w->overflow);
+
+            replace_list(w, &w->level1[(tick >> TWHEEL_BITS) & TWHEEL_MASK]);
+        }
+
+        /* Everything in this slot is due now. Anything that gets scheduled by
+           the callbacks will land on a later tick, so this will terminate. */
+        w->now = tick;
+        l = &w->level0[tick & TWHEEL_MASK];
+
+        while((t = TAILQ_FIRST(l))) {
+            TAILQ_REMOVE(l, t, qentry);
+            t->list = NULL;
+            --w->count;
+
+            pthread_mutex_unlock(&w->mutex);
+            rv |= t->cb(t, tick);
+            pthread_mutex_lock(&w->mutex);
+        }
+    }
+
+    pthread_mutex_unlock(&w->mutex);
+    return rv;
+}
+
+int twheel_next(twheel_t *w, time_t now) {
+    time_t tick = 0;
+    int i;
+
+    pthread_mutex_lock(&w->mutex);
+
+    if(!w->count) {
+        pthread_mutex_unlock(&w->mutex);
+        return -1;
+    }
+
+    for(i = 1; i <= TWHEEL_SLOTS; ++i) {
+        if(!TAILQ_EMPTY(&w->level0[(w->now + i) & TWHEEL_MASK])) {
+            tick = w->now + i;
+            break;
+        }
+    }
+
+    /* Nothing coming up in the first level, so wake up for the next cascade,
+       since something might come down from the higher levels then. */
+    if(!tick)
+        tick = ((w->now >> TWHEEL_BITS) + 1) << TWHEEL_BITS;
+
+    pthread_mutex_unlock(&w->mutex);
+
+    if(tick <= now)
+        return 0;
+
+    return (int)(tick - now) * 1000;
+}
@@ -0,0 +1,94 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2026 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TWHEEL_H
+#define TWHEEL_H
+
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+/* A hierarchical timer wheel with one second resolution. The first level
+   covers the next 64 seconds one slot per second, the second level covers the
+   next 64 * 64 seconds (a bit over an hour) one slot per 64 seconds, and
+   anything further out than that sits on an overflow list until it gets close
+   enough to be placed. Timers only ever get looked at when their slot comes
+   up (or cascades down a level), so idle timers cost nothing. */
+#define TWHEEL_BITS     6
+#define TWHEEL_SLOTS    (1 << TWHEEL_BITS)
+#define TWHEEL_MASK     (TWHEEL_SLOTS - 1)
+
+struct twheel_timer;
+TAILQ_HEAD(twheel_list, twheel_timer);
+
+#ifndef TWHEEL_TIMER_DEFINED
+#define TWHEEL_TIMER_DEFINED
+typedef struct twheel_timer twheel_timer_t;
+#endif
+
+/* Timer callback. Called (without the wheel's lock held) from twheel_run()
+   once the timer's deadline has passed. The timer is no longer scheduled when
+   this is called, so it is free to reschedule itself. */
+typedef int (*twheel_cb_t)(twheel_timer_t *t, time_t now);
+
+struct twheel_timer {
+    TAILQ_ENTRY(twheel_timer) qentry;
+    struct twheel_list *list;
+    time_t expires;
+    twheel_cb_t cb;
+    void *data;
+};
+
+typedef struct twheel {
+    pthread_mutex_t mutex;
+    time_t now;
+    int count;
+
+    struct twheel_list level0[TWHEEL_SLOTS];
+    struct twheel_list level1[TWHEEL_SLOTS];
+    struct twheel_list overflow;
+} twheel_t;
+
+/* Set up an empty wheel, starting at the specified time. */
+int twheel_init(twheel_t *w, time_t now);
+
+/* Clean up a wheel. Any timers still on it are simply forgotten. */
+void twheel_destroy(twheel_t *w);
+
+/* Initialize a timer so that it can be scheduled. */
+void twheel_timer_init(twheel_timer_t *t, twheel_cb_t cb, void *data);
+
+/* Schedule a timer to go off at the specified time (or at the next tick, if
+   that time has already passed). If the timer was already scheduled, it is
+   moved. This is safe to call from any thread. */
+void twheel_add(twheel_t *w, twheel_timer_t *t, time_t expires);
+
+/* Cancel a timer. It is not an error to cancel a timer that isn't scheduled.
+   This is safe to call from any thread. */
+void twheel_del(twheel_t *w, twheel_timer_t *t);
+
+/* Move the wheel forward to the specified time, calling the callback of every
+   timer that has expired along the way. Returns non-zero if any callback
+   returned non-zero. */
+int twheel_run(twheel_t *w, time_t now);
+
+/* Figure out how long until the next tick where a timer might go off, in
+   milliseconds, for use as an event loop timeout. Returns -1 if there are no
+   timers scheduled at all. */
+int twheel_next(twheel_t *w, time_t now);
+
+#endif /* !TWHEEL_H */
@@ -17,6 +17,7 @@
 */
 
 #include <stdio.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <time.h>
 #include <sys/time.h>
@@ -24,6 +25,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
@@ -32,23 +35,41 @@
 #include "utils.h"
 #include "clients.h"
 #include "player.h"
+#include "handoff.h"
 
 #ifdef HAVE_LIBMINI18N
 mini18n_t langs[CLIENT_LANG_COUNT];
 #endif
 
-/* iconv contexts that are used throughout the code */
-iconv_t ic_utf8_to_utf16;
-iconv_t ic_utf16_to_utf8;
-iconv_t ic_8859_to_utf8;
-iconv_t ic_utf8_to_8859;
-iconv_t ic_sjis_to_utf8;
-iconv_t ic_utf8_to_sjis;
-iconv_t ic_utf16_to_ascii;
-iconv_t ic_8859_to_utf16;
-iconv_t ic_sjis_to_utf16;
-iconv_t ic_utf16_to_8859;
-iconv_t ic_utf16_to_sjis;
+/* Character sets on each end of the iconv conversions used throughout the
+   code. ASCII comes through all of them unchanged, except for the backslash
+   and tilde in Shift-JIS (which are the yen sign and overline there). */
+#define IC_ENC_8BIT     0
+#define IC_ENC_UTF16    1
+#define IC_ENC_SJIS     2
+
+static const struct {
+    const char *to;
+    const char *from;
+    uint8_t to_enc;
+    uint8_t from_enc;
+} ic_info[IC_COUNT] = {
+    { "UTF-16LE", "UTF-8", IC_ENC_UTF16, IC_ENC_8BIT },
+    { "UTF-8", "UTF-16LE", IC_ENC_8BIT, IC_ENC_UTF16 },
+    { "UTF-8", "ISO-8859-1", IC_ENC_8BIT, IC_ENC_8BIT },
+    { "ISO-8859-1", "UTF-8", IC_ENC_8BIT, IC_ENC_8BIT },
+    { "UTF-8", "SHIFT_JIS", IC_ENC_8BIT, IC_ENC_SJIS },
+    { "SHIFT_JIS", "UTF-8", IC_ENC_SJIS, IC_ENC_8BIT },
+    { "ASCII", "UTF-16LE", IC_ENC_8BIT, IC_ENC_UTF16 },
+    { "UTF-16LE", "ISO-8859-1", IC_ENC_UTF16, IC_ENC_8BIT },
+    { "UTF-16LE", "SHIFT_JIS", IC_ENC_UTF16, IC_ENC_SJIS },
+    { "ISO-8859-1", "UTF-16LE", IC_ENC_8BIT, IC_ENC_UTF16 },
+    { "SHIFT_JIS", "UTF-16LE", IC_ENC_SJIS, IC_ENC_UTF16 }
+};
+
+static pthread_key_t ic_key;
+static pthread_once_t ic_once = PTHREAD_ONCE_INIT;
+static iconv_t *ic_main;
 
 void print_packet(const unsigned char *pkt, int len) {
     /* With NULL, this will simply grab the current output for the debug log.
@@ -288,13 +309,15 @@ int bb_bug_report(ship_client_t *c, bb_simple_mail_pkt *pkt) {
     return send_txt(c, "%s", __(c, "\tE\tC7Thank you for your report."));
 }
 
+int pkt_log_capture = 0;
+
 /* Begin logging the specified client's packets */
 int pkt_log_start(ship_client_t *i) {
     struct timeval rawtime;
     struct tm cooked;
     char str[128];
-    FILE *fp;
-    time_t now;
+    pktlog_t *l;
+    pktlog_session_t s;
 
     pthread_mutex_lock(&i->mutex);
 
@@ -317,26 +340,31 @@ int pkt_log_start(ship_client_t *i) {
                 (unsigned int)(rawtime.tv_usec / 1000), i->guildcard);
     }
     else {
-        sprintf(str, "logs/%u.%02u.%02u.%02u.%02u.%02u.%03u",
+        /* With captures on, lots of connections come in without a guild card
+           yet, so use the socket to keep them from colliding. */
+        sprintf(str, "logs/%u.%02u.%02u.%02u.%02u.%02u.%03u-s%d",
                 cooked.tm_year + 1900, cooked.tm_mon + 1, cooked.tm_mday,
                 cooked.tm_hour, cooked.tm_min, cooked.tm_sec,
-                (unsigned int)(rawtime.tv_usec / 1000));
+                (unsigned int)(rawtime.tv_usec / 1000), i->sock);
     }
 
-    fp = fopen(str, "wt");
-
-    if(!fp) {
+    /* Packet logs are binary, see pktlog.h for the format. */
+    if(!(l = pktlog_open(str, PKTLOG_MODE_BINARY))) {
         pthread_mutex_unlock(&i->mutex);
         return -2;
     }
 
-    /* Write a nice header to the log */
-    now = time(NULL);
-    ctime_r(&now, str);
-    str[strlen(str) - 1] = 0;
+    pktlog_note(l, "Packet log started\n");
+
+    /* Note what kind of connection this is, so it can be replayed later. */
+    s.guildcard = i->guildcard;
+    s.block = (i->flags & CLIENT_FLAG_TYPE_SHIP) ? 0 : i->cur_block->b;
+    s.version = (uint8_t)i->version;
+    s.hdr_size = (uint8_t)i->hdr_size;
+    s.flags = i->flags;
+    pktlog_session(l, &s);
 
-    fprintf(fp, "[%s] Packet log started\n", str);
-    i->logfile = fp;
+    i->logfile = l;
 
     /* We're done, so clean up */
     pthread_mutex_unlock(&i->mutex);
@@ -345,9 +373,6 @@ int pkt_log_start(ship_client_t *i) {
 
 /* Stop logging the specified client's packets */
 int pkt_log_stop(ship_client_t *i) {
-    time_t now;
-    char str[64];
-
     pthread_mutex_lock(&i->mutex);
 
     if(!i->logfile) {
@@ -355,13 +380,8 @@ int pkt_log_stop(ship_client_t *i) {
         return -1;
     }
 
-    /* Write a nice footer to the log */
-    now = time(NULL);
-    ctime_r(&now, str);
-    str[strlen(str) - 1] = 0;
-
-    fprintf(i->logfile, "[%s] Packet log ended\n", str);
-    fclose(i->logfile);
+    pktlog_note(i->logfile, "Packet log ended\n");
+    pktlog_close(i->logfile);
     i->logfile = NULL;
 
     /* We're done, so clean up */
@@ -369,13 +389,29 @@ int pkt_log_stop(ship_client_t *i) {
     return 0;
 }
 
+/* Write the lobby's info out to its team log. lobby_print_info() wants a FILE,
+   so give it one in memory and queue up whatever it writes. */
+static void team_log_info(lobby_t *l) {
+    FILE *fp;
+    char *buf = NULL;
+    size_t len = 0;
+
+    if(!(fp = open_memstream(&buf, &len)))
+        return;
+
+    lobby_print_info(l, fp);
+    fclose(fp);
+
+    pktlog_raw(l->logfp, buf, len);
+    free(buf);
+}
+
 /* Begin logging the specified team */
 int team_log_start(lobby_t *i) {
     struct timeval rawtime;
     struct tm cooked;
     char str[128];
-    FILE *fp;
-    time_t now;
+    pktlog_t *l;
 
     pthread_mutex_lock(&i->mutex);
 
@@ -395,21 +431,15 @@ int team_log_start(lobby_t *i) {
             cooked.tm_year + 1900, cooked.tm_mon + 1, cooked.tm_mday,
             cooked.tm_hour, cooked.tm_min, cooked.tm_sec,
             (unsigned int)(rawtime.tv_usec / 1000), (int)i->lobby_id);
-    fp = fopen(str, "wt");
 
-    if(!fp) {
+    if(!(l = pktlog_open(str, PKTLOG_MODE_TEXT))) {
         pthread_mutex_unlock(&i->mutex);
         return -2;
     }
 
-    /* Write a nice header to the log */
-    now = time(NULL);
-    ctime_r(&now, str);
-    str[strlen(str) - 1] = 0;
-
-    fprintf(fp, "[%s] Team log started\n", str);
-    lobby_print_info(i, i->logfp);
-    i->logfp = fp;
+    i->logfp = l;
+    pktlog_note(l, "Team log started\n");
+    team_log_info(i);
 
     /* We're done, so clean up */
     pthread_mutex_unlock(&i->mutex);
@@ -418,9 +448,6 @@ int team_log_start(lobby_t *i) {
 
 /* Stop logging the specified team's packets */
 int team_log_stop(lobby_t *i) {
-    time_t now;
-    char str[64];
-
     pthread_mutex_lock(&i->mutex);
 
     if(!i->logfp) {
@@ -428,15 +455,10 @@ int team_log_stop(lobby_t *i) {
         return -1;
     }
 
-    /* Write a nice footer to the log */
-    now = time(NULL);
-    ctime_r(&now, str);
-    str[strlen(str) - 1] = 0;
-
-    fprintf(i->logfp, "[%s] Team log ended\n", str);
-    lobby_print_info(i, i->logfp);
+    pktlog_note(i->logfp, "Team log ended\n");
+    team_log_info(i);
 
-    fclose(i->logfp);
+    pktlog_close(i->logfp);
     i->logfp = NULL;
 
     /* We're done, so clean up */
@@ -446,7 +468,6 @@ int team_log_stop(lobby_t *i) {
 
 int team_log_write(lobby_t *l, uint32_t msg_type, const char *fmt, ...) {
     va_list args;
-    int rv;
 
     /* Don't bother if we're not logging this team... */
     if(!l->logfp)
@@ -456,10 +477,10 @@ int team_log_write(lobby_t *l, uint32_t msg_type, const char *fmt, ...) {
     (void)msg_type;
 
     va_start(args, fmt);
-    rv = vfdebug(l->logfp, fmt, args);
+    pktlog_vnote(l->logfp, fmt, args);
     va_end(args);
 
-    return rv;
+    return 0;
 }
 
 char *istrncpy(iconv_t ic, char *outs, const char *ins, int out_len) {
@@ -474,7 +495,7 @@ char *istrncpy(iconv_t ic, char *outs, const char *ins, int out_len) {
     out = out_len;
     inptr = (ICONV_CONST char *)ins;
     outptr = outs;
-    iconv(ic, &inptr, &in, &outptr, &out);
+    ic_convert(ic, &inptr, &in, &outptr, &out);
 
     return outptr;
 }
@@ -498,7 +519,7 @@ char *istrncpy16(iconv_t ic, char *outs, const uint16_t *ins, int out_len) {
     out = out_len;
     inptr = (ICONV_CONST char *)ins;
     outptr = outs;
-    iconv(ic, &inptr, &in, &outptr, &out);
+    ic_convert(ic, &inptr, &in, &outptr, &out);
 
     return outptr;
 }
@@ -539,18 +560,25 @@ size_t strlen16_raw(const void *str) {
 
 char *istrncpy16_raw(iconv_t ic, char *outs, const void *ins,
                      int out_len, int max_src) {
-    size_t len = (size_t)max_src;
-
-    if(max_src <= 0) {
-        len = strlen16_raw(ins);
-    }
+    const uint8_t *src = (const uint8_t *)ins;
+    size_t len = 0, in, out;
+    ICONV_CONST char *inptr;
+    char *outptr;
 
     if(max_src > 0) {
-        uint16_t src[len + 1];
+        /* Convert straight from the source, up to the first NUL. */
+        while(len < (size_t)max_src && (src[len * 2] || src[len * 2 + 1]))
+            ++len;
+
+        memset(outs, 0, out_len);
 
-        memcpy(src, ins, sizeof(uint16_t) * len);
-        src[len] = 0;
-        return istrncpy16(ic, outs, src, out_len);
+        in = len * 2;
+        out = out_len;
+        inptr = (ICONV_CONST char *)ins;
+        outptr = outs;
+        ic_convert(ic, &inptr, &in, &outptr, &out);
+
+        return outptr;
     }
     else if(out_len > 0) {
         *outs = 0;
@@ -639,10 +667,34 @@ int my_pton(int family, const char *str, struct sockaddr_storage *addr) {
 }
 
 int open_sock(int family, uint16_t port) {
+    return open_sock_ex(family, port, 0);
+}
+
+int set_cloexec(int fd) {
+    int fl;
+
+    if((fl = fcntl(fd, F_GETFD)) == -1 ||
+       fcntl(fd, F_SETFD, fl | FD_CLOEXEC) == -1) {
+        debug(DBG_WARN, "Cannot set close-on-exec: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int open_sock_ex(int family, uint16_t port, int reuseport) {
     int sock = -1, val;
     struct sockaddr_in addr;
     struct sockaddr_in6 addr6;
 
+    /* If the last image passed this one along in a live restart, it's already
+       bound and listening. */
+    if((sock = handoff_take(family, port)) >= 0) {
+        set_cloexec(sock);
+        handoff_add(sock, family, port);
+        return sock;
+    }
+
     /* Create the socket and listen for connections. */
     sock = socket(family, SOCK_STREAM, IPPROTO_TCP);
 
@@ -651,6 +703,10 @@ int open_sock(int family, uint16_t port) {
         return -1;
     }
 
+    /* A live restart hands these over itself, rather than letting the new image
+       inherit them. */
+    set_cloexec(sock);
+
     /* Set SO_REUSEADDR so we don't run into issues when we kill the ship
        server and bring it back up quickly... */
     val = 1;
@@ -660,6 +716,21 @@ int open_sock(int family, uint16_t port) {
            anyway... */
     }
 
+#ifdef SO_REUSEPORT
+    /* Let other sockets listen on the same port, so that the kernel can share
+       the incoming connections out between them. */
+    if(reuseport) {
+        val = 1;
+        if(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(int))) {
+            perror("setsockopt SO_REUSEPORT");
+            close(sock);
+            return -1;
+        }
+    }
+#else
+    (void)reuseport;
+#endif
+
     if(family == AF_INET) {
         memset(&addr, 0, sizeof(struct sockaddr_in));
         addr.sin_family = family;
@@ -712,6 +783,7 @@ int open_sock(int family, uint16_t port) {
         return -1;
     }
 
+    handoff_add(sock, family, port);
     return sock;
 }
 
@@ -901,118 +973,142 @@ static void convert_bb_to_dcpcgc(ship_client_t *s, uint8_t *buf) {
     istrncpy16_raw(ic_utf16_to_ascii, c->name, &sp->name[2], 16, 16);
 }
 
-void make_disp_data(ship_client_t *s, ship_client_t *d, void *buf) {
-    int vs = s->version, vd = d->version;
-    uint8_t *bp = (uint8_t *)buf;
-
+/* The converted forms of a player's display data that get cached. Copying the
+   data as-is doesn't need any conversion, so there's no slot for that. */
+#define DISP_FORM_NONE  -1
+#define DISP_FORM_V1    0               /* Blue Burst -> anything else */
+#define DISP_FORM_DCPC  1               /* GC/Ep3/Xbox -> DC/PC */
+#define DISP_FORM_XBGC  2               /* GC/Ep3 <-> Xbox */
+#define DISP_FORM_BB    3               /* Anything else -> Blue Burst */
+#define DISP_FORM_COUNT 4
+
+#define DISP_DATA_SIZE  (sizeof(v1_player_t) > sizeof(sylverant_inventory_t) + \
+                         sizeof(sylverant_bb_char_t) ? sizeof(v1_player_t) :   \
+                         sizeof(sylverant_inventory_t) +                       \
+                         sizeof(sylverant_bb_char_t))
+
+static int disp_form(int vs, int vd) {
     switch(vs) {
         case CLIENT_VERSION_DCV1:
         case CLIENT_VERSION_DCV2:
         case CLIENT_VERSION_PC:
-            switch(vd) {
-                case CLIENT_VERSION_DCV1:
-                case CLIENT_VERSION_DCV2:
-                case CLIENT_VERSION_PC:
-                case CLIENT_VERSION_GC:
-                case CLIENT_VERSION_EP3:
-                case CLIENT_VERSION_XBOX:
-                    /* As long as the destination isn't a BB player, just copy
-                       the data over as-is. Technically if we ever allowed
-                       cross-play, we would need to deal with the differences in
-                       Mags on Gamecube and Xbox here, at least. */
-                    memcpy(buf, &s->pl->v1, sizeof(v1_player_t));
-                    break;
-
-                case CLIENT_VERSION_BB:
-                    /* Going to Blue Burst, so, convert. */
-                    convert_dcpcgc_to_bb(s, (uint8_t *)buf);
-                    break;
-            }
-
-            break;
+            if(vd == CLIENT_VERSION_BB)
+                return DISP_FORM_BB;
+            return DISP_FORM_NONE;
 
         case CLIENT_VERSION_GC:
         case CLIENT_VERSION_EP3:
+        case CLIENT_VERSION_XBOX:
             switch(vd) {
                 case CLIENT_VERSION_DCV1:
                 case CLIENT_VERSION_DCV2:
                 case CLIENT_VERSION_PC:
-                    /* We're going to an earlier version. Apply a few fixups for
-                       things like missing costumes and character classes. */
-                    convert_gc_to_dcpc(s, buf);
-                    break;
+                    return DISP_FORM_DCPC;
 
                 case CLIENT_VERSION_GC:
                 case CLIENT_VERSION_EP3:
-                    /* We're dealing with the "same" version, so just copy. */
-                    memcpy(buf, &s->pl->v1, sizeof(v1_player_t));
-                    break;
+                    return vs == CLIENT_VERSION_XBOX ? DISP_FORM_XBGC :
+                        DISP_FORM_NONE;
 
                 case CLIENT_VERSION_XBOX:
-                    /* Apply Mag fixups... */
-                    convert_gcxb_to_xbgc(s, buf);
-                    break;
+                    return vs == CLIENT_VERSION_XBOX ? DISP_FORM_NONE :
+                        DISP_FORM_XBGC;
 
                 case CLIENT_VERSION_BB:
-                    /* Going to Blue Burst, so, convert. */
-                    convert_dcpcgc_to_bb(s, (uint8_t *)buf);
-                    break;
+                    return DISP_FORM_BB;
             }
 
-            break;
+            return DISP_FORM_NONE;
 
-        case CLIENT_VERSION_XBOX:
-            switch(vd) {
-                case CLIENT_VERSION_DCV1:
-                case CLIENT_VERSION_DCV2:
-                case CLIENT_VERSION_PC:
-                    /* We're going to an earlier version. Apply a few fixups for
-                       things like missing costumes and character classes. */
-                    convert_xb_to_dcpc(s, buf);
-                    break;
+        case CLIENT_VERSION_BB:
+            if(vd == CLIENT_VERSION_BB)
+                return DISP_FORM_NONE;
+            return DISP_FORM_V1;
+    }
 
-                case CLIENT_VERSION_GC:
-                case CLIENT_VERSION_EP3:
-                    /* Apply Mag fixups... */
-                    convert_gcxb_to_xbgc(s, buf);
-                    break;
+    return DISP_FORM_NONE;
+}
 
-                case CLIENT_VERSION_XBOX:
-                    /* We're dealing with the "same" version, so just copy. */
-                    memcpy(buf, &s->pl->v1, sizeof(v1_player_t));
-                    break;
+static void convert_disp_data(ship_client_t *s, int form, uint8_t *buf) {
+    switch(form) {
+        case DISP_FORM_V1:
+            /* We're going from Blue Burst to an earlier version... */
+            convert_bb_to_dcpcgc(s, buf);
+            break;
 
-                case CLIENT_VERSION_BB:
-                    /* Going to Blue Burst, so, convert. */
-                    convert_dcpcgc_to_bb(s, (uint8_t *)buf);
-                    break;
-            }
+        case DISP_FORM_DCPC:
+            /* We're going to an earlier version. Apply a few fixups for
+               things like missing costumes and character classes. */
+            if(s->version == CLIENT_VERSION_XBOX)
+                convert_xb_to_dcpc(s, buf);
+            else
+                convert_gc_to_dcpc(s, buf);
+            break;
 
+        case DISP_FORM_XBGC:
+            /* Apply Mag fixups... */
+            convert_gcxb_to_xbgc(s, buf);
             break;
 
-        case CLIENT_VERSION_BB:
-            switch(vd) {
-                case CLIENT_VERSION_DCV1:
-                case CLIENT_VERSION_DCV2:
-                case CLIENT_VERSION_PC:
-                case CLIENT_VERSION_GC:
-                case CLIENT_VERSION_EP3:
-                case CLIENT_VERSION_XBOX:
-                    /* We're going from Blue Burst to an earlier version... */
-                    convert_bb_to_dcpcgc(s, bp);
-                    break;
+        case DISP_FORM_BB:
+            /* Going to Blue Burst, so, convert. */
+            convert_dcpcgc_to_bb(s, buf);
+            break;
+    }
+}
 
-                case CLIENT_VERSION_BB:
-                    /* Both clients are Blue Burst -- Copy the data over. */
-                    memcpy(bp, &s->pl->bb.inv, sizeof(sylverant_inventory_t));
-                    bp += sizeof(sylverant_inventory_t);
-                    memcpy(bp, &s->pl->bb.character,
-                           sizeof(sylverant_bb_char_t));
-                    break;
-            }
+static size_t disp_form_size(int form) {
+    if(form == DISP_FORM_BB)
+        return sizeof(sylverant_inventory_t) + sizeof(sylverant_bb_char_t);
 
-            break;
+    return sizeof(v1_player_t);
+}
+
+void make_disp_data(ship_client_t *s, ship_client_t *d, void *buf) {
+    int form = disp_form(s->version, d->version);
+    uint8_t *bp = (uint8_t *)buf, *cp;
+
+    if(form == DISP_FORM_NONE) {
+        /* As long as both ends are the "same" version, just copy the data over
+           as-is. Technically if we ever allowed cross-play, we would need to
+           deal with the differences in Mags on Gamecube and Xbox here, at
+           least. */
+        if(s->version == CLIENT_VERSION_BB) {
+            memcpy(bp, &s->pl->bb.inv, sizeof(sylverant_inventory_t));
+            bp += sizeof(sylverant_inventory_t);
+            memcpy(bp, &s->pl->bb.character, sizeof(sylverant_bb_char_t));
+        }
+        else {
+            memcpy(buf, &s->pl->v1, sizeof(v1_player_t));
+        }
+
+        return;
     }
+
+    /* Everything else gets converted once and then reused for everyone else
+       that needs the same form, until the player's data changes. */
+    if(!s->disp_cache) {
+        if(!(s->disp_cache = (uint8_t *)malloc(DISP_DATA_SIZE *
+                                               DISP_FORM_COUNT))) {
+            convert_disp_data(s, form, bp);
+            return;
+        }
+
+        s->disp_valid = 0;
+    }
+
+    cp = s->disp_cache + DISP_DATA_SIZE * form;
+
+    if(!(s->disp_valid & (1 << form))) {
+        convert_disp_data(s, form, cp);
+        s->disp_valid |= 1 << form;
+    }
+
+    memcpy(bp, cp, disp_form_size(form));
+}
+
+void clear_disp_data(ship_client_t *c) {
+    c->disp_valid = 0;
 }
 
 void update_lobby_event(void) {
@@ -1071,110 +1167,215 @@ void memcpy_str(void * restrict d, const char * restrict s, size_t sz) {
     memcpy(d, s, sz < l ? sz : l);
 }
 
-int init_iconv(void) {
-    ic_utf8_to_utf16 = iconv_open("UTF-16LE", "UTF-8");
+static void ic_dtor(void *p) {
+    iconv_t *set = (iconv_t *)p;
+    int i;
 
-    if(ic_utf8_to_utf16 == (iconv_t)-1) {
-        return -1;
+    for(i = 0; i < IC_COUNT; ++i) {
+        if(set[i] != (iconv_t)-1)
+            iconv_close(set[i]);
     }
 
-    ic_utf16_to_utf8 = iconv_open("UTF-8", "UTF-16LE");
+    free(set);
+}
 
-    if(ic_utf16_to_utf8 == (iconv_t)-1) {
-        goto out1;
-    }
+static void ic_key_init(void) {
+    if(pthread_key_create(&ic_key, &ic_dtor))
+        perror("pthread_key_create");
+}
+
+static iconv_t *ic_thread_set(void) {
+    iconv_t *set;
+    int i;
+
+    pthread_once(&ic_once, &ic_key_init);
 
-    ic_8859_to_utf8 = iconv_open("UTF-8", "ISO-8859-1");
+    if((set = (iconv_t *)pthread_getspecific(ic_key)))
+        return set;
 
-    if(ic_8859_to_utf8 == (iconv_t)-1) {
-        goto out2;
+    if(!(set = (iconv_t *)malloc(sizeof(iconv_t) * IC_COUNT))) {
+        perror("malloc");
+        return NULL;
     }
 
-    ic_utf8_to_8859 = iconv_open("ISO-8859-1", "UTF-8");
+    for(i = 0; i < IC_COUNT; ++i) {
+        set[i] = (iconv_t)-1;
+    }
 
-    if(ic_utf8_to_8859 == (iconv_t)-1) {
-        goto out3;
+    if(pthread_setspecific(ic_key, set)) {
+        perror("pthread_setspecific");
+        free(set);
+        return NULL;
     }
 
-    ic_sjis_to_utf8 = iconv_open("UTF-8", "SHIFT_JIS");
+    return set;
+}
+
+iconv_t ic_get(int which) {
+    iconv_t *set = ic_thread_set();
 
-    if(ic_sjis_to_utf8 == (iconv_t)-1) {
-        goto out4;
+    if(!set)
+        return (iconv_t)-1;
+
+    if(set[which] == (iconv_t)-1) {
+        set[which] = iconv_open(ic_info[which].to, ic_info[which].from);
+
+        if(set[which] == (iconv_t)-1)
+            debug(DBG_WARN, "Cannot open iconv context from %s to %s\n",
+                  ic_info[which].from, ic_info[which].to);
     }
 
-    ic_utf8_to_sjis = iconv_open("SHIFT_JIS", "UTF-8");
+    return set[which];
+}
 
-    if(ic_utf8_to_sjis == (iconv_t)-1) {
-        goto out5;
+/* Figure out which conversion a handle belongs to, if it is one of ours. */
+static int ic_which(iconv_t ic) {
+    iconv_t *set = (iconv_t *)pthread_getspecific(ic_key);
+    int i;
+
+    if(!set || ic == (iconv_t)-1)
+        return -1;
+
+    for(i = 0; i < IC_COUNT; ++i) {
+        if(set[i] == ic)
+            return i;
     }
 
-    ic_utf16_to_ascii = iconv_open("ASCII", "UTF-16LE");
+    return -1;
+}
+
+/* Count the plain ASCII characters at the start of a string. This looks at
+   eight bytes at a time while it can, which covers most strings. */
+static size_t ascii_span(const uint8_t *s, size_t units, int enc, int sjis) {
+    static const uint8_t mask16[8] = {
+        0x80, 0xFF, 0x80, 0xFF, 0x80, 0xFF, 0x80, 0xFF
+    };
+    uint64_t v, m;
+    size_t i = 0, step, usz = (enc == IC_ENC_UTF16) ? 2 : 1;
+    uint16_t c;
+
+    if(enc == IC_ENC_UTF16)
+        memcpy(&m, mask16, 8);
+    else
+        m = UINT64_C(0x8080808080808080);
+
+    step = 8 / usz;
+
+    for(; i + step <= units; i += step) {
+        memcpy(&v, s + i * usz, 8);
 
-    if(ic_utf16_to_ascii == (iconv_t)-1) {
-        goto out6;
+        if(v & m)
+            break;
+
+        /* For Shift-JIS, fall back to looking at each character when there
+           might be a backslash or tilde in here. This has zero bytes where
+           either of them is, along with some false positives that the loop
+           below sorts out. */
+        if(sjis && ((((v ^ UINT64_C(0x5C5C5C5C5C5C5C5C)) -
+                      UINT64_C(0x0101010101010101)) |
+                     ((v ^ UINT64_C(0x7E7E7E7E7E7E7E7E)) -
+                      UINT64_C(0x0101010101010101))) &
+                    UINT64_C(0x8080808080808080)))
+            break;
     }
 
-    ic_utf16_to_sjis = iconv_open("SHIFT_JIS", "UTF-16LE");
+    for(; i < units; ++i) {
+        if(enc == IC_ENC_UTF16)
+            c = s[i * 2] | (s[i * 2 + 1] << 8);
+        else
+            c = s[i];
 
-    if(ic_utf16_to_sjis == (iconv_t)-1) {
-        goto out7;
+        if(c >= 0x80 || (sjis && (c == '\\' || c == '~')))
+            break;
     }
 
-    ic_utf16_to_8859 = iconv_open("ISO-8859-1", "UTF-16LE");
+    return i;
+}
 
-    if(ic_utf16_to_8859 == (iconv_t)-1) {
-        goto out8;
+size_t ic_convert(iconv_t ic, ICONV_CONST char **in, size_t *inb, char **out,
+                  size_t *outb) {
+    int which = ic_which(ic), fenc, tenc;
+    size_t n, fsz, tsz, i;
+    const uint8_t *src;
+    uint8_t *dst;
+
+    if(which < 0 || !*in || !*inb)
+        return iconv(ic, in, inb, out, outb);
+
+    fenc = ic_info[which].from_enc;
+    tenc = ic_info[which].to_enc;
+    fsz = (fenc == IC_ENC_UTF16) ? 2 : 1;
+    tsz = (tenc == IC_ENC_UTF16) ? 2 : 1;
+
+    /* Copy over as much of the ASCII at the start as will fit. */
+    n = ascii_span((const uint8_t *)*in, *inb / fsz, fenc,
+                   fenc == IC_ENC_SJIS || tenc == IC_ENC_SJIS);
+
+    if(n > *outb / tsz)
+        n = *outb / tsz;
+
+    src = (const uint8_t *)*in;
+    dst = (uint8_t *)*out;
+
+    if(fsz == tsz) {
+        memcpy(dst, src, n * fsz);
+    }
+    else if(fsz == 1) {
+        for(i = 0; i < n; ++i) {
+            dst[i * 2] = src[i];
+            dst[i * 2 + 1] = 0;
+        }
+    }
+    else {
+        for(i = 0; i < n; ++i) {
+            dst[i] = src[i * 2];
+        }
     }
 
-    ic_sjis_to_utf16 = iconv_open("UTF-16LE", "SHIFT_JIS");
+    *in += n * fsz;
+    *inb -= n * fsz;
+    *out += n * tsz;
+    *outb -= n * tsz;
+
+    /* Let iconv deal with whatever's left, if anything. */
+    if(!*inb)
+        return 0;
 
-    if(ic_sjis_to_utf16 == (iconv_t)-1) {
-        goto out9;
+    if(*outb < tsz) {
+        errno = E2BIG;
+        return (size_t)-1;
     }
 
-    ic_8859_to_utf16 = iconv_open("UTF-16LE", "ISO-8859-1");
+    return iconv(ic, in, inb, out, outb);
+}
+
+int init_iconv(void) {
+    int i;
 
-    if(ic_8859_to_utf16 == (iconv_t)-1) {
-        goto out10;
+    /* Open all of the contexts for the main thread up front, so that we know
+       they all work. The other threads open theirs as they need them. */
+    if(!(ic_main = ic_thread_set()))
+        return -1;
+
+    for(i = 0; i < IC_COUNT; ++i) {
+        if(ic_get(i) == (iconv_t)-1)
+            goto err;
     }
 
     return 0;
 
-out10:
-    iconv_close(ic_sjis_to_utf16);
-out9:
-    iconv_close(ic_utf16_to_8859);
-out8:
-    iconv_close(ic_utf16_to_sjis);
-out7:
-    iconv_close(ic_utf16_to_ascii);
-out6:
-    iconv_close(ic_utf8_to_sjis);
-out5:
-    iconv_close(ic_sjis_to_utf8);
-out4:
-    iconv_close(ic_utf8_to_8859);
-out3:
-    iconv_close(ic_8859_to_utf8);
-out2:
-    iconv_close(ic_utf16_to_utf8);
-out1:
-    iconv_close(ic_utf8_to_utf16);
+err:
+    cleanup_iconv();
     return -1;
 }
 
 void cleanup_iconv(void) {
-    iconv_close(ic_8859_to_utf16);
-    iconv_close(ic_sjis_to_utf16);
-    iconv_close(ic_utf16_to_8859);
-    iconv_close(ic_utf16_to_sjis);
-    iconv_close(ic_utf16_to_ascii);
-    iconv_close(ic_utf8_to_sjis);
-    iconv_close(ic_sjis_to_utf8);
-    iconv_close(ic_utf8_to_8859);
-    iconv_close(ic_8859_to_utf8);
-    iconv_close(ic_utf16_to_utf8);
-    iconv_close(ic_utf8_to_utf16);
+    if(!ic_main)
+        return;
+
+    pthread_setspecific(ic_key, NULL);
+    ic_dtor(ic_main);
+    ic_main = NULL;
 }
 
 /* Initialize mini18n support. */
@@ -33,6 +33,10 @@ int dc_bug_report(ship_client_t *c, dc_simple_mail_pkt *pkt);
 int pc_bug_report(ship_client_t *c, pc_simple_mail_pkt *pkt);
 int bb_bug_report(ship_client_t *c, bb_simple_mail_pkt *pkt);
 
+/* If set, every new connection has a packet log started for it right away,
+   capturing the whole session. */
+extern int pkt_log_capture;
+
 int pkt_log_start(ship_client_t *i);
 int pkt_log_stop(ship_client_t *i);
 
@@ -57,9 +61,21 @@ const void *my_ntop(struct sockaddr_storage *addr, char str[INET6_ADDRSTRLEN]);
 int my_pton(int family, const char *str, struct sockaddr_storage *addr);
 int open_sock(int family, uint16_t port);
 
+/* Keep a file descriptor from leaking into the new image on a live restart. */
+int set_cloexec(int fd);
+
+/* Like open_sock(), but if reuseport is non-zero (and the system supports it)
+   more than one socket may be opened on the same port. Every one of them has
+   to be opened this way. */
+int open_sock_ex(int family, uint16_t port, int reuseport);
+
 const char *skip_lang_code(const char *input);
 
+/* Fill in the display data for the player s as the client d should see it.
+   Converted forms are cached on s, so anything that changes s->pl must call
+   clear_disp_data() afterwards. */
 void make_disp_data(ship_client_t *s, ship_client_t *d, void *buf);
+void clear_disp_data(ship_client_t *c);
 void update_lobby_event(void);
 
 /* Actually implemented in list.c, not utils.c. */
@@ -69,18 +85,40 @@ uint64_t get_ms_time(void);
 
 void memcpy_str(void * restrict d, const char * restrict s, size_t sz);
 
-/* Various iconv contexts that we'll use... */
-extern iconv_t ic_utf8_to_utf16;
-extern iconv_t ic_utf16_to_utf8;
-extern iconv_t ic_8859_to_utf8;
-extern iconv_t ic_utf8_to_8859;
-extern iconv_t ic_sjis_to_utf8;
-extern iconv_t ic_utf8_to_sjis;
-extern iconv_t ic_utf16_to_ascii;
-extern iconv_t ic_8859_to_utf16;
-extern iconv_t ic_sjis_to_utf16;
-extern iconv_t ic_utf16_to_8859;
-extern iconv_t ic_utf16_to_sjis;
+/* Various iconv contexts that we'll use... iconv handles can't be used by more
+   than one thread at a time, so each thread gets a set of its own, opened the
+   first time the thread needs one. */
+#define IC_UTF8_TO_UTF16    0
+#define IC_UTF16_TO_UTF8    1
+#define IC_8859_TO_UTF8     2
+#define IC_UTF8_TO_8859     3
+#define IC_SJIS_TO_UTF8     4
+#define IC_UTF8_TO_SJIS     5
+#define IC_UTF16_TO_ASCII   6
+#define IC_8859_TO_UTF16    7
+#define IC_SJIS_TO_UTF16    8
+#define IC_UTF16_TO_8859    9
+#define IC_UTF16_TO_SJIS    10
+#define IC_COUNT            11
+
+iconv_t ic_get(int which);
+
+#define ic_utf8_to_utf16    ic_get(IC_UTF8_TO_UTF16)
+#define ic_utf16_to_utf8    ic_get(IC_UTF16_TO_UTF8)
+#define ic_8859_to_utf8     ic_get(IC_8859_TO_UTF8)
+#define ic_utf8_to_8859     ic_get(IC_UTF8_TO_8859)
+#define ic_sjis_to_utf8     ic_get(IC_SJIS_TO_UTF8)
+#define ic_utf8_to_sjis     ic_get(IC_UTF8_TO_SJIS)
+#define ic_utf16_to_ascii   ic_get(IC_UTF16_TO_ASCII)
+#define ic_8859_to_utf16    ic_get(IC_8859_TO_UTF16)
+#define ic_sjis_to_utf16    ic_get(IC_SJIS_TO_UTF16)
+#define ic_utf16_to_8859    ic_get(IC_UTF16_TO_8859)
+#define ic_utf16_to_sjis    ic_get(IC_UTF16_TO_SJIS)
+
+/* Convert a string with iconv, the same way iconv() itself does. Any plain
+   ASCII is copied over directly, only the rest is handed off to iconv. */
+size_t ic_convert(iconv_t ic, ICONV_CONST char **in, size_t *inb, char **out,
+                  size_t *outb);
 
 int init_iconv(void);
 void cleanup_iconv(void);
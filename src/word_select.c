@@ -28,490 +28,263 @@
 #include "word_select-pc.h"
 #include "word_select-gc.h"
 
-int word_select_send_dc(ship_client_t *c, subcmd_word_select_t *pkt) {
-    lobby_t *l = c->cur_lobby;
-    int i;
-    subcmd_word_select_t pc, gc, xb;
-    subcmd_bb_word_select_t bb;
-    int pcusers = 0, gcusers = 0;
-    int pcuntrans = 0, gcuntrans = 0;
-    uint16_t dcw, pcw, gcw;
-
-    /* Fill in the translated packets */
-    pc.hdr.pkt_type = GAME_COMMAND0_TYPE;
-    pc.hdr.flags = pkt->hdr.flags;
-    pc.hdr.pkt_len = LE16(0x0024);
-    pc.type = SUBCMD_WORD_SELECT;
-    pc.size = 0x08;
-    pc.client_id = pkt->client_id;
-    pc.client_id_gc = 0;
-    pc.num_words = pkt->num_words;
-    pc.unused1 = 0;
-    pc.ws_type = pkt->ws_type;
-    pc.unused2 = 0;
-
-    gc.hdr.pkt_type = GAME_COMMAND0_TYPE;
-    gc.hdr.flags = pkt->hdr.flags;
-    gc.hdr.pkt_len = LE16(0x0024);
-    gc.type = SUBCMD_WORD_SELECT;
-    gc.size = 0x08;
-    gc.client_id = 0;
-    gc.client_id_gc = pkt->client_id;
-    gc.num_words = pkt->num_words;
-    gc.unused1 = 0;
-    gc.ws_type = pkt->ws_type;
-    gc.unused2 = 0;
-
-    xb.hdr.pkt_type = GAME_COMMAND0_TYPE;
-    xb.hdr.flags = pkt->hdr.flags;
-    xb.hdr.pkt_len = LE16(0x0024);
-    xb.type = SUBCMD_WORD_SELECT;
-    xb.size = 0x08;
-    xb.client_id = pkt->client_id;
-    xb.client_id_gc = 0;
-    xb.num_words = pkt->num_words;
-    xb.unused1 = 0;
-    xb.ws_type = pkt->ws_type;
-    xb.unused2 = 0;
-
-    bb.hdr.pkt_type = LE16(GAME_COMMAND0_TYPE);
-    bb.hdr.flags = LE32(pkt->hdr.flags);
-    bb.hdr.pkt_len = LE16(0x0028);
-    bb.type = SUBCMD_WORD_SELECT;
-    bb.size = 0x08;
-    bb.client_id = pkt->client_id;
-    bb.client_id_gc = 0;
-    bb.num_words = pkt->num_words;
-    bb.unused1 = 0;
-    bb.ws_type = pkt->ws_type;
-    bb.unused2 = 0;
-
-    /* No versions other than PSODC sport the lovely LIST ALL menu. Oh well, I
-       guess I can't go around saying "HELL HELL HELL" to everyone. */
-    if(pkt->ws_type == 6) {
-        pcuntrans = 1;
-        gcuntrans = 1;
+/* The word select IDs come in three sets: the ones PSODC uses, the ones PSOPC
+   uses, and the ones everything from PSOGC on uses. */
+#define WS_DC       0
+#define WS_PC       1
+#define WS_GC       2
+#define WS_COUNT    3
+
+/* Which version each client sees word select packets as. Some of these share
+   a set of words, but not the layout of the packet. */
+#define WS_PKT_DC   0
+#define WS_PKT_PC   1
+#define WS_PKT_GC   2
+#define WS_PKT_XB   3
+#define WS_PKT_BB   4
+#define WS_PKT_COUNT 5
+
+/* Translation from each set to the other two, indexed directly by the word ID,
+   and which column of each holds which of the other sets. */
+static const uint16_t (*const ws_maps[WS_COUNT])[2] = {
+    word_select_dc_map, word_select_pc_map, word_select_gc_map
+};
+
+static const uint16_t ws_max[WS_COUNT] = {
+    WORD_SELECT_DC_MAX, WORD_SELECT_PC_MAX, WORD_SELECT_GC_MAX
+};
+
+static const int8_t ws_column[WS_COUNT][WS_COUNT] = {
+    { -1,  0,  1 },
+    {  0, -1,  1 },
+    {  0,  1, -1 }
+};
+
+static const int ws_pkt_set[WS_PKT_COUNT] = {
+    WS_DC, WS_PC, WS_GC, WS_GC, WS_GC
+};
+
+static int ws_pkt_type(ship_client_t *c) {
+    switch(c->version) {
+        case CLIENT_VERSION_DCV1:
+        case CLIENT_VERSION_DCV2:
+            return WS_PKT_DC;
+
+        case CLIENT_VERSION_PC:
+            return WS_PKT_PC;
+
+        case CLIENT_VERSION_GC:
+        case CLIENT_VERSION_EP3:
+            return WS_PKT_GC;
+
+        case CLIENT_VERSION_XBOX:
+            return WS_PKT_XB;
+
+        case CLIENT_VERSION_BB:
+            return WS_PKT_BB;
     }
 
-    for(i = 0; i < 8; ++i) {
-        dcw = LE16(pkt->words[i]);
+    return -1;
+}
 
-        /* Make sure each word is valid */
-        if(dcw > WORD_SELECT_DC_MAX && dcw != 0xFFFF) {
-            return send_txt(c, __(c, "\tE\tC7Invalid word select."));
-        }
+/* Build the packet for one version out of the words in its set. Only GC and
+   Episode 3 put the client ID in the second field. */
+static void ws_build(subcmd_word_select_t *pkt, int src, const uint16_t words[8],
+                     int type, uint8_t client_id, void *out) {
+    subcmd_word_select_t *dc = (subcmd_word_select_t *)out;
+    subcmd_bb_word_select_t *bb = (subcmd_bb_word_select_t *)out;
+    int i;
+
+    /* Anyone using the same words as the sender gets what was sent as-is,
+       other than moving the client ID around if need be. */
+    if(type == src) {
+        memcpy(dc, pkt, sizeof(subcmd_word_select_t));
+        return;
+    }
+    else if(ws_pkt_set[type] == ws_pkt_set[src] && type != WS_PKT_BB) {
+        memcpy(dc, pkt, sizeof(subcmd_word_select_t));
 
-        /* Grab the words from the map */
-        if(dcw != 0xFFFF) {
-            pcw = word_select_dc_map[dcw][0];
-            gcw = word_select_dc_map[dcw][1];
+        if(type == WS_PKT_GC) {
+            dc->client_id = 0;
+            dc->client_id_gc = client_id;
         }
         else {
-            pcw = gcw = 0xFFFF;
+            dc->client_id = client_id;
+            dc->client_id_gc = 0;
         }
 
-        /* See if we have an untranslateable word */
-        if(pcw == 0xFFFF && dcw != 0xFFFF) {
-            pcuntrans = 1;
-        }
+        return;
+    }
 
-        if(gcw == 0xFFFF && dcw != 0xFFFF) {
-            gcuntrans = 1;
+    if(type == WS_PKT_BB) {
+        bb->hdr.pkt_type = LE16(GAME_COMMAND0_TYPE);
+        bb->hdr.flags = LE32(pkt->hdr.flags);
+        bb->hdr.pkt_len = LE16(0x0028);
+        bb->type = SUBCMD_WORD_SELECT;
+        bb->size = 0x08;
+        bb->client_id = client_id;
+        bb->client_id_gc = 0;
+        bb->num_words = pkt->num_words;
+        bb->unused1 = 0;
+        bb->ws_type = pkt->ws_type;
+        bb->unused2 = 0;
+
+        for(i = 0; i < 8; ++i) {
+            bb->words[i] = LE16(words[i]);
         }
 
-        /* Throw them into the packets */
-        pc.words[i] = LE16(pcw);
-        gc.words[i] = xb.words[i] = LE16(gcw);
-        bb.words[i] = LE16(gcw);
+        /* Amounts and such don't need translating. */
+        memcpy(&bb->words[8], &pkt->words[8], 4 * sizeof(uint16_t));
+        return;
     }
 
-    /* Deal with amounts and such... */
-    pc.words[8] = pkt->words[8];
-    pc.words[9] = pkt->words[9];
-    pc.words[10] = pkt->words[10];
-    pc.words[11] = pkt->words[11];
-    gc.words[8] = pkt->words[8];
-    gc.words[9] = pkt->words[9];
-    gc.words[10] = pkt->words[10];
-    gc.words[11] = pkt->words[11];
-    xb.words[8] = pkt->words[8];
-    xb.words[9] = pkt->words[9];
-    xb.words[10] = pkt->words[10];
-    xb.words[11] = pkt->words[11];
-    bb.words[8] = pkt->words[8];
-    bb.words[9] = pkt->words[9];
-    bb.words[10] = pkt->words[10];
-    bb.words[11] = pkt->words[11];
-
-    /* Send the packet to everyone we can */
-    for(i = 0; i < l->max_clients; ++i) {
-        if(l->clients[i] && l->clients[i] != c &&
-           !client_has_ignored(l->clients[i], c->guildcard)) {
-            switch(l->clients[i]->version) {
-                case CLIENT_VERSION_DCV1:
-                case CLIENT_VERSION_DCV2:
-                    send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)pkt);
-                    break;
-
-                case CLIENT_VERSION_PC:
-                    if(!pcuntrans) {
-                        send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&pc);
-                    }
-
-                    pcusers = 1;
-                    break;
-
-                case CLIENT_VERSION_GC:
-                case CLIENT_VERSION_EP3:
-                    if(!gcuntrans) {
-                        send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&gc);
-                    }
-
-                    gcusers = 1;
-                    break;
-
-                case CLIENT_VERSION_XBOX:
-                    if(!gcuntrans) {
-                        send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&xb);
-                    }
-
-                    gcusers = 1;
-                    break;
-
-                case CLIENT_VERSION_BB:
-                    if(!gcuntrans) {
-                        send_pkt_bb(l->clients[i], (bb_pkt_hdr_t *)&bb);
-                    }
-
-                    gcusers = 1;
-                    break;
-            }
-        }
+    dc->hdr.pkt_type = GAME_COMMAND0_TYPE;
+    dc->hdr.flags = pkt->hdr.flags;
+    dc->hdr.pkt_len = LE16(0x0024);
+    dc->type = SUBCMD_WORD_SELECT;
+    dc->size = 0x08;
+    dc->num_words = pkt->num_words;
+    dc->unused1 = 0;
+    dc->ws_type = pkt->ws_type;
+    dc->unused2 = 0;
+
+    if(type == WS_PKT_GC) {
+        dc->client_id = 0;
+        dc->client_id_gc = client_id;
+    }
+    else {
+        dc->client_id = client_id;
+        dc->client_id_gc = 0;
     }
 
-    /* See if we had anyone that we couldn't send it to */
-    if((pcusers && pcuntrans) || (gcusers && gcuntrans)) {
-        send_txt(c, __(c, "\tE\tC7Some clients did not\n"
-                          "receive your last word\nselect."));
+    for(i = 0; i < 8; ++i) {
+        dc->words[i] = LE16(words[i]);
     }
 
-    return 0;
+    memcpy(&dc->words[8], &pkt->words[8], 4 * sizeof(uint16_t));
 }
 
-int word_select_send_pc(ship_client_t *c, subcmd_word_select_t *pkt) {
+/* Send a word select from c (in the form of packet given) to everyone else in
+   the lobby. Each set of words is only translated, and each version's packet
+   only built, if someone in the lobby actually needs it. */
+static int word_select_send(ship_client_t *c, subcmd_word_select_t *pkt,
+                            int src, uint8_t client_id) {
     lobby_t *l = c->cur_lobby;
-    int i;
-    subcmd_word_select_t dc, gc, xb;
+    ship_client_t *c2;
+    uint16_t words[WS_COUNT][8];
+    int untrans[WS_COUNT] = { 0 };
+    int users[WS_COUNT] = { 0 };
+    int have_words, have_pkts = 0;
+    int types[LOBBY_MAX_CLIENTS];
+    subcmd_word_select_t pkts[WS_PKT_COUNT - 1];
     subcmd_bb_word_select_t bb;
-    int dcusers = 0, gcusers = 0;
-    int dcuntrans = 0, gcuntrans = 0;
-    uint16_t dcw, pcw, gcw;
-
-    /* Fill in the translated packets */
-    dc.hdr.pkt_type = GAME_COMMAND0_TYPE;
-    dc.hdr.flags = pkt->hdr.flags;
-    dc.hdr.pkt_len = LE16(0x0024);
-    dc.type = SUBCMD_WORD_SELECT;
-    dc.size = 0x08;
-    dc.client_id = pkt->client_id;
-    dc.client_id_gc = 0;
-    dc.num_words = pkt->num_words;
-    dc.unused1 = 0;
-    dc.ws_type = pkt->ws_type;
-    dc.unused2 = 0;
-
-    gc.hdr.pkt_type = GAME_COMMAND0_TYPE;
-    gc.hdr.flags = pkt->hdr.flags;
-    gc.hdr.pkt_len = LE16(0x0024);
-    gc.type = SUBCMD_WORD_SELECT;
-    gc.size = 0x08;
-    gc.client_id = 0;
-    gc.client_id_gc = pkt->client_id;
-    gc.num_words = pkt->num_words;
-    gc.unused1 = 0;
-    gc.ws_type = pkt->ws_type;
-    gc.unused2 = 0;
-
-    xb.hdr.pkt_type = GAME_COMMAND0_TYPE;
-    xb.hdr.flags = pkt->hdr.flags;
-    xb.hdr.pkt_len = LE16(0x0024);
-    xb.type = SUBCMD_WORD_SELECT;
-    xb.size = 0x08;
-    xb.client_id = pkt->client_id;
-    xb.client_id_gc = 0;
-    xb.num_words = pkt->num_words;
-    xb.unused1 = 0;
-    xb.ws_type = pkt->ws_type;
-    xb.unused2 = 0;
-
-    bb.hdr.pkt_type = LE16(GAME_COMMAND0_TYPE);
-    bb.hdr.flags = LE32(pkt->hdr.flags);
-    bb.hdr.pkt_len = LE16(0x0028);
-    bb.type = SUBCMD_WORD_SELECT;
-    bb.size = 0x08;
-    bb.client_id = pkt->client_id;
-    bb.client_id_gc = 0;
-    bb.num_words = pkt->num_words;
-    bb.unused1 = 0;
-    bb.ws_type = pkt->ws_type;
-    bb.unused2 = 0;
+    int set = ws_pkt_set[src];
+    int i, j, t, s, col;
+    uint16_t w;
 
+    /* Make sure each word is valid */
     for(i = 0; i < 8; ++i) {
-        pcw = LE16(pkt->words[i]);
+        w = LE16(pkt->words[i]);
+        words[set][i] = w;
 
-        /* Make sure each word is valid */
-        if(pcw > WORD_SELECT_PC_MAX && pcw != 0xFFFF) {
+        if(w > ws_max[set] && w != 0xFFFF) {
             return send_txt(c, __(c, "\tE\tC7Invalid word select."));
         }
+    }
 
-        /* Grab the words from the map */
-        if(pcw != 0xFFFF && pcw <= WORD_SELECT_PC_MAX) {
-            dcw = word_select_pc_map[pcw][0];
-            gcw = word_select_pc_map[pcw][1];
-        }
-        else {
-            dcw = gcw = 0xFFFF;
-        }
-
-        /* See if we have an untranslateable word */
-        if(dcw == 0xFFFF && pcw != 0xFFFF) {
-            dcuntrans = 1;
-        }
-
-        if(gcw == 0xFFFF && pcw != 0xFFFF) {
-            gcuntrans = 1;
-        }
-
-        /* Throw them into the packets */
-        dc.words[i] = LE16(dcw);
-        gc.words[i] = xb.words[i] = LE16(gcw);
-        bb.words[i] = LE16(gcw);
+    /* No versions other than PSODC sport the lovely LIST ALL menu. Oh well, I
+       guess I can't go around saying "HELL HELL HELL" to everyone. */
+    if(set == WS_DC && pkt->ws_type == 6) {
+        untrans[WS_PC] = untrans[WS_GC] = 1;
     }
 
-    /* Deal with amounts and such... */
-    dc.words[8] = pkt->words[8];
-    dc.words[9] = pkt->words[9];
-    dc.words[10] = pkt->words[10];
-    dc.words[11] = pkt->words[11];
-    gc.words[8] = pkt->words[8];
-    gc.words[9] = pkt->words[9];
-    gc.words[10] = pkt->words[10];
-    gc.words[11] = pkt->words[11];
-    xb.words[8] = pkt->words[8];
-    xb.words[9] = pkt->words[9];
-    xb.words[10] = pkt->words[10];
-    xb.words[11] = pkt->words[11];
-    bb.words[8] = pkt->words[8];
-    bb.words[9] = pkt->words[9];
-    bb.words[10] = pkt->words[10];
-    bb.words[11] = pkt->words[11];
+    have_words = 1 << set;
 
-    /* Send the packet to everyone we can */
+    /* Figure out who needs what, translating the words into each set the
+       first time someone does. */
     for(i = 0; i < l->max_clients; ++i) {
-        if(l->clients[i] && l->clients[i] != c &&
-           !client_has_ignored(l->clients[i], c->guildcard)) {
-            switch(l->clients[i]->version) {
-                case CLIENT_VERSION_DCV1:
-                case CLIENT_VERSION_DCV2:
-                    if(!dcuntrans) {
-                        send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&dc);
-                    }
+        types[i] = -1;
 
-                    dcusers = 1;
-                    break;
+        if(!(c2 = l->clients[i]) || c2 == c ||
+           client_has_ignored(c2, c->guildcard) ||
+           (t = ws_pkt_type(c2)) < 0) {
+            continue;
+        }
 
-                case CLIENT_VERSION_PC:
-                    send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)pkt);
-                    break;
+        s = ws_pkt_set[t];
+        users[s] = 1;
 
-                case CLIENT_VERSION_GC:
-                case CLIENT_VERSION_EP3:
-                    if(!gcuntrans) {
-                        send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&gc);
-                    }
+        if(!(have_words & (1 << s))) {
+            col = ws_column[set][s];
 
-                    gcusers = 1;
-                    break;
+            for(j = 0; j < 8; ++j) {
+                if((w = words[set][j]) != 0xFFFF) {
+                    w = ws_maps[set][w][col];
 
-                case CLIENT_VERSION_XBOX:
-                    if(!gcuntrans) {
-                        send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&xb);
+                    /* See if we have an untranslateable word */
+                    if(w == 0xFFFF) {
+                        untrans[s] = 1;
                     }
+                }
 
-                    gcusers = 1;
-                    break;
-
-                case CLIENT_VERSION_BB:
-                    if(!gcuntrans) {
-                        send_pkt_bb(l->clients[i], (bb_pkt_hdr_t *)&bb);
-                    }
-
-                    gcusers = 1;
-                    break;
+                words[s][j] = w;
             }
-        }
-    }
 
-    /* See if we had anyone that we couldn't send it to */
-    if((dcusers && dcuntrans) || (gcusers && gcuntrans)) {
-        send_txt(c, __(c, "\tE\tC7Some clients did not\n"
-                       "receive your last word\nselect."));
-    }
-
-    return 0;
-}
+            have_words |= 1 << s;
+        }
 
-int word_select_send_gc(ship_client_t *c, subcmd_word_select_t *pkt) {
-    lobby_t *l = c->cur_lobby;
-    int i;
-    subcmd_word_select_t pc, dc, xb, gc;
-    subcmd_bb_word_select_t bb;
-    int pcusers = 0, dcusers = 0;
-    int pcuntrans = 0, dcuntrans = 0;
-    uint16_t dcw, pcw, gcw;
-    uint8_t client_id;
-
-    if(c->version == CLIENT_VERSION_XBOX) {
-        client_id = pkt->client_id;
-        memcpy(&xb, pkt, sizeof(subcmd_word_select_t));
-        memcpy(&gc, pkt, sizeof(subcmd_word_select_t));
-        gc.client_id = 0;
-        gc.client_id_gc = client_id;
-    }
-    else {
-        client_id = pkt->client_id_gc;
-        memcpy(&xb, pkt, sizeof(subcmd_word_select_t));
-        memcpy(&gc, pkt, sizeof(subcmd_word_select_t));
-        xb.client_id = client_id;
-        xb.client_id_gc = 0;
+        if(!untrans[s]) {
+            types[i] = t;
+        }
     }
 
-    /* Fill in the translated packets */
-    pc.hdr.pkt_type = GAME_COMMAND0_TYPE;
-    pc.hdr.flags = pkt->hdr.flags;
-    pc.hdr.pkt_len = LE16(0x0024);
-    pc.type = SUBCMD_WORD_SELECT;
-    pc.size = 0x08;
-    pc.client_id = client_id;
-    pc.client_id_gc = 0;
-    pc.num_words = pkt->num_words;
-    pc.unused1 = 0;
-    pc.ws_type = pkt->ws_type;
-    pc.unused2 = 0;
-
-    dc.hdr.pkt_type = GAME_COMMAND0_TYPE;
-    dc.hdr.flags = pkt->hdr.flags;
-    dc.hdr.pkt_len = LE16(0x0024);
-    dc.type = SUBCMD_WORD_SELECT;
-    dc.size = 0x08;
-    dc.client_id = client_id;
-    dc.client_id_gc = 0;
-    dc.num_words = pkt->num_words;
-    dc.unused1 = 0;
-    dc.ws_type = pkt->ws_type;
-    dc.unused2 = 0;
-
-    bb.hdr.pkt_type = LE16(GAME_COMMAND0_TYPE);
-    bb.hdr.flags = LE32(pkt->hdr.flags);
-    bb.hdr.pkt_len = LE16(0x0028);
-    bb.type = SUBCMD_WORD_SELECT;
-    bb.size = 0x08;
-    bb.client_id = client_id;
-    bb.client_id_gc = 0;
-    bb.num_words = pkt->num_words;
-    bb.unused1 = 0;
-    bb.ws_type = pkt->ws_type;
-    bb.unused2 = 0;
+    /* Send the packet to everyone we can */
+    for(i = 0; i < l->max_clients; ++i) {
+        if((t = types[i]) < 0) {
+            continue;
+        }
 
-    for(i = 0; i < 8; ++i) {
-        gcw = LE16(pkt->words[i]);
+        c2 = l->clients[i];
 
-        /* Make sure each word is valid */
-        if(gcw > WORD_SELECT_GC_MAX && gcw != 0xFFFF) {
-            return send_txt(c, __(c, "\tE\tC7Invalid word select."));
+        if(!(have_pkts & (1 << t))) {
+            ws_build(pkt, src, words[ws_pkt_set[t]], t, client_id,
+                     t == WS_PKT_BB ? (void *)&bb : (void *)&pkts[t]);
+            have_pkts |= 1 << t;
         }
 
-        /* Grab the words from the map */
-        if(gcw != 0xFFFF) {
-            dcw = word_select_gc_map[gcw][0];
-            pcw = word_select_gc_map[gcw][1];
+        if(t == WS_PKT_BB) {
+            send_pkt_bb(c2, (bb_pkt_hdr_t *)&bb);
         }
         else {
-            pcw = dcw = 0xFFFF;
-        }
-
-        /* See if we have an untranslateable word */
-        if(pcw == 0xFFFF && gcw != 0xFFFF) {
-            pcuntrans = 1;
+            send_pkt_dc(c2, (dc_pkt_hdr_t *)&pkts[t]);
         }
+    }
 
-        if(dcw == 0xFFFF && gcw != 0xFFFF) {
-            dcuntrans = 1;
+    /* See if we had anyone that we couldn't send it to */
+    for(i = 0; i < WS_COUNT; ++i) {
+        if(users[i] && untrans[i]) {
+            send_txt(c, __(c, "\tE\tC7Some clients did not\n"
+                           "receive your last word\nselect."));
+            break;
         }
-
-        /* Throw them into the packets */
-        pc.words[i] = LE16(pcw);
-        dc.words[i] = LE16(dcw);
-        bb.words[i] = LE16(gcw);
     }
 
-    /* Deal with amounts and such... */
-    dc.words[8] = pkt->words[8];
-    dc.words[9] = pkt->words[9];
-    dc.words[10] = pkt->words[10];
-    dc.words[11] = pkt->words[11];
-    pc.words[8] = pkt->words[8];
-    pc.words[9] = pkt->words[9];
-    pc.words[10] = pkt->words[10];
-    pc.words[11] = pkt->words[11];
-    bb.words[8] = pkt->words[8];
-    bb.words[9] = pkt->words[9];
-    bb.words[10] = pkt->words[10];
-    bb.words[11] = pkt->words[11];
-
-    /* Send the packet to everyone we can */
-    for(i = 0; i < l->max_clients; ++i) {
-        if(l->clients[i] && l->clients[i] != c &&
-           !client_has_ignored(l->clients[i], c->guildcard)) {
-            switch(l->clients[i]->version) {
-                case CLIENT_VERSION_DCV1:
-                case CLIENT_VERSION_DCV2:
-                    if(!dcuntrans) {
-                        send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&dc);
-                    }
-
-                    dcusers = 1;
-                    break;
-
-                case CLIENT_VERSION_PC:
-                    if(!pcuntrans) {
-                        send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&pc);
-                    }
-
-                    pcusers = 1;
-                    break;
-
-                case CLIENT_VERSION_GC:
-                case CLIENT_VERSION_EP3:
-                    send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&gc);
-                    break;
+    return 0;
+}
 
-                case CLIENT_VERSION_XBOX:
-                    send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)&xb);
-                    break;
+int word_select_send_dc(ship_client_t *c, subcmd_word_select_t *pkt) {
+    return word_select_send(c, pkt, WS_PKT_DC, pkt->client_id);
+}
 
-                case CLIENT_VERSION_BB:
-                    send_pkt_bb(l->clients[i], (bb_pkt_hdr_t *)&bb);
-                    break;
-            }
-        }
-    }
+int word_select_send_pc(ship_client_t *c, subcmd_word_select_t *pkt) {
+    return word_select_send(c, pkt, WS_PKT_PC, pkt->client_id);
+}
 
-    /* See if we had anyone that we couldn't send it to */
-    if((pcusers && pcuntrans) || (dcusers && dcuntrans)) {
-        send_txt(c, __(c, "\tE\tC7Some clients did not\n"
-                       "receive your last word\nselect."));
-    }
+/* Blue Burst's packets are turned into GC ones before they get here. */
+int word_select_send_gc(ship_client_t *c, subcmd_word_select_t *pkt) {
+    /* Xbox puts the client ID where PSODC and PSOPC do, not where GC does. */
+    if(c->version == CLIENT_VERSION_XBOX)
+        return word_select_send(c, pkt, WS_PKT_XB, pkt->client_id);
 
-    return 0;
+    return word_select_send(c, pkt, WS_PKT_GC, pkt->client_id_gc);
 }